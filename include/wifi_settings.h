@@ -16,6 +16,7 @@ extern "C" {
 #include "wifi_settings/wifi_settings_connect.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_hostname.h"
+#include "wifi_settings/wifi_settings_profile.h"
 #ifdef ENABLE_REMOTE_UPDATE
 #include "wifi_settings/wifi_settings_remote.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
@@ -51,6 +51,78 @@
 #define WIFI_SETTINGS_FILE_SIZE         (1 * FLASH_SECTOR_SIZE)   // (0x1000 bytes)
 #endif
 
+// Minimal build profile (cmake -DWIFI_SETTINGS_MINIMAL=1). This changes the defaults
+// for the options below to save RAM, for applications with a tight RAM budget:
+// no link quality history, no key index, up to 16 SSIDs, and, if the remote
+// service is enabled, one session, no tickets, no user handlers and no UDP responder.
+// Each option can still be set individually. See "Build profiles" in doc/INTEGRATION.md.
+#ifndef WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_MINIMAL           0
+#endif
+
+// Interrupts are disabled while the wifi-settings file is updated in Flash:
+// separately for each sector erase, and while programming pages. Several pages
+// are programmed each time interrupts are disabled, as long as the time taken is
+// expected to stay within this limit (microseconds). The limit is never less than
+// the time for erasing one sector, or programming one page, as these can't be divided.
+// 0 = program one page each time. The longest times are reported by pico info.
+#ifndef WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US
+#define WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US 0
+#endif
+
+// A/B storage of the wifi-settings file. If this is 1, a second slot of
+// WIFI_SETTINGS_FILE_SIZE bytes is used at WIFI_SETTINGS_AB_STORAGE_ADDRESS, and
+// each update is written to the slot which is not in use, followed by a footer
+// in the final page of the slot. A power failure during an update will
+// not lose the previous file, and each slot is only erased by every other update.
+// The maximum size of the file is reduced by one Flash page. The setup app
+// does not support this option.
+#ifndef WIFI_SETTINGS_AB_STORAGE
+#define WIFI_SETTINGS_AB_STORAGE        0
+#endif
+
+// With A/B storage, the start location of the second slot. By default, this
+// is immediately before the wifi-settings file. It is not reusable by
+// OTA firmware updates.
+#ifndef WIFI_SETTINGS_AB_STORAGE_ADDRESS
+#define WIFI_SETTINGS_AB_STORAGE_ADDRESS   (WIFI_SETTINGS_FILE_ADDRESS - WIFI_SETTINGS_FILE_SIZE)
+#endif
+
+// Persistent event log. If this is 1, connection events (scans, joins, authentication
+// failures, disconnections and boots) are recorded with timestamps in a ring of
+// Flash sectors at WIFI_SETTINGS_EVENT_LOG_ADDRESS, so that they survive a reboot.
+// Events are buffered in RAM and written one Flash page at a time, either when the
+// page is full, or WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS after the first event in
+// the page. A sector is only erased when the log moves into it, which
+// erases the oldest events. The log is read by "remote_picotool events".
+#ifndef WIFI_SETTINGS_EVENT_LOG
+#define WIFI_SETTINGS_EVENT_LOG         0
+#endif
+
+// Size of the event log in bytes: at least two Flash sectors, so that the
+// most recent events are kept when a sector is erased.
+#ifndef WIFI_SETTINGS_EVENT_LOG_SIZE
+#define WIFI_SETTINGS_EVENT_LOG_SIZE    (2 * FLASH_SECTOR_SIZE)   // (0x2000 bytes)
+#endif
+
+// Start location of the event log. By default, this is immediately before the
+// wifi-settings file (and the A/B storage slot, if used). It is not reusable by
+// OTA firmware updates.
+#ifndef WIFI_SETTINGS_EVENT_LOG_ADDRESS
+#if WIFI_SETTINGS_AB_STORAGE
+#define WIFI_SETTINGS_EVENT_LOG_ADDRESS (WIFI_SETTINGS_AB_STORAGE_ADDRESS - WIFI_SETTINGS_EVENT_LOG_SIZE)
+#else
+#define WIFI_SETTINGS_EVENT_LOG_ADDRESS (WIFI_SETTINGS_FILE_ADDRESS - WIFI_SETTINGS_EVENT_LOG_SIZE)
+#endif
+#endif
+
+// Maximum time that an event is kept in RAM before the page is written to
+// Flash (milliseconds). Each write uses a whole page, so a shorter time wears
+// the Flash more quickly.
+#ifndef WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS
+#define WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS   60000
+#endif
+
 // Minimum time between initialisation and the first scan (milliseconds).
 #ifndef INITIAL_SETUP_TIME_MS
 #define INITIAL_SETUP_TIME_MS           1000
@@ -71,20 +143,441 @@
 #define REPEAT_SCAN_TIME_MS             3000
 #endif
 
+// Maximum time between scans (milliseconds). Each time a scan fails to lead
+// to a connection, the time before the next scan is doubled, starting from
+// REPEAT_SCAN_TIME_MS, up to this limit. This saves power and radio time
+// when no known hotspot is present. The time returns to REPEAT_SCAN_TIME_MS
+// after a successful connection, or when wifi_settings_connect is called.
+// Set this to REPEAT_SCAN_TIME_MS to disable the backoff.
+#ifndef MAX_REPEAT_SCAN_TIME_MS
+#define MAX_REPEAT_SCAN_TIME_MS         60000
+#endif
+
+// If this is 1, wifi_settings begins connecting as soon as the scan finds the
+// hotspot that would be preferred to all of the others (the one with the
+// highest priority, and the lowest number among those), without waiting for
+// the scan to visit the remaining channels. This makes the connection
+// faster, but if the hotspot has several access points, the one with the
+// strongest signal may not be used. Early termination does not apply if
+// "select=rssi" is set in the WiFi settings file, because in that case, the
+// preferred hotspot is not known until the scan is complete.
+#ifndef EARLY_SCAN_TERMINATION
+#define EARLY_SCAN_TERMINATION          0
+#endif
+
+// Maximum time allowed for a fast reconnection (milliseconds). After a
+// connection is lost, wifi_settings first tries to rejoin the most recently
+// used hotspot directly, using the BSSID and channel that worked before,
+// without scanning. If this doesn't succeed within the timeout, a scan is
+// started as usual. Set this to 0 to disable fast reconnection.
+#ifndef FAST_RECONNECT_TIMEOUT_TIME_MS
+#define FAST_RECONNECT_TIMEOUT_TIME_MS  10000
+#endif
+
+// The details of the most recently used hotspot can be kept in the
+// watchdog scratch registers, so that fast reconnection is also possible
+// after a soft reset (e.g. watchdog reboot). Three registers are needed,
+// starting at this index. The Pico SDK uses scratch registers 4 to 7, so
+// this can be 0 or 1. This is disabled by default, because your application
+// may use the scratch registers for something else.
+// #define WIFI_SETTINGS_FAST_RECONNECT_SCRATCH 0
+
+// Roaming: while connected, wifi_settings can check the signal strength
+// every ROAMING_CHECK_TIME_MS. If the signal stays below ROAMING_RSSI_THRESHOLD
+// (dBm) for ROAMING_LOW_RSSI_COUNT checks in a row, a scan runs in the
+// background, and wifi_settings moves to an access point with a signal that is
+// at least ROAMING_RSSI_MARGIN (dB) stronger, if one is found for the current
+// hotspot or one with the same or a higher priority. Roaming is disabled by
+// default, because the connection is briefly interrupted by each move.
+// #define ROAMING_RSSI_THRESHOLD          -75
+#ifndef ROAMING_CHECK_TIME_MS
+#define ROAMING_CHECK_TIME_MS           10000
+#endif
+#ifndef ROAMING_LOW_RSSI_COUNT
+#define ROAMING_LOW_RSSI_COUNT          3
+#endif
+#ifndef ROAMING_RSSI_MARGIN
+#define ROAMING_RSSI_MARGIN             10
+#endif
+
 // Minimum time between calls to the periodic function,
 // wifi_settings_periodic_callback,
 // which will initiate scans and connections if necessary (milliseconds).
+// Most state changes are handled sooner than this, because the state machine
+// also runs when lwIP reports a change in the link status or IP address
+// (if LWIP_NETIF_EXT_STATUS_CALLBACK is enabled in lwipopts.h).
 #ifndef PERIODIC_TIME_MS
 #define PERIODIC_TIME_MS                1000
 #endif
 
+// Time between calls to the periodic function while a scan is running
+// (milliseconds). The end of a scan is not reported by a callback, so this
+// determines how quickly a connection attempt begins after a scan.
+#ifndef SCAN_POLL_TIME_MS
+#define SCAN_POLL_TIME_MS               100
+#endif
+
+// Number of entries in the link quality history, which records the signal
+// strength every LINK_QUALITY_SAMPLE_TIME_MS (milliseconds) while connected,
+// and every change in the connection state. Each entry uses 12 bytes of RAM.
+// When the history is full, the oldest entry is replaced. Set this to 0 to
+// disable the history.
+#ifndef LINK_QUALITY_HISTORY_SIZE
+#if WIFI_SETTINGS_MINIMAL
+#define LINK_QUALITY_HISTORY_SIZE       0
+#else
+#define LINK_QUALITY_HISTORY_SIZE       32
+#endif
+#endif
+#ifndef LINK_QUALITY_SAMPLE_TIME_MS
+#define LINK_QUALITY_SAMPLE_TIME_MS     10000
+#endif
+
+// Number of access points kept from the most recent scan, which the application
+// can get from wifi_settings_get_scan_results() instead of scanning again.
+// Each entry uses 46 bytes of RAM. If more access points are found, those with
+// the weakest signals are not kept. Set this to 0 to disable this.
+#ifndef SCAN_RESULTS_SIZE
+#if WIFI_SETTINGS_MINIMAL
+#define SCAN_RESULTS_SIZE               0
+#else
+#define SCAN_RESULTS_SIZE               16
+#endif
+#endif
+
+// While a remote service session is connected (e.g. during an OTA update),
+// wifi_settings can use WIFI_SETTINGS_POWER_PROFILE_LOW_LATENCY regardless
+// of the profile set by wifi_settings_set_power_profile(), so that requests
+// are not delayed by the cyw43 power saving mode. Set this to 0 to always
+// use the application's profile.
+#ifndef REMOTE_LOW_LATENCY
+#define REMOTE_LOW_LATENCY              1
+#endif
+
+// Maximum number of remote service sessions (TCP connections) at the same time.
+// Sessions are allocated from a static pool, with each session using about
+// 1kb of RAM, so that many connections (e.g. a port scan) can't fragment the heap.
+// When the pool is full, new connections are rejected. Set this to 0 to allocate
+// sessions from the heap instead, with no limit.
+#ifndef WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE 1
+#else
+#define WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE 2
+#endif
+#endif
+
+// Maximum number of remote service sessions which have not yet completed the
+// authentication handshake. Further connections are rejected until one of these
+// handshakes finishes, so that unauthenticated connections can't use all of the sessions
+// (or heap) while an authenticated session is in progress.
+#ifndef WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES
+#define WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES 2
+#endif
+
+// Time allowed for the remote service authentication handshake (milliseconds).
+// If the handshake doesn't finish within this time, the connection is aborted and
+// counts as a failed handshake. Set this to 0 to allow any amount of time.
+#ifndef WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS
+#define WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS 5000
+#endif
+
+// Time allowed between messages in an authenticated remote service session (milliseconds).
+// If nothing is received from the client, and none of the data sent is acknowledged,
+// for this long, the connection is aborted and the session is freed, so that clients which
+// go silent, and connections left half-open (e.g. after roaming), don't hold a session.
+// Time spent running a handler, and telemetry subscriptions, don't count.
+// Set this to 0 to allow any amount of time.
+#ifndef WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS
+#define WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS 60000
+#endif
+
+// Number of source addresses for which failed handshakes are remembered by the
+// remote service. After a failed handshake (wrong authentication, bad message or
+// timeout), new connections from the same address are rejected for
+// WIFI_SETTINGS_REMOTE_BACKOFF_MS, doubling after each further failure up to
+// WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS, until a handshake from that address succeeds.
+// Each address uses about 28 bytes of RAM. Set this to 0 to disable the backoff.
+#ifndef WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES
+#define WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES 4
+#endif
+
+// Time for which connections are rejected after the first failed handshake (milliseconds).
+#ifndef WIFI_SETTINGS_REMOTE_BACKOFF_MS
+#define WIFI_SETTINGS_REMOTE_BACKOFF_MS 1000
+#endif
+
+// Longest time for which connections are rejected after failed handshakes (milliseconds).
+#ifndef WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS
+#define WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS (60 * 1000)
+#endif
+
+// Number of user handlers for the remote service, from ID_FIRST_USER_HANDLER
+// upwards (see wifi_settings_remote_set_handler), up to 16. Each handler uses 48 bytes of RAM
+// for its callbacks and statistics. This can be reduced to the number that the
+// application actually uses, or 0 if it only uses the built-in handlers.
+#ifndef WIFI_SETTINGS_REMOTE_USER_HANDLERS
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_REMOTE_USER_HANDLERS 0
+#else
+#define WIFI_SETTINGS_REMOTE_USER_HANDLERS 16
+#endif
+#endif
+
+// The remote service answers UDP broadcasts from remote_picotool, so that boards
+// can be found by name or board ID, and listed with 'remote_picotool list'. Set this to
+// 0 to remove the responder: remote_picotool must then be given the IP address.
+#ifndef WIFI_SETTINGS_REMOTE_RESPONDER
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_REMOTE_RESPONDER  0
+#else
+#define WIFI_SETTINGS_REMOTE_RESPONDER  1
+#endif
+#endif
+
+// With cmake -DWIFI_SETTINGS_REMOTE_RESPONDER_DETAILS=1, the responder's reply also
+// includes the hostname and the pico-wifi-settings and application versions, which
+// 'remote_picotool list' shows. The reply is not authenticated and is sent to anyone
+// on the network who asks, so by default it contains only the board ID.
+#ifndef WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS
+#define WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS  0
+#endif
+
+// Single-datagram requests (cmake -DWIFI_SETTINGS_REMOTE_UDP_RPC=1): the responder also
+// accepts an authenticated and encrypted request in one UDP datagram, and replies with
+// one datagram, so that small queries ("remote_picotool --udp ...") don't need a TCP
+// connection and handshake. Only handlers allowed by wifi_settings_remote_allow_udp_rpc
+// can be called in this way: by default, ID_PING_HANDLER, ID_PICO_INFO_HANDLER,
+// ID_STATS_HANDLER, ID_LINK_QUALITY_HANDLER and ID_TELEMETRY_HANDLER.
+// WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE is the largest datagram (the request and reply
+// data are 44 bytes smaller), and WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE is the number
+// of recent requests that are remembered, so that replayed requests are rejected.
+#ifndef WIFI_SETTINGS_REMOTE_UDP_RPC
+#define WIFI_SETTINGS_REMOTE_UDP_RPC    0
+#endif
+#ifndef WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE
+#define WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE       1024
+#endif
+#ifndef WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE
+#define WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE   16
+#endif
+
+// Number of 4kb data buffers for remote service requests. A session only uses
+// a data buffer while an authenticated request is being handled, so
+// sessions which are idle or not authenticated share the buffers. If no
+// buffer is available, the request is rejected with ID_BUSY_ERROR. By default
+// there is one per session, so every session can make requests at the same time;
+// a smaller pool saves 4kb per buffer. Set this to 0 to allocate data buffers
+// from the heap instead.
+#ifndef WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE
+#define WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE
+#endif
+
+// Accept compressed data for ID_WRITE_FLASH_HANDLER (used by remote_picotool 'load'
+// and 'ota'). Data is decompressed within the data buffer, so no extra RAM is needed.
+// This only applies if remote memory access is enabled (cmake -DWIFI_SETTINGS_REMOTE=2).
+// Set this to 0 to disable it.
+#ifndef WIFI_SETTINGS_REMOTE_COMPRESSION
+#define WIFI_SETTINGS_REMOTE_COMPRESSION 1
+#endif
+
+// Largest reply that a handler can send directly from memory, without copying it
+// to the data buffer (see wifi_settings_remote_set_reply_source). This is used by
+// ID_READ_HANDLER (remote_picotool 'save') for Flash. The reply is hashed before it
+// is sent, so larger values mean that the lwIP context is busy for longer.
+#ifndef WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE
+#define WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE (16 * 1024)
+#endif
+
+// Copy Flash data for ID_READ_RANGES_HANDLER using the XIP streaming interface and DMA,
+// rather than reading each word with the CPU. This only applies if remote memory access
+// is enabled (cmake -DWIFI_SETTINGS_REMOTE=2). Set this to 0 if the application uses
+// the XIP streaming FIFO itself.
+#ifndef WIFI_SETTINGS_REMOTE_READ_DMA
+#define WIFI_SETTINGS_REMOTE_READ_DMA 1
+#endif
+
+// Use the SHA-256 hardware on RP2350 (via pico_sha256) for the remote service,
+// including authentication and checking OTA firmware images. This is enabled
+// if the pico_sha256 library is linked, which is automatic for Pico 2.
+// Set this to 0 to use the mbedtls implementation instead.
+#ifndef WIFI_SETTINGS_SHA256_HARDWARE
+#if LIB_PICO_SHA256
+#define WIFI_SETTINGS_SHA256_HARDWARE 1
+#else
+#define WIFI_SETTINGS_SHA256_HARDWARE 0
+#endif
+#endif
+
+// Number of session resumption tickets kept by the remote service. After a full
+// authentication handshake, remote_picotool may ask for a ticket, and present it
+// when it next connects, so that the challenge-response handshake is skipped.
+// Each ticket can be used once, and uses about 40 bytes of RAM.
+// Set this to 0 to disable session resumption.
+#ifndef WIFI_SETTINGS_REMOTE_TICKET_COUNT
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_REMOTE_TICKET_COUNT 0
+#else
+#define WIFI_SETTINGS_REMOTE_TICKET_COUNT 4
+#endif
+#endif
+
+// Time for which a session resumption ticket can be used (milliseconds).
+#ifndef WIFI_SETTINGS_REMOTE_TICKET_LIFETIME_MS
+#define WIFI_SETTINGS_REMOTE_TICKET_LIFETIME_MS (5 * 60 * 1000)
+#endif
+
+// Time between reads of the signal strength (RSSI) from the cyw43 hardware (milliseconds).
+// The RSSI is read by the periodic function at this rate, and wifi_settings_get_status()
+// and wifi_settings_get_hw_status_text() report the most recent value, so that these
+// functions do not need to wait for the gSPI bus. The link status and scan status
+// are always current, as these are known without communicating with the cyw43.
+// Set this to 0 to read the RSSI on every call.
+#ifndef HW_STATUS_CACHE_TIME_MS
+#define HW_STATUS_CACHE_TIME_MS         1000
+#endif
+
 // Maximum number of SSIDs that can be supported. This determines the size
-// of the g_wifi_state.ssid_scan_info array. You can set this maximum
-// to larger values if you wish, at the cost of some additional memory
-// usage (1 byte per SSID), but the setup app assumes this maximum.
+// of the g_wifi_state.ssid_match array. Only the hotspots actually defined
+// in the file are scanned and checked, so the time taken does not depend on this.
+// You can set this maximum to larger values if you wish, at the cost of some
+// additional memory usage (20 bytes per SSID), but the setup app assumes
+// this maximum.
 #ifndef MAX_NUM_SSIDS
+#if WIFI_SETTINGS_MINIMAL
+#define MAX_NUM_SSIDS                   16
+#else
 #define MAX_NUM_SSIDS                   100
 #endif
+#endif
+
+// Number of entries in the in-RAM index of keys in the wifi-settings file.
+// The index is built by wifi_settings_init and allows
+// wifi_settings_get_value_for_key to find a key without scanning the whole
+// file. Each entry uses 8 bytes of RAM. Up to 3/4 of the entries can be
+// filled; if the file contains more keys than this, lookups fall back to
+// scanning the file. This must be a power of 2, or 0 to disable the index.
+#ifndef WIFI_SETTINGS_KEY_INDEX_SIZE
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_KEY_INDEX_SIZE    0
+#else
+#define WIFI_SETTINGS_KEY_INDEX_SIZE    64
+#endif
+#endif
+
+// How wifi_settings_get_value_for_key reads the wifi-settings file.
+// 0: through the XIP cache. Searching the file may evict program code from the cache.
+// 1: through the uncached XIP alias, so that the cache is not disturbed, but each
+//    search is slower. (On RP2350 the file is always read this way.)
+// 2: from a copy in RAM, which is made using the uncached XIP alias whenever the file
+//    changes. This is the fastest, but uses WIFI_SETTINGS_FILE_SIZE bytes of RAM.
+#ifndef WIFI_SETTINGS_FILE_READ_MODE
+#define WIFI_SETTINGS_FILE_READ_MODE    0
+#endif
+
+// Size of the RAM buffer for changes made by wifi_settings_stage_value_for_key and
+// wifi_settings_stage_delete_key (bytes). Staged changes are found immediately by
+// wifi_settings_get_value_for_key, and are written to Flash together, after
+// WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS without any further change, or when
+// wifi_settings_flush_staged_updates is called. Each change uses the size of the
+// key and value plus 2 bytes. If this is 0, changes are written to Flash immediately.
+#ifndef WIFI_SETTINGS_STAGED_UPDATE_SIZE
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_STAGED_UPDATE_SIZE    0
+#else
+#define WIFI_SETTINGS_STAGED_UPDATE_SIZE    256
+#endif
+#endif
+
+// Time without any further change before staged changes are written to Flash (milliseconds).
+// This is checked by the periodic function, so changes may be written up to
+// PERIODIC_TIME_MS later.
+#ifndef WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS
+#define WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS    2000
+#endif
+
+// FreeRTOS integration: with pico_cyw43_arch_lwip_sys_freertos, the remote
+// service handlers (e.g. Flash writes, OTA image hashing) run in a task owned
+// by wifi_settings, rather than holding the lwIP lock in the async_context,
+// so that networking for other tasks continues during a remote update.
+// The task has this priority, stack size (in words) and core affinity
+// (a bit mask of cores, or -1 for any core). Set WIFI_SETTINGS_TASK to 0 to
+// run the handlers in the async_context, as without FreeRTOS.
+#ifndef WIFI_SETTINGS_TASK
+#if PICO_CYW43_ARCH_FREERTOS
+#define WIFI_SETTINGS_TASK              1
+#else
+#define WIFI_SETTINGS_TASK              0
+#endif
+#endif
+#ifndef WIFI_SETTINGS_TASK_PRIORITY
+#define WIFI_SETTINGS_TASK_PRIORITY     1
+#endif
+#ifndef WIFI_SETTINGS_TASK_STACK_SIZE
+#define WIFI_SETTINGS_TASK_STACK_SIZE   2048
+#endif
+#ifndef WIFI_SETTINGS_TASK_CORE_AFFINITY
+#define WIFI_SETTINGS_TASK_CORE_AFFINITY -1
+#endif
+
+// Without the wifi_settings task, the remote service handlers run in an async_context
+// worker, after the lwIP receive callback has returned, rather than within the callback.
+// The session waits in a "handler pending" state until the handler has run.
+// Set WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS to 0 to run them within the callback.
+#ifndef WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS
+#define WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS 1
+#endif
+
+// mDNS and DNS-SD (cmake -DWIFI_SETTINGS_MDNS=1): announce "<hostname>.local" and,
+// if the remote service is enabled, a _pico-wifi-settings._tcp service with the board ID
+// and versions. This requires LWIP_MDNS_RESPONDER=1 and LWIP_IGMP=1 in lwipopts.h.
+#ifndef WIFI_SETTINGS_MDNS
+#define WIFI_SETTINGS_MDNS              0
+#endif
+
+// Multicast OTA updates (cmake -DWIFI_SETTINGS_REMOTE=2 -DWIFI_SETTINGS_REMOTE_MULTICAST_OTA=1):
+// ID_MULTICAST_OTA_HANDLER can receive a firmware image from a multicast group, so that
+// "remote_picotool --fleet ... ota --multicast" sends the image to all boards at once.
+// This requires LWIP_IGMP=1 in lwipopts.h. WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE is
+// the largest image that can be received, which sets the size of the bitmaps that record
+// what was received (one bit per 1kb).
+#ifndef WIFI_SETTINGS_REMOTE_MULTICAST_OTA
+#define WIFI_SETTINGS_REMOTE_MULTICAST_OTA  0
+#endif
+#ifndef WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE
+#define WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE (4 * 1024 * 1024)
+#endif
+
+// Telemetry subscriptions for the remote service: after a request to ID_TELEMETRY_HANDLER
+// with a non-zero interval, the board sends a telemetry frame (link status, RSSI,
+// heap usage and profiling counters) at that interval, until the client disconnects
+// ("remote_picotool telemetry"). The session is held for as long as the client is
+// subscribed. Set this to 0 to remove the telemetry handler.
+#ifndef WIFI_SETTINGS_REMOTE_TELEMETRY
+#if WIFI_SETTINGS_MINIMAL
+#define WIFI_SETTINGS_REMOTE_TELEMETRY  0
+#else
+#define WIFI_SETTINGS_REMOTE_TELEMETRY  1
+#endif
+#endif
+
+// Lazy start for the remote service (cmake -DWIFI_SETTINGS_REMOTE_LAZY_INIT=1): if this is 1,
+// wifi_settings_remote_init() only installs the handlers, and the update secret is hashed
+// and the TCP and UDP ports are opened when the connection first reaches CONNECTED_IP,
+// so that these are not done during wifi_settings_init(). The precomputed HMAC states
+// are then set up when the first client authenticates.
+#ifndef WIFI_SETTINGS_REMOTE_LAZY_INIT
+#define WIFI_SETTINGS_REMOTE_LAZY_INIT  0
+#endif
+
+// Hot path profiling (cmake -DWIFI_SETTINGS_PROFILE=1): count the CPU cycles taken by
+// searches of the wifi-settings file, scan callbacks, remote service HMACs and handlers,
+// and Flash erase and program operations. The counters are read with
+// wifi_settings_profile_get() and reported by ID_PICO_INFO_HANDLER. If this is 0,
+// no profiling code is compiled.
+#ifndef WIFI_SETTINGS_PROFILE
+#define WIFI_SETTINGS_PROFILE           0
+#endif
 
 // Validation for wifi-settings file address and size
 #ifdef static_assert
@@ -93,6 +586,70 @@ static_assert(WIFI_SETTINGS_FILE_ADDRESS > 0);
 static_assert(WIFI_SETTINGS_FILE_SIZE > 0);
 static_assert((WIFI_SETTINGS_FILE_SIZE % FLASH_SECTOR_SIZE) == 0);
 static_assert((WIFI_SETTINGS_FILE_ADDRESS % WIFI_SETTINGS_FILE_SIZE) == 0);
+static_assert((WIFI_SETTINGS_KEY_INDEX_SIZE & (WIFI_SETTINGS_KEY_INDEX_SIZE - 1)) == 0);
+static_assert((WIFI_SETTINGS_KEY_INDEX_SIZE == 0) || (WIFI_SETTINGS_FILE_SIZE <= 0x10000));
+static_assert((WIFI_SETTINGS_FILE_READ_MODE >= 0) && (WIFI_SETTINGS_FILE_READ_MODE <= 2));
+static_assert(WIFI_SETTINGS_STAGED_UPDATE_SIZE <= 0x10000);
+static_assert((WIFI_SETTINGS_AB_STORAGE >= 0) && (WIFI_SETTINGS_AB_STORAGE <= 1));
+#if WIFI_SETTINGS_AB_STORAGE
+static_assert((WIFI_SETTINGS_AB_STORAGE_ADDRESS + WIFI_SETTINGS_FILE_SIZE) <= PICO_FLASH_SIZE_BYTES);
+static_assert((WIFI_SETTINGS_AB_STORAGE_ADDRESS % WIFI_SETTINGS_FILE_SIZE) == 0);
+static_assert(((WIFI_SETTINGS_AB_STORAGE_ADDRESS + WIFI_SETTINGS_FILE_SIZE) <= WIFI_SETTINGS_FILE_ADDRESS)
+    || (WIFI_SETTINGS_AB_STORAGE_ADDRESS >= (WIFI_SETTINGS_FILE_ADDRESS + WIFI_SETTINGS_FILE_SIZE)));
+#endif
+static_assert((WIFI_SETTINGS_EVENT_LOG >= 0) && (WIFI_SETTINGS_EVENT_LOG <= 1));
+#if WIFI_SETTINGS_EVENT_LOG
+static_assert((WIFI_SETTINGS_EVENT_LOG_ADDRESS + WIFI_SETTINGS_EVENT_LOG_SIZE) <= PICO_FLASH_SIZE_BYTES);
+static_assert((WIFI_SETTINGS_EVENT_LOG_ADDRESS % FLASH_SECTOR_SIZE) == 0);
+static_assert((WIFI_SETTINGS_EVENT_LOG_SIZE % FLASH_SECTOR_SIZE) == 0);
+static_assert(WIFI_SETTINGS_EVENT_LOG_SIZE >= (2 * FLASH_SECTOR_SIZE));
+static_assert(((WIFI_SETTINGS_EVENT_LOG_ADDRESS + WIFI_SETTINGS_EVENT_LOG_SIZE) <= WIFI_SETTINGS_FILE_ADDRESS)
+    || (WIFI_SETTINGS_EVENT_LOG_ADDRESS >= (WIFI_SETTINGS_FILE_ADDRESS + WIFI_SETTINGS_FILE_SIZE)));
+#if WIFI_SETTINGS_AB_STORAGE
+static_assert(((WIFI_SETTINGS_EVENT_LOG_ADDRESS + WIFI_SETTINGS_EVENT_LOG_SIZE) <= WIFI_SETTINGS_AB_STORAGE_ADDRESS)
+    || (WIFI_SETTINGS_EVENT_LOG_ADDRESS >= (WIFI_SETTINGS_AB_STORAGE_ADDRESS + WIFI_SETTINGS_FILE_SIZE)));
+#endif
+static_assert((WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS > 0) && (WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS < 0x80000000));
+#endif
+static_assert(MAX_REPEAT_SCAN_TIME_MS >= REPEAT_SCAN_TIME_MS);
+static_assert(WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE >= 0);
+static_assert(WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE >= 0);
+// More data buffers than sessions would never be used
+static_assert((WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE == 0)
+    || (WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE <= WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE));
+static_assert(WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES >= 1);
+static_assert((WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS >= 0) && (WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS < 0x80000000));
+static_assert((WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS >= 0) && (WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS < 0x80000000));
+static_assert(WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES >= 0);
+static_assert(WIFI_SETTINGS_REMOTE_BACKOFF_MS > 0);
+static_assert((WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS >= WIFI_SETTINGS_REMOTE_BACKOFF_MS)
+    && (WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS < 0x80000000));
+static_assert(WIFI_SETTINGS_REMOTE_TICKET_COUNT >= 0);
+static_assert((WIFI_SETTINGS_REMOTE_USER_HANDLERS >= 0) && (WIFI_SETTINGS_REMOTE_USER_HANDLERS <= 16));
+static_assert((WIFI_SETTINGS_REMOTE_RESPONDER >= 0) && (WIFI_SETTINGS_REMOTE_RESPONDER <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS >= 0) && (WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_UDP_RPC >= 0) && (WIFI_SETTINGS_REMOTE_UDP_RPC <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_UDP_RPC == 0) || WIFI_SETTINGS_REMOTE_RESPONDER);  // uses the responder's port
+static_assert((WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE >= 128) && (WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE <= 1472));
+static_assert(WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE >= 1);
+static_assert((WIFI_SETTINGS_MINIMAL >= 0) && (WIFI_SETTINGS_MINIMAL <= 1));
+static_assert((SCAN_RESULTS_SIZE >= 0) && (SCAN_RESULTS_SIZE <= 255));
+static_assert((WIFI_SETTINGS_SHA256_HARDWARE >= 0) && (WIFI_SETTINGS_SHA256_HARDWARE <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_COMPRESSION >= 0) && (WIFI_SETTINGS_REMOTE_COMPRESSION <= 1));
+static_assert(WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE >= 4096);
+static_assert((WIFI_SETTINGS_REMOTE_READ_DMA >= 0) && (WIFI_SETTINGS_REMOTE_READ_DMA <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS >= 0) && (WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS <= 1));
+static_assert((WIFI_SETTINGS_MDNS >= 0) && (WIFI_SETTINGS_MDNS <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_MULTICAST_OTA >= 0) && (WIFI_SETTINGS_REMOTE_MULTICAST_OTA <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE % FLASH_SECTOR_SIZE) == 0);
+static_assert(WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE > 0);
+static_assert((WIFI_SETTINGS_REMOTE_TELEMETRY >= 0) && (WIFI_SETTINGS_REMOTE_TELEMETRY <= 1));
+static_assert((WIFI_SETTINGS_REMOTE_LAZY_INIT >= 0) && (WIFI_SETTINGS_REMOTE_LAZY_INIT <= 1));
+static_assert((WIFI_SETTINGS_PROFILE >= 0) && (WIFI_SETTINGS_PROFILE <= 1));
+static_assert(WIFI_SETTINGS_REMOTE_TICKET_LIFETIME_MS < 0x80000000);
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+static_assert((WIFI_SETTINGS_FAST_RECONNECT_SCRATCH >= 0) && (WIFI_SETTINGS_FAST_RECONNECT_SCRATCH <= 1));
+#endif
 #endif
 
 #endif
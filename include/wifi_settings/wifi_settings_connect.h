@@ -12,16 +12,118 @@
 #define _WIFI_SETTINGS_CONNECT_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // These settings are fixed by WPA-PSK standards
 #define WIFI_SSID_SIZE      33      // including '\0' character
 #define WIFI_BSSID_SIZE     6       // size of a MAC address
 #define WIFI_PASSWORD_SIZE  65      // including '\0' character
 
+/// @brief Timing of the phases of a connection attempt. Times are in
+/// milliseconds since boot, or 0 if the phase has not been reached.
+typedef struct wifi_settings_connect_timing_t {
+    uint32_t scan_start_time_ms;    // most recent scan began (0 for a fast reconnection)
+    uint32_t scan_end_time_ms;      // ... and ended
+    uint32_t join_start_time_ms;    // most recent attempt to join a hotspot began
+    uint32_t link_up_time_ms;       // ... the hotspot was joined
+    uint32_t ip_time_ms;            // ... and an IP address was obtained
+    uint32_t failure_time_ms;       // most recent failure of an attempt or connection
+    int ssid_index;                 // hotspot for the most recent attempt
+    int failure_ssid_index;         // hotspot for the most recent failure
+    const char* failure_cause;      // cause of the most recent failure, e.g. TIMEOUT, or ""
+    uint32_t num_attempts;          // number of attempts to join a hotspot
+    uint32_t num_failures;          // number of failures
+} wifi_settings_connect_timing_t;
+
+/// @brief Current connection status, as reported by wifi_settings_get_status()
+typedef struct wifi_settings_status_t {
+    uint8_t state;                  // connection state (see IMPLEMENTATION.md)
+    bool link_up;                   // network link is up (the IPv4 fields are valid)
+    bool scan_active;               // a hotspot scan is in progress
+    int ssid_index;                 // hotspot being joined or used (ssid<n>), or 0
+    uint16_t channel;               // channel for ssid_index, or 0 if not known
+    int32_t rssi;                   // signal strength (dBm), or -1 if not known
+    int link_status;                // from cyw43_wifi_link_status(), e.g. CYW43_LINK_UP
+    int hw_error_code;              // result of the last cyw43 join/scan, or a later cyw43 error
+    uint32_t rssi_time_ms;          // when rssi was read (milliseconds since boot)
+    uint32_t ipv4_address;          // IPv4 addresses in network byte order
+    uint32_t ipv4_netmask;
+    uint32_t ipv4_gateway;
+} wifi_settings_status_t;
+
+/// @brief Entry in the link quality history
+typedef struct wifi_settings_link_quality_t {
+    uint32_t time_ms;               // milliseconds since boot
+    int16_t rssi;                   // signal strength (dBm), or 0 if not connected
+    uint8_t event;                  // WIFI_SETTINGS_LINK_QUALITY_SAMPLE or _STATE_CHANGE
+    uint8_t state;                  // connection state (see IMPLEMENTATION.md)
+    uint16_t num_attempts;          // number of attempts to join a hotspot so far
+    uint16_t num_failures;          // number of failures so far
+} wifi_settings_link_quality_t;
+
+#define WIFI_SETTINGS_LINK_QUALITY_SAMPLE       0   // periodic sample while connected
+#define WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE 1   // connection state changed
+
+/// @brief Access point found by a scan, as reported by wifi_settings_get_scan_results()
+typedef struct wifi_settings_scan_result_t {
+    uint8_t bssid[WIFI_BSSID_SIZE];
+    uint16_t channel;
+    int16_t rssi;                   // signal strength (dBm)
+    uint8_t auth_mode;              // from cyw43_ev_scan_result_t (0 if open)
+    uint8_t ssid_len;
+    char ssid[WIFI_SSID_SIZE];      // '\0'-terminated (empty for a hidden hotspot)
+} wifi_settings_scan_result_t;
+
+/// @brief Connection events reported to the callback set by wifi_settings_set_event_callback()
+typedef enum wifi_settings_event_t {
+    WIFI_SETTINGS_EVENT_CONNECTED = 0,      // hotspot joined, waiting for an IP address
+    WIFI_SETTINGS_EVENT_IP_ACQUIRED,        // IP address obtained: the connection is ready
+    WIFI_SETTINGS_EVENT_LOST,               // connection lost (or disconnected)
+    WIFI_SETTINGS_EVENT_SCAN_FAILED,        // scan did not find any hotspot that could be joined
+    WIFI_SETTINGS_EVENT_INITIALISED,        // wifi_settings_init_async() has finished
+} wifi_settings_event_t;
+
+/// @brief Power management profiles for wifi_settings_set_power_profile()
+typedef enum wifi_settings_power_profile_t {
+    WIFI_SETTINGS_POWER_PROFILE_BALANCED = 0,   // cyw43 driver default (CYW43_DEFAULT_PM)
+    WIFI_SETTINGS_POWER_PROFILE_LOW_LATENCY,    // no power saving (CYW43_NONE_PM)
+    WIFI_SETTINGS_POWER_PROFILE_LOW_POWER,      // maximum power saving (CYW43_AGGRESSIVE_PM)
+} wifi_settings_power_profile_t;
+
+/// @brief Callback for connection events. This is called from the async_context with
+/// the lwIP lock held, so it should not block.
+typedef void (*wifi_settings_event_callback_t)(wifi_settings_event_t event, void* arg);
+
+/// @brief Callback for the end of a scan, with the number of access points found
+/// (see wifi_settings_get_scan_results()). This is called from the async_context with
+/// the lwIP lock held, so it should not block.
+typedef void (*wifi_settings_scan_callback_t)(int num_results, void* arg);
+
 /// @brief Initialise wifi_settings module
 /// @return 0 on success, or an error code from cyw43_arch_init
 int wifi_settings_init();
 
+/// @brief Initialise wifi_settings module without waiting for the cyw43 hardware
+/// to start. The hardware is started in the async_context, and then
+/// WIFI_SETTINGS_EVENT_INITIALISED is reported (see wifi_settings_set_event_callback()).
+/// wifi_settings_connect() may be called before this happens.
+/// @return 0 on success, or an error code from cyw43_arch_init
+int wifi_settings_init_async();
+
+#if LIB_PICO_MULTICORE && PICO_CYW43_ARCH_THREADSAFE_BACKGROUND
+/// @brief Initialise wifi_settings module on core 1, so that the cyw43 driver,
+/// lwIP, the remote service and all other background work run on core 1 rather
+/// than the calling core. This is called on core 0 instead of wifi_settings_init(),
+/// and waits for initialisation to complete. Core 1 must not be in use.
+/// Both cores are set up for flash_safe_execute().
+/// Requires pico_multicore and pico_cyw43_arch_lwip_threadsafe_background.
+/// @param[in] stack_bottom Stack for core 1, or NULL to use the default stack
+/// @param[in] stack_size_bytes Size of the stack for core 1 (if stack_bottom is not NULL)
+/// @return 0 on success, or an error code from cyw43_arch_init
+int wifi_settings_init_core1(uint32_t* stack_bottom, size_t stack_size_bytes);
+#endif
+
 /// @brief Deinitialise wifi_settings module
 void wifi_settings_deinit();
 
@@ -38,12 +140,44 @@ void wifi_settings_disconnect();
 /// @return true if ready
 bool wifi_settings_is_connected();
 
+/// @brief Set a callback to be called when the connection state changes,
+/// as an alternative to polling wifi_settings_is_connected(). This may be called
+/// before wifi_settings_init() or wifi_settings_init_async(), so that every event is
+/// received, including WIFI_SETTINGS_EVENT_INITIALISED. Only one callback can be set: NULL removes it.
+/// @param[in] callback Function to be called for each event
+/// @param[in] arg Argument passed to the callback
+void wifi_settings_set_event_callback(wifi_settings_event_callback_t callback, void* arg);
+
+/// @brief Set the cyw43 power management mode. The profile is applied each time a
+/// hotspot is joined, so it is kept across reconnections, and is applied immediately
+/// if already connected. This may be called before wifi_settings_init() or
+/// wifi_settings_init_async(), and the profile is kept across initialisation.
+/// While a remote service session is connected, the LOW_LATENCY profile is used
+/// instead (see REMOTE_LOW_LATENCY).
+/// @param[in] profile Power management profile
+void wifi_settings_set_power_profile(wifi_settings_power_profile_t profile);
+
+/// @brief Get the power management profile set by wifi_settings_set_power_profile()
+/// @return Power management profile
+wifi_settings_power_profile_t wifi_settings_get_power_profile();
+
+/// @brief Called by the remote service when its first session is connected and
+/// when its last session ends. This is not normally called by applications.
+/// The lwIP lock must be held.
+/// @param[in] active true if a session is connected
+void wifi_settings_set_remote_active(bool active);
+
 /// @brief Determine if the WiFi settings are empty - if the
 /// file is empty, wifi_settings will be unable to connect. See README.md
 /// for instructions on how to provide settings.
 /// @return true if empty (no known SSIDs or BSSIDs)
 bool wifi_settings_has_no_wifi_details();
 
+/// @brief Get the current connection status, without text formatting. The
+/// status text functions below report the same information as text.
+/// @param[out] status Status information
+void wifi_settings_get_status(wifi_settings_status_t* status);
+
 /// @brief Get a report on the current connection status
 /// @param[inout] text Text buffer for the report
 /// @param[in] text_size Available space in the buffer (bytes)
@@ -74,6 +208,42 @@ int wifi_settings_get_ip(char* text, int text_size);
 /// @return Return code from snprintf when formatting
 int wifi_settings_get_ssid(char* text, int text_size);
 
+/// @brief Get the timing of the most recent connection attempt
+/// @param[out] timing Timing information
+void wifi_settings_get_connect_timing(wifi_settings_connect_timing_t* timing);
+
+/// @brief Get a report on the timing of the most recent connection attempt,
+/// e.g. "scan=1000:3150 join=3160 link=4020 ip=4890 attempts=1 failures=0"
+/// (times in milliseconds since boot).
+/// @param[inout] text Text buffer for the report
+/// @param[in] text_size Available space in the buffer (bytes)
+/// @return Return code from snprintf when formatting
+int wifi_settings_get_connect_timing_text(char* text, int text_size);
+
+/// @brief Get the link quality history, i.e. signal strength samples
+/// and connection state changes, oldest first.
+/// @param[out] history Array for the history entries
+/// @param[in] max_entries Available space in the array (entries)
+/// @return Number of entries copied
+int wifi_settings_get_link_quality_history(wifi_settings_link_quality_t* history, int max_entries);
+
+/// @brief Get the access points found by the most recent scan, strongest signal first.
+/// wifi_settings scans for hotspots before connecting (and while connected, if roaming
+/// is enabled), so the application can use these results instead of starting another
+/// scan with cyw43_wifi_scan(). While a scan is running, only the access points found
+/// so far are copied. Up to SCAN_RESULTS_SIZE access points are kept.
+/// @param[out] results Array for the results
+/// @param[in] max_entries Available space in the array (entries)
+/// @return Number of entries copied
+int wifi_settings_get_scan_results(wifi_settings_scan_result_t* results, int max_entries);
+
+/// @brief Set a callback to be called when each scan is complete. This may be called
+/// before wifi_settings_init() or wifi_settings_init_async(). Only one callback can be set:
+/// NULL removes it, and the callback may remove itself to be called only once.
+/// @param[in] callback Function to be called at the end of each scan
+/// @param[in] arg Argument passed to the callback
+void wifi_settings_set_scan_callback(wifi_settings_scan_callback_t callback, void* arg);
+
 /// @brief Get the status of a connection attempt to
 /// an SSID as a static string, e.g. SUCCESS, NOT_FOUND. "" is returned
 /// if the SSID index is not known.
@@ -15,6 +15,7 @@
 #else
 
 #include "wifi_settings_configuration.h"
+#include "wifi_settings_connect.h"
 
 #include "pico/async_context.h"
 #include "pico/stdlib.h"
@@ -31,6 +32,7 @@ enum __packed wifi_connect_state_t {
     SCANNING,                   // scan running
     CONNECTING,                 // connection running
     CONNECTED_IP,               // connection is ready for use
+    INITIALISING,               // cyw43 hardware is starting (wifi_settings_init_async)
 };
 
 enum __packed ssid_scan_info_t {
@@ -44,20 +46,93 @@ enum __packed ssid_scan_info_t {
     LOST,                       // we connected to this SSID but the connection dropped
 };
 
+enum __packed ssid_type_t {
+    NONE = 0,                   // neither ssid<n> or bssid<n> is defined
+    BSSID,                      // bssid<n> is defined
+    SSID,                       // ssid<n> is defined
+};
+
+// Compact copy of the hotspot details in the WiFi settings file,
+// built at init and at the start of each scan, and used to match scan results.
+// Only entries 1 .. num_ssid_matches are valid.
+struct ssid_match_t {
+    enum ssid_type_t            ssid_type : 2;
+    bool                        directed : 1;                   // from scan<n>=directed
+    enum ssid_scan_info_t       scan_info : 3;                  // state of this hotspot
+    uint8_t                     ssid_size;
+    union {
+        uint8_t                 bssid[WIFI_BSSID_SIZE];
+        uint16_t                ssid_hash;
+    };
+    uint8_t                     found_bssid[WIFI_BSSID_SIZE];   // from the scan result
+    uint16_t                    found_channel;                  // from the scan result
+    int16_t                     found_rssi;                     // from the scan result
+    int8_t                      priority;                       // from prio<n>
+};
+
+// Most recent signal strength reading, see HW_STATUS_CACHE_TIME_MS
+struct hw_status_t {
+    bool                        valid;
+    int32_t                     rssi;
+    uint32_t                    time_ms;
+    absolute_time_t             refresh_time;
+};
+
 #define IPV4_ADDRESS_SIZE   16      // "xxx.xxx.xxx.xxx\0"
 #define KEY_SIZE            10      // e.g. "bssid0"
 
 struct wifi_state_t {
     enum wifi_connect_state_t   cstate;
-    enum ssid_scan_info_t       ssid_scan_info[MAX_NUM_SSIDS + 1];
+    struct ssid_match_t         ssid_match[MAX_NUM_SSIDS + 1];
+    uint                        num_ssid_matches;           // number of configured hotspots
+    bool                        select_by_rssi;             // from select=rssi
+    uint                        top_ssid_index;             // preferred to all others if found
+    bool                        top_ssid_found;             // scan can end early
+    bool                        broadcast_scan_needed;      // some hotspots are not directed
+    uint                        directed_scan_index;        // SSID for the current directed scan
     struct netif*               netif;
     cyw43_t*                    cyw43;
     uint                        selected_ssid_index;
+    uint8_t                     selected_bssid[WIFI_BSSID_SIZE];
+    uint16_t                    selected_channel;
+    bool                        static_ip_address;          // DHCP stopped by ip<n>
+    bool                        connect_after_init;         // wifi_settings_connect() while INITIALISING
+    bool                        fast_reconnect_attempt;     // selected hotspot was not scanned
+    bool                        fast_reconnect_pending;     // try the last hotspot before scanning
+    uint                        last_ssid_index;            // most recent successful connection
+    uint8_t                     last_bssid[WIFI_BSSID_SIZE];
+    uint16_t                    last_channel;
+    bool                        roaming_scan_active;        // background scan while connected
+    uint                        roaming_low_rssi_count;
+    int32_t                     roaming_rssi;               // signal strength of the connection
+    absolute_time_t             roaming_check_time;
     int                         hw_error_code;
+    struct hw_status_t          hw_status;
+    wifi_settings_connect_timing_t timing;
     absolute_time_t             connect_timeout_time;
     absolute_time_t             scan_holdoff_time;
+    uint32_t                    scan_backoff_time_ms;       // next value for scan_holdoff_time
+    uint32_t                    storage_empty_generation;   // file generation checked by STORAGE_EMPTY_ERROR
+#if LINK_QUALITY_HISTORY_SIZE > 0
+    wifi_settings_link_quality_t link_quality[LINK_QUALITY_HISTORY_SIZE];
+    uint                        link_quality_next;          // index of the next entry
+    uint                        link_quality_count;         // number of valid entries
+    absolute_time_t             link_quality_sample_time;
+#endif
+#if SCAN_RESULTS_SIZE > 0
+    wifi_settings_scan_result_t scan_results[SCAN_RESULTS_SIZE];    // strongest signal first
+    uint                        num_scan_results;
+#endif
+    bool                        scan_results_pending;       // scan running, scan_callback not called yet
+    wifi_settings_scan_callback_t scan_callback;
+    void*                       scan_callback_arg;
+    wifi_settings_power_profile_t power_profile;        // from wifi_settings_set_power_profile
+    bool                        remote_active;              // remote service session connected
+    wifi_settings_event_callback_t event_callback;
+    void*                       event_callback_arg;
     async_context_t*            context;
     async_at_time_worker_t      periodic_worker;
+    async_when_pending_worker_t event_worker;
 };
 
 #endif
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file declares the decompressor used for compressed data
+ * received by the remote update service (ID_WRITE_FLASH_HANDLER).
+ * This header file is intended only for internal use.
+ * You would normally only need to include "wifi_settings.h" in your application.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_DECOMPRESS_H_
+#define _WIFI_SETTINGS_DECOMPRESS_H_
+
+#include "pico/stdlib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief Decompress data in place, without any other buffer
+/// @param[inout] buffer Contains the compressed data at the start,
+/// and the decompressed data on return
+/// @param[in] buffer_size Size of the buffer, which is the maximum decompressed size
+/// @param[in] input_size Size of the compressed data
+/// @param[out] output_size Size of the decompressed data
+/// @return PICO_OK on success, PICO_ERROR_INVALID_ARG if input_size is not valid,
+/// or PICO_ERROR_INVALID_DATA if the compressed data is not valid.
+/// @details The compressed data is:
+///  - the decompressed size (2 bytes, little-endian)
+///  - the size of the uncompressed tail (2 bytes, little-endian)
+///  - sequences in the LZ4 block format, for the data before the tail
+///  - the uncompressed tail
+/// The tail is moved to its final position, and the sequences are moved to end
+/// where the tail begins, and then decompressed from the start of the buffer.
+/// This is only possible if the decompressed data never overwrites sequences that
+/// have not been read yet, so the compressor must check this (remote_picotool does),
+/// and put any literals at the end of the data in the tail. Other data is
+/// rejected with PICO_ERROR_INVALID_DATA.
+int wifi_settings_decompress_in_place(
+        uint8_t* buffer,
+        uint32_t buffer_size,
+        uint32_t input_size,
+        uint32_t* output_size);
+
+#endif
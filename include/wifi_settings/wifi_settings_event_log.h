@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file declares functions for the persistent event log,
+ * enabled by building with -DWIFI_SETTINGS_EVENT_LOG=1.
+ *
+ * Connection events are recorded by wifi_settings_connect.c, so you would
+ * normally only need to include this header if your application calls
+ * wifi_settings_event_log_flush() before rebooting.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_EVENT_LOG_H_
+#define _WIFI_SETTINGS_EVENT_LOG_H_
+
+#include "hardware/flash.h"
+#include "pico/stdlib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// The event log is a ring of Flash pages in the area given by WIFI_SETTINGS_EVENT_LOG_ADDRESS
+// and WIFI_SETTINGS_EVENT_LOG_SIZE. Each page begins with this header, followed by
+// as many entries as will fit. Unused entries are erased ('\xff'). The page with a valid
+// header and the highest sequence number is the most recent.
+typedef struct wifi_settings_event_log_header_t {
+    uint32_t magic;         // WIFI_SETTINGS_EVENT_LOG_MAGIC
+    uint32_t sequence;      // incremented for each page written
+    uint32_t boot_count;    // incremented at each boot
+    uint32_t checksum;      // FNV-1a hash of the entries in the page
+} wifi_settings_event_log_header_t;
+
+/// @brief Entry in the event log
+typedef struct wifi_settings_event_log_entry_t {
+    uint32_t time_ms;       // milliseconds since boot
+    uint8_t event;          // WIFI_SETTINGS_EVENT_LOG_..., or 0xff if unused
+    uint8_t ssid_index;     // hotspot being joined or used (ssid<n>), or 0
+    int8_t rssi;            // signal strength (dBm), or 0 if not known
+    uint8_t arg;            // depends on the event
+} wifi_settings_event_log_entry_t;
+
+#define WIFI_SETTINGS_EVENT_LOG_MAGIC   0x4c457377u     // "wsEL"
+#define WIFI_SETTINGS_EVENT_LOG_ENTRIES_PER_PAGE \
+    ((FLASH_PAGE_SIZE - sizeof(wifi_settings_event_log_header_t)) / sizeof(wifi_settings_event_log_entry_t))
+
+// Events 0 .. 4 are the same as wifi_settings_event_t
+#define WIFI_SETTINGS_EVENT_LOG_CONNECTED       0   // hotspot joined, waiting for an IP address
+#define WIFI_SETTINGS_EVENT_LOG_IP_ACQUIRED     1   // IP address obtained
+#define WIFI_SETTINGS_EVENT_LOG_LOST            2   // connection lost (or disconnected)
+#define WIFI_SETTINGS_EVENT_LOG_SCAN_FAILED     3   // scan did not find any hotspot that could be joined
+#define WIFI_SETTINGS_EVENT_LOG_INITIALISED     4   // cyw43 hardware started
+#define WIFI_SETTINGS_EVENT_LOG_BOOT            16  // event log started
+#define WIFI_SETTINGS_EVENT_LOG_SCAN_STARTED    17  // scan began
+#define WIFI_SETTINGS_EVENT_LOG_JOIN            18  // began joining a hotspot (arg = 1 if no scan)
+#define WIFI_SETTINGS_EVENT_LOG_JOIN_FAILED     19  // hotspot could not be joined
+#define WIFI_SETTINGS_EVENT_LOG_JOIN_TIMEOUT    20  // hotspot was not joined within the timeout
+#define WIFI_SETTINGS_EVENT_LOG_AUTH_FAILED     21  // hotspot rejected the password
+#define WIFI_SETTINGS_EVENT_LOG_UNUSED          0xff
+
+/// @brief Start the event log: find the most recent page in Flash, and record
+/// WIFI_SETTINGS_EVENT_LOG_BOOT. Later calls do nothing.
+void wifi_settings_event_log_init();
+
+/// @brief Forget the position in Flash, so that it is found again by the next call to
+/// wifi_settings_event_log_init(). Any buffered entries are lost.
+void wifi_settings_event_log_reset();
+
+/// @brief Add an entry to the event log. The entry is buffered in RAM, and the
+/// page is written to Flash if it is now full.
+/// @param[in] event WIFI_SETTINGS_EVENT_LOG_...
+/// @param[in] ssid_index Hotspot being joined or used (ssid<n>), or 0
+/// @param[in] rssi Signal strength (dBm), or 0 if not known
+/// @param[in] arg Additional information for the event
+void wifi_settings_event_log_add(uint8_t event, uint ssid_index, int32_t rssi, uint8_t arg);
+
+/// @brief Write the buffered entries to Flash if WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS
+/// has passed since the first one was added. This is called by the periodic function.
+void wifi_settings_event_log_periodic();
+
+/// @brief Write the buffered entries to Flash now, using flash_safe_execute.
+/// Call this before a deliberate reboot so that the most recent events are kept.
+/// @return PICO_OK if written successfully (or nothing was buffered), or PICO_ERROR_...
+/// @details The buffered entries are discarded even if an error is returned.
+int wifi_settings_event_log_flush();
+
+/// @brief Get the number of pages that can be read by wifi_settings_event_log_read_pages():
+/// the pages in Flash, plus one for the entries buffered in RAM
+/// @return Number of pages
+uint wifi_settings_event_log_get_num_pages();
+
+/// @brief Copy pages of the event log, oldest first. Some of the pages may be
+/// erased, or may not have a valid header, and these should be ignored.
+/// The final page contains the entries buffered in RAM.
+/// @param[in] first_page Number of the first page to copy (0 is the oldest)
+/// @param[out] buffer Buffer for the pages
+/// @param[in] max_pages Maximum number of pages to copy
+/// @return Number of pages copied
+uint wifi_settings_event_log_read_pages(uint first_page, uint8_t* buffer, uint max_pages);
+
+#endif
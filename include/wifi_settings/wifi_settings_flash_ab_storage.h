@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file declares functions used for A/B storage of the
+ * wifi-settings file, enabled by building with -DWIFI_SETTINGS_AB_STORAGE=1.
+ * This header file is intended only for internal use.
+ * You would normally only need to include "wifi_settings.h" in your application.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_FLASH_AB_STORAGE_H_
+#define _WIFI_SETTINGS_FLASH_AB_STORAGE_H_
+
+#include "wifi_settings/wifi_settings_flash_range.h"
+
+#include "pico/stdlib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// With A/B storage, there are two slots for the wifi-settings file, each
+// WIFI_SETTINGS_FILE_SIZE bytes. An update is written to the slot that is not in use,
+// and the final page of that slot is then programmed with this footer.
+// The slot with a valid footer and the highest sequence number is used.
+// If a power failure interrupts an update, the footer is not valid, and
+// the other slot is still used.
+typedef struct wifi_settings_ab_footer_t {
+    uint32_t magic;         // WIFI_SETTINGS_AB_FOOTER_MAGIC
+    uint32_t sequence;      // incremented by each update
+    uint32_t file_size;     // size of the file at the start of the slot
+    uint32_t checksum;      // FNV-1a hash of the file
+} wifi_settings_ab_footer_t;
+
+#define WIFI_SETTINGS_AB_FOOTER_MAGIC   0x42417377u     // "wsAB"
+#define WIFI_SETTINGS_AB_NUM_SLOTS      2
+
+/// @brief Get the Flash memory range of an A/B storage slot, including the final
+/// page which holds the footer
+/// @param[in] slot Slot number (0 is at WIFI_SETTINGS_FILE_ADDRESS,
+/// 1 is at WIFI_SETTINGS_AB_STORAGE_ADDRESS)
+/// @param[out] r Flash memory range
+void wifi_settings_ab_get_slot(uint slot, wifi_settings_flash_range_t* r);
+
+/// @brief Get the slot which contains the current wifi-settings file. This is
+/// found by checking the footers when first called, and then remembered.
+/// If neither slot has a valid footer, slot 0 is used, as this is where
+/// the file is stored without A/B storage.
+/// @return Slot number
+uint wifi_settings_ab_get_active_slot();
+
+/// @brief Make the footer for a file which will be stored in the slot
+/// that is not currently active
+/// @param[in] file File data
+/// @param[in] file_size Size of file
+/// @param[out] footer Footer to be programmed after the file
+void wifi_settings_ab_make_footer(
+            const char* file, uint file_size,
+            wifi_settings_ab_footer_t* footer);
+
+/// @brief Record that the file in a slot has been committed by programming its footer
+/// @param[in] slot Slot number
+void wifi_settings_ab_set_active_slot(uint slot);
+
+/// @brief Forget which slot is active, so that the footers are checked again
+void wifi_settings_ab_reset_active_slot();
+
+#endif
@@ -60,6 +60,8 @@ void wifi_settings_range_get_reusable(
 /// including a location that is determined dynamically. A different
 /// static location can also be set at build time with
 /// -DWIFI_SETTINGS_FILE_ADDRESS=0x...
+/// If the location changes while the program is running, call
+/// wifi_settings_range_invalidate_cache() afterwards.
 void wifi_settings_range_get_wifi_settings_file(
     wifi_settings_flash_range_t* r);
 
@@ -73,6 +75,11 @@ void wifi_settings_range_get_program(
 void wifi_settings_range_get_partition(
     wifi_settings_flash_range_t* r);
 
+/// @brief Discard the cached program, partition and reusable ranges, so that they
+/// are calculated again when next needed. The reusable range depends on the location
+/// of the wifi-settings file, so this must be called if the location changes.
+void wifi_settings_range_invalidate_cache();
+
 /// @brief Translate Flash range to logical range
 /// @param[in] fr Flash memory range
 /// @param[out] lr Logical memory range
@@ -80,6 +87,16 @@ void wifi_settings_range_translate_to_logical(
     const wifi_settings_flash_range_t* fr,
     wifi_settings_logical_range_t* lr);
 
+/// @brief Translate Flash range to a logical range which is read without
+/// using the XIP cache, so that reading it doesn't evict program code from the cache.
+/// This is the same as wifi_settings_range_translate_to_logical on RP2350,
+/// as that already avoids the cache.
+/// @param[in] fr Flash memory range
+/// @param[out] lr Logical memory range
+void wifi_settings_range_translate_to_uncached_logical(
+    const wifi_settings_flash_range_t* fr,
+    wifi_settings_logical_range_t* lr);
+
 /// @brief Align Flash range to sector boundary and size:
 /// no effect if they are already aligned
 /// @param[inout] fr Flash memory range (possibly unaligned)
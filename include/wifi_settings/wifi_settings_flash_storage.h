@@ -15,6 +15,29 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/// @brief The settings file may be stored in a pre-compiled binary format
+/// instead of text. The file begins with this header, followed by num_keys
+/// directory entries sorted by key, followed by the keys and values.
+/// All fields are little-endian.
+typedef struct wifi_settings_binary_file_header_t {
+    char magic[4];          // WIFI_SETTINGS_BINARY_FILE_MAGIC
+    uint16_t version;       // WIFI_SETTINGS_BINARY_FILE_VERSION
+    uint16_t num_keys;      // number of directory entries
+} wifi_settings_binary_file_header_t;
+
+/// @brief Directory entry in a binary settings file. Offsets are
+/// relative to the start of the file. Entries are sorted by key, comparing
+/// bytes as unsigned values, and a key that is a prefix of another key comes first.
+typedef struct wifi_settings_binary_file_entry_t {
+    uint16_t key_offset;
+    uint16_t key_size;
+    uint16_t value_offset;
+    uint16_t value_size;
+} wifi_settings_binary_file_entry_t;
+
+#define WIFI_SETTINGS_BINARY_FILE_MAGIC     "PWSB"
+#define WIFI_SETTINGS_BINARY_FILE_VERSION   1
+
 /// @brief Scan the settings file in Flash for a particular key.
 /// If found, copy up to *value_size characters to value.
 /// Note: value will not be '\0' terminated.
@@ -28,4 +51,130 @@ bool wifi_settings_get_value_for_key(
             const char* key,
             char* value, uint* value_size);
 
+/// @brief Scan the settings file in Flash for a particular key, without
+/// copying the value. The value is in the memory-mapped settings file, or in the
+/// staged updates, so it remains valid until the file generation changes:
+/// wifi_settings_get_file_generation() can be used to detect this.
+/// The caller must hold wifi_settings_staged_update_lock while calling this and
+/// while using the value, as changes can be staged by lwIP callbacks at any time,
+/// and each change may move the other staged values.
+/// @param[in] key Key to be found ('\0' terminated)
+/// @param[out] value Location of the value (if found) - not '\0' terminated
+/// @param[out] value_size Size of the value (if found)
+/// @return true if key found
+/// @details This function has a weak symbol, allowing it to be reimplemented
+/// by applications in order to load settings from some other storage
+bool wifi_settings_get_value_pointer_for_key(
+            const char* key,
+            const char** value, uint* value_size);
+
+/// @brief Get a number which changes whenever the settings file may have
+/// changed, i.e. whenever wifi_settings_key_index_rebuild or
+/// wifi_settings_key_index_invalidate is called, and whenever a change is staged
+/// or the staged updates are cleared. A value found by
+/// wifi_settings_get_value_pointer_for_key is only valid while this is unchanged.
+/// @return File generation number
+uint32_t wifi_settings_get_file_generation();
+
+/// @brief Callback for wifi_settings_add_file_change_subscriber
+typedef void (*wifi_settings_file_change_callback_t)(void* arg);
+
+/// @brief Subscriber to be notified when the settings file changes.
+/// The structure is owned by the caller and must remain valid until it is removed.
+typedef struct wifi_settings_file_change_subscriber_t {
+    wifi_settings_file_change_callback_t callback;
+    void* arg;
+    struct wifi_settings_file_change_subscriber_t* next;    // used internally
+} wifi_settings_file_change_subscriber_t;
+
+/// @brief Add a subscriber, so that subscriber->callback(subscriber->arg) is called
+/// whenever wifi_settings_key_index_rebuild is called, i.e. after each update of the
+/// settings file. This allows a module to refresh data derived from the file only
+/// when the file has actually changed. The callback runs in the context of the caller of
+/// wifi_settings_key_index_rebuild: for an update from remote_picotool, the lwIP lock is held.
+/// Adding a subscriber that is already present has no effect.
+/// @param[in] subscriber Callback and argument
+void wifi_settings_add_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber);
+
+/// @brief Remove a subscriber added by wifi_settings_add_file_change_subscriber.
+/// Removing a subscriber that is not present has no effect.
+/// @param[in] subscriber Callback and argument
+void wifi_settings_remove_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber);
+
+/// @brief Key and value buffer for wifi_settings_get_values_for_keys
+typedef struct wifi_settings_key_value_t {
+    const char* key;        // key to be found ('\0' terminated)
+    char* value;            // value for key (if found) - not '\0' terminated
+    uint value_size;        // size of the value buffer, updated to the size of the value if found
+    bool found;             // set if the key was found
+} wifi_settings_key_value_t;
+
+/// @brief Scan the settings file in Flash for several keys at once.
+/// This is equivalent to calling wifi_settings_get_value_for_key for each
+/// item, but the file is only scanned once.
+/// @param[inout] items Keys to be found, and buffers for their values
+/// @param[in] num_items Number of items
+/// @return Number of keys found
+/// @details This function has a weak symbol, allowing it to be reimplemented
+/// by applications in order to load settings from some other storage. If an
+/// application reimplements only wifi_settings_get_value_for_key, this function
+/// calls it for each item instead of scanning the settings file.
+uint wifi_settings_get_values_for_keys(
+            wifi_settings_key_value_t* items, uint num_items);
+
+/// @brief Rebuild the in-RAM index of keys in the settings file.
+/// @details This is called by wifi_settings_init and after the settings file
+/// is updated by wifi_settings_update_flash_safe. It should also be called
+/// if the settings file is modified by some other means. The index
+/// records the location of the file, so it is not used if
+/// wifi_settings_range_get_wifi_settings_file reports a different location.
+/// Subscribers added by wifi_settings_add_file_change_subscriber are then notified.
+/// An application that reimplements wifi_settings_get_value_for_key should call
+/// this function whenever its own storage changes.
+/// This does nothing if WIFI_SETTINGS_KEY_INDEX_SIZE is 0, or if the settings
+/// file is in the binary format, as that already has a directory of keys.
+void wifi_settings_key_index_rebuild();
+
+/// @brief Discard the in-RAM index of keys in the settings file.
+/// @details Until wifi_settings_key_index_rebuild is called,
+/// wifi_settings_get_value_for_key will scan the settings file for each key.
+void wifi_settings_key_index_invalidate();
+
+/// @brief Add a change to the staged updates in RAM. Staged updates are found by
+/// wifi_settings_get_value_for_key and related functions before the settings file
+/// is searched. This is used by wifi_settings_stage_value_for_key, which checks the key
+/// and value and writes the staged updates to Flash later.
+/// @param[in] key Key, e.g. "pass3": at least one character, not containing '='
+/// @param[in] value Pointer to the new value, or NULL if the key is deleted
+/// @param[in] value_size Size of the new value
+/// @return PICO_OK if added, or PICO_ERROR_INSUFFICIENT_RESOURCES if there is not
+/// enough space (see WIFI_SETTINGS_STAGED_UPDATE_SIZE)
+/// @details Any earlier change for the key is replaced. The file generation is changed,
+/// and subscribers added by wifi_settings_add_file_change_subscriber are notified.
+int wifi_settings_staged_update_add(const char* key, const char* value, uint value_size);
+
+/// @brief Get the staged updates: a line for each key, ending with '\n', containing
+/// "key=value" if the key is set, or "key" if it is deleted.
+/// @param[out] updates Location of the staged updates, which remains valid until
+/// the file generation changes (hold wifi_settings_staged_update_lock while using it)
+/// @param[out] size Size of the staged updates (0 if there are none)
+void wifi_settings_staged_update_get(const char** updates, uint* size);
+
+/// @brief Discard the staged updates, once they have been written to Flash.
+/// The file generation is changed, and subscribers added by
+/// wifi_settings_add_file_change_subscriber are notified.
+void wifi_settings_staged_update_clear();
+
+/// @brief Lock the staged updates, so that changes can't be staged by lwIP callbacks
+/// (e.g. remote handlers) while they are used. This is the lwIP lock, which is
+/// only taken once cyw43_arch has been initialised.
+/// @return Value to pass to wifi_settings_staged_update_unlock
+bool wifi_settings_staged_update_lock();
+
+/// @brief Unlock the staged updates
+/// @param[in] need_lock Value returned by wifi_settings_staged_update_lock
+void wifi_settings_staged_update_unlock(bool need_lock);
+
 #endif
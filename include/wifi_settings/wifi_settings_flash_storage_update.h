@@ -21,6 +21,11 @@
 /// @param[in] file_size Size of file: maximum is the size set by
 /// wifi_settings_range_get_wifi_settings_file()
 /// @return PICO_OK if updated successfully, or PICO_ERROR_...
+/// @details Only the sectors which differ from the new file are erased and
+/// reprogrammed, and pages which would only contain padding are not programmed.
+/// The key index is invalidated, and is not rebuilt, because this
+/// function is normally followed by a reboot. Call
+/// wifi_settings_key_index_rebuild() afterwards if this is not the case.
 int wifi_settings_update_flash_unsafe(
             const char* file,
             const uint file_size);
@@ -30,8 +35,89 @@ int wifi_settings_update_flash_unsafe(
 /// @param[in] file_size Size of file: maximum is the size set by
 /// wifi_settings_range_get_wifi_settings_file()
 /// @return PICO_OK if updated successfully, or PICO_ERROR_...
+/// @details The key index is rebuilt afterwards.
 int wifi_settings_update_flash_safe(
             const char* file,
             const uint file_size);
 
+/// @brief Set the value for a key in the settings file in Flash
+/// @param[in] key Key, e.g. "pass3": at least one character, not containing '='
+/// @param[in] value Pointer to the new value: this does not need to be '\0'-terminated
+/// @param[in] value_size Size of the new value
+/// @return PICO_OK if updated successfully, or PICO_ERROR_...
+/// @details The first line for the key is replaced with "key=value", and any other lines
+/// for the key are removed. If the key is not present, "key=value" is added at the end.
+/// The new file is built in RAM, and written with wifi_settings_update_flash_safe(),
+/// so only the sectors that change are reprogrammed. The key and value may not contain
+/// end of line or end of file characters. A pre-compiled binary file cannot be edited,
+/// and PICO_ERROR_INVALID_DATA is returned. PICO_ERROR_INVALID_ARG is returned
+/// if the new file would not fit. Any changes staged by wifi_settings_stage_value_for_key()
+/// are written at the same time.
+int wifi_settings_set_value_for_key(
+            const char* key,
+            const char* value,
+            const uint value_size);
+
+/// @brief Remove a key from the settings file in Flash
+/// @param[in] key Key, e.g. "pass3"
+/// @return PICO_OK if removed successfully or the key was not present, or PICO_ERROR_...
+/// @details All lines for the key are removed, as described for
+/// wifi_settings_set_value_for_key().
+int wifi_settings_delete_key(const char* key);
+
+/// @brief Stage a new value for a key, to be written to the settings file in Flash later
+/// @param[in] key Key, e.g. "pass3": at least one character, not containing '='
+/// @param[in] value Pointer to the new value: this does not need to be '\0'-terminated
+/// @param[in] value_size Size of the new value
+/// @return PICO_OK if staged (or updated) successfully, or PICO_ERROR_...
+/// @details The change is kept in RAM, and wifi_settings_get_value_for_key finds
+/// the new value immediately. Several changes made in quick succession are written
+/// to Flash together by wifi_settings_flush_staged_updates(), which is called
+/// by the periodic function once no change has been staged for
+/// WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS. If there is no space for the change in RAM
+/// (see WIFI_SETTINGS_STAGED_UPDATE_SIZE), the staged changes are written first, and
+/// if there is still no space, the key is updated immediately as for
+/// wifi_settings_set_value_for_key(). The same errors are returned for invalid keys
+/// or values, or a pre-compiled binary file.
+int wifi_settings_stage_value_for_key(
+            const char* key,
+            const char* value,
+            const uint value_size);
+
+/// @brief Stage the removal of a key from the settings file in Flash
+/// @param[in] key Key, e.g. "pass3"
+/// @return PICO_OK if staged (or removed) successfully, or PICO_ERROR_...
+/// @details As for wifi_settings_stage_value_for_key(): the key is not found
+/// by wifi_settings_get_value_for_key from now on.
+int wifi_settings_stage_delete_key(const char* key);
+
+/// @brief Write any staged changes to the settings file in Flash now
+/// @return PICO_OK if written successfully (or nothing was staged), or PICO_ERROR_...
+/// @details All of the changes are applied to a copy of the file in RAM, which is
+/// written with wifi_settings_update_flash_safe(). If the changes can never be written,
+/// because the new file would not fit (PICO_ERROR_INVALID_ARG) or the file has been replaced
+/// by a pre-compiled binary file (PICO_ERROR_INVALID_DATA), they are discarded. After any
+/// other error, the changes remain staged, and the periodic function tries again later.
+/// Call this before a deliberate reboot so that staged changes are not lost.
+int wifi_settings_flush_staged_updates();
+
+/// @brief Are there any staged changes which have not been written to Flash?
+/// @return true if there are staged changes
+bool wifi_settings_has_staged_updates();
+
+/// @brief Write staged changes to Flash if WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS has
+/// passed since the last change. This is called by the periodic function.
+void wifi_settings_staged_updates_periodic();
+
+/// @brief Timing of Flash updates by wifi_settings_update_flash_unsafe
+typedef struct wifi_settings_flash_update_stats_t {
+    uint32_t num_updates;               // number of calls to wifi_settings_update_flash_unsafe
+    uint32_t max_erase_time_us;         // longest time with interrupts disabled for a sector erase
+    uint32_t max_program_time_us;       // longest time with interrupts disabled for programming
+} wifi_settings_flash_update_stats_t;
+
+/// @brief Get timing information for Flash updates since boot
+/// @param[out] stats Timing information
+void wifi_settings_get_flash_update_stats(wifi_settings_flash_update_stats_t* stats);
+
 #endif
@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file declares functions for advertising the hostname and the
+ * remote service with mDNS and DNS-SD, which is enabled by building with
+ * WIFI_SETTINGS_MDNS=1 (cmake -DWIFI_SETTINGS_MDNS=1). These are called
+ * by wifi_settings_connect.c, and should not be called by applications.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_MDNS_H_
+#define _WIFI_SETTINGS_MDNS_H_
+
+/// @brief DNS-SD service type for the remote service (with the _tcp protocol)
+#define WIFI_SETTINGS_MDNS_SERVICE_TYPE     "_pico-wifi-settings"
+
+/// @brief Start the mDNS responder for the default netif, announcing
+/// "<hostname>.local" and (if enabled) the remote service. The lwIP lock must be held.
+void wifi_settings_mdns_init();
+
+/// @brief Update the announced names after the hostname has changed.
+/// The lwIP lock must be held.
+void wifi_settings_mdns_update_hostname();
+
+/// @brief Announce again after a connection has been made.
+/// The lwIP lock must be held.
+void wifi_settings_mdns_connected();
+
+/// @brief Stop the mDNS responder. The lwIP lock must be held.
+void wifi_settings_mdns_deinit();
+
+#endif
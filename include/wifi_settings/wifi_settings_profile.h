@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file declares functions to read the hot path profiling counters,
+ * which are enabled by building with WIFI_SETTINGS_PROFILE=1
+ * (cmake -DWIFI_SETTINGS_PROFILE=1). Without this, the WIFI_SETTINGS_PROFILE_START
+ * and WIFI_SETTINGS_PROFILE_STOP macros compile to nothing, and the counters are always zero.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_PROFILE_H_
+#define _WIFI_SETTINGS_PROFILE_H_
+
+#include "wifi_settings/wifi_settings_configuration.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// @brief The parts of pico-wifi-settings that are profiled
+typedef enum {
+    WIFI_SETTINGS_PROFILE_FILE_SEARCH = 0,  // search of the wifi-settings file for keys
+    WIFI_SETTINGS_PROFILE_SCAN_CALLBACK,    // processing one WiFi scan result
+    WIFI_SETTINGS_PROFILE_SECRET_HASH,      // hashing update_secret to make the HMAC key
+    WIFI_SETTINGS_PROFILE_KEY_SETUP,        // making the session keys for a remote service session
+    WIFI_SETTINGS_PROFILE_HMAC,             // one HMAC for the remote service handshake or key setup
+    WIFI_SETTINGS_PROFILE_HANDLER,          // one call to a remote service handler callback
+    WIFI_SETTINGS_PROFILE_FLASH_ERASE,      // one Flash erase
+    WIFI_SETTINGS_PROFILE_FLASH_PROGRAM,    // one Flash program operation
+    WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF,   // one period with interrupts disabled for Flash access
+    WIFI_SETTINGS_PROFILE_NUM_COUNTERS,
+} wifi_settings_profile_id_t;
+
+/// @brief One profiling counter: times are in the units given by wifi_settings_profile_get_unit()
+typedef struct wifi_settings_profile_counter_t {
+    uint32_t count;                 // number of times the code ran
+    uint32_t max_time;              // longest time for one run
+    uint64_t total_time;            // total time for all runs
+} wifi_settings_profile_counter_t;
+
+/// @brief Get a profiling counter
+/// @param[in] id Counter to get
+/// @param[out] counter Counter value (all zero if profiling is not enabled)
+void wifi_settings_profile_get(wifi_settings_profile_id_t id, wifi_settings_profile_counter_t* counter);
+
+/// @brief Set all of the profiling counters to zero
+void wifi_settings_profile_reset();
+
+/// @brief Get the name of a profiling counter, e.g. "file_search"
+/// @param[in] id Counter
+/// @return Pointer to a static string ("?" if the id is not valid)
+const char* wifi_settings_profile_get_name(wifi_settings_profile_id_t id);
+
+/// @brief Get the unit of time used by the profiling counters
+/// @return "cycles" (CPU cycles) or "us" (microseconds), or "" if profiling is not enabled
+const char* wifi_settings_profile_get_unit();
+
+/// @brief Produce a text report of the profiling counters, one line per counter
+/// e.g. "file_search count=12 total=53412 max=9210"
+/// @param[out] text Text buffer
+/// @param[in] text_size Size of text buffer
+/// @return Return value from snprintf (text size, excluding '\0'; empty if profiling is not enabled)
+int wifi_settings_profile_get_text(char* text, int text_size);
+
+#if WIFI_SETTINGS_PROFILE
+/// @brief Read the profiling timer (internal: use WIFI_SETTINGS_PROFILE_START)
+uint32_t wifi_settings_profile_start();
+
+/// @brief Add the time since start to a counter (internal: use WIFI_SETTINGS_PROFILE_STOP)
+void wifi_settings_profile_stop(wifi_settings_profile_id_t id, uint32_t start);
+
+#define WIFI_SETTINGS_PROFILE_START(start) const uint32_t start = wifi_settings_profile_start()
+#define WIFI_SETTINGS_PROFILE_STOP(id, start) wifi_settings_profile_stop((id), (start))
+#else
+#define WIFI_SETTINGS_PROFILE_START(start) do {} while (0)
+#define WIFI_SETTINGS_PROFILE_STOP(id, start) do {} while (0)
+#endif
+
+#endif
@@ -20,6 +20,9 @@
 #define ID_LAST_USER_HANDLER    143
 #define MAX_DATA_SIZE           4096
 
+// TCP and UDP port of the remote service (also advertised by mDNS)
+#define WIFI_SETTINGS_REMOTE_PORT_NUMBER    1404
+
 
 /// @brief Callback function for a handler.
 /// The handler is called when a request is received with a msg_type previously registered with
@@ -73,16 +76,80 @@ typedef void (* handler_callback2_t) (
         int32_t callback1_return,
         void* arg);
 
-/// @brief Initialise wifi_settings_remote service
+/// @brief Callback function called at the start of a request for a streaming handler.
+/// Streaming handlers receive the request data in chunks as it is decrypted, rather than
+/// all at once, so the request data is not limited to MAX_DATA_SIZE bytes and no data
+/// buffer is needed. This could be used to program Flash pages as they arrive.
+///
+/// Streaming handlers are always called with the lwIP lock held (never in the wifi_settings task).
+/// With hardware SHA-256 (Pico 2), the hardware is held until the end of the request, so
+/// a streaming request is only accepted when there are no other sessions. Until it ends,
+/// new connections are sent ID_BUSY_ERROR instead of the greeting, and UDP RPC requests
+/// are ignored.
+///
+/// @param[in] msg_type Message type (passed to wifi_settings_remote_set_stream_handler)
+/// @param[in] input_data_size Total size of the request data in bytes
+/// @param[in] input_parameter Value of parameter in the request
+/// @param[in] arg Opaque user data for the function
+/// @return 0 to accept the request. Any other value rejects the request: the data is
+/// not passed to the handler, the end handler is not called, and the value is returned
+/// to the caller.
+typedef int32_t (* handler_stream_begin_t) (
+        uint8_t msg_type,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        void* arg);
+
+/// @brief Callback function called for each chunk of request data for a streaming handler.
+/// Chunks are passed in order, and each one is at most 256 bytes.
+///
+/// The integrity of the data is only checked after the final chunk, so the data
+/// must not be used until the end handler is called with data_valid == true.
+///
+/// @param[in] msg_type Message type (passed to wifi_settings_remote_set_stream_handler)
+/// @param[in] data Chunk of request data
+/// @param[in] data_offset Position of the chunk within the request data
+/// @param[in] data_size Size of the chunk in bytes
+/// @param[in] arg Opaque user data for the function
+typedef void (* handler_stream_data_t) (
+        uint8_t msg_type,
+        const uint8_t* data,
+        uint32_t data_offset,
+        uint32_t data_size,
+        void* arg);
+
+/// @brief Callback function called at the end of a request for a streaming handler,
+/// after all of the data has been passed to the data handler. This is also called
+/// (with data_valid == false) if the connection is lost before the end of the request.
+///
+/// @param[in] msg_type Message type (passed to wifi_settings_remote_set_stream_handler)
+/// @param[in] data_valid True if the integrity check for the request data passed
+/// @param[in] arg Opaque user data for the function
+/// @return Value to be returned to the caller (ignored if data_valid is false,
+/// as the caller receives an error instead). No data can be returned.
+typedef int32_t (* handler_stream_end_t) (
+        uint8_t msg_type,
+        bool data_valid,
+        void* arg);
+
+/// @brief Initialise wifi_settings_remote service.
+/// If WIFI_SETTINGS_REMOTE_LAZY_INIT is 1, this only installs the handlers, and the
+/// service is started by wifi_settings_remote_connected().
 /// @return 0 on success, or an PICO_ERROR code
 int wifi_settings_remote_init();
 
+/// @brief Start the wifi_settings_remote service, if this was deferred by
+/// WIFI_SETTINGS_REMOTE_LAZY_INIT. This is called by wifi_settings_connect.c
+/// when a connection is made, with the lwIP lock held, and does nothing after the first call.
+/// @return 0 on success, or an PICO_ERROR code
+int wifi_settings_remote_connected();
+
 /// @brief Register a handler for a msg_type
 /// A remote user can call the handler by placing a valid request with a matching msg_type.
 /// This type of handler returns a value and optional data to the user. An acknowledgment and
 /// returned data are sent after the handler runs.
 /// @param[in] msg_type Identifies the handler; must be in range ID_FIRST_USER_HANDLER ..
-/// ID_LAST_USER_HANDLER inclusive.
+/// ID_LAST_USER_HANDLER inclusive, or fewer if WIFI_SETTINGS_REMOTE_USER_HANDLERS is reduced.
 /// @param[in] handler_callback Pointer to callback function
 /// @param[in] arg Opaque user data for the function
 /// @return 0 on success, or an PICO_ERROR code
@@ -96,7 +163,7 @@ int wifi_settings_remote_set_handler(
 /// This type of handler does not return any data, but does return a value (from the first handler).
 /// The second handler is called after this value is sent.
 /// @param[in] msg_type Identifies the handler; must be in range ID_FIRST_USER_HANDLER ..
-/// ID_LAST_USER_HANDLER inclusive.
+/// ID_LAST_USER_HANDLER inclusive, or fewer if WIFI_SETTINGS_REMOTE_USER_HANDLERS is reduced.
 /// @param[in] callback1 Pointer to first stage function
 /// @param[in] callback2 Pointer to second stage function
 /// @param[in] arg Opaque user data for the function
@@ -107,9 +174,99 @@ int wifi_settings_remote_set_two_stage_handler(
         handler_callback2_t callback2,
         void* arg);
 
+/// @brief Register a streaming handler for a msg_type
+/// A remote user can call the handler by placing a valid request with a matching msg_type.
+/// The request data is passed to stream_data in chunks as it arrives, so it may be up to
+/// 4GB in size. This type of handler returns a value (from stream_begin or stream_end)
+/// but does not return any data.
+/// @param[in] msg_type Identifies the handler; must be in range ID_FIRST_USER_HANDLER ..
+/// ID_LAST_USER_HANDLER inclusive, or fewer if WIFI_SETTINGS_REMOTE_USER_HANDLERS is reduced.
+/// @param[in] stream_begin Pointer to function called at the start of the request
+/// @param[in] stream_data Pointer to function called for each chunk of data
+/// @param[in] stream_end Pointer to function called at the end of the request
+/// @param[in] arg Opaque user data for the functions
+/// @return 0 on success, or an PICO_ERROR code
+int wifi_settings_remote_set_stream_handler(
+        uint8_t msg_type,
+        handler_stream_begin_t stream_begin,
+        handler_stream_data_t stream_data,
+        handler_stream_end_t stream_end,
+        void* arg);
+
+/// @brief Send the reply for the current request directly from memory, rather than
+/// copying it to data_buffer. This can only be called by a handler (handler_callback1_t)
+/// while it is running, and *output_data_size may then be up to
+/// WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE. The memory is read after the handler returns:
+/// the data hash is computed first, then the data is encrypted as it is sent.
+/// If the memory changes in between, the data won't match the hash, and the client
+/// rejects the reply as corrupted, so this should only be used for memory that
+/// rarely changes (for example, Flash).
+/// This is ignored for two-stage handlers, as the reply data is not sent.
+/// @param[inout] output_data_size The output_data_size pointer passed to the handler,
+/// which identifies the request (handlers may run at the same time in different contexts)
+/// @param[in] source Start of the reply data
+void wifi_settings_remote_set_reply_source(uint32_t* output_data_size, const void* source);
+
+/// @brief Returns true if the wifi_settings task (WIFI_SETTINGS_TASK) is running a handler,
+/// or has one waiting, or is preparing Flash for an update. This must be called in the lwIP
+/// context (e.g. in a UDP receive callback). While it returns true, code in the lwIP context
+/// must not call handlers or write to Flash, as the task may be doing the same thing.
+/// UDP RPC requests are rejected with ID_BUSY_ERROR, and telemetry frames are delayed.
+/// Without the task, handlers run in the lwIP context, so this always returns false.
+/// @return true if the task is busy
+bool wifi_settings_remote_is_task_busy();
+
+/// @brief Allow the handler for a msg_type to be called by a single UDP datagram, without
+/// a TCP connection (WIFI_SETTINGS_REMOTE_UDP_RPC). The handler must have been registered
+/// with wifi_settings_remote_set_handler; registering it again removes the permission.
+/// It is called in the lwIP context, so it should be quick. The request data and reply
+/// data are limited to (WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE - 44) bytes, and a request
+/// may be handled twice if the client sends it again after losing the reply, so this is
+/// intended for handlers which only return information.
+/// @param[in] msg_type Identifies the handler (built-in or user handler)
+/// @return 0 on success, PICO_ERROR_INVALID_ARG if msg_type is not a handler of the
+/// right type, or PICO_ERROR_NOT_PERMITTED if WIFI_SETTINGS_REMOTE_UDP_RPC is 0
+int wifi_settings_remote_allow_udp_rpc(uint8_t msg_type);
+
+/// @brief Remote service session counts, see wifi_settings_remote_get_session_stats
+typedef struct wifi_settings_remote_session_stats_t {
+    uint32_t num_active;        // sessions currently allocated
+    uint32_t max_active;        // most sessions allocated at the same time
+    uint32_t num_rejected;      // connections rejected because no session was available (or busy streaming)
+    uint32_t pool_size;         // WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE (0 = heap)
+    uint32_t num_sessions;      // sessions allocated since boot
+    uint32_t num_auth_failures; // sessions ended because the client authentication was wrong
+    uint64_t crypto_time_us;    // total time spent on encryption, decryption and hashing
+    uint32_t num_handshakes;    // sessions currently allocated which are not yet authenticated
+    uint32_t num_handshake_limited; // connections rejected because of WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES
+    uint32_t num_handshake_timeouts;// sessions ended because of WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS
+    uint32_t num_backoff_rejected;  // connections rejected because of failed handshakes from the same address
+    uint32_t num_idle_timeouts;     // sessions ended because of WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS
+} wifi_settings_remote_session_stats_t;
+
+/// @brief Get remote service session counts since boot
+/// @param[out] stats Session counts
+void wifi_settings_remote_get_session_stats(wifi_settings_remote_session_stats_t* stats);
+
+/// @brief Remote service handler counts, see wifi_settings_remote_get_handler_stats
+typedef struct wifi_settings_remote_handler_stats_t {
+    uint32_t num_calls;         // requests handled
+    uint32_t max_time_us;       // longest time for one call of a handler callback
+    uint64_t total_time_us;     // total time for all handler callbacks
+    uint32_t bytes_in;          // request data received
+    uint32_t bytes_out;         // reply data sent
+} wifi_settings_remote_handler_stats_t;
+
+/// @brief Get remote service counts since boot for the handler for msg_type.
+/// For two-stage and streaming handlers, the time includes every callback.
+/// @param[in] msg_type Identifies the handler (built-in or user handler)
+/// @param[out] stats Handler counts
+/// @return PICO_OK on success, or PICO_ERROR_INVALID_ARG if msg_type is not a handler
+int wifi_settings_remote_get_handler_stats(uint8_t msg_type, wifi_settings_remote_handler_stats_t* stats);
+
 /// @brief Re-read the wifi_settings file in Flash to obtain update_secret,
 /// this should be called if the secret is updated in memory so that the new
-/// value is used. (Note, this is called by wifi_settings_remote_init).
+/// value is used. (Note, this is called when the service starts).
 void wifi_settings_remote_update_secret();
 
 #endif
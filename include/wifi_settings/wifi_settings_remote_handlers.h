@@ -17,7 +17,66 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-/// @brief for ID_PICO_INFO_HANDLER messages:
+/// @brief Get a string from the program's binary info,
+/// e.g. BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING
+/// @return The string, or NULL if the program doesn't have it
+const char* wifi_settings_get_binary_info_string(uint32_t id);
+
+/// @brief Formats for the ID_PICO_INFO_HANDLER reply, selected by the request parameter
+#define WIFI_SETTINGS_PICO_INFO_TEXT    0   // key=value lines
+#define WIFI_SETTINGS_PICO_INFO_BINARY  1   // entries: tag (uint8_t), size (uint8_t), value
+
+/// @brief Tags for WIFI_SETTINGS_PICO_INFO_BINARY. Values are uint32_t (little-endian),
+/// ranges (start and end as uint32_t), or strings (not '\0'-terminated), as noted.
+/// These must not be renumbered, as remote_picotool uses the same numbers.
+typedef enum wifi_settings_pico_info_tag_t {
+    PICO_INFO_FLASH_SECTOR_SIZE = 1,        // uint32_t
+    PICO_INFO_MAX_DATA_SIZE,                // uint32_t
+    PICO_INFO_FLASH_ALL,                    // range
+    PICO_INFO_FLASH_REUSABLE,               // range
+    PICO_INFO_FLASH_WIFI_SETTINGS_FILE,     // range
+    PICO_INFO_FLASH_PROGRAM,                // range
+    PICO_INFO_LOGICAL_OFFSET,               // uint32_t
+    PICO_INFO_MULTICORE,                    // string
+    PICO_INFO_REMOTE_MEMORY_ACCESS,         // string
+    PICO_INFO_MAX_READ_SIZE,                // uint32_t
+    PICO_INFO_AB_OTA,                       // string
+    PICO_INFO_FLASH_SECTOR_HASH,            // string
+    PICO_INFO_FLASH_PREPARE,                // string
+    PICO_INFO_MULTICAST_OTA,                // string
+    PICO_INFO_WRITE_FLASH_COMPRESSION,      // string
+    PICO_INFO_SYSINFO_CHIP_ID,              // uint32_t
+    PICO_INFO_BOARD_ID,                     // string
+    PICO_INFO_NAME,                         // string
+    PICO_INFO_IP,                           // string
+    PICO_INFO_CONNECT_TIMING,               // string
+    PICO_INFO_FLASH_UPDATE_COUNT,           // uint32_t
+    PICO_INFO_FLASH_ERASE_MAX_US,           // uint32_t
+    PICO_INFO_FLASH_PROGRAM_MAX_US,         // uint32_t
+    PICO_INFO_REMOTE_SESSIONS_ACTIVE,       // uint32_t
+    PICO_INFO_REMOTE_SESSIONS_MAX,          // uint32_t
+    PICO_INFO_REMOTE_SESSIONS_REJECTED,     // uint32_t
+    PICO_INFO_REMOTE_SESSION_POOL_SIZE,     // uint32_t
+    PICO_INFO_PROFILE_UNIT,                 // string
+    PICO_INFO_PROFILE,                      // wifi_settings_profile_id_t (uint8_t), then
+                                            // wifi_settings_profile_counter_t
+    PICO_INFO_WIFI_SETTINGS_VERSION,        // string
+    PICO_INFO_PROGRAM,                      // string
+    PICO_INFO_VERSION,                      // string
+    PICO_INFO_BUILD_DATE,                   // string
+    PICO_INFO_URL,                          // string
+    PICO_INFO_DESCRIPTION,                  // string
+    PICO_INFO_FEATURE,                      // string
+    PICO_INFO_BUILD_ATTRIBUTE,              // string
+    PICO_INFO_SDK_VERSION,                  // string
+    PICO_INFO_REMOTE_DATA_BUFFER_POOL_SIZE, // uint32_t
+    PICO_INFO_WRITE_FLASH_UNCHANGED,        // string
+    PICO_INFO_NUM_TAGS,
+} wifi_settings_pico_info_tag_t;
+
+/// @brief for ID_PICO_INFO_HANDLER messages: returns information about the Pico
+/// in the format given by the parameter (WIFI_SETTINGS_PICO_INFO_TEXT or
+/// WIFI_SETTINGS_PICO_INFO_BINARY)
 int32_t wifi_settings_pico_info_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
@@ -35,6 +94,88 @@ int32_t wifi_settings_update_handler(
         uint32_t* output_data_size,
         void* arg);
 
+/// @brief for ID_LINK_QUALITY_HANDLER: returns the link quality history
+/// as an array of wifi_settings_link_quality_t
+int32_t wifi_settings_link_quality_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_STATS_HANDLER: returns wifi_settings_remote_session_stats_t, followed by
+/// a record for each handler that has been used: the msg_type (uint32_t) and
+/// wifi_settings_remote_handler_stats_t. The result is the number of records.
+int32_t wifi_settings_stats_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_EVENT_LOG_HANDLER: returns pages of the persistent event log, beginning
+/// with page <parameter> (see wifi_settings_event_log_read_pages()). The result is the
+/// total number of pages.
+int32_t wifi_settings_event_log_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief Telemetry frame returned by ID_TELEMETRY_HANDLER, followed by
+/// the profiling counters (wifi_settings_profile_counter_t)
+typedef struct wifi_settings_telemetry_t {
+    uint32_t time_ms;               // milliseconds since boot
+    int32_t rssi;                   // from wifi_settings_status_t
+    uint8_t state;
+    uint8_t link_up;
+    uint16_t channel;
+    int32_t link_status;
+    uint32_t num_attempts;          // from wifi_settings_connect_timing_t
+    uint32_t num_failures;
+    uint32_t heap_used;             // bytes allocated from the heap (mallinfo)
+    uint32_t heap_arena;            // bytes obtained for the heap so far
+    uint32_t num_active;            // from wifi_settings_remote_session_stats_t
+    uint32_t num_sessions;
+    uint32_t num_auth_failures;
+} wifi_settings_telemetry_t;
+
+/// @brief for ID_TELEMETRY_HANDLER: returns wifi_settings_telemetry_t, followed by
+/// the profiling counters if WIFI_SETTINGS_PROFILE is enabled. The result is the
+/// number of counters. A non-zero parameter subscribes the session to a telemetry
+/// frame every <parameter> milliseconds (see wifi_settings_remote.c).
+int32_t wifi_settings_telemetry_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_PING_HANDLER: does nothing, and returns the parameter, so that
+/// the round trip time can be measured
+int32_t wifi_settings_ping_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_SET_KEY_HANDLER: parameter 0 sets a key (input "key=value"),
+/// parameter 1 deletes a key (input "key")
+int32_t wifi_settings_set_key_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
 /// @brief for ID_UPDATE_REBOOT_HANDLER (first stage)
 int32_t wifi_settings_update_reboot_handler1(
         uint8_t msg_type,
@@ -20,6 +20,18 @@
 
 #define WIFI_SETTINGS_OTA_HASH_SIZE 32
 
+// Set in the input_parameter of ID_WRITE_FLASH_HANDLER if the data is compressed
+// (see wifi_settings_decompress.h). This is not part of any Flash address.
+#define WIFI_SETTINGS_WRITE_FLASH_COMPRESSED 0x40000000u
+
+// Set in the input_parameter of ID_WRITE_FLASH_HANDLER if the client accepts
+// WIFI_SETTINGS_WRITE_FLASH_UNCHANGED as a result. This is not part of any Flash address.
+#define WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED 0x20000000u
+
+// Returned by ID_WRITE_FLASH_HANDLER if the target already contained the data,
+// so nothing was written (only if WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED was set)
+#define WIFI_SETTINGS_WRITE_FLASH_UNCHANGED 1
+
 // structure received by ID_OTA_FIRMWARE_UPDATE_HANDLER
 typedef struct ota_firmware_update_parameter_t {
     wifi_settings_flash_range_t copy_from;
@@ -27,7 +39,45 @@ typedef struct ota_firmware_update_parameter_t {
     uint8_t hash[WIFI_SETTINGS_OTA_HASH_SIZE];
 } ota_firmware_update_parameter_t;
 
-// structure received by ID_READ_HANDLER
+// input_parameter values for ID_AB_OTA_HANDLER (the target partition is
+// returned by ID_AB_OTA_TARGET_HANDLER)
+#define WIFI_SETTINGS_AB_OTA_REBOOT     1
+
+// structure received by ID_AB_OTA_HANDLER (WIFI_SETTINGS_AB_OTA_REBOOT)
+typedef struct ab_ota_parameter_t {
+    wifi_settings_flash_range_t image;
+    uint8_t hash[WIFI_SETTINGS_OTA_HASH_SIZE];
+} ab_ota_parameter_t;
+
+// input_parameter values for ID_MULTICAST_OTA_HANDLER
+#define WIFI_SETTINGS_MULTICAST_OTA_BEGIN   0
+#define WIFI_SETTINGS_MULTICAST_OTA_STATUS  1
+#define WIFI_SETTINGS_MULTICAST_OTA_END     2
+
+#define WIFI_SETTINGS_MULTICAST_OTA_KEY_SIZE    32
+
+// structure received by ID_MULTICAST_OTA_HANDLER (WIFI_SETTINGS_MULTICAST_OTA_BEGIN)
+typedef struct multicast_ota_begin_parameter_t {
+    wifi_settings_flash_range_t image;  // where the image is written (aligned to sectors)
+    uint32_t group_address;             // IPv4 multicast group (network byte order)
+    uint32_t port;                      // UDP port
+    uint32_t transfer_id;               // sent in every packet of this transfer
+    uint8_t encrypt_key[WIFI_SETTINGS_MULTICAST_OTA_KEY_SIZE];  // AES-256-CTR key
+    uint8_t mac_key[WIFI_SETTINGS_MULTICAST_OTA_KEY_SIZE];      // AES-256-CBC-MAC key
+} multicast_ota_begin_parameter_t;
+
+// structure returned by ID_MULTICAST_OTA_HANDLER (WIFI_SETTINGS_MULTICAST_OTA_STATUS),
+// followed by a bitmap with one bit per sector, set if the sector was received
+typedef struct multicast_ota_status_t {
+    uint32_t num_sectors;
+    uint32_t packets_accepted;
+    uint32_t packets_rejected;
+} multicast_ota_status_t;
+
+// Maximum number of read_parameter_t structures received by ID_READ_RANGES_HANDLER
+#define WIFI_SETTINGS_READ_RANGES_MAX 32
+
+// structure received by ID_READ_HANDLER (ID_READ_RANGES_HANDLER receives an array)
 typedef struct read_parameter_t {
     wifi_settings_logical_range_t copy_from;
 } read_parameter_t;
@@ -41,9 +91,60 @@ int32_t wifi_settings_read_handler(
         uint32_t* output_data_size,
         void* arg);
 
+/// @brief for ID_READ_RANGES_HANDLER
+/// @param[in] data_buffer contains 1 .. WIFI_SETTINGS_READ_RANGES_MAX read_parameter_t
+/// structures, and receives the data read from all of them, concatenated
+int32_t wifi_settings_read_ranges_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_HASH_FLASH_HANDLER
+/// @param[in] data_buffer contains a wifi_settings_flash_range_t (aligned to sectors),
+/// and receives the SHA-256 digest of each sector in that range
+int32_t wifi_settings_hash_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_PREPARE_FLASH_HANDLER
+/// @param[in] data_buffer contains a wifi_settings_flash_range_t (aligned to sectors)
+/// to be erased in the background by wifi_settings_prepare_flash_step
+int32_t wifi_settings_prepare_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief Returns true if ID_PREPARE_FLASH_HANDLER has left Flash to be erased
+bool wifi_settings_prepare_flash_pending();
+
+/// @brief Erase the next sector requested by ID_PREPARE_FLASH_HANDLER.
+/// Called by wifi_settings_remote in the same context as the handlers.
+/// @return true if there is more to erase
+bool wifi_settings_prepare_flash_step();
+
+/// @brief Called by wifi_settings_remote when a session ends, so that the data written
+/// by that session (ID_WRITE_FLASH_HANDLER) isn't assumed to match a later request
+/// for ID_OTA_FIRMWARE_UPDATE_HANDLER. This may be called while a handler is running.
+void wifi_settings_write_flash_session_ended();
+
 /// @brief for ID_WRITE_FLASH_HANDLER
 /// @param[in] input_data_size data to write must be a whole number of Flash sectors
-/// @param[in] input_parameter target Flash address (0 = start of Flash)
+/// (after decompression, if compressed)
+/// @param[in] input_parameter target Flash address (0 = start of Flash), plus
+/// WIFI_SETTINGS_WRITE_FLASH_COMPRESSED if the data is compressed, plus
+/// WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED if the client accepts that result
+/// @return 0 if written, WIFI_SETTINGS_WRITE_FLASH_UNCHANGED if the data was already in
+/// Flash (and the client asked for this), or a PICO_ERROR code
 int32_t wifi_settings_write_flash_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
@@ -52,6 +153,32 @@ int32_t wifi_settings_write_flash_handler(
         uint32_t* output_data_size,
         void* arg);
 
+#if WIFI_SETTINGS_REMOTE_MULTICAST_OTA
+/// @brief Returns true if the Flash range is within reusable Flash (or the A/B target),
+/// i.e. ID_WRITE_FLASH_HANDLER is allowed to write to it
+bool wifi_settings_can_write_flash(const wifi_settings_flash_range_t* fr);
+
+/// @brief Write part of one sector of Flash, for ID_MULTICAST_OTA_HANDLER
+/// @param[in] fr Flash range, which must be aligned to Flash pages, within one
+/// sector, and subject to the same restrictions as ID_WRITE_FLASH_HANDLER
+/// @param[in] data Data to write (fr->size bytes)
+/// @param[in] erase_sector If true, the sector is erased first (unless already erased);
+/// if false, the range must already be erased
+/// @return PICO_OK (also if the range already contained the data), or a PICO_ERROR code
+int wifi_settings_write_flash_pages(const wifi_settings_flash_range_t* fr,
+                                    const uint8_t* data, bool erase_sector);
+
+/// @brief for ID_MULTICAST_OTA_HANDLER
+/// @param[in] input_parameter WIFI_SETTINGS_MULTICAST_OTA_BEGIN, _STATUS or _END
+int32_t wifi_settings_multicast_ota_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+#endif
+
 /// @brief for ID_OTA_FIRMWARE_UPDATE_HANDLER (first stage)
 int32_t wifi_settings_ota_firmware_update_handler1(
         uint8_t msg_type,
@@ -69,4 +196,39 @@ void wifi_settings_ota_firmware_update_handler2(
         int32_t input_parameter,
         void* arg);
 
+#if PICO_RP2350
+/// @brief Handler for ID_AB_OTA_TARGET_HANDLER: returns the other partition of the
+/// A/B pair (wifi_settings_flash_range_t)
+int32_t wifi_settings_ab_ota_target_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_AB_OTA_HANDLER (first stage)
+/// @param[in] input_parameter WIFI_SETTINGS_AB_OTA_REBOOT
+int32_t wifi_settings_ab_ota_handler1(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg);
+
+/// @brief for ID_AB_OTA_HANDLER (second stage)
+void wifi_settings_ab_ota_handler2(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        void* arg);
+
+/// @brief Keep the current firmware, if it was installed by an A/B OTA update and
+/// the bootrom is waiting for it to be accepted ("try before you buy").
+/// Called by wifi_settings_remote_init().
+void wifi_settings_ab_ota_buy();
+#endif
+
 #endif
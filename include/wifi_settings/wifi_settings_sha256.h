@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This header file selects the SHA-256 implementation used by the remote
+ * service: the SHA-256 hardware on RP2350 (via pico_sha256) if
+ * WIFI_SETTINGS_SHA256_HARDWARE is set, or mbedtls otherwise.
+ * This header file is intended only for internal use.
+ * You would normally only need to include "wifi_settings.h" in your application.
+ *
+ */
+
+#ifndef _WIFI_SETTINGS_SHA256_H_
+#define _WIFI_SETTINGS_SHA256_H_
+
+#include "wifi_settings/wifi_settings_configuration.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WIFI_SETTINGS_SHA256_DIGEST_SIZE 32
+
+#if WIFI_SETTINGS_SHA256_HARDWARE
+#include "pico/sha256.h"
+
+// The hardware computes one hash at a time: wifi_settings_sha256_starts waits
+// until it is available, and it is released by wifi_settings_sha256_finish
+#define WIFI_SETTINGS_SHA256_SINGLE_STATE 1
+
+typedef pico_sha256_state_t wifi_settings_sha256_context_t;
+
+static inline void wifi_settings_sha256_init(wifi_settings_sha256_context_t* ctx) {
+    memset(ctx, 0, sizeof(wifi_settings_sha256_context_t));
+}
+
+static inline void wifi_settings_sha256_free(wifi_settings_sha256_context_t* ctx) {
+}
+
+static inline int wifi_settings_sha256_starts(wifi_settings_sha256_context_t* ctx) {
+    // DMA is not used, so that no DMA channel is needed
+    return pico_sha256_start_blocking(ctx, SHA256_BIG_ENDIAN, false);
+}
+
+static inline int wifi_settings_sha256_update(wifi_settings_sha256_context_t* ctx,
+                                              const uint8_t* data, size_t size) {
+    pico_sha256_update_blocking(ctx, data, size);
+    return 0;
+}
+
+static inline int wifi_settings_sha256_finish(wifi_settings_sha256_context_t* ctx,
+                                              uint8_t* digest) {
+    sha256_result_t result;
+    pico_sha256_finish(ctx, &result);
+    memcpy(digest, result.bytes, WIFI_SETTINGS_SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+#else
+#include "mbedtls/sha256.h"
+#include "mbedtls/version.h"
+
+#if MBEDTLS_VERSION_MAJOR < 3
+// These names were changed in mbedlts 3.x.x
+#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
+#define mbedtls_sha256_update mbedtls_sha256_update_ret
+#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
+#endif
+
+#ifdef MBEDTLS_SHA256_ALT
+// mbedtls is also using the SHA-256 hardware, so the same restriction applies
+#define WIFI_SETTINGS_SHA256_SINGLE_STATE 1
+#else
+#define WIFI_SETTINGS_SHA256_SINGLE_STATE 0
+#endif
+
+typedef mbedtls_sha256_context wifi_settings_sha256_context_t;
+
+static inline void wifi_settings_sha256_init(wifi_settings_sha256_context_t* ctx) {
+    mbedtls_sha256_init(ctx);
+}
+
+static inline void wifi_settings_sha256_free(wifi_settings_sha256_context_t* ctx) {
+    mbedtls_sha256_free(ctx);
+}
+
+static inline int wifi_settings_sha256_starts(wifi_settings_sha256_context_t* ctx) {
+    return mbedtls_sha256_starts(ctx, 0);
+}
+
+static inline int wifi_settings_sha256_update(wifi_settings_sha256_context_t* ctx,
+                                              const uint8_t* data, size_t size) {
+    return mbedtls_sha256_update(ctx, data, size);
+}
+
+static inline int wifi_settings_sha256_finish(wifi_settings_sha256_context_t* ctx,
+                                              uint8_t* digest) {
+    return mbedtls_sha256_finish(ctx, digest);
+}
+
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+static inline void wifi_settings_sha256_clone(wifi_settings_sha256_context_t* dst,
+                                              const wifi_settings_sha256_context_t* src) {
+    mbedtls_sha256_clone(dst, src);
+}
+#endif
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 #include "activity_ping.h"
 #include "activity_dns_test.h"
 #include "activity_telnet_test.h"
+#include "activity_throughput_test.h"
 #include "user_interface.h"
 
 #include "pico/stdlib.h"
@@ -25,6 +26,7 @@ void activity_connection_test() {
     ui_menu_add_item(&menu, activity_ping, "Ping (test network connection)");
     ui_menu_add_item(&menu, activity_dns_test, "DNS (test name server connection)");
     ui_menu_add_item(&menu, activity_telnet_test, "Telnet (test TCP connection)");
+    ui_menu_add_item(&menu, activity_throughput_test, "Throughput (test TCP speed)");
     const int choice = ui_menu_show(&menu, NULL);
     const callback_t callback = ui_menu_get_arg(&menu, choice);
     if (callback) {
@@ -11,11 +11,154 @@
 #include "user_interface.h"
 #include "dns_lookup.h"
 
+#include "lwip/dns.h"
+
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+
 
+#define DEFAULT_NUM_QUERIES     5
+#define MAX_NUM_QUERIES         100
+#define QUERY_TIMEOUT_MS        5000
 
 static char g_lookup_address[MAX_EDIT_LINE_LENGTH];
+static int g_num_queries = DEFAULT_NUM_QUERIES;
+
+typedef struct timing_stats_t {
+    uint        num_ok;
+    uint        num_failed;
+    uint32_t    min_time_us;
+    uint32_t    max_time_us;
+    uint64_t    sum_time_us;
+} timing_stats_t;
+
+static void record_time(timing_stats_t* stats, uint32_t time_us) {
+    if ((stats->num_ok == 0) || (time_us < stats->min_time_us)) {
+        stats->min_time_us = time_us;
+    }
+    if (time_us > stats->max_time_us) {
+        stats->max_time_us = time_us;
+    }
+    stats->sum_time_us += time_us;
+    stats->num_ok++;
+}
+
+static void print_ms(uint32_t time_us) {
+    printf("%u.%03u ms", (uint) (time_us / 1000), (uint) (time_us % 1000));
+}
+
+static void print_stats(const char* name, const timing_stats_t* stats) {
+    printf("%s: %u ok, %u failed", name, stats->num_ok, stats->num_failed);
+    if (stats->num_ok != 0) {
+        printf(", min ");
+        print_ms(stats->min_time_us);
+        printf(", avg ");
+        print_ms((uint32_t) (stats->sum_time_us / stats->num_ok));
+        printf(", max ");
+        print_ms(stats->max_time_us);
+    }
+    printf("\n");
+}
+
+static void print_address(const ip_addr_t* addr) {
+    char addr_str[IP4ADDR_STRLEN_MAX + 1];
+    addr_str[0] = '\0';
+    ipaddr_ntoa_r(addr, addr_str, sizeof(addr_str));
+    printf("%s", addr_str);
+}
+
+static bool ask_for_number_of_queries() {
+    printf("How many times should it be looked up? (1 to %d)\n", MAX_NUM_QUERIES);
+    char number[10];
+    snprintf(number, sizeof(number), "%d", g_num_queries);
+    if (!ui_text_entry(number, sizeof(number))) {
+        return false; // cancel
+    }
+    char* end = NULL;
+    const long value = strtol(number, &end, 10);
+    if ((value < 1) || (value > MAX_NUM_QUERIES) || (end[0] != '\0')) {
+        printf("Invalid number\n");
+        ui_wait_for_the_user();
+        return false;
+    }
+    g_num_queries = (int) value;
+    return true;
+}
+
+static void test_resolver() {
+    // Use the lwIP resolver, as applications do: the first lookup
+    // usually goes to a DNS server, and later lookups are answered from the cache
+    printf("\nUsing the lwIP resolver:\n");
+    timing_stats_t cached_stats;
+    timing_stats_t uncached_stats;
+    memset(&cached_stats, 0, sizeof(cached_stats));
+    memset(&uncached_stats, 0, sizeof(uncached_stats));
+    for (int i = 0; i < g_num_queries; i++) {
+        ip_addr_t addr;
+        bool is_cached = false;
+        uint32_t time_us = 0;
+        const bool found = dns_lookup_timed(g_lookup_address, &addr, &is_cached, &time_us);
+        timing_stats_t* stats = is_cached ? &cached_stats : &uncached_stats;
+        printf(" %2d: ", i + 1);
+        if (found) {
+            print_address(&addr);
+            record_time(stats, time_us);
+        } else {
+            printf("not found");
+            stats->num_failed++;
+        }
+        printf(" in ");
+        print_ms(time_us);
+        printf(" (%s)\n", is_cached ? "cached" : "from server");
+        fflush(stdout);
+    }
+    print_stats("From server", &uncached_stats);
+    print_stats("Cached", &cached_stats);
+}
+
+static void test_servers() {
+    // Query each DNS server directly, so that the answer never comes from the lwIP cache
+    for (u8_t server_index = 0; server_index < DNS_MAX_SERVERS; server_index++) {
+        const ip_addr_t* server = dns_getserver(server_index);
+        if ((!server) || ip_addr_isany(server)) {
+            continue;
+        }
+        printf("\nDNS server %d (", (int) server_index + 1);
+        print_address(server);
+        printf("):\n");
+
+        timing_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        for (int i = 0; i < g_num_queries; i++) {
+            ip_addr_t addr;
+            int rcode = 0;
+            uint32_t time_us = 0;
+            printf(" %2d: ", i + 1);
+            if (!dns_query_server(server, g_lookup_address, &addr,
+                                  QUERY_TIMEOUT_MS, &rcode, &time_us)) {
+                printf("no reply\n");
+                stats.num_failed++;
+                continue;
+            }
+            if (rcode != 0) {
+                printf("error code %d", rcode);
+                stats.num_failed++;
+            } else if (ip_addr_isany(&addr)) {
+                printf("no address");
+                stats.num_failed++;
+            } else {
+                print_address(&addr);
+                record_time(&stats, time_us);
+            }
+            printf(" in ");
+            print_ms(time_us);
+            printf("\n");
+            fflush(stdout);
+        }
+        print_stats("Summary", &stats);
+    }
+}
 
 void activity_dns_test() {
     ui_clear();
@@ -26,18 +169,13 @@ void activity_dns_test() {
     if ((!ui_text_entry(g_lookup_address, sizeof(g_lookup_address))) || (strlen(g_lookup_address) == 0)) {
         return; // cancel
     }
-
-    printf("Sending request...\n");
-
-    ip_addr_t addr;
-    if (!dns_lookup(g_lookup_address, &addr)) {
-        printf("%s was not found\n", g_lookup_address);
-    } else {
-        // Decode the address
-        char addr_str[IP4ADDR_STRLEN_MAX + 1];
-        addr_str[0] = '\0';
-        ipaddr_ntoa_r(&addr, addr_str, sizeof(addr_str));
-        printf("%s is %s\n", g_lookup_address, addr_str);
+    if (!ask_for_number_of_queries()) {
+        return; // cancel
     }
+
+    printf("Sending requests...\n");
+    test_resolver();
+    test_servers();
+    printf("\n");
     ui_wait_for_the_user();
 }
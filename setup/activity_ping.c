@@ -26,65 +26,135 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
-#define PING_DATA_SIZE      24
-#define IPV4_ADDRESS_SIZE   (IP4ADDR_STRLEN_MAX + 1)
-#define IN_FLIGHT_MASK_SIZE 7
+#define PING_DEFAULT_DATA_SIZE      24
+#define PING_MAX_DATA_SIZE          1472    // 1500 byte MTU minus IP and ICMP headers
+#define PING_DEFAULT_INTERVAL_MS    1000
+#define PING_MAX_INTERVAL_MS        60000
+#define PING_TIMEOUT_MS             1000    // flood mode: send again if there is no reply
+#define PING_MAX_COUNT              100000
+#define PING_WINDOW_SIZE            16      // must be a power of two
+#define PING_HISTOGRAM_SIZE         12
+#define IPV4_ADDRESS_SIZE           (IP4ADDR_STRLEN_MAX + 1)
 
 static char g_ping_address[IPV4_ADDRESS_SIZE];
+static int g_ping_count = 0;
+static int g_ping_interval_ms = PING_DEFAULT_INTERVAL_MS;
+static int g_ping_data_size = PING_DEFAULT_DATA_SIZE;
 
-typedef union ping_t {
-    struct icmp_echo_hdr    header;
-    uint8_t                 bytes[sizeof(struct icmp_echo_hdr) + PING_DATA_SIZE];
-} ping_t;
+typedef struct ping_stats_t {
+    uint                    num_received;
+    uint                    num_late;
+    uint32_t                min_rtt_us;
+    uint32_t                max_rtt_us;
+    uint64_t                sum_rtt_us;
+    uint64_t                sum_sq_rtt_us;
+    uint32_t                previous_rtt_us;
+    uint                    jitter_histogram[PING_HISTOGRAM_SIZE];
+} ping_stats_t;
 
 typedef struct ping_data_t {
-    uint32_t                send_time;
+    uint32_t                send_time[PING_WINDOW_SIZE];
+    uint16_t                send_seq_num[PING_WINDOW_SIZE];
     uint16_t                seq_num;
     uint16_t                ping_id;
     uint                    in_flight;
+    uint                    num_sent;
     uint                    lost_counter;
+    uint16_t                data_size;
+    bool                    is_quiet;
+    ping_stats_t            stats;
 } ping_data_t;
 
 
+static uint get_window_mask(uint16_t seq_num) {
+    return 1 << (seq_num & (PING_WINDOW_SIZE - 1));
+}
+
 // This is based on the LWIP example contrib/apps/ping/ping.c
 static err_t ping_send(ping_data_t* ping_data, struct raw_pcb *raw, const ip_addr_t *addr) {
     struct pbuf *p;
     err_t err = ERR_MEM;
+    const u16_t ping_size = (u16_t) (sizeof(struct icmp_echo_hdr) + ping_data->data_size);
 
-    p = pbuf_alloc(PBUF_IP, (u16_t)sizeof(ping_t), PBUF_RAM);
+    p = pbuf_alloc(PBUF_IP, ping_size, PBUF_RAM);
     if (p) {
         if ((p->len == p->tot_len) && (p->next == NULL)) {
-            ping_t* ping = (ping_t *)p->payload;
+            struct icmp_echo_hdr* header = (struct icmp_echo_hdr *)p->payload;
+            uint8_t* data = (uint8_t*) &header[1];
 
             // create packet
-            memset(ping, 0, sizeof(ping_t));
-            ICMPH_TYPE_SET(&ping->header, ICMP_ECHO);
-            ICMPH_CODE_SET(&ping->header, 0);
-            ping->header.chksum = 0;
-            ping->header.id = ping_data->ping_id;
-            ping->header.seqno = lwip_htons(ping_data->seq_num);
-            ping->header.chksum = inet_chksum(&ping->header, sizeof(ping_t));
-
-            // send
-            err = raw_sendto(raw, p, addr);
-            ping_data->send_time = time_us_32();
-            ping_data->seq_num++;
+            memset(header, 0, sizeof(struct icmp_echo_hdr));
+            for (uint i = 0; i < ping_data->data_size; i++) {
+                data[i] = (uint8_t) i;
+            }
+            ICMPH_TYPE_SET(header, ICMP_ECHO);
+            ICMPH_CODE_SET(header, 0);
+            header->chksum = 0;
+            header->id = ping_data->ping_id;
+            header->seqno = lwip_htons(ping_data->seq_num);
+            header->chksum = inet_chksum(header, ping_size);
 
             // set "in flight" for each packet that's out there
-            const uint32_t mask = 1 << (ping_data->seq_num & IN_FLIGHT_MASK_SIZE);
+            const uint index = ping_data->seq_num & (PING_WINDOW_SIZE - 1);
+            const uint mask = get_window_mask(ping_data->seq_num);
             if (ping_data->in_flight & mask) {
                 // The bit should have been cleared - it wasn't. A packet was lost.
                 ping_data->lost_counter ++;
-            } else {
-                ping_data->in_flight |= mask;
             }
+            ping_data->in_flight |= mask;
+            ping_data->send_seq_num[index] = ping_data->seq_num;
+            ping_data->send_time[index] = time_us_32();
+
+            // send
+            err = raw_sendto(raw, p, addr);
+            ping_data->seq_num++;
+            ping_data->num_sent++;
         }
         pbuf_free(p);
     }
     return err;
 }
 
+static void ping_expire(ping_data_t* ping_data) {
+    // All packets in flight are counted as lost
+    for (uint i = 0; i < PING_WINDOW_SIZE; i++) {
+        if (ping_data->in_flight & (1 << i)) {
+            ping_data->lost_counter++;
+        }
+    }
+    ping_data->in_flight = 0;
+}
+
+static void ping_record_rtt(ping_stats_t* stats, uint32_t rtt_us) {
+    if ((stats->num_received == 0) || (rtt_us < stats->min_rtt_us)) {
+        stats->min_rtt_us = rtt_us;
+    }
+    if (rtt_us > stats->max_rtt_us) {
+        stats->max_rtt_us = rtt_us;
+    }
+    stats->sum_rtt_us += rtt_us;
+    stats->sum_sq_rtt_us += ((uint64_t) rtt_us) * rtt_us;
+
+    // Jitter is the difference between consecutive round trip times.
+    // Histogram bucket 0 is < 1 ms, bucket 1 is 1 ms, bucket 2 is 2 .. 3 ms, 3 is 4 .. 7 ms, etc.
+    if (stats->num_received != 0) {
+        const uint32_t jitter_us = (rtt_us > stats->previous_rtt_us) ?
+            (rtt_us - stats->previous_rtt_us) : (stats->previous_rtt_us - rtt_us);
+        uint bucket = 0;
+        for (uint32_t jitter_ms = jitter_us / 1000; jitter_ms != 0; jitter_ms >>= 1) {
+            bucket++;
+        }
+        if (bucket >= PING_HISTOGRAM_SIZE) {
+            bucket = PING_HISTOGRAM_SIZE - 1;
+        }
+        stats->jitter_histogram[bucket]++;
+    }
+    stats->previous_rtt_us = rtt_us;
+    stats->num_received++;
+}
+
 // This is based on the LWIP example contrib/apps/ping/ping.c
 static u8_t ping_recv(void *arg, struct raw_pcb *unused, struct pbuf *p, const ip_addr_t *addr) {
     const uint32_t capture_time = time_us_32();
@@ -99,7 +169,7 @@ static u8_t ping_recv(void *arg, struct raw_pcb *unused, struct pbuf *p, const i
     // If possible, remove IP header and parse ICMP header
     if ((p->tot_len >= (PBUF_IP_HLEN + sizeof(struct icmp_echo_hdr)))
     && (pbuf_remove_header(p, PBUF_IP_HLEN) == 0)) {
-        ping_t* ping = (ping_t *)p->payload;
+        struct icmp_echo_hdr* header = (struct icmp_echo_hdr *)p->payload;
 
         // Decode the address
         char source_addr_str[IPV4_ADDRESS_SIZE];
@@ -107,24 +177,38 @@ static u8_t ping_recv(void *arg, struct raw_pcb *unused, struct pbuf *p, const i
         ipaddr_ntoa_r(addr, source_addr_str, sizeof(source_addr_str));
 
         // Report the packet
-        if ((p->tot_len == sizeof(ping_t))
-        && (ICMPH_TYPE(&ping->header) == ICMP_ER)
-        && (ping->header.id == ping_data->ping_id)) {
-            uint16_t rx_seq_num = lwip_ntohs(ping->header.seqno);
-            printf("%d bytes from %s: icmp_seq=%d ttl=%d time=%u ms\n",
-                p->tot_len,
-                source_addr_str,
-                (int) rx_seq_num,
-                ttl,
-                (uint) (capture_time - ping_data->send_time) / 1000);
-
-            // clear "in flight" bit when the reply is received
-            const uint32_t mask = 1 << (ping_data->seq_num & IN_FLIGHT_MASK_SIZE);
-            ping_data->in_flight &= ~mask;
+        if ((p->tot_len == (sizeof(struct icmp_echo_hdr) + ping_data->data_size))
+        && (ICMPH_TYPE(header) == ICMP_ER)
+        && (header->id == ping_data->ping_id)) {
+            const uint16_t rx_seq_num = lwip_ntohs(header->seqno);
+            const uint index = rx_seq_num & (PING_WINDOW_SIZE - 1);
+            const uint mask = get_window_mask(rx_seq_num);
+
+            if ((ping_data->in_flight & mask) && (ping_data->send_seq_num[index] == rx_seq_num)) {
+                // clear "in flight" bit when the reply is received
+                ping_data->in_flight &= ~mask;
+                const uint32_t rtt_us = capture_time - ping_data->send_time[index];
+                ping_record_rtt(&ping_data->stats, rtt_us);
+                if (!ping_data->is_quiet) {
+                    printf("%d bytes from %s: icmp_seq=%d ttl=%d time=%u.%03u ms\n",
+                        p->tot_len,
+                        source_addr_str,
+                        (int) rx_seq_num,
+                        ttl,
+                        (uint) (rtt_us / 1000), (uint) (rtt_us % 1000));
+                }
+            } else {
+                // duplicate, or the reply arrived after the packet was counted as lost
+                ping_data->stats.num_late++;
+                if (!ping_data->is_quiet) {
+                    printf("%d bytes from %s: icmp_seq=%d ttl=%d (late or duplicate)\n",
+                        p->tot_len, source_addr_str, (int) rx_seq_num, ttl);
+                }
+            }
         } else {
             printf("from %s: type %d code %d length %d\n",
-                source_addr_str, ICMPH_TYPE(&ping->header),
-                ICMPH_CODE(&ping->header), p->tot_len);
+                source_addr_str, ICMPH_TYPE(header),
+                ICMPH_CODE(header), p->tot_len);
         }
         pbuf_free(p);
         fflush(stdout);
@@ -135,6 +219,107 @@ static u8_t ping_recv(void *arg, struct raw_pcb *unused, struct pbuf *p, const i
     return 0;
 }
 
+static uint32_t isqrt64(uint64_t value) {
+    // Bitwise integer square root
+    uint64_t result = 0;
+    uint64_t bit = ((uint64_t) 1) << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= (result + bit)) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t) result;
+}
+
+static void print_ms(const char* name, uint32_t time_us, const char* separator) {
+    printf("%s %u.%03u ms%s", name, (uint) (time_us / 1000), (uint) (time_us % 1000), separator);
+}
+
+static void ping_print_stats(const ping_data_t* ping_data) {
+    const ping_stats_t* stats = &ping_data->stats;
+    const uint num_lost = ping_data->lost_counter;
+
+    printf("\n--- %s ping statistics ---\n", g_ping_address);
+    printf("%u packets sent, %u received, %u lost", ping_data->num_sent, stats->num_received, num_lost);
+    if (ping_data->num_sent != 0) {
+        printf(" (%u%%)", (num_lost * 100) / ping_data->num_sent);
+    }
+    if (stats->num_late != 0) {
+        printf(", %u late or duplicate", stats->num_late);
+    }
+    printf("\n");
+    if (stats->num_received == 0) {
+        return;
+    }
+
+    // Variance is E[x^2] - E[x]^2
+    const uint64_t mean_us = stats->sum_rtt_us / stats->num_received;
+    const uint64_t mean_sq_us = stats->sum_sq_rtt_us / stats->num_received;
+    const uint32_t stddev_us = (mean_sq_us > (mean_us * mean_us)) ?
+        isqrt64(mean_sq_us - (mean_us * mean_us)) : 0;
+    print_ms("rtt min", stats->min_rtt_us, ",");
+    print_ms(" avg", (uint32_t) mean_us, ",");
+    print_ms(" max", stats->max_rtt_us, ",");
+    print_ms(" stddev", stddev_us, "\n");
+
+    if (stats->num_received < 2) {
+        return;
+    }
+    printf("jitter between consecutive replies:\n");
+    uint max_count = 1;
+    for (uint i = 0; i < PING_HISTOGRAM_SIZE; i++) {
+        if (stats->jitter_histogram[i] > max_count) {
+            max_count = stats->jitter_histogram[i];
+        }
+    }
+    for (uint i = 0; i < PING_HISTOGRAM_SIZE; i++) {
+        const uint count = stats->jitter_histogram[i];
+        if (i == 0) {
+            printf("       < 1 ms");
+        } else if (i == (PING_HISTOGRAM_SIZE - 1)) {
+            printf("    >= %4u ms", 1u << (i - 1));
+        } else {
+            printf(" %4u..%4u ms", 1u << (i - 1), (1u << i) - 1);
+        }
+        printf(" %6u ", count);
+        const uint bar_size = (count * 40 + max_count - 1) / max_count;
+        for (uint j = 0; j < bar_size; j++) {
+            printf("#");
+        }
+        printf("\n");
+    }
+}
+
+static bool ask_for_number(const char* caption, int* value, int min_value, int max_value) {
+    while (true) {
+        printf("\n%s: range is %d to %d\n", caption, min_value, max_value);
+        char number[10];
+        snprintf(number, sizeof(number), "%d", *value);
+        if (!ui_text_entry(number, sizeof(number))) {
+            return false; // cancelled
+        }
+
+        char* end = number;
+        int new_value = (int) strtol(number, &end, 0);
+        if ((end[0] == '\0') && (number != end)
+        && (new_value >= min_value) && (new_value <= max_value)) {
+            *value = new_value;
+            return true;
+        }
+        printf("\nThat's not a valid number. Try again? ");
+        if (!ui_choose_yes_or_no()) {
+            return false;
+        }
+    }
+}
+
 
 void activity_ping() {
     ui_clear();
@@ -155,6 +340,17 @@ void activity_ping() {
         return;
     }
  
+    if ((!ask_for_number("Number of pings to send, or 0 to ping until a key is pressed",
+                         &g_ping_count, 0, PING_MAX_COUNT))
+    || (!ask_for_number("Interval between pings in milliseconds, or 0 for flood mode\n"
+                        "(send each ping as soon as the previous reply arrives)",
+                         &g_ping_interval_ms, 0, PING_MAX_INTERVAL_MS))
+    || (!ask_for_number("Ping data size in bytes",
+                         &g_ping_data_size, 0, PING_MAX_DATA_SIZE))) {
+        return; // cancel
+    }
+    const bool is_flood = (g_ping_interval_ms == 0);
+
     cyw43_arch_lwip_begin();
     struct raw_pcb* ping_pcb = raw_new(IP_PROTO_ICMP);
     cyw43_arch_lwip_end();
@@ -167,23 +363,43 @@ void activity_ping() {
     ping_data_t ping_data;
     memset(&ping_data, 0, sizeof(ping_data));
     ping_data.seq_num = 1;
-    ping_data.send_time = time_us_32();
-    ping_data.ping_id = (uint16_t) ping_data.send_time;
+    ping_data.ping_id = (uint16_t) time_us_32();
+    ping_data.data_size = (uint16_t) g_ping_data_size;
+    ping_data.is_quiet = is_flood;
 
     cyw43_arch_lwip_begin();
     raw_recv(ping_pcb, ping_recv, &ping_data);
     raw_bind(ping_pcb, IP_ADDR_ANY);
     cyw43_arch_lwip_end();
 
-    printf("Press a key to stop pinging:\n");
+    printf("\nPress a key to stop pinging:\n");
     absolute_time_t next_ping_time = make_timeout_time_ms(0);
+    absolute_time_t start_time = get_absolute_time();
     uint previous = 0;
     while (ui_getchar_timeout_us(100) < 0) {
-        if (time_reached(next_ping_time)) {
-            next_ping_time = delayed_by_ms(next_ping_time, 1000);
+        // In flood mode, send as soon as there is no packet in flight, or after a timeout
+        const bool is_count_reached = (g_ping_count != 0) && (ping_data.num_sent >= (uint) g_ping_count);
+        const bool is_reply_pending = (ping_data.in_flight != 0);
+        if (is_count_reached) {
+            if ((!is_reply_pending) || time_reached(next_ping_time)) {
+                break; // all replies received, or timed out waiting for them
+            }
+        } else if (time_reached(next_ping_time) || (is_flood && !is_reply_pending)) {
+            next_ping_time = is_flood ?
+                make_timeout_time_ms(PING_TIMEOUT_MS) :
+                delayed_by_ms(next_ping_time, g_ping_interval_ms);
             cyw43_arch_lwip_begin();
+            if (is_flood) {
+                // Any reply to the previous packet is now too late
+                ping_expire(&ping_data);
+            }
             err_t err = ping_send(&ping_data, ping_pcb, &addr);
             cyw43_arch_lwip_end();
+            if ((g_ping_count != 0) && (ping_data.num_sent >= (uint) g_ping_count)
+            && (g_ping_interval_ms < PING_TIMEOUT_MS)) {
+                // wait for the final reply
+                next_ping_time = make_timeout_time_ms(PING_TIMEOUT_MS);
+            }
             if (err == ERR_RTE) {
                 printf("Unable to send, no route to host\n");
             } else if (err != 0) {
@@ -191,12 +407,21 @@ void activity_ping() {
             } else if (ping_data.lost_counter != previous) {
                 printf("%u packets sent with no reply\n", ping_data.lost_counter);
                 previous = ping_data.lost_counter;
+            } else if (is_flood && ((ping_data.num_sent % 100) == 0)) {
+                printf("\r%u sent, %u received ", ping_data.num_sent, ping_data.stats.num_received);
+                fflush(stdout);
             }
         }
     }
+    const uint32_t elapsed_ms = (uint32_t) (absolute_time_diff_us(start_time, get_absolute_time()) / 1000);
 
     cyw43_arch_lwip_begin();
     raw_recv(ping_pcb, NULL, NULL);
     raw_remove(ping_pcb);
     cyw43_arch_lwip_end();
+
+    ping_expire(&ping_data);
+    ping_print_stats(&ping_data);
+    printf("time %u ms\n\n", (uint) elapsed_ms);
+    ui_wait_for_the_user();
 }
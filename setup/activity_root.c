@@ -8,6 +8,7 @@
 
 #include "activity_root.h"
 #include "activity_scan_for_a_hotspot.h"
+#include "activity_site_survey.h"
 #include "activity_edit_hotspots.h"
 #include "activity_connection_test.h"
 #include "activity_force_disconnect_reconnect.h"
@@ -60,6 +61,8 @@ void activity_root() {
                                 "Scan for a hotspot");
                     ui_menu_add_item(&menu, activity_edit_hotspots, 
                                 "View and edit known hotspots");
+                    ui_menu_add_item(&menu, activity_site_survey,
+                                "Survey hotspot signal strength");
                     ui_menu_add_item(&menu, activity_connection_test,
                                 "Perform connection test");
                     ui_menu_add_item(&menu, activity_force_disconnect_reconnect,
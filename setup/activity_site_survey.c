@@ -0,0 +1,404 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Site survey activity (repeated scans with signal strength statistics)
+ */
+
+#include "activity_site_survey.h"
+#include "user_interface.h"
+#include "file_operations.h"
+#include "wifi_slots.h"
+
+#include "wifi_settings.h"
+#include "wifi_settings/wifi_settings_configuration.h"
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SURVEY_DEFAULT_NUM_SCANS        5
+#define SURVEY_MAX_NUM_SCANS            50
+#define SURVEY_SSID_COLUMNS             20
+
+// Leave space in the menu for the "Save" option
+#define MAX_SURVEY_RESULTS              (MAX_MENU_ITEMS - 3)
+
+// Hash table of results, indexed by BSSID. The size must be a power of two,
+// and larger than MAX_SURVEY_RESULTS, so that there is always an empty entry.
+#define SURVEY_TABLE_SIZE               256
+
+typedef struct survey_entry_t {
+    uint8_t bssid[WIFI_BSSID_SIZE];
+    char ssid[WIFI_SSID_SIZE];
+    bool is_used;
+    bool is_bssid;
+    bool is_open;
+    uint8_t channel;
+    int min_rssi;
+    int max_rssi;
+    int rssi_sum;
+    int num_samples;
+    int num_scans_seen;
+    int last_scan_seen;
+} survey_entry_t;
+
+typedef struct survey_data_t {
+    menu_t menu;
+    survey_entry_t table[SURVEY_TABLE_SIZE];
+    survey_entry_t* ranked[MAX_SURVEY_RESULTS];
+    int num_entries;
+    int num_scans;
+    int scan_number;
+    bool is_full;
+} survey_data_t;
+
+// Menu argument for the "Save" option (any unique address will do)
+static const char save_ranking_option = 0;
+
+static uint32_t hash_bssid(const uint8_t* bssid) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < WIFI_BSSID_SIZE; i++) {
+        hash = (hash ^ bssid[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static survey_entry_t* find_survey_entry(survey_data_t* survey, const uint8_t* bssid) {
+    // Linear probing: the table is never full, so an unused entry is always found
+    uint32_t index = hash_bssid(bssid);
+    while (true) {
+        survey_entry_t* entry = &survey->table[index & (SURVEY_TABLE_SIZE - 1)];
+        if (!entry->is_used) {
+            if (survey->num_entries >= MAX_SURVEY_RESULTS) {
+                // No space for more results
+                survey->is_full = true;
+                return NULL;
+            }
+            entry->is_used = true;
+            memcpy(entry->bssid, bssid, WIFI_BSSID_SIZE);
+            survey->ranked[survey->num_entries] = entry;
+            survey->num_entries++;
+            return entry;
+        }
+        if (memcmp(entry->bssid, bssid, WIFI_BSSID_SIZE) == 0) {
+            return entry;
+        }
+        index++;
+    }
+}
+
+static int setup_survey_callback(void* arg, const cyw43_ev_scan_result_t* raw_result) {
+    survey_data_t* survey = (survey_data_t*) arg;
+    survey_entry_t* entry = find_survey_entry(survey, raw_result->bssid);
+    if (!entry) {
+        return 0;
+    }
+    const int rssi = (int) raw_result->rssi;
+
+    if (entry->num_samples == 0) {
+        // First time this BSSID has been seen
+        if ((raw_result->ssid_len == 0) || (raw_result->ssid_len >= WIFI_SSID_SIZE)) {
+            // Invalid SSID - use BSSID only
+            entry->is_bssid = true;
+        } else {
+            memcpy(entry->ssid, raw_result->ssid, raw_result->ssid_len);
+            entry->ssid[(int) raw_result->ssid_len] = '\0';
+        }
+        entry->is_open = (raw_result->auth_mode == CYW43_AUTH_OPEN);
+        entry->min_rssi = rssi;
+        entry->max_rssi = rssi;
+        entry->channel = (uint8_t) raw_result->channel;
+    }
+
+    // Update statistics: the channel is the one where the signal was strongest
+    if (rssi >= entry->max_rssi) {
+        entry->max_rssi = rssi;
+        entry->channel = (uint8_t) raw_result->channel;
+    }
+    if (rssi < entry->min_rssi) {
+        entry->min_rssi = rssi;
+    }
+    entry->rssi_sum += rssi;
+    entry->num_samples++;
+
+    // A BSSID may be reported more than once in each scan
+    if (entry->last_scan_seen != survey->scan_number) {
+        entry->last_scan_seen = survey->scan_number;
+        entry->num_scans_seen++;
+    }
+    return 0;
+}
+
+static int compare_survey_entries(const void* p1, const void* p2) {
+    const survey_entry_t* e1 = *((const survey_entry_t* const*) p1);
+    const survey_entry_t* e2 = *((const survey_entry_t* const*) p2);
+
+    // Most stable first (seen in the most scans)
+    if (e1->num_scans_seen != e2->num_scans_seen) {
+        return e2->num_scans_seen - e1->num_scans_seen;
+    }
+    // Then strongest average signal; compare sum1 / n1 with sum2 / n2 without division
+    const int64_t avg1 = ((int64_t) e1->rssi_sum) * e2->num_samples;
+    const int64_t avg2 = ((int64_t) e2->rssi_sum) * e1->num_samples;
+    if (avg1 != avg2) {
+        return (avg2 > avg1) ? 1 : -1;
+    }
+    // Then strongest weakest signal
+    return e2->min_rssi - e1->min_rssi;
+}
+
+static int get_average_rssi(const survey_entry_t* entry) {
+    // Round to the nearest integer (rssi_sum is negative)
+    return (entry->rssi_sum - (entry->num_samples / 2)) / entry->num_samples;
+}
+
+static bool wait_for_scan(const char* message) {
+    while (cyw43_wifi_scan_active(&cyw43_state)) {
+        if (ui_waiting_check_abort()) {
+            printf("\nError: interrupted while waiting %s.\n", message);
+            ui_wait_for_the_user();
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool do_setup_survey(survey_data_t* survey) {
+    // Wait for any existing scan to finish (just in case wifi-settings was doing a scan)
+    printf("\nScanning: ");
+    fflush(stdout);
+    if (!wait_for_scan("for another scan to finish")) {
+        return false;
+    }
+
+    for (survey->scan_number = 1; survey->scan_number <= survey->num_scans; survey->scan_number++) {
+        printf("\rScanning: %d of %d, %d hotspots found ",
+               survey->scan_number, survey->num_scans, survey->num_entries);
+        fflush(stdout);
+
+        cyw43_wifi_scan_options_t opts;
+        memset(&opts, 0, sizeof(opts));
+        int rc = cyw43_wifi_scan(&cyw43_state, &opts, survey, setup_survey_callback);
+        if (rc != PICO_OK) {
+            printf("\nError: cyw43_wifi_scan returned error code %d\n", rc);
+            ui_wait_for_the_user();
+            return false;
+        }
+        if (!wait_for_scan("for scan results")) {
+            return false;
+        }
+    }
+    printf("\r");
+
+    // Rank the results
+    qsort(survey->ranked, survey->num_entries, sizeof(survey_entry_t*), compare_survey_entries);
+    return true;
+}
+
+static int ask_for_number_of_scans() {
+    while (true) {
+        printf("\nHow many scans should be done? Range is 1 to %d\n"
+               "More scans take longer, but show which hotspots are stable.\n",
+               SURVEY_MAX_NUM_SCANS);
+        char number[10];
+        snprintf(number, sizeof(number), "%d", SURVEY_DEFAULT_NUM_SCANS);
+        if (!ui_text_entry(number, sizeof(number))) {
+            return 0; // cancelled
+        }
+
+        char* end = number;
+        int new_value = (int) strtol(number, &end, 0);
+        if ((end[0] == '\0') && (number != end)
+        && (new_value >= 1) && (new_value <= SURVEY_MAX_NUM_SCANS)) {
+            return new_value;
+        }
+        printf("\nThat's not a valid number of scans. Try again? ");
+        if (!ui_choose_yes_or_no()) {
+            return 0;
+        }
+    }
+}
+
+static void get_bssid_text(const survey_entry_t* entry, char* bssid_text) {
+    wifi_slots_convert_string_to_bssid(entry->bssid, bssid_text);
+}
+
+static bool is_match(const survey_entry_t* entry, const wifi_slot_item_t* item) {
+    if (item->is_bssid) {
+        char bssid_text[BSSID_AS_TEXT_SIZE];
+        get_bssid_text(entry, bssid_text);
+        return strcmp(bssid_text, item->ssid) == 0;
+    }
+    return (!entry->is_bssid) && (strcmp(entry->ssid, item->ssid) == 0);
+}
+
+static bool save_slots(file_handle_t* fh, wifi_slot_data_t* slot_data) {
+    wifi_slots_renumber(slot_data);
+    if (!wifi_slots_save(fh, slot_data)) {
+        ui_file_full_error();
+        return false;
+    }
+    if (ui_file_save(fh)) {
+        // reconnect with the new settings
+        wifi_settings_connect();
+    }
+    return true;
+}
+
+static void save_ranking(survey_data_t* survey, file_handle_t* fh, wifi_slot_data_t* slot_data) {
+    // Each known hotspot takes the rank of the best result that matches it.
+    // Hotspots which were not found go last, in their current order.
+    bool any_found = false;
+    for (int slot_index = 0; slot_index < slot_data->num_items; slot_index++) {
+        wifi_slot_item_t* item = &slot_data->item[slot_index];
+        item->priority = MAX_SURVEY_RESULTS + item->index_in_file;
+        for (int rank = 0; rank < survey->num_entries; rank++) {
+            if (is_match(survey->ranked[rank], item)) {
+                item->priority = rank;
+                any_found = true;
+                break;
+            }
+        }
+    }
+    if (!any_found) {
+        printf("None of the known hotspots were found by the survey, so their order\n"
+               "will not be changed.\n\n");
+        ui_wait_for_the_user();
+        return;
+    }
+    wifi_slots_renumber(slot_data);
+
+    printf("The known hotspots will be renumbered in this order:\n");
+    for (int slot_index = 0; slot_index < slot_data->num_items; slot_index++) {
+        const wifi_slot_item_t* item = &slot_data->item[slot_index];
+        printf(" %s%d=%s%s\n",
+               item->is_bssid ? "bssid" : "ssid", slot_index + 1, item->ssid,
+               (item->priority >= MAX_SURVEY_RESULTS) ? " (not found)" : "");
+    }
+    printf("\nSave the new order? ");
+    if (!ui_choose_yes_or_no()) {
+        return;
+    }
+    save_slots(fh, slot_data);
+}
+
+static void pin_to_bssid(survey_entry_t* entry, file_handle_t* fh, wifi_slot_data_t* slot_data) {
+    char bssid_text[BSSID_AS_TEXT_SIZE];
+    get_bssid_text(entry, bssid_text);
+
+    // Find the known hotspot with this SSID or BSSID
+    for (int slot_index = 0; slot_index < slot_data->num_items; slot_index++) {
+        wifi_slot_item_t* item = &slot_data->item[slot_index];
+        if (!is_match(entry, item)) {
+            continue;
+        }
+        if (item->is_bssid) {
+            printf("bssid%d=%s is already known.\n\n", item->index_in_file, bssid_text);
+            ui_wait_for_the_user();
+            return;
+        }
+        printf("ssid%d=%s can be replaced by bssid%d=%s so that only this\n"
+               "access point is used. Other access points with the same SSID will be ignored.\n"
+               "Replace the SSID with the BSSID? ",
+               item->index_in_file, item->ssid, item->index_in_file, bssid_text);
+        if (!ui_choose_yes_or_no()) {
+            return;
+        }
+        item->is_bssid = true;
+        strcpy(item->ssid, bssid_text);
+        save_slots(fh, slot_data);
+        return;
+    }
+    printf("This hotspot is not known.\n"
+           "Use 'Scan for a hotspot' to add it.\n\n");
+    ui_wait_for_the_user();
+}
+
+void activity_site_survey() {
+
+    survey_data_t survey;
+    wifi_slot_data_t slot_data;
+    file_handle_t fh;
+
+    // stop the wifi-settings library using the hardware
+    wifi_settings_disconnect();
+
+    ui_clear();
+    const int num_scans = ask_for_number_of_scans();
+    if (num_scans == 0) {
+        return; // cancelled
+    }
+
+    // While user hasn't chosen an option
+    void* arg = NULL;
+    while (!arg) {
+        ui_clear();
+
+        // Reset all results
+        memset(&survey, 0, sizeof(survey_data_t));
+        ui_menu_init(&survey.menu, MENU_FLAG_ENABLE_RETRY | MENU_FLAG_ENABLE_CANCEL);
+        survey.num_scans = num_scans;
+
+        // Load all data from the file
+        file_load(&fh);
+        wifi_slots_load(&fh, &slot_data);
+
+        // Do the survey
+        if (!do_setup_survey(&survey)) {
+            return;
+        }
+
+        // Show a menu with the ranked results
+        for (int rank = 0; rank < survey.num_entries; rank++) {
+            const survey_entry_t* entry = survey.ranked[rank];
+            char bssid_text[BSSID_AS_TEXT_SIZE];
+            get_bssid_text(entry, bssid_text);
+            ui_menu_add_item(&survey.menu, survey.ranked[rank],
+                             "%-*.*s | %s | %3u | %4d/%4d/%4d | %2d/%2d",
+                             SURVEY_SSID_COLUMNS, SURVEY_SSID_COLUMNS,
+                             entry->is_bssid ? "<unnamed>" : entry->ssid,
+                             bssid_text, (unsigned) entry->channel,
+                             entry->min_rssi, get_average_rssi(entry), entry->max_rssi,
+                             entry->num_scans_seen, survey.num_scans);
+        }
+        if (survey.num_entries != 0) {
+            ui_menu_add_item(&survey.menu, (void*) &save_ranking_option,
+                             "Save this ranking as the order of known hotspots");
+        }
+
+        char caption[MAX_DESCRIPTION_SIZE];
+        if (survey.num_entries == 0) {
+            snprintf(caption, sizeof(caption),
+                "Sorry, no hotspots were found - please choose:\n");
+        } else {
+            snprintf(caption, sizeof(caption),
+                "%s %d, ranked (min/avg/max dB, scans seen):\n",
+                survey.is_full ? "Found more than" : "Found",
+                survey.num_entries);
+        }
+
+        int choice = ui_menu_show(&survey.menu, caption);
+
+        // if the choice is "cancel":
+        if (choice == MENU_ITEM_CANCEL) {
+            return; // give up
+        }
+        // if the choice is "Refresh", then arg == NULL, so the loop repeats
+        arg = ui_menu_get_arg(&survey.menu, choice);
+    }
+
+    // Clear screen
+    ui_clear();
+
+    if (arg == &save_ranking_option) {
+        save_ranking(&survey, &fh, &slot_data);
+    } else {
+        pin_to_bssid((survey_entry_t*) arg, &fh, &slot_data);
+    }
+}
@@ -0,0 +1,14 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Site survey activity (repeated scans with signal strength statistics)
+ */
+
+#ifndef ACTIVITY_SITE_SURVEY_H
+#define ACTIVITY_SITE_SURVEY_H
+
+void activity_site_survey();
+
+#endif
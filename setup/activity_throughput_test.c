@@ -0,0 +1,415 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test TCP throughput, like iperf
+ */
+
+
+#include "activity_throughput_test.h"
+#include "user_interface.h"
+#include "dns_lookup.h"
+
+#include "lwip/tcp.h"
+#include "lwip/stats.h"
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+#define DEFAULT_PORT            5001    // the default port for iperf version 2
+#define DEFAULT_DURATION_S      10
+#define MAX_DURATION_S          3600
+#define SEND_CHUNK_SIZE         TCP_MSS
+
+#if LWIP_STATS && TCP_STATS
+#define HAS_TCP_REXMIT_STATS    1
+#else
+#define HAS_TCP_REXMIT_STATS    0
+#endif
+
+static char g_throughput_address[MAX_EDIT_LINE_LENGTH];
+static char g_throughput_port[6];
+static int g_throughput_duration_s = DEFAULT_DURATION_S;
+
+// Data to be sent (all zero). tcp_write is used without TCP_WRITE_FLAG_COPY, so this must not change.
+static const uint8_t g_send_chunk[SEND_CHUNK_SIZE];
+
+typedef enum {
+    DIRECTION_SEND = 1 << 0,
+    DIRECTION_RECEIVE = 1 << 1,
+    DIRECTION_BOTH = DIRECTION_SEND | DIRECTION_RECEIVE,
+} direction_t;
+
+typedef struct throughput_data_t {
+    struct tcp_pcb* tcp_pcb;
+    struct tcp_pcb* listen_pcb;
+    direction_t     direction;
+    bool            connected;
+    bool            sending;
+    bool            finish;
+    uint64_t        bytes_sent;
+    uint64_t        bytes_received;
+    uint            retransmits;
+    uint            previous_retransmits;
+    absolute_time_t start_time;
+    absolute_time_t stop_time;
+} throughput_data_t;
+
+static void throughput_close(struct tcp_pcb* tcp_pcb) {
+    if (tcp_pcb != NULL) {
+        // disable all callbacks
+        tcp_arg(tcp_pcb, NULL);
+        tcp_sent(tcp_pcb, NULL);
+        tcp_recv(tcp_pcb, NULL);
+        tcp_err(tcp_pcb, NULL);
+        // close
+        if (tcp_close(tcp_pcb) != ERR_OK) {
+            tcp_abort(tcp_pcb);
+        }
+    }
+}
+
+static void throughput_try_to_send_more_bytes(throughput_data_t* throughput_data) {
+    // Fill the send buffer with large writes, then send all of it
+    if ((!throughput_data->sending) || (!throughput_data->tcp_pcb)) {
+        return;
+    }
+    struct tcp_pcb* tcp_pcb = throughput_data->tcp_pcb;
+    bool written = false;
+    while ((tcp_sndbuf(tcp_pcb) > 0) && (tcp_sndqueuelen(tcp_pcb) < TCP_SND_QUEUELEN)) {
+        uint send_size = tcp_sndbuf(tcp_pcb);
+        if (send_size > SEND_CHUNK_SIZE) {
+            send_size = SEND_CHUNK_SIZE;
+        }
+        err_t err = tcp_write(tcp_pcb, g_send_chunk, (u16_t) send_size, TCP_WRITE_FLAG_MORE);
+        if (err == ERR_MEM) {
+            break; // try again when more data has been sent
+        } else if (err != ERR_OK) {
+            printf("\nDisconnected, write error %d\n", err);
+            throughput_data->finish = true;
+            return;
+        }
+        written = true;
+    }
+    if (written) {
+        tcp_output(tcp_pcb);
+    }
+}
+
+static err_t throughput_sent(void *arg, struct tcp_pcb *tcp_pcb, u16_t len) {
+    // Called when sent data is acknowledged, so more data can be sent
+    throughput_data_t* throughput_data = (throughput_data_t*)arg;
+    if (!throughput_data) {
+        throughput_close(tcp_pcb);
+    } else {
+        throughput_data->bytes_sent += len;
+        throughput_try_to_send_more_bytes(throughput_data);
+    }
+    return ERR_OK;
+}
+
+static err_t throughput_recv(void *arg, struct tcp_pcb *tcp_pcb, struct pbuf *p, err_t err) {
+    // Called when a packet is received or when the connection is closed by the other side
+    // (see telnet_client_recv for the requirements for this callback)
+    throughput_data_t* throughput_data = (throughput_data_t*)arg;
+    if ((!p) || (!throughput_data)) {
+        if (p) {
+            pbuf_free(p);
+        }
+        if (throughput_data) {
+            if (!throughput_data->finish) {
+                printf("\nDisconnected by the other side\n");
+                throughput_data->finish = true;
+            }
+            throughput_data->tcp_pcb = NULL;
+        }
+        throughput_close(tcp_pcb);
+        return ERR_OK;
+    }
+
+    // Data is counted and discarded
+    throughput_data->bytes_received += p->tot_len;
+    tcp_recved(tcp_pcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static void throughput_err(void* arg, err_t err) {
+    // Called if there is a TCP error: the pcb has already been freed
+    throughput_data_t* throughput_data = (throughput_data_t*)arg;
+    if (throughput_data) {
+        if (!throughput_data->finish) {
+            printf("\nDisconnected, error %d\n", err);
+            throughput_data->finish = true;
+        }
+        throughput_data->tcp_pcb = NULL;
+    }
+}
+
+static void throughput_start(throughput_data_t* throughput_data, struct tcp_pcb* tcp_pcb) {
+    tcp_arg(tcp_pcb, throughput_data);
+    tcp_sent(tcp_pcb, throughput_sent);
+    tcp_recv(tcp_pcb, throughput_recv);
+    tcp_err(tcp_pcb, throughput_err);
+    tcp_nagle_disable(tcp_pcb);
+    throughput_data->tcp_pcb = tcp_pcb;
+    throughput_data->connected = true;
+    throughput_data->sending = (throughput_data->direction & DIRECTION_SEND) != 0;
+    throughput_data->start_time = get_absolute_time();
+    throughput_data->stop_time = delayed_by_ms(throughput_data->start_time,
+                                               g_throughput_duration_s * 1000);
+#if HAS_TCP_REXMIT_STATS
+    throughput_data->previous_retransmits = lwip_stats.tcp.rexmit;
+#endif
+    throughput_try_to_send_more_bytes(throughput_data);
+}
+
+static err_t throughput_connected(void *arg, struct tcp_pcb* tcp_pcb, err_t err) {
+    // Called when connected as a client
+    throughput_data_t* throughput_data = (throughput_data_t*)arg;
+    if (!throughput_data) {
+        return ERR_OK;
+    } else if (err != ERR_OK) {
+        printf("Connection failed, callback error = %d\n", err);
+        throughput_data->finish = true;
+        return ERR_OK;
+    }
+    throughput_start(throughput_data, tcp_pcb);
+    return ERR_OK;
+}
+
+static err_t throughput_accept(void *arg, struct tcp_pcb* tcp_pcb, err_t err) {
+    // Called when a client connects to the server
+    throughput_data_t* throughput_data = (throughput_data_t*)arg;
+    if ((err != ERR_OK) || (!tcp_pcb)) {
+        return ERR_VAL;
+    }
+    if ((!throughput_data) || throughput_data->connected) {
+        // Only one connection is accepted
+        tcp_abort(tcp_pcb);
+        return ERR_ABRT;
+    }
+    printf("Connected\n");
+    throughput_start(throughput_data, tcp_pcb);
+    return ERR_OK;
+}
+
+static void throughput_update_retransmits(throughput_data_t* throughput_data) {
+#if HAS_TCP_REXMIT_STATS
+    // lwip counts every retransmitted segment
+    throughput_data->retransmits += lwip_stats.tcp.rexmit - throughput_data->previous_retransmits;
+    throughput_data->previous_retransmits = lwip_stats.tcp.rexmit;
+#else
+    // Without lwip statistics, the retransmission counter for the oldest unacknowledged
+    // segment is sampled: this counts retransmission timeouts, but not fast retransmits
+    if (throughput_data->tcp_pcb) {
+        const uint nrtx = throughput_data->tcp_pcb->nrtx;
+        if (nrtx > throughput_data->previous_retransmits) {
+            throughput_data->retransmits += nrtx - throughput_data->previous_retransmits;
+        }
+        throughput_data->previous_retransmits = nrtx;
+    }
+#endif
+}
+
+static void print_rate(const char* name, uint64_t bytes, int64_t elapsed_us) {
+    // bits per microsecond is Mbit/s
+    const uint64_t centi_mbit_per_s = (elapsed_us > 0) ? ((bytes * 800) / (uint64_t) elapsed_us) : 0;
+    printf("%s %llu bytes, %u.%02u Mbit/s\n", name,
+           (unsigned long long) bytes,
+           (uint) (centi_mbit_per_s / 100), (uint) (centi_mbit_per_s % 100));
+}
+
+static bool ask_for_parameters(bool is_server) {
+    if (!is_server) {
+        printf("Please enter the host name or IP address of the server:\n");
+        if ((!ui_text_entry(g_throughput_address, sizeof(g_throughput_address)))
+        || (strlen(g_throughput_address) == 0)) {
+            return false; // cancel
+        }
+    }
+    printf("Please enter the TCP port number:\n");
+    if (strlen(g_throughput_port) == 0) {
+        snprintf(g_throughput_port, sizeof(g_throughput_port), "%d", DEFAULT_PORT);
+    }
+    if ((!ui_text_entry(g_throughput_port, sizeof(g_throughput_port))) || (strlen(g_throughput_port) == 0)) {
+        return false; // cancel
+    }
+    printf("Please enter the test duration in seconds (1 to %d):\n", MAX_DURATION_S);
+    char number[10];
+    snprintf(number, sizeof(number), "%d", g_throughput_duration_s);
+    if (!ui_text_entry(number, sizeof(number))) {
+        return false; // cancel
+    }
+    char* end = NULL;
+    const long duration_s = strtol(number, &end, 10);
+    if ((duration_s < 1) || (duration_s > MAX_DURATION_S) || (end[0] != '\0')) {
+        printf("Invalid duration\n");
+        ui_wait_for_the_user();
+        return false;
+    }
+    g_throughput_duration_s = (int) duration_s;
+    return true;
+}
+
+static void run_throughput_test(bool is_server, direction_t direction) {
+    ui_clear();
+    if (!ask_for_parameters(is_server)) {
+        return;
+    }
+    char* end = NULL;
+    long port = strtol(g_throughput_port, &end, 10);
+    if ((port <= 0) || (port > 0xffff) || (end[0] != '\0')) {
+        printf("Invalid port number\n");
+        ui_wait_for_the_user();
+        return;
+    }
+
+    ip_addr_t addr;
+    if ((!is_server) && (!dns_lookup(g_throughput_address, &addr))) {
+        printf("Unable to resolve address\n");
+        ui_wait_for_the_user();
+        return;
+    }
+
+    throughput_data_t throughput_data;
+    memset(&throughput_data, 0, sizeof(throughput_data));
+    throughput_data.direction = direction;
+
+    err_t err = ERR_MEM;
+    cyw43_arch_lwip_begin();
+    if (is_server) {
+        struct tcp_pcb* tcp_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+        if (tcp_pcb) {
+            err = tcp_bind(tcp_pcb, IP_ANY_TYPE, (uint16_t) port);
+            if (err == ERR_OK) {
+                throughput_data.listen_pcb = tcp_listen_with_backlog(tcp_pcb, 1);
+                if (!throughput_data.listen_pcb) {
+                    err = ERR_MEM;
+                }
+            }
+            if (err != ERR_OK) {
+                tcp_close(tcp_pcb);
+            }
+        }
+        if (throughput_data.listen_pcb) {
+            tcp_arg(throughput_data.listen_pcb, &throughput_data);
+            tcp_accept(throughput_data.listen_pcb, throughput_accept);
+        }
+    } else {
+        struct tcp_pcb* tcp_pcb = tcp_new_ip_type(IP_GET_TYPE(&addr));
+        if (tcp_pcb) {
+            tcp_arg(tcp_pcb, &throughput_data);
+            tcp_err(tcp_pcb, throughput_err);
+            err = tcp_connect(tcp_pcb, &addr, (uint16_t) port, throughput_connected);
+            if (err != ERR_OK) {
+                throughput_close(tcp_pcb);
+            }
+        }
+    }
+    cyw43_arch_lwip_end();
+
+    if (err != ERR_OK) {
+        printf("Connection failed, setup error = %d\n", err);
+        ui_wait_for_the_user();
+        return;
+    }
+    if (is_server) {
+        printf("Waiting for a connection to port %d, press a key to stop:\n", (int) port);
+    } else {
+        printf("Connecting, press a key to stop:\n");
+    }
+
+    // The test runs until the duration has elapsed, or until a key is pressed
+    uint previous_s = 0;
+    while ((!throughput_data.finish) && (ui_getchar_timeout_us(10000) < 0)) {
+        cyw43_arch_lwip_begin();
+        if (throughput_data.connected) {
+            throughput_update_retransmits(&throughput_data);
+            if (time_reached(throughput_data.stop_time)) {
+                throughput_data.finish = true;
+            }
+            const int64_t elapsed_us = absolute_time_diff_us(throughput_data.start_time, get_absolute_time());
+            if ((uint) (elapsed_us / 1000000) != previous_s) {
+                previous_s = (uint) (elapsed_us / 1000000);
+                printf("\r%u s: %llu bytes sent, %llu bytes received, %u retransmits ",
+                       previous_s,
+                       (unsigned long long) throughput_data.bytes_sent,
+                       (unsigned long long) throughput_data.bytes_received,
+                       throughput_data.retransmits);
+                fflush(stdout);
+            }
+        }
+        cyw43_arch_lwip_end();
+    }
+
+    cyw43_arch_lwip_begin();
+    const int64_t elapsed_us = throughput_data.connected ?
+        absolute_time_diff_us(throughput_data.start_time, get_absolute_time()) : 0;
+    throughput_update_retransmits(&throughput_data);
+    throughput_data.sending = false;
+    throughput_close(throughput_data.tcp_pcb);
+    throughput_data.tcp_pcb = NULL;
+    if (throughput_data.listen_pcb) {
+        tcp_arg(throughput_data.listen_pcb, NULL);
+        tcp_accept(throughput_data.listen_pcb, NULL);
+        tcp_close(throughput_data.listen_pcb);
+    }
+    cyw43_arch_lwip_end();
+
+    if (throughput_data.connected) {
+        printf("\n\nTest time %u.%03u s\n",
+               (uint) (elapsed_us / 1000000), (uint) ((elapsed_us / 1000) % 1000));
+        if (direction & DIRECTION_SEND) {
+            print_rate("Sent and acknowledged", throughput_data.bytes_sent, elapsed_us);
+        }
+        if (direction & DIRECTION_RECEIVE) {
+            print_rate("Received", throughput_data.bytes_received, elapsed_us);
+        }
+        printf("%s: %u\n",
+               HAS_TCP_REXMIT_STATS ? "Retransmitted segments" : "Retransmission timeouts",
+               throughput_data.retransmits);
+    }
+    printf("\n");
+    ui_wait_for_the_user();
+}
+
+static void client_send() {
+    run_throughput_test(false, DIRECTION_SEND);
+}
+
+static void client_receive() {
+    run_throughput_test(false, DIRECTION_RECEIVE);
+}
+
+static void client_both() {
+    run_throughput_test(false, DIRECTION_BOTH);
+}
+
+static void server_both() {
+    run_throughput_test(true, DIRECTION_BOTH);
+}
+
+typedef void (* callback_t) (void);
+
+void activity_throughput_test() {
+    ui_clear();
+
+    menu_t menu;
+    ui_menu_init(&menu, MENU_FLAG_ENABLE_CANCEL);
+    ui_menu_add_item(&menu, client_send, "Connect to a server and send data");
+    ui_menu_add_item(&menu, client_receive, "Connect to a server and receive data");
+    ui_menu_add_item(&menu, client_both, "Connect to a server and send and receive data");
+    ui_menu_add_item(&menu, server_both, "Wait for a client, then send and receive data");
+    const int choice = ui_menu_show(&menu, "Which throughput test?");
+    const callback_t callback = ui_menu_get_arg(&menu, choice);
+    if (callback) {
+        callback();
+    }
+}
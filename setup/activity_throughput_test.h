@@ -0,0 +1,14 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test TCP throughput, like iperf
+ */
+
+#ifndef ACTIVITY_THROUGHPUT_TEST_H
+#define ACTIVITY_THROUGHPUT_TEST_H
+
+void activity_throughput_test();
+
+#endif
@@ -10,10 +10,25 @@
 #include "dns_lookup.h"
 
 #include "lwip/dns.h"
+#include "lwip/udp.h"
 
 #include "pico/stdlib.h"
+#include "pico/rand.h"
 #include "pico/cyw43_arch.h"
 
+#include <string.h>
+
+#define DNS_PORT                53
+#define DNS_HEADER_SIZE         12
+#define DNS_MAX_NAME_SIZE       255
+#define DNS_MAX_LABEL_SIZE      63
+#define DNS_MAX_MESSAGE_SIZE    512
+#define DNS_FLAG_RESPONSE       0x8000
+#define DNS_FLAG_RECURSION      0x0100
+#define DNS_RCODE_MASK          0x000f
+#define DNS_TYPE_A              1
+#define DNS_CLASS_IN            1
+
 
 typedef struct dns_data_t {
     ip_addr_t*  output_address;
@@ -30,7 +45,13 @@ static void dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg)
 }
 
 bool dns_lookup(const char* input_address, ip_addr_t* output_address) {
+    return dns_lookup_timed(input_address, output_address, NULL, NULL);
+}
+
+bool dns_lookup_timed(const char* input_address, ip_addr_t* output_address,
+                      bool* is_cached, uint32_t* time_us) {
     memset(output_address, 0, sizeof(ip_addr_t));
+    const uint32_t start_time = time_us_32();
 
     dns_data_t dns_data;
     memset(&dns_data, 0, sizeof(dns_data));
@@ -41,18 +62,208 @@ bool dns_lookup(const char* input_address, ip_addr_t* output_address) {
                         dns_found, &dns_data, LWIP_DNS_ADDRTYPE_IPV4);
     cyw43_arch_lwip_end();
 
+    bool success = false;
+    if (is_cached) {
+        *is_cached = (err == ERR_OK);
+    }
     if (err == ERR_OK) {
         // Result available already (IP address or cached)
-        return true;
+        success = true;
 
     } else if (err == ERR_INPROGRESS) {
         // Wait for callback to dns_found (can't cancel this; eventually LWIP will time out)
         while (!dns_data.finished) {
-            sleep_ms(10);
+            sleep_ms(1);
         }
-        return dns_data.success;
+        success = dns_data.success;
     } else {
         // Unreachable DNS server / invalid hostname / other error
+        success = false;
+    }
+    if (time_us) {
+        *time_us = time_us_32() - start_time;
+    }
+    return success;
+}
+
+typedef struct dns_query_data_t {
+    const ip_addr_t*    server;
+    ip_addr_t*          output_address;
+    uint16_t            id;
+    int                 rcode;
+    uint32_t            receive_time;
+    volatile bool       finished;
+} dns_query_data_t;
+
+static uint16_t get_u16(const uint8_t* data) {
+    return (uint16_t) ((((uint16_t) data[0]) << 8) | data[1]);
+}
+
+static void put_u16(uint8_t* data, uint16_t value) {
+    data[0] = (uint8_t) (value >> 8);
+    data[1] = (uint8_t) value;
+}
+
+static int skip_name(const uint8_t* message, int size, int offset) {
+    // Skip a name, which is a series of labels ending with
+    // an empty label or a compression pointer. Return -1 if invalid.
+    while (offset < size) {
+        const uint8_t label_size = message[offset];
+        if ((label_size & 0xc0) == 0xc0) {
+            return ((offset + 2) <= size) ? (offset + 2) : -1;
+        } else if (label_size == 0) {
+            return offset + 1;
+        }
+        offset += label_size + 1;
+    }
+    return -1;
+}
+
+static int build_query(uint8_t* message, const char* name, uint16_t id) {
+    // Header: one question, recursion desired
+    memset(message, 0, DNS_HEADER_SIZE);
+    put_u16(&message[0], id);
+    put_u16(&message[2], DNS_FLAG_RECURSION);
+    put_u16(&message[4], 1);
+    int offset = DNS_HEADER_SIZE;
+
+    // Question: name as a series of labels
+    const int name_size = (int) strlen(name);
+    if ((name_size == 0) || (name_size > DNS_MAX_NAME_SIZE)) {
+        return -1;
+    }
+    int label_start = 0;
+    for (int i = 0; i <= name_size; i++) {
+        if ((name[i] == '.') || (name[i] == '\0')) {
+            const int label_size = i - label_start;
+            if (label_size > DNS_MAX_LABEL_SIZE) {
+                return -1;
+            }
+            if (label_size == 0) {
+                if (name[i] == '\0') {
+                    break; // trailing '.'
+                }
+                return -1;
+            }
+            message[offset] = (uint8_t) label_size;
+            memcpy(&message[offset + 1], &name[label_start], label_size);
+            offset += label_size + 1;
+            label_start = i + 1;
+        }
+    }
+    message[offset] = 0;
+    put_u16(&message[offset + 1], DNS_TYPE_A);
+    put_u16(&message[offset + 3], DNS_CLASS_IN);
+    return offset + 5;
+}
+
+static void parse_reply(dns_query_data_t* query_data, const uint8_t* message, int size) {
+    const uint16_t flags = get_u16(&message[2]);
+    const uint16_t question_count = get_u16(&message[4]);
+    const uint16_t answer_count = get_u16(&message[6]);
+    query_data->rcode = flags & DNS_RCODE_MASK;
+
+    int offset = DNS_HEADER_SIZE;
+    for (uint i = 0; (i < question_count) && (offset >= 0); i++) {
+        offset = skip_name(message, size, offset);
+        if (offset >= 0) {
+            offset += 4; // type and class
+        }
+    }
+    for (uint i = 0; (i < answer_count) && (offset >= 0); i++) {
+        offset = skip_name(message, size, offset);
+        if ((offset < 0) || ((offset + 10) > size)) {
+            return;
+        }
+        const uint16_t type = get_u16(&message[offset]);
+        const uint16_t class = get_u16(&message[offset + 2]);
+        const uint16_t data_size = get_u16(&message[offset + 8]);
+        offset += 10;
+        if ((offset + data_size) > size) {
+            return;
+        }
+        if ((type == DNS_TYPE_A) && (class == DNS_CLASS_IN) && (data_size == 4)) {
+            IP_ADDR4(query_data->output_address,
+                     message[offset], message[offset + 1],
+                     message[offset + 2], message[offset + 3]);
+            return;
+        }
+        offset += data_size;
+    }
+}
+
+static void dns_query_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                           const ip_addr_t *addr, u16_t port) {
+    const uint32_t receive_time = time_us_32();
+    dns_query_data_t* query_data = (dns_query_data_t*) arg;
+    uint8_t message[DNS_MAX_MESSAGE_SIZE];
+    const int size = (int) pbuf_copy_partial(p, message, sizeof(message), 0);
+    pbuf_free(p);
+
+    // Ignore anything that isn't the reply to the query
+    if (query_data->finished
+    || (!ip_addr_cmp(addr, query_data->server))
+    || (port != DNS_PORT)
+    || (size < DNS_HEADER_SIZE)
+    || (get_u16(&message[0]) != query_data->id)
+    || (!(get_u16(&message[2]) & DNS_FLAG_RESPONSE))) {
+        return;
+    }
+    parse_reply(query_data, message, size);
+    query_data->receive_time = receive_time;
+    query_data->finished = true;
+}
+
+bool dns_query_server(const ip_addr_t* server, const char* input_address, ip_addr_t* output_address,
+                      uint32_t timeout_ms, int* rcode, uint32_t* time_us) {
+    memset(output_address, 0, sizeof(ip_addr_t));
+    *rcode = -1;
+    *time_us = 0;
+
+    dns_query_data_t query_data;
+    memset(&query_data, 0, sizeof(query_data));
+    query_data.server = server;
+    query_data.output_address = output_address;
+    query_data.id = (uint16_t) get_rand_32();
+
+    uint8_t message[DNS_HEADER_SIZE + DNS_MAX_NAME_SIZE + 7];
+    const int size = build_query(message, input_address, query_data.id);
+    if (size < 0) {
+        return false;
+    }
+
+    cyw43_arch_lwip_begin();
+    struct udp_pcb* pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    err_t err = ERR_MEM;
+    uint32_t send_time = 0;
+    if (pcb) {
+        udp_recv(pcb, dns_query_recv, &query_data);
+        struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, (u16_t) size, PBUF_RAM);
+        if (p) {
+            memcpy(p->payload, message, size);
+            send_time = time_us_32();
+            err = udp_sendto(pcb, p, server, DNS_PORT);
+            pbuf_free(p);
+        }
+    }
+    cyw43_arch_lwip_end();
+
+    // Wait for the reply
+    const absolute_time_t timeout_time = make_timeout_time_ms(timeout_ms);
+    while ((err == ERR_OK) && (!query_data.finished) && (!time_reached(timeout_time))) {
+        sleep_ms(1);
+    }
+
+    cyw43_arch_lwip_begin();
+    if (pcb) {
+        udp_remove(pcb);
+    }
+    cyw43_arch_lwip_end();
+
+    if (!query_data.finished) {
         return false;
     }
+    *rcode = query_data.rcode;
+    *time_us = query_data.receive_time - send_time;
+    return true;
 }
@@ -13,4 +13,17 @@
 
 bool dns_lookup(const char* input_address, ip_addr_t* output_address);
 
+/// @brief As dns_lookup, but also report whether the result was available without
+/// waiting (i.e. from the lwIP cache, or because input_address is an IP address)
+/// and the time taken in microseconds
+bool dns_lookup_timed(const char* input_address, ip_addr_t* output_address,
+                      bool* is_cached, uint32_t* time_us);
+
+/// @brief Send a query for an IPv4 address directly to a DNS server, bypassing the lwIP cache.
+/// @return true if a reply was received, in which case *rcode is the response code
+/// (0 = no error, 3 = name does not exist) and *output_address is the first IPv4
+/// address in the reply, or zero if there is none. false on timeout or error.
+bool dns_query_server(const ip_addr_t* server, const char* input_address, ip_addr_t* output_address,
+                      uint32_t timeout_ms, int* rcode, uint32_t* time_us);
+
 #endif
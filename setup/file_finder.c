@@ -144,6 +144,8 @@ void file_finder_init() {
 // Set address for file
 void file_finder_set_address(uint32_t address) {
     g_wifi_settings_file_range.start_address = address;
+    // The reusable Flash range depends on the file location
+    wifi_settings_range_invalidate_cache();
 }
 
 // Set address for file and reformat the block at the destination
@@ -8,6 +8,7 @@
 
 #include "file_operations.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
 
 #include <string.h>
@@ -181,6 +182,38 @@ static void include_line_ending(const file_handle_t* fh, find_index_result_t* fi
     }
 }
 
+/// @brief If the file is in the pre-compiled binary format, convert it
+/// to text, so that it can be edited: it will be saved as text.
+static void convert_from_binary(file_handle_t* fh, const char* file) {
+    wifi_settings_binary_file_header_t header;
+    memcpy(&header, file, sizeof(header));
+    if ((memcmp(header.magic, WIFI_SETTINGS_BINARY_FILE_MAGIC, sizeof(header.magic)) != 0)
+    || (header.version != WIFI_SETTINGS_BINARY_FILE_VERSION)
+    || ((sizeof(header) + ((uint) header.num_keys
+            * sizeof(wifi_settings_binary_file_entry_t))) > WIFI_SETTINGS_FILE_SIZE)) {
+        return; // not a binary file
+    }
+
+    memset(fh->contents, '\xff', WIFI_SETTINGS_FILE_SIZE);
+    uint index = 0;
+    for (uint i = 0; i < header.num_keys; i++) {
+        wifi_settings_binary_file_entry_t entry;
+        memcpy(&entry, &file[sizeof(header) + (i * sizeof(entry))], sizeof(entry));
+        const uint total_size = entry.key_size + entry.value_size + 2; // 2 bytes: '=' and '\n'
+        if ((((uint) entry.key_offset + entry.key_size) > WIFI_SETTINGS_FILE_SIZE)
+        || (((uint) entry.value_offset + entry.value_size) > WIFI_SETTINGS_FILE_SIZE)
+        || ((index + total_size) > WIFI_SETTINGS_FILE_SIZE)) {
+            break; // corrupted directory entry
+        }
+        memcpy(&fh->contents[index], &file[entry.key_offset], entry.key_size);
+        index += entry.key_size;
+        fh->contents[index++] = '=';
+        memcpy(&fh->contents[index], &file[entry.value_offset], entry.value_size);
+        index += entry.value_size;
+        fh->contents[index++] = '\n';
+    }
+}
+
 void file_load(file_handle_t* fh) {
     wifi_settings_flash_range_t fr;
     wifi_settings_logical_range_t lr;
@@ -189,6 +222,7 @@ void file_load(file_handle_t* fh) {
     wifi_settings_range_translate_to_logical(&fr, &lr);
 
     memcpy(fh->contents, lr.start_address, WIFI_SETTINGS_FILE_SIZE);
+    convert_from_binary(fh, (const char*) lr.start_address);
 }
 
 void file_discard(file_handle_t* fh, const char* key) {
@@ -246,6 +280,84 @@ bool file_set(file_handle_t* fh, const char* key, const char* value) {
     return true;
 }
 
+/// @brief Append to the new file created by file_rewrite, if there is space
+static bool append_bytes(char* contents, int* index, const char* data, const int size) {
+    if ((size < 0) || ((*index + size) > (int) WIFI_SETTINGS_FILE_SIZE)) {
+        return false;
+    }
+    memcpy(&contents[*index], data, size);
+    *index += size;
+    return true;
+}
+
+static bool append_key_value(char* contents, int* index, const char* key,
+                             const int key_size, const char* value) {
+    return append_bytes(contents, index, key, key_size)
+        && append_bytes(contents, index, "=", 1)
+        && append_bytes(contents, index, value, (int) strlen(value));
+}
+
+bool file_rewrite(file_handle_t* fh,
+            file_rewrite_callback_t rewrite_callback,
+            file_append_callback_t append_callback,
+            void* arg) {
+    // The new file is built here and then copied to fh
+    static char new_contents[WIFI_SETTINGS_FILE_SIZE];
+    int new_size = 0;
+    int copied_index = 0; // fh->contents before this index has been copied or discarded
+
+    find_index_result_t fir;
+    fir.key_index = fir.value_index = fir.end_index = 0;
+    while (find_next_key(fh, &fir)) {
+        // Copy anything before the key=value (line endings and lines with no '=')
+        if (!append_bytes(new_contents, &new_size, &fh->contents[copied_index],
+                          fir.key_index - copied_index)) {
+            return false;
+        }
+        const char* key = &fh->contents[fir.key_index];
+        const int key_size = (fir.value_index - fir.key_index) - 1;
+        const char* new_value = NULL;
+        if (!rewrite_callback(key, key_size, &new_value, arg)) {
+            // Discard key=value, including its line ending
+            include_line_ending(fh, &fir);
+        } else if (new_value) {
+            // Replace the value, keeping the original line ending
+            if (!append_key_value(new_contents, &new_size, key, key_size, new_value)) {
+                return false;
+            }
+        } else {
+            // Keep key=value
+            if (!append_bytes(new_contents, &new_size, key, fir.end_index - fir.key_index)) {
+                return false;
+            }
+        }
+        copied_index = fir.end_index;
+    }
+    // Copy anything after the final key=value
+    if (!append_bytes(new_contents, &new_size, &fh->contents[copied_index],
+                      get_file_size(fh) - copied_index)) {
+        return false;
+    }
+
+    // Add new keys on new lines
+    const char* key;
+    const char* value;
+    while (append_callback(&key, &value, arg)) {
+        if ((new_size > 0) && !is_end_of_line_char(new_contents[new_size - 1])
+        && !append_bytes(new_contents, &new_size, "\n", 1)) {
+            return false;
+        }
+        if (!(append_key_value(new_contents, &new_size, key, (int) strlen(key), value)
+        && append_bytes(new_contents, &new_size, "\n", 1))) {
+            return false;
+        }
+    }
+
+    memcpy(fh->contents, new_contents, new_size);
+    memset(&fh->contents[new_size], '\xff', WIFI_SETTINGS_FILE_SIZE - new_size);
+    return true;
+}
+
 bool file_contains(const file_handle_t* fh, const char* key) {
     find_index_result_t fir;
     return find_index(fh, key, &fir);
@@ -22,8 +22,29 @@ typedef struct file_handle_t {
 void file_load(file_handle_t* fh);
 int file_save(const file_handle_t* fh);
 
+/// @brief Called by file_rewrite() for each key=value in the file.
+/// key is not nul-terminated. Return false to discard the key=value, or true to keep it;
+/// set *new_value to replace the value.
+typedef bool (*file_rewrite_callback_t)(
+            const char* key, const int key_size,
+            const char** new_value, void* arg);
+
+/// @brief Called by file_rewrite() after the file has been rewritten,
+/// until it returns false, to get key=value pairs to be added at the end.
+typedef bool (*file_append_callback_t)(
+            const char** key, const char** value, void* arg);
+
 void file_discard(file_handle_t* fh, const char* key);
 bool file_set(file_handle_t* fh, const char* key, const char* value);
+/// @brief Keep, replace or discard every key=value in a single pass over the file,
+/// and then add new key=value pairs. This is faster than many calls to file_set()
+/// and file_discard(), as each of them searches the file.
+/// Other lines are kept. If the new file would be too large, it is not changed,
+/// and false is returned.
+bool file_rewrite(file_handle_t* fh,
+            file_rewrite_callback_t rewrite_callback,
+            file_append_callback_t append_callback,
+            void* arg);
 bool file_contains(const file_handle_t* fh, const char* key);
 int file_get(const file_handle_t* fh, const char* key, char* value, const int value_size);
 int file_get_next_key_value(
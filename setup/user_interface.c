@@ -20,6 +20,7 @@
 #include <time.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdarg.h>
 
 
 
@@ -44,6 +45,7 @@
 
 #define ANSI_CLEAR_SCREEN   "\x1b[2J"
 #define ANSI_CLEAR_LINE     "\x1b[0J"
+#define ANSI_CLEAR_TO_EOL   "\x1b[K"
 #define ANSI_BOLD_FONT      "\x1b[1m"
 #define ANSI_NORMAL_FONT    "\x1b[0m"
 
@@ -63,12 +65,93 @@ typedef enum {
 
 static escape_state_t g_escape_state = NO_ESCAPE;
 
+// The menu is drawn on these lines of the screen
+#define SCREEN_LINES            (MENU_FOOTER_LINE + 1)
+#define MAX_SCREEN_LINE_SIZE    (MAX_DESCRIPTION_SIZE + 32)
+#define OUTPUT_BUFFER_SIZE      512
+
+// What the menu has drawn on the screen, so that only lines which change are redrawn,
+// and the output which has not been written yet, so that it is written in large blocks
+typedef struct screen_t {
+    char line[SCREEN_LINES][MAX_SCREEN_LINE_SIZE];
+    bool valid;             // false if something else may have been drawn since
+    char output[OUTPUT_BUFFER_SIZE];
+    uint output_size;
+} screen_t;
+
+static screen_t g_screen;
+
 static void cursor_go_to_line(const int line_number) {
     // ANSI code to go to a particular line
     printf("\x1b[%dH\r", line_number + 1);
 }
 
+static void screen_write_output() {
+    fwrite(g_screen.output, 1, g_screen.output_size, stdout);
+    fflush(stdout);
+    g_screen.output_size = 0;
+}
+
+static void screen_add_output(const char* text) {
+    const uint size = strlen(text);
+    if ((g_screen.output_size + size) > sizeof(g_screen.output)) {
+        screen_write_output();
+    }
+    if (size > sizeof(g_screen.output)) {
+        // Too large to be buffered (not expected)
+        printf("%s", text);
+        return;
+    }
+    memcpy(&g_screen.output[g_screen.output_size], text, size);
+    g_screen.output_size += size;
+}
+
+// Set the contents of a line, redrawing it only if it has changed
+static void screen_set_line(const int line_number, const char* format, ...) {
+    char text[MAX_SCREEN_LINE_SIZE];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(text, sizeof(text), format, ap);
+    va_end(ap);
+
+    if ((line_number < 0) || (line_number >= SCREEN_LINES)) {
+        return;
+    }
+    if (g_screen.valid && (strcmp(g_screen.line[line_number], text) == 0)) {
+        // Already on screen
+        return;
+    }
+    char go_to_line[16];
+    snprintf(go_to_line, sizeof(go_to_line), "\x1b[%dH\r", line_number + 1);
+    screen_add_output(go_to_line);
+    screen_add_output(text);
+    screen_add_output(ANSI_CLEAR_TO_EOL);
+    strcpy(g_screen.line[line_number], text);
+}
+
+// Write any redrawn lines, and put the cursor back at the end of the footer
+static void screen_update() {
+    if (g_screen.output_size == 0) {
+        return;
+    }
+    char go_to_footer[24];
+    snprintf(go_to_footer, sizeof(go_to_footer), "\x1b[%d;%dH",
+             MENU_FOOTER_LINE + 1, (int) strlen(g_screen.line[MENU_FOOTER_LINE]) + 1);
+    screen_add_output(go_to_footer);
+    screen_write_output();
+}
+
+// Clear the screen, if something else may have been drawn since the menu was drawn
+static void screen_prepare() {
+    if (!g_screen.valid) {
+        ui_clear();
+        memset(g_screen.line, 0, sizeof(g_screen.line));
+        g_screen.valid = true;
+    }
+}
+
 void ui_clear() {
+    g_screen.valid = false;
     printf(ANSI_CLEAR_SCREEN);
     cursor_go_to_line(0);
     printf(ANSI_BOLD_FONT
@@ -320,35 +403,30 @@ static void draw_menu_item(const menu_t* menu,
         return;
     }
     // Draw this item
-    cursor_go_to_line(MENU_CAPTION_LINE + item_index - page_start_index);
+    const int line_number = MENU_CAPTION_LINE + 1 + item_index - page_start_index;
     if (cursor_index == item_index) {
-        // Turn on bold font
-        printf("\n" ANSI_BOLD_FONT "\r >> ");
+        // In bold font
+        screen_set_line(line_number, ANSI_BOLD_FONT " >> %s" ANSI_NORMAL_FONT,
+                        menu->item[item_index].description);
     } else {
-        printf("\n %c. ", code);
-    }
-    printf("%s", menu->item[item_index].description);
-    if (cursor_index == item_index) {
-        // Turn off bold font
-        printf(ANSI_NORMAL_FONT "\r");
+        screen_set_line(line_number, " %c. %s", code, menu->item[item_index].description);
     }
 }
 
 static void draw_menu_footer(const int page_start_index,
                         const int page_end_index,
-                        const int num_items) {
-    cursor_go_to_line(MENU_FOOTER_LINE);
-    printf("Press '%c' .. '%c' to select",
-            get_code_for_item(page_start_index, page_start_index),
-            get_code_for_item(page_end_index - 1, page_start_index));
-    if (page_start_index > 0) {
-        printf(", 'p' for previous page");
+                        const int num_items,
+                        const int chosen_code) {
+    char selection[4] = "";
+    if (chosen_code >= 0) {
+        snprintf(selection, sizeof(selection), " %c", chosen_code);
     }
-    if (page_end_index < num_items) {
-        printf(", 'n' for next page");
-    }
-    printf(":");
-    fflush(stdout);
+    screen_set_line(MENU_FOOTER_LINE, "Press '%c' .. '%c' to select%s%s:%s",
+            get_code_for_item(page_start_index, page_start_index),
+            get_code_for_item(page_end_index - 1, page_start_index),
+            (page_start_index > 0) ? ", 'p' for previous page" : "",
+            (page_end_index < num_items) ? ", 'n' for next page" : "",
+            selection);
 }
 
 int ui_menu_show(menu_t* menu, const char* caption) {
@@ -382,17 +460,19 @@ int ui_menu_show(menu_t* menu, const char* caption) {
     status_summary_t status_summary;
     get_status(&status_summary);
 
+    // The screen is cleared when the menu is first shown, as anything may be on it.
+    // After that, only the lines that change are redrawn.
+    g_screen.valid = false;
+
     // Outer loop redraws the menu (e.g. for a page change)
     while (outcome == MENU_ITEM_REFRESH) {
-        ui_clear();
+        screen_prepare();
 
         // print status and board information 
-        printf("This Pico has board id %s\n", wifi_settings_get_board_id_hex());
-        printf("%s\n%s\n%s\n\n",
-                status_summary.settings_file_status,
-                status_summary.connect_status,
-                status_summary.ip_status);
-        fflush(stdout);
+        screen_set_line(2, "This Pico has board id %s", wifi_settings_get_board_id_hex());
+        screen_set_line(3, "%s", status_summary.settings_file_status);
+        screen_set_line(4, "%s", status_summary.connect_status);
+        screen_set_line(5, "%s", status_summary.ip_status);
 
         // Calculate the bounds of the current page
         const int page_start_index = current_page_number * MENU_ITEMS_PER_PAGE;
@@ -400,16 +480,21 @@ int ui_menu_show(menu_t* menu, const char* caption) {
             ((page_start_index + MENU_ITEMS_PER_PAGE) < menu->num_items) ? 
                 (page_start_index + MENU_ITEMS_PER_PAGE) : menu->num_items;
 
-        // Draw the current page
-        cursor_go_to_line(MENU_CAPTION_LINE);
-        printf("%s", caption);
+        // Draw the current page, clearing any lines that are not used on this page
         if (num_pages > 1) {
-            printf(" (page %d of %d)", current_page_number + 1, num_pages);
+            screen_set_line(MENU_CAPTION_LINE, "%s (page %d of %d)",
+                            caption, current_page_number + 1, num_pages);
+        } else {
+            screen_set_line(MENU_CAPTION_LINE, "%s", caption);
         }
         for (int i = page_start_index; i < page_end_index; i++) {
             draw_menu_item(menu, i, current_cursor_index, page_start_index);
         }
-        draw_menu_footer(page_start_index, page_end_index, menu->num_items);
+        for (int i = page_end_index; i < (page_start_index + MENU_ITEMS_PER_PAGE); i++) {
+            screen_set_line(MENU_CAPTION_LINE + 1 + i - page_start_index, "");
+        }
+        draw_menu_footer(page_start_index, page_end_index, menu->num_items, -1);
+        screen_update();
 
         // Wait for the user to decide what to do
         outcome = MENU_ITEM_NOTHING;
@@ -427,8 +512,9 @@ int ui_menu_show(menu_t* menu, const char* caption) {
                     outcome = MENU_ITEM_CANCEL;
                     break;
                 case CONTROL_L:
-                    // Refresh forced
+                    // Refresh forced: clear the screen and redraw everything
                     outcome = MENU_ITEM_REFRESH;
+                    g_screen.valid = false;
                     break;
                 case KEY_UP:
                     // Cursor moves up
@@ -530,8 +616,8 @@ int ui_menu_show(menu_t* menu, const char* caption) {
             }
             if (chosen_index >= 0) {
                 // selection made
-                draw_menu_footer(page_start_index, page_end_index, menu->num_items);
-                printf(" %c", get_code_for_item(chosen_index, page_start_index));
+                draw_menu_footer(page_start_index, page_end_index, menu->num_items,
+                                 get_code_for_item(chosen_index, page_start_index));
                 // check built-in options
                 if (chosen_index == cancel_option_index) {
                     outcome = MENU_ITEM_CANCEL;
@@ -541,6 +627,8 @@ int ui_menu_show(menu_t* menu, const char* caption) {
                     outcome = chosen_index;
                 }
             }
+            // Draw any lines that changed, e.g. because the cursor moved
+            screen_update();
         }
     }
     cursor_go_to_line(MENU_FOOTER_LINE);
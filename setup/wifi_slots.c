@@ -97,41 +97,106 @@ void wifi_slots_renumber(wifi_slot_data_t* slot_data) {
     qsort(slot_data->item, slot_data->num_items, sizeof(wifi_slot_item_t), compare_slot_items);
 }
 
-bool wifi_slots_save(file_handle_t* fh, const wifi_slot_data_t* slot_data) {
-    // discard any other wifi slots from the file first, to make space
-    for (int index_in_file = slot_data->num_items + 1; index_in_file <= MAX_NUM_SSIDS; index_in_file++) {
-        char key[SEARCH_KEY_SIZE];
-        generate_bssid_search_key(key, index_in_file);
-        file_discard(fh, key);
-        generate_ssid_search_key(key, index_in_file);
-        file_discard(fh, key);
-        generate_pass_search_key(key, index_in_file);
-        file_discard(fh, key);
+// Keys for each wifi slot, in the order in which they are added to the file
+typedef enum slot_key_t {
+    SLOT_KEY_PASS = 0,
+    SLOT_KEY_BSSID,
+    SLOT_KEY_SSID,
+    NUM_SLOT_KEYS,
+} slot_key_t;
+
+static const char* const SLOT_KEY_PREFIX[NUM_SLOT_KEYS] = {"pass", "bssid", "ssid"};
+
+typedef struct slot_save_t {
+    const wifi_slot_data_t* slot_data;
+    bool in_file[MAX_NUM_SSIDS][NUM_SLOT_KEYS];
+    int next_append;
+    char append_key[SEARCH_KEY_SIZE];
+} slot_save_t;
+
+/// @brief If key is ssid<N>, bssid<N> or pass<N>, with N in 1 .. MAX_NUM_SSIDS,
+/// return N and set *kind. Otherwise return 0.
+static int parse_slot_key(const char* key, const int key_size, slot_key_t* kind) {
+    for (int k = 0; k < NUM_SLOT_KEYS; k++) {
+        const int prefix_size = (int) strlen(SLOT_KEY_PREFIX[k]);
+        if ((key_size <= prefix_size)
+        || (strncmp(key, SLOT_KEY_PREFIX[k], prefix_size) != 0)
+        || (key[prefix_size] == '0')) {
+            continue;
+        }
+        int index = 0;
+        for (int i = prefix_size; (i < key_size) && (index <= MAX_NUM_SSIDS); i++) {
+            if ((key[i] < '0') || (key[i] > '9')) {
+                return 0;
+            }
+            index = (index * 10) + (key[i] - '0');
+        }
+        if (index > MAX_NUM_SSIDS) {
+            return 0;
+        }
+        *kind = (slot_key_t) k;
+        return index;
     }
-    // add updated wifi slots
-    bool added_ok = true;
-    for (int index_in_array = 0; index_in_array < slot_data->num_items; index_in_array++) {
-        const int index_in_file = index_in_array + 1;
-        char key[SEARCH_KEY_SIZE];
+    return 0;
+}
 
-        // Password first (prepending)
-        if (!slot_data->item[index_in_array].is_open) {
-            generate_pass_search_key(key, index_in_file);
-            added_ok = file_set(fh, key, slot_data->item[index_in_array].password) && added_ok;
-        }
-        // SSID or BSSID
-        if (slot_data->item[index_in_array].is_bssid) {
-            // BSSID - first discard SSID
-            generate_ssid_search_key(key, index_in_file);
-            file_discard(fh, key);
-            generate_bssid_search_key(key, index_in_file);
-        } else {
-            // SSID - first discard BSSID
-            generate_bssid_search_key(key, index_in_file);
-            file_discard(fh, key);
-            generate_ssid_search_key(key, index_in_file);
+/// @brief Return the value for a slot key, or NULL if the key should not be in the file
+static const char* get_slot_value(const wifi_slot_data_t* slot_data, slot_key_t kind, int index_in_file) {
+    if (index_in_file > slot_data->num_items) {
+        return NULL;
+    }
+    const wifi_slot_item_t* item = &slot_data->item[index_in_file - 1];
+    switch (kind) {
+        case SLOT_KEY_PASS:
+            return item->is_open ? NULL : item->password;
+        case SLOT_KEY_BSSID:
+            return item->is_bssid ? item->ssid : NULL;
+        default:
+            return item->is_bssid ? NULL : item->ssid;
+    }
+}
+
+static bool rewrite_slot_key(const char* key, const int key_size, const char** new_value, void* arg) {
+    slot_save_t* save = (slot_save_t*) arg;
+    slot_key_t kind;
+    const int index_in_file = parse_slot_key(key, key_size, &kind);
+    if (index_in_file == 0) {
+        return true; // not a wifi slot, keep it
+    }
+    if (save->in_file[index_in_file - 1][kind]) {
+        return false; // discard duplicate
+    }
+    *new_value = get_slot_value(save->slot_data, kind, index_in_file);
+    if (!*new_value) {
+        return false; // discard unused key
+    }
+    // update value in place
+    save->in_file[index_in_file - 1][kind] = true;
+    return true;
+}
+
+static bool append_slot_key(const char** key, const char** value, void* arg) {
+    slot_save_t* save = (slot_save_t*) arg;
+    while (save->next_append < (save->slot_data->num_items * NUM_SLOT_KEYS)) {
+        const int index_in_file = (save->next_append / NUM_SLOT_KEYS) + 1;
+        const slot_key_t kind = (slot_key_t) (save->next_append % NUM_SLOT_KEYS);
+        save->next_append++;
+        *value = get_slot_value(save->slot_data, kind, index_in_file);
+        if (*value && !save->in_file[index_in_file - 1][kind]) {
+            snprintf(save->append_key, SEARCH_KEY_SIZE, "%s%d", SLOT_KEY_PREFIX[kind], index_in_file);
+            *key = save->append_key;
+            return true;
         }
-        added_ok = file_set(fh, key, slot_data->item[index_in_array].ssid) && added_ok;
     }
-    return added_ok;
+    return false;
+}
+
+bool wifi_slots_save(file_handle_t* fh, const wifi_slot_data_t* slot_data) {
+    // Rewrite the file in one pass: keys for each wifi slot are updated where they
+    // are in the file, keys for unused slots are discarded, and other keys are kept.
+    // Then new keys are added at the end.
+    slot_save_t save;
+    memset(&save, 0, sizeof(save));
+    save.slot_data = slot_data;
+    return file_rewrite(fh, rewrite_slot_key, append_slot_key, &save);
 }
@@ -13,28 +13,46 @@
 #include "wifi_settings/wifi_settings_configuration.h"
 #include "wifi_settings/wifi_settings_connect.h"
 #include "wifi_settings/wifi_settings_connect_internal.h"
+#include "wifi_settings/wifi_settings_event_log.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_hostname.h"
+#include "wifi_settings/wifi_settings_profile.h"
+#if WIFI_SETTINGS_MDNS
+#include "wifi_settings/wifi_settings_mdns.h"
+#endif
 
 #ifdef ENABLE_REMOTE_UPDATE
+#include "wifi_settings/wifi_settings_flash_storage_update.h"
 #include "wifi_settings/wifi_settings_remote.h"
 #endif
 
 #include "pico/binary_info.h"
 #include "pico/error.h"
 
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+
+#if LIB_PICO_MULTICORE && PICO_CYW43_ARCH_THREADSAFE_BACKGROUND
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#include "pico/sem.h"
+#endif
+
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+#include "hardware/structs/watchdog.h"
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 
 struct wifi_state_t g_wifi_state;
 
-enum ssid_type_t {
-    NONE = 0,
-    BSSID,
-    SSID,
-};
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+#define FAST_RECONNECT_MAGIC 0xfa570000
+#endif
 
 static enum ssid_type_t fetch_ssid(uint ssid_index, char* ssid, uint8_t* bssid);
 
@@ -73,6 +91,8 @@ int wifi_settings_get_connect_status_text(char* text, int text_size) {
             return snprintf(text, text_size, "WiFi is disconnected");
         case UNINITIALISED:
             return snprintf(text, text_size, "WiFi uninitialised");
+        case INITIALISING:
+            return snprintf(text, text_size, "WiFi hardware is starting");
         case INITIALISATION_ERROR:
             return snprintf(text, text_size, "WiFi init error: %d",
                     g_wifi_state.hw_error_code);
@@ -85,14 +105,72 @@ int wifi_settings_get_connect_status_text(char* text, int text_size) {
     return snprintf(text, text_size, "WiFi status is unknown (%d)", (int) g_wifi_state.cstate);
 }
 
+static uint32_t get_time_ms() {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static void log_event(uint8_t event, int32_t rssi, uint8_t arg) {
+    // Record an event for the selected hotspot in the persistent event log
+#if WIFI_SETTINGS_EVENT_LOG
+    wifi_settings_event_log_add(event, g_wifi_state.selected_ssid_index, rssi, arg);
+#endif
+}
+
+static void refresh_hw_status() {
+    // Read the signal strength: this requires an ioctl over the gSPI bus,
+    // so it is done at most once every HW_STATUS_CACHE_TIME_MS
+    struct hw_status_t* hw_status = &g_wifi_state.hw_status;
+    hw_status->rssi = -1;
+    cyw43_wifi_get_rssi(g_wifi_state.cyw43, &hw_status->rssi);
+    hw_status->time_ms = get_time_ms();
+    hw_status->refresh_time = make_timeout_time_ms(HW_STATUS_CACHE_TIME_MS);
+    hw_status->valid = true;
+}
+
+void wifi_settings_get_status(wifi_settings_status_t* status) {
+    memset(status, 0, sizeof(wifi_settings_status_t));
+    // The lock is needed for LWIP functions, and if the async_context runs on the other core
+    const bool need_lock = (g_wifi_state.context != NULL);
+    if (need_lock) {
+        cyw43_arch_lwip_begin();
+    }
+    status->state = (uint8_t) g_wifi_state.cstate;
+    status->hw_error_code = g_wifi_state.hw_error_code;
+    status->rssi = -1;
+    if ((g_wifi_state.cstate == CONNECTING) || (g_wifi_state.cstate == CONNECTED_IP)) {
+        status->ssid_index = (int) g_wifi_state.selected_ssid_index;
+        status->channel = g_wifi_state.selected_channel;
+    }
+    if (g_wifi_state.cyw43 && (g_wifi_state.cstate != INITIALISING)) {
+        status->link_status = cyw43_wifi_link_status(g_wifi_state.cyw43, CYW43_ITF_STA);
+        status->scan_active = cyw43_wifi_scan_active(g_wifi_state.cyw43);
+        if ((HW_STATUS_CACHE_TIME_MS == 0) || !g_wifi_state.hw_status.valid) {
+            refresh_hw_status();
+        }
+        status->rssi = g_wifi_state.hw_status.rssi;
+        status->rssi_time_ms = g_wifi_state.hw_status.time_ms;
+    }
+    if (g_wifi_state.netif && netif_is_link_up(g_wifi_state.netif)) {
+        status->link_up = true;
+        status->ipv4_address = ip4_addr_get_u32(netif_ip4_addr(g_wifi_state.netif));
+        status->ipv4_netmask = ip4_addr_get_u32(netif_ip4_netmask(g_wifi_state.netif));
+        status->ipv4_gateway = ip4_addr_get_u32(netif_ip4_gw(g_wifi_state.netif));
+    }
+    if (need_lock) {
+        cyw43_arch_lwip_end();
+    }
+}
+
 int wifi_settings_get_hw_status_text(char* text, int text_size) {
-    if (!g_wifi_state.cyw43) {
+    if ((!g_wifi_state.cyw43) || (g_wifi_state.cstate == INITIALISING)) {
         text[0] = '\0';
         return 0;
     }
 
+    wifi_settings_status_t status;
+    wifi_settings_get_status(&status);
     const char* hw_status_text = "?";
-    switch (cyw43_wifi_link_status(g_wifi_state.cyw43, CYW43_ITF_STA)) {
+    switch (status.link_status) {
         case CYW43_LINK_DOWN:       hw_status_text = "DOWN"; break;
         case CYW43_LINK_JOIN:       hw_status_text = "JOIN"; break;
         case CYW43_LINK_NOIP:       hw_status_text = "NOIP"; break;
@@ -102,18 +180,23 @@ int wifi_settings_get_hw_status_text(char* text, int text_size) {
         case CYW43_LINK_BADAUTH:    hw_status_text = "BADAUTH"; break;
         default: break;
     }
-    int32_t rssi = -1;
-    cyw43_wifi_get_rssi(g_wifi_state.cyw43, &rssi);
     return snprintf(text, text_size,
         "cyw43_wifi_link_status = CYW43_LINK_%s scan_active = %s rssi = %d",
         hw_status_text,
-        cyw43_wifi_scan_active(g_wifi_state.cyw43) ? "True" : "False",
-        (int) rssi);
+        status.scan_active ? "True" : "False",
+        (int) status.rssi);
+}
+
+static const char* get_address_text(uint32_t value, char* addr_buf) {
+    ip4_addr_t addr;
+    ip4_addr_set_u32(&addr, value);
+    return ip4addr_ntoa_r(&addr, addr_buf, IPV4_ADDRESS_SIZE);
 }
 
 int wifi_settings_get_ip_status_text(char* text, int text_size) {
-    if ((!g_wifi_state.netif)
-    || (!netif_is_link_up(g_wifi_state.netif))) {
+    wifi_settings_status_t status;
+    wifi_settings_get_status(&status);
+    if (!status.link_up) {
         text[0] = '\0';
         return 0;
     }
@@ -122,22 +205,21 @@ int wifi_settings_get_ip_status_text(char* text, int text_size) {
     char addr_buf3[IPV4_ADDRESS_SIZE];
     return snprintf(text, text_size,
         "IPv4 address = %s netmask = %s gateway = %s",
-        ip4addr_ntoa_r(netif_ip4_addr(g_wifi_state.netif), addr_buf1, IPV4_ADDRESS_SIZE),
-        ip4addr_ntoa_r(netif_ip4_netmask(g_wifi_state.netif), addr_buf2, IPV4_ADDRESS_SIZE),
-        ip4addr_ntoa_r(netif_ip4_gw(g_wifi_state.netif), addr_buf3, IPV4_ADDRESS_SIZE));
+        get_address_text(status.ipv4_address, addr_buf1),
+        get_address_text(status.ipv4_netmask, addr_buf2),
+        get_address_text(status.ipv4_gateway, addr_buf3));
 }
 
 int wifi_settings_get_ip(char* text, int text_size) {
-    if ((!g_wifi_state.netif)
-    || (!netif_is_link_up(g_wifi_state.netif))) {
+    wifi_settings_status_t status;
+    wifi_settings_get_status(&status);
+    if (!status.link_up) {
         // Not connected - return empty string
         text[0] = '\0';
         return 0;
     }
     char addr_buf[IPV4_ADDRESS_SIZE];
-    return snprintf(text, text_size,
-        "%s",
-        ip4addr_ntoa_r(netif_ip4_addr(g_wifi_state.netif), addr_buf, IPV4_ADDRESS_SIZE));
+    return snprintf(text, text_size, "%s", get_address_text(status.ipv4_address, addr_buf));
 }
 
 int wifi_settings_get_ssid(char* text, int text_size) {
@@ -158,23 +240,73 @@ int wifi_settings_get_ssid(char* text, int text_size) {
     }
 }
 
+static const char* get_ssid_scan_info_text(enum ssid_scan_info_t info) {
+    switch (info) {
+        case NOT_FOUND: return "NOT FOUND"; break;
+        case FOUND:     return "FOUND"; break;
+        case ATTEMPT:   return "ATTEMPT"; break;
+        case SUCCESS:   return "SUCCESS"; break;
+        case FAILED:    return "FAILED"; break;
+        case TIMEOUT:   return "TIMEOUT"; break;
+        case BADAUTH:   return "BADAUTH"; break;
+        case LOST:      return "LOST"; break;
+        default: break;
+    }
+    return "";
+}
+
 const char* wifi_settings_get_ssid_status(int ssid_index) {
+    if ((ssid_index >= 1) && (ssid_index <= (int) g_wifi_state.num_ssid_matches)) {
+        return get_ssid_scan_info_text(g_wifi_state.ssid_match[ssid_index].scan_info);
+    }
     if ((ssid_index >= 1) && (ssid_index <= MAX_NUM_SSIDS)) {
-        switch (g_wifi_state.ssid_scan_info[ssid_index]) {
-            case NOT_FOUND: return "NOT FOUND"; break;
-            case FOUND:     return "FOUND"; break;
-            case ATTEMPT:   return "ATTEMPT"; break;
-            case SUCCESS:   return "SUCCESS"; break;
-            case FAILED:    return "FAILED"; break;
-            case TIMEOUT:   return "TIMEOUT"; break;
-            case BADAUTH:   return "BADAUTH"; break;
-            case LOST:      return "LOST"; break;
-            default: break;
-        }
+        return get_ssid_scan_info_text(NOT_FOUND);
     }
     return "";
 }
 
+void wifi_settings_get_connect_timing(wifi_settings_connect_timing_t* timing) {
+    if (g_wifi_state.context) {
+        // The async_context may be running on the other core
+        cyw43_arch_lwip_begin();
+        *timing = g_wifi_state.timing;
+        cyw43_arch_lwip_end();
+    } else {
+        *timing = g_wifi_state.timing;
+    }
+    if (!timing->failure_cause) {
+        timing->failure_cause = "";
+    }
+}
+
+int wifi_settings_get_connect_timing_text(char* text, int text_size) {
+    wifi_settings_connect_timing_t timing;
+    wifi_settings_get_connect_timing(&timing);
+    if (timing.num_failures == 0) {
+        return snprintf(text, text_size,
+            "scan=%u:%u join=%u link=%u ip=%u attempts=%u failures=0",
+            (unsigned) timing.scan_start_time_ms,
+            (unsigned) timing.scan_end_time_ms,
+            (unsigned) timing.join_start_time_ms,
+            (unsigned) timing.link_up_time_ms,
+            (unsigned) timing.ip_time_ms,
+            (unsigned) timing.num_attempts);
+    }
+    return snprintf(text, text_size,
+        "scan=%u:%u join=%u link=%u ip=%u attempts=%u failures=%u "
+        "last_failure=ssid%d:%s@%u",
+        (unsigned) timing.scan_start_time_ms,
+        (unsigned) timing.scan_end_time_ms,
+        (unsigned) timing.join_start_time_ms,
+        (unsigned) timing.link_up_time_ms,
+        (unsigned) timing.ip_time_ms,
+        (unsigned) timing.num_attempts,
+        (unsigned) timing.num_failures,
+        timing.failure_ssid_index,
+        timing.failure_cause,
+        (unsigned) timing.failure_time_ms);
+}
+
 static bool wifi_is_connected() {
     if (g_wifi_state.netif) {
         return netif_is_link_up(g_wifi_state.netif);
@@ -214,18 +346,41 @@ static bool convert_string_to_bssid(const char* text, uint text_size, uint8_t* b
     return true;
 }
 
-static enum ssid_type_t fetch_ssid(uint ssid_index, char* ssid, uint8_t* bssid) {
-    // Generate search key
-    char key[KEY_SIZE];
-    snprintf(key, sizeof(key), "bssid%u", ssid_index);
+static enum ssid_type_t fetch_hotspot(uint ssid_index, char* ssid, uint8_t* bssid,
+                                      char* password, uint* password_size) {
+    // Get the BSSID or SSID for a hotspot, and optionally the password
+    // (password may be NULL), with a single search of the file.
+    // password_size is set to UINT_MAX if there is no password.
+    // Generate search keys
+    char bssid_key[KEY_SIZE];
+    char pass_key[KEY_SIZE];
+    snprintf(bssid_key, sizeof(bssid_key), "bssid%u", ssid_index);
+    snprintf(pass_key, sizeof(pass_key), "pass%u", ssid_index);
+
+    char bssid_text[WIFI_SSID_SIZE];
+    wifi_settings_key_value_t items[3];
+    memset(items, 0, sizeof(items));
+    items[0].key = bssid_key;
+    items[0].value = bssid_text;
+    items[0].value_size = sizeof(bssid_text) - 1;
+    items[1].key = &bssid_key[1];
+    items[1].value = ssid;
+    items[1].value_size = WIFI_SSID_SIZE - 1;
+    items[2].key = pass_key;
+    items[2].value = password;
+    items[2].value_size = password ? *password_size : 0;
+    wifi_settings_get_values_for_keys(items, password ? 3 : 2);
 
-    uint ssid_size = WIFI_SSID_SIZE;
     memset(bssid, 0, WIFI_BSSID_SIZE);
+    if (password) {
+        *password_size = items[2].found ? items[2].value_size : UINT_MAX;
+    }
 
     // A BSSID is specified in the file as bssid1=01:23:45:67:89:ab
-    if (wifi_settings_get_value_for_key(key, ssid, &ssid_size)) {
-        ssid[ssid_size] = '\0';
-        if (convert_string_to_bssid(ssid, ssid_size, bssid)) {
+    if (items[0].found) {
+        bssid_text[items[0].value_size] = '\0';
+        if (convert_string_to_bssid(bssid_text, items[0].value_size, bssid)) {
+            strcpy(ssid, bssid_text);
             return BSSID;
         }
     }
@@ -233,8 +388,8 @@ static enum ssid_type_t fetch_ssid(uint ssid_index, char* ssid, uint8_t* bssid)
     // An SSID is specified in the file as ssid1=MyHotspotName
     // and must match exactly; SSIDs cannot contain characters recognised
     // as end of line or end of file (\r \n \xff \x00 \x1a)
-    if (wifi_settings_get_value_for_key(&key[1], ssid, &ssid_size)) {
-        ssid[ssid_size] = '\0';
+    if (items[1].found) {
+        ssid[items[1].value_size] = '\0';
         return SSID;
     }
     // Undefined SSID and BSSID
@@ -243,37 +398,256 @@ static enum ssid_type_t fetch_ssid(uint ssid_index, char* ssid, uint8_t* bssid)
     return NONE;
 }
 
-static int wifi_scan_callback(void* unused, const cyw43_ev_scan_result_t* scan_result) {
-    // Is this SSID known? Iterate through the file to see if there is a record of it.
-    for (uint ssid_index = 1; ssid_index <= MAX_NUM_SSIDS; ssid_index++) {
-        // Skip SSIDs that we already saw
-        if (g_wifi_state.ssid_scan_info[ssid_index] != NOT_FOUND) {
-            continue;
-        }
+static enum ssid_type_t fetch_ssid(uint ssid_index, char* ssid, uint8_t* bssid) {
+    return fetch_hotspot(ssid_index, ssid, bssid, NULL, NULL);
+}
+
+static uint16_t get_ssid_hash(const uint8_t* ssid, uint ssid_size) {
+    // FNV-1a hash, folded to 16 bits
+    uint32_t hash = 2166136261u;
+    for (uint i = 0; i < ssid_size; i++) {
+        hash ^= ssid[i];
+        hash *= 16777619u;
+    }
+    return (uint16_t) (hash ^ (hash >> 16));
+}
+
+static int8_t fetch_priority(uint ssid_index) {
+    // A priority is specified in the file as prio1=<number>; higher numbers are
+    // preferred. The default priority is 0.
+    char key[KEY_SIZE];
+    snprintf(key, sizeof(key), "prio%u", ssid_index);
 
-        // Check file entries for bssid<ssid_index> and ssid<ssid_index>
+    char value[8];
+    uint value_size = sizeof(value) - 1;
+    if (!wifi_settings_get_value_for_key(key, value, &value_size)) {
+        return 0;
+    }
+    value[value_size] = '\0';
+    long priority = strtol(value, NULL, 10);
+    if (priority < INT8_MIN) {
+        priority = INT8_MIN;
+    } else if (priority > INT8_MAX) {
+        priority = INT8_MAX;
+    }
+    return (int8_t) priority;
+}
+
+static bool fetch_select_by_rssi() {
+    // The selection policy is specified in the file as select=rssi (the strongest
+    // hotspot is preferred) or select=order (the lowest-numbered hotspot is preferred,
+    // which is the default). Priorities set by prio<n> apply in both cases.
+    char value[5];
+    uint value_size = sizeof(value);
+    return wifi_settings_get_value_for_key("select", value, &value_size)
+        && (value_size == 4)
+        && (memcmp(value, "rssi", 4) == 0);
+}
+
+static bool fetch_directed(uint ssid_index) {
+    // A directed scan is requested in the file as scan1=directed. The hotspot is
+    // looked for by a scan that sends probe requests containing its SSID. This is
+    // needed for hidden hotspots, which don't include their SSID in beacons.
+    char key[KEY_SIZE];
+    snprintf(key, sizeof(key), "scan%u", ssid_index);
+
+    char value[9];
+    uint value_size = sizeof(value);
+    return wifi_settings_get_value_for_key(key, value, &value_size)
+        && (value_size == 8)
+        && (memcmp(value, "directed", 8) == 0);
+}
+
+static void set_selected_scan_info(enum ssid_scan_info_t info) {
+    // Record the state of the selected hotspot, if it is still in the table
+    const uint ssid_index = g_wifi_state.selected_ssid_index;
+    if ((ssid_index >= 1) && (ssid_index <= g_wifi_state.num_ssid_matches)) {
+        g_wifi_state.ssid_match[ssid_index].scan_info = info;
+    }
+}
+
+static void build_ssid_match_table() {
+    // Copy the SSIDs and BSSIDs from the file into g_wifi_state.ssid_match,
+    // so that wifi_scan_callback does not need to search the file for each scan result.
+    // All hotspots become NOT_FOUND. The table is only as large as the number of
+    // hotspots in the file, and other loops over hotspots are bounded by this.
+    g_wifi_state.num_ssid_matches = 0;
+    g_wifi_state.top_ssid_index = 0;
+    g_wifi_state.top_ssid_found = false;
+    g_wifi_state.broadcast_scan_needed = false;
+    g_wifi_state.select_by_rssi = fetch_select_by_rssi();
+    for (uint ssid_index = 1; ssid_index <= MAX_NUM_SSIDS; ssid_index++) {
+        struct ssid_match_t* match = &g_wifi_state.ssid_match[ssid_index];
         char ssid[WIFI_SSID_SIZE];
         uint8_t bssid[WIFI_BSSID_SIZE];
-        enum ssid_type_t ssid_type = fetch_ssid(ssid_index, ssid, bssid);
-        switch (ssid_type) {
+
+        memset(match, 0, sizeof(struct ssid_match_t));
+        match->ssid_type = fetch_ssid(ssid_index, ssid, bssid);
+        switch (match->ssid_type) {
+            case BSSID:
+                memcpy(match->bssid, bssid, WIFI_BSSID_SIZE);
+                break;
+            case SSID:
+                match->ssid_size = (uint8_t) strlen(ssid);
+                match->ssid_hash = get_ssid_hash((const uint8_t*) ssid, match->ssid_size);
+                match->directed = fetch_directed(ssid_index);
+                break;
+            case NONE:
+                // ssid<n> doesn't exist, so ssid<n+1>, ssid<n+2> etc. won't be checked
+                return;
+        }
+        match->priority = fetch_priority(ssid_index);
+        g_wifi_state.num_ssid_matches = ssid_index;
+        if (!match->directed) {
+            g_wifi_state.broadcast_scan_needed = true;
+        }
+        if ((g_wifi_state.top_ssid_index == 0)
+        || (match->priority > g_wifi_state.ssid_match[g_wifi_state.top_ssid_index].priority)) {
+            g_wifi_state.top_ssid_index = ssid_index;
+        }
+    }
+}
+
+static void set_found(uint ssid_index, const cyw43_ev_scan_result_t* scan_result) {
+    // Record the hotspot as found, along with the details needed to rejoin it later.
+    // If there is more than one access point for the same hotspot, this is
+    // the one with the strongest signal.
+    struct ssid_match_t* match = &g_wifi_state.ssid_match[ssid_index];
+    memcpy(match->found_bssid, scan_result->bssid, WIFI_BSSID_SIZE);
+    match->found_channel = scan_result->channel;
+    match->found_rssi = scan_result->rssi;
+    match->scan_info = FOUND;
+
+    if (EARLY_SCAN_TERMINATION
+    && (ssid_index == g_wifi_state.top_ssid_index)
+    && !g_wifi_state.select_by_rssi) {
+        // Nothing else in the scan could be preferred to this hotspot,
+        // so the connection attempt can begin immediately
+        g_wifi_state.top_ssid_found = true;
+        async_context_set_work_pending(g_wifi_state.context, &g_wifi_state.event_worker);
+    }
+}
+
+static void begin_scan_results() {
+    // Called as a scan begins: the results of the previous scan are discarded
+#if SCAN_RESULTS_SIZE > 0
+    g_wifi_state.num_scan_results = 0;
+#endif
+    g_wifi_state.scan_results_pending = true;
+}
+
+static void add_scan_result(const cyw43_ev_scan_result_t* scan_result, uint scan_ssid_size) {
+    // Record an access point for wifi_settings_get_scan_results. The results are
+    // kept in order of signal strength, so if there is no space, the weakest is
+    // discarded. An access point may be reported more than once by the same scan:
+    // only the strongest signal is kept.
+#if SCAN_RESULTS_SIZE > 0
+    wifi_settings_scan_result_t* results = g_wifi_state.scan_results;
+    uint count = g_wifi_state.num_scan_results;
+    for (uint i = 0; i < count; i++) {
+        if (memcmp(results[i].bssid, scan_result->bssid, WIFI_BSSID_SIZE) == 0) {
+            if (results[i].rssi >= scan_result->rssi) {
+                return;
+            }
+            count--;
+            memmove(&results[i], &results[i + 1], (count - i) * sizeof(wifi_settings_scan_result_t));
+            break;
+        }
+    }
+    uint index = 0;
+    while ((index < count) && (results[index].rssi >= scan_result->rssi)) {
+        index++;
+    }
+    if (index >= SCAN_RESULTS_SIZE) {
+        // Weaker than all of the others
+        g_wifi_state.num_scan_results = count;
+        return;
+    }
+    if (count >= SCAN_RESULTS_SIZE) {
+        count = SCAN_RESULTS_SIZE - 1;
+    }
+    memmove(&results[index + 1], &results[index], (count - index) * sizeof(wifi_settings_scan_result_t));
+    wifi_settings_scan_result_t* result = &results[index];
+    memcpy(result->bssid, scan_result->bssid, WIFI_BSSID_SIZE);
+    result->channel = scan_result->channel;
+    result->rssi = scan_result->rssi;
+    result->auth_mode = scan_result->auth_mode;
+    result->ssid_len = (uint8_t) scan_ssid_size;
+    memcpy(result->ssid, scan_result->ssid, scan_ssid_size);
+    result->ssid[scan_ssid_size] = '\0';
+    g_wifi_state.num_scan_results = count + 1;
+#endif
+}
+
+static void end_scan_results() {
+    // Called when a scan is complete, to tell the application
+    if (!g_wifi_state.scan_results_pending) {
+        return;
+    }
+    g_wifi_state.scan_results_pending = false;
+    if (g_wifi_state.scan_callback) {
+        int num_results = 0;
+#if SCAN_RESULTS_SIZE > 0
+        num_results = (int) g_wifi_state.num_scan_results;
+#endif
+        g_wifi_state.scan_callback(num_results, g_wifi_state.scan_callback_arg);
+    }
+}
+
+static int wifi_scan_callback(void* unused, const cyw43_ev_scan_result_t* scan_result) {
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    uint scan_ssid_size = (uint) scan_result->ssid_len;
+    if (scan_ssid_size > sizeof(scan_result->ssid)) {
+        scan_ssid_size = sizeof(scan_result->ssid);
+    }
+    add_scan_result(scan_result, scan_ssid_size);
+
+    // Is this SSID known? Check the table built by build_ssid_match_table.
+    const uint16_t scan_ssid_hash = get_ssid_hash(scan_result->ssid, scan_ssid_size);
+
+    for (uint ssid_index = 1; ssid_index <= g_wifi_state.num_ssid_matches; ssid_index++) {
+        const struct ssid_match_t* match = &g_wifi_state.ssid_match[ssid_index];
+
+        // Skip SSIDs that we already saw, unless this is a stronger signal
+        // from another access point
+        switch (match->scan_info) {
+            case NOT_FOUND:
+                break;
+            case FOUND:
+                if (scan_result->rssi > match->found_rssi) {
+                    break;
+                }
+                continue;
+            default:
+                continue;
+        }
+
+        switch (match->ssid_type) {
             case BSSID:
-                if (memcmp(bssid, scan_result->bssid, WIFI_BSSID_SIZE) == 0) {
+                if (memcmp(match->bssid, scan_result->bssid, WIFI_BSSID_SIZE) == 0) {
                     // BSSID match
-                    g_wifi_state.ssid_scan_info[ssid_index] = FOUND;
+                    set_found(ssid_index, scan_result);
                 }
                 break;
             case SSID:
-                if ((strlen(ssid) == (uint) scan_result->ssid_len)
-                && (memcmp(scan_result->ssid, ssid, (uint) scan_result->ssid_len) == 0)) {
-                    // SSID match
-                    g_wifi_state.ssid_scan_info[ssid_index] = FOUND;
+                if ((match->ssid_size == scan_ssid_size)
+                && (match->ssid_hash == scan_ssid_hash)) {
+                    // Probable SSID match - confirm with the entry in the file
+                    char ssid[WIFI_SSID_SIZE];
+                    uint8_t bssid[WIFI_BSSID_SIZE];
+                    if ((fetch_ssid(ssid_index, ssid, bssid) == SSID)
+                    && (strlen(ssid) == scan_ssid_size)
+                    && (memcmp(scan_result->ssid, ssid, scan_ssid_size) == 0)) {
+                        // SSID match
+                        set_found(ssid_index, scan_result);
+                    }
                 }
                 break;
             case NONE:
-                // ssid<n> doesn't exist, so ssid<n+1>, ssid<n+2> etc. won't be checked
-                return 0;
+                break;
         }
     }
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_SCAN_CALLBACK, profile_start);
     // No more entries to try
     return 0;
 }
@@ -283,50 +657,84 @@ static void ensure_disconnected() {
     g_wifi_state.netif = NULL;
 }
 
-static void begin_connecting() {
-    // This function is called after a scan, to begin connecting to a new hotspot.
-    // It looks at the results of the scan and previous connections, via ssid_scan_info.
-    ensure_disconnected();
+static bool fetch_ip_address(const char* key_prefix, uint ssid_index, char* value) {
+    // Get the text of an IP address from the file, e.g. ip1=192.168.0.2.
+    // value must have space for IPV4_ADDRESS_SIZE characters.
+    char key[KEY_SIZE];
+    snprintf(key, sizeof(key), "%s%u", key_prefix, ssid_index);
 
-    // Which hotspot to connect to?
-    g_wifi_state.selected_ssid_index = 0;
-    for (uint ssid_index = 1; ssid_index <= MAX_NUM_SSIDS; ssid_index++) {
-        if (g_wifi_state.ssid_scan_info[ssid_index] == FOUND) {
-            g_wifi_state.selected_ssid_index = ssid_index;
-            break;
-        }
+    uint value_size = IPV4_ADDRESS_SIZE - 1;
+    if (!wifi_settings_get_value_for_key(key, value, &value_size)) {
+        return false;
     }
+    value[value_size] = '\0';
+    return true;
+}
 
-    if (g_wifi_state.selected_ssid_index == 0) {
-        // There are no available hotspots to connect to, either because the scan
-        // didn't find anything, or everything is FAILED, TIMEOUT, BADAUTH or LOST.
-        // In this case we should scan again.
-        g_wifi_state.cstate = TRY_TO_CONNECT;
+static void configure_ip_address() {
+    // Called before joining g_wifi_state.selected_ssid_index. If ip<n> is
+    // specified in the file, then the hotspot uses a static IP address,
+    // DHCP is not needed, and the connection is complete as soon as the hotspot
+    // has been joined. Otherwise, DHCP is used.
+    struct netif* netif = netif_default;
+    if (!netif) {
         return;
     }
+    const uint ssid_index = g_wifi_state.selected_ssid_index;
+    char value[IPV4_ADDRESS_SIZE];
+    ip4_addr_t address, netmask, gateway;
+    if (fetch_ip_address("ip", ssid_index, value) && ip4addr_aton(value, &address)) {
+        if (!(fetch_ip_address("mask", ssid_index, value) && ip4addr_aton(value, &netmask))) {
+            IP4_ADDR(&netmask, 255, 255, 255, 0);
+        }
+        if (!(fetch_ip_address("gw", ssid_index, value) && ip4addr_aton(value, &gateway))) {
+            ip4_addr_set_zero(&gateway);
+        }
+        dhcp_stop(netif);
+        netif_set_addr(netif, &address, &netmask, &gateway);
+#if LWIP_DNS
+        ip_addr_t dns_server;
+        if (fetch_ip_address("dns", ssid_index, value) && ipaddr_aton(value, &dns_server)) {
+            dns_setserver(0, &dns_server);
+        }
+#endif
+        g_wifi_state.static_ip_address = true;
+    } else if (g_wifi_state.static_ip_address) {
+        // A static IP address was used for the previous hotspot, but not this one
+        netif_set_addr(netif, IP4_ADDR_ANY4, IP4_ADDR_ANY4, IP4_ADDR_ANY4);
+        dhcp_start(netif);
+        g_wifi_state.static_ip_address = false;
+    }
+}
 
-    // Begin connecting
-    g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] = ATTEMPT;
-    g_wifi_state.connect_timeout_time = make_timeout_time_ms(CONNECT_TIMEOUT_TIME_MS);
+static void join_selected_hotspot(uint32_t timeout_ms) {
+    // Begin connecting to g_wifi_state.selected_ssid_index.
+    // g_wifi_state.selected_bssid and g_wifi_state.selected_channel identify the
+    // access point that was found, so the join is pinned to it, and the
+    // hardware does not have to search all channels again.
+    set_selected_scan_info(ATTEMPT);
+    g_wifi_state.connect_timeout_time = make_timeout_time_ms(timeout_ms);
     g_wifi_state.cstate = CONNECTING;
+    g_wifi_state.timing.join_start_time_ms = get_time_ms();
+    g_wifi_state.timing.link_up_time_ms = 0;
+    g_wifi_state.timing.ip_time_ms = 0;
+    g_wifi_state.timing.ssid_index = (int) g_wifi_state.selected_ssid_index;
+    g_wifi_state.timing.num_attempts++;
 
-    // Get the password
-    char key[KEY_SIZE];
-    snprintf(key, sizeof(key), "pass%u", g_wifi_state.selected_ssid_index);
+    // Get the BSSID or SSID, and the password
+    char ssid[WIFI_SSID_SIZE];
+    uint8_t bssid[WIFI_BSSID_SIZE];
     char password[WIFI_PASSWORD_SIZE];
     uint password_size = sizeof(password) - 1;
+    enum ssid_type_t ssid_type = fetch_hotspot(g_wifi_state.selected_ssid_index,
+                                               ssid, bssid, password, &password_size);
     uint32_t auth_type = CYW43_AUTH_WPA2_AES_PSK;
-    if (!wifi_settings_get_value_for_key(key, password, &password_size)) {
+    if (password_size == UINT_MAX) {
         // No password specified (open WiFi)
         password_size = 0;
         auth_type = CYW43_AUTH_OPEN;
     }
     password[password_size] = '\0';
-
-    // Get the BSSID or SSID
-    char ssid[WIFI_SSID_SIZE];
-    uint8_t bssid[WIFI_BSSID_SIZE];
-    enum ssid_type_t ssid_type = fetch_ssid(g_wifi_state.selected_ssid_index, ssid, bssid);
     if (ssid_type == NONE) {
         // No valid SSID or BSSID - this could happen if the storage was updated
         // between scanning and connecting. Force a rescan
@@ -335,7 +743,17 @@ static void begin_connecting() {
         return;
     }
 
+    log_event(WIFI_SETTINGS_EVENT_LOG_JOIN,
+              g_wifi_state.fast_reconnect_attempt ? 0 :
+                g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].found_rssi,
+              g_wifi_state.fast_reconnect_attempt ? 1 : 0);
+
+    // Use a static IP address if specified
+    configure_ip_address();
+
     // Begin connection
+    const uint32_t channel = (g_wifi_state.selected_channel != 0) ?
+            g_wifi_state.selected_channel : CYW43_CHANNEL_NONE;
     if (ssid_type == BSSID) {
         g_wifi_state.hw_error_code = cyw43_wifi_join(g_wifi_state.cyw43,
                 0, // size_t ssid_len
@@ -344,7 +762,7 @@ static void begin_connecting() {
                 (const uint8_t *) password, // const uint8_t *key
                 auth_type, // uint32_t auth_type
                 bssid, // const uint8_t *bssid
-                CYW43_CHANNEL_NONE); // uint32_t channel
+                channel); // uint32_t channel
     } else {
         g_wifi_state.hw_error_code = cyw43_wifi_join(g_wifi_state.cyw43,
                 strlen(ssid), // size_t ssid_len
@@ -352,15 +770,184 @@ static void begin_connecting() {
                 password_size, // size_t key_len
                 (const uint8_t *) password, // const uint8_t *key
                 auth_type, // uint32_t auth_type
-                NULL, // const uint8_t *bssid
-                CYW43_CHANNEL_NONE); // uint32_t channel
+                g_wifi_state.selected_bssid, // const uint8_t *bssid
+                channel); // uint32_t channel
+    }
+}
+
+static bool is_better_hotspot(uint ssid_index, uint other_ssid_index) {
+    // True if ssid_index should be preferred to other_ssid_index, which has a
+    // lower number. The priority is considered first, then (if select=rssi)
+    // the signal strength.
+    const struct ssid_match_t* match = &g_wifi_state.ssid_match[ssid_index];
+    const struct ssid_match_t* other = &g_wifi_state.ssid_match[other_ssid_index];
+    if (match->priority != other->priority) {
+        return match->priority > other->priority;
+    }
+    return g_wifi_state.select_by_rssi && (match->found_rssi > other->found_rssi);
+}
+
+static void report_event(wifi_settings_event_t event) {
+    // Record the event, with the most recent signal strength reading
+    const int32_t rssi = (g_wifi_state.hw_status.valid && (g_wifi_state.hw_status.rssi != -1)) ?
+                            g_wifi_state.hw_status.rssi : 0;
+    log_event((uint8_t) event, rssi, 0);
+
+    // Tell the application about a connection event
+    if (g_wifi_state.event_callback) {
+        g_wifi_state.event_callback(event, g_wifi_state.event_callback_arg);
+    }
+}
+
+static uint32_t get_power_management_mode() {
+    // Choose the cyw43 power management mode for the current profile
+    wifi_settings_power_profile_t profile = g_wifi_state.power_profile;
+    if (REMOTE_LOW_LATENCY && g_wifi_state.remote_active) {
+        profile = WIFI_SETTINGS_POWER_PROFILE_LOW_LATENCY;
+    }
+    switch (profile) {
+        case WIFI_SETTINGS_POWER_PROFILE_LOW_LATENCY:   return CYW43_NONE_PM;
+        case WIFI_SETTINGS_POWER_PROFILE_LOW_POWER:     return CYW43_AGGRESSIVE_PM;
+        default:                                        return CYW43_DEFAULT_PM;
     }
 }
 
+static void apply_power_profile() {
+    // Set the power management mode. This is also done each time a hotspot is joined,
+    // so that the mode is kept across reconnections. Only a failure is stored in
+    // hw_error_code, so that an earlier join or scan error is still reported.
+    const int err = cyw43_wifi_pm(g_wifi_state.cyw43, get_power_management_mode());
+    if (err) {
+        g_wifi_state.hw_error_code = err;
+    }
+}
+
+static bool can_apply_power_profile() {
+    // The cyw43 hardware can't be configured until initialisation has finished
+    return (g_wifi_state.cstate != UNINITIALISED) && (g_wifi_state.cstate != INITIALISING);
+}
+
+static void begin_connecting() {
+    // This function is called after a scan, to begin connecting to a new hotspot.
+    // It looks at the results of the scan and previous connections, via ssid_scan_info.
+    ensure_disconnected();
+    g_wifi_state.fast_reconnect_attempt = false;
+
+    // Which hotspot to connect to?
+    g_wifi_state.selected_ssid_index = 0;
+    for (uint ssid_index = 1; ssid_index <= g_wifi_state.num_ssid_matches; ssid_index++) {
+        if ((g_wifi_state.ssid_match[ssid_index].scan_info == FOUND)
+        && ((g_wifi_state.selected_ssid_index == 0)
+            || is_better_hotspot(ssid_index, g_wifi_state.selected_ssid_index))) {
+            g_wifi_state.selected_ssid_index = ssid_index;
+        }
+    }
+
+    if (g_wifi_state.selected_ssid_index == 0) {
+        // There are no available hotspots to connect to, either because the scan
+        // didn't find anything, or everything is FAILED, TIMEOUT, BADAUTH or LOST.
+        // In this case we should scan again.
+        g_wifi_state.cstate = TRY_TO_CONNECT;
+        report_event(WIFI_SETTINGS_EVENT_SCAN_FAILED);
+        return;
+    }
+
+    // Remember where the hotspot was found
+    const struct ssid_match_t* match = &g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index];
+    memcpy(g_wifi_state.selected_bssid, match->found_bssid, WIFI_BSSID_SIZE);
+    g_wifi_state.selected_channel = match->found_channel;
+
+    // Begin connecting
+    join_selected_hotspot(CONNECT_TIMEOUT_TIME_MS);
+}
+
+static bool begin_fast_reconnect() {
+    // This function is called instead of beginning a new scan, if the most recently
+    // used hotspot is known. It tries to rejoin that hotspot directly.
+    // Returns false if this is not possible.
+    g_wifi_state.fast_reconnect_pending = false;
+    if ((FAST_RECONNECT_TIMEOUT_TIME_MS == 0)
+    || (g_wifi_state.last_ssid_index == 0)
+    || (g_wifi_state.last_ssid_index > g_wifi_state.num_ssid_matches)) {
+        return false;
+    }
+    ensure_disconnected();
+
+    // Nothing is known about other hotspots, as there was no scan
+    for (uint ssid_index = 1; ssid_index <= g_wifi_state.num_ssid_matches; ssid_index++) {
+        g_wifi_state.ssid_match[ssid_index].scan_info = NOT_FOUND;
+    }
+    g_wifi_state.fast_reconnect_attempt = true;
+    g_wifi_state.timing.scan_start_time_ms = 0;
+    g_wifi_state.timing.scan_end_time_ms = 0;
+    g_wifi_state.selected_ssid_index = g_wifi_state.last_ssid_index;
+    memcpy(g_wifi_state.selected_bssid, g_wifi_state.last_bssid, WIFI_BSSID_SIZE);
+    g_wifi_state.selected_channel = g_wifi_state.last_channel;
+    join_selected_hotspot(FAST_RECONNECT_TIMEOUT_TIME_MS);
+    return g_wifi_state.cstate == CONNECTING;
+}
+
+static void save_last_connection() {
+    // Called after connecting successfully: this hotspot will be tried first
+    // if the connection is lost.
+    g_wifi_state.last_ssid_index = g_wifi_state.selected_ssid_index;
+    memcpy(g_wifi_state.last_bssid, g_wifi_state.selected_bssid, WIFI_BSSID_SIZE);
+    g_wifi_state.last_channel = g_wifi_state.selected_channel;
+    g_wifi_state.fast_reconnect_pending = true;
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+    volatile uint32_t* scratch = &watchdog_hw->scratch[WIFI_SETTINGS_FAST_RECONNECT_SCRATCH];
+    const uint8_t* b = g_wifi_state.last_bssid;
+    scratch[0] = FAST_RECONNECT_MAGIC | (g_wifi_state.last_ssid_index & 0xffff);
+    scratch[1] = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+    scratch[2] = b[4] | (b[5] << 8) | ((uint32_t) g_wifi_state.last_channel << 16);
+#endif
+}
+
+static void forget_last_connection() {
+    // Called if a fast reconnection fails
+    g_wifi_state.last_ssid_index = 0;
+    g_wifi_state.fast_reconnect_pending = false;
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+    watchdog_hw->scratch[WIFI_SETTINGS_FAST_RECONNECT_SCRATCH] = 0;
+#endif
+}
+
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+static void load_last_connection() {
+    // Called during initialisation, to recover the most recently used hotspot
+    // from before a soft reset
+    const volatile uint32_t* scratch = &watchdog_hw->scratch[WIFI_SETTINGS_FAST_RECONNECT_SCRATCH];
+    if ((scratch[0] & 0xffff0000) != FAST_RECONNECT_MAGIC) {
+        return;
+    }
+    g_wifi_state.last_ssid_index = scratch[0] & 0xffff;
+    g_wifi_state.last_bssid[0] = (uint8_t) (scratch[1] >> 0);
+    g_wifi_state.last_bssid[1] = (uint8_t) (scratch[1] >> 8);
+    g_wifi_state.last_bssid[2] = (uint8_t) (scratch[1] >> 16);
+    g_wifi_state.last_bssid[3] = (uint8_t) (scratch[1] >> 24);
+    g_wifi_state.last_bssid[4] = (uint8_t) (scratch[2] >> 0);
+    g_wifi_state.last_bssid[5] = (uint8_t) (scratch[2] >> 8);
+    g_wifi_state.last_channel = (uint16_t) (scratch[2] >> 16);
+    g_wifi_state.fast_reconnect_pending = true;
+}
+#endif
+
 static void give_up_connecting(enum ssid_scan_info_t info) {
     // Mark the selected SSID as bad in some way (e.g. BADAUTH, TIMEOUT)
     // so that it won't be tried again. Go back to the SCANNING state.
-    g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] = info;
+    set_selected_scan_info(info);
+    g_wifi_state.timing.failure_time_ms = get_time_ms();
+    g_wifi_state.timing.failure_ssid_index = (int) g_wifi_state.selected_ssid_index;
+    g_wifi_state.timing.failure_cause = get_ssid_scan_info_text(info);
+    g_wifi_state.timing.num_failures++;
+    log_event((info == BADAUTH) ? WIFI_SETTINGS_EVENT_LOG_AUTH_FAILED :
+              (info == TIMEOUT) ? WIFI_SETTINGS_EVENT_LOG_JOIN_TIMEOUT :
+                                  WIFI_SETTINGS_EVENT_LOG_JOIN_FAILED, 0, 0);
+    if (g_wifi_state.fast_reconnect_attempt) {
+        // Fast reconnection didn't work: the next attempt will begin with a scan
+        g_wifi_state.fast_reconnect_attempt = false;
+        forget_last_connection();
+    }
     g_wifi_state.cstate = SCANNING;
 }
 
@@ -376,29 +963,185 @@ static bool has_valid_address() {
     return false;
 }
 
+static bool begin_next_scan() {
+    // A scan is made up of a directed scan for each hotspot with scan<n>=directed,
+    // followed by a broadcast scan which finds all other hotspots. This function
+    // starts the next part of the scan, returning false if there are no more parts.
+    cyw43_wifi_scan_options_t opts;
+    memset(&opts, 0, sizeof(opts));
+    uint ssid_index = g_wifi_state.directed_scan_index + 1;
+    while ((ssid_index <= g_wifi_state.num_ssid_matches)
+    && !g_wifi_state.ssid_match[ssid_index].directed) {
+        ssid_index++;
+    }
+    if (ssid_index <= g_wifi_state.num_ssid_matches) {
+        // Directed scan for ssid<n>
+        char ssid[WIFI_SSID_SIZE];
+        uint8_t bssid[WIFI_BSSID_SIZE];
+        g_wifi_state.directed_scan_index = ssid_index;
+        if (fetch_ssid(ssid_index, ssid, bssid) != SSID) {
+            // The file was updated since the scan began
+            return begin_next_scan();
+        }
+        opts.ssid_len = (uint32_t) strlen(ssid);
+        memcpy(opts.ssid, ssid, opts.ssid_len);
+    } else if ((g_wifi_state.directed_scan_index <= g_wifi_state.num_ssid_matches)
+    && g_wifi_state.broadcast_scan_needed) {
+        // Broadcast scan
+        g_wifi_state.directed_scan_index = MAX_NUM_SSIDS + 1;
+    } else {
+        // No more parts
+        g_wifi_state.directed_scan_index = MAX_NUM_SSIDS + 1;
+        return false;
+    }
+    g_wifi_state.hw_error_code = cyw43_wifi_scan(g_wifi_state.cyw43, &opts, NULL, wifi_scan_callback);
+    g_wifi_state.cstate = SCANNING;
+    return true;
+}
+
 static void begin_new_scan() {
     // Begin a scan. We will reset everything we know about hotspots first.
-    for (uint ssid_index = 1; ssid_index <= MAX_NUM_SSIDS; ssid_index++) {
-        g_wifi_state.ssid_scan_info[ssid_index] = NOT_FOUND;
-    }
+    build_ssid_match_table();
     // Start the scan
+    g_wifi_state.timing.scan_start_time_ms = get_time_ms();
+    g_wifi_state.timing.scan_end_time_ms = 0;
+    g_wifi_state.timing.join_start_time_ms = 0;
+    g_wifi_state.timing.link_up_time_ms = 0;
+    g_wifi_state.timing.ip_time_ms = 0;
+    g_wifi_state.directed_scan_index = 0;
+    log_event(WIFI_SETTINGS_EVENT_LOG_SCAN_STARTED, 0, 0);
+    begin_scan_results();
+    begin_next_scan();
+    g_wifi_state.cstate = SCANNING;
+    // If this scan doesn't lead to a connection, the next one will be delayed
+    // for longer (exponential backoff)
+    g_wifi_state.scan_holdoff_time = make_timeout_time_ms(g_wifi_state.scan_backoff_time_ms);
+    g_wifi_state.scan_backoff_time_ms *= 2;
+    if (g_wifi_state.scan_backoff_time_ms > MAX_REPEAT_SCAN_TIME_MS) {
+        g_wifi_state.scan_backoff_time_ms = MAX_REPEAT_SCAN_TIME_MS;
+    }
+}
+
+#ifdef ROAMING_RSSI_THRESHOLD
+static void begin_roaming_scan() {
+    // Begin a scan in the background while connected, looking for an access point
+    // with a stronger signal. The connection is not affected.
+    build_ssid_match_table();
+    g_wifi_state.timing.scan_start_time_ms = get_time_ms();
+    g_wifi_state.timing.scan_end_time_ms = 0;
     cyw43_wifi_scan_options_t opts;
     memset(&opts, 0, sizeof(opts));
-    g_wifi_state.hw_error_code = cyw43_wifi_scan(g_wifi_state.cyw43, &opts, NULL, wifi_scan_callback);
-    g_wifi_state.cstate = SCANNING;
-    g_wifi_state.scan_holdoff_time = make_timeout_time_ms(REPEAT_SCAN_TIME_MS);
+    begin_scan_results();
+    // Only a failure is stored in hw_error_code, as the connection is still in use
+    const int err = cyw43_wifi_scan(g_wifi_state.cyw43, &opts, NULL, wifi_scan_callback);
+    g_wifi_state.roaming_scan_active = (err == 0);
+    if (err) {
+        g_wifi_state.hw_error_code = err;
+    }
 }
 
-static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_time_worker_t* unused2) {
+static void end_roaming_scan() {
+    // Called when the background scan is complete. If an access point was found
+    // with a signal that is stronger by at least ROAMING_RSSI_MARGIN, for a hotspot
+    // with at least the same priority, then disconnect and join it.
+    const uint current_ssid_index = g_wifi_state.selected_ssid_index;
+    const int8_t current_priority = (current_ssid_index <= g_wifi_state.num_ssid_matches) ?
+            g_wifi_state.ssid_match[current_ssid_index].priority : INT8_MIN;
+    g_wifi_state.roaming_scan_active = false;
+    g_wifi_state.roaming_low_rssi_count = 0;
+    g_wifi_state.timing.scan_end_time_ms = get_time_ms();
+    end_scan_results();
+
+    uint best_ssid_index = 0;
+    for (uint ssid_index = 1; ssid_index <= g_wifi_state.num_ssid_matches; ssid_index++) {
+        const struct ssid_match_t* match = &g_wifi_state.ssid_match[ssid_index];
+        if ((match->scan_info != FOUND)
+        || (match->priority < current_priority)
+        || (match->found_rssi < (g_wifi_state.roaming_rssi + ROAMING_RSSI_MARGIN))
+        || ((ssid_index == current_ssid_index)
+            && (memcmp(match->found_bssid, g_wifi_state.selected_bssid, WIFI_BSSID_SIZE) == 0))) {
+            continue;
+        }
+        const struct ssid_match_t* best = &g_wifi_state.ssid_match[best_ssid_index];
+        if ((best_ssid_index == 0)
+        || (match->priority > best->priority)
+        || ((match->priority == best->priority) && (match->found_rssi > best->found_rssi))) {
+            best_ssid_index = ssid_index;
+        }
+    }
+    if (best_ssid_index == 0) {
+        // Nothing better was found: stay connected
+        set_selected_scan_info(SUCCESS);
+        return;
+    }
+
+    // Move to the better access point. The other scan results remain available
+    // in case the attempt fails.
+    ensure_disconnected();
+    g_wifi_state.fast_reconnect_attempt = false;
+    g_wifi_state.selected_ssid_index = best_ssid_index;
+    const struct ssid_match_t* match = &g_wifi_state.ssid_match[best_ssid_index];
+    memcpy(g_wifi_state.selected_bssid, match->found_bssid, WIFI_BSSID_SIZE);
+    g_wifi_state.selected_channel = match->found_channel;
+    join_selected_hotspot(CONNECT_TIMEOUT_TIME_MS);
+}
+
+static void check_roaming() {
+    // Called in the CONNECTED_IP state to check the signal strength, and
+    // move to a better access point if the signal is too weak.
+    if (g_wifi_state.roaming_scan_active) {
+        if (!cyw43_wifi_scan_active(g_wifi_state.cyw43)) {
+            end_roaming_scan();
+        }
+        return;
+    }
+    if (!time_reached(g_wifi_state.roaming_check_time)) {
+        return;
+    }
+    g_wifi_state.roaming_check_time = make_timeout_time_ms(ROAMING_CHECK_TIME_MS);
+    int32_t rssi = 0;
+    if (cyw43_wifi_get_rssi(g_wifi_state.cyw43, &rssi) != 0) {
+        return;
+    }
+    g_wifi_state.roaming_rssi = rssi;
+    if (rssi >= ROAMING_RSSI_THRESHOLD) {
+        g_wifi_state.roaming_low_rssi_count = 0;
+        return;
+    }
+    g_wifi_state.roaming_low_rssi_count++;
+    if ((g_wifi_state.roaming_low_rssi_count >= ROAMING_LOW_RSSI_COUNT)
+    && !cyw43_wifi_scan_active(g_wifi_state.cyw43)) {
+        begin_roaming_scan();
+    }
+}
+#endif
+
+static bool is_any_hotspot_found() {
+    for (uint ssid_index = 1; ssid_index <= g_wifi_state.num_ssid_matches; ssid_index++) {
+        if (g_wifi_state.ssid_match[ssid_index].scan_info == FOUND) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void wifi_settings_state_machine() {
     switch (g_wifi_state.cstate) {
         case TRY_TO_CONNECT:
             // In this state, we are not connected, and we are waiting for a holdoff time
             // before beginning a scan for available hotspots. If a scan is already running
             // (e.g. due to disconnecting during a scan) we wait for it to finish.
+            // If a connection was recently lost, we first try to rejoin the same hotspot
+            // without scanning.
             ensure_disconnected();
             if (wifi_settings_has_no_wifi_details()) {
                 // This is reached if the storage file contains no SSIDs.
                 g_wifi_state.cstate = STORAGE_EMPTY_ERROR;
+                g_wifi_state.storage_empty_generation = wifi_settings_get_file_generation();
+            } else if (g_wifi_state.fast_reconnect_pending
+                        && !cyw43_wifi_scan_active(g_wifi_state.cyw43)
+                        && begin_fast_reconnect()) {
+                // Trying to rejoin the most recently used hotspot without a scan
             } else if (time_reached(g_wifi_state.scan_holdoff_time) && !cyw43_wifi_scan_active(g_wifi_state.cyw43)) {
                 begin_new_scan();
             }
@@ -406,8 +1149,21 @@ static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_t
         case SCANNING:
             // In this state, we are waiting for a hotspot scan to complete.
             // If it already completed, and we have some results, we can go directly to CONNECTING.
-            if (!cyw43_wifi_scan_active(g_wifi_state.cyw43)) {
-                begin_connecting();
+            // With EARLY_SCAN_TERMINATION, we don't wait for the scan to complete if the
+            // preferred hotspot was already found.
+            // If nothing has been found yet, the next part of the scan begins (if any).
+            {
+                const bool scan_active = cyw43_wifi_scan_active(g_wifi_state.cyw43);
+                if ((g_wifi_state.top_ssid_found || !scan_active)
+                && (scan_active || is_any_hotspot_found() || !begin_next_scan())) {
+                    if (g_wifi_state.timing.scan_end_time_ms == 0) {
+                        g_wifi_state.timing.scan_end_time_ms = get_time_ms();
+                    }
+                    if (!scan_active) {
+                        end_scan_results();
+                    }
+                    begin_connecting();
+                }
             }
             break;
         case CONNECTING:
@@ -429,11 +1185,39 @@ static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_t
                 case CYW43_LINK_UP:
                     // Connection still in progress or completed
                     g_wifi_state.netif = netif_default;
-                    if (wifi_is_connected() && has_valid_address()) {
-                        // Successful
-                        g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] = SUCCESS;
-                        g_wifi_state.cstate = CONNECTED_IP;
-                    } else if (time_reached(g_wifi_state.connect_timeout_time)) {
+                    if (wifi_is_connected()) {
+                        if (g_wifi_state.timing.link_up_time_ms == 0) {
+                            // Hotspot joined, waiting for an IP address
+                            g_wifi_state.timing.link_up_time_ms = get_time_ms();
+                            apply_power_profile();
+                            report_event(WIFI_SETTINGS_EVENT_CONNECTED);
+                        }
+                        if (has_valid_address()) {
+                            // Successful
+                            g_wifi_state.timing.ip_time_ms = get_time_ms();
+                            set_selected_scan_info(SUCCESS);
+                            g_wifi_state.cstate = CONNECTED_IP;
+                            g_wifi_state.fast_reconnect_attempt = false;
+                            g_wifi_state.scan_backoff_time_ms = REPEAT_SCAN_TIME_MS;
+                            g_wifi_state.roaming_low_rssi_count = 0;
+                            g_wifi_state.roaming_check_time = make_timeout_time_ms(ROAMING_CHECK_TIME_MS);
+                            save_last_connection();
+#if defined(ENABLE_REMOTE_UPDATE) && WIFI_SETTINGS_REMOTE_LAZY_INIT
+                            {
+                                // Start remote access service after the first connection
+                                const int pico_err = wifi_settings_remote_connected();
+                                if (pico_err) {
+                                    g_wifi_state.hw_error_code = pico_err;
+                                }
+                            }
+#endif
+#if WIFI_SETTINGS_MDNS
+                            wifi_settings_mdns_connected();
+#endif
+                            break;
+                        }
+                    }
+                    if (time_reached(g_wifi_state.connect_timeout_time)) {
                         // Connection failed with a timeout
                         give_up_connecting(TIMEOUT);
                     }
@@ -451,16 +1235,26 @@ static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_t
                 give_up_connecting(LOST);
                 // It may be some time since the last scan, so scan again
                 g_wifi_state.cstate = TRY_TO_CONNECT;
+                g_wifi_state.roaming_scan_active = false;
+                break;
             }
+#ifdef ROAMING_RSSI_THRESHOLD
+            // Still connected: is there a better access point?
+            check_roaming();
+#endif
             break;
         case STORAGE_EMPTY_ERROR:
             // This state is reached if the storage file contains no SSIDs.
-            // Wait for the file to be updated.
-            if (!wifi_settings_has_no_wifi_details()) {
-                g_wifi_state.cstate = TRY_TO_CONNECT;
+            // Wait for the file to be updated: it is only checked again if it has changed.
+            if (g_wifi_state.storage_empty_generation != wifi_settings_get_file_generation()) {
+                g_wifi_state.storage_empty_generation = wifi_settings_get_file_generation();
+                if (!wifi_settings_has_no_wifi_details()) {
+                    g_wifi_state.cstate = TRY_TO_CONNECT;
+                }
             }
             break;
         case INITIALISATION_ERROR:
+        case INITIALISING:
         case UNINITIALISED:
         case DISCONNECTED:
             // nothing to do
@@ -468,26 +1262,194 @@ static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_t
         default:
             break;
     }
-    // trigger again after the period
+}
+
+static void add_link_quality_entry(uint8_t event) {
+    // Record the current state and signal strength in the link quality history
+#if LINK_QUALITY_HISTORY_SIZE > 0
+    wifi_settings_link_quality_t* entry = &g_wifi_state.link_quality[g_wifi_state.link_quality_next];
+    int32_t rssi = 0;
+    if ((g_wifi_state.cstate != CONNECTED_IP)
+    || (cyw43_wifi_get_rssi(g_wifi_state.cyw43, &rssi) != 0)) {
+        rssi = 0;
+    }
+    entry->time_ms = get_time_ms();
+    entry->rssi = (int16_t) rssi;
+    entry->event = event;
+    entry->state = (uint8_t) g_wifi_state.cstate;
+    entry->num_attempts = (uint16_t) g_wifi_state.timing.num_attempts;
+    entry->num_failures = (uint16_t) g_wifi_state.timing.num_failures;
+    g_wifi_state.link_quality_next = (g_wifi_state.link_quality_next + 1) % LINK_QUALITY_HISTORY_SIZE;
+    if (g_wifi_state.link_quality_count < LINK_QUALITY_HISTORY_SIZE) {
+        g_wifi_state.link_quality_count++;
+    }
+#endif
+}
+
+int wifi_settings_get_link_quality_history(wifi_settings_link_quality_t* history, int max_entries) {
+    int count = 0;
+#if LINK_QUALITY_HISTORY_SIZE > 0
+    cyw43_arch_lwip_begin();
+    uint index = (g_wifi_state.link_quality_next + LINK_QUALITY_HISTORY_SIZE
+                    - g_wifi_state.link_quality_count) % LINK_QUALITY_HISTORY_SIZE;
+    while ((count < max_entries) && (count < (int) g_wifi_state.link_quality_count)) {
+        history[count] = g_wifi_state.link_quality[index];
+        index = (index + 1) % LINK_QUALITY_HISTORY_SIZE;
+        count++;
+    }
+    cyw43_arch_lwip_end();
+#endif
+    return count;
+}
+
+int wifi_settings_get_scan_results(wifi_settings_scan_result_t* results, int max_entries) {
+    int count = 0;
+#if SCAN_RESULTS_SIZE > 0
+    cyw43_arch_lwip_begin();
+    while ((count < max_entries) && (count < (int) g_wifi_state.num_scan_results)) {
+        results[count] = g_wifi_state.scan_results[count];
+        count++;
+    }
+    cyw43_arch_lwip_end();
+#endif
+    return count;
+}
+
+static void run_state_machine() {
+    // Run the state machine; if the state changes, record the change, and
+    // run the state machine again soon, since the new state may also be able
+    // to make progress.
+    const enum wifi_connect_state_t old_cstate = g_wifi_state.cstate;
+    wifi_settings_state_machine();
+    if (g_wifi_state.cstate != old_cstate) {
+        add_link_quality_entry(WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+        if (g_wifi_state.cstate == CONNECTED_IP) {
+            report_event(WIFI_SETTINGS_EVENT_IP_ACQUIRED);
+        } else if (old_cstate == CONNECTED_IP) {
+            report_event(WIFI_SETTINGS_EVENT_LOST);
+        }
+        async_context_set_work_pending(g_wifi_state.context, &g_wifi_state.event_worker);
+    }
+}
+
+static void wifi_settings_event_callback(async_context_t* unused1, async_when_pending_worker_t* unused2) {
+    // Called (via async_context) soon after something happens that may allow the
+    // state machine to make progress.
+    run_state_machine();
+}
+
+static void wifi_settings_file_change_callback(void* unused) {
+    // Called after the WiFi settings file is updated: the hostname may have changed.
+    // The SSID table is rebuilt at the start of each scan, and STORAGE_EMPTY_ERROR
+    // checks the file generation.
+    wifi_settings_set_hostname();
+#if WIFI_SETTINGS_MDNS
+    if (g_wifi_state.context) {
+        cyw43_arch_lwip_begin();
+        wifi_settings_mdns_update_hostname();
+        cyw43_arch_lwip_end();
+    }
+#endif
+}
+
+static wifi_settings_file_change_subscriber_t g_file_change_subscriber = {
+    .callback = wifi_settings_file_change_callback,
+};
+
+#if LWIP_NETIF_EXT_STATUS_CALLBACK
+NETIF_DECLARE_EXT_CALLBACK(g_netif_callback)
+
+static void wifi_settings_netif_callback(struct netif* netif, netif_nsc_reason_t reason,
+                                         const netif_ext_callback_args_t* args) {
+    // Called by lwIP when the link goes up or down, or an IP address is assigned.
+    if (g_wifi_state.context) {
+        async_context_set_work_pending(g_wifi_state.context, &g_wifi_state.event_worker);
+    }
+}
+#endif
+
+static void wifi_settings_periodic_callback(async_context_t* unused1, async_at_time_worker_t* unused2) {
+    // Called regularly, to detect timeouts and any events that are not reported by callbacks.
+    run_state_machine();
+
+#if LINK_QUALITY_HISTORY_SIZE > 0
+    // Sample the signal strength while connected
+    if ((g_wifi_state.cstate == CONNECTED_IP)
+    && time_reached(g_wifi_state.link_quality_sample_time)) {
+        g_wifi_state.link_quality_sample_time = make_timeout_time_ms(LINK_QUALITY_SAMPLE_TIME_MS);
+        add_link_quality_entry(WIFI_SETTINGS_LINK_QUALITY_SAMPLE);
+    }
+#endif
+
+    // With EARLY_SCAN_TERMINATION, the scan may still be running after
+    // the SCANNING state
+    if (g_wifi_state.scan_results_pending
+    && (g_wifi_state.cstate != SCANNING)
+    && !g_wifi_state.roaming_scan_active
+    && !cyw43_wifi_scan_active(g_wifi_state.cyw43)) {
+        end_scan_results();
+    }
+
+    // Update the signal strength reported by wifi_settings_get_status
+    if ((HW_STATUS_CACHE_TIME_MS != 0)
+    && time_reached(g_wifi_state.hw_status.refresh_time)) {
+        refresh_hw_status();
+    }
+
+#if WIFI_SETTINGS_EVENT_LOG
+    // Write buffered events to Flash
+    wifi_settings_event_log_periodic();
+#endif
+
+#if defined(ENABLE_REMOTE_UPDATE) && (WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0)
+    // Write staged changes to the settings file once they stop arriving
+    wifi_settings_staged_updates_periodic();
+#endif
+
+    // trigger again after the period: this is shorter while scanning, as the
+    // end of a scan is not reported by a callback
     g_wifi_state.periodic_worker.next_time =
         delayed_by_ms(g_wifi_state.periodic_worker.next_time,
-                      PERIODIC_TIME_MS);
+                      ((g_wifi_state.cstate == SCANNING) || g_wifi_state.roaming_scan_active) ?
+                        SCAN_POLL_TIME_MS : PERIODIC_TIME_MS);
     async_context_add_at_time_worker(
         g_wifi_state.context,
         &g_wifi_state.periodic_worker);
 }
 
-int wifi_settings_init() {
+static int begin_init() {
+    // First part of initialisation, which does not need to wait for the cyw43 hardware
     if (g_wifi_state.cstate != UNINITIALISED) {
         return PICO_ERROR_INVALID_STATE;
     }
     // Put wifi-settings library version into the binary info
     bi_decl_if_func_used(bi_program_feature("pico-wifi-settings v" WIFI_SETTINGS_VERSION_STRING));
 
-    // Start with globals in known state
+    // Start with globals in known state, keeping the callbacks and the power profile,
+    // which may be set before initialisation
+    const wifi_settings_event_callback_t event_callback = g_wifi_state.event_callback;
+    void* const event_callback_arg = g_wifi_state.event_callback_arg;
+    const wifi_settings_scan_callback_t scan_callback = g_wifi_state.scan_callback;
+    void* const scan_callback_arg = g_wifi_state.scan_callback_arg;
+    const wifi_settings_power_profile_t power_profile = g_wifi_state.power_profile;
     memset(&g_wifi_state, 0, sizeof(g_wifi_state));
+    g_wifi_state.event_callback = event_callback;
+    g_wifi_state.event_callback_arg = event_callback_arg;
+    g_wifi_state.scan_callback = scan_callback;
+    g_wifi_state.scan_callback_arg = scan_callback_arg;
+    g_wifi_state.power_profile = power_profile;
     g_wifi_state.cstate = UNINITIALISED;
     g_wifi_state.cyw43 = &cyw43_state; // from Pico SDK, lib/cyw43-driver (MAC layer)
+#ifdef WIFI_SETTINGS_FAST_RECONNECT_SCRATCH
+    load_last_connection();
+#endif
+#if WIFI_SETTINGS_EVENT_LOG
+    // Find the end of the event log (only at the first initialisation)
+    wifi_settings_event_log_init();
+#endif
+
+    // Index the keys in the WiFi settings file
+    wifi_settings_key_index_rebuild();
 
     // Which country should be used?
     // You can put "country=<xy>" in the WiFi settings file to set a different value.
@@ -502,30 +1464,51 @@ int wifi_settings_init() {
         country = CYW43_COUNTRY(value[0], value[1], 0);
     }
 
-    // Set the hostname from wifi-settings "name=<xxx>" or use unique board id
+    // Set the hostname from wifi-settings "name=<xxx>" or use unique board id,
+    // and set it again whenever the file changes
     wifi_settings_set_hostname();
+    wifi_settings_add_file_change_subscriber(&g_file_change_subscriber);
 
-    // Hardware init
+    // Driver init (the cyw43 firmware is loaded later, by cyw43_arch_enable_sta_mode)
     g_wifi_state.hw_error_code = cyw43_arch_init_with_country(country);
     if (g_wifi_state.hw_error_code) {
         g_wifi_state.cstate = INITIALISATION_ERROR;
         return g_wifi_state.hw_error_code;
     }
 
+    // Use cyw43 async context
+    g_wifi_state.context = cyw43_arch_async_context();
+
     // After initialisation, any call to LWIP requires this lock (callback functions
     // are always holding it already, but this function is not a callback)
     cyw43_arch_lwip_begin();
 
+    // Start event worker, and ask lwIP to trigger it for link and address changes
+    g_wifi_state.event_worker.do_work = wifi_settings_event_callback;
+    async_context_add_when_pending_worker(
+        g_wifi_state.context,
+        &g_wifi_state.event_worker);
+#if LWIP_NETIF_EXT_STATUS_CALLBACK
+    netif_add_ext_callback(&g_netif_callback, wifi_settings_netif_callback);
+#endif
+
+    cyw43_arch_lwip_end();
+    return 0;
+}
+
+static void finish_init() {
+    // Second part of initialisation, which waits for the cyw43 hardware to start.
+    // The lwIP lock must be held.
+
     // Set up to connect to an access point
     cyw43_arch_enable_sta_mode();
 
     // State initialised
     g_wifi_state.connect_timeout_time = make_timeout_time_ms(CONNECT_TIMEOUT_TIME_MS);
     g_wifi_state.scan_holdoff_time = make_timeout_time_ms(INITIAL_SETUP_TIME_MS);
+    g_wifi_state.scan_backoff_time_ms = REPEAT_SCAN_TIME_MS;
     g_wifi_state.cstate = DISCONNECTED;
-
-    // Use cyw43 async context
-    g_wifi_state.context = cyw43_arch_async_context();
+    build_ssid_match_table();
 
     // Start periodic worker
     g_wifi_state.periodic_worker.next_time = g_wifi_state.scan_holdoff_time;
@@ -540,36 +1523,135 @@ int wifi_settings_init() {
 #endif
     // set lwip hostname (overriding the default set by cyw43_cb_tcpip_init)
     netif_set_hostname(netif_default, wifi_settings_get_hostname());
+#if WIFI_SETTINGS_MDNS
+    // announce <hostname>.local and the remote service
+    wifi_settings_mdns_init();
+#endif
+}
 
-    // Ready to run LWIP functions
-    cyw43_arch_lwip_end();
+static void wifi_settings_init_callback(async_context_t* unused1, async_at_time_worker_t* unused2) {
+    // Called (via async_context) to complete wifi_settings_init_async()
+    finish_init();
+    if (g_wifi_state.connect_after_init) {
+        // wifi_settings_connect() was called during initialisation
+        g_wifi_state.cstate = TRY_TO_CONNECT;
+        async_context_set_work_pending(g_wifi_state.context, &g_wifi_state.event_worker);
+    }
+    add_link_quality_entry(WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+    report_event(WIFI_SETTINGS_EVENT_INITIALISED);
+}
 
+int wifi_settings_init() {
+    int rc = begin_init();
+    if (rc) {
+        return rc;
+    }
+    cyw43_arch_lwip_begin();
+    finish_init();
+    cyw43_arch_lwip_end();
     return g_wifi_state.hw_error_code;
 }
 
+int wifi_settings_init_async() {
+    int rc = begin_init();
+    if (rc) {
+        return rc;
+    }
+    // The rest of the initialisation happens in the async_context
+    cyw43_arch_lwip_begin();
+    g_wifi_state.cstate = INITIALISING;
+    g_wifi_state.periodic_worker.next_time = get_absolute_time();
+    g_wifi_state.periodic_worker.do_work = wifi_settings_init_callback;
+    async_context_add_at_time_worker(
+        g_wifi_state.context,
+        &g_wifi_state.periodic_worker);
+    cyw43_arch_lwip_end();
+    return 0;
+}
+
+#if LIB_PICO_MULTICORE && PICO_CYW43_ARCH_THREADSAFE_BACKGROUND
+static semaphore_t g_core1_ready;
+static int g_core1_init_result;
+
+static void wifi_settings_core1_entry() {
+    // Runs on core 1: the cyw43 interrupts and the async_context are owned
+    // by the core that initialises them, so all of the background work of
+    // pico-wifi-settings (and lwIP) then happens here.
+    g_core1_init_result = wifi_settings_init();
+    // Allow core 0 to lock out core 1 when writing to Flash
+    flash_safe_execute_core_init();
+    sem_release(&g_core1_ready);
+    while (true) {
+        __wfe();
+    }
+}
+
+int wifi_settings_init_core1(uint32_t* stack_bottom, size_t stack_size_bytes) {
+    if (g_wifi_state.cstate != UNINITIALISED) {
+        return PICO_ERROR_INVALID_STATE;
+    }
+    sem_init(&g_core1_ready, 0, 1);
+    if (stack_bottom) {
+        multicore_launch_core1_with_stack(wifi_settings_core1_entry, stack_bottom, stack_size_bytes);
+    } else {
+        multicore_launch_core1(wifi_settings_core1_entry);
+    }
+    sem_acquire_blocking(&g_core1_ready);
+    // Allow core 1 to lock out core 0 when writing to Flash, e.g. for a remote update.
+    // This happens after core 1 is launched, as the lockout uses the inter-core FIFO.
+    if (!flash_safe_execute_core_init()) {
+        return PICO_ERROR_GENERIC;
+    }
+    return g_core1_init_result;
+}
+#endif
+
 void wifi_settings_deinit() {
     if (g_wifi_state.cstate == UNINITIALISED) {
         return;
     }
-    ensure_disconnected();
+    if (g_wifi_state.cstate != INITIALISING) {
+        ensure_disconnected();
+    }
     if (g_wifi_state.context) {
-        // stop periodic task
+        // stop periodic task (or wifi_settings_init_callback) and event worker
         async_context_remove_at_time_worker(
             g_wifi_state.context,
             &g_wifi_state.periodic_worker);
+        async_context_remove_when_pending_worker(
+            g_wifi_state.context,
+            &g_wifi_state.event_worker);
+#if LWIP_NETIF_EXT_STATUS_CALLBACK
+        netif_remove_ext_callback(&g_netif_callback);
+#endif
+#if WIFI_SETTINGS_MDNS
+        cyw43_arch_lwip_begin();
+        wifi_settings_mdns_deinit();
+        cyw43_arch_lwip_end();
+#endif
     }
     g_wifi_state.context = NULL;
+#if WIFI_SETTINGS_EVENT_LOG
+    wifi_settings_event_log_flush();
+#endif
+    wifi_settings_remove_file_change_subscriber(&g_file_change_subscriber);
     cyw43_arch_deinit();
     g_wifi_state.cstate = UNINITIALISED;
     g_wifi_state.selected_ssid_index = 0;
 }
 
 void wifi_settings_connect() {
-    if (g_wifi_state.cstate == DISCONNECTED) {
-        // Try to connect when periodic worker is next called
+    if ((g_wifi_state.cstate == DISCONNECTED) || (g_wifi_state.cstate == INITIALISING)) {
+        // Try to connect as soon as possible
         cyw43_arch_lwip_begin();
-        if (g_wifi_state.cstate == DISCONNECTED) {
+        if (g_wifi_state.cstate == INITIALISING) {
+            // Connect when wifi_settings_init_callback runs
+            g_wifi_state.connect_after_init = true;
+        } else if (g_wifi_state.cstate == DISCONNECTED) {
             g_wifi_state.cstate = TRY_TO_CONNECT;
+            g_wifi_state.scan_backoff_time_ms = REPEAT_SCAN_TIME_MS;
+            add_link_quality_entry(WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+            async_context_set_work_pending(g_wifi_state.context, &g_wifi_state.event_worker);
         }
         cyw43_arch_lwip_end();
     }
@@ -580,13 +1662,80 @@ void wifi_settings_disconnect() {
     if ((g_wifi_state.cstate != UNINITIALISED)
     && (g_wifi_state.cstate != INITIALISATION_ERROR)) {
         cyw43_arch_lwip_begin();
+        if (g_wifi_state.cstate == INITIALISING) {
+            // Remain disconnected after initialisation
+            g_wifi_state.connect_after_init = false;
+            cyw43_arch_lwip_end();
+            return;
+        }
+        const enum wifi_connect_state_t old_cstate = g_wifi_state.cstate;
         ensure_disconnected();
         g_wifi_state.cstate = DISCONNECTED;
         g_wifi_state.selected_ssid_index = 0;
+        g_wifi_state.roaming_scan_active = false;
+        add_link_quality_entry(WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+        if (old_cstate == CONNECTED_IP) {
+            report_event(WIFI_SETTINGS_EVENT_LOST);
+        }
         cyw43_arch_lwip_end();
     }
 }
 
+void wifi_settings_set_event_callback(wifi_settings_event_callback_t callback, void* arg) {
+    if (!g_wifi_state.context) {
+        // not initialised: the callback is kept for wifi_settings_init()
+        g_wifi_state.event_callback = callback;
+        g_wifi_state.event_callback_arg = arg;
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    g_wifi_state.event_callback = callback;
+    g_wifi_state.event_callback_arg = arg;
+    cyw43_arch_lwip_end();
+}
+
+void wifi_settings_set_scan_callback(wifi_settings_scan_callback_t callback, void* arg) {
+    if (!g_wifi_state.context) {
+        // not initialised: the callback is kept for wifi_settings_init()
+        g_wifi_state.scan_callback = callback;
+        g_wifi_state.scan_callback_arg = arg;
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    g_wifi_state.scan_callback = callback;
+    g_wifi_state.scan_callback_arg = arg;
+    cyw43_arch_lwip_end();
+}
+
+void wifi_settings_set_power_profile(wifi_settings_power_profile_t profile) {
+    if (!g_wifi_state.context) {
+        // not initialised: the profile is kept for wifi_settings_init(),
+        // and applied when a hotspot is joined
+        g_wifi_state.power_profile = profile;
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    g_wifi_state.power_profile = profile;
+    if (can_apply_power_profile()) {
+        apply_power_profile();
+    }
+    cyw43_arch_lwip_end();
+}
+
+wifi_settings_power_profile_t wifi_settings_get_power_profile() {
+    return g_wifi_state.power_profile;
+}
+
+void wifi_settings_set_remote_active(bool active) {
+    if (g_wifi_state.remote_active == active) {
+        return;
+    }
+    g_wifi_state.remote_active = active;
+    if (can_apply_power_profile()) {
+        apply_power_profile();
+    }
+}
+
 bool wifi_settings_is_connected() {
     bool rc = false;
     if (g_wifi_state.cstate == CONNECTED_IP) {
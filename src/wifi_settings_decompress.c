@@ -0,0 +1,136 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This pico-wifi-settings module decompresses data in the LZ4 block format.
+ * It is used by the remote update service so that firmware images can be
+ * sent in compressed form.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_decompress.h"
+
+#include "pico/error.h"
+
+#include <string.h>
+
+#define MIN_MATCH_SIZE 4
+#define HEADER_SIZE    4
+
+// Read a length which may be extended by additional bytes (255 = another byte follows)
+static bool read_length(const uint8_t** in, const uint8_t* end, uint32_t* length) {
+    if (*length != 15) {
+        return true;
+    }
+    uint8_t value;
+    do {
+        if (*in >= end) {
+            return false;
+        }
+        value = **in;
+        (*in)++;
+        *length += value;
+    } while (value == 255);
+    return true;
+}
+
+static int decompress_sequences(
+        uint8_t* buffer,
+        uint32_t buffer_size,
+        uint32_t input_size,
+        uint32_t* output_size) {
+
+    // The input is at the end of the buffer. The output is written from the start,
+    // and must never go past the next input byte to be read (in).
+    const uint8_t* in = &buffer[buffer_size - input_size];
+    const uint8_t* end = &buffer[buffer_size];
+    uint8_t* out = buffer;
+
+    while (in < end) {
+        // Each sequence begins with a token containing the literal size and match size
+        const uint8_t token = *in;
+        in++;
+
+        // Copy literals: memmove is safe because out <= in
+        uint32_t literal_size = token >> 4;
+        if ((!read_length(&in, end, &literal_size))
+        || (literal_size > (uint32_t) (end - in))
+        || (out > in)) {
+            return PICO_ERROR_INVALID_DATA;
+        }
+        memmove(out, in, literal_size);
+        out += literal_size;
+        in += literal_size;
+        if (in >= end) {
+            // The last sequence may have no match
+            break;
+        }
+
+        // Copy match from earlier output
+        if ((end - in) < 2) {
+            return PICO_ERROR_INVALID_DATA;
+        }
+        const uint32_t offset = ((uint32_t) in[0]) | (((uint32_t) in[1]) << 8);
+        in += 2;
+        uint32_t match_size = token & 15;
+        if ((!read_length(&in, end, &match_size))
+        || (offset == 0)
+        || (offset > (uint32_t) (out - buffer))) {
+            return PICO_ERROR_INVALID_DATA;
+        }
+        match_size += MIN_MATCH_SIZE;
+        if (match_size > (uint32_t) (in - out)) {
+            // The match would overwrite input which has not been read yet
+            return PICO_ERROR_INVALID_DATA;
+        }
+        // Byte-by-byte, as the match may overlap itself (e.g. a run of one byte value)
+        const uint8_t* match = out - offset;
+        for (uint32_t i = 0; i < match_size; i++) {
+            out[i] = match[i];
+        }
+        out += match_size;
+    }
+    *output_size = (uint32_t) (out - buffer);
+    return PICO_OK;
+}
+
+int wifi_settings_decompress_in_place(
+        uint8_t* buffer,
+        uint32_t buffer_size,
+        uint32_t input_size,
+        uint32_t* output_size) {
+
+    *output_size = 0;
+    if ((input_size > buffer_size) || (input_size < HEADER_SIZE)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    const uint32_t total_size = ((uint32_t) buffer[0]) | (((uint32_t) buffer[1]) << 8);
+    const uint32_t tail_size = ((uint32_t) buffer[2]) | (((uint32_t) buffer[3]) << 8);
+    if ((total_size > buffer_size)
+    || (total_size < input_size)
+    || (tail_size > (input_size - HEADER_SIZE))) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+
+    // Move the uncompressed tail to its final position, then move the sequences
+    // so that they end where the tail begins. Both move towards the end
+    // of the buffer (or stay where they are), so the tail is moved first.
+    const uint32_t sequences_size = input_size - HEADER_SIZE - tail_size;
+    const uint32_t sequences_end = total_size - tail_size;
+    memmove(&buffer[sequences_end], &buffer[HEADER_SIZE + sequences_size], tail_size);
+    memmove(&buffer[sequences_end - sequences_size], &buffer[HEADER_SIZE], sequences_size);
+
+    // Decompress the sequences, which must exactly fill the space before the tail
+    uint32_t sequences_output_size = 0;
+    const int rc = decompress_sequences(buffer, sequences_end, sequences_size,
+                                        &sequences_output_size);
+    if (rc != PICO_OK) {
+        return rc;
+    }
+    if (sequences_output_size != sequences_end) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+    *output_size = total_size;
+    return PICO_OK;
+}
@@ -0,0 +1,227 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This pico-wifi-settings module records connection events in a
+ * ring of Flash pages, enabled by building with -DWIFI_SETTINGS_EVENT_LOG=1.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_event_log.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+#include "wifi_settings/wifi_settings_profile.h"
+
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "pico/cyw43_arch.h"
+#include "pico/error.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+#include "pico/time.h"
+
+#include <string.h>
+#include <limits.h>
+
+#define NUM_PAGES           (WIFI_SETTINGS_EVENT_LOG_SIZE / FLASH_PAGE_SIZE)
+#define PAGES_PER_SECTOR    (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define ENTRIES_PER_PAGE    WIFI_SETTINGS_EVENT_LOG_ENTRIES_PER_PAGE
+
+typedef struct event_log_t {
+    bool initialised;
+    uint next_page;             // next page to be programmed
+    uint32_t next_sequence;     // sequence number for that page
+    uint32_t boot_count;
+    uint num_entries;           // entries buffered in RAM
+    absolute_time_t flush_time; // when the buffered entries should be written
+    wifi_settings_event_log_entry_t entries[ENTRIES_PER_PAGE];
+} event_log_t;
+
+static event_log_t g_event_log;
+
+static uint32_t get_checksum(const uint8_t* data, uint size) {
+    // FNV-1a hash
+    uint32_t hash = 2166136261u;
+    for (uint i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Get the current contents of a page of the event log in Flash
+static const uint8_t* get_flash_page(uint page) {
+    wifi_settings_flash_range_t fr;
+    wifi_settings_logical_range_t lr;
+    fr.start_address = WIFI_SETTINGS_EVENT_LOG_ADDRESS + (page * FLASH_PAGE_SIZE);
+    fr.size = FLASH_PAGE_SIZE;
+    wifi_settings_range_translate_to_logical(&fr, &lr);
+    return (const uint8_t*) lr.start_address;
+}
+
+// Read the header for a page, returning true if it is valid for the entries in the page
+static bool get_valid_header(const uint8_t* page_data, wifi_settings_event_log_header_t* header) {
+    memcpy(header, page_data, sizeof(wifi_settings_event_log_header_t));
+    return (header->magic == WIFI_SETTINGS_EVENT_LOG_MAGIC)
+        && (header->checksum == get_checksum(&page_data[sizeof(wifi_settings_event_log_header_t)],
+                            FLASH_PAGE_SIZE - sizeof(wifi_settings_event_log_header_t)));
+}
+
+static bool is_erased(const uint8_t* page_data) {
+    for (uint i = 0; i < FLASH_PAGE_SIZE; i++) {
+        if (page_data[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Make a page containing the entries buffered in RAM, to be programmed at g_event_log.next_page
+static void make_page(uint8_t* page_data) {
+    wifi_settings_event_log_header_t header;
+    const uint entries_offset = sizeof(wifi_settings_event_log_header_t);
+    memset(page_data, 0xff, FLASH_PAGE_SIZE);
+    memcpy(&page_data[entries_offset], g_event_log.entries,
+           g_event_log.num_entries * sizeof(wifi_settings_event_log_entry_t));
+    header.magic = WIFI_SETTINGS_EVENT_LOG_MAGIC;
+    header.sequence = g_event_log.next_sequence;
+    header.boot_count = g_event_log.boot_count;
+    header.checksum = get_checksum(&page_data[entries_offset], FLASH_PAGE_SIZE - entries_offset);
+    memcpy(page_data, &header, sizeof(header));
+}
+
+void wifi_settings_event_log_init() {
+    if (g_event_log.initialised) {
+        return;
+    }
+    memset(&g_event_log, 0, sizeof(g_event_log));
+    g_event_log.initialised = true;
+
+    // Find the most recent page: this comparison allows for the sequence number wrapping
+    bool found = false;
+    for (uint page = 0; page < NUM_PAGES; page++) {
+        wifi_settings_event_log_header_t header;
+        if (get_valid_header(get_flash_page(page), &header)
+        && ((!found) || (((int32_t) (header.sequence - g_event_log.next_sequence)) >= 0))) {
+            found = true;
+            g_event_log.next_page = (page + 1) % NUM_PAGES;
+            g_event_log.next_sequence = header.sequence + 1;
+            g_event_log.boot_count = header.boot_count + 1;
+        }
+    }
+    wifi_settings_event_log_add(WIFI_SETTINGS_EVENT_LOG_BOOT, 0, 0, 0);
+}
+
+void wifi_settings_event_log_reset() {
+    memset(&g_event_log, 0, sizeof(g_event_log));
+}
+
+void wifi_settings_event_log_add(uint8_t event, uint ssid_index, int32_t rssi, uint8_t arg) {
+    if (!g_event_log.initialised) {
+        return;
+    }
+    if (g_event_log.num_entries == 0) {
+        g_event_log.flush_time = make_timeout_time_ms(WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS);
+    }
+    wifi_settings_event_log_entry_t* entry = &g_event_log.entries[g_event_log.num_entries];
+    entry->time_ms = to_ms_since_boot(get_absolute_time());
+    entry->event = event;
+    entry->ssid_index = (uint8_t) ((ssid_index > UINT8_MAX) ? UINT8_MAX : ssid_index);
+    entry->rssi = (int8_t) ((rssi < INT8_MIN) ? INT8_MIN : ((rssi > INT8_MAX) ? INT8_MAX : rssi));
+    entry->arg = arg;
+    g_event_log.num_entries++;
+    if (g_event_log.num_entries >= ENTRIES_PER_PAGE) {
+        wifi_settings_event_log_flush();
+    }
+}
+
+void wifi_settings_event_log_periodic() {
+    if ((g_event_log.num_entries != 0) && time_reached(g_event_log.flush_time)) {
+        wifi_settings_event_log_flush();
+    }
+}
+
+typedef struct event_log_flush_params_t {
+    const uint8_t* page_data;
+    int rc;
+} event_log_flush_params_t;
+
+static void event_log_flush_internal(void* tmp) {
+    event_log_flush_params_t* param = (event_log_flush_params_t*) tmp;
+
+    // Find a page which can be programmed. The sector is erased when the log
+    // reaches the start of it, removing the oldest entries. Any other page which
+    // is not erased is skipped, e.g. if power was lost while it was programmed.
+    while (((g_event_log.next_page % PAGES_PER_SECTOR) != 0)
+    && !is_erased(get_flash_page(g_event_log.next_page))) {
+        g_event_log.next_page = (g_event_log.next_page + 1) % NUM_PAGES;
+    }
+    const uint32_t page_address = WIFI_SETTINGS_EVENT_LOG_ADDRESS + (g_event_log.next_page * FLASH_PAGE_SIZE);
+    if ((g_event_log.next_page % PAGES_PER_SECTOR) == 0) {
+        const uint32_t flags = save_and_disable_interrupts();
+        WIFI_SETTINGS_PROFILE_START(profile_off);
+        flash_range_erase(page_address, FLASH_SECTOR_SIZE);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_ERASE, profile_off);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
+        restore_interrupts(flags);
+    }
+
+    // Program the page
+    const uint32_t flags = save_and_disable_interrupts();
+    WIFI_SETTINGS_PROFILE_START(profile_off);
+    flash_range_program(page_address, param->page_data, FLASH_PAGE_SIZE);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_PROGRAM, profile_off);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
+    restore_interrupts(flags);
+
+    // Test copy
+    param->rc = (memcmp(get_flash_page(g_event_log.next_page), param->page_data, FLASH_PAGE_SIZE) == 0) ?
+                PICO_OK : PICO_ERROR_INVALID_DATA;
+    g_event_log.next_page = (g_event_log.next_page + 1) % NUM_PAGES;
+    g_event_log.next_sequence++;
+}
+
+int wifi_settings_event_log_flush() {
+    uint8_t page_data[FLASH_PAGE_SIZE];
+    event_log_flush_params_t param;
+    int rc = PICO_OK;
+
+    cyw43_arch_lwip_begin();
+    if (g_event_log.num_entries != 0) {
+        make_page(page_data);
+        g_event_log.num_entries = 0;
+        param.page_data = page_data;
+        param.rc = PICO_ERROR_GENERIC;
+        rc = flash_safe_execute(event_log_flush_internal, &param, UINT_MAX);
+        if (rc == PICO_OK) {
+            rc = param.rc;
+        }
+    }
+    cyw43_arch_lwip_end();
+    return rc;
+}
+
+uint wifi_settings_event_log_get_num_pages() {
+    return NUM_PAGES + 1;
+}
+
+uint wifi_settings_event_log_read_pages(uint first_page, uint8_t* buffer, uint max_pages) {
+    // The pages are copied in the order they are programmed, beginning with the next page
+    // to be programmed, which is either erased or the oldest
+    uint count = 0;
+    cyw43_arch_lwip_begin();
+    for (uint page = first_page; (page <= NUM_PAGES) && (count < max_pages); page++) {
+        uint8_t* page_data = &buffer[count * FLASH_PAGE_SIZE];
+        if (page < NUM_PAGES) {
+            memcpy(page_data, get_flash_page((g_event_log.next_page + page) % NUM_PAGES),
+                   FLASH_PAGE_SIZE);
+        } else {
+            make_page(page_data);
+        }
+        count++;
+    }
+    cyw43_arch_lwip_end();
+    return count;
+}
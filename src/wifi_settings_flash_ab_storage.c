@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This pico-wifi-settings module selects between the two slots
+ * used for A/B storage of the WiFi settings file.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_flash_ab_storage.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+
+#include <string.h>
+
+#define NO_ACTIVE_SLOT UINT32_MAX
+
+static uint32_t g_active_slot = NO_ACTIVE_SLOT;
+
+static uint32_t get_checksum(const char* file, uint file_size) {
+    // FNV-1a hash
+    uint32_t hash = 2166136261u;
+    for (uint i = 0; i < file_size; i++) {
+        hash ^= (uint8_t) file[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void wifi_settings_ab_get_slot(uint slot, wifi_settings_flash_range_t* r) {
+    r->start_address = (slot == 0) ? WIFI_SETTINGS_FILE_ADDRESS : WIFI_SETTINGS_AB_STORAGE_ADDRESS;
+    r->size = WIFI_SETTINGS_FILE_SIZE;
+}
+
+// Read the footer for a slot, returning true if it is valid for the file in the slot
+static bool get_valid_footer(uint slot, wifi_settings_ab_footer_t* footer) {
+    wifi_settings_flash_range_t fr;
+    wifi_settings_logical_range_t lr;
+
+    wifi_settings_ab_get_slot(slot, &fr);
+    wifi_settings_range_translate_to_logical(&fr, &lr);
+
+    const char* file = (const char*) lr.start_address;
+    const uint max_file_size = lr.size - FLASH_PAGE_SIZE;
+    memcpy(footer, &file[max_file_size], sizeof(wifi_settings_ab_footer_t));
+    return (footer->magic == WIFI_SETTINGS_AB_FOOTER_MAGIC)
+        && (footer->file_size <= max_file_size)
+        && (footer->checksum == get_checksum(file, footer->file_size));
+}
+
+uint wifi_settings_ab_get_active_slot() {
+    if (g_active_slot == NO_ACTIVE_SLOT) {
+        wifi_settings_ab_footer_t footer[WIFI_SETTINGS_AB_NUM_SLOTS];
+        const bool valid0 = get_valid_footer(0, &footer[0]);
+        const bool valid1 = get_valid_footer(1, &footer[1]);
+        if (valid0 && valid1) {
+            // Use the most recent: this comparison allows for the sequence number wrapping
+            g_active_slot = (((int32_t) (footer[1].sequence - footer[0].sequence)) > 0) ? 1 : 0;
+        } else {
+            // Use the only valid slot, or slot 0 if neither is valid
+            g_active_slot = valid1 ? 1 : 0;
+        }
+    }
+    return g_active_slot;
+}
+
+void wifi_settings_ab_make_footer(
+            const char* file, uint file_size,
+            wifi_settings_ab_footer_t* footer) {
+    wifi_settings_ab_footer_t active_footer;
+    uint32_t sequence = 0;
+    if (get_valid_footer(wifi_settings_ab_get_active_slot(), &active_footer)) {
+        sequence = active_footer.sequence;
+    }
+    footer->magic = WIFI_SETTINGS_AB_FOOTER_MAGIC;
+    footer->sequence = sequence + 1;
+    footer->file_size = file_size;
+    footer->checksum = get_checksum(file, file_size);
+}
+
+void wifi_settings_ab_set_active_slot(uint slot) {
+    g_active_slot = slot;
+}
+
+void wifi_settings_ab_reset_active_slot() {
+    g_active_slot = NO_ACTIVE_SLOT;
+}
@@ -9,6 +9,9 @@
 
 #include "wifi_settings/wifi_settings_configuration.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
+#if WIFI_SETTINGS_AB_STORAGE
+#include "wifi_settings/wifi_settings_flash_ab_storage.h"
+#endif
 
 #include "pico/platform.h"
 #include "hardware/regs/addressmap.h"
@@ -77,25 +80,22 @@ void wifi_settings_range_get_all(wifi_settings_flash_range_t* r) {
 
 extern char __flash_binary_end;
 
-// Determine the range of Flash addresses used by the current program
-void wifi_settings_range_get_program(wifi_settings_flash_range_t* r) {
-    // Initial setup: assume the program is not in Flash
-    r->start_address = 0;
-    r->size = 0;
+// The program, partition and reusable ranges are needed for every remote memory
+// access request, but they don't change while the program is running, so they
+// are only calculated once. The reusable range also depends on the location of
+// the wifi-settings file, so the cache must be invalidated if the file moves
+// (see wifi_settings_range_invalidate_cache).
+typedef struct range_cache_t {
+    wifi_settings_flash_range_t program;
+    wifi_settings_flash_range_t partition;
+    wifi_settings_flash_range_t reusable;
+    volatile bool valid;
+} range_cache_t;
 
-    // If the program is in Flash, determine the size
-    const uintptr_t end_of_program = ((uintptr_t) &__flash_binary_end);
-    if ((end_of_program > XIP_BASE)
-    && (end_of_program <= (XIP_BASE + PICO_FLASH_SIZE_BYTES))) {
-        // get start of partition
-        wifi_settings_range_get_partition(r);
-        // get program size
-        r->size = end_of_program - XIP_BASE;
-    }
-}
+static range_cache_t g_range_cache;
 
 // Determine the range of Flash addresses for the current partition
-void wifi_settings_range_get_partition(wifi_settings_flash_range_t* r) {
+static void calculate_partition(wifi_settings_flash_range_t* r) {
 #ifdef XIP_QMI_BASE
     // Partition base and size is in the ATRANS0 register
     const uint32_t atrans0 = *((io_ro_32*)(XIP_QMI_BASE + QMI_ATRANS0_OFFSET));
@@ -110,36 +110,60 @@ void wifi_settings_range_get_partition(wifi_settings_flash_range_t* r) {
 #endif
 }
 
-// Determine the range of addresses used by the wifi-settings file
-// This function can be reimplemented in order to set the file location dynamically;
-// this default version uses values from wifi_settings_configuration.h which are
-// guaranteed to be valid because of static assertions in the header
-__weak void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r) {
-    r->start_address = WIFI_SETTINGS_FILE_ADDRESS;
-    r->size = WIFI_SETTINGS_FILE_SIZE;
+// Determine the range of Flash addresses used by the current program
+static void calculate_program(const wifi_settings_flash_range_t* partition_range,
+                              wifi_settings_flash_range_t* r) {
+    // Initial setup: assume the program is not in Flash
+    r->start_address = 0;
+    r->size = 0;
+
+    // If the program is in Flash, determine the size
+    const uintptr_t end_of_program = ((uintptr_t) &__flash_binary_end);
+    if ((end_of_program > XIP_BASE)
+    && (end_of_program <= (XIP_BASE + PICO_FLASH_SIZE_BYTES))) {
+        // get start of partition
+        r->start_address = partition_range->start_address;
+        // get program size
+        r->size = end_of_program - XIP_BASE;
+    }
 }
 
 // Determine the range of addresses that are reusable
 // They are between the end of the program and either the start of the
 // wifi-settings file, or the end of the partition, whichever comes first
-void wifi_settings_range_get_reusable(wifi_settings_flash_range_t* r) {
-    wifi_settings_flash_range_t program_range;
-    wifi_settings_flash_range_t partition_range;
+static void calculate_reusable(const wifi_settings_flash_range_t* program_range,
+                               const wifi_settings_flash_range_t* partition_range,
+                               wifi_settings_flash_range_t* r) {
+    wifi_settings_flash_range_t aligned_program_range = *program_range;
     wifi_settings_flash_range_t wifi_settings_file_range;
 
-    wifi_settings_range_get_program(&program_range);
-    wifi_settings_range_get_partition(&partition_range);
     wifi_settings_range_get_wifi_settings_file(&wifi_settings_file_range);
 
     // round up the program size
-    wifi_settings_range_align_to_sector(&program_range);
+    wifi_settings_range_align_to_sector(&aligned_program_range);
 
-    const uint32_t end_of_partition = get_end_address(&partition_range);
-    const uint32_t start_of_settings_file = wifi_settings_file_range.start_address;
+    const uint32_t end_of_partition = get_end_address(partition_range);
+    uint32_t start_of_settings_file = wifi_settings_file_range.start_address;
+#if WIFI_SETTINGS_AB_STORAGE
+    // Neither slot is reusable
+    for (uint slot = 0; slot < WIFI_SETTINGS_AB_NUM_SLOTS; slot++) {
+        wifi_settings_flash_range_t slot_range;
+        wifi_settings_ab_get_slot(slot, &slot_range);
+        if (slot_range.start_address < start_of_settings_file) {
+            start_of_settings_file = slot_range.start_address;
+        }
+    }
+#endif
+#if WIFI_SETTINGS_EVENT_LOG
+    // The event log is not reusable
+    if (WIFI_SETTINGS_EVENT_LOG_ADDRESS < start_of_settings_file) {
+        start_of_settings_file = WIFI_SETTINGS_EVENT_LOG_ADDRESS;
+    }
+#endif
     const uint32_t end_of_reusable_space =
         (end_of_partition < start_of_settings_file) ? end_of_partition : start_of_settings_file;
 
-    r->start_address = get_end_address(&program_range);
+    r->start_address = get_end_address(&aligned_program_range);
     if (end_of_reusable_space <= r->start_address) {
         // There is no reusable space
         r->start_address = 0;
@@ -149,6 +173,48 @@ void wifi_settings_range_get_reusable(wifi_settings_flash_range_t* r) {
     }
 }
 
+static const range_cache_t* get_range_cache() {
+    if (!g_range_cache.valid) {
+        calculate_partition(&g_range_cache.partition);
+        calculate_program(&g_range_cache.partition, &g_range_cache.program);
+        calculate_reusable(&g_range_cache.program, &g_range_cache.partition,
+                           &g_range_cache.reusable);
+        g_range_cache.valid = true;
+    }
+    return &g_range_cache;
+}
+
+void wifi_settings_range_invalidate_cache() {
+    g_range_cache.valid = false;
+}
+
+void wifi_settings_range_get_program(wifi_settings_flash_range_t* r) {
+    *r = get_range_cache()->program;
+}
+
+void wifi_settings_range_get_partition(wifi_settings_flash_range_t* r) {
+    *r = get_range_cache()->partition;
+}
+
+// Determine the range of addresses used by the wifi-settings file
+// This function can be reimplemented in order to set the file location dynamically;
+// this default version uses values from wifi_settings_configuration.h which are
+// guaranteed to be valid because of static assertions in the header
+__weak void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r) {
+#if WIFI_SETTINGS_AB_STORAGE
+    // The file is in the active slot, excluding the final page (footer)
+    wifi_settings_ab_get_slot(wifi_settings_ab_get_active_slot(), r);
+    r->size -= FLASH_PAGE_SIZE;
+#else
+    r->start_address = WIFI_SETTINGS_FILE_ADDRESS;
+    r->size = WIFI_SETTINGS_FILE_SIZE;
+#endif
+}
+
+void wifi_settings_range_get_reusable(wifi_settings_flash_range_t* r) {
+    *r = get_range_cache()->reusable;
+}
+
 // Translate Flash range to logical range
 void wifi_settings_range_translate_to_logical(
         const wifi_settings_flash_range_t* fr,
@@ -164,6 +230,20 @@ void wifi_settings_range_translate_to_logical(
     lr->size = fr->size;
 }
 
+// Translate Flash range to logical range, bypassing the XIP cache
+void wifi_settings_range_translate_to_uncached_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+
+#if defined(XIP_NOCACHE_NOALLOC_BASE) && !defined(XIP_NOCACHE_NOALLOC_NOTRANSLATE_BASE)
+    // XIP_NOCACHE_NOALLOC_BASE represents flash address 0, without caching (used for Pico 1)
+    lr->start_address = (void*) ((uintptr_t) (fr->start_address + XIP_NOCACHE_NOALLOC_BASE));
+    lr->size = fr->size;
+#else
+    wifi_settings_range_translate_to_logical(fr, lr);
+#endif
+}
+
 void wifi_settings_range_align_to_sector(wifi_settings_flash_range_t* fr) {
     // Start address is rounded down (no effect if already aligned)
     fr->start_address &= ~(FLASH_SECTOR_SIZE - 1);
@@ -8,125 +8,787 @@
  *
  */
 
+#include "wifi_settings/wifi_settings_configuration.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
+#include "wifi_settings/wifi_settings_profile.h"
 
+#include "pico/cyw43_arch.h"
+#include "pico/error.h"
 #include "pico/platform.h"
 
 #include <string.h>
+#include <stdint.h>
 
+static inline bool is_end_of_file(const char c) {
+    return (c == '\0')
+        || (c == '\x1a')  // CPM EOF character
+        || (c == '\xff'); // Flash padding character
+}
 
-// Scan the settings file in Flash for a particular key.
-// This function can be reimplemented in order to load settings from some other storage
-__weak bool wifi_settings_get_value_for_key(
-            const char* key, char* value, uint* value_size) {
+static inline bool is_end_of_line(const char c) {
+    return (c == '\n') || (c == '\r');
+}
+
+#define ONE_IN_EACH_BYTE        0x01010101u
+#define HIGH_BIT_IN_EACH_BYTE   0x80808080u
+
+static inline bool may_have_end_of_line_or_file(uint32_t word) {
+    // Bit tricks: true if any byte of word is less than 0x20 (which includes
+    // '\0', '\n', '\r' and '\x1a') or equal to 0xff. Other control characters
+    // such as '\t' also give true, so the bytes must be checked individually.
+    return (((word - (ONE_IN_EACH_BYTE * 0x20)) & ~word & HIGH_BIT_IN_EACH_BYTE) != 0)
+        || (((~word - ONE_IN_EACH_BYTE) & word & HIGH_BIT_IN_EACH_BYTE) != 0);
+}
+
+static inline bool is_end_of_line_or_file(const char c) {
+    return is_end_of_line(c) || is_end_of_file(c);
+}
+
+// Find the end of the line containing file_index: this is the index of the next
+// end of line or end of file character, or file_size if there is none.
+static uint find_end_of_line(const char* file, uint file_index, uint file_size) {
+    // Check one character at a time until aligned
+    while ((file_index < file_size) && ((((uintptr_t) &file[file_index]) & 3) != 0)) {
+        if (is_end_of_line_or_file(file[file_index])) {
+            return file_index;
+        }
+        file_index++;
+    }
+    // Check four characters at a time, as most of the file is
+    // comments, values and keys that don't match
+    while ((file_index + 4) <= file_size) {
+        uint32_t word;
+        memcpy(&word, &file[file_index], 4);
+        if (may_have_end_of_line_or_file(word)) {
+            for (uint i = 0; i < 4; i++) {
+                if (is_end_of_line_or_file(file[file_index + i])) {
+                    return file_index + i;
+                }
+            }
+        }
+        file_index += 4;
+    }
+    // Check the remaining characters
+    while ((file_index < file_size) && !is_end_of_line_or_file(file[file_index])) {
+        file_index++;
+    }
+    return file_index;
+}
+
+// Is this a settings file in the pre-compiled binary format?
+static bool is_binary_file(const char* file, uint file_size) {
+    wifi_settings_binary_file_header_t header;
+    if (file_size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, file, sizeof(header));
+    return (memcmp(header.magic, WIFI_SETTINGS_BINARY_FILE_MAGIC, sizeof(header.magic)) == 0)
+        && (header.version == WIFI_SETTINGS_BINARY_FILE_VERSION)
+        && ((sizeof(header) + ((uint) header.num_keys
+                * sizeof(wifi_settings_binary_file_entry_t))) <= file_size);
+}
+
+// Compare two keys in the order used by the binary file directory
+static int compare_keys(const char* key1, uint key1_size, const char* key2, uint key2_size) {
+    const int cmp = memcmp(key1, key2, (key1_size < key2_size) ? key1_size : key2_size);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (key1_size < key2_size) ? -1 : ((key1_size > key2_size) ? 1 : 0);
+}
+
+// Find a key in a binary file by searching the sorted directory
+static bool find_in_binary_file(const char* file, uint file_size, const char* key,
+                                uint* value_offset, uint* value_size) {
+    wifi_settings_binary_file_header_t header;
+    memcpy(&header, file, sizeof(header));
+
+    const uint key_size = strlen(key);
+    uint low = 0;
+    uint high = header.num_keys;
+    while (low < high) {
+        const uint middle = (low + high) / 2;
+        wifi_settings_binary_file_entry_t entry;
+        memcpy(&entry, &file[sizeof(header) + (middle * sizeof(entry))], sizeof(entry));
+        if (((uint) entry.key_offset + (uint) entry.key_size) > file_size) {
+            // Corrupted directory entry
+            return false;
+        }
+        const int cmp = compare_keys(&file[entry.key_offset], entry.key_size, key, key_size);
+        if (cmp == 0) {
+            if (((uint) entry.value_offset + (uint) entry.value_size) > file_size) {
+                return false;
+            }
+            *value_offset = entry.value_offset;
+            *value_size = entry.value_size;
+            return true;
+        } else if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    // Key was not found
+    return false;
+}
+
+#if WIFI_SETTINGS_KEY_INDEX_SIZE > 0
+// The index is an open-addressing hash table: each key in the settings file
+// has an entry giving its location. Only the first occurrence of each key
+// is recorded, matching the behaviour of the linear scan.
+typedef struct key_index_entry_t {
+    uint16_t hash;
+    uint16_t key_offset;
+    uint16_t key_size;      // 0 = unused entry
+    uint16_t value_size;
+} key_index_entry_t;
+
+typedef struct key_index_t {
+    key_index_entry_t entry[WIFI_SETTINGS_KEY_INDEX_SIZE];
+    const char* file;       // NULL = index is invalid
+    uint file_size;
+} key_index_t;
+
+#define KEY_INDEX_MASK          (WIFI_SETTINGS_KEY_INDEX_SIZE - 1)
+#define KEY_INDEX_MAX_USED      (WIFI_SETTINGS_KEY_INDEX_SIZE - (WIFI_SETTINGS_KEY_INDEX_SIZE / 4))
+
+static key_index_t g_key_index;
+
+static uint16_t key_index_hash(const char* key, uint key_size) {
+    // FNV-1a hash, folded to 16 bits
+    uint32_t hash = 2166136261u;
+    for (uint i = 0; i < key_size; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619u;
+    }
+    return (uint16_t) (hash ^ (hash >> 16));
+}
+
+// Find the entry for a key, or the unused entry where it should be added
+static key_index_entry_t* key_index_find(const char* file, const char* key,
+                                         uint key_size, uint16_t hash) {
+    uint slot = hash & KEY_INDEX_MASK;
+    while (true) {
+        key_index_entry_t* entry = &g_key_index.entry[slot];
+        if ((entry->key_size == 0)
+        || ((entry->hash == hash)
+            && (entry->key_size == key_size)
+            && (memcmp(&file[entry->key_offset], key, key_size) == 0))) {
+            // The table is never full, so this loop always terminates
+            return entry;
+        }
+        slot = (slot + 1) & KEY_INDEX_MASK;
+    }
+}
+
+// Is the index valid for this file and key?
+static bool can_use_key_index(const char* file, uint file_size, const char* key) {
+    // A key containing '=' can't be found using the index,
+    // because the index assumes that the key ends at the first '='.
+    return (g_key_index.file == file)
+        && (g_key_index.file_size == file_size)
+        && (strchr(key, '=') == NULL);
+}
+
+// Find a key using the index
+static bool find_in_key_index(const char* file, uint file_size, const char* key,
+                              uint* value_offset, uint* value_size) {
+    const uint key_size = strlen(key);
+    if (key_size >= file_size) {
+        return false;
+    }
+    const key_index_entry_t* entry = key_index_find(
+            file, key, key_size, key_index_hash(key, key_size));
+    if (entry->key_size == 0) {
+        // Key was not found
+        return false;
+    }
+    *value_offset = entry->key_offset + key_size + 1;
+    *value_size = entry->value_size;
+    return true;
+}
+#endif
+
+// Incremented whenever the file may have changed
+static uint32_t g_file_generation = 0;
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+// Incremented only when the file in Flash may have been rewritten, not for staged changes
+static uint32_t g_flash_generation = 0;
+#endif
+
+uint32_t wifi_settings_get_file_generation() {
+    return g_file_generation;
+}
 
+void wifi_settings_key_index_invalidate() {
+    g_file_generation++;
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+    g_flash_generation++;
+#endif
+#if WIFI_SETTINGS_KEY_INDEX_SIZE > 0
+    g_key_index.file = NULL;
+#endif
+}
+
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+// Copy of the settings file in RAM, refreshed whenever the file in Flash may have changed
+typedef struct file_copy_t {
+    char contents[WIFI_SETTINGS_FILE_SIZE];
+    const void* source;     // NULL = no copy
+    uint32_t generation;
+} file_copy_t;
+
+static file_copy_t g_file_copy;
+#endif
+
+// Find the location of the settings file in memory
+static void get_file(const char** file, uint* file_size) {
     wifi_settings_flash_range_t fr;
     wifi_settings_logical_range_t lr;
 
     wifi_settings_range_get_wifi_settings_file(&fr);
+#if WIFI_SETTINGS_FILE_READ_MODE == 0
     wifi_settings_range_translate_to_logical(&fr, &lr);
+#else
+    wifi_settings_range_translate_to_uncached_logical(&fr, &lr);
+#endif
+
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+    // If the file does not fit in the copy (because
+    // wifi_settings_range_get_wifi_settings_file was reimplemented) it is read directly
+    if (lr.size <= sizeof(g_file_copy.contents)) {
+        if (g_file_copy.source != lr.start_address) {
+            // The file has moved, so the index and any pointers into the copy are not valid
+            wifi_settings_key_index_invalidate();
+        }
+        // The copy is refreshed while holding the staged update lock, so that
+        // another refresh can't start meanwhile (e.g. in a remote handler), and
+        // it is never cleared first, so a reader sees the old or new contents
+        const bool need_lock = wifi_settings_staged_update_lock();
+        if (g_file_copy.generation != g_flash_generation) {
+            memcpy(g_file_copy.contents, lr.start_address, lr.size);
+            memset(&g_file_copy.contents[lr.size], '\xff', sizeof(g_file_copy.contents) - lr.size);
+            g_file_copy.source = lr.start_address;
+            g_file_copy.generation = g_flash_generation;
+        }
+        wifi_settings_staged_update_unlock(need_lock);
+        lr.start_address = g_file_copy.contents;
+    }
+#endif
+
+    *file = (const char*) lr.start_address;
+    *file_size = lr.size;
+}
+
+// Modules that cache data derived from the file
+static wifi_settings_file_change_subscriber_t* g_file_change_subscribers = NULL;
+
+void wifi_settings_add_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {
+    wifi_settings_remove_file_change_subscriber(subscriber);
+    subscriber->next = g_file_change_subscribers;
+    g_file_change_subscribers = subscriber;
+}
+
+void wifi_settings_remove_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {
+    wifi_settings_file_change_subscriber_t** link = &g_file_change_subscribers;
+    while (*link) {
+        if (*link == subscriber) {
+            *link = subscriber->next;
+            subscriber->next = NULL;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+static void notify_file_change_subscribers() {
+    wifi_settings_file_change_subscriber_t* subscriber = g_file_change_subscribers;
+    while (subscriber) {
+        // The callback may remove its own subscriber
+        wifi_settings_file_change_subscriber_t* next = subscriber->next;
+        subscriber->callback(subscriber->arg);
+        subscriber = next;
+    }
+}
+
+static void key_index_build() {
+#if WIFI_SETTINGS_KEY_INDEX_SIZE > 0
+    const char* file;
+    uint file_size;
+    uint num_used = 0;
+
+    get_file(&file, &file_size);
+
+    memset(&g_key_index, 0, sizeof(g_key_index));
+
+    if (is_binary_file(file, file_size)) {
+        // No index is needed - lookups will search the binary file directory instead
+        return;
+    }
 
-    const char* file = (const char*) lr.start_address;
-    const uint file_size = lr.size;
-
-    enum parse_state_t {
-        NEW_LINE,
-        KEY,
-        SEPARATOR,
-        VALUE,
-        WAIT_FOR_NEW_LINE,
-    } parse_state = NEW_LINE;
-    uint value_index = 0;
+    uint file_index = 0;
+    while ((file_index < file_size) && !is_end_of_file(file[file_index])) {
+        // At the beginning of a line: the key is everything up to the first '='
+        const uint key_offset = file_index;
+        while ((file_index < file_size)
+        && !is_end_of_file(file[file_index])
+        && !is_end_of_line(file[file_index])
+        && (file[file_index] != '=')) {
+            file_index++;
+        }
+        const uint key_size = file_index - key_offset;
+        const bool has_separator = (file_index < file_size) && (file[file_index] == '=');
+
+        // The value is everything up to the end of the line
+        if (has_separator) {
+            file_index++;
+        }
+        const uint value_offset = file_index;
+        file_index = find_end_of_line(file, file_index, file_size);
+
+        if (has_separator && (key_size > 0)) {
+            // Valid key, add to the index unless it is already present
+            const uint16_t hash = key_index_hash(&file[key_offset], key_size);
+            key_index_entry_t* entry = key_index_find(file, &file[key_offset], key_size, hash);
+            if (entry->key_size == 0) {
+                if (num_used >= KEY_INDEX_MAX_USED) {
+                    // Too many keys - lookups will scan the file instead
+                    return;
+                }
+                num_used++;
+                entry->hash = hash;
+                entry->key_offset = (uint16_t) key_offset;
+                entry->key_size = (uint16_t) key_size;
+                entry->value_size = (uint16_t) (file_index - value_offset);
+            }
+        }
+
+        // Skip the end of line character
+        if ((file_index < file_size) && is_end_of_line(file[file_index])) {
+            file_index++;
+        }
+    }
+    g_key_index.file = file;
+    g_key_index.file_size = file_size;
+#endif
+}
+
+void wifi_settings_key_index_rebuild() {
+    g_file_generation++;
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+    g_flash_generation++;
+#endif
+    key_index_build();
+    notify_file_change_subscribers();
+}
+
+
+// Does the line begin with the key followed by '='? If so, find the start of the value.
+static bool match_key(const char* line, uint line_size, const char* key, uint* value_offset) {
     uint key_index = 0;
+    while (key[key_index] != '\0') {
+        if ((key_index >= line_size) || (line[key_index] != key[key_index])) {
+            return false;
+        }
+        key_index++;
+    }
+    if ((key_index >= line_size) || (line[key_index] != '=')) {
+        return false;
+    }
+    *value_offset = key_index + 1;
+    return true;
+}
+
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+// Changes which have not been written to Flash yet, as lines of text ending with '\n':
+// "key=value" for a key that is set, or "key" for a key that is deleted.
+// Changes may be staged by remote handlers (in lwIP context) while the application
+// is reading settings, so the lwIP lock is held while the text is used.
+typedef struct staged_update_t {
+    char text[WIFI_SETTINGS_STAGED_UPDATE_SIZE];
+    uint size;
+} staged_update_t;
+
+static staged_update_t g_staged_update;
+
+// Find the line for a key in the staged updates. If the key is deleted, value_offset is 0.
+static bool find_staged_line(const char* key, uint* line_offset, uint* line_size,
+                             uint* value_offset) {
+    const char* text = g_staged_update.text;
+    const uint key_size = strlen(key);
+    uint index = 0;
+    while (index < g_staged_update.size) {
+        // Every line ends with '\n'
+        const uint offset = index;
+        while (text[index] != '\n') {
+            index++;
+        }
+        const uint size = index - offset;
+        index++;
+        uint found_offset = 0;
+        if (match_key(&text[offset], size, key, &found_offset)
+        || ((size == key_size) && (memcmp(&text[offset], key, key_size) == 0))) {
+            *line_offset = offset;
+            *line_size = size + 1;
+            *value_offset = found_offset;
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// The lwIP lock is only needed (and only available) once cyw43_arch has been initialised.
+// It also protects the copy of the file (WIFI_SETTINGS_FILE_READ_MODE 2).
+bool wifi_settings_staged_update_lock() {
+#if (WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0) || (WIFI_SETTINGS_FILE_READ_MODE == 2)
+    const bool need_lock = (cyw43_arch_async_context() != NULL);
+    if (need_lock) {
+        cyw43_arch_lwip_begin();
+    }
+    return need_lock;
+#else
+    return false;
+#endif
+}
+
+void wifi_settings_staged_update_unlock(bool need_lock) {
+    if (need_lock) {
+        cyw43_arch_lwip_end();
+    }
+}
+
+// Find a key in the staged updates. If the key is deleted, *value is NULL.
+// The caller must hold wifi_settings_staged_update_lock while using *value.
+static bool find_staged(const char* key, const char** value, uint* value_size) {
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    uint line_offset = 0;
+    uint line_size = 0;
+    uint value_offset = 0;
+    if ((key[0] != '\0') && find_staged_line(key, &line_offset, &line_size, &value_offset)) {
+        if (value_offset == 0) {
+            *value = NULL;
+            *value_size = 0;
+        } else {
+            *value = &g_staged_update.text[line_offset + value_offset];
+            *value_size = line_size - value_offset - 1;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Copy the value for a key from the staged updates, holding the lock in case
+// a change is staged at the same time. If the key is deleted, *deleted is set.
+static bool copy_staged(const char* key, char* value, uint* value_size, bool* deleted) {
+    const char* staged_value = NULL;
+    uint staged_value_size = 0;
+    const bool need_lock = wifi_settings_staged_update_lock();
+    const bool found = find_staged(key, &staged_value, &staged_value_size);
+    *deleted = found && (staged_value == NULL);
+    if (found && !*deleted) {
+        if (staged_value_size < *value_size) {
+            *value_size = staged_value_size;
+        }
+        memcpy(value, staged_value, *value_size);
+    }
+    wifi_settings_staged_update_unlock(need_lock);
+    return found;
+}
+
+int wifi_settings_staged_update_add(const char* key, const char* value, uint value_size) {
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    uint line_offset = 0;
+    uint line_size = 0;
+    uint value_offset = 0;
+    const bool need_lock = wifi_settings_staged_update_lock();
+    const bool replace = find_staged_line(key, &line_offset, &line_size, &value_offset);
+    const uint key_size = strlen(key);
+    const uint new_line_size = key_size + ((value != NULL) ? (1 + value_size) : 0) + 1;
+    const uint free_size = sizeof(g_staged_update.text) - g_staged_update.size
+                            + (replace ? line_size : 0);
+    if (new_line_size > free_size) {
+        wifi_settings_staged_update_unlock(need_lock);
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+
+    // Remove the earlier change for the key, and add the new one at the end
+    char* text = g_staged_update.text;
+    if (replace) {
+        memmove(&text[line_offset], &text[line_offset + line_size],
+                g_staged_update.size - (line_offset + line_size));
+        g_staged_update.size -= line_size;
+    }
+    memcpy(&text[g_staged_update.size], key, key_size);
+    g_staged_update.size += key_size;
+    if (value != NULL) {
+        text[g_staged_update.size++] = '=';
+        memcpy(&text[g_staged_update.size], value, value_size);
+        g_staged_update.size += value_size;
+    }
+    text[g_staged_update.size++] = '\n';
+
+    // Values found by wifi_settings_get_value_pointer_for_key may have moved
+    g_file_generation++;
+    wifi_settings_staged_update_unlock(need_lock);
+    notify_file_change_subscribers();
+    return PICO_OK;
+#else
+    return PICO_ERROR_INSUFFICIENT_RESOURCES;
+#endif
+}
+
+void wifi_settings_staged_update_get(const char** updates, uint* size) {
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    *updates = g_staged_update.text;
+    *size = g_staged_update.size;
+#else
+    *updates = "";
+    *size = 0;
+#endif
+}
+
+void wifi_settings_staged_update_clear() {
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    const bool need_lock = wifi_settings_staged_update_lock();
+    g_staged_update.size = 0;
+    g_file_generation++;
+    wifi_settings_staged_update_unlock(need_lock);
+    // Values found in the staged updates are now found in the file (if at all)
+    notify_file_change_subscribers();
+#endif
+}
 
+// Find the value for a key in the file, using the index if possible
+static bool find_value(const char* file, uint file_size, const char* key,
+                       uint* value_offset, uint* value_size) {
     if (key[0] == '\0') {
         // Invalid key - must contain at least 1 character
         return false;
     }
 
-    for (uint file_index = 0;
-            (file_index < file_size)
-            && (file[file_index] != '\0')
-            && (file[file_index] != '\x1a') // CPM EOF character
-            && (file[file_index] != '\xff'); // Flash padding character
-            file_index++) {
+    if (is_binary_file(file, file_size)) {
+        return find_in_binary_file(file, file_size, key, value_offset, value_size);
+    }
+
+#if WIFI_SETTINGS_KEY_INDEX_SIZE > 0
+    if (can_use_key_index(file, file_size, key)) {
+        return find_in_key_index(file, file_size, key, value_offset, value_size);
+    }
+#endif
+
+    uint file_index = 0;
+    while ((file_index < file_size) && !is_end_of_file(file[file_index])) {
+        // Find the end of the line
+        const uint line_offset = file_index;
+        file_index = find_end_of_line(file, file_index, file_size);
+        const uint line_size = file_index - line_offset;
+        uint offset = 0;
+        if (match_key(&file[line_offset], line_size, key, &offset)) {
+            // The value is everything after the first '=' up to the end of the line
+            *value_offset = line_offset + offset;
+            *value_size = line_size - offset;
+            return true;
+        }
+
+        // Skip the end of line character
+        if ((file_index < file_size) && is_end_of_line(file[file_index])) {
+            file_index++;
+        }
+    }
+    // Key was not found
+    return false;
+}
+
+// Scan the settings file in Flash for a particular key.
+static bool default_get_value_for_key(
+            const char* key, char* value, uint* value_size) {
+    const char* file;
+    uint file_size;
+    uint value_offset = 0;
+    uint size = 0;
+
+    bool deleted = false;
+    if (copy_staged(key, value, value_size, &deleted)) {
+        // The key has been changed, but not written to Flash yet
+        return !deleted;
+    }
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    get_file(&file, &file_size);
+    const bool found = find_value(file, file_size, key, &value_offset, &size);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FILE_SEARCH, profile_start);
+    if (!found) {
+        return false;
+    }
+    if (size < *value_size) {
+        *value_size = size;
+    }
+    memcpy(value, &file[value_offset], *value_size);
+    return true;
+}
+
+// This function can be reimplemented in order to load settings from some other storage.
+// It is an alias, so that wifi_settings_get_values_for_keys can tell if this was done.
+bool wifi_settings_get_value_for_key(
+            const char* key, char* value, uint* value_size)
+            __attribute__((weak, alias("default_get_value_for_key")));
+
+// Find a key in the settings file without copying the value.
+// The caller must hold wifi_settings_staged_update_lock while using *value (see find_staged).
+// This function can be reimplemented in order to load settings from some other storage
+__weak bool wifi_settings_get_value_pointer_for_key(
+            const char* key, const char** value, uint* value_size) {
+    const char* file;
+    uint file_size;
+    uint value_offset = 0;
+
+    if (find_staged(key, value, value_size)) {
+        // The key has been changed, but not written to Flash yet
+        return (*value != NULL);
+    }
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    get_file(&file, &file_size);
+    const bool found = find_value(file, file_size, key, &value_offset, value_size);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FILE_SEARCH, profile_start);
+    if (!found) {
+        return false;
+    }
+    *value = &file[value_offset];
+    return true;
+}
+
+// Can this key be found without scanning the file?
+static bool can_find_directly(const char* file, uint file_size, bool is_binary, const char* key) {
+    if (is_binary) {
+        return true;
+    }
+#if WIFI_SETTINGS_KEY_INDEX_SIZE > 0
+    if (can_use_key_index(file, file_size, key)) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Does this item need to be found by scanning the file?
+static bool needs_scan(const wifi_settings_key_value_t* item, const char* file, uint file_size,
+                       bool is_binary) {
+    if (item->found || (item->key[0] == '\0')) {
+        // Already found, or invalid key - must contain at least 1 character
+        return false;
+    }
+    if (can_find_directly(file, file_size, is_binary, item->key)) {
+        // Already looked up using the index or binary file directory
+        return false;
+    }
+    return true;
+}
+
+// Scan the settings file in Flash for several keys at once.
+// This function can be reimplemented in order to load settings from some other storage
+__weak uint wifi_settings_get_values_for_keys(
+            wifi_settings_key_value_t* items, uint num_items) {
+
+    const char* file;
+    uint file_size;
+    uint num_found = 0;
+    uint num_to_scan = 0;
+    uint num_deleted = 0;
 
-        if ((file[file_index] == '\n') || (file[file_index] == '\r')) {
-            // End of line reached (Unix or DOS line endings)
-            if (parse_state == VALUE) {
-                // This is the end of the value
-                *value_size = value_index;
-                return true;
+    if (wifi_settings_get_value_for_key != default_get_value_for_key) {
+        // The application loads settings from some other storage, and has not
+        // reimplemented this function too, so each key is found separately
+        for (uint i = 0; i < num_items; i++) {
+            wifi_settings_key_value_t* item = &items[i];
+            item->found = wifi_settings_get_value_for_key(item->key, item->value, &item->value_size);
+            num_found += item->found ? 1 : 0;
+        }
+        return num_found;
+    }
+
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    get_file(&file, &file_size);
+    const bool is_binary = is_binary_file(file, file_size);
+    for (uint i = 0; i < num_items; i++) {
+        wifi_settings_key_value_t* item = &items[i];
+        bool deleted = false;
+        item->found = false;
+        if (copy_staged(item->key, item->value, &item->value_size, &deleted)) {
+            // The key has been changed, but not written to Flash yet. A deleted key
+            // is marked as found until the scan is finished, so that it is not scanned for.
+            item->found = true;
+            if (deleted) {
+                num_deleted++;
             } else {
-                // Reset the parsing state
-                parse_state = NEW_LINE;
-                continue;
+                num_found++;
             }
+            continue;
         }
-
-        switch (parse_state) {
-            case NEW_LINE:
-                // At the beginning of a new line - ignore whitespace before the key
-                key_index = 0;
-                if (key[key_index] == file[file_index]) {
-                    // Matched the first character in the key
-                    key_index++;
-                    if (key[key_index] == '\0') {
-                        // There is only one character in the key
-                        parse_state = SEPARATOR;
-                    } else {
-                        // Match the other characters in the key
-                        parse_state = KEY;
-                    }
-                } else {
-                    // Non-matching character: a different key,
-                    // a comment - wait for the next newline
-                    parse_state = WAIT_FOR_NEW_LINE;
-                }
-                break;
-            case KEY:
-                if (key[key_index] == file[file_index]) {
-                    // Still matching the key
-                    key_index++;
-                    if (key[key_index] == '\0') {
-                        // There are no more characters in the key
-                        parse_state = SEPARATOR;
-                    }
-                } else {
-                    // Non-matching character in the key
-                    parse_state = WAIT_FOR_NEW_LINE;
-                }
-                break;
-            case SEPARATOR:
-                if (file[file_index] == '=') {
-                    // Key is recognised - copy the value
-                    parse_state = VALUE;
-                } else {
-                    // Key is not immediately followed by '=': not valid
-                    parse_state = WAIT_FOR_NEW_LINE;
+        if ((item->key[0] != '\0') && can_find_directly(file, file_size, is_binary, item->key)) {
+            uint value_offset = 0;
+            uint value_size = 0;
+            if (find_value(file, file_size, item->key, &value_offset, &value_size)) {
+                if (value_size < item->value_size) {
+                    item->value_size = value_size;
                 }
-                break;
-            case VALUE:
-                if (value_index >= *value_size) {
-                    // Unable to copy more value characters - value is complete
-                    return true;
-                } else {
-                    value[value_index] = file[file_index];
-                    value_index++;
+                memcpy(item->value, &file[value_offset], item->value_size);
+                item->found = true;
+                num_found++;
+            }
+            continue;
+        }
+        num_to_scan += needs_scan(item, file, file_size, is_binary) ? 1 : 0;
+    }
+
+    uint file_index = 0;
+    while ((num_to_scan > 0)
+    && (file_index < file_size)
+    && !is_end_of_file(file[file_index])) {
+        // Find the end of the line
+        const char* line = &file[file_index];
+        const uint line_offset = file_index;
+        file_index = find_end_of_line(file, file_index, file_size);
+        const uint line_size = file_index - line_offset;
+
+        // Check each key that has not been found yet. If a key appears more than
+        // once, the first value is used, matching wifi_settings_get_value_for_key.
+        for (uint i = 0; i < num_items; i++) {
+            wifi_settings_key_value_t* item = &items[i];
+            uint value_offset = 0;
+            if (needs_scan(item, file, file_size, is_binary)
+            && match_key(line, line_size, item->key, &value_offset)) {
+                if ((line_size - value_offset) < item->value_size) {
+                    item->value_size = line_size - value_offset;
                 }
-                break;
-            case WAIT_FOR_NEW_LINE:
-                // Do nothing in this state, as the state will be reset when
-                // the next newline is seen
-                break;
+                memcpy(item->value, &line[value_offset], item->value_size);
+                item->found = true;
+                num_found++;
+                num_to_scan--;
+            }
+        }
+
+        // Skip the end of line character
+        if ((file_index < file_size) && is_end_of_line(file[file_index])) {
+            file_index++;
         }
     }
-    if (parse_state == VALUE) {
-        // Reached end of file while parsing the value - value is complete
-        *value_size = value_index;
-        return true;
+    const bool need_lock = (num_deleted > 0) && wifi_settings_staged_update_lock();
+    for (uint i = 0; (num_deleted > 0) && (i < num_items); i++) {
+        wifi_settings_key_value_t* item = &items[i];
+        const char* staged_value = NULL;
+        uint staged_value_size = 0;
+        if (item->found
+        && find_staged(item->key, &staged_value, &staged_value_size)
+        && (staged_value == NULL)) {
+            item->found = false;
+            num_deleted--;
+        }
     }
-    // Key was not found
-    return false;
+    wifi_settings_staged_update_unlock(need_lock);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FILE_SEARCH, profile_start);
+    return num_found;
 }
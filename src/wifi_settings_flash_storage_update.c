@@ -9,8 +9,13 @@
  */
 
 #include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
+#include "wifi_settings/wifi_settings_profile.h"
+#if WIFI_SETTINGS_AB_STORAGE
+#include "wifi_settings/wifi_settings_flash_ab_storage.h"
+#endif
 
 #include "hardware/flash.h"
 #include "hardware/sync.h"
@@ -18,8 +23,10 @@
 #include "pico/error.h"
 #include "pico/flash.h"
 #include "pico/stdlib.h"
+#include "pico/time.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include <limits.h>
 
 #ifndef UNIT_TEST
@@ -33,58 +40,197 @@ static inline bool wifi_settings_flash_range_verify(
 }
 #endif
 
+static wifi_settings_flash_update_stats_t g_flash_update_stats;
+
+void wifi_settings_get_flash_update_stats(wifi_settings_flash_update_stats_t* stats) {
+    *stats = g_flash_update_stats;
+}
+
+static void record_time(uint32_t* max_time_us, uint32_t start_time_us) {
+    const uint32_t time_us = time_us_32() - start_time_us;
+    if (time_us > *max_time_us) {
+        *max_time_us = time_us;
+    }
+}
+
+// Get one page of the new contents of the file, padded with '\xff' (Flash erase byte)
+static void get_page(uint8_t* page_copy, uint offset, const char* file, const uint file_size) {
+    memset(page_copy, '\xff', FLASH_PAGE_SIZE);
+    if (offset < file_size) {
+        const uint remaining_size = file_size - offset;
+        memcpy(page_copy, &file[offset],
+               (remaining_size < FLASH_PAGE_SIZE) ? remaining_size : FLASH_PAGE_SIZE);
+    }
+}
+
+static bool is_erased(const uint8_t* page_copy) {
+    for (uint i = 0; i < FLASH_PAGE_SIZE; i++) {
+        if (page_copy[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Does the sector already contain the new contents of the file?
+static bool sector_matches(const wifi_settings_flash_range_t* fr, uint sector_offset,
+                           const char* file, const uint file_size) {
+    for (uint offset = sector_offset; offset < (sector_offset + FLASH_SECTOR_SIZE);
+                offset += FLASH_PAGE_SIZE) {
+        uint8_t page_copy[FLASH_PAGE_SIZE];
+        wifi_settings_flash_range_t page_range;
+        get_page(page_copy, offset, file, file_size);
+        page_range.start_address = fr->start_address + offset;
+        page_range.size = FLASH_PAGE_SIZE;
+        if (!wifi_settings_flash_range_verify(&page_range, (const char*) page_copy)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find the next page in the sector that is not entirely '\xff', and copy it to page_copy
+static uint find_page_to_program(uint8_t* page_copy, uint offset, uint end_offset,
+                                 const char* file, const uint file_size) {
+    while (offset < end_offset) {
+        get_page(page_copy, offset, file, file_size);
+        if (!is_erased(page_copy)) {
+            break;
+        }
+        offset += FLASH_PAGE_SIZE;
+    }
+    return offset;
+}
+
+// Program the pages in an erased sector. Pages which are entirely '\xff' are not
+// programmed, as they are already erased, and several pages may be programmed
+// each time interrupts are disabled, if WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US allows.
+static void program_sector(const wifi_settings_flash_range_t* fr, uint sector_offset,
+                           const char* file, const uint file_size) {
+    const uint end_offset = sector_offset + FLASH_SECTOR_SIZE;
+    uint8_t page_copy[FLASH_PAGE_SIZE];
+    uint offset = find_page_to_program(page_copy, sector_offset, end_offset, file, file_size);
+
+    while (offset < end_offset) {
+        const uint32_t flags = save_and_disable_interrupts();
+        WIFI_SETTINGS_PROFILE_START(profile_off);
+        const uint32_t start_time_us = time_us_32();
+        uint32_t page_time_us = 0;
+        do {
+            const uint32_t page_start_time_us = time_us_32();
+            WIFI_SETTINGS_PROFILE_START(profile_program);
+            flash_range_program(fr->start_address + offset, page_copy, FLASH_PAGE_SIZE);
+            WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_PROGRAM, profile_program);
+            page_time_us = time_us_32() - page_start_time_us;
+            offset = find_page_to_program(page_copy, offset + FLASH_PAGE_SIZE,
+                                          end_offset, file, file_size);
+            // Continue if the next page is expected to finish within the limit
+        } while ((offset < end_offset)
+            && (((time_us_32() - start_time_us) + page_time_us)
+                    <= WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US));
+        record_time(&g_flash_update_stats.max_program_time_us, start_time_us);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
+        restore_interrupts(flags);
+    }
+}
+
+#if WIFI_SETTINGS_AB_STORAGE
+// Commit a new file in an A/B storage slot by programming the footer in the final page
+static int commit_slot(uint slot, const wifi_settings_flash_range_t* fr,
+                       const char* file, const uint file_size) {
+    uint8_t page_copy[FLASH_PAGE_SIZE];
+    wifi_settings_ab_footer_t footer;
+    wifi_settings_flash_range_t footer_range;
+
+    wifi_settings_ab_make_footer(file, file_size, &footer);
+    memset(page_copy, '\xff', FLASH_PAGE_SIZE);
+    memcpy(page_copy, &footer, sizeof(footer));
+    footer_range.start_address = fr->start_address + fr->size - FLASH_PAGE_SIZE;
+    footer_range.size = FLASH_PAGE_SIZE;
+
+    const uint32_t flags = save_and_disable_interrupts();
+    WIFI_SETTINGS_PROFILE_START(profile_off);
+    const uint32_t start_time_us = time_us_32();
+    flash_range_program(footer_range.start_address, page_copy, FLASH_PAGE_SIZE);
+    record_time(&g_flash_update_stats.max_program_time_us, start_time_us);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_PROGRAM, profile_off);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
+    restore_interrupts(flags);
+
+    if (!wifi_settings_flash_range_verify(&footer_range, (const char*) page_copy)) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+    wifi_settings_ab_set_active_slot(slot);
+    return PICO_OK;
+}
+#endif
+
 int wifi_settings_update_flash_unsafe(
             const char* file,
             const uint file_size) {
 
     // Get memory range for wifi-settings file
     wifi_settings_flash_range_t fr;
+#if WIFI_SETTINGS_AB_STORAGE
+    // The new file is written to the slot which is not in use, and only
+    // replaces the current file when the footer is programmed
+    const uint slot = 1 - wifi_settings_ab_get_active_slot();
+    wifi_settings_ab_get_slot(slot, &fr);
+    const uint max_file_size = fr.size - FLASH_PAGE_SIZE;
+#else
     wifi_settings_range_get_wifi_settings_file(&fr);
+    const uint max_file_size = fr.size;
+#endif
 
     // Check that the new data will actually fit
-    const uint max_file_size = fr.size;
     if (file_size > max_file_size) {
         return PICO_ERROR_INVALID_ARG;
     }
 
-    // Erase existing file in Flash
-    uint32_t flags = save_and_disable_interrupts();
-    flash_range_erase(fr.start_address, max_file_size);
-    restore_interrupts(flags);
+    // The key index will not match the new file
+    wifi_settings_key_index_invalidate();
+    g_flash_update_stats.num_updates++;
 
-    // Store new copy
-    for (uint offset = 0; offset < file_size; offset += FLASH_PAGE_SIZE) {
-        uint8_t page_copy[FLASH_PAGE_SIZE];
-        const uint remaining_size = file_size - offset;
-
-        if (remaining_size >= FLASH_PAGE_SIZE) {
-            // This page is full size
-            memcpy(page_copy, &file[offset], FLASH_PAGE_SIZE);
-        } else {
-            // Page is incomplete and padded with '\xff' (Flash erase byte)
-            memset(page_copy, '\xff', FLASH_PAGE_SIZE);
-            memcpy(page_copy, &file[offset], remaining_size);
+    // Only sectors which differ from the new contents are erased and reprogrammed
+    for (uint sector_offset = 0; sector_offset < fr.size;
+                sector_offset += FLASH_SECTOR_SIZE) {
+        if (sector_matches(&fr, sector_offset, file, file_size)) {
+            continue;
         }
-        flags = save_and_disable_interrupts();
-        flash_range_program(fr.start_address + offset, page_copy, FLASH_PAGE_SIZE);
+
+        // Erase existing sector in Flash
+        const uint32_t flags = save_and_disable_interrupts();
+        WIFI_SETTINGS_PROFILE_START(profile_off);
+        const uint32_t start_time_us = time_us_32();
+        flash_range_erase(fr.start_address + sector_offset, FLASH_SECTOR_SIZE);
+        record_time(&g_flash_update_stats.max_erase_time_us, start_time_us);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_ERASE, profile_off);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
         restore_interrupts(flags);
+
+        // Store new copy
+        program_sector(&fr, sector_offset, file, file_size);
     }
 
     // Test copy
-    fr.size = file_size;
-    if (wifi_settings_flash_range_verify(&fr, file)) {
-        if (file_size < max_file_size) {
-            // Check file is terminated by '\xff'
-            fr.start_address += file_size;
-            fr.size = 1;
-            if (wifi_settings_flash_range_verify(&fr, "\xff")) {
-                return PICO_OK;
-            }
-        } else {
-            return PICO_OK;
+    wifi_settings_flash_range_t test_range = fr;
+    test_range.size = file_size;
+    if (!wifi_settings_flash_range_verify(&test_range, file)) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+    if (file_size < max_file_size) {
+        // Check file is terminated by '\xff'
+        test_range.start_address += file_size;
+        test_range.size = 1;
+        if (!wifi_settings_flash_range_verify(&test_range, "\xff")) {
+            return PICO_ERROR_INVALID_DATA;
         }
     }
-    return PICO_ERROR_INVALID_DATA;
+#if WIFI_SETTINGS_AB_STORAGE
+    return commit_slot(slot, &fr, file, file_size);
+#else
+    return PICO_OK;
+#endif
 }
 
 typedef struct wifi_settings_flash_safe_params_t {
@@ -106,9 +252,339 @@ int wifi_settings_update_flash_safe(
     param.file_size = file_size;
     param.rc = PICO_ERROR_GENERIC;
     int rc = flash_safe_execute(wifi_settings_flash_safe_internal, &param, UINT_MAX);
+    wifi_settings_key_index_rebuild();
     if (rc == PICO_OK) {
         return param.rc;
     } else {
         return rc;
     }
 }
+
+static bool is_end_of_line_or_file(const char c) {
+    return (c == '\n') || (c == '\r')
+        || (c == '\0') || (c == '\x1a') || (c == '\xff');
+}
+
+// Find the end of the current settings file
+static uint get_file_size(const char* file, uint max_file_size) {
+    uint file_size = 0;
+    while ((file_size < max_file_size)
+    && (file[file_size] != '\0') && (file[file_size] != '\x1a') && (file[file_size] != '\xff')) {
+        file_size++;
+    }
+    return file_size;
+}
+
+// Copy the current settings file into new_file, replacing the line
+// for the key with "key=value", removing it if value is NULL, or adding it
+// at the end if it was not present. Returns the new size, or a PICO_ERROR_... code.
+static int edit_file(char* new_file, uint max_file_size,
+                     const char* file, uint file_size,
+                     const char* key, uint key_size, const char* value, uint value_size) {
+    const bool set = (value != NULL);
+    bool found = false;
+    uint new_size = 0;
+    uint file_index = 0;
+    while (file_index < file_size) {
+        // Find the end of the line, including the line ending
+        const uint line_offset = file_index;
+        while ((file_index < file_size) && !is_end_of_line_or_file(file[file_index])) {
+            file_index++;
+        }
+        const uint line_size = file_index - line_offset;
+        while ((file_index < file_size) && is_end_of_line_or_file(file[file_index])) {
+            file_index++;
+        }
+
+        const bool matches = (line_size > key_size)
+            && (memcmp(&file[line_offset], key, key_size) == 0)
+            && (file[line_offset + key_size] == '=');
+        if (!matches) {
+            // Copy the line unchanged
+            const uint copy_size = file_index - line_offset;
+            if ((new_size + copy_size) > max_file_size) {
+                return PICO_ERROR_INVALID_ARG;
+            }
+            memcpy(&new_file[new_size], &file[line_offset], copy_size);
+            new_size += copy_size;
+        } else if (set && !found) {
+            // Replace the value, keeping the line ending
+            const uint ending_size = file_index - (line_offset + line_size);
+            const uint copy_size = key_size + 1 + value_size + ending_size;
+            if ((new_size + copy_size) > max_file_size) {
+                return PICO_ERROR_INVALID_ARG;
+            }
+            memcpy(&new_file[new_size], key, key_size);
+            new_file[new_size + key_size] = '=';
+            memcpy(&new_file[new_size + key_size + 1], value, value_size);
+            memcpy(&new_file[new_size + key_size + 1 + value_size],
+                   &file[line_offset + line_size], ending_size);
+            new_size += copy_size;
+        }
+        // Any other line for the key would be ignored, so it is removed
+        found = found || matches;
+    }
+
+    if (set && !found) {
+        // Add the key at the end, starting a new line if necessary
+        const bool needs_newline = (new_size > 0) && !is_end_of_line_or_file(new_file[new_size - 1]);
+        const uint copy_size = (needs_newline ? 1 : 0) + key_size + 1 + value_size + 1;
+        if ((new_size + copy_size) > max_file_size) {
+            return PICO_ERROR_INVALID_ARG;
+        }
+        if (needs_newline) {
+            new_file[new_size++] = '\n';
+        }
+        memcpy(&new_file[new_size], key, key_size);
+        new_size += key_size;
+        new_file[new_size++] = '=';
+        memcpy(&new_file[new_size], value, value_size);
+        new_size += value_size;
+        new_file[new_size++] = '\n';
+    }
+    return (int) new_size;
+}
+
+// Check a key, and a value (unless value == NULL) for update_key and stage_key
+static int check_key_and_value(const char* key, const char* value, uint value_size) {
+    // Keys must not be empty, and keys and values must fit on one line
+    if ((key[0] == '\0') || (strchr(key, '=') != NULL)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    for (uint i = 0; key[i] != '\0'; i++) {
+        if (is_end_of_line_or_file(key[i])) {
+            return PICO_ERROR_INVALID_ARG;
+        }
+    }
+    for (uint i = 0; (value != NULL) && (i < value_size); i++) {
+        if (is_end_of_line_or_file(value[i])) {
+            return PICO_ERROR_INVALID_ARG;
+        }
+    }
+    return PICO_OK;
+}
+
+// Find the current settings file, which must be in the text format
+static int get_editable_file(const char** file, uint* file_size, uint* max_file_size) {
+    wifi_settings_flash_range_t fr;
+    wifi_settings_logical_range_t lr;
+    wifi_settings_range_get_wifi_settings_file(&fr);
+    wifi_settings_range_translate_to_logical(&fr, &lr);
+    *file = (const char*) lr.start_address;
+    *max_file_size = lr.size;
+
+    // A pre-compiled binary file can't be edited
+    if ((lr.size >= sizeof(wifi_settings_binary_file_header_t))
+    && (memcmp(*file, WIFI_SETTINGS_BINARY_FILE_MAGIC, 4) == 0)) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+    *file_size = get_file_size(*file, lr.size);
+    return PICO_OK;
+}
+
+// Set or delete (if value == NULL) a key in the settings file now
+static int update_key(const char* key, const char* value, uint value_size) {
+    const char* file = NULL;
+    uint file_size = 0;
+    uint max_file_size = 0;
+    int rc = get_editable_file(&file, &file_size, &max_file_size);
+    if (rc != PICO_OK) {
+        return rc;
+    }
+
+    // The new file is built in RAM, and then only the sectors that
+    // have changed are reprogrammed
+    char* new_file = malloc(max_file_size);
+    if (!new_file) {
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    rc = edit_file(new_file, max_file_size, file, file_size,
+                   key, strlen(key), value, value_size);
+    if (rc >= 0) {
+        const uint new_file_size = (uint) rc;
+        rc = PICO_OK;
+        if ((new_file_size != file_size) || (memcmp(new_file, file, file_size) != 0)) {
+            rc = wifi_settings_update_flash_safe(new_file, new_file_size);
+        }
+    }
+    free(new_file);
+    return rc;
+}
+
+// When the staged updates are written to Flash, if there are any
+static absolute_time_t g_staged_update_flush_time;
+
+// Stage a change to a key (deleting it if value == NULL), or make it now if it can't be staged
+static int stage_key(const char* key, const char* value, uint value_size) {
+    const char* file = NULL;
+    uint file_size = 0;
+    uint max_file_size = 0;
+    int rc = check_key_and_value(key, value, value_size);
+    if (rc == PICO_OK) {
+        rc = get_editable_file(&file, &file_size, &max_file_size);
+    }
+    if (rc != PICO_OK) {
+        return rc;
+    }
+
+    rc = wifi_settings_staged_update_add(key, value, value_size);
+    if ((rc == PICO_ERROR_INSUFFICIENT_RESOURCES) && wifi_settings_has_staged_updates()) {
+        // No space for the change: write the earlier changes first
+        rc = wifi_settings_flush_staged_updates();
+        if (rc == PICO_OK) {
+            rc = wifi_settings_staged_update_add(key, value, value_size);
+        }
+    }
+    if (rc == PICO_ERROR_INSUFFICIENT_RESOURCES) {
+        // The change is too large to be staged (or WIFI_SETTINGS_STAGED_UPDATE_SIZE is 0)
+        return update_key(key, value, value_size);
+    }
+    if (rc == PICO_OK) {
+        g_staged_update_flush_time = make_timeout_time_ms(WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS);
+    }
+    return rc;
+}
+
+// Apply the staged updates to a copy of the file in new_file[*new_index]: each change
+// is applied in turn, alternating between the two buffers in new_file. Returns the new
+// size, or a PICO_ERROR_... code.
+static int apply_staged_updates(char* new_file[2], uint* new_index, uint max_file_size,
+                                const char* file, uint file_size,
+                                const char* updates, uint updates_size) {
+    uint index = 0;
+    uint size = file_size;
+    memcpy(new_file[*new_index], file, file_size);
+    while (index < updates_size) {
+        // Each line is "key=value" or "key", ending with '\n'
+        const char* key = &updates[index];
+        uint key_size = 0;
+        while ((key[key_size] != '=') && (key[key_size] != '\n')) {
+            key_size++;
+        }
+        index += key_size;
+        const char* value = NULL;
+        uint value_size = 0;
+        if (updates[index] == '=') {
+            index++;
+            value = &updates[index];
+            while (value[value_size] != '\n') {
+                value_size++;
+            }
+            index += value_size;
+        }
+        index++;
+
+        const int rc = edit_file(new_file[1 - *new_index], max_file_size,
+                                 new_file[*new_index], size,
+                                 key, key_size, value, value_size);
+        if (rc < 0) {
+            return rc;
+        }
+        size = (uint) rc;
+        *new_index = 1 - *new_index;
+    }
+    return (int) size;
+}
+
+int wifi_settings_flush_staged_updates() {
+    const char* updates = NULL;
+    uint updates_size = 0;
+    // Changes can't be staged while the staged updates are being written
+    const bool need_lock = wifi_settings_staged_update_lock();
+    wifi_settings_staged_update_get(&updates, &updates_size);
+    if (updates_size == 0) {
+        wifi_settings_staged_update_unlock(need_lock);
+        return PICO_OK;
+    }
+
+    const char* file = NULL;
+    uint file_size = 0;
+    uint max_file_size = 0;
+    char* new_file[2];
+    uint new_index = 0;
+    int rc = get_editable_file(&file, &file_size, &max_file_size);
+    if (rc == PICO_OK) {
+        new_file[0] = malloc(max_file_size);
+        new_file[1] = malloc(max_file_size);
+        if (new_file[0] && new_file[1]) {
+            rc = apply_staged_updates(new_file, &new_index, max_file_size,
+                                      file, file_size, updates, updates_size);
+        } else {
+            rc = PICO_ERROR_INSUFFICIENT_RESOURCES;
+        }
+        if (rc >= 0) {
+            const uint new_file_size = (uint) rc;
+            rc = PICO_OK;
+            if ((new_file_size != file_size)
+            || (memcmp(new_file[new_index], file, file_size) != 0)) {
+                rc = wifi_settings_update_flash_safe(new_file[new_index], new_file_size);
+            }
+        }
+        free(new_file[0]);
+        free(new_file[1]);
+    }
+
+    if ((rc == PICO_OK) || (rc == PICO_ERROR_INVALID_ARG) || (rc == PICO_ERROR_INVALID_DATA)) {
+        // Written, or can never be written: the file would be too large,
+        // or has been replaced by a pre-compiled binary file. If discarded, the
+        // values in the file are found again, so subscribers are notified.
+        wifi_settings_staged_update_clear();
+    } else {
+        // Try again later
+        g_staged_update_flush_time = make_timeout_time_ms(WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS);
+    }
+    wifi_settings_staged_update_unlock(need_lock);
+    return rc;
+}
+
+bool wifi_settings_has_staged_updates() {
+    const char* updates = NULL;
+    uint updates_size = 0;
+    wifi_settings_staged_update_get(&updates, &updates_size);
+    return updates_size != 0;
+}
+
+void wifi_settings_staged_updates_periodic() {
+    if (wifi_settings_has_staged_updates() && time_reached(g_staged_update_flush_time)) {
+        wifi_settings_flush_staged_updates();
+    }
+}
+
+// Set or delete (if value == NULL) a key in the settings file now, with any staged changes
+static int update_key_now(const char* key, const char* value, uint value_size) {
+    if (wifi_settings_has_staged_updates()) {
+        // The staged changes are written at the same time
+        int rc = stage_key(key, value, value_size);
+        if (rc == PICO_OK) {
+            rc = wifi_settings_flush_staged_updates();
+        }
+        return rc;
+    }
+    const int rc = check_key_and_value(key, value, value_size);
+    if (rc != PICO_OK) {
+        return rc;
+    }
+    return update_key(key, value, value_size);
+}
+
+int wifi_settings_set_value_for_key(
+            const char* key,
+            const char* value,
+            const uint value_size) {
+    return update_key_now(key, value, value_size);
+}
+
+int wifi_settings_delete_key(const char* key) {
+    return update_key_now(key, NULL, 0);
+}
+
+int wifi_settings_stage_value_for_key(
+            const char* key,
+            const char* value,
+            const uint value_size) {
+    return stage_key(key, value, value_size);
+}
+
+int wifi_settings_stage_delete_key(const char* key) {
+    return stage_key(key, NULL, 0);
+}
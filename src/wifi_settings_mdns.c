@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * mDNS and DNS-SD advertisement for wifi-settings: the board can be
+ * found as "<hostname>.local", and the remote service is advertised as
+ * a _pico-wifi-settings._tcp service with the board ID and versions
+ * in the TXT record.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_mdns.h"
+#include "wifi_settings/wifi_settings_hostname.h"
+#include "wifi_settings/wifi_settings_remote.h"
+#ifdef ENABLE_REMOTE_UPDATE
+#include "wifi_settings/wifi_settings_remote_handlers.h"
+#endif
+
+#include "lwip/netif.h"
+#include "lwip/apps/mdns.h"
+#include "pico/binary_info/structure.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if !LWIP_MDNS_RESPONDER
+#error "WIFI_SETTINGS_MDNS requires LWIP_MDNS_RESPONDER=1 in lwipopts.h (and LWIP_IGMP=1)"
+#endif
+
+#ifndef WIFI_SETTINGS_VERSION_STRING
+#error "WIFI_SETTINGS_VERSION_STRING must be set"
+#endif
+
+// mDNS names are limited to 63 characters
+#define MDNS_NAME_SIZE              64
+
+// The name which is currently announced
+static char g_mdns_hostname[MDNS_NAME_SIZE];
+static struct netif* g_mdns_netif = NULL;
+static bool g_mdns_responder_started = false;
+#ifdef ENABLE_REMOTE_UPDATE
+static s8_t g_mdns_service_slot = -1;
+#endif
+
+static void copy_hostname() {
+    snprintf(g_mdns_hostname, sizeof(g_mdns_hostname), "%s", wifi_settings_get_hostname());
+}
+
+#ifdef ENABLE_REMOTE_UPDATE
+static void add_txt_item(struct mdns_service* service, const char* key, const char* value) {
+    char item[MDNS_NAME_SIZE];
+    const int size = snprintf(item, sizeof(item), "%s=%s", key, value ? value : "");
+    if ((size > 0) && (size < (int) sizeof(item))) {
+        mdns_resp_add_service_txtitem(service, item, (u8_t) size);
+    }
+}
+
+static void service_txt_callback(struct mdns_service* service, void* unused) {
+    // Called by lwIP whenever the TXT record is sent
+    add_txt_item(service, "board_id", wifi_settings_get_board_id_hex());
+    add_txt_item(service, "wifi_settings_version", WIFI_SETTINGS_VERSION_STRING);
+    const char* version = wifi_settings_get_binary_info_string(
+        BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING);
+    if (version) {
+        add_txt_item(service, "version", version);
+    }
+}
+#endif
+
+void wifi_settings_mdns_init() {
+    if (!g_mdns_responder_started) {
+        // The responder can't be stopped, so it is only started once
+        mdns_resp_init();
+        g_mdns_responder_started = true;
+    }
+    if (g_mdns_netif || !netif_default) {
+        return;
+    }
+    copy_hostname();
+    if (mdns_resp_add_netif(netif_default, g_mdns_hostname) != ERR_OK) {
+        return;
+    }
+    g_mdns_netif = netif_default;
+#ifdef ENABLE_REMOTE_UPDATE
+    g_mdns_service_slot = mdns_resp_add_service(g_mdns_netif, g_mdns_hostname,
+        WIFI_SETTINGS_MDNS_SERVICE_TYPE, DNSSD_PROTO_TCP, WIFI_SETTINGS_REMOTE_PORT_NUMBER,
+        service_txt_callback, NULL);
+#endif
+}
+
+void wifi_settings_mdns_update_hostname() {
+    if ((!g_mdns_netif) || (strcmp(g_mdns_hostname, wifi_settings_get_hostname()) == 0)) {
+        return;
+    }
+    copy_hostname();
+    // Renaming restarts the probe for the new names
+    mdns_resp_rename_netif(g_mdns_netif, g_mdns_hostname);
+#ifdef ENABLE_REMOTE_UPDATE
+    if (g_mdns_service_slot >= 0) {
+        mdns_resp_rename_service(g_mdns_netif, (u8_t) g_mdns_service_slot, g_mdns_hostname);
+    }
+#endif
+}
+
+void wifi_settings_mdns_connected() {
+#if !LWIP_NETIF_EXT_STATUS_CALLBACK
+    // Without the netif callback, the responder is not told about the new link
+    // and IP address, so the names are probed and announced again here
+    if (g_mdns_netif) {
+        mdns_resp_restart(g_mdns_netif);
+    }
+#endif
+}
+
+void wifi_settings_mdns_deinit() {
+    if (g_mdns_netif) {
+        mdns_resp_remove_netif(g_mdns_netif);
+        g_mdns_netif = NULL;
+    }
+#ifdef ENABLE_REMOTE_UPDATE
+    g_mdns_service_slot = -1;
+#endif
+}
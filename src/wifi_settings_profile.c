@@ -0,0 +1,149 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * This file contains the hot path profiling counters, which are
+ * enabled by building with WIFI_SETTINGS_PROFILE=1.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_profile.h"
+
+#include "pico/stdlib.h"
+#include "pico/time.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if WIFI_SETTINGS_PROFILE && !defined(UNIT_TEST) && defined(PICO_RP2350) && !defined(__riscv)
+// RP2350 Arm: DWT cycle counter (32 bits)
+#include "hardware/structs/m33.h"
+#define PROFILE_DWT_CYCCNT
+#define PROFILE_UNIT "cycles"
+#elif WIFI_SETTINGS_PROFILE && !defined(UNIT_TEST) && defined(PICO_RP2040)
+// RP2040: SysTick (24 bits, counts down)
+#include "hardware/structs/systick.h"
+#define PROFILE_SYSTICK
+#define PROFILE_UNIT "cycles"
+#else
+// RP2350 RISC-V, and unit tests: microsecond timer
+#define PROFILE_UNIT "us"
+#endif
+
+static const char* const g_profile_names[WIFI_SETTINGS_PROFILE_NUM_COUNTERS] = {
+    "file_search",
+    "scan_callback",
+    "secret_hash",
+    "key_setup",
+    "hmac",
+    "handler",
+    "flash_erase",
+    "flash_program",
+    "interrupts_off",
+};
+
+#if WIFI_SETTINGS_PROFILE
+// The counters are updated without a lock. If both cores update the same
+// counter at the same moment, one of the updates may be lost, which is acceptable
+// for profiling, and avoids adding a spin lock to every hot path.
+static wifi_settings_profile_counter_t g_profile[WIFI_SETTINGS_PROFILE_NUM_COUNTERS];
+
+uint32_t wifi_settings_profile_start() {
+#if defined(PROFILE_DWT_CYCCNT)
+    if (!(m33_hw->dwt_ctrl & M33_DWT_CTRL_CYCCNTENA_BITS)) {
+        m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+        m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+    }
+    return m33_hw->dwt_cyccnt;
+#elif defined(PROFILE_SYSTICK)
+    if (!(systick_hw->csr & M0PLUS_SYST_CSR_ENABLE_BITS)) {
+        systick_hw->rvr = M0PLUS_SYST_RVR_BITS;
+        systick_hw->cvr = 0;
+        systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+    }
+    return systick_hw->cvr;
+#else
+    return time_us_32();
+#endif
+}
+
+static uint32_t get_elapsed(uint32_t start) {
+#if defined(PROFILE_DWT_CYCCNT)
+    return m33_hw->dwt_cyccnt - start;
+#elif defined(PROFILE_SYSTICK)
+    // SysTick counts down from rvr and wraps after 2^24 cycles (about 0.1s at 125MHz),
+    // so longer times can't be measured correctly.
+    const uint32_t now = systick_hw->cvr;
+    if (start >= now) {
+        return start - now;
+    }
+    return start + (systick_hw->rvr & M0PLUS_SYST_RVR_BITS) + 1 - now;
+#else
+    return time_us_32() - start;
+#endif
+}
+
+void wifi_settings_profile_stop(wifi_settings_profile_id_t id, uint32_t start) {
+    const uint32_t elapsed = get_elapsed(start);
+    wifi_settings_profile_counter_t* counter = &g_profile[id];
+    counter->count++;
+    counter->total_time += elapsed;
+    if (elapsed > counter->max_time) {
+        counter->max_time = elapsed;
+    }
+}
+#endif
+
+void wifi_settings_profile_get(wifi_settings_profile_id_t id, wifi_settings_profile_counter_t* counter) {
+#if WIFI_SETTINGS_PROFILE
+    if ((uint) id < (uint) WIFI_SETTINGS_PROFILE_NUM_COUNTERS) {
+        *counter = g_profile[id];
+        return;
+    }
+#endif
+    memset(counter, 0, sizeof(wifi_settings_profile_counter_t));
+}
+
+void wifi_settings_profile_reset() {
+#if WIFI_SETTINGS_PROFILE
+    memset(g_profile, 0, sizeof(g_profile));
+#endif
+}
+
+const char* wifi_settings_profile_get_name(wifi_settings_profile_id_t id) {
+    if ((uint) id < (uint) WIFI_SETTINGS_PROFILE_NUM_COUNTERS) {
+        return g_profile_names[id];
+    }
+    return "?";
+}
+
+const char* wifi_settings_profile_get_unit() {
+#if WIFI_SETTINGS_PROFILE
+    return PROFILE_UNIT;
+#else
+    return "";
+#endif
+}
+
+int wifi_settings_profile_get_text(char* text, int text_size) {
+    int index = 0;
+    if (text_size > 0) {
+        text[0] = '\0';
+    }
+#if WIFI_SETTINGS_PROFILE
+    for (int i = 0; (i < WIFI_SETTINGS_PROFILE_NUM_COUNTERS) && (index < text_size); i++) {
+        const wifi_settings_profile_counter_t* counter = &g_profile[i];
+        const int size = snprintf(&text[index], text_size - index,
+            "%s count=%u total=%llu max=%u\n",
+            g_profile_names[i], (uint) counter->count,
+            (unsigned long long) counter->total_time, (uint) counter->max_time);
+        if (size < 0) {
+            break;
+        }
+        index += size;
+    }
+#endif
+    return index;
+}
@@ -7,18 +7,20 @@
  */
 
 
+#include "wifi_settings/wifi_settings_configuration.h"
 #include "wifi_settings/wifi_settings_remote.h"
 #include "wifi_settings/wifi_settings_remote_handlers.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
+#include "wifi_settings/wifi_settings_connect.h"
+#include "wifi_settings/wifi_settings_sha256.h"
+#include "wifi_settings/wifi_settings_profile.h"
 
 #include "pico/rand.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "pico/binary_info.h"
 
-#include "mbedtls/sha256.h"
 #include "mbedtls/aes.h"
-#include "mbedtls/version.h"
 #include "lwip/tcp.h"
 #include "lwip/udp.h"
 
@@ -33,6 +35,19 @@
 #ifdef ENABLE_REMOTE_MEMORY_ACCESS
 #include "wifi_settings/wifi_settings_remote_memory_access_handlers.h"
 #endif
+#if WIFI_SETTINGS_TASK
+#if !PICO_CYW43_ARCH_FREERTOS
+#error "WIFI_SETTINGS_TASK requires pico_cyw43_arch_lwip_sys_freertos"
+#endif
+#include "FreeRTOS.h"
+#include "task.h"
+#endif
+// Handlers run outside of the lwIP receive callback, either in the wifi_settings task
+// or in an async_context worker (see defer_handler)
+#define DEFERRED_HANDLERS (WIFI_SETTINGS_TASK || WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS)
+#if (DEFERRED_HANDLERS && !WIFI_SETTINGS_TASK) || defined(ENABLE_REMOTE_MEMORY_ACCESS)
+#include "pico/async_context.h"
+#endif
 #ifndef MBEDTLS_AES_C
 #error "MBEDTLS_AES_C must be enabled"
 #endif
@@ -49,17 +64,24 @@
 #error "WIFI_SETTINGS_VERSION_STRING must be set"
 #endif
 
-#if MBEDTLS_VERSION_MAJOR < 3
-// These names were changed in mbedlts 3.x.x
-#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
-#define mbedtls_sha256_update mbedtls_sha256_update_ret
-#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
-#endif
-
 
-#define PORT_NUMBER                 1404
 #define RESPONDER_REQUEST_MAGIC     "PWS?"
 #define RESPONDER_REPLY_MAGIC       "PWS:"
+#if WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS
+#define RESPONDER_REPLY_MAX_SIZE    256
+#else
+#define RESPONDER_REPLY_MAX_SIZE    sizeof(responder_packet_t)
+#endif
+#define UDP_RPC_REQUEST_MAGIC       "PWR?"
+#define UDP_RPC_REPLY_MAGIC         "PWR:"
+#define UDP_RPC_REJECT_MAGIC        "PWR!"
+#define UDP_RPC_MAGIC_SIZE          4
+#define UDP_RPC_NONCE_SIZE          16      // epoch (4 bytes), counter (8 bytes), random (4 bytes)
+#define UDP_RPC_HEADER_SIZE         (UDP_RPC_MAGIC_SIZE + UDP_RPC_NONCE_SIZE)
+#define UDP_RPC_BODY_HEADER_SIZE    8       // msg_type, 3 bytes reserved, parameter or result
+#define UDP_RPC_MAC_SIZE            16
+#define UDP_RPC_MAX_DATA_SIZE       (WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE - UDP_RPC_HEADER_SIZE \
+                                    - UDP_RPC_BODY_HEADER_SIZE - UDP_RPC_MAC_SIZE)
 #define APPEND_CODE_SIZE            2
 #define CHALLENGE_SIZE              15      // max is AES_BLOCK_SIZE - 1
 #define AUTHENTICATION_SIZE         15      // max is AES_BLOCK_SIZE - 1
@@ -69,6 +91,35 @@
 #define AES_KEY_SIZE                32      // 256 bits (AES-256)
 #define DATA_HASH_SIZE              7
 #define PROTOCOL_VERSION            1
+#define PROTOCOL_VERSION_CTR        2       // AES-CTR with HMAC data hashes, selected by the client
+
+// Output blocks are generated into a buffer which is passed to tcp_write when full,
+// so that there are few tcp_write calls (lwIP also combines these into full segments)
+#define OUTPUT_BUFFER_SIZE          (AES_BLOCK_SIZE * 16)
+#define GREETING_SIZE               (AES_BLOCK_SIZE * 6)
+#define GREETING_PIPELINING         'p'     // byte 3 of the greeting (previously '\r')
+#define GREETING_TICKETS            'r'     // byte 3 of the greeting: pipelining and tickets
+#define GREETING_CAP_CTR            0x01    // set in the last byte of the greeting if PROTOCOL_VERSION_CTR is supported
+#define ACKNOWLEDGE_TICKET          'T'     // byte 1 of the acknowledgment: ticket requested
+                                            // byte 2 of the acknowledgment: protocol version
+// Streaming handlers receive the request payload in chunks of up to this size
+#define STREAM_CHUNK_SIZE           (AES_BLOCK_SIZE * 16)
+// The largest streaming request payload: padding it to a whole number of blocks must not overflow
+#define MAX_STREAM_DATA_SIZE        (UINT32_MAX - (AES_BLOCK_SIZE - 1))
+#define MAX_UPDATE_SECRET_SIZE      128
+#define SERVER_POLL_INTERVAL        1       // tcp_poll interval (0.5 seconds)
+#define TELEMETRY_MIN_INTERVAL_MS   500     // telemetry frames are sent from server_poll
+// server_poll is needed for the handshake timeout and for telemetry
+#define SERVER_POLL                 ((WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS > 0) \
+                                    || (WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS > 0) \
+                                    || WIFI_SETTINGS_REMOTE_TELEMETRY)
+
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+// With software SHA-256, the HMAC states after absorbing the ipad and opad blocks
+// are computed once for each secret, and then copied for each HMAC. This isn't
+// possible with hardware SHA-256 (Pico 2), which can only hold one state.
+#define HMAC_PRECOMPUTED_STATES     1
+#endif
 
 typedef enum msg_type_t {
     ID_GREETING =           70, // s->c
@@ -86,23 +137,37 @@ typedef enum msg_type_t {
     ID_NO_SECRET_ERROR =    82, // s->c
     ID_CORRUPT_ERROR =      83, // s->c
     ID_UNKNOWN_ERROR =      84, // s->c
+    ID_BUSY_ERROR =         85, // s->c
+    ID_RESUME =             86, // s<-c
+    ID_RESUMED =            87, // s->c
+    ID_TICKET =             88, // s->c
     // Message handlers (callbacks)
-    // First 8 are reserved for wifi_settings_remote
+    // First 18 are reserved for wifi_settings_remote
+    ID_AB_OTA_TARGET_HANDLER =  110,
+    ID_EVENT_LOG_HANDLER =      111,
+    ID_TELEMETRY_HANDLER =      112,
+    ID_MULTICAST_OTA_HANDLER =  113,
+    ID_PING_HANDLER =           114,
+    ID_PREPARE_FLASH_HANDLER =  115,
+    ID_AB_OTA_HANDLER =         116,
+    ID_HASH_FLASH_HANDLER =     117,
+    ID_READ_RANGES_HANDLER =    118,
+    ID_STATS_HANDLER =          119,
     ID_PICO_INFO_HANDLER =      120,
     ID_UPDATE_HANDLER =         121,
     ID_READ_HANDLER =           122,
-    ID_RESERVED_3 =             123,
+    ID_LINK_QUALITY_HANDLER =   123,
     ID_UPDATE_REBOOT_HANDLER =  124,
     ID_WRITE_FLASH_HANDLER =    125,
-    ID_RESERVED_6 =             126,
+    ID_SET_KEY_HANDLER =        126,
     ID_OTA_FIRMWARE_UPDATE_HANDLER = 127,
     // The rest are available for reuse
     ID_USER_HANDLER_0 =         ID_FIRST_USER_HANDLER,
     ID_USER_HANDLER_N =         ID_LAST_USER_HANDLER,
 } msg_type_t;
 
-#define ID_FIRST_HANDLER    ID_PICO_INFO_HANDLER
-#define NUM_HANDLERS        (ID_LAST_USER_HANDLER + 1 - ID_FIRST_HANDLER)
+#define ID_FIRST_HANDLER    ID_AB_OTA_TARGET_HANDLER
+#define NUM_HANDLERS        (ID_FIRST_USER_HANDLER + WIFI_SETTINGS_REMOTE_USER_HANDLERS - ID_FIRST_HANDLER)
 
 typedef enum receive_state_t {
     // Authentication states (unencrypted)
@@ -115,6 +180,9 @@ typedef enum receive_state_t {
     SEND_BAD_MSG_ERROR,
     SEND_AUTH_ERROR,
     SEND_NO_SECRET_ERROR,
+    SEND_CLEAR_BUSY_ERROR,
+    SEND_RESUMED,
+    SEND_TICKET,
     // Encrypted communication states
     EXPECT_ENC_REQUEST_HEADER,
     EXPECT_ENC_REQUEST_PAYLOAD,
@@ -123,9 +191,14 @@ typedef enum receive_state_t {
     SEND_CORRUPT_ERROR,
     SEND_BAD_PARAM_ERROR,
     SEND_BAD_HANDLER_ERROR,
+    SEND_BUSY_ERROR,
     SEND_ENC_REPLY_HEADER_WITH_CALLBACK2,
+    // Special state when callback1 is pending or running (see defer_handler)
+    EXECUTE_CALLBACK1,
     // Special state when waiting to finish sending
     EXECUTE_CALLBACK2,
+    // Special state when subscribed to telemetry (see server_poll)
+    WAIT_TELEMETRY,
     // Disconnected state
     DISCONNECT,
 } receive_state_t;
@@ -139,83 +212,306 @@ typedef struct enc_message_header_t {
 } enc_message_header_t;
 
 typedef struct session_t {
-    uint8_t                     data[MAX_DATA_SIZE];
+    uint8_t*                    data;           // MAX_DATA_SIZE bytes, or NULL if not attached
+    const uint8_t*              reply_source;   // reply data, if not in data (see handler_output_t)
+    union {
+        uint8_t                 greeting[GREETING_SIZE];        // before authentication
+        uint8_t                 stream_chunk[STREAM_CHUNK_SIZE];// after authentication
+    };
     uint8_t                     client_challenge[CHALLENGE_SIZE];
     uint8_t                     server_challenge[CHALLENGE_SIZE];
-    uint8_t                     output_block[AES_BLOCK_SIZE];
-    bool                        output_block_ready;
+    uint8_t                     output_buffer[OUTPUT_BUFFER_SIZE];
+    uint16_t                    output_size;    // bytes generated but not yet written
     uint8_t                     input_block[AES_BLOCK_SIZE];
     uint8_t                     input_block_offset;
-    uint8_t                     decrypt_iv[AES_BLOCK_SIZE];
-    uint8_t                     encrypt_iv[AES_BLOCK_SIZE];
+    struct pbuf*                input_pbuf;     // received data which has not been processed
+    uint8_t                     decrypt_iv[AES_BLOCK_SIZE];     // counter for PROTOCOL_VERSION_CTR
+    uint8_t                     encrypt_iv[AES_BLOCK_SIZE];     // counter for PROTOCOL_VERSION_CTR
     mbedtls_aes_context         decrypt;
     mbedtls_aes_context         encrypt;
+    uint8_t                     request_mac_key[HMAC_DIGEST_SIZE];  // PROTOCOL_VERSION_CTR only
+    uint8_t                     reply_mac_key[HMAC_DIGEST_SIZE];    // PROTOCOL_VERSION_CTR only
+    uint8_t                     protocol_version;
     enc_message_header_t        reply_header;
     enc_message_header_t        request_header;
     receive_state_t             state;
+    bool                        authenticated;  // the handshake has finished
+    uint32_t                    accept_time_ms; // for WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS
+    uint32_t                    activity_time_ms;   // for WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS
+    ip_addr_t                   remote_address; // for WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES
     uint32_t                    data_index;
+    bool                        streaming;      // request is for a streaming handler
+    uint16_t                    stream_chunk_size;
+    int32_t                     stream_begin_result;
+    wifi_settings_sha256_context_t stream_hash;
+    uint32_t                    telemetry_interval_ms;  // 0 if not subscribed to telemetry
+    uint32_t                    telemetry_next_ms;      // when the next telemetry frame is due
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    bool                        resume_pending; // resumed with a ticket, client not yet verified
+    uint8_t                     resume_ticket_id[CHALLENGE_SIZE];   // consumed by confirm_ticket
+    uint8_t                     next_ticket_id[CHALLENGE_SIZE];     // added by confirm_ticket
+#endif
+#if DEFERRED_HANDLERS
+    struct tcp_pcb*             client_pcb;     // NULL after the connection is closed
+    bool                        handler_busy;   // a handler is pending or running (see defer_handler)
+    bool                        closed;         // free the session when the handler is done
+    struct session_t*           next_deferred;  // next session waiting for a handler
+#endif
 } session_t;
 
+// Results from a handler, other than the result code: the handler is given a pointer
+// to data_size, and wifi_settings_remote_set_reply_source uses it to find source
+typedef struct handler_output_t {
+    uint32_t                    data_size;      // must be the first field
+    const uint8_t*              source;         // reply data, if not in the data buffer
+} handler_output_t;
+
+// A session resumption ticket: the ticket ID is sent to the client, which can
+// compute the resume challenge for itself. When the ticket is used, these
+// replace the client and server challenges from the full handshake.
+typedef struct ticket_t {
+    uint8_t                     id[CHALLENGE_SIZE];
+    uint8_t                     resume_challenge[CHALLENGE_SIZE];
+    uint8_t                     protocol_version;
+    bool                        valid;
+    uint32_t                    expiry_time_ms;
+} ticket_t;
+
+// Failed handshakes from a source address: new connections from the
+// address are rejected until backoff_end_ms
+typedef struct backoff_source_t {
+    ip_addr_t                   address;
+    uint32_t                    backoff_end_ms;
+    uint8_t                     num_failures;
+    bool                        valid;
+} backoff_source_t;
+
 typedef struct handler_callback_arg_t {
     handler_callback1_t callback1;
     handler_callback2_t callback2;
+    handler_stream_begin_t stream_begin;
+    handler_stream_data_t stream_data;
+    handler_stream_end_t stream_end;
     void* arg;
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    bool udp_rpc;               // may be called by a single UDP datagram
+#endif
 } handler_callback_arg_t;
 
+#if WIFI_SETTINGS_REMOTE_RESPONDER
 typedef struct responder_packet_t {
     uint8_t magic[4];
     uint8_t board_id_hex[(BOARD_ID_SIZE * 2) + 1];
 } responder_packet_t;
+#endif
+
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+// Replay protection for single-datagram requests. Each request has a nonce containing
+// the epoch (chosen randomly at boot), a counter chosen by the client, and random bytes.
+// A request is accepted if it has the current epoch, if its counter is at least
+// min_counter, and if it is not one of the recent requests. When a request is removed
+// from the recent requests, min_counter is moved past its counter, so a request can
+// never be accepted twice.
+typedef struct udp_rpc_replay_t {
+    uint32_t                    epoch;
+    uint64_t                    min_counter;
+    uint8_t                     recent[WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE]
+                                      [UDP_RPC_NONCE_SIZE - 4];   // counter and random bytes
+    uint                        recent_index;
+} udp_rpc_replay_t;
+#endif
 
 
 static handler_callback_arg_t g_handler_table[NUM_HANDLERS];
 static struct tcp_pcb* g_remote_service_pcb = NULL;
+#if WIFI_SETTINGS_REMOTE_RESPONDER
 static struct udp_pcb* g_responder_service_pcb = NULL;
+#endif
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+static udp_rpc_replay_t g_udp_rpc_replay;
+// A request is decrypted in place, then the handler writes the reply data in place. The
+// extra block is needed because crypt_ctr_blocks always processes whole blocks.
+static uint8_t g_udp_rpc_buffer[WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE + AES_BLOCK_SIZE];
+#endif
+static bool g_remote_initialised = false;
+#if WIFI_SETTINGS_REMOTE_LAZY_INIT
+static bool g_remote_start_pending = false;
+#endif
 static uint8_t g_secret_hashed[HMAC_DIGEST_SIZE];
 static bool g_secret_valid;
+#ifdef HMAC_PRECOMPUTED_STATES
+static wifi_settings_sha256_context_t g_hmac_inner_state;
+static wifi_settings_sha256_context_t g_hmac_outer_state;
+static bool g_hmac_states_valid;
+#endif
+static wifi_settings_remote_session_stats_t g_session_stats;
+static wifi_settings_remote_handler_stats_t g_handler_stats[NUM_HANDLERS];
+#if WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE > 0
+static session_t g_session_pool[WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE];
+static bool g_session_pool_used[WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE];
+#endif
+#if WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE > 0
+static uint8_t g_data_buffer_pool[WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE][MAX_DATA_SIZE];
+static bool g_data_buffer_pool_used[WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE];
+#endif
+#if DEFERRED_HANDLERS
+// Sessions waiting for a handler to run, oldest first (protected by the lwIP lock)
+static session_t* g_deferred_first = NULL;
+static session_t* g_deferred_last = NULL;
+// Deferred handlers which are waiting or running, plus Flash preparation in
+// the wifi_settings task: see wifi_settings_remote_is_task_busy
+static uint g_task_busy_count = 0;
+#endif
+#if WIFI_SETTINGS_TASK
+static TaskHandle_t g_task = NULL;
+#elif DEFERRED_HANDLERS
+static async_when_pending_worker_t g_handler_worker;
+#endif
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+// Erases Flash in the background for ID_PREPARE_FLASH_HANDLER
+// (in the wifi_settings task, if there is one, this is done between handlers)
+static async_at_time_worker_t g_prepare_flash_worker;
+static bool g_prepare_flash_scheduled = false;
+#endif
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+static ticket_t g_tickets[WIFI_SETTINGS_REMOTE_TICKET_COUNT];
+#endif
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+static backoff_source_t g_backoff_sources[WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES];
+#endif
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+// Hardware SHA-256 (Pico 2) can only compute one hash at a time, and a streaming
+// request holds it until the end of the request, as the state of the hash can't be
+// saved between chunks. Meanwhile, no other session can use it: new connections
+// are sent ID_BUSY_ERROR instead of the greeting, and UDP RPC requests are ignored.
+static bool g_stream_hash_in_use = false;
+#endif
 
 
-static void generate_authentication(
-        session_t* session,
+static void add_crypto_time(uint64_t start_us) {
+    // Called in the lwIP context after encryption, decryption or hashing
+    g_session_stats.crypto_time_us += time_us_64() - start_us;
+}
+
+static void get_hmac_pad(uint8_t* k_pad, const uint8_t* key, uint8_t pad_byte) {
+    // HMAC SHA-256 -> key is HMAC_DIGEST_SIZE bytes, e.g. the hashed secret
+    uint i;
+    for (i = 0; i < HMAC_DIGEST_SIZE; i++) {
+        k_pad[i] = key[i] ^ pad_byte;
+    }
+    for (; i < HMAC_BLOCK_SIZE; i++) {
+        k_pad[i] = pad_byte;
+    }
+}
+
+#ifdef HMAC_PRECOMPUTED_STATES
+static void discard_hmac_states() {
+    if (g_hmac_states_valid) {
+        wifi_settings_sha256_free(&g_hmac_inner_state);
+        wifi_settings_sha256_free(&g_hmac_outer_state);
+        g_hmac_states_valid = false;
+    }
+}
+
+static void update_hmac_states() {
+    // Absorb the ipad and opad blocks for the current secret
+    discard_hmac_states();
+    if (!g_secret_valid) {
+        return;
+    }
+    uint8_t k_pad[HMAC_BLOCK_SIZE];
+    wifi_settings_sha256_init(&g_hmac_inner_state);
+    wifi_settings_sha256_init(&g_hmac_outer_state);
+    get_hmac_pad(k_pad, g_secret_hashed, 0x36);
+    if ((0 != wifi_settings_sha256_starts(&g_hmac_inner_state))
+    || (0 != wifi_settings_sha256_update(&g_hmac_inner_state, k_pad, HMAC_BLOCK_SIZE))) {
+        panic("update_hmac_states sha256 (1) failed");
+    }
+    get_hmac_pad(k_pad, g_secret_hashed, 0x5c);
+    if ((0 != wifi_settings_sha256_starts(&g_hmac_outer_state))
+    || (0 != wifi_settings_sha256_update(&g_hmac_outer_state, k_pad, HMAC_BLOCK_SIZE))) {
+        panic("update_hmac_states sha256 (2) failed");
+    }
+    memset(k_pad, 0, HMAC_BLOCK_SIZE);
+    g_hmac_states_valid = true;
+}
+#endif
+
+static void generate_secret_hmac(
+        const uint8_t* data1,
+        const uint size1,
+        const uint8_t* data2,
+        const uint size2,
         const char* append_code,
         uint8_t* output,
         const uint output_size) {
-    // HMAC SHA-256 -> key is the hashed secret
-    uint8_t k_pad[HMAC_BLOCK_SIZE];
+    // HMAC of data1, data2 and append_code, keyed with the hashed secret
+    const uint64_t start_us = time_us_64();
+    WIFI_SETTINGS_PROFILE_START(profile_start);
     uint8_t digest_data[HMAC_DIGEST_SIZE];
-    uint i;
+    wifi_settings_sha256_context_t ctx;
+#if defined(HMAC_PRECOMPUTED_STATES) && WIFI_SETTINGS_REMOTE_LAZY_INIT
+    if (!g_hmac_states_valid) {
+        // First use since the secret was loaded
+        update_hmac_states();
+    }
+#endif
+    wifi_settings_sha256_init(&ctx);
 
-    for (i = 0; i < HMAC_DIGEST_SIZE; i++) {
-        k_pad[i] = g_secret_hashed[i] ^ 0x36;
+#ifdef HMAC_PRECOMPUTED_STATES
+    // Continue from the state after the ipad block
+    wifi_settings_sha256_clone(&ctx, &g_hmac_inner_state);
+#else
+    uint8_t k_pad[HMAC_BLOCK_SIZE];
+    get_hmac_pad(k_pad, g_secret_hashed, 0x36);
+    if ((0 != wifi_settings_sha256_starts(&ctx))
+    || (0 != wifi_settings_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))) {
+        panic("generate_secret_hmac sha256 (1) failed");
     }
-    for (; i < HMAC_BLOCK_SIZE; i++) {
-        k_pad[i] = 0x36;
-    }
-    mbedtls_sha256_context ctx;
-    mbedtls_sha256_init(&ctx);
-    if ((0 != mbedtls_sha256_starts(&ctx, 0))
-    || (0 != mbedtls_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))
-    || (0 != mbedtls_sha256_update(&ctx, session->client_challenge, CHALLENGE_SIZE))
-    || (0 != mbedtls_sha256_update(&ctx, session->server_challenge, CHALLENGE_SIZE))
-    || (0 != mbedtls_sha256_update(&ctx, (const uint8_t*) append_code, APPEND_CODE_SIZE))
-    || (0 != mbedtls_sha256_finish(&ctx, digest_data))) {
-        panic("generate_authentication sha256 (1) failed");
-    }
-    for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
-        k_pad[i] ^= 0x5c ^ 0x36;
-    }
-    if ((0 != mbedtls_sha256_starts(&ctx, 0))
-    || (0 != mbedtls_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))
-    || (0 != mbedtls_sha256_update(&ctx, digest_data, HMAC_DIGEST_SIZE))
-    || (0 != mbedtls_sha256_finish(&ctx, digest_data))) {
-        panic("generate_authentication sha256 (2) failed");
-    }
-    mbedtls_sha256_free(&ctx);
+#endif
+    if ((0 != wifi_settings_sha256_update(&ctx, data1, size1))
+    || (0 != wifi_settings_sha256_update(&ctx, data2, size2))
+    || (0 != wifi_settings_sha256_update(&ctx, (const uint8_t*) append_code, APPEND_CODE_SIZE))
+    || (0 != wifi_settings_sha256_finish(&ctx, digest_data))) {
+        panic("generate_secret_hmac sha256 (1) failed");
+    }
+#ifdef HMAC_PRECOMPUTED_STATES
+    // Continue from the state after the opad block
+    wifi_settings_sha256_clone(&ctx, &g_hmac_outer_state);
+#else
+    get_hmac_pad(k_pad, g_secret_hashed, 0x5c);
+    if ((0 != wifi_settings_sha256_starts(&ctx))
+    || (0 != wifi_settings_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))) {
+        panic("generate_secret_hmac sha256 (2) failed");
+    }
+#endif
+    if ((0 != wifi_settings_sha256_update(&ctx, digest_data, HMAC_DIGEST_SIZE))
+    || (0 != wifi_settings_sha256_finish(&ctx, digest_data))) {
+        panic("generate_secret_hmac sha256 (2) failed");
+    }
+    wifi_settings_sha256_free(&ctx);
     memcpy(output, digest_data, output_size);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_HMAC, profile_start);
+    add_crypto_time(start_us);
+}
+
+static void generate_authentication(
+        session_t* session,
+        const char* append_code,
+        uint8_t* output,
+        const uint output_size) {
+    generate_secret_hmac(session->client_challenge, CHALLENGE_SIZE,
+                         session->server_challenge, CHALLENGE_SIZE,
+                         append_code, output, output_size);
+}
+
+static bool is_ctr_mode(const session_t* session) {
+    return session->protocol_version == PROTOCOL_VERSION_CTR;
 }
 
 static void generate_keys(session_t* session) {
 
+    WIFI_SETTINGS_PROFILE_START(profile_start);
     uint8_t raw_key[AES_KEY_SIZE];
 
     generate_authentication(session, "SK", raw_key, AES_KEY_SIZE);
@@ -229,58 +525,388 @@ static void generate_keys(session_t* session) {
     generate_authentication(session, "CK", raw_key, AES_KEY_SIZE);
     memset(session->decrypt_iv, 0, AES_BLOCK_SIZE);
     mbedtls_aes_init(&session->decrypt);
-    if (0 != mbedtls_aes_setkey_dec(&session->decrypt,
-                raw_key, AES_KEY_SIZE * 8)) {
+    // CTR mode decrypts by encrypting the counter, so the decryption key schedule isn't needed
+    if (0 != (is_ctr_mode(session) ?
+                mbedtls_aes_setkey_enc(&session->decrypt, raw_key, AES_KEY_SIZE * 8) :
+                mbedtls_aes_setkey_dec(&session->decrypt, raw_key, AES_KEY_SIZE * 8))) {
         panic("generate_keys aes (2) failed");
     }
 
+    if (is_ctr_mode(session)) {
+        // Data hashes are HMACs using these keys, as CTR mode alone doesn't
+        // stop an attacker from changing the data and the (encrypted) hash
+        generate_authentication(session, "SM", session->reply_mac_key, HMAC_DIGEST_SIZE);
+        generate_authentication(session, "CM", session->request_mac_key, HMAC_DIGEST_SIZE);
+    }
+
     memset(raw_key, 0, sizeof(AES_KEY_SIZE));
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_KEY_SETUP, profile_start);
+}
+
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+static bool is_ticket_expired(const ticket_t* ticket, uint32_t now_ms) {
+    // This comparison allows for the time wrapping
+    return ((int32_t) (now_ms - ticket->expiry_time_ms)) >= 0;
+}
+
+static ticket_t* find_ticket(const uint8_t* ticket_id) {
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_TICKET_COUNT; i++) {
+        ticket_t* ticket = &g_tickets[i];
+        if (ticket->valid && (memcmp(ticket->id, ticket_id, CHALLENGE_SIZE) == 0)) {
+            return ticket;
+        }
+    }
+    return NULL;
+}
+
+static void add_ticket(session_t* session, const uint8_t* ticket_id) {
+    // Add a ticket for resuming a session based on this one, replacing
+    // an unused or expired ticket, or the one which would expire first
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    ticket_t* ticket = &g_tickets[0];
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_TICKET_COUNT; i++) {
+        if ((!g_tickets[i].valid) || is_ticket_expired(&g_tickets[i], now_ms)) {
+            ticket = &g_tickets[i];
+            break;
+        }
+        if (((int32_t) (g_tickets[i].expiry_time_ms - ticket->expiry_time_ms)) < 0) {
+            ticket = &g_tickets[i];
+        }
+    }
+    memcpy(ticket->id, ticket_id, CHALLENGE_SIZE);
+    generate_authentication(session, "RT", ticket->resume_challenge, CHALLENGE_SIZE);
+    ticket->protocol_version = session->protocol_version;
+    ticket->expiry_time_ms = now_ms + WIFI_SETTINGS_REMOTE_TICKET_LIFETIME_MS;
+    ticket->valid = true;
+}
+#endif
+
+static void issue_ticket(session_t* session, uint8_t* ticket_id) {
+    // Issue a ticket for resuming a session based on this one. If this session
+    // was resumed, the ticket is only added when the client has been verified
+    // (see confirm_ticket), so that an attacker can't replace the stored tickets.
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    rng_128_t rng;
+    get_rand_128(&rng);
+    memcpy(ticket_id, &rng, CHALLENGE_SIZE);
+    if (session->resume_pending) {
+        memcpy(session->next_ticket_id, ticket_id, CHALLENGE_SIZE);
+    } else {
+        add_ticket(session, ticket_id);
+    }
+#else
+    memset(ticket_id, 0, CHALLENGE_SIZE);
+#endif
+}
+
+static bool use_ticket(session_t* session, const uint8_t* ticket_id) {
+    // If the ticket is valid, set the session challenges from it, and return true.
+    // The ticket ID is sent in the clear, so the ticket is not consumed until the
+    // client has shown that it has the session keys (see confirm_ticket).
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    ticket_t* ticket = find_ticket(ticket_id);
+    if (!ticket) {
+        return false;
+    }
+    if (is_ticket_expired(ticket, to_ms_since_boot(get_absolute_time()))) {
+        memset(ticket, 0, sizeof(ticket_t));
+        return false;
+    }
+    memcpy(session->client_challenge, ticket->resume_challenge, CHALLENGE_SIZE);
+    memcpy(session->server_challenge, ticket->id, CHALLENGE_SIZE);
+    memcpy(session->resume_ticket_id, ticket->id, CHALLENGE_SIZE);
+    session->protocol_version = ticket->protocol_version;
+    session->resume_pending = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static bool confirm_ticket(session_t* session) {
+    // Called when the first request of a resumed session has passed the data hash
+    // check. Each ticket can only be used once, so this consumes the ticket and adds
+    // the new one. Returns false if the ticket was already consumed by another
+    // session, i.e. the resumed session is a replay.
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    if (!session->resume_pending) {
+        return true;
+    }
+    session->resume_pending = false;
+    ticket_t* ticket = find_ticket(session->resume_ticket_id);
+    if (!ticket) {
+        return false;
+    }
+    memset(ticket, 0, sizeof(ticket_t));
+    add_ticket(session, session->next_ticket_id);
+#else
+    (void) session;
+#endif
+    return true;
+}
+
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+static backoff_source_t* find_backoff_source(const ip_addr_t* address) {
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES; i++) {
+        backoff_source_t* source = &g_backoff_sources[i];
+        if (source->valid && ip_addr_cmp(&source->address, address)) {
+            return source;
+        }
+    }
+    return NULL;
+}
+#endif
+
+static bool is_backoff_source(const ip_addr_t* address) {
+    // Returns true if connections from this address are rejected because of failed handshakes
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+    const backoff_source_t* source = find_backoff_source(address);
+    if (source) {
+        const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+        // This comparison allows for the time wrapping
+        return ((int32_t) (now_ms - source->backoff_end_ms)) < 0;
+    }
+#endif
+    return false;
+}
+
+static void handshake_failed(session_t* session) {
+    // Reject new connections from the client's address for a time, which doubles
+    // after each failure. If the address isn't known, it replaces an unused entry,
+    // or the one whose backoff ends first.
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    backoff_source_t* source = find_backoff_source(&session->remote_address);
+    if (!source) {
+        source = &g_backoff_sources[0];
+        for (uint i = 0; i < WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES; i++) {
+            if (!g_backoff_sources[i].valid) {
+                source = &g_backoff_sources[i];
+                break;
+            }
+            if (((int32_t) (g_backoff_sources[i].backoff_end_ms - source->backoff_end_ms)) < 0) {
+                source = &g_backoff_sources[i];
+            }
+        }
+        memset(source, 0, sizeof(backoff_source_t));
+        ip_addr_copy(source->address, session->remote_address);
+        source->valid = true;
+    }
+    uint32_t backoff_ms = WIFI_SETTINGS_REMOTE_BACKOFF_MS;
+    for (uint i = 0; (i < source->num_failures) && (backoff_ms < WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS); i++) {
+        backoff_ms *= 2;
+    }
+    if (backoff_ms > WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS) {
+        backoff_ms = WIFI_SETTINGS_REMOTE_MAX_BACKOFF_MS;
+    }
+    if (source->num_failures < UINT8_MAX) {
+        source->num_failures++;
+    }
+    source->backoff_end_ms = now_ms + backoff_ms;
+#endif
+}
+
+static void handshake_done(session_t* session) {
+    // The client is authenticated, so the session is no longer limited by
+    // WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES, and earlier failures from its address are forgotten
+    session->authenticated = true;
+    g_session_stats.num_handshakes--;
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+    backoff_source_t* source = find_backoff_source(&session->remote_address);
+    if (source) {
+        memset(source, 0, sizeof(backoff_source_t));
+    }
+#endif
+}
+
+// The next output block is generated at the end of the output buffer
+static uint8_t* get_output_block(session_t* session) {
+    return &session->output_buffer[session->output_size];
+}
+
+// Attach a data buffer to the session: this is only needed while an encrypted
+// request is received, handled and replied to, so that sessions that are
+// idle or not authenticated don't need one. The lwIP lock must be held.
+static bool attach_data_buffer(session_t* session) {
+    if (session->data) {
+        return true;
+    }
+#if WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE > 0
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE; i++) {
+        if (!g_data_buffer_pool_used[i]) {
+            g_data_buffer_pool_used[i] = true;
+            session->data = g_data_buffer_pool[i];
+            return true;
+        }
+    }
+    return false;
+#else
+    session->data = malloc(MAX_DATA_SIZE);
+    return session->data != NULL;
+#endif
+}
+
+static void release_data_buffer(session_t* session) {
+    if (!session->data) {
+        return;
+    }
+    // Clear the data, which may include secrets, before reuse
+    memset(session->data, 0, MAX_DATA_SIZE);
+#if WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE > 0
+    g_data_buffer_pool_used[(uint) ((session->data - g_data_buffer_pool[0]) / MAX_DATA_SIZE)] = false;
+#else
+    free(session->data);
+#endif
+    session->data = NULL;
+}
+
+// AES-CTR with a 128-bit big-endian counter, starting at zero for each direction (the keys
+// are unique to each session). This is built on mbedtls_aes_crypt_ecb so that it doesn't
+// need MBEDTLS_CIPHER_MODE_CTR. Unlike CBC, each block only depends on the counter, so
+// src and dest can be the same, and the blocks don't have to be passed to mbedtls one at a time.
+static void crypt_ctr_blocks(
+        mbedtls_aes_context* ctx,
+        uint8_t* counter,
+        const uint8_t* src,
+        uint8_t* dest,
+        uint size) {
+
+    uint8_t keystream[AES_BLOCK_SIZE];
+    for (uint offset = 0; offset < size; offset += AES_BLOCK_SIZE) {
+        if (0 != mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, counter, keystream)) {
+            panic("crypt_ctr_blocks failed");
+        }
+        for (uint i = AES_BLOCK_SIZE; i > 0; i--) {
+            counter[i - 1]++;
+            if (counter[i - 1] != 0) {
+                break;
+            }
+        }
+        for (uint i = 0; i < AES_BLOCK_SIZE; i++) {
+            dest[offset + i] = src[offset + i] ^ keystream[i];
+        }
+    }
 }
 
 static void encrypt_block(
         session_t* session,
         const uint8_t* src) {
-    uint8_t* dest = session->output_block;
+    const uint64_t start_us = time_us_64();
+    uint8_t* dest = get_output_block(session);
 
-    if (0 != mbedtls_aes_crypt_cbc(&session->encrypt, MBEDTLS_AES_ENCRYPT,
+    if (is_ctr_mode(session)) {
+        crypt_ctr_blocks(&session->encrypt, session->encrypt_iv, src, dest, AES_BLOCK_SIZE);
+    } else if (0 != mbedtls_aes_crypt_cbc(&session->encrypt, MBEDTLS_AES_ENCRYPT,
                           AES_BLOCK_SIZE, session->encrypt_iv,
                           src, dest)) {
         panic("encrypt_block failed");
     }
+    add_crypto_time(start_us);
+}
+
+static void decrypt_blocks(
+        session_t* session,
+        const uint8_t* src,
+        uint8_t* dest,
+        uint size) {
+
+    const uint64_t start_us = time_us_64();
+    if (is_ctr_mode(session)) {
+        crypt_ctr_blocks(&session->decrypt, session->decrypt_iv, src, dest, size);
+    } else if (0 != mbedtls_aes_crypt_cbc(&session->decrypt, MBEDTLS_AES_DECRYPT,
+                          size, session->decrypt_iv,
+                          src, dest)) {
+        panic("decrypt_block failed");
+    }
+    add_crypto_time(start_us);
 }
 
 static void decrypt_block(
         session_t* session,
         uint8_t* dest) {
-    const uint8_t* src = session->input_block;
+    decrypt_blocks(session, session->input_block, dest, AES_BLOCK_SIZE);
+}
 
-    if (0 != mbedtls_aes_crypt_cbc(&session->decrypt, MBEDTLS_AES_DECRYPT,
-                          AES_BLOCK_SIZE, session->decrypt_iv,
-                          src, dest)) {
-        panic("decrypt_block failed");
+// The data hash key for requests or replies, or NULL if the data hash is unkeyed (CBC mode)
+static const uint8_t* get_data_hash_key(const session_t* session, bool reply) {
+    if (!is_ctr_mode(session)) {
+        return NULL;
+    }
+    return reply ? session->reply_mac_key : session->request_mac_key;
+}
+
+static void start_enc_data_hash(
+        wifi_settings_sha256_context_t* ctx,
+        const uint8_t* key,
+        const enc_message_header_t* header) {
+
+    // Start the data hash with the header (except the hash itself). If there is a key,
+    // this is the inner hash of an HMAC, so it begins with the ipad block.
+    wifi_settings_sha256_init(ctx);
+    if (0 != wifi_settings_sha256_starts(ctx)) {
+        panic("start_enc_data_hash sha256 (1) failed");
+    }
+    if (key) {
+        uint8_t k_pad[HMAC_BLOCK_SIZE];
+        get_hmac_pad(k_pad, key, 0x36);
+        if (0 != wifi_settings_sha256_update(ctx, k_pad, HMAC_BLOCK_SIZE)) {
+            panic("start_enc_data_hash sha256 (2) failed");
+        }
+    }
+    if (0 != wifi_settings_sha256_update(ctx, (const uint8_t*) header,
+                    AES_BLOCK_SIZE - DATA_HASH_SIZE)) {
+        panic("start_enc_data_hash sha256 (3) failed");
+    }
+}
+
+static void finish_enc_data_hash(
+        wifi_settings_sha256_context_t* ctx,
+        const uint8_t* key,
+        uint8_t* data_hash) {
+
+    // Finish the data hash, adding the outer hash of the HMAC if there is a key
+    uint8_t full_data_hash[HMAC_DIGEST_SIZE];
+    if (0 != wifi_settings_sha256_finish(ctx, full_data_hash)) {
+        panic("finish_enc_data_hash sha256 (1) failed");
+    }
+    wifi_settings_sha256_free(ctx);
+    if (key) {
+        uint8_t k_pad[HMAC_BLOCK_SIZE];
+        get_hmac_pad(k_pad, key, 0x5c);
+        wifi_settings_sha256_init(ctx);
+        if ((0 != wifi_settings_sha256_starts(ctx))
+        || (0 != wifi_settings_sha256_update(ctx, k_pad, HMAC_BLOCK_SIZE))
+        || (0 != wifi_settings_sha256_update(ctx, full_data_hash, HMAC_DIGEST_SIZE))
+        || (0 != wifi_settings_sha256_finish(ctx, full_data_hash))) {
+            panic("finish_enc_data_hash sha256 (2) failed");
+        }
+        wifi_settings_sha256_free(ctx);
     }
+    memcpy(data_hash, full_data_hash, DATA_HASH_SIZE);
+}
+
+static const uint8_t* get_reply_data(const session_t* session) {
+    return session->reply_source ? session->reply_source : session->data;
 }
 
 static void generate_enc_data_hash(
         session_t* session,
         enc_message_header_t* header,
+        bool reply,
         uint8_t* data_hash) {
 
-    // Generate data hash for the reply header and payload (if any)
-    uint8_t full_data_hash[HMAC_DIGEST_SIZE];
-    mbedtls_sha256_context ctx;
-
-    mbedtls_sha256_init(&ctx);
-    if ((0 != mbedtls_sha256_starts(&ctx, 0))
-    || (0 != mbedtls_sha256_update(&ctx, (uint8_t*) header,
-                    AES_BLOCK_SIZE - DATA_HASH_SIZE))
-    || (0 != mbedtls_sha256_update(&ctx, session->data,
-                    header->data_size))
-    || (0 != mbedtls_sha256_finish(&ctx, full_data_hash))) {
+    // Generate data hash for the header and payload (if any)
+    const uint64_t start_us = time_us_64();
+    const uint8_t* key = get_data_hash_key(session, reply);
+    const uint8_t* data = reply ? get_reply_data(session) : session->data;
+    wifi_settings_sha256_context_t ctx;
+
+    start_enc_data_hash(&ctx, key, header);
+    if (0 != wifi_settings_sha256_update(&ctx, data, header->data_size)) {
         panic("generate_enc_data_hash sha256 failed");
     }
-    mbedtls_sha256_free(&ctx);
-    memcpy(data_hash, full_data_hash, DATA_HASH_SIZE);
+    finish_enc_data_hash(&ctx, key, data_hash);
+    add_crypto_time(start_us);
 }
 
 static void generate_enc_header_for_error(
@@ -292,7 +918,7 @@ static void generate_enc_header_for_error(
     session->reply_header.msg_type = msg_type;
 
     // Add data hash
-    generate_enc_data_hash(session, &session->reply_header, session->reply_header.data_hash);
+    generate_enc_data_hash(session, &session->reply_header, true, session->reply_header.data_hash);
 
     // Encrypt
     encrypt_block(session, (const uint8_t*) &session->reply_header);
@@ -304,18 +930,24 @@ static void generate_clear_header_for_error(
         msg_type_t msg_type) {
 
     // Generate an unencrypted reply header containing the error msg_type
-    uint8_t* block = session->output_block;
+    uint8_t* block = get_output_block(session);
     memset(block, 0, AES_BLOCK_SIZE);
     block[0] = msg_type;
     session->state = DISCONNECT;
 }
 
+// The state after a reply has been sent: wait for the next request, unless
+// the session is subscribed to telemetry, in which case no more requests are accepted
+static receive_state_t get_idle_state(const session_t* session) {
+    return session->telemetry_interval_ms ? WAIT_TELEMETRY : EXPECT_ENC_REQUEST_HEADER;
+}
+
 static bool generate_output_block(session_t* session) {
-    uint8_t* block = session->output_block;
+    uint8_t* block = get_output_block(session);
     switch (session->state) {
         case SEND_GREETING:
             // First message, server to client. Say hello.
-            memcpy(block, &session->data[session->data_index], AES_BLOCK_SIZE);
+            memcpy(block, &session->greeting[session->data_index], AES_BLOCK_SIZE);
             session->data_index += AES_BLOCK_SIZE;
             if (session->data_index >= session->reply_header.data_size) {
                 session->state = EXPECT_REQUEST;
@@ -359,6 +991,26 @@ static bool generate_output_block(session_t* session) {
             // Report 'no secret' error to the client.
             generate_clear_header_for_error(session, ID_NO_SECRET_ERROR);
             return true;
+        case SEND_CLEAR_BUSY_ERROR:
+            // Report that the session can't start yet (sent instead of the greeting).
+            generate_clear_header_for_error(session, ID_BUSY_ERROR);
+            return true;
+        case SEND_RESUMED:
+            // Server accepts a ticket instead of the third to sixth messages.
+            // Server sends the server authentication, based on the challenges in the ticket.
+            block[0] = ID_RESUMED;
+            generate_authentication(session, "SA", &block[1], AUTHENTICATION_SIZE);
+            generate_keys(session);
+            // A new ticket is sent, as the old one can't be used again
+            // once the first request has been verified
+            session->state = SEND_TICKET;
+            return true;
+        case SEND_TICKET:
+            // Server sends a ticket that the client can use to resume the session later.
+            block[0] = ID_TICKET;
+            issue_ticket(session, &block[1]);
+            session->state = EXPECT_ENC_REQUEST_HEADER;
+            return true;
         case SEND_CORRUPT_ERROR:
             // Encrypted stage. Report corrupt encrypted data error to the client.
             generate_enc_header_for_error(session, ID_CORRUPT_ERROR);
@@ -371,6 +1023,10 @@ static bool generate_output_block(session_t* session) {
             // Encrypted stage. Report bad handler error to the client.
             generate_enc_header_for_error(session, ID_BAD_HANDLER_ERROR);
             return true;
+        case SEND_BUSY_ERROR:
+            // Encrypted stage. Report that no data buffer is available.
+            generate_enc_header_for_error(session, ID_BUSY_ERROR);
+            return true;
         case EXPECT_ENC_REQUEST_HEADER:
             // Encrypted stage. Awaiting request from the client.
             return false;
@@ -382,18 +1038,33 @@ static bool generate_output_block(session_t* session) {
             encrypt_block(session, (const uint8_t*) &session->reply_header);
             if (session->reply_header.data_size == 0) {
                 // Header only - no payload
-                session->state = EXPECT_ENC_REQUEST_HEADER;
+                session->state = get_idle_state(session);
+                release_data_buffer(session);
             } else {
                 session->state = SEND_ENC_REPLY_PAYLOAD;
             }
             return true;
         case SEND_ENC_REPLY_PAYLOAD:
             // Encrypted stage. Send payload data to the client.
-            encrypt_block(session, &session->data[session->data_index]);
+            {
+                const uint8_t* src = &get_reply_data(session)[session->data_index];
+                const uint32_t remaining = session->reply_header.data_size - session->data_index;
+                if (session->reply_source && (remaining < AES_BLOCK_SIZE)) {
+                    // Don't read beyond the end of the reply source: pad the final block
+                    uint8_t final_block[AES_BLOCK_SIZE];
+                    memset(final_block, 0, AES_BLOCK_SIZE);
+                    memcpy(final_block, src, remaining);
+                    encrypt_block(session, final_block);
+                } else {
+                    encrypt_block(session, src);
+                }
+            }
             session->data_index += AES_BLOCK_SIZE;
             if (session->data_index >= session->reply_header.data_size) {
                 // Finished
-                session->state = EXPECT_ENC_REQUEST_HEADER;
+                session->state = get_idle_state(session);
+                session->reply_source = NULL;
+                release_data_buffer(session);
             }
             return true;
         case SEND_ENC_REPLY_HEADER_WITH_CALLBACK2:
@@ -401,57 +1072,188 @@ static bool generate_output_block(session_t* session) {
             encrypt_block(session, (const uint8_t*) &session->reply_header);
             session->state = EXECUTE_CALLBACK2;
             return true;
+        case EXECUTE_CALLBACK1:
+            // Waiting for callback1 handler to finish in the wifi_settings task (nothing to send yet).
+            return false;
         case EXECUTE_CALLBACK2:
             // Execute callback2 handler when header has been sent (nothing should be sent).
             return false;
+        case WAIT_TELEMETRY:
+            // Encrypted stage. Subscribed to telemetry: frames are generated by server_poll.
+            return false;
         case DISCONNECT:
             return false;
     }
     return false;
 }
 
-static void handle_enc_request_end(session_t* session) {
-    // Check data hash is correct
-    uint8_t expect_hash[DATA_HASH_SIZE];
-    generate_enc_data_hash(session, &session->request_header, expect_hash);
-    if (memcmp(expect_hash, session->request_header.data_hash, DATA_HASH_SIZE) != 0) {
-        session->state = SEND_CORRUPT_ERROR;
-        return;
-    }
+static bool is_handler_valid(uint8_t handler_id) {
+    return (handler_id < NUM_HANDLERS)
+        && (g_handler_table[(uint) handler_id].callback1
+            || g_handler_table[(uint) handler_id].callback2
+            || g_handler_table[(uint) handler_id].stream_begin);
+}
 
-    memset(&session->reply_header, 0, AES_BLOCK_SIZE);
-    session->reply_header.msg_type = ID_OK;
+static void add_handler_time(uint8_t handler_id, uint64_t start_us, bool new_call,
+                             uint32_t bytes_in, uint32_t bytes_out) {
+    // Update the counts after calling a handler callback. The lock is needed because
+    // the callback may have run in the wifi_settings task.
+    const uint64_t time_us = time_us_64() - start_us;
+    cyw43_arch_lwip_begin();
+    wifi_settings_remote_handler_stats_t* stats = &g_handler_stats[(uint) handler_id];
+    if (new_call) {
+        stats->num_calls++;
+    }
+    stats->total_time_us += time_us;
+    if (time_us > stats->max_time_us) {
+        stats->max_time_us = (time_us > UINT32_MAX) ? UINT32_MAX : (uint32_t) time_us;
+    }
+    stats->bytes_in += bytes_in;
+    stats->bytes_out += bytes_out;
+    cyw43_arch_lwip_end();
+}
 
-    // Process the request, getting new data, data_size, parameter
-    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+static void prepare_flash_worker_callback(async_context_t* context, async_at_time_worker_t* worker) {
+    // Called (via async_context) to erase one sector at a time, so that handlers and
+    // other work can run in between
+    if (wifi_settings_prepare_flash_step()) {
+        async_context_add_at_time_worker_in_ms(context, worker, 1);
+    } else {
+        g_prepare_flash_scheduled = false;
+    }
+}
 
-    // Check handler is valid (this was already checked, but g_handler_table may have changed)
-    if ((handler_id >= NUM_HANDLERS)
-    || !(g_handler_table[(uint) handler_id].callback1
-            || g_handler_table[(uint) handler_id].callback2)) {
-        session->state = SEND_BAD_HANDLER_ERROR;
+static void start_prepare_flash() {
+    // Called after a handler, in case it was ID_PREPARE_FLASH_HANDLER
+#if WIFI_SETTINGS_TASK
+    if (g_task) {
+        return; // the wifi_settings task will do this
+    }
+#endif
+    if (g_prepare_flash_scheduled || !wifi_settings_prepare_flash_pending()) {
         return;
     }
+    g_prepare_flash_scheduled = true;
+    g_prepare_flash_worker.do_work = prepare_flash_worker_callback;
+    async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &g_prepare_flash_worker, 1);
+}
+#endif
 
-    uint32_t reply_data_size = session->request_header.data_size;
-    int32_t result = session->request_header.parameter_or_result;
+static void call_handler1(session_t* session, uint32_t* reply_data_size, int32_t* result) {
+    // Call the first handler (if any), getting new data, data_size, result
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    *reply_data_size = session->request_header.data_size;
+    *result = session->request_header.parameter_or_result;
+    session->reply_source = NULL;
 
-    if (g_handler_table[(uint) handler_id].callback1) {
+    if ((handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].callback1) {
         // call first handler
-        reply_data_size = MAX_DATA_SIZE;
-        result = g_handler_table[(uint) handler_id].callback1(
+        const uint64_t start_us = time_us_64();
+        handler_output_t output = {MAX_DATA_SIZE, NULL};
+        WIFI_SETTINGS_PROFILE_START(profile_start);
+        *result = g_handler_table[(uint) handler_id].callback1(
                 session->request_header.msg_type,
                 session->data,
                 session->request_header.data_size,
                 session->request_header.parameter_or_result,
-                &reply_data_size,
+                &output.data_size,
                 g_handler_table[(uint) handler_id].arg);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_HANDLER, profile_start);
+        *reply_data_size = output.data_size;
+        uint32_t max_reply_data_size = MAX_DATA_SIZE;
+        if (output.source && !g_handler_table[(uint) handler_id].callback2) {
+            // The reply is sent directly from memory
+            session->reply_source = output.source;
+            max_reply_data_size = WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE;
+        }
         // The handler should not increase reply_data_size, try to do something useful anyway:
-        if (reply_data_size > MAX_DATA_SIZE) {
-            reply_data_size = MAX_DATA_SIZE;
+        if (*reply_data_size > max_reply_data_size) {
+            *reply_data_size = max_reply_data_size;
+        }
+        // If there is a second handler, the reply data is not sent
+        add_handler_time(handler_id, start_us, true, session->request_header.data_size,
+                         g_handler_table[(uint) handler_id].callback2 ? 0 : *reply_data_size);
+    }
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+    start_prepare_flash();
+#endif
+}
+
+static void call_handler2(session_t* session) {
+    // Call the second handler (if any) after the reply has been sent
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+
+    if ((handler_id < NUM_HANDLERS)
+    && (g_handler_table[(uint) handler_id].callback2)) {
+        const uint64_t start_us = time_us_64();
+        WIFI_SETTINGS_PROFILE_START(profile_start);
+        g_handler_table[(uint) handler_id].callback2(
+            session->request_header.msg_type,
+            session->data,
+            session->request_header.data_size,
+            session->request_header.parameter_or_result,
+            g_handler_table[(uint) handler_id].arg);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_HANDLER, profile_start);
+        // A handler with callback2 only is counted here, as callback1 was not called
+        const bool new_call = !g_handler_table[(uint) handler_id].callback1;
+        add_handler_time(handler_id, start_us, new_call,
+                         new_call ? session->request_header.data_size : 0, 0);
+    }
+}
+
+#if DEFERRED_HANDLERS
+static bool defer_handler(session_t* session, receive_state_t state) {
+    // Ask the wifi_settings task to run a handler for this session without holding
+    // the lwIP lock, or ask the handler worker to run it after the lwIP callback
+    // has returned. Sessions wait in a list, which can't become full, as a session
+    // has at most one handler at a time. Returns false only if there is no task or
+    // worker, in which case the caller should run the handler immediately.
+#if WIFI_SETTINGS_TASK
+    if (!g_task) {
+        return false;
+    }
+#else
+    if (!g_handler_worker.do_work) {
+        return false;
+    }
+#endif
+    session->state = state;
+    session->handler_busy = true;
+    session->next_deferred = NULL;
+    if (g_deferred_last) {
+        g_deferred_last->next_deferred = session;
+    } else {
+        g_deferred_first = session;
+    }
+    g_deferred_last = session;
+    g_task_busy_count++;
+#if WIFI_SETTINGS_TASK
+    xTaskNotifyGive(g_task);
+#else
+    async_context_set_work_pending(cyw43_arch_async_context(), &g_handler_worker);
+#endif
+    return true;
+}
+
+static session_t* take_deferred_session() {
+    // Remove the oldest session waiting for a handler, holding the lwIP lock
+    session_t* session = g_deferred_first;
+    if (session) {
+        g_deferred_first = session->next_deferred;
+        if (!g_deferred_first) {
+            g_deferred_last = NULL;
         }
+        session->next_deferred = NULL;
     }
+    return session;
+}
+#endif
 
+static void finish_enc_request(session_t* session, uint32_t reply_data_size, int32_t result) {
+    // Prepare the reply after the first handler has run
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
     session->data_index = 0;
     session->reply_header.parameter_or_result = result;
 
@@ -467,26 +1269,242 @@ static void handle_enc_request_end(session_t* session) {
         session->reply_header.data_size = reply_data_size;
         session->state = SEND_ENC_REPLY_HEADER;
     }
-    generate_enc_data_hash(session, &session->reply_header, session->reply_header.data_hash);
+    generate_enc_data_hash(session, &session->reply_header, true, session->reply_header.data_hash);
+    if (session->reply_source) {
+        // The data buffer isn't needed to send the reply, so another session can use it
+        release_data_buffer(session);
+    }
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+    if ((session->request_header.msg_type == ID_TELEMETRY_HANDLER)
+    && (session->request_header.parameter_or_result > 0) && (result >= 0)) {
+        // Subscribe: after this reply, a telemetry frame is sent at each interval
+        uint32_t interval_ms = (uint32_t) session->request_header.parameter_or_result;
+        if (interval_ms < TELEMETRY_MIN_INTERVAL_MS) {
+            interval_ms = TELEMETRY_MIN_INTERVAL_MS;
+        }
+        session->telemetry_interval_ms = interval_ms;
+        session->telemetry_next_ms = to_ms_since_boot(get_absolute_time()) + interval_ms;
+    }
+#endif
 }
 
-static void handle_enc_request_start(session_t* session) {
-    // Decrypt 
-    decrypt_block(session, (uint8_t*) &session->request_header);
-
-    // Check handler ID is within the allowed range
+static void finish_stream_request(session_t* session) {
+    // Check data hash is correct: the hash of each chunk was added as it was received
+    uint8_t expect_hash[DATA_HASH_SIZE];
+    const uint64_t hash_start_us = time_us_64();
+    finish_enc_data_hash(&session->stream_hash, get_data_hash_key(session, false), expect_hash);
+    add_crypto_time(hash_start_us);
+    session->streaming = false;
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    g_stream_hash_in_use = false;
+#endif
+    bool data_valid =
+        (memcmp(expect_hash, session->request_header.data_hash, DATA_HASH_SIZE) == 0);
+    bool replayed = false;
+    if (data_valid && !confirm_ticket(session)) {
+        // The handler is told to discard the data, and the session ends
+        data_valid = false;
+        replayed = true;
+    }
+
+    // The end handler is called even if the data is corrupt, so that the handler
+    // can discard it, but the result can't be returned in this case
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    int32_t result = session->stream_begin_result;
+    if ((result == 0) && (handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].stream_end) {
+        const uint64_t start_us = time_us_64();
+        result = g_handler_table[(uint) handler_id].stream_end(
+                session->request_header.msg_type,
+                data_valid,
+                g_handler_table[(uint) handler_id].arg);
+        add_handler_time(handler_id, start_us, false, 0, 0);
+    }
+    if (replayed) {
+        session->state = DISCONNECT;
+        return;
+    }
+    if (!data_valid) {
+        session->state = SEND_CORRUPT_ERROR;
+        return;
+    }
+
+    // Reply with the result only
+    memset(&session->reply_header, 0, AES_BLOCK_SIZE);
+    session->reply_header.msg_type = ID_OK;
+    session->reply_header.parameter_or_result = result;
+    session->state = SEND_ENC_REPLY_HEADER;
+    generate_enc_data_hash(session, &session->reply_header, true, session->reply_header.data_hash);
+}
+
+static void abort_stream_request(session_t* session) {
+    // Called if the session ends while a streaming request is being received
+    if (!session->streaming) {
+        return;
+    }
+    // The hash is finished rather than just freed, as this releases the SHA-256 hardware (if used)
+    uint8_t full_data_hash[HMAC_DIGEST_SIZE];
+    const uint64_t hash_start_us = time_us_64();
+    if (0 != wifi_settings_sha256_finish(&session->stream_hash, full_data_hash)) {
+        panic("abort_stream_request sha256 failed");
+    }
+    add_crypto_time(hash_start_us);
+    wifi_settings_sha256_free(&session->stream_hash);
+    session->streaming = false;
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    g_stream_hash_in_use = false;
+#endif
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    if ((session->stream_begin_result == 0) && (handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].stream_end) {
+        const uint64_t start_us = time_us_64();
+        g_handler_table[(uint) handler_id].stream_end(
+                session->request_header.msg_type,
+                false,
+                g_handler_table[(uint) handler_id].arg);
+        add_handler_time(handler_id, start_us, false, 0, 0);
+    }
+}
+
+static void handle_enc_request_end(session_t* session) {
+    if (session->streaming) {
+        finish_stream_request(session);
+        return;
+    }
+
+    // Check data hash is correct
+    uint8_t expect_hash[DATA_HASH_SIZE];
+    generate_enc_data_hash(session, &session->request_header, false, expect_hash);
+    if (memcmp(expect_hash, session->request_header.data_hash, DATA_HASH_SIZE) != 0) {
+        session->state = SEND_CORRUPT_ERROR;
+        return;
+    }
+    if (!confirm_ticket(session)) {
+        // Resumed with a ticket that was already used: don't run the request again
+        session->state = DISCONNECT;
+        return;
+    }
+
+    memset(&session->reply_header, 0, AES_BLOCK_SIZE);
+    session->reply_header.msg_type = ID_OK;
+
+    // Process the request
     uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+
+    // Check handler is valid (this was already checked, but g_handler_table may have changed)
     if ((handler_id >= NUM_HANDLERS)
     || !(g_handler_table[(uint) handler_id].callback1
             || g_handler_table[(uint) handler_id].callback2)) {
         session->state = SEND_BAD_HANDLER_ERROR;
         return;
     }
+
+#if DEFERRED_HANDLERS
+    if (g_handler_table[(uint) handler_id].callback1 && defer_handler(session, EXECUTE_CALLBACK1)) {
+        // run_deferred_handler will call the first handler, then finish_enc_request
+        return;
+    }
+#endif
+    uint32_t reply_data_size;
+    int32_t result;
+    call_handler1(session, &reply_data_size, &result);
+    finish_enc_request(session, reply_data_size, result);
+}
+
+static void start_stream_request(session_t* session) {
+    // The payload is passed to the handler in chunks as it is decrypted, so it
+    // can be larger than MAX_DATA_SIZE, and no data buffer is needed
+    if (session->request_header.data_size > MAX_STREAM_DATA_SIZE) {
+        session->state = SEND_BAD_PARAM_ERROR;
+        return;
+    }
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    // The SHA-256 hardware will be held until the end of the request,
+    // so this is only possible if there are no other sessions
+    if (g_session_stats.num_active > 1) {
+        session->state = SEND_BUSY_ERROR;
+        return;
+    }
+    g_stream_hash_in_use = true;
+#endif
+    session->streaming = true;
+    session->stream_chunk_size = 0;
+    const uint64_t hash_start_us = time_us_64();
+    start_enc_data_hash(&session->stream_hash, get_data_hash_key(session, false),
+                        &session->request_header);
+    add_crypto_time(hash_start_us);
+
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    const uint64_t start_us = time_us_64();
+    session->stream_begin_result = g_handler_table[(uint) handler_id].stream_begin(
+            session->request_header.msg_type,
+            session->request_header.data_size,
+            session->request_header.parameter_or_result,
+            g_handler_table[(uint) handler_id].arg);
+    add_handler_time(handler_id, start_us, true, 0, 0);
+
+    if (session->request_header.data_size == 0) {
+        // There is no payload - go direct to the end
+        handle_enc_request_end(session);
+    } else {
+        // Payload needed
+        session->state = EXPECT_ENC_REQUEST_PAYLOAD;
+    }
+}
+
+static void pass_stream_chunk(session_t* session) {
+    // Pass the decrypted chunk to the streaming handler, without the padding
+    // at the end of the final block
+    const uint32_t chunk_offset = session->data_index - session->stream_chunk_size;
+    uint32_t chunk_size = session->stream_chunk_size;
+    if (chunk_size > (session->request_header.data_size - chunk_offset)) {
+        chunk_size = session->request_header.data_size - chunk_offset;
+    }
+    const uint64_t hash_start_us = time_us_64();
+    if (0 != wifi_settings_sha256_update(&session->stream_hash, session->stream_chunk, chunk_size)) {
+        panic("pass_stream_chunk sha256 failed");
+    }
+    add_crypto_time(hash_start_us);
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    if ((session->stream_begin_result == 0) && (handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].stream_data) {
+        const uint64_t start_us = time_us_64();
+        g_handler_table[(uint) handler_id].stream_data(
+                session->request_header.msg_type,
+                session->stream_chunk,
+                chunk_offset,
+                chunk_size,
+                g_handler_table[(uint) handler_id].arg);
+        add_handler_time(handler_id, start_us, false, chunk_size, 0);
+    }
+    session->stream_chunk_size = 0;
+}
+
+static void handle_enc_request_start(session_t* session) {
+    // Decrypt 
+    decrypt_block(session, (uint8_t*) &session->request_header);
+
+    // Check handler ID is within the allowed range
+    uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
+    if (!is_handler_valid(handler_id)) {
+        session->state = SEND_BAD_HANDLER_ERROR;
+        return;
+    }
+    if (g_handler_table[(uint) handler_id].stream_begin) {
+        session->data_index = 0;
+        start_stream_request(session);
+        return;
+    }
     // Check parameters are valid, start processing the request
     if (session->request_header.data_size > MAX_DATA_SIZE) {
         session->state = SEND_BAD_PARAM_ERROR;
         return;
     }
+    // A data buffer is needed for the request and reply
+    if (!attach_data_buffer(session)) {
+        session->state = SEND_BUSY_ERROR;
+        return;
+    }
 
     // Prepare for receiving the request payload
     session->data_index = 0;
@@ -499,15 +1517,67 @@ static void handle_enc_request_start(session_t* session) {
     }
 }
 
-static void handle_enc_request_add_data(session_t* session) {
-    decrypt_block(session, &session->data[session->data_index]);
-    session->data_index += AES_BLOCK_SIZE;
+// Get the location where the next request payload blocks should be decrypted,
+// and the space available there
+static uint8_t* get_request_payload_dest(session_t* session, uint* space) {
+    if (session->streaming) {
+        *space = STREAM_CHUNK_SIZE - session->stream_chunk_size;
+        return &session->stream_chunk[session->stream_chunk_size];
+    }
+    *space = MAX_DATA_SIZE - session->data_index;
+    return &session->data[session->data_index];
+}
+
+// Called after request payload blocks have been decrypted at get_request_payload_dest
+static void add_request_payload(session_t* session, uint size) {
+    session->data_index += size;
+    if (session->streaming) {
+        session->stream_chunk_size += (uint16_t) size;
+        if ((session->stream_chunk_size >= STREAM_CHUNK_SIZE)
+        || (session->data_index >= session->request_header.data_size)) {
+            pass_stream_chunk(session);
+        }
+    }
     if (session->data_index >= session->request_header.data_size) {
         // No more blocks
         handle_enc_request_end(session);
     }
 }
 
+static void handle_enc_request_add_data(session_t* session) {
+    uint space;
+    decrypt_block(session, get_request_payload_dest(session, &space));
+    add_request_payload(session, AES_BLOCK_SIZE);
+}
+
+// Decrypt as many whole blocks of the request payload as possible directly from
+// received data, returning the number of bytes used. Blocks which are split
+// between pbufs are copied to input_block and handled by handle_input_block instead.
+static uint handle_enc_request_add_data_bulk(session_t* session,
+                                             const uint8_t* payload, uint payload_size) {
+    if ((session->state != EXPECT_ENC_REQUEST_PAYLOAD) || (session->input_block_offset != 0)) {
+        return 0;
+    }
+    const uint remaining_size = session->request_header.data_size - session->data_index;
+    const uint remaining_blocks = (remaining_size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    uint space;
+    uint8_t* dest = get_request_payload_dest(session, &space);
+    uint num_blocks = payload_size / AES_BLOCK_SIZE;
+    if (num_blocks > remaining_blocks) {
+        num_blocks = remaining_blocks;
+    }
+    if (num_blocks > (space / AES_BLOCK_SIZE)) {
+        num_blocks = space / AES_BLOCK_SIZE;
+    }
+    if (num_blocks == 0) {
+        return 0;
+    }
+    const uint size = num_blocks * AES_BLOCK_SIZE;
+    decrypt_blocks(session, payload, dest, size);
+    add_request_payload(session, size);
+    return size;
+}
+
 static bool handle_input_block(session_t* session) {
     const uint8_t* block = session->input_block;
     switch (session->state) {
@@ -515,12 +1585,19 @@ static bool handle_input_block(session_t* session) {
             // First message, server to client. Say hello.
             return false;
         case EXPECT_REQUEST:
-            // Second message, client to server. Client sends the client challenge.
-            if (block[0] != ID_REQUEST) {
+            // Second message, client to server. Client sends the client challenge,
+            // or a ticket from an earlier session.
+            if ((block[0] != ID_REQUEST) && (block[0] != ID_RESUME)) {
                 session->state = SEND_BAD_MSG_ERROR;
+                handshake_failed(session);
             } else if (!g_secret_valid) {
                 session->state = SEND_NO_SECRET_ERROR;
+            } else if ((block[0] == ID_RESUME) && use_ticket(session, &block[1])) {
+                session->state = SEND_RESUMED;
+                handshake_done(session);
             } else {
+                // If the ticket can't be used, it is the client challenge, and
+                // the client continues with the full handshake
                 memcpy(session->client_challenge, &block[1], CHALLENGE_SIZE);
                 session->state = SEND_CHALLENGE;
             }
@@ -532,13 +1609,17 @@ static bool handle_input_block(session_t* session) {
             // Fourth message, client to server. Client sends the client authentication.
             if (block[0] != ID_AUTHENTICATION) {
                 session->state = SEND_BAD_MSG_ERROR;
+                handshake_failed(session);
             } else {
                 uint8_t check_authentication[AUTHENTICATION_SIZE];
                 generate_authentication(session, "CA", check_authentication, AUTHENTICATION_SIZE);
                 if (memcmp(check_authentication, &block[1], AUTHENTICATION_SIZE) != 0) {
                     session->state = SEND_AUTH_ERROR;
+                    g_session_stats.num_auth_failures++;
+                    handshake_failed(session);
                 } else {
                     session->state = SEND_AUTHENTICATION;
+                    handshake_done(session);
                 }
             }
             return true;
@@ -551,6 +1632,14 @@ static bool handle_input_block(session_t* session) {
                 session->state = SEND_BAD_MSG_ERROR;
             } else {
                 session->state = EXPECT_ENC_REQUEST_HEADER;
+                // The client chooses CTR mode if the server supports it (see the greeting)
+                session->protocol_version =
+                    (block[2] == PROTOCOL_VERSION_CTR) ? PROTOCOL_VERSION_CTR : PROTOCOL_VERSION;
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+                if (block[1] == ACKNOWLEDGE_TICKET) {
+                    session->state = SEND_TICKET;
+                }
+#endif
                 // Session keys can be generated now
                 generate_keys(session);
             }
@@ -564,12 +1653,24 @@ static bool handle_input_block(session_t* session) {
         case SEND_BAD_HANDLER_ERROR:
             // Report bad handler error to the client.
             return false;
+        case SEND_BUSY_ERROR:
+            // Report that no data buffer is available.
+            return false;
         case SEND_AUTH_ERROR:
             // Report authentication error to the client.
             return false;
         case SEND_NO_SECRET_ERROR:
             // Report "no secret" error to the client.
             return false;
+        case SEND_CLEAR_BUSY_ERROR:
+            // Report that the session can't start yet.
+            return false;
+        case SEND_RESUMED:
+            // Server accepts a ticket.
+            return false;
+        case SEND_TICKET:
+            // Server sends a ticket.
+            return false;
         case SEND_CORRUPT_ERROR:
             // Report corrupt block error to the client.
             return false;
@@ -577,9 +1678,15 @@ static bool handle_input_block(session_t* session) {
             // Encrypted stage. Awaiting request from the client.
             handle_enc_request_start(session);
             return true;
+        case EXECUTE_CALLBACK1:
+            // Waiting for callback1 handler to finish in the wifi_settings task (nothing should be received).
+            return false;
         case EXECUTE_CALLBACK2:
             // Execute callback2 handler when header has been sent (nothing should be received).
             return false;
+        case WAIT_TELEMETRY:
+            // Subscribed to telemetry: any data from the client ends the subscription.
+            return false;
         case EXPECT_ENC_REQUEST_PAYLOAD:
             // Encrypted stage. Awaiting payload data from the client.
             handle_enc_request_add_data(session);
@@ -599,16 +1706,116 @@ static bool handle_input_block(session_t* session) {
     return false;
 }
 
-static void server_tcp_close(struct tcp_pcb *client_pcb) {
-    // Disable all callbacks
+static void server_tcp_remove_callbacks(struct tcp_pcb *client_pcb) {
     tcp_arg(client_pcb, NULL);
     tcp_sent(client_pcb, NULL);
     tcp_recv(client_pcb, NULL);
     tcp_err(client_pcb, NULL);
+#if SERVER_POLL
+    tcp_poll(client_pcb, NULL, 0);
+#endif
+}
+
+static void server_tcp_close(struct tcp_pcb *client_pcb) {
+    // Disable all callbacks
+    server_tcp_remove_callbacks(client_pcb);
     // close
     tcp_close(client_pcb);
 }
 
+static session_t* new_session() {
+    // Allocate zeroed session data. The lwIP lock must be held.
+#if WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE > 0
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE; i++) {
+        if (!g_session_pool_used[i]) {
+            g_session_pool_used[i] = true;
+            return &g_session_pool[i];
+        }
+    }
+    return NULL;
+#else
+    return calloc(1, sizeof(session_t));
+#endif
+}
+
+void wifi_settings_remote_get_session_stats(wifi_settings_remote_session_stats_t* stats) {
+    cyw43_arch_lwip_begin();
+    *stats = g_session_stats;
+    cyw43_arch_lwip_end();
+    stats->pool_size = WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE;
+}
+
+void wifi_settings_remote_set_reply_source(uint32_t* output_data_size, const void* source) {
+    // output_data_size is the data_size field of the caller's handler_output_t
+    ((handler_output_t*) output_data_size)->source = (const uint8_t*) source;
+}
+
+bool wifi_settings_remote_is_task_busy() {
+    // Called in the lwIP context
+#if WIFI_SETTINGS_TASK
+    return g_task_busy_count != 0;
+#else
+    return false;
+#endif
+}
+
+int wifi_settings_remote_get_handler_stats(uint8_t msg_type, wifi_settings_remote_handler_stats_t* stats) {
+    uint8_t handler_id = msg_type - ID_FIRST_HANDLER;
+    if (handler_id >= NUM_HANDLERS) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    cyw43_arch_lwip_begin();
+    *stats = g_handler_stats[(uint) handler_id];
+    cyw43_arch_lwip_end();
+    return PICO_OK;
+}
+
+static void delete_session(session_t* session) {
+    // Free session data. The lwIP lock must be held.
+    if (!session) {
+        return;
+    }
+    abort_stream_request(session);
+    release_data_buffer(session);
+    if (session->input_pbuf) {
+        pbuf_free(session->input_pbuf);
+    }
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+    wifi_settings_write_flash_session_ended();
+#endif
+    if (!session->authenticated) {
+        g_session_stats.num_handshakes--;
+    }
+#if WIFI_SETTINGS_REMOTE_SESSION_POOL_SIZE > 0
+    // Clear the session (including the keys) so that it is ready for reuse
+    const uint index = (uint) (session - g_session_pool);
+    memset(session, 0, sizeof(session_t));
+    g_session_pool_used[index] = false;
+#else
+    free(session);
+#endif
+    g_session_stats.num_active--;
+#if REMOTE_LOW_LATENCY
+    if (g_session_stats.num_active == 0) {
+        // Last session ended, so the application's power profile can be used again
+        wifi_settings_set_remote_active(false);
+    }
+#endif
+}
+
+static void free_session(session_t* session) {
+    // Free session data, unless a handler is still pending or running,
+    // in which case run_deferred_handler frees it later
+#if DEFERRED_HANDLERS
+    if (session && session->handler_busy) {
+        session->client_pcb = NULL;
+        session->closed = true;
+        return;
+    }
+#endif
+    delete_session(session);
+}
+
 static void server_err(void *arg, err_t unused) {
     // Called if there is a TCP error with the connection or from the remote side.
     // This callback:
@@ -616,29 +1823,40 @@ static void server_err(void *arg, err_t unused) {
     // * should ignore the err parameter
     // * might be called with arg == NULL
     struct session_t* session = (struct session_t*) arg;
-    free(session);
+    free_session(session);
 }
 
 static void send_while_able(struct session_t* session, struct tcp_pcb* client_pcb) {
     while (true) {
-        // check if an output block is waiting to be sent
-        if (!session->output_block_ready) {
-            // try to generate an output block
-            if (!generate_output_block(session)) {
+        // check if output blocks are waiting to be sent
+        if (session->output_size == 0) {
+            // try to generate as many output blocks as there is space for
+            // in the send buffer; at least one block is generated, as
+            // tcp_sndbuf can't tell us if tcp_write will succeed anyway
+            uint limit = tcp_sndbuf(client_pcb);
+            if (limit > OUTPUT_BUFFER_SIZE) {
+                limit = OUTPUT_BUFFER_SIZE;
+            }
+            if (limit < AES_BLOCK_SIZE) {
+                limit = AES_BLOCK_SIZE;
+            }
+            while ((((uint) session->output_size + AES_BLOCK_SIZE) <= limit)
+            && generate_output_block(session)) {
+                session->output_size += AES_BLOCK_SIZE;
+            }
+            if (session->output_size == 0) {
                 // There's nothing to send
                 return;
             }
-            session->output_block_ready = true;
         }
 
-        // try to send a block
-        // Note: can't use tcp_sndbuf to tell if this will succeed, so we have
-        // to generate a block beforehand.
-        err_t err = tcp_write(client_pcb, session->output_block,
-                        AES_BLOCK_SIZE, TCP_WRITE_FLAG_COPY);
+        // try to send the blocks, which must be sent together as they
+        // have already been generated
+        err_t err = tcp_write(client_pcb, session->output_buffer,
+                        session->output_size, TCP_WRITE_FLAG_COPY);
         if (err == ERR_OK) {
-            // success, block has been sent
-            session->output_block_ready = false;
+            // success, blocks have been sent
+            session->output_size = 0;
         } else if (err == ERR_MEM) {
             // failure, we should try again later, after some data has been sent
             return;
@@ -650,6 +1868,97 @@ static void send_while_able(struct session_t* session, struct tcp_pcb* client_pc
     }
 }
 
+// Is the reply to a request still being prepared? If so, the client may have sent
+// more requests (pipelining), and these are kept in input_pbuf until the reply
+// has been generated.
+static bool is_reply_pending(const session_t* session) {
+    switch (session->state) {
+        case EXECUTE_CALLBACK1:
+        case SEND_ENC_REPLY_HEADER:
+        case SEND_ENC_REPLY_PAYLOAD:
+        case SEND_RESUMED:
+        case SEND_TICKET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Process received data in input_pbuf, and send replies.
+// Returns false if the session was deleted and the connection closed.
+static bool process_input(session_t* session, struct tcp_pcb* client_pcb) {
+    bool input_buffer_overflow = false;
+
+    while (session->input_pbuf && !input_buffer_overflow
+    && !is_reply_pending(session) && (session->state != DISCONNECT)) {
+        // copy in to blocks, from each pbuf in the chain
+        struct pbuf* p = session->input_pbuf;
+        uint used_size = 0;
+
+        for (struct pbuf* q = p; q && !input_buffer_overflow; q = q->next) {
+            const uint8_t* payload = (const uint8_t*) q->payload;
+            const uint payload_size = (uint) q->len;
+            uint recv_index = 0;
+
+            while ((recv_index < payload_size) && !is_reply_pending(session)) {
+                // Request payload blocks are decrypted in bulk where possible
+                const uint bulk_size = handle_enc_request_add_data_bulk(
+                        session, &payload[recv_index], payload_size - recv_index);
+                if (bulk_size != 0) {
+                    recv_index += bulk_size;
+                    continue;
+                }
+                session->input_block[(uint) session->input_block_offset] = payload[recv_index];
+                session->input_block_offset++;
+                recv_index++;
+                if (session->input_block_offset >= AES_BLOCK_SIZE) {
+                    // Process the block
+                    if (!handle_input_block(session)) {
+                        // Unable to handle input right now!
+                        // (There is no buffer space for this.)
+                        // We will disconnect, possibly after sending an error message
+                        input_buffer_overflow = true;
+                        break;
+                    }
+                    session->input_block_offset = 0;
+                }
+            }
+            used_size += recv_index;
+            if (recv_index < payload_size) {
+                break;
+            }
+        }
+
+        // mark data as received, free the pbufs which have been used
+        if (input_buffer_overflow || (used_size >= p->tot_len)) {
+            tcp_recved(client_pcb, p->tot_len);
+            pbuf_free(p);
+            session->input_pbuf = NULL;
+        } else {
+            tcp_recved(client_pcb, (u16_t) used_size);
+            session->input_pbuf = pbuf_free_header(p, (u16_t) used_size);
+        }
+
+        // disconnect before sending anything if requested by handle_input_block
+        if (session->state == DISCONNECT) {
+            free_session(session);
+            server_tcp_close(client_pcb);
+            return false;
+        }
+
+        // Send data (if any)
+        // send_while_able may also enter the DISCONNECT state, but in this case,
+        // don't disconnect immediately, wait for server_sent to be called.
+        send_while_able(session, client_pcb);
+    }
+
+    // If an overflow was detected, disconnect after sending an error message
+    if (input_buffer_overflow) {
+        session->state = DISCONNECT;
+    }
+    return true;
+}
+
 static err_t server_recv(void* arg, struct tcp_pcb* client_pcb, struct pbuf* p, err_t err) {
     // Called when a packet is received or when the connection is closed by the other side
     //
@@ -671,7 +1980,7 @@ static err_t server_recv(void* arg, struct tcp_pcb* client_pcb, struct pbuf* p,
 
     if ((!p) || (!session)) {
         // connection has been closed by the other side
-        free(session);
+        free_session(session);
         server_tcp_close(client_pcb);
         if (p) {
             pbuf_free(p);
@@ -679,47 +1988,15 @@ static err_t server_recv(void* arg, struct tcp_pcb* client_pcb, struct pbuf* p,
         return ERR_OK;
     }
 
-    // copy in to blocks
-    uint8_t* payload = (uint8_t*) p->payload;
-    uint16_t payload_size = (uint) p->len;
-    bool input_buffer_overflow = false;
+    session->activity_time_ms = to_ms_since_boot(get_absolute_time());
 
-    for (uint16_t recv_index = 0; recv_index < payload_size; recv_index++) {
-        session->input_block[(uint) session->input_block_offset] = payload[(uint) recv_index];
-        session->input_block_offset++;
-        if (session->input_block_offset >= AES_BLOCK_SIZE) {
-            // Process the block
-            if (!handle_input_block(session)) {
-                // Unable to handle input right now!
-                // (There is no buffer space for this.)
-                // We will disconnect, possibly after sending an error message
-                input_buffer_overflow = true;
-                break;
-            }
-            session->input_block_offset = 0;
-        }
-    }
-
-    // mark data as received, free pbuf
-    tcp_recved(client_pcb, payload_size);
-    pbuf_free(p);
-
-    // disconnect before sending anything if requested by handle_input_block
-    if (session->state == DISCONNECT) {
-        free(session);
-        server_tcp_close(client_pcb);
-        return ERR_OK;
-    }
-
-    // Send data (if any)
-    // send_while_able may also enter the DISCONNECT state, but in this case,
-    // don't disconnect immediately, wait for server_sent to be called.
-    send_while_able(session, client_pcb);
-
-    // If an overflow was detected, disconnect after sending an error message
-    if (input_buffer_overflow) {
-        session->state = DISCONNECT;
+    // Received data is processed in order, after any data that is waiting
+    if (session->input_pbuf) {
+        pbuf_cat(session->input_pbuf, p);
+    } else {
+        session->input_pbuf = p;
     }
+    process_input(session, client_pcb);
     return ERR_OK;
 }
 
@@ -737,34 +2014,138 @@ static err_t server_sent(void *arg, struct tcp_pcb *client_pcb, uint16_t unused)
         server_tcp_close(client_pcb);
         return ERR_OK;
     }
+    session->activity_time_ms = to_ms_since_boot(get_absolute_time());
 
-    // Send data?
+    // Send data, and process any requests that were waiting for the reply to be sent
     send_while_able(session, client_pcb);
+    if (!process_input(session, client_pcb)) {
+        return ERR_OK;
+    }
 
-    if (session->state == EXECUTE_CALLBACK2) {
+    if ((session->state == EXECUTE_CALLBACK2) && (session->output_size == 0)) {
         // Data has been sent, execute callback2 if it exists (close first)
         server_tcp_close(client_pcb);
-
-        uint8_t handler_id = session->request_header.msg_type - ID_FIRST_HANDLER;
-
-        if ((handler_id < NUM_HANDLERS)
-        && (g_handler_table[(uint) handler_id].callback2)) {
-            g_handler_table[(uint) handler_id].callback2(
-                session->request_header.msg_type,
-                session->data,
-                session->request_header.data_size,
-                session->request_header.parameter_or_result,
-                g_handler_table[(uint) handler_id].arg);
+#if DEFERRED_HANDLERS
+        session->client_pcb = NULL;
+        if (defer_handler(session, EXECUTE_CALLBACK2)) {
+            // run_deferred_handler will call the second handler, then free the session
+            return ERR_OK;
         }
+#endif
+        call_handler2(session);
         // Result of executing callback2 cannot be reported
-        free(session);
+        delete_session(session);
     } else if (session->state == DISCONNECT) {
-        free(session);
+        free_session(session);
         server_tcp_close(client_pcb);
     }
     return ERR_OK;
 }
 
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+static void send_telemetry(session_t* session, struct tcp_pcb* client_pcb) {
+    // Send a telemetry frame as a reply from ID_TELEMETRY_HANDLER. The frame is
+    // generated in stream_chunk, so that no data buffer is needed.
+    const uint8_t handler_id = ID_TELEMETRY_HANDLER - ID_FIRST_HANDLER;
+    const handler_callback_arg_t* handler = &g_handler_table[(uint) handler_id];
+    if (!handler->callback1) {
+        return;
+    }
+    const uint64_t start_us = time_us_64();
+    // (a reply source is ignored, the frame is always sent from stream_chunk)
+    handler_output_t output = {STREAM_CHUNK_SIZE, NULL};
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    const int32_t result = handler->callback1(ID_TELEMETRY_HANDLER,
+            session->stream_chunk, 0, (int32_t) session->telemetry_interval_ms,
+            &output.data_size, handler->arg);
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_HANDLER, profile_start);
+    uint32_t reply_data_size = output.data_size;
+    if (reply_data_size > STREAM_CHUNK_SIZE) {
+        reply_data_size = STREAM_CHUNK_SIZE;
+    }
+    add_handler_time(handler_id, start_us, true, 0, reply_data_size);
+
+    memset(&session->reply_header, 0, AES_BLOCK_SIZE);
+    session->reply_header.msg_type = ID_OK;
+    session->reply_header.data_size = reply_data_size;
+    session->reply_header.parameter_or_result = result;
+    session->reply_source = session->stream_chunk;
+    session->data_index = 0;
+    session->state = SEND_ENC_REPLY_HEADER;
+    generate_enc_data_hash(session, &session->reply_header, true, session->reply_header.data_hash);
+    send_while_able(session, client_pcb);
+}
+#endif
+
+#if SERVER_POLL
+static err_t server_poll(void *arg, struct tcp_pcb *client_pcb) {
+    // Called periodically (every SERVER_POLL_INTERVAL) while the connection is open
+    //
+    // This callback:
+    // * may call tcp_close
+    // * may call tcp_abort, after freeing the session data, and must then return ERR_ABRT
+    // * must otherwise return ERR_OK
+    // * might be called with arg == NULL
+    struct session_t* session = (struct session_t*) arg;
+
+    if (!session) {
+        return ERR_OK;
+    }
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+    if (session->telemetry_interval_ms) {
+        if (session->state == DISCONNECT) {
+            // The client sent more data, which ends the subscription
+            free_session(session);
+            server_tcp_close(client_pcb);
+        } else if ((session->state == WAIT_TELEMETRY)
+        && (((int32_t) (now_ms - session->telemetry_next_ms)) >= 0)
+        && !wifi_settings_remote_is_task_busy()) {
+            // A frame is due. If frames were missed (e.g. the previous frame was
+            // still being sent, or the wifi_settings task was running a handler),
+            // they are skipped rather than sent together.
+            session->telemetry_next_ms += session->telemetry_interval_ms;
+            if (((int32_t) (now_ms - session->telemetry_next_ms)) >= 0) {
+                session->telemetry_next_ms = now_ms + session->telemetry_interval_ms;
+            }
+            send_telemetry(session, client_pcb);
+        }
+        return ERR_OK;
+    }
+#endif
+#if WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS > 0
+    if ((!session->authenticated)
+    && ((now_ms - session->accept_time_ms) >= WIFI_SETTINGS_REMOTE_HANDSHAKE_TIMEOUT_MS)) {
+        // The handshake is taking too long
+        g_session_stats.num_handshake_timeouts++;
+        if (session->state != DISCONNECT) {
+            handshake_failed(session);
+        }
+        free_session(session);
+        server_tcp_remove_callbacks(client_pcb);
+        tcp_abort(client_pcb);
+        return ERR_ABRT;
+    }
+#endif
+#if WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS > 0
+    if ((session->state == EXECUTE_CALLBACK1) || (session->state == EXECUTE_CALLBACK2)) {
+        // A handler is running: the client is waiting for it, so this is not idle time
+        session->activity_time_ms = now_ms;
+    } else if (session->authenticated
+    && ((now_ms - session->activity_time_ms) >= WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS)) {
+        // Nothing has been received or acknowledged by the client for too long:
+        // it has gone silent, or the connection is half-open (e.g. after roaming)
+        g_session_stats.num_idle_timeouts++;
+        free_session(session);
+        server_tcp_remove_callbacks(client_pcb);
+        tcp_abort(client_pcb);
+        return ERR_ABRT;
+    }
+#endif
+    return ERR_OK;
+}
+#endif
+
 static err_t server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err) {
     // Called for a new connection
     //
@@ -779,33 +2160,302 @@ static err_t server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err) {
         return ERR_VAL; 
     }
 
-    struct session_t* session = calloc(1, sizeof(struct session_t));
+    // Cheap checks first: no session is allocated for a rejected connection
+    ip_addr_t remote_address;
+    tcp_tcp_get_tcp_addrinfo(client_pcb, 0, &remote_address, NULL);
+    if (is_backoff_source(&remote_address)) {
+        // Rejected because of failed handshakes from this address
+        g_session_stats.num_backoff_rejected++;
+        return ERR_MEM;
+    }
+    if (g_session_stats.num_handshakes >= WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES) {
+        // Rejected because too many sessions are not yet authenticated
+        g_session_stats.num_handshake_limited++;
+        return ERR_MEM;
+    }
+
+    struct session_t* session = new_session();
     if (!session) {
+        // Rejected: returning ERR_MEM causes lwIP to abort the connection
+        g_session_stats.num_rejected++;
         return ERR_MEM;
     }
+#if REMOTE_LOW_LATENCY
+    if (g_session_stats.num_active == 0) {
+        // Avoid power saving delays while the session is connected
+        wifi_settings_set_remote_active(true);
+    }
+#endif
+    g_session_stats.num_active++;
+    g_session_stats.num_sessions++;
+    g_session_stats.num_handshakes++;
+    if (g_session_stats.num_active > g_session_stats.max_active) {
+        g_session_stats.max_active = g_session_stats.num_active;
+    }
+    session->accept_time_ms = to_ms_since_boot(get_absolute_time());
+    session->activity_time_ms = session->accept_time_ms;
+    ip_addr_copy(session->remote_address, remote_address);
 
+#if DEFERRED_HANDLERS
+    session->client_pcb = client_pcb;
+#endif
     tcp_arg(client_pcb, session);
     tcp_sent(client_pcb, server_sent);
     tcp_recv(client_pcb, server_recv);
     tcp_err(client_pcb, server_err);
+#if SERVER_POLL
+    tcp_poll(client_pcb, server_poll, SERVER_POLL_INTERVAL);
+#endif
 
-    // Set up greeting
-    int string_size = snprintf((char*) session->data, MAX_DATA_SIZE,
+    // Set up greeting (the last byte is reserved for the capabilities)
+    int string_size = snprintf((char*) session->greeting, GREETING_SIZE - 1,
         "xxx\r%s\rpico-wifi-settings version " WIFI_SETTINGS_VERSION_STRING "\r\n",
         wifi_settings_get_board_id_hex());
-    // bytes 0 .. 2 are fixed fields in the reply:
-    session->data[0] = ID_GREETING;
-    session->data[1] = PROTOCOL_VERSION;
-    session->data[2] = (uint8_t) ((string_size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    if ((string_size < 0) || (string_size >= (GREETING_SIZE - 1))) {
+        string_size = GREETING_SIZE - 2;
+    }
+    // bytes 0 .. 3 are fixed fields in the reply:
+    session->greeting[0] = ID_GREETING;
+    session->greeting[1] = PROTOCOL_VERSION;
+    session->greeting[2] = (uint8_t) ((string_size + 2 + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    session->greeting[3] = (WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0) ? GREETING_TICKETS : GREETING_PIPELINING;
     // bytes 4 .. 19 contain the board ID in uppercase hex format
-    session->reply_header.data_size = ((uint32_t) session->data[2]) * AES_BLOCK_SIZE;
-    // bytes 20 .. <unspecified> contain UTF-8 text that can be printed
+    session->reply_header.data_size = ((uint32_t) session->greeting[2]) * AES_BLOCK_SIZE;
+    // bytes 20 .. <unspecified> contain UTF-8 text that can be printed, ending with a zero byte
+    // the last byte contains GREETING_CAP_* flags (older versions send zero or text here)
+    session->greeting[session->reply_header.data_size - 1] = GREETING_CAP_CTR;
 
     session->state = SEND_GREETING;
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    if (g_stream_hash_in_use) {
+        // The handshake needs SHA-256, so the client must try again after the
+        // streaming request: this is reported before the connection is closed
+        g_session_stats.num_rejected++;
+        session->state = SEND_CLEAR_BUSY_ERROR;
+    }
+#endif
     send_while_able(session, client_pcb);
     return ERR_OK;
 }
 
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+// Single-datagram requests: the request is "PWR?", a nonce, then the body (msg_type,
+// 3 reserved bytes, parameter and data) encrypted with AES-CTR, then a MAC (HMAC, truncated)
+// of everything before it. The reply has the same layout, beginning with "PWR:", and the
+// body contains the result and reply data. The keys are unique to each request: "CE" and "CM"
+// for the request, "SE" and "SM" for the reply.
+static void udp_rpc_key(const uint8_t* nonce, const char* append_code, uint8_t* key) {
+    generate_secret_hmac((const uint8_t*) UDP_RPC_REQUEST_MAGIC, UDP_RPC_MAGIC_SIZE,
+                         nonce, UDP_RPC_NONCE_SIZE, append_code, key, HMAC_DIGEST_SIZE);
+}
+
+static void udp_rpc_mac(
+        const uint8_t* nonce,
+        const char* append_code,
+        const uint8_t* datagram,
+        const uint size,
+        uint8_t* mac) {
+    // HMAC of the datagram (up to the MAC), truncated to UDP_RPC_MAC_SIZE
+    uint8_t key[HMAC_DIGEST_SIZE];
+    udp_rpc_key(nonce, append_code, key);
+
+    const uint64_t start_us = time_us_64();
+    uint8_t k_pad[HMAC_BLOCK_SIZE];
+    uint8_t digest[HMAC_DIGEST_SIZE];
+    wifi_settings_sha256_context_t ctx;
+    wifi_settings_sha256_init(&ctx);
+    get_hmac_pad(k_pad, key, 0x36);
+    if ((0 != wifi_settings_sha256_starts(&ctx))
+    || (0 != wifi_settings_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))
+    || (0 != wifi_settings_sha256_update(&ctx, datagram, size))
+    || (0 != wifi_settings_sha256_finish(&ctx, digest))) {
+        panic("udp_rpc_mac sha256 (1) failed");
+    }
+    wifi_settings_sha256_free(&ctx);
+    get_hmac_pad(k_pad, key, 0x5c);
+    wifi_settings_sha256_init(&ctx);
+    if ((0 != wifi_settings_sha256_starts(&ctx))
+    || (0 != wifi_settings_sha256_update(&ctx, k_pad, HMAC_BLOCK_SIZE))
+    || (0 != wifi_settings_sha256_update(&ctx, digest, HMAC_DIGEST_SIZE))
+    || (0 != wifi_settings_sha256_finish(&ctx, digest))) {
+        panic("udp_rpc_mac sha256 (2) failed");
+    }
+    wifi_settings_sha256_free(&ctx);
+    memcpy(mac, digest, UDP_RPC_MAC_SIZE);
+    memset(key, 0, HMAC_DIGEST_SIZE);
+    add_crypto_time(start_us);
+}
+
+static void udp_rpc_crypt(
+        const uint8_t* nonce,
+        const char* append_code,
+        uint8_t* data,
+        const uint size) {
+    // AES-CTR in place, with the counter starting at zero. Whole blocks are processed,
+    // so there must be space after the data (see g_udp_rpc_buffer).
+    uint8_t key[AES_KEY_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    udp_rpc_key(nonce, append_code, key);
+
+    const uint64_t start_us = time_us_64();
+    mbedtls_aes_context ctx;
+    memset(counter, 0, AES_BLOCK_SIZE);
+    mbedtls_aes_init(&ctx);
+    if (0 != mbedtls_aes_setkey_enc(&ctx, key, AES_KEY_SIZE * 8)) {
+        panic("udp_rpc_crypt aes failed");
+    }
+    crypt_ctr_blocks(&ctx, counter, data, data, size);
+    mbedtls_aes_free(&ctx);
+    memset(key, 0, AES_KEY_SIZE);
+    add_crypto_time(start_us);
+}
+
+static bool udp_rpc_is_fresh(const uint8_t* nonce) {
+    // Check a request against the replay protection (see udp_rpc_replay_t),
+    // and remember it if it is accepted
+    uint32_t epoch;
+    uint64_t counter;
+    memcpy(&epoch, nonce, sizeof(epoch));
+    memcpy(&counter, &nonce[4], sizeof(counter));
+    if ((epoch != g_udp_rpc_replay.epoch) || (counter < g_udp_rpc_replay.min_counter)) {
+        return false;
+    }
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE; i++) {
+        if (memcmp(g_udp_rpc_replay.recent[i], &nonce[4], UDP_RPC_NONCE_SIZE - 4) == 0) {
+            return false;
+        }
+    }
+    // Replace the oldest request
+    uint8_t* oldest = g_udp_rpc_replay.recent[g_udp_rpc_replay.recent_index];
+    uint64_t oldest_counter;
+    memcpy(&oldest_counter, oldest, sizeof(oldest_counter));
+    if ((oldest_counter >= g_udp_rpc_replay.min_counter) && (oldest_counter < UINT64_MAX)) {
+        g_udp_rpc_replay.min_counter = oldest_counter + 1;
+    }
+    memcpy(oldest, &nonce[4], UDP_RPC_NONCE_SIZE - 4);
+    g_udp_rpc_replay.recent_index = (g_udp_rpc_replay.recent_index + 1)
+                                    % WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE;
+    return true;
+}
+
+static void udp_rpc_send(
+        struct udp_pcb* pcb,
+        const ip_addr_t* addr,
+        u16_t port,
+        uint8_t* datagram,
+        const uint size) {
+    // Add the MAC to the reply (in g_udp_rpc_buffer) and send it
+    udp_rpc_mac(&datagram[UDP_RPC_MAGIC_SIZE], "SM", datagram, size, &datagram[size]);
+    struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, (u16_t) (size + UDP_RPC_MAC_SIZE), PBUF_RAM);
+    if (!p) {
+        return;
+    }
+    memcpy(p->payload, datagram, size + UDP_RPC_MAC_SIZE);
+    udp_sendto(pcb, p, addr, port);
+    pbuf_free(p);
+}
+
+static void udp_rpc_recv(
+        struct udp_pcb* pcb,
+        struct pbuf* p,
+        const ip_addr_t* addr,
+        u16_t port) {
+    // Called by responder_recv for a UDP_RPC_REQUEST_MAGIC datagram. Requests that
+    // are not authenticated are ignored.
+    uint8_t* datagram = g_udp_rpc_buffer;
+    const uint size = p->tot_len;
+    if ((size < (UDP_RPC_HEADER_SIZE + UDP_RPC_BODY_HEADER_SIZE + UDP_RPC_MAC_SIZE))
+    || (size > WIFI_SETTINGS_REMOTE_UDP_RPC_MAX_SIZE)
+    || (!g_secret_valid)
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    || g_stream_hash_in_use
+#endif
+    || (pbuf_copy_partial(p, datagram, (u16_t) size, 0) != size)) {
+        pbuf_free(p);
+        return;
+    }
+    pbuf_free(p);
+
+    // Check the MAC before anything else
+    const uint8_t* nonce = &datagram[UDP_RPC_MAGIC_SIZE];
+    uint8_t expect_mac[UDP_RPC_MAC_SIZE];
+    udp_rpc_mac(nonce, "CM", datagram, size - UDP_RPC_MAC_SIZE, expect_mac);
+    if (memcmp(expect_mac, &datagram[size - UDP_RPC_MAC_SIZE], UDP_RPC_MAC_SIZE) != 0) {
+        return;
+    }
+    uint8_t* body = &datagram[UDP_RPC_HEADER_SIZE];
+    if (!udp_rpc_is_fresh(nonce)) {
+        // Reject with "PWR!", the epoch and min_counter, so that the client
+        // can send the request again with a new nonce
+        memcpy(datagram, UDP_RPC_REJECT_MAGIC, UDP_RPC_MAGIC_SIZE);
+        memcpy(&body[0], &g_udp_rpc_replay.epoch, sizeof(uint32_t));
+        memcpy(&body[4], &g_udp_rpc_replay.min_counter, sizeof(uint64_t));
+        udp_rpc_send(pcb, addr, port, datagram, UDP_RPC_HEADER_SIZE + 12);
+        return;
+    }
+
+    // Decrypt the body and call the handler, which replaces the data
+    const uint body_size = size - UDP_RPC_HEADER_SIZE - UDP_RPC_MAC_SIZE;
+    udp_rpc_crypt(nonce, "CE", body, body_size);
+    const uint8_t msg_type = body[0];
+    const uint8_t handler_id = msg_type - ID_FIRST_HANDLER;
+    uint8_t* data = &body[UDP_RPC_BODY_HEADER_SIZE];
+    const uint32_t data_size = body_size - UDP_RPC_BODY_HEADER_SIZE;
+    uint32_t reply_data_size = 0;
+    int32_t result;
+    memcpy(&result, &body[4], sizeof(int32_t));
+
+    if ((handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].callback1
+    && g_handler_table[(uint) handler_id].udp_rpc
+    && wifi_settings_remote_is_task_busy()) {
+        // Handlers are not called here while the wifi_settings task may be
+        // running one, so the client should try again later
+        result = 0;
+        body[1] = ID_BUSY_ERROR;
+    } else if ((handler_id < NUM_HANDLERS)
+    && g_handler_table[(uint) handler_id].callback1
+    && g_handler_table[(uint) handler_id].udp_rpc) {
+        const uint64_t start_us = time_us_64();
+        handler_output_t output = {UDP_RPC_MAX_DATA_SIZE, NULL};
+        WIFI_SETTINGS_PROFILE_START(profile_start);
+        result = g_handler_table[(uint) handler_id].callback1(
+                msg_type, data, data_size, result, &output.data_size,
+                g_handler_table[(uint) handler_id].arg);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_HANDLER, profile_start);
+        reply_data_size = output.data_size;
+        if (reply_data_size > UDP_RPC_MAX_DATA_SIZE) {
+            reply_data_size = UDP_RPC_MAX_DATA_SIZE;
+        }
+        if (output.source) {
+            // The reply is encrypted in place, so it is copied
+            memmove(data, output.source, reply_data_size);
+        }
+        add_handler_time(handler_id, start_us, true, data_size, reply_data_size);
+        body[1] = ID_OK;
+    } else {
+        // Like ID_BAD_HANDLER_ERROR for a TCP request
+        result = 0;
+        body[1] = ID_BAD_HANDLER_ERROR;
+    }
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+    start_prepare_flash();
+#endif
+
+    // Reply with the result: msg_type, status (ID_OK, ID_BUSY_ERROR or
+    // ID_BAD_HANDLER_ERROR), 2 reserved bytes, result and data
+    memcpy(datagram, UDP_RPC_REPLY_MAGIC, UDP_RPC_MAGIC_SIZE);
+    body[2] = body[3] = 0;
+    memcpy(&body[4], &result, sizeof(int32_t));
+    const uint reply_body_size = UDP_RPC_BODY_HEADER_SIZE + reply_data_size;
+    udp_rpc_crypt(nonce, "SE", body, reply_body_size);
+    udp_rpc_send(pcb, addr, port, datagram, UDP_RPC_HEADER_SIZE + reply_body_size);
+    // Clear the data, which may include secrets
+    memset(g_udp_rpc_buffer, 0, sizeof(g_udp_rpc_buffer));
+}
+#endif
+
+#if WIFI_SETTINGS_REMOTE_RESPONDER
 static void responder_recv(
         void* unused,
         struct udp_pcb *pcb,
@@ -813,6 +2463,14 @@ static void responder_recv(
         const ip_addr_t *addr,
         u16_t port) {
   
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    if (p->payload && (p->len >= UDP_RPC_MAGIC_SIZE)
+    && (memcmp(p->payload, UDP_RPC_REQUEST_MAGIC, UDP_RPC_MAGIC_SIZE) == 0)) {
+        udp_rpc_recv(pcb, p, addr, port);
+        return;
+    }
+#endif
+
     // Copy the request into a responder_packet_t
     responder_packet_t mp;
     memset(&mp, 0, sizeof(mp));
@@ -837,14 +2495,145 @@ static void responder_recv(
     memcpy(mp.magic, RESPONDER_REPLY_MAGIC, sizeof(mp.magic));
     memcpy(mp.board_id_hex, my_board_id_hex, BOARD_ID_SIZE * 2);
 
-    p = pbuf_alloc(PBUF_TRANSPORT, sizeof(responder_packet_t), PBUF_RAM);
+    char reply[RESPONDER_REPLY_MAX_SIZE];
+    memcpy(reply, &mp, sizeof(responder_packet_t));
+    uint16_t reply_size = sizeof(responder_packet_t);
+#if WIFI_SETTINGS_REMOTE_RESPONDER_DETAILS
+    // The board id is followed by key=value lines with the hostname and versions,
+    // so that remote_picotool can list boards without connecting to each one
+    const char* version = wifi_settings_get_binary_info_string(
+        BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING);
+    int text_size = snprintf(&reply[sizeof(responder_packet_t)],
+        sizeof(reply) - sizeof(responder_packet_t),
+        "name=%s\nwifi_settings_version=" WIFI_SETTINGS_VERSION_STRING "\nversion=%s\n",
+        wifi_settings_get_hostname(), version ? version : "");
+    if ((text_size < 0) || (text_size >= (int) (sizeof(reply) - sizeof(responder_packet_t)))) {
+        text_size = sizeof(reply) - sizeof(responder_packet_t) - 1;
+    }
+    reply_size += (uint16_t) text_size;
+#endif
+
+    p = pbuf_alloc(PBUF_TRANSPORT, reply_size, PBUF_RAM);
     if (!p) {
         return;
     }
-    memcpy(p->payload, &mp, sizeof(responder_packet_t));
+    memcpy(p->payload, reply, reply_size);
     udp_sendto(pcb, p, addr, port);
     pbuf_free(p);
 }
+#endif
+
+#if DEFERRED_HANDLERS
+static void run_deferred_handler(session_t* session) {
+    // Called in the wifi_settings task (without holding the lwIP lock)
+    // or in the handler worker to run a handler queued by defer_handler
+    if (session->state == EXECUTE_CALLBACK2) {
+        // The connection is already closed
+        call_handler2(session);
+        cyw43_arch_lwip_begin();
+        g_task_busy_count--;
+        delete_session(session);
+        cyw43_arch_lwip_end();
+        return;
+    }
+
+    uint32_t reply_data_size;
+    int32_t result;
+    call_handler1(session, &reply_data_size, &result);
+
+    cyw43_arch_lwip_begin();
+    g_task_busy_count--;
+    session->handler_busy = false;
+    struct tcp_pcb* client_pcb = session->client_pcb;
+    if (session->closed) {
+        // The connection was closed while the handler was running
+        delete_session(session);
+    } else if (session->state != EXECUTE_CALLBACK1) {
+        // The client sent something unexpected while the handler was running
+        delete_session(session);
+        server_tcp_close(client_pcb);
+    } else {
+        // Send the reply
+        finish_enc_request(session, reply_data_size, result);
+        send_while_able(session, client_pcb);
+        if (process_input(session, client_pcb)) {
+            tcp_output(client_pcb);
+        }
+    }
+    cyw43_arch_lwip_end();
+}
+
+#if WIFI_SETTINGS_TASK
+static void wifi_settings_task(void* unused) {
+    while (true) {
+        cyw43_arch_lwip_begin();
+        session_t* session = take_deferred_session();
+        cyw43_arch_lwip_end();
+        if (session) {
+            run_deferred_handler(session);
+            continue;
+        }
+        TickType_t wait = portMAX_DELAY;
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+        if (wifi_settings_prepare_flash_pending()) {
+            // Erase Flash for ID_PREPARE_FLASH_HANDLER while there are no handlers to run
+            wait = 1;
+        }
+#endif
+        // defer_handler adds to the list before notifying the task, so a session
+        // added after the list was checked makes this return immediately
+        if ((ulTaskNotifyTake(pdTRUE, wait) == 0) && (wait != portMAX_DELAY)) {
+#ifdef ENABLE_REMOTE_MEMORY_ACCESS
+            // Counted as busy, so that nothing else is written to Flash meanwhile
+            cyw43_arch_lwip_begin();
+            g_task_busy_count++;
+            cyw43_arch_lwip_end();
+            wifi_settings_prepare_flash_step();
+            cyw43_arch_lwip_begin();
+            g_task_busy_count--;
+            cyw43_arch_lwip_end();
+#endif
+        }
+    }
+}
+
+static void start_task() {
+    if (g_task) {
+        return; // already running
+    }
+    TaskHandle_t task = NULL;
+    if (xTaskCreate(wifi_settings_task, "wifi_settings", WIFI_SETTINGS_TASK_STACK_SIZE,
+                    NULL, WIFI_SETTINGS_TASK_PRIORITY, &task) != pdPASS) {
+        return; // handlers will run in the async_context
+    }
+    g_task = task;
+#if (configUSE_CORE_AFFINITY == 1) && (configNUMBER_OF_CORES > 1)
+    if (WIFI_SETTINGS_TASK_CORE_AFFINITY != -1) {
+        vTaskCoreAffinitySet(task, (UBaseType_t) WIFI_SETTINGS_TASK_CORE_AFFINITY);
+    }
+#endif
+}
+#else
+static void handler_worker_callback(async_context_t* unused1, async_when_pending_worker_t* unused2) {
+    // Called (via async_context) to run the handlers queued by defer_handler.
+    // Handlers queued while these are running are left for the next call.
+    session_t* last = g_deferred_last;
+    session_t* session = NULL;
+    while (last && (session != last)) {
+        session = take_deferred_session();
+        run_deferred_handler(session);
+    }
+}
+
+static void start_handler_worker() {
+    if (g_handler_worker.do_work) {
+        return; // already running
+    }
+    g_handler_worker.do_work = handler_worker_callback;
+    async_context_add_when_pending_worker(cyw43_arch_async_context(), &g_handler_worker);
+}
+#endif
+#endif
 
 int wifi_settings_remote_set_two_stage_handler(
         uint8_t msg_type,
@@ -857,7 +2646,35 @@ int wifi_settings_remote_set_two_stage_handler(
     }
     g_handler_table[(uint) handler_id].callback1 = callback1;
     g_handler_table[(uint) handler_id].callback2 = callback2;
+    g_handler_table[(uint) handler_id].stream_begin = NULL;
+    g_handler_table[(uint) handler_id].stream_data = NULL;
+    g_handler_table[(uint) handler_id].stream_end = NULL;
     g_handler_table[(uint) handler_id].arg = arg;
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    g_handler_table[(uint) handler_id].udp_rpc = false;
+#endif
+    return PICO_ERROR_NONE;
+}
+
+int wifi_settings_remote_set_stream_handler(
+        uint8_t msg_type,
+        handler_stream_begin_t stream_begin,
+        handler_stream_data_t stream_data,
+        handler_stream_end_t stream_end,
+        void* arg) {
+    uint8_t handler_id = msg_type - ID_FIRST_HANDLER;
+    if (handler_id >= NUM_HANDLERS) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    g_handler_table[(uint) handler_id].callback1 = NULL;
+    g_handler_table[(uint) handler_id].callback2 = NULL;
+    g_handler_table[(uint) handler_id].stream_begin = stream_begin;
+    g_handler_table[(uint) handler_id].stream_data = stream_data;
+    g_handler_table[(uint) handler_id].stream_end = stream_end;
+    g_handler_table[(uint) handler_id].arg = arg;
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    g_handler_table[(uint) handler_id].udp_rpc = false;
+#endif
     return PICO_ERROR_NONE;
 }
 
@@ -868,29 +2685,136 @@ int wifi_settings_remote_set_handler(
     return wifi_settings_remote_set_two_stage_handler(msg_type, callback, NULL, arg);
 }
 
+int wifi_settings_remote_allow_udp_rpc(uint8_t msg_type) {
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    uint8_t handler_id = msg_type - ID_FIRST_HANDLER;
+    if ((handler_id >= NUM_HANDLERS)
+    || (!g_handler_table[(uint) handler_id].callback1)
+    || g_handler_table[(uint) handler_id].callback2) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    g_handler_table[(uint) handler_id].udp_rpc = true;
+    return PICO_ERROR_NONE;
+#else
+    return PICO_ERROR_NOT_PERMITTED;
+#endif
+}
+
 void wifi_settings_remote_update_secret() {
+    WIFI_SETTINGS_PROFILE_START(profile_start);
     g_secret_valid = false;
     memset(g_secret_hashed, 0, HMAC_DIGEST_SIZE);
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    // Tickets issued with the old secret can't be used
+    memset(g_tickets, 0, sizeof(g_tickets));
+#endif
 
-    uint8_t update_secret[128];
-    uint update_secret_size = sizeof(update_secret);
+    // The secret is copied while the staged updates are locked, as a staged
+    // value may be moved by another change; then it is hashed without the lock
+    char update_secret[MAX_UPDATE_SECRET_SIZE];
+    const char* value = NULL;
+    uint update_secret_size = 0;
+
+    const bool need_lock = wifi_settings_staged_update_lock();
+    if (wifi_settings_get_value_pointer_for_key(
+            "update_secret", &value, &update_secret_size)) {
+        if (update_secret_size > MAX_UPDATE_SECRET_SIZE) {
+            // Only the beginning of a long secret is used, as in earlier versions
+            update_secret_size = MAX_UPDATE_SECRET_SIZE;
+        }
+        memcpy(update_secret, value, update_secret_size);
+    } else {
+        update_secret_size = 0;
+    }
+    wifi_settings_staged_update_unlock(need_lock);
 
-    if (wifi_settings_get_value_for_key(
-            "update_secret", (char*) update_secret, &update_secret_size)
-    && (update_secret_size > 0)) {
-        mbedtls_sha256_context ctx;
-        mbedtls_sha256_init(&ctx);
+    if (update_secret_size > 0) {
+        wifi_settings_sha256_context_t ctx;
+        wifi_settings_sha256_init(&ctx);
         for (uint i = 0; i < 4096; i++) {
-            if ((0 != mbedtls_sha256_starts(&ctx, 0))
-            || (0 != mbedtls_sha256_update(&ctx, g_secret_hashed, HMAC_DIGEST_SIZE))
-            || (0 != mbedtls_sha256_update(&ctx, update_secret, update_secret_size))
-            || (0 != mbedtls_sha256_finish(&ctx, g_secret_hashed))) {
+            if ((0 != wifi_settings_sha256_starts(&ctx))
+            || (0 != wifi_settings_sha256_update(&ctx, g_secret_hashed, HMAC_DIGEST_SIZE))
+            || (0 != wifi_settings_sha256_update(&ctx, (const uint8_t*) update_secret, update_secret_size))
+            || (0 != wifi_settings_sha256_finish(&ctx, g_secret_hashed))) {
                 panic("update_secret sha256 failed");
             }
         }
-        mbedtls_sha256_free(&ctx);
+        wifi_settings_sha256_free(&ctx);
         g_secret_valid = true;
+        memset(update_secret, 0, sizeof(update_secret));
+    }
+#ifdef HMAC_PRECOMPUTED_STATES
+#if WIFI_SETTINGS_REMOTE_LAZY_INIT
+    // The states are computed by generate_authentication when they are next needed
+    discard_hmac_states();
+#else
+    update_hmac_states();
+#endif
+#endif
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_SECRET_HASH, profile_start);
+}
+
+static void file_change_callback(void* arg) {
+    // The update secret may have changed
+    wifi_settings_remote_update_secret();
+}
+
+static wifi_settings_file_change_subscriber_t g_file_change_subscriber = {
+    .callback = file_change_callback,
+};
+
+static int start_service() {
+    // Called with the lwIP lock held
+    // Load secret, and reload it whenever the file changes
+    wifi_settings_remote_update_secret();
+    wifi_settings_add_file_change_subscriber(&g_file_change_subscriber);
+
+    // Start TCP service
+    struct tcp_pcb* port_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!port_pcb) {
+        panic("wifi_settings_remote: tcp_new_ip_type failed\n");
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+
+    err_t lwip_err = tcp_bind(port_pcb, NULL, WIFI_SETTINGS_REMOTE_PORT_NUMBER);
+    if (lwip_err) {
+        panic("wifi_settings_remote: tcp_bind failed\n");
+        return PICO_ERROR_RESOURCE_IN_USE;
     }
+
+    g_remote_service_pcb = tcp_listen_with_backlog(port_pcb, 1);
+    if (!g_remote_service_pcb) {
+        panic("wifi_settings_remote: tcp_listen_with_backlog failed\n");
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    tcp_accept(g_remote_service_pcb, server_accept);
+
+#if WIFI_SETTINGS_REMOTE_RESPONDER
+    // Start UDP service (responder)
+    g_responder_service_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!g_responder_service_pcb) {
+        panic("wifi_settings_remote: udp_new_ip_type failed\n");
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    lwip_err = udp_bind(g_responder_service_pcb, NULL, WIFI_SETTINGS_REMOTE_PORT_NUMBER);
+    if (lwip_err) {
+        panic("wifi_settings_remote: udp_bind failed\n");
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    udp_recv(g_responder_service_pcb, responder_recv, NULL);
+#endif
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    // Single-datagram requests from before this boot have a different epoch
+    memset(&g_udp_rpc_replay, 0, sizeof(g_udp_rpc_replay));
+    while (g_udp_rpc_replay.epoch == 0) {
+        rng_128_t rng;
+        get_rand_128(&rng);
+        memcpy(&g_udp_rpc_replay.epoch, &rng, sizeof(uint32_t));
+    }
+    g_udp_rpc_replay.min_counter = 1;
+#endif
+
+    return PICO_ERROR_NONE;
 }
 
 int wifi_settings_remote_init() {
@@ -898,18 +2822,42 @@ int wifi_settings_remote_init() {
 
     // We will be calling LWIP functions, so the lock is needed
     cyw43_arch_lwip_begin();
-    if (g_remote_service_pcb) {
+    if (g_remote_initialised) {
         goto end;
     }
-
-    // Load secret
-    wifi_settings_remote_update_secret();
+    g_remote_initialised = true;
 
     // Install handlers for messages
     wifi_settings_remote_set_handler(ID_PICO_INFO_HANDLER,
             wifi_settings_pico_info_handler, NULL);
+    wifi_settings_remote_set_handler(ID_STATS_HANDLER,
+            wifi_settings_stats_handler, NULL);
+    wifi_settings_remote_set_handler(ID_PING_HANDLER,
+            wifi_settings_ping_handler, NULL);
     wifi_settings_remote_set_handler(ID_UPDATE_HANDLER,
             wifi_settings_update_handler, NULL);
+    wifi_settings_remote_set_handler(ID_LINK_QUALITY_HANDLER,
+            wifi_settings_link_quality_handler, NULL);
+    wifi_settings_remote_set_handler(ID_SET_KEY_HANDLER,
+            wifi_settings_set_key_handler, NULL);
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+    wifi_settings_remote_set_handler(ID_TELEMETRY_HANDLER,
+            wifi_settings_telemetry_handler, NULL);
+#endif
+#if WIFI_SETTINGS_EVENT_LOG
+    wifi_settings_remote_set_handler(ID_EVENT_LOG_HANDLER,
+            wifi_settings_event_log_handler, NULL);
+#endif
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    // Handlers which only return information can be called by a single UDP datagram
+    wifi_settings_remote_allow_udp_rpc(ID_PICO_INFO_HANDLER);
+    wifi_settings_remote_allow_udp_rpc(ID_STATS_HANDLER);
+    wifi_settings_remote_allow_udp_rpc(ID_PING_HANDLER);
+    wifi_settings_remote_allow_udp_rpc(ID_LINK_QUALITY_HANDLER);
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+    wifi_settings_remote_allow_udp_rpc(ID_TELEMETRY_HANDLER);
+#endif
+#endif
     wifi_settings_remote_set_two_stage_handler(
             ID_UPDATE_REBOOT_HANDLER,
             wifi_settings_update_reboot_handler1,
@@ -918,55 +2866,61 @@ int wifi_settings_remote_init() {
 #ifdef ENABLE_REMOTE_MEMORY_ACCESS
     wifi_settings_remote_set_handler(ID_READ_HANDLER,
             wifi_settings_read_handler, NULL);
+    wifi_settings_remote_set_handler(ID_READ_RANGES_HANDLER,
+            wifi_settings_read_ranges_handler, NULL);
     wifi_settings_remote_set_handler(ID_WRITE_FLASH_HANDLER,
             wifi_settings_write_flash_handler, NULL);
+    wifi_settings_remote_set_handler(ID_HASH_FLASH_HANDLER,
+            wifi_settings_hash_flash_handler, NULL);
+    wifi_settings_remote_set_handler(ID_PREPARE_FLASH_HANDLER,
+            wifi_settings_prepare_flash_handler, NULL);
     wifi_settings_remote_set_two_stage_handler(
             ID_OTA_FIRMWARE_UPDATE_HANDLER,
             wifi_settings_ota_firmware_update_handler1,
             wifi_settings_ota_firmware_update_handler2, NULL);
+#if WIFI_SETTINGS_REMOTE_MULTICAST_OTA
+    wifi_settings_remote_set_handler(ID_MULTICAST_OTA_HANDLER,
+            wifi_settings_multicast_ota_handler, NULL);
+#endif
+#if PICO_RP2350
+    wifi_settings_remote_set_handler(ID_AB_OTA_TARGET_HANDLER,
+            wifi_settings_ab_ota_target_handler, NULL);
+    wifi_settings_remote_set_two_stage_handler(
+            ID_AB_OTA_HANDLER,
+            wifi_settings_ab_ota_handler1,
+            wifi_settings_ab_ota_handler2, NULL);
+    // If this firmware was installed by an A/B OTA update, it has started successfully
+    wifi_settings_ab_ota_buy();
+#endif
     bi_decl_if_func_used(bi_program_feature("pico-wifi-settings remote memory access"));
 #endif
 
-    // Start TCP service
-    struct tcp_pcb* port_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
-    if (!port_pcb) {
-        panic("wifi_settings_remote_init(): tcp_new_ip_type failed\n");
-        pico_err = PICO_ERROR_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
-
-    err_t lwip_err = tcp_bind(port_pcb, NULL, PORT_NUMBER);
-    if (lwip_err) {
-        panic("wifi_settings_remote_init(): tcp_bind failed\n");
-        pico_err = PICO_ERROR_RESOURCE_IN_USE;
-        goto end;
-    }
-
-    g_remote_service_pcb = tcp_listen_with_backlog(port_pcb, 1);
-    if (!g_remote_service_pcb) {
-        panic("wifi_settings_remote_init(): tcp_listen_with_backlog failed\n");
-        pico_err = PICO_ERROR_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
-    tcp_accept(g_remote_service_pcb, server_accept);
-
-    // Start UDP service (responder)
-    g_responder_service_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
-    if (!g_responder_service_pcb) {
-        panic("wifi_settings_remote_init(): udp_new_ip_type failed\n");
-        pico_err = PICO_ERROR_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
-    lwip_err = udp_bind(g_responder_service_pcb, NULL, PORT_NUMBER);
-    if (lwip_err) {
-        panic("wifi_settings_remote_init(): udp_bind failed\n");
-        pico_err = PICO_ERROR_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
-    udp_recv(g_responder_service_pcb, responder_recv, NULL);
+#if WIFI_SETTINGS_TASK
+    // Start the task for running handlers
+    start_task();
+#elif DEFERRED_HANDLERS
+    // Start the async_context worker for running handlers
+    start_handler_worker();
+#endif
 
-    pico_err = PICO_ERROR_NONE; 
+#if WIFI_SETTINGS_REMOTE_LAZY_INIT
+    // The service is started by wifi_settings_remote_connected()
+    g_remote_start_pending = true;
+#else
+    pico_err = start_service();
+#endif
 end:
     cyw43_arch_lwip_end();
     return pico_err;
 }
+
+int wifi_settings_remote_connected() {
+    int pico_err = PICO_ERROR_NONE;
+#if WIFI_SETTINGS_REMOTE_LAZY_INIT
+    if (g_remote_start_pending) {
+        g_remote_start_pending = false;
+        pico_err = start_service();
+    }
+#endif
+    return pico_err;
+}
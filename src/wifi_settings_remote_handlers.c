@@ -9,10 +9,13 @@
  */
 
 #include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_connect.h"
+#include "wifi_settings/wifi_settings_event_log.h"
 #include "wifi_settings/wifi_settings_remote.h"
 #include "wifi_settings/wifi_settings_remote_handlers.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
+#include "wifi_settings/wifi_settings_profile.h"
 
 #include "hardware/flash.h"
 #include "hardware/structs/sysinfo.h"
@@ -28,6 +31,7 @@
 #include "pico/multicore.h"
 #endif
 
+#include <malloc.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -43,7 +47,7 @@
 extern binary_info_t* __binary_info_start[];
 extern binary_info_t* __binary_info_end[];
 
-static const char* binary_info_get_string_for_id(uint32_t id) {
+const char* wifi_settings_get_binary_info_string(uint32_t id) {
     for (binary_info_t** item = __binary_info_start;
                 item != __binary_info_end; item++) {
         if ((item[0]->type == BINARY_INFO_TYPE_ID_AND_STRING)
@@ -59,59 +63,162 @@ static const char* binary_info_get_string_for_id(uint32_t id) {
 }
 
 typedef struct pico_info_buf_t {
-    char* text;
+    uint8_t* data;
     uint index;
-    uint max_text_size;
+    uint max_size;
+    bool binary;
 } pico_info_buf_t;
 
-static void add_pico_info_string(
+// Keys for WIFI_SETTINGS_PICO_INFO_TEXT
+static const char* const g_pico_info_keys[PICO_INFO_NUM_TAGS] = {
+    [PICO_INFO_FLASH_SECTOR_SIZE] = "flash_sector_size",
+    [PICO_INFO_MAX_DATA_SIZE] = "max_data_size",
+    [PICO_INFO_FLASH_ALL] = "flash_all",
+    [PICO_INFO_FLASH_REUSABLE] = "flash_reusable",
+    [PICO_INFO_FLASH_WIFI_SETTINGS_FILE] = "flash_wifi_settings_file",
+    [PICO_INFO_FLASH_PROGRAM] = "flash_program",
+    [PICO_INFO_LOGICAL_OFFSET] = "logical_offset",
+    [PICO_INFO_MULTICORE] = "multicore",
+    [PICO_INFO_REMOTE_MEMORY_ACCESS] = "remote_memory_access",
+    [PICO_INFO_MAX_READ_SIZE] = "max_read_size",
+    [PICO_INFO_AB_OTA] = "ab_ota",
+    [PICO_INFO_FLASH_SECTOR_HASH] = "flash_sector_hash",
+    [PICO_INFO_FLASH_PREPARE] = "flash_prepare",
+    [PICO_INFO_MULTICAST_OTA] = "multicast_ota",
+    [PICO_INFO_WRITE_FLASH_COMPRESSION] = "write_flash_compression",
+    [PICO_INFO_SYSINFO_CHIP_ID] = "sysinfo_chip_id",
+    [PICO_INFO_BOARD_ID] = "board_id",
+    [PICO_INFO_NAME] = "name",
+    [PICO_INFO_IP] = "ip",
+    [PICO_INFO_CONNECT_TIMING] = "connect_timing",
+    [PICO_INFO_FLASH_UPDATE_COUNT] = "flash_update_count",
+    [PICO_INFO_FLASH_ERASE_MAX_US] = "flash_erase_max_us",
+    [PICO_INFO_FLASH_PROGRAM_MAX_US] = "flash_program_max_us",
+    [PICO_INFO_REMOTE_SESSIONS_ACTIVE] = "remote_sessions_active",
+    [PICO_INFO_REMOTE_SESSIONS_MAX] = "remote_sessions_max",
+    [PICO_INFO_REMOTE_SESSIONS_REJECTED] = "remote_sessions_rejected",
+    [PICO_INFO_REMOTE_SESSION_POOL_SIZE] = "remote_session_pool_size",
+    [PICO_INFO_PROFILE_UNIT] = "profile_unit",
+    [PICO_INFO_PROFILE] = "profile",
+    [PICO_INFO_WIFI_SETTINGS_VERSION] = "wifi_settings_version",
+    [PICO_INFO_PROGRAM] = "program",
+    [PICO_INFO_VERSION] = "version",
+    [PICO_INFO_BUILD_DATE] = "build_date",
+    [PICO_INFO_URL] = "url",
+    [PICO_INFO_DESCRIPTION] = "description",
+    [PICO_INFO_FEATURE] = "feature",
+    [PICO_INFO_BUILD_ATTRIBUTE] = "build_attribute",
+    [PICO_INFO_SDK_VERSION] = "sdk_version",
+    [PICO_INFO_REMOTE_DATA_BUFFER_POOL_SIZE] = "remote_data_buffer_pool_size",
+    [PICO_INFO_WRITE_FLASH_UNCHANGED] = "write_flash_unchanged",
+};
+
+static void add_pico_info_entry(
         pico_info_buf_t* buf,
-        const char* key,
-        const char* value) {
-    if (!value) {
-        return;
+        wifi_settings_pico_info_tag_t tag,
+        const void* value,
+        uint value_size) {
+    if (value_size > UINT8_MAX) {
+        value_size = UINT8_MAX;
     }
-    const uint value_size = strlen(value);
-    if (!value_size) {
+    if ((value_size + 2 + buf->index) > buf->max_size) {
         return;
     }
+    buf->data[buf->index] = (uint8_t) tag;
+    buf->data[buf->index + 1] = (uint8_t) value_size;
+    memcpy(&buf->data[buf->index + 2], value, value_size);
+    buf->index += value_size + 2;
+}
+
+static void add_pico_info_text(
+        pico_info_buf_t* buf,
+        const char* key,
+        const char* value) {
+    const uint value_size = strlen(value);
     const uint key_size = strlen(key);
     const uint total_size = key_size + value_size + 2;
-    if ((total_size + buf->index) > buf->max_text_size) {
+    if ((total_size + buf->index) > buf->max_size) {
         return;
     }
-    strcpy(&buf->text[buf->index], key);
+    char* text = (char*) buf->data;
+    strcpy(&text[buf->index], key);
     buf->index += key_size;
-    strcpy(&buf->text[buf->index], "=");
+    strcpy(&text[buf->index], "=");
     buf->index ++;
-    strcpy(&buf->text[buf->index], value);
+    strcpy(&text[buf->index], value);
     buf->index += value_size;
-    strcpy(&buf->text[buf->index], "\n");
+    strcpy(&text[buf->index], "\n");
     buf->index ++;
 }
 
+static void add_pico_info_string(
+        pico_info_buf_t* buf,
+        wifi_settings_pico_info_tag_t tag,
+        const char* value) {
+    if ((!value) || (!value[0])) {
+        return;
+    }
+    if (buf->binary) {
+        add_pico_info_entry(buf, tag, value, strlen(value));
+    } else {
+        add_pico_info_text(buf, g_pico_info_keys[tag], value);
+    }
+}
+
 static void add_pico_info_u32(
         pico_info_buf_t* buf,
-        const char* key,
+        wifi_settings_pico_info_tag_t tag,
         uint32_t value) {
+    if (buf->binary) {
+        add_pico_info_entry(buf, tag, &value, sizeof(value));
+        return;
+    }
     char tmp_buf[16];
     snprintf(tmp_buf, sizeof(tmp_buf), "0x%08x", (unsigned) value);
-    add_pico_info_string(buf, key, tmp_buf);
+    add_pico_info_text(buf, g_pico_info_keys[tag], tmp_buf);
 }
 
 static void add_pico_info_range(
         pico_info_buf_t* buf,
-        const char* key,
+        wifi_settings_pico_info_tag_t tag,
         void (* range_callback) (wifi_settings_flash_range_t* fr)) {
 
     wifi_settings_flash_range_t fr;
     range_callback(&fr);
 
+    const uint32_t value[2] = {fr.start_address, fr.start_address + fr.size};
+    if (buf->binary) {
+        add_pico_info_entry(buf, tag, value, sizeof(value));
+        return;
+    }
     char tmp_buf[32];
     snprintf(tmp_buf, sizeof(tmp_buf), "0x%08x:0x%08x",
-        (unsigned) fr.start_address, (unsigned) (fr.start_address + fr.size));
-    add_pico_info_string(buf, key, tmp_buf);
+        (unsigned) value[0], (unsigned) value[1]);
+    add_pico_info_text(buf, g_pico_info_keys[tag], tmp_buf);
+}
+
+#if WIFI_SETTINGS_PROFILE
+static void add_pico_info_profile(
+        pico_info_buf_t* buf,
+        wifi_settings_profile_id_t id) {
+    wifi_settings_profile_counter_t counter;
+    wifi_settings_profile_get(id, &counter);
+    if (buf->binary) {
+        uint8_t value[1 + sizeof(counter)];
+        value[0] = (uint8_t) id;
+        memcpy(&value[1], &counter, sizeof(counter));
+        add_pico_info_entry(buf, PICO_INFO_PROFILE, value, sizeof(value));
+        return;
+    }
+    char key_buf[32];
+    char value_buf[64];
+    snprintf(key_buf, sizeof(key_buf), "profile_%s", wifi_settings_profile_get_name(id));
+    snprintf(value_buf, sizeof(value_buf), "count=%u total=%llu max=%u",
+        (unsigned) counter.count, (unsigned long long) counter.total_time,
+        (unsigned) counter.max_time);
+    add_pico_info_text(buf, key_buf, value_buf);
 }
+#endif
 
 int32_t wifi_settings_pico_info_handler(
         uint8_t msg_type,
@@ -121,26 +228,29 @@ int32_t wifi_settings_pico_info_handler(
         uint32_t* output_data_size,
         void* arg) {
 
-    // No input is accepted
-    if ((input_data_size != 0) || (input_parameter != 0)) {
+    // No input is accepted, and the parameter is the format
+    if ((input_data_size != 0)
+    || ((input_parameter != WIFI_SETTINGS_PICO_INFO_TEXT)
+        && (input_parameter != WIFI_SETTINGS_PICO_INFO_BINARY))) {
         *output_data_size = 0;
         return PICO_ERROR_INVALID_ARG;
     }
 
-    // Set up for copying info text
+    // Set up for copying info
     pico_info_buf_t buf;
     memset(data_buffer, 0, *output_data_size);
-    buf.text = (char*) data_buffer;
+    buf.data = data_buffer;
     buf.index = 0;
-    buf.max_text_size = *output_data_size;
+    buf.max_size = *output_data_size;
+    buf.binary = (input_parameter == WIFI_SETTINGS_PICO_INFO_BINARY);
 
     // data to help with reprogramming
-    add_pico_info_u32(&buf, "flash_sector_size", FLASH_SECTOR_SIZE);
-    add_pico_info_u32(&buf, "max_data_size", *output_data_size);
-    add_pico_info_range(&buf, "flash_all", wifi_settings_range_get_all);
-    add_pico_info_range(&buf, "flash_reusable", wifi_settings_range_get_reusable);
-    add_pico_info_range(&buf, "flash_wifi_settings_file", wifi_settings_range_get_wifi_settings_file);
-    add_pico_info_range(&buf, "flash_program", wifi_settings_range_get_program);
+    add_pico_info_u32(&buf, PICO_INFO_FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    add_pico_info_u32(&buf, PICO_INFO_MAX_DATA_SIZE, *output_data_size);
+    add_pico_info_range(&buf, PICO_INFO_FLASH_ALL, wifi_settings_range_get_all);
+    add_pico_info_range(&buf, PICO_INFO_FLASH_REUSABLE, wifi_settings_range_get_reusable);
+    add_pico_info_range(&buf, PICO_INFO_FLASH_WIFI_SETTINGS_FILE, wifi_settings_range_get_wifi_settings_file);
+    add_pico_info_range(&buf, PICO_INFO_FLASH_PROGRAM, wifi_settings_range_get_program);
 
     // get logical memory offset for untranslated read accesses to Flash
     // (this address represents the start of Flash memory, i.e. flash address 0)
@@ -148,51 +258,263 @@ int32_t wifi_settings_pico_info_handler(
     wifi_settings_logical_range_t lr;
     wifi_settings_range_get_all(&fr);
     wifi_settings_range_translate_to_logical(&fr, &lr);
-    add_pico_info_u32(&buf, "logical_offset", (uint32_t) ((uintptr_t) lr.start_address));
+    add_pico_info_u32(&buf, PICO_INFO_LOGICAL_OFFSET, (uint32_t) ((uintptr_t) lr.start_address));
 
     // relevant features enabled
 #if LIB_PICO_MULTICORE
-    add_pico_info_string(&buf, "multicore", "1");
+    add_pico_info_string(&buf, PICO_INFO_MULTICORE, "1");
 #endif
 #ifdef ENABLE_REMOTE_MEMORY_ACCESS
-    add_pico_info_string(&buf, "remote_memory_access", "1");
+    add_pico_info_string(&buf, PICO_INFO_REMOTE_MEMORY_ACCESS, "1");
+    // ID_READ_HANDLER sends up to this much from Flash in one reply
+    add_pico_info_u32(&buf, PICO_INFO_MAX_READ_SIZE, WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE);
+#if PICO_RP2350
+    // ID_AB_OTA_TARGET_HANDLER and ID_AB_OTA_HANDLER are available
+    add_pico_info_string(&buf, PICO_INFO_AB_OTA, "1");
+#endif
+    // ID_HASH_FLASH_HANDLER returns a digest of each sector in this format
+    add_pico_info_string(&buf, PICO_INFO_FLASH_SECTOR_HASH, "sha256");
+    // ID_PREPARE_FLASH_HANDLER erases Flash in the background, ahead of ID_WRITE_FLASH_HANDLER
+    add_pico_info_string(&buf, PICO_INFO_FLASH_PREPARE, "1");
+    // ID_WRITE_FLASH_HANDLER accepts WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED
+    add_pico_info_string(&buf, PICO_INFO_WRITE_FLASH_UNCHANGED, "1");
+#if WIFI_SETTINGS_REMOTE_MULTICAST_OTA
+    // ID_MULTICAST_OTA_HANDLER can receive a firmware image from a multicast group
+    add_pico_info_string(&buf, PICO_INFO_MULTICAST_OTA, "1");
+#endif
+#if WIFI_SETTINGS_REMOTE_COMPRESSION
+    // ID_WRITE_FLASH_HANDLER accepts WIFI_SETTINGS_WRITE_FLASH_COMPRESSED data in this format
+    add_pico_info_string(&buf, PICO_INFO_WRITE_FLASH_COMPRESSION, "lz4");
+#endif
 #endif
 
     // sysinfo chip ID from sysinfo registers
-    add_pico_info_u32(&buf, "sysinfo_chip_id", *((io_ro_32*)(SYSINFO_BASE + SYSINFO_CHIP_ID_OFFSET)));
+    add_pico_info_u32(&buf, PICO_INFO_SYSINFO_CHIP_ID, *((io_ro_32*)(SYSINFO_BASE + SYSINFO_CHIP_ID_OFFSET)));
 
     // board id
-    add_pico_info_string(&buf, "board_id", wifi_settings_get_board_id_hex());
+    add_pico_info_string(&buf, PICO_INFO_BOARD_ID, wifi_settings_get_board_id_hex());
 
     // network info
-    add_pico_info_string(&buf, "name", wifi_settings_get_hostname());
+    add_pico_info_string(&buf, PICO_INFO_NAME, wifi_settings_get_hostname());
     char tmp_buf[16];
-    add_pico_info_string(&buf, "ip",
-        netif_default ? ip4addr_ntoa_r(netif_ip4_addr(netif_default),
-                               tmp_buf, sizeof(tmp_buf)) : NULL);
+    wifi_settings_get_ip(tmp_buf, sizeof(tmp_buf));
+    add_pico_info_string(&buf, PICO_INFO_IP, tmp_buf);
+    char timing_buf[128];
+    wifi_settings_get_connect_timing_text(timing_buf, sizeof(timing_buf));
+    add_pico_info_string(&buf, PICO_INFO_CONNECT_TIMING, timing_buf);
+
+    // longest times with interrupts disabled during updates of the wifi-settings file
+    wifi_settings_flash_update_stats_t stats;
+    wifi_settings_get_flash_update_stats(&stats);
+    add_pico_info_u32(&buf, PICO_INFO_FLASH_UPDATE_COUNT, stats.num_updates);
+    add_pico_info_u32(&buf, PICO_INFO_FLASH_ERASE_MAX_US, stats.max_erase_time_us);
+    add_pico_info_u32(&buf, PICO_INFO_FLASH_PROGRAM_MAX_US, stats.max_program_time_us);
+
+    // remote service sessions
+    wifi_settings_remote_session_stats_t session_stats;
+    wifi_settings_remote_get_session_stats(&session_stats);
+    add_pico_info_u32(&buf, PICO_INFO_REMOTE_SESSIONS_ACTIVE, session_stats.num_active);
+    add_pico_info_u32(&buf, PICO_INFO_REMOTE_SESSIONS_MAX, session_stats.max_active);
+    add_pico_info_u32(&buf, PICO_INFO_REMOTE_SESSIONS_REJECTED, session_stats.num_rejected);
+    add_pico_info_u32(&buf, PICO_INFO_REMOTE_SESSION_POOL_SIZE, session_stats.pool_size);
+    // each session needs one of these while a request is handled (0: heap allocated)
+    add_pico_info_u32(&buf, PICO_INFO_REMOTE_DATA_BUFFER_POOL_SIZE,
+                      WIFI_SETTINGS_REMOTE_DATA_BUFFER_POOL_SIZE);
+
+#if WIFI_SETTINGS_PROFILE
+    // hot path profiling counters
+    add_pico_info_string(&buf, PICO_INFO_PROFILE_UNIT, wifi_settings_profile_get_unit());
+    for (uint i = 0; i < WIFI_SETTINGS_PROFILE_NUM_COUNTERS; i++) {
+        add_pico_info_profile(&buf, (wifi_settings_profile_id_t) i);
+    }
+#endif
 
     // program info
-    add_pico_info_string(&buf, "wifi_settings_version", WIFI_SETTINGS_VERSION_STRING);
-    add_pico_info_string(&buf, "program",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_NAME));
-    add_pico_info_string(&buf, "version",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING));
-    add_pico_info_string(&buf, "build_date",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_BUILD_DATE_STRING));
-    add_pico_info_string(&buf, "url",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_URL));
-    add_pico_info_string(&buf, "description",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_DESCRIPTION));
-    add_pico_info_string(&buf, "feature",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_FEATURE));
-    add_pico_info_string(&buf, "build_attribute",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_PROGRAM_BUILD_ATTRIBUTE));
-    add_pico_info_string(&buf, "sdk_version",
-        binary_info_get_string_for_id(BINARY_INFO_ID_RP_SDK_VERSION));
+    add_pico_info_string(&buf, PICO_INFO_WIFI_SETTINGS_VERSION, WIFI_SETTINGS_VERSION_STRING);
+    add_pico_info_string(&buf, PICO_INFO_PROGRAM,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_NAME));
+    add_pico_info_string(&buf, PICO_INFO_VERSION,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING));
+    add_pico_info_string(&buf, PICO_INFO_BUILD_DATE,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_BUILD_DATE_STRING));
+    add_pico_info_string(&buf, PICO_INFO_URL,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_URL));
+    add_pico_info_string(&buf, PICO_INFO_DESCRIPTION,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_DESCRIPTION));
+    add_pico_info_string(&buf, PICO_INFO_FEATURE,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_FEATURE));
+    add_pico_info_string(&buf, PICO_INFO_BUILD_ATTRIBUTE,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_PROGRAM_BUILD_ATTRIBUTE));
+    add_pico_info_string(&buf, PICO_INFO_SDK_VERSION,
+        wifi_settings_get_binary_info_string(BINARY_INFO_ID_RP_SDK_VERSION));
     *output_data_size = buf.index;
     return 0;
 }
 
+int32_t wifi_settings_link_quality_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    // No input is accepted
+    if ((input_data_size != 0) || (input_parameter != 0)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    // Copy the history into the buffer, keeping the most recent entries if
+    // there is not enough space for all of them
+    int count = 0;
+#if LINK_QUALITY_HISTORY_SIZE > 0
+    wifi_settings_link_quality_t history[LINK_QUALITY_HISTORY_SIZE];
+    count = wifi_settings_get_link_quality_history(history, LINK_QUALITY_HISTORY_SIZE);
+    const int max_count = (int) (*output_data_size / sizeof(wifi_settings_link_quality_t));
+    const int first = (count > max_count) ? (count - max_count) : 0;
+    count -= first;
+    memcpy(data_buffer, &history[first], count * sizeof(wifi_settings_link_quality_t));
+#endif
+    *output_data_size = (uint32_t) count * sizeof(wifi_settings_link_quality_t);
+    return count;
+}
+
+int32_t wifi_settings_stats_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    // No input is accepted
+    if ((input_data_size != 0) || (input_parameter != 0)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    // Session counts, followed by a record for each handler that has been used
+    wifi_settings_remote_session_stats_t session_stats;
+    wifi_settings_remote_get_session_stats(&session_stats);
+    const uint record_size = sizeof(uint32_t) + sizeof(wifi_settings_remote_handler_stats_t);
+    uint index = 0;
+    int count = 0;
+    if (*output_data_size >= sizeof(session_stats)) {
+        memcpy(data_buffer, &session_stats, sizeof(session_stats));
+        index = sizeof(session_stats);
+    }
+    for (uint id = 0; (id <= ID_LAST_USER_HANDLER) && (index != 0); id++) {
+        wifi_settings_remote_handler_stats_t handler_stats;
+        if ((wifi_settings_remote_get_handler_stats((uint8_t) id, &handler_stats) != PICO_OK)
+        || (handler_stats.num_calls == 0)) {
+            continue;
+        }
+        if ((index + record_size) > *output_data_size) {
+            break;
+        }
+        const uint32_t record_msg_type = id;
+        memcpy(&data_buffer[index], &record_msg_type, sizeof(uint32_t));
+        memcpy(&data_buffer[index + sizeof(uint32_t)], &handler_stats, sizeof(handler_stats));
+        index += record_size;
+        count++;
+    }
+    *output_data_size = index;
+    return count;
+}
+
+#if WIFI_SETTINGS_EVENT_LOG
+int32_t wifi_settings_event_log_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    // The parameter is the first page
+    if ((input_data_size != 0) || (input_parameter < 0)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    // Copy as many pages as will fit into the buffer
+    const uint count = wifi_settings_event_log_read_pages((uint) input_parameter,
+                            data_buffer, *output_data_size / FLASH_PAGE_SIZE);
+    *output_data_size = count * FLASH_PAGE_SIZE;
+    return (int32_t) wifi_settings_event_log_get_num_pages();
+}
+#endif
+
+int32_t wifi_settings_telemetry_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    // The parameter is the subscription interval, which is used by wifi_settings_remote.c
+    if ((input_data_size != 0) || (input_parameter < 0)
+    || (*output_data_size < sizeof(wifi_settings_telemetry_t))) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    wifi_settings_status_t status;
+    wifi_settings_connect_timing_t timing;
+    wifi_settings_remote_session_stats_t session_stats;
+    wifi_settings_get_status(&status);
+    wifi_settings_get_connect_timing(&timing);
+    wifi_settings_remote_get_session_stats(&session_stats);
+    const struct mallinfo heap_info = mallinfo();
+
+    wifi_settings_telemetry_t telemetry;
+    memset(&telemetry, 0, sizeof(telemetry));
+    telemetry.time_ms = to_ms_since_boot(get_absolute_time());
+    telemetry.rssi = status.rssi;
+    telemetry.state = status.state;
+    telemetry.link_up = status.link_up;
+    telemetry.channel = status.channel;
+    telemetry.link_status = status.link_status;
+    telemetry.num_attempts = timing.num_attempts;
+    telemetry.num_failures = timing.num_failures;
+    telemetry.heap_used = (uint32_t) heap_info.uordblks;
+    telemetry.heap_arena = (uint32_t) heap_info.arena;
+    telemetry.num_active = session_stats.num_active;
+    telemetry.num_sessions = session_stats.num_sessions;
+    telemetry.num_auth_failures = session_stats.num_auth_failures;
+    memcpy(data_buffer, &telemetry, sizeof(telemetry));
+    uint index = sizeof(telemetry);
+
+    // Profiling counters, as many as fit
+    int count = 0;
+#if WIFI_SETTINGS_PROFILE
+    for (int i = 0; (i < WIFI_SETTINGS_PROFILE_NUM_COUNTERS)
+            && ((index + sizeof(wifi_settings_profile_counter_t)) <= *output_data_size); i++) {
+        wifi_settings_profile_counter_t counter;
+        wifi_settings_profile_get((wifi_settings_profile_id_t) i, &counter);
+        memcpy(&data_buffer[index], &counter, sizeof(counter));
+        index += sizeof(counter);
+        count++;
+    }
+#endif
+    *output_data_size = index;
+    return count;
+}
+
+int32_t wifi_settings_ping_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    // Nothing is done, and there is no reply data (remote_picotool bench)
+    *output_data_size = 0;
+    return input_parameter;
+}
+
 int32_t wifi_settings_update_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
@@ -205,16 +527,53 @@ int32_t wifi_settings_update_handler(
     if (input_parameter != 0) {
         return PICO_ERROR_INVALID_ARG;
     }
+    // The wifi-settings file is shared with the connection state machine, so the
+    // lock is needed if this handler is running in the wifi_settings task.
+    // The update secret and hostname are reloaded by the file change subscribers.
+    cyw43_arch_lwip_begin();
     int rc = wifi_settings_update_flash_safe((const char*) data_buffer, input_data_size);
+    cyw43_arch_lwip_end();
     if (rc != PICO_OK) {
         return rc;
     }
-
-    wifi_settings_remote_update_secret();
-    wifi_settings_set_hostname();
     return (int32_t) input_data_size;
 }
 
+int32_t wifi_settings_set_key_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    *output_data_size = 0;
+    if ((input_data_size == 0) || (input_data_size >= MAX_DATA_SIZE)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    // The key is '\0'-terminated in the buffer
+    char* key = (char*) data_buffer;
+    key[input_data_size] = '\0';
+
+    int rc = PICO_ERROR_INVALID_ARG;
+    cyw43_arch_lwip_begin();
+    if (input_parameter == 0) {
+        // Set: split "key=value" at the first '='
+        char* value = strchr(key, '=');
+        if (value) {
+            *value = '\0';
+            value++;
+            rc = wifi_settings_set_value_for_key(key, value,
+                    input_data_size - (uint32_t) (value - key));
+        }
+    } else if (input_parameter == 1) {
+        // Delete
+        rc = wifi_settings_delete_key(key);
+    }
+    cyw43_arch_lwip_end();
+    return rc;
+}
+
 bool wifi_settings_can_lock_out() {
 #if LIB_PICO_MULTICORE
     flash_safety_helper_t *helper = get_flash_safety_helper();
@@ -285,6 +644,10 @@ void wifi_settings_update_reboot_handler2(
         int32_t callback1_return,
         void* arg) {
 
+#if WIFI_SETTINGS_EVENT_LOG
+    // Keep the most recent events
+    wifi_settings_event_log_flush();
+#endif
     if (callback1_data_size != 0) {
         if (!wifi_settings_do_lock_out()) {
             // abandon reboot: can't lock out
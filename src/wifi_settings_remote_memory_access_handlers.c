@@ -15,7 +15,19 @@
 #include "wifi_settings/wifi_settings_remote_memory_access_handlers.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
+#include "wifi_settings/wifi_settings_sha256.h"
+#include "wifi_settings/wifi_settings_profile.h"
+#if WIFI_SETTINGS_REMOTE_COMPRESSION
+#include "wifi_settings/wifi_settings_decompress.h"
+#endif
+#if WIFI_SETTINGS_AB_STORAGE
+#include "wifi_settings/wifi_settings_flash_ab_storage.h"
+#endif
 
+#if WIFI_SETTINGS_REMOTE_READ_DMA
+#include "hardware/dma.h"
+#include "hardware/structs/xip_ctrl.h"
+#endif
 #include "hardware/flash.h"
 #include "hardware/structs/sysinfo.h"
 #include "hardware/structs/watchdog.h"
@@ -26,16 +38,18 @@
 #include "pico/stdlib.h"
 #include "pico/unique_id.h"
 #include "pico/bootrom.h"
+#if PICO_RP2350
+#include "boot/picobin.h"
+#include "boot/uf2.h"
+#endif
 
 #if LIB_PICO_MULTICORE
 #include "pico/multicore.h"
 #endif
 
-#include "mbedtls/sha256.h"
-#include "mbedtls/version.h"
-
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 
@@ -47,19 +61,83 @@
 #error "MAX_DATA_SIZE must be >= FLASH_SECTOR_SIZE"
 #endif
 
-#if MBEDTLS_VERSION_MAJOR < 3
-// These names were changed in mbedlts 3.x.x
-#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
-#define mbedtls_sha256_update mbedtls_sha256_update_ret
-#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
-#endif
-
 
 // Copy from flash.c
 #define FLASH_BLOCK_ERASE_CMD 0xd8
 
+// Smaller Flash reads are copied by the CPU, as setting up DMA takes longer
+#define DMA_READ_MIN_SIZE 64
+
 
 
+// Trying to read from an arbitrary address is dangerous. Some addresses
+// will cause a hard fault, i.e. crash the program. Let's try to be safe.
+// If the range can be read, return the address to read it from, and set in_flash
+// if this is Flash. Otherwise return NULL.
+static const uint8_t* get_readable_address(
+        const wifi_settings_logical_range_t* range,
+        bool* in_flash) {
+
+    // Is the requested address in Flash?
+    wifi_settings_flash_range_t fr;
+    if (wifi_settings_range_translate_to_flash(range, &fr)) {
+        // Translated to a usable Flash address - translate back to a logical range
+        // which bypasses the XIP cache, so that reading doesn't evict program code
+        wifi_settings_logical_range_t lr;
+        wifi_settings_range_translate_to_uncached_logical(&fr, &lr);
+        *in_flash = true;
+        return (const uint8_t*) lr.start_address;
+    }
+
+    // Not translated to Flash... is it in SRAM?
+    *in_flash = false;
+    const uintptr_t start_address = (uintptr_t) range->start_address;
+    const uintptr_t end_address = start_address + range->size;
+
+    if ((start_address >= SRAM_BASE)
+    && (start_address < end_address)
+    && (end_address <= SRAM_END)) {
+        return (const uint8_t*) range->start_address;
+    }
+    // The address is not accessible
+    return NULL;
+}
+
+#if WIFI_SETTINGS_REMOTE_READ_DMA
+// Copy from Flash using the XIP streaming interface and DMA. Reading through the
+// non-caching alias with the CPU waits for a separate Flash access for each word,
+// whereas the streaming interface reads ahead, and neither method fills the XIP cache
+// with data that the application won't use. Returns false if the copy can't be done
+// this way, so that the caller can use memcpy instead.
+static bool copy_from_flash_with_dma(uint8_t* dest, const uint8_t* source, uint32_t size) {
+    if ((size < DMA_READ_MIN_SIZE)
+    || ((((uintptr_t) dest) | ((uintptr_t) source) | size) & 3)) {
+        return false;
+    }
+    const int channel = dma_claim_unused_channel(false);
+    if (channel < 0) {
+        return false;
+    }
+    // Discard anything left in the streaming FIFO, then start streaming
+    while (!(xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY)) {
+        (void) xip_ctrl_hw->stream_fifo;
+    }
+    xip_ctrl_hw->stream_addr = (uint32_t) (uintptr_t) source;
+    xip_ctrl_hw->stream_ctr = size / 4;
+
+    dma_channel_config config = dma_channel_get_default_config((uint) channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, DREQ_XIP_STREAM);
+    dma_channel_configure((uint) channel, &config, dest,
+                          (const void*) XIP_AUX_BASE, size / 4, true);
+    dma_channel_wait_for_finish_blocking((uint) channel);
+    dma_channel_unclaim((uint) channel);
+    return true;
+}
+#endif
+
 // This handler can read from an arbitrary memory address.
 // This implements the 'save' command.
 // note: The source address is a logical address which can be anywhere in RAM.
@@ -83,6 +161,22 @@ int32_t wifi_settings_read_handler(
     read_parameter_t parameter;
     memcpy(&parameter, data_buffer, sizeof(read_parameter_t));
 
+    wifi_settings_logical_range_t flash_copy_from = parameter.copy_from;
+    if (flash_copy_from.size > WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE) {
+        flash_copy_from.size = WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE;
+    }
+    bool in_flash = false;
+    const uint8_t* source = get_readable_address(&flash_copy_from, &in_flash);
+    if (source && in_flash) {
+        // Flash is sent directly, without a copy, and up to WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE
+        // at a time. It can still be written (by another session or by the application)
+        // while the reply is sent: in this case the data won't match the data hash,
+        // and the client will reject the reply rather than receive a mixture of old and new data.
+        wifi_settings_remote_set_reply_source(output_data_size, source);
+        *output_data_size = flash_copy_from.size;
+        return (int32_t) flash_copy_from.size;
+    }
+
     if (parameter.copy_from.size > *output_data_size) {
         // Truncate requested size to fit the output buffer
         parameter.copy_from.size = *output_data_size;
@@ -91,47 +185,228 @@ int32_t wifi_settings_read_handler(
         *output_data_size = parameter.copy_from.size;
     }
 
-    // Trying to read from an arbitrary address is dangerous. Some addresses
-    // will cause a hard fault, i.e. crash the program. Let's try to be safe.
-    // Is the requested address in Flash?
-    wifi_settings_flash_range_t fr;
-    if (wifi_settings_range_translate_to_flash(&parameter.copy_from, &fr)) {
-        // Translated to a usable Flash address - translate back to logical range for copy
-        wifi_settings_logical_range_t lr;
-        wifi_settings_range_translate_to_logical(&fr, &lr);
-        memcpy(data_buffer, lr.start_address, parameter.copy_from.size);
-    } else {
-        // Not translated to Flash... is it in SRAM?
-        const uintptr_t start_address = (uintptr_t) parameter.copy_from.start_address;
-        const uintptr_t end_address = start_address + parameter.copy_from.size;
-
-        if ((start_address >= SRAM_BASE)
-        && (start_address < end_address)
-        && (end_address <= SRAM_END)) {
-            memcpy(data_buffer, parameter.copy_from.start_address, parameter.copy_from.size);
-        } else {
-            // The address is not accessible
+    // SRAM is copied, as it may change before the reply is sent.
+    source = get_readable_address(&parameter.copy_from, &in_flash);
+    if (!source) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ADDRESS;
+    }
+    memcpy(data_buffer, source, parameter.copy_from.size);
+    return (int32_t) parameter.copy_from.size;
+}
+
+// This handler reads a list of ranges (read_parameter_t) and replies with
+// the data from each one, concatenated, so that scattered data can be
+// collected in one round trip. The ranges are checked in the same way as
+// wifi_settings_read_handler, but are not truncated: if any range can't be
+// read, or the total size doesn't fit in the output buffer, nothing is read.
+int32_t wifi_settings_read_ranges_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    const uint32_t num_ranges = input_data_size / sizeof(read_parameter_t);
+    if ((input_parameter != 0)
+    || (num_ranges == 0)
+    || (num_ranges > WIFI_SETTINGS_READ_RANGES_MAX)
+    || ((input_data_size % sizeof(read_parameter_t)) != 0)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    // Load the parameters, as the output overwrites them
+    read_parameter_t parameters[WIFI_SETTINGS_READ_RANGES_MAX];
+    const uint8_t* sources[WIFI_SETTINGS_READ_RANGES_MAX];
+    bool in_flash[WIFI_SETTINGS_READ_RANGES_MAX];
+    memcpy(parameters, data_buffer, input_data_size);
+
+    // Check everything before copying anything
+    uint32_t total_size = 0;
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        const uint32_t size = parameters[i].copy_from.size;
+        if ((size == 0) || (size > (*output_data_size - total_size))) {
+            *output_data_size = 0;
+            return PICO_ERROR_INVALID_ARG;
+        }
+        sources[i] = get_readable_address(&parameters[i].copy_from, &in_flash[i]);
+        if (!sources[i]) {
             *output_data_size = 0;
             return PICO_ERROR_INVALID_ADDRESS;
-        } 
+        }
+        total_size += size;
     }
-    return (int32_t) parameter.copy_from.size;
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        bool copied = false;
+#if WIFI_SETTINGS_REMOTE_READ_DMA
+        copied = in_flash[i] && copy_from_flash_with_dma(
+                    &data_buffer[offset], sources[i], parameters[i].copy_from.size);
+#endif
+        if (!copied) {
+            memcpy(&data_buffer[offset], sources[i], parameters[i].copy_from.size);
+        }
+        offset += parameters[i].copy_from.size;
+    }
+    *output_data_size = total_size;
+    return (int32_t) total_size;
 }
 
 typedef struct wifi_settings_write_flash_handler_params_t {
     wifi_settings_logical_range_t copy_from;
     wifi_settings_flash_range_t copy_to;
+    bool erase;
+    bool program;
 } wifi_settings_write_flash_handler_params_t;
 
 static void wifi_settings_write_flash_handler_internal(void* tmp) {
     wifi_settings_write_flash_handler_params_t* param = (wifi_settings_write_flash_handler_params_t*) tmp;
     const uint32_t flags = save_and_disable_interrupts();
-    flash_range_erase(param->copy_to.start_address, param->copy_to.size);
-    flash_range_program(param->copy_to.start_address, param->copy_from.start_address,
-                        param->copy_to.size);
+    WIFI_SETTINGS_PROFILE_START(profile_off);
+    if (param->erase) {
+        WIFI_SETTINGS_PROFILE_START(profile_erase);
+        flash_range_erase(param->copy_to.start_address, param->copy_to.size);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_ERASE, profile_erase);
+    }
+    if (param->program) {
+        WIFI_SETTINGS_PROFILE_START(profile_program);
+        flash_range_program(param->copy_to.start_address, param->copy_from.start_address,
+                            param->copy_to.size);
+        WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_FLASH_PROGRAM, profile_program);
+    }
+    WIFI_SETTINGS_PROFILE_STOP(WIFI_SETTINGS_PROFILE_INTERRUPTS_OFF, profile_off);
     restore_interrupts(flags);
 }
 
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+// Running SHA-256 of the data written to consecutive sectors by ID_WRITE_FLASH_HANDLER.
+// If an OTA firmware image was uploaded in order, ID_OTA_FIRMWARE_UPDATE_HANDLER can
+// use this instead of hashing the whole image again. This isn't possible if the
+// SHA-256 implementation has one state, as that is also needed by the remote service.
+typedef struct running_hash_t {
+    wifi_settings_sha256_context_t ctx;
+    wifi_settings_flash_range_t range;  // Flash hashed so far
+    bool valid;
+} running_hash_t;
+
+static running_hash_t g_running_hash;
+
+// Set by wifi_settings_write_flash_session_ended, which may run in a different context
+static volatile bool g_running_hash_session_ended = false;
+
+static void running_hash_reset() {
+    g_running_hash_session_ended = false;
+    if (g_running_hash.valid) {
+        wifi_settings_sha256_free(&g_running_hash.ctx);
+        g_running_hash.valid = false;
+    }
+}
+
+// The running hash only applies to the session that wrote the data, and
+// only while the Flash still contains it
+static void running_hash_check(const wifi_settings_flash_range_t* erased) {
+    if (g_running_hash_session_ended
+    || (erased && g_running_hash.valid
+        && wifi_settings_range_has_overlap(erased, &g_running_hash.range))) {
+        running_hash_reset();
+    }
+}
+
+static void running_hash_add(const wifi_settings_flash_range_t* fr, const uint8_t* data) {
+    running_hash_check(NULL);
+    if (!(g_running_hash.valid
+    && (fr->start_address == (g_running_hash.range.start_address + g_running_hash.range.size)))) {
+        // Not a continuation of the previous write: start again here
+        running_hash_reset();
+        wifi_settings_sha256_init(&g_running_hash.ctx);
+        if (0 != wifi_settings_sha256_starts(&g_running_hash.ctx)) {
+            wifi_settings_sha256_free(&g_running_hash.ctx);
+            return;
+        }
+        g_running_hash.range.start_address = fr->start_address;
+        g_running_hash.range.size = 0;
+        g_running_hash.valid = true;
+    }
+    if (0 != wifi_settings_sha256_update(&g_running_hash.ctx, data, fr->size)) {
+        running_hash_reset();
+        return;
+    }
+    g_running_hash.range.size += fr->size;
+}
+
+// If the running hash covers exactly this range, get the digest and return true
+static bool running_hash_finish(const wifi_settings_flash_range_t* fr, uint8_t* digest) {
+    running_hash_check(NULL);
+    if (!(g_running_hash.valid
+    && (fr->start_address == g_running_hash.range.start_address)
+    && (fr->size == g_running_hash.range.size))) {
+        return false;
+    }
+    const bool ok = (0 == wifi_settings_sha256_finish(&g_running_hash.ctx, digest));
+    running_hash_reset();
+    return ok;
+}
+#endif
+
+void wifi_settings_write_flash_session_ended() {
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    // Only a flag is set, as a handler may be using the running hash in another context
+    g_running_hash_session_ended = true;
+#endif
+}
+
+// Check that the SHA-256 hash of a range of Flash matches the expected value
+static int check_flash_hash(const wifi_settings_flash_range_t* fr, const uint8_t* expected_hash) {
+    uint8_t digest_data[WIFI_SETTINGS_OTA_HASH_SIZE];
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    // If the whole range was just written in order, the hash is already known
+    // (each sector was checked after it was written)
+    if (!running_hash_finish(fr, digest_data))
+#endif
+    {
+        wifi_settings_logical_range_t lr;
+        wifi_settings_range_translate_to_logical(fr, &lr);
+        wifi_settings_sha256_context_t ctx;
+        wifi_settings_sha256_init(&ctx);
+
+        const bool ok = (0 == wifi_settings_sha256_starts(&ctx))
+                && (0 == wifi_settings_sha256_update(&ctx, lr.start_address, lr.size))
+                && (0 == wifi_settings_sha256_finish(&ctx, digest_data));
+        wifi_settings_sha256_free(&ctx);
+        if (!ok) {
+            return PICO_ERROR_GENERIC;
+        }
+    }
+
+    if (memcmp(digest_data, expected_hash, WIFI_SETTINGS_OTA_HASH_SIZE) != 0) {
+        return PICO_ERROR_MODIFIED_DATA;
+    }
+    return PICO_OK;
+}
+
+#if PICO_RP2350
+// The other partition of an A/B pair, which ID_AB_OTA_HANDLER allows
+// ID_WRITE_FLASH_HANDLER to overwrite (size 0 if not known yet)
+static wifi_settings_flash_range_t g_ab_target;
+
+static bool is_in_ab_target(const wifi_settings_flash_range_t* fr) {
+    return (g_ab_target.size != 0) && wifi_settings_range_is_contained(fr, &g_ab_target);
+}
+#endif
+
+// Returns true if all bytes are 0xff, i.e. the same as erased Flash
+static bool is_erased(const uint8_t* data, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        if (data[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int check_for_alignment_error(const wifi_settings_flash_range_t* fr) {
     // Make a copy of the range
     wifi_settings_flash_range_t fr2;
@@ -150,12 +425,182 @@ static int check_for_alignment_error(const wifi_settings_flash_range_t* fr) {
     return PICO_OK;
 }
 
+// Flash which ID_PREPARE_FLASH_HANDLER has asked to be erased in the background,
+// ahead of ID_WRITE_FLASH_HANDLER (size 0 if there is nothing to do)
+static wifi_settings_flash_range_t g_prepare;
+
+// Called when the range fr has been written: the background erase must not
+// undo this, so it continues after the write, or stops before it
+static void prepare_flash_notify_write(const wifi_settings_flash_range_t* fr) {
+    const uint32_t write_end = fr->start_address + fr->size;
+    const uint32_t prepare_end = g_prepare.start_address + g_prepare.size;
+    if ((g_prepare.size == 0)
+    || (fr->start_address >= prepare_end)
+    || (write_end <= g_prepare.start_address)) {
+        return; // no overlap
+    }
+    if (fr->start_address <= g_prepare.start_address) {
+        g_prepare.start_address = write_end;
+        g_prepare.size = (prepare_end > write_end) ? (prepare_end - write_end) : 0;
+    } else {
+        g_prepare.size = fr->start_address - g_prepare.start_address;
+    }
+}
+
+bool wifi_settings_prepare_flash_pending() {
+    return g_prepare.size != 0;
+}
+
+bool wifi_settings_prepare_flash_step() {
+    if (g_prepare.size == 0) {
+        return false;
+    }
+    // Erase one sector, so that interrupts are only disabled for a short time,
+    // and a write request can run between each sector
+    wifi_settings_write_flash_handler_params_t param;
+    param.copy_to.start_address = g_prepare.start_address;
+    param.copy_to.size = FLASH_SECTOR_SIZE;
+    param.erase = true;
+    param.program = false;
+    wifi_settings_logical_range_t lr;
+    wifi_settings_range_translate_to_logical(&param.copy_to, &lr);
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    running_hash_check(&param.copy_to);
+#endif
+    if ((!is_erased(lr.start_address, FLASH_SECTOR_SIZE))
+    && (flash_safe_execute(wifi_settings_write_flash_handler_internal,
+                           &param, UINT_MAX) != PICO_OK)) {
+        // Give up - ID_WRITE_FLASH_HANDLER will erase the sector if needed
+        g_prepare.size = 0;
+        return false;
+    }
+    g_prepare.start_address += FLASH_SECTOR_SIZE;
+    g_prepare.size -= FLASH_SECTOR_SIZE;
+    return g_prepare.size != 0;
+}
+
+// This handler starts erasing a range of Flash in the background, so that
+// ID_WRITE_FLASH_HANDLER only has to program it. The 'load' and 'ota' commands
+// send this before each run of sectors that will be written. The range is given as
+// Flash offsets (0 = start of Flash), must be aligned to sectors, and has the
+// same restrictions as ID_WRITE_FLASH_HANDLER. A new request replaces any range
+// that is not erased yet, and a size of 0 cancels it.
+int32_t wifi_settings_prepare_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    *output_data_size = 0;
+    wifi_settings_flash_range_t parameter;
+    if ((input_data_size != sizeof(wifi_settings_flash_range_t)) || (input_parameter != 0)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    memcpy(&parameter, data_buffer, sizeof(wifi_settings_flash_range_t));
+    g_prepare.size = 0;
+    if (parameter.size == 0) {
+        return PICO_OK;
+    }
+
+    // Check alignment and size
+    int rc = check_for_alignment_error(&parameter);
+    if (rc != PICO_OK) {
+        return rc;
+    }
+    // Check the range is within reusable Flash (or the A/B target)
+    wifi_settings_flash_range_t reusable_flash;
+    wifi_settings_range_get_reusable(&reusable_flash);
+    if (!wifi_settings_range_is_contained(&parameter, &reusable_flash)
+#if PICO_RP2350
+    && !is_in_ab_target(&parameter)
+#endif
+    ) {
+        return PICO_ERROR_INVALID_ADDRESS;
+    }
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    // Sectors already in the running hash will no longer match it
+    running_hash_check(&parameter);
+#endif
+    g_prepare = parameter;
+    return PICO_OK;
+}
+
+// This handler returns the SHA-256 digest of each sector in a range of Flash,
+// so that the 'load' and 'ota' commands can skip sectors that are unchanged.
+// The range is given as Flash offsets (0 = start of Flash) and must be aligned
+// to sectors. The reply has one digest per sector, so the number of sectors
+// is limited by the size of the output buffer.
+int32_t wifi_settings_hash_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    wifi_settings_flash_range_t parameter;
+    if ((input_data_size != sizeof(wifi_settings_flash_range_t)) || (input_parameter != 0)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+    memcpy(&parameter, data_buffer, sizeof(wifi_settings_flash_range_t));
+
+    // Check alignment and size
+    int rc = check_for_alignment_error(&parameter);
+    if (rc != PICO_OK) {
+        *output_data_size = 0;
+        return rc;
+    }
+    const uint32_t num_sectors = parameter.size / FLASH_SECTOR_SIZE;
+    if ((num_sectors == 0)
+    || (num_sectors > (*output_data_size / WIFI_SETTINGS_SHA256_DIGEST_SIZE))) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ARG;
+    }
+    // Range must be within Flash
+    wifi_settings_flash_range_t all_flash;
+    wifi_settings_range_get_all(&all_flash);
+    if (!wifi_settings_range_is_contained(&parameter, &all_flash)) {
+        *output_data_size = 0;
+        return PICO_ERROR_INVALID_ADDRESS;
+    }
+
+    wifi_settings_logical_range_t lr;
+    wifi_settings_range_translate_to_logical(&parameter, &lr);
+    const uint8_t* sector = (const uint8_t*) lr.start_address;
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        wifi_settings_sha256_context_t ctx;
+        wifi_settings_sha256_init(&ctx);
+        // The context is freed whether or not the hash succeeds
+        const bool ok = (0 == wifi_settings_sha256_starts(&ctx))
+                && (0 == wifi_settings_sha256_update(&ctx, sector, FLASH_SECTOR_SIZE))
+                && (0 == wifi_settings_sha256_finish(&ctx, &data_buffer[i * WIFI_SETTINGS_SHA256_DIGEST_SIZE]));
+        wifi_settings_sha256_free(&ctx);
+        if (!ok) {
+            *output_data_size = 0;
+            return PICO_ERROR_GENERIC;
+        }
+        sector += FLASH_SECTOR_SIZE;
+    }
+    *output_data_size = num_sectors * WIFI_SETTINGS_SHA256_DIGEST_SIZE;
+    return (int32_t) num_sectors;
+}
+
 // This handler can write to a Flash sector. 
 // This implements the 'load' command. The address must
 // be appropriately aligned to an address in Flash and the input size must
 // be a whole number of Flash sectors. There is an attempt to prevent the user overwriting
 // the current program.
 // note: The input_parameter (target address) is a Flash address (i.e. 0 = start of Flash)
+// If WIFI_SETTINGS_WRITE_FLASH_COMPRESSED is set in input_parameter, the input is
+// compressed, and the decompressed size must be a whole number of Flash sectors.
+// Flash is only erased and programmed if needed: if the target is already the same as
+// the data, nothing is written, and WIFI_SETTINGS_WRITE_FLASH_UNCHANGED is returned if
+// WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED is set in input_parameter (0 otherwise,
+// as older clients treat any other non-zero result as an error).
+// If ID_PREPARE_FLASH_HANDLER has already erased the target, it is only programmed.
 int32_t wifi_settings_write_flash_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
@@ -164,14 +609,35 @@ int32_t wifi_settings_write_flash_handler(
         uint32_t* output_data_size,
         void* arg) {
 
+    // On entry, *output_data_size is the size of the data buffer
+    const uint32_t data_buffer_size = *output_data_size;
     *output_data_size = 0;
 
+    uint32_t write_size = input_data_size;
+    uint32_t write_address = (uint32_t) input_parameter;
+    const int32_t unchanged_result = (write_address & WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED)
+        ? WIFI_SETTINGS_WRITE_FLASH_UNCHANGED : 0;
+    write_address &= ~WIFI_SETTINGS_WRITE_FLASH_REPORT_UNCHANGED;
+    if (write_address & WIFI_SETTINGS_WRITE_FLASH_COMPRESSED) {
+#if WIFI_SETTINGS_REMOTE_COMPRESSION
+        // Decompress in the data buffer
+        write_address &= ~WIFI_SETTINGS_WRITE_FLASH_COMPRESSED;
+        const int rc = wifi_settings_decompress_in_place(
+                data_buffer, data_buffer_size, input_data_size, &write_size);
+        if (rc != PICO_OK) {
+            return rc;
+        }
+#else
+        return PICO_ERROR_INVALID_ARG;
+#endif
+    }
+
     // This internal parameter structure is needed for use with flash_safe_execute
     wifi_settings_write_flash_handler_params_t param;
     param.copy_from.start_address = data_buffer;
-    param.copy_from.size = input_data_size;
-    param.copy_to.start_address = (uint32_t) input_parameter;
-    param.copy_to.size = input_data_size;
+    param.copy_from.size = write_size;
+    param.copy_to.start_address = write_address;
+    param.copy_to.size = write_size;
 
     // Check alignment and size of the user's request
     int rc = check_for_alignment_error(&param.copy_to);
@@ -182,27 +648,132 @@ int32_t wifi_settings_write_flash_handler(
     // Check the target is within reusable Flash
     wifi_settings_flash_range_t reusable_flash;
     wifi_settings_range_get_reusable(&reusable_flash);
-    if (!wifi_settings_range_is_contained(&param.copy_to, &reusable_flash)) {
+    if (!wifi_settings_range_is_contained(&param.copy_to, &reusable_flash)
+#if PICO_RP2350
+    // ... or the other partition, during an A/B OTA update
+    && !is_in_ab_target(&param.copy_to)
+#endif
+    ) {
         // Goes outside of usable Flash memory e.g. collides with current program,
         // wifi-settings file, or is just outside of the available space
         return PICO_ERROR_INVALID_ADDRESS;
     }
 
-    // Looks good - rewrite sectors in Flash
+    // Looks good - but is there anything to do? Erasing and programming take a long
+    // time with interrupts disabled, and wear out the Flash, so they are skipped
+    // if the target already has the data, or is already erased.
+    wifi_settings_logical_range_t lr;
+    wifi_settings_range_translate_to_logical(&param.copy_to, &lr);
+    prepare_flash_notify_write(&param.copy_to);
+    if (memcmp(lr.start_address, param.copy_from.start_address, param.copy_from.size) == 0) {
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+        running_hash_add(&param.copy_to, param.copy_from.start_address);
+#endif
+        return unchanged_result;
+    }
+    param.erase = !is_erased(lr.start_address, param.copy_to.size);
+    param.program = !is_erased(param.copy_from.start_address, param.copy_from.size);
+
+    // Rewrite sectors in Flash
     rc = flash_safe_execute(wifi_settings_write_flash_handler_internal,
                             &param, UINT_MAX);
+    // Test the results
+    if ((rc == PICO_OK)
+    && (memcmp(lr.start_address, param.copy_from.start_address, param.copy_from.size) != 0)) {
+        rc = PICO_ERROR_INVALID_DATA;
+    }
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    if (rc == PICO_OK) {
+        running_hash_add(&param.copy_to, param.copy_from.start_address);
+    } else {
+        running_hash_reset();
+    }
+#endif
     if (rc != PICO_OK) {
         return rc;
     }
-    // Test the results
+    // Success
+    return 0;
+}
+
+#if WIFI_SETTINGS_REMOTE_MULTICAST_OTA
+// Returns true if ID_WRITE_FLASH_HANDLER would be allowed to write to the range
+bool wifi_settings_can_write_flash(const wifi_settings_flash_range_t* fr) {
+    wifi_settings_flash_range_t reusable_flash;
+    wifi_settings_range_get_reusable(&reusable_flash);
+    return wifi_settings_range_is_contained(fr, &reusable_flash)
+#if PICO_RP2350
+        || is_in_ab_target(fr)
+#endif
+        ;
+}
+
+// Write part of one sector, for ID_MULTICAST_OTA_HANDLER, which receives firmware images
+// in pieces that are smaller than a sector. The range must be aligned to Flash pages,
+// and has the same restrictions as ID_WRITE_FLASH_HANDLER. If erase_sector is set, the
+// sector is erased first (unless already erased); otherwise, the range must be erased.
+int wifi_settings_write_flash_pages(const wifi_settings_flash_range_t* fr,
+                                    const uint8_t* data, bool erase_sector) {
+    wifi_settings_write_flash_handler_params_t param;
+    param.copy_from.start_address = (uint8_t*) data;
+    param.copy_from.size = fr->size;
+    param.copy_to = *fr;
+
+    const uint32_t sector_start = fr->start_address & ~(FLASH_SECTOR_SIZE - 1);
+    if ((fr->start_address % FLASH_PAGE_SIZE) || (fr->size % FLASH_PAGE_SIZE)
+    || (fr->size == 0)
+    || ((fr->start_address + fr->size) > (sector_start + FLASH_SECTOR_SIZE))) {
+        return PICO_ERROR_BAD_ALIGNMENT;
+    }
+    wifi_settings_flash_range_t sector;
+    sector.start_address = sector_start;
+    sector.size = FLASH_SECTOR_SIZE;
+    if (!wifi_settings_can_write_flash(&sector)) {
+        return PICO_ERROR_INVALID_ADDRESS;
+    }
+
+    // Sectors are not written in order, so the running hash can't be used
+    // for this image, and the background erase must not undo the write
+    prepare_flash_notify_write(&sector);
+#if !WIFI_SETTINGS_SHA256_SINGLE_STATE
+    running_hash_reset();
+#endif
+    wifi_settings_logical_range_t sector_lr;
+    wifi_settings_range_translate_to_logical(&sector, &sector_lr);
     wifi_settings_logical_range_t lr;
-    wifi_settings_range_translate_to_logical(&param.copy_to, &lr);
-    if (memcmp(lr.start_address, param.copy_from.start_address, param.copy_from.size) != 0) {
+    wifi_settings_range_translate_to_logical(fr, &lr);
+    param.erase = erase_sector && !is_erased(sector_lr.start_address, FLASH_SECTOR_SIZE);
+    if (param.erase) {
+        // Erase the whole sector, then program the pages
+        param.copy_to = sector;
+        param.program = false;
+        int rc = flash_safe_execute(wifi_settings_write_flash_handler_internal,
+                                    &param, UINT_MAX);
+        if (rc != PICO_OK) {
+            return rc;
+        }
+        param.copy_to = *fr;
+        param.erase = false;
+    } else if (memcmp(lr.start_address, data, fr->size) == 0) {
+        return PICO_OK; // already written
+    } else if (!is_erased(lr.start_address, fr->size)) {
+        // Programming can't change a 0 bit to 1
         return PICO_ERROR_INVALID_DATA;
     }
-    // Success
-    return 0;
+    param.program = !is_erased(data, fr->size);
+    if (param.program) {
+        int rc = flash_safe_execute(wifi_settings_write_flash_handler_internal,
+                                    &param, UINT_MAX);
+        if (rc != PICO_OK) {
+            return rc;
+        }
+    }
+    if (memcmp(lr.start_address, data, fr->size) != 0) {
+        return PICO_ERROR_INVALID_DATA;
+    }
+    return PICO_OK;
 }
+#endif
 
 // Functions used by OTA updater
 typedef struct ota_firmware_update_funcs_t {
@@ -251,6 +822,8 @@ int32_t wifi_settings_ota_firmware_update_handler1(
     if (!wifi_settings_can_lock_out()) {
         return PICO_ERROR_NOT_PERMITTED;
     }
+    // Stop erasing in the background, as the update will use Flash
+    g_prepare.size = 0;
     // Check that all of the ROM functions needed for the firmware update are available
     ota_firmware_update_funcs_t funcs;
     if (!setup_ota_firmware_update_funcs(&funcs)) {
@@ -295,24 +868,17 @@ int32_t wifi_settings_ota_firmware_update_handler1(
     if (wifi_settings_range_has_overlap(&settings_file, &parameter.copy_to)) {
         return PICO_ERROR_INVALID_ADDRESS;
     }
-    // The addresses look good - what about the data itself? Check the hash.
-    wifi_settings_logical_range_t copy_from_lr;
-    wifi_settings_range_translate_to_logical(&parameter.copy_from, &copy_from_lr);
-    mbedtls_sha256_context ctx;
-    mbedtls_sha256_init(&ctx);
-    uint8_t digest_data[WIFI_SETTINGS_OTA_HASH_SIZE];
-
-    if ((0 != mbedtls_sha256_starts(&ctx, 0))
-    || (0 != mbedtls_sha256_update(&ctx, copy_from_lr.start_address, copy_from_lr.size))
-    || (0 != mbedtls_sha256_finish(&ctx, digest_data))) {
-        return PICO_ERROR_GENERIC;
-    }
-    mbedtls_sha256_free(&ctx);
-
-    if (memcmp(digest_data, parameter.hash, WIFI_SETTINGS_OTA_HASH_SIZE) != 0) {
-        return PICO_ERROR_MODIFIED_DATA;
+#if WIFI_SETTINGS_AB_STORAGE
+    // Target and the other A/B storage slot must not overlap either
+    for (uint slot = 0; slot < WIFI_SETTINGS_AB_NUM_SLOTS; slot++) {
+        wifi_settings_ab_get_slot(slot, &settings_file);
+        if (wifi_settings_range_has_overlap(&settings_file, &parameter.copy_to)) {
+            return PICO_ERROR_INVALID_ADDRESS;
+        }
     }
-    return 0;
+#endif
+    // The addresses look good - what about the data itself? Check the hash.
+    return check_flash_hash(&parameter.copy_from, parameter.hash);
 }
 
 // This handler will verify and then apply an over-the-air (OTA) update.
@@ -360,6 +926,8 @@ static void __no_inline_not_in_flash_func(do_ota_firmware_update)(
     // Continue the process started above (but running from RAM)
     wifi_settings_logical_range_t copy_from_lr;
     wifi_settings_range_translate_to_logical(&parameter->copy_from, &copy_from_lr);
+    wifi_settings_logical_range_t copy_to_lr;
+    wifi_settings_range_translate_to_logical(&parameter->copy_to, &copy_to_lr);
 
     // Commit any pending writes to external RAM, to avoid losing them in the subsequent flush:
     xip_cache_clean_all();
@@ -377,36 +945,215 @@ static void __no_inline_not_in_flash_func(do_ota_firmware_update)(
     // Connect the boot ROM functions here:
     funcs->connect_internal_flash_func();
 
-    // Erase
+    // Rewrite the target one erase unit at a time, using the (much faster) block erase
+    // command for each aligned 64kb block, and sector erase for the rest. Units which
+    // already match the new firmware are skipped, so a small change is installed quickly.
     funcs->flash_exit_xip_func(); // read access to memory off
-    for (uint32_t i = 0; i < parameter->copy_to.size; i += FLASH_SECTOR_SIZE) {
-        *watchdog_load = 1000000;  // set to 500ms (RP2040) or 1 second (RP2350)
-        funcs->flash_range_erase_func(
-            i + parameter->copy_to.start_address,
-            FLASH_SECTOR_SIZE, FLASH_BLOCK_SIZE, FLASH_BLOCK_ERASE_CMD);
-    }
-    funcs->flash_flush_cache_func();
-
-    // Write
-    for (uint32_t i = 0; i < parameter->copy_to.size; i += FLASH_SECTOR_SIZE) {
-        *watchdog_load = 1000000;  // set to 500ms (RP2040) or 1 second (RP2350)
+    uint32_t unit_size = 0;
+    for (uint32_t i = 0; i < parameter->copy_to.size; i += unit_size) {
+        const uint32_t unit_address = i + parameter->copy_to.start_address;
+        uint32_t unit_timeout = 0;
+        if (((unit_address % FLASH_BLOCK_SIZE) == 0)
+        && ((parameter->copy_to.size - i) >= FLASH_BLOCK_SIZE)) {
+            // A block erase may take up to 2 seconds (worst case for typical Flash chips)
+            unit_timeout = 6000000;  // set to 3 seconds (RP2040) or 6 seconds (RP2350)
+            unit_size = FLASH_BLOCK_SIZE;
+        } else {
+            unit_timeout = 1000000;  // set to 500ms (RP2040) or 1 second (RP2350)
+            unit_size = FLASH_SECTOR_SIZE;
+        }
 
-        // read data to be copied
+        // Compare
+        *watchdog_load = unit_timeout;
         funcs->flash_enter_cmd_xip_func(); // read access to memory on
         const uint32_t* copy_from_ptr =
             (const uint32_t*) (((uintptr_t) copy_from_lr.start_address) + i);
-        for (uint32_t j = 0; j < (FLASH_SECTOR_SIZE / 4); j++) {
-            copy_buffer[j] = copy_from_ptr[j];
+        const uint32_t* copy_to_ptr =
+            (const uint32_t*) (((uintptr_t) copy_to_lr.start_address) + i);
+        bool same = true;
+        for (uint32_t j = 0; j < (unit_size / 4); j++) {
+            if (copy_from_ptr[j] != copy_to_ptr[j]) {
+                same = false;
+                break;
+            }
         }
         funcs->flash_exit_xip_func(); // read access to memory off
+        if (same) {
+            continue;
+        }
 
-        funcs->flash_range_program_func(
-            i + parameter->copy_to.start_address,
-            (uint8_t*) copy_buffer, FLASH_SECTOR_SIZE);
+        // Erase
+        *watchdog_load = unit_timeout;
+        funcs->flash_range_erase_func(
+            unit_address, unit_size, FLASH_BLOCK_SIZE, FLASH_BLOCK_ERASE_CMD);
         funcs->flash_flush_cache_func();
+
+        // Write
+        for (uint32_t k = i; k < (i + unit_size); k += FLASH_SECTOR_SIZE) {
+            *watchdog_load = 1000000;  // set to 500ms (RP2040) or 1 second (RP2350)
+
+            // read data to be copied
+            funcs->flash_enter_cmd_xip_func(); // read access to memory on
+            copy_from_ptr = (const uint32_t*) (((uintptr_t) copy_from_lr.start_address) + k);
+            for (uint32_t j = 0; j < (FLASH_SECTOR_SIZE / 4); j++) {
+                copy_buffer[j] = copy_from_ptr[j];
+            }
+            funcs->flash_exit_xip_func(); // read access to memory off
+
+            funcs->flash_range_program_func(
+                k + parameter->copy_to.start_address,
+                (uint8_t*) copy_buffer, FLASH_SECTOR_SIZE);
+            funcs->flash_flush_cache_func();
+        }
     }
 
     // Reboot
     *watchdog_load = 10;  // set to 5us (RP2040) or 10us (RP2350)
     while(1) {} // Wait for watchdog reset
 }
+
+#if PICO_RP2350
+// This handler implements OTA updates using A/B partitions (Pico 2 only). The new
+// firmware is written into the other partition of the A/B pair while the current
+// firmware keeps running, and then the Pico reboots into it, so there is no
+// need to copy it over the current firmware with the Pico offline.
+//
+// ID_AB_OTA_TARGET_HANDLER returns the other partition (wifi_settings_flash_range_t)
+// and allows ID_WRITE_FLASH_HANDLER to write there. PICO_ERROR_NOT_FOUND is returned
+// if the current firmware is not in an A/B partition. This is a separate (one stage)
+// handler because the reply data of a two stage handler is only passed to callback2.
+int32_t wifi_settings_ab_ota_target_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    const uint32_t data_buffer_size = *output_data_size;
+    *output_data_size = 0;
+
+    if (input_data_size != 0) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    // The bootrom chooses the partition that a UF2 file would be written to,
+    // which is the other partition if the current one is part of an A/B pair.
+    // The data buffer is its work area.
+    resident_partition_t partition;
+#if PICO_RISCV
+    const uint32_t family_id = RP2350_RISCV_FAMILY_ID;
+#else
+    const uint32_t family_id = RP2350_ARM_S_FAMILY_ID;
+#endif
+    const int rc = rom_get_uf2_target_partition(
+            data_buffer, data_buffer_size, family_id, &partition);
+    if (rc < 0) {
+        return PICO_ERROR_NOT_FOUND;
+    }
+    wifi_settings_flash_range_t target;
+    const uint32_t first_sector = (partition.permissions_and_location &
+        PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_LSB;
+    const uint32_t last_sector = (partition.permissions_and_location &
+        PICOBIN_PARTITION_LOCATION_LAST_SECTOR_BITS) >> PICOBIN_PARTITION_LOCATION_LAST_SECTOR_LSB;
+    target.start_address = first_sector * FLASH_SECTOR_SIZE;
+    target.size = (last_sector + 1 - first_sector) * FLASH_SECTOR_SIZE;
+
+    // The target must not be the current partition, or contain the wifi-settings file
+    wifi_settings_flash_range_t current;
+    wifi_settings_range_get_partition(&current);
+    wifi_settings_flash_range_t settings_file;
+    wifi_settings_range_get_wifi_settings_file(&settings_file);
+    if ((last_sector < first_sector)
+    || wifi_settings_range_has_overlap(&target, &current)
+    || wifi_settings_range_has_overlap(&target, &settings_file)) {
+        return PICO_ERROR_NOT_FOUND;
+    }
+#if WIFI_SETTINGS_AB_STORAGE
+    for (uint slot = 0; slot < WIFI_SETTINGS_AB_NUM_SLOTS; slot++) {
+        wifi_settings_ab_get_slot(slot, &settings_file);
+        if (wifi_settings_range_has_overlap(&target, &settings_file)) {
+            return PICO_ERROR_NOT_FOUND;
+        }
+    }
+#endif
+    g_ab_target = target;
+    memcpy(data_buffer, &target, sizeof(wifi_settings_flash_range_t));
+    *output_data_size = sizeof(wifi_settings_flash_range_t);
+    return 0;
+}
+
+// ID_AB_OTA_HANDLER input_parameter WIFI_SETTINGS_AB_OTA_REBOOT: verifies the new
+// firmware (ab_ota_parameter_t) in the partition returned by ID_AB_OTA_TARGET_HANDLER,
+// and then wifi_settings_ab_ota_handler2 reboots into it.
+int32_t wifi_settings_ab_ota_handler1(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    *output_data_size = 0;
+
+    switch (input_parameter) {
+        case WIFI_SETTINGS_AB_OTA_REBOOT:
+            {
+                if (input_data_size != sizeof(ab_ota_parameter_t)) {
+                    return PICO_ERROR_INVALID_ARG;
+                }
+                // The parameters are passed on to handler2
+                *output_data_size = input_data_size;
+                // Stop erasing in the background, as the new firmware is complete
+                g_prepare.size = 0;
+                ab_ota_parameter_t parameter;
+                memcpy(&parameter, data_buffer, sizeof(ab_ota_parameter_t));
+                const int rc = check_for_alignment_error(&parameter.image);
+                if (rc != PICO_OK) {
+                    return rc;
+                }
+                // The image must start at the beginning of the partition
+                if ((!is_in_ab_target(&parameter.image))
+                || (parameter.image.start_address != g_ab_target.start_address)) {
+                    return PICO_ERROR_INVALID_ADDRESS;
+                }
+                return check_flash_hash(&parameter.image, parameter.hash);
+            }
+        default:
+            return PICO_ERROR_INVALID_ARG;
+    }
+}
+
+// This handler reboots into the new firmware, if it was verified by handler1.
+void wifi_settings_ab_ota_handler2(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t callback1_data_size,
+        int32_t callback1_return,
+        void* arg) {
+
+    if ((callback1_return != 0) || (callback1_data_size != sizeof(ab_ota_parameter_t))) {
+        return; // not a (successful) WIFI_SETTINGS_AB_OTA_REBOOT request
+    }
+    // A "flash update" boot: the bootrom prefers the newly written partition, and
+    // if the new firmware uses "try before you buy", it must call
+    // wifi_settings_ab_ota_buy() or the previous firmware will be restored
+    rom_reboot(REBOOT2_FLAG_REBOOT_TYPE_FLASH_UPDATE | REBOOT2_FLAG_NO_RETURN_ON_SUCCESS,
+               10, XIP_BASE + g_ab_target.start_address, 0);
+    watchdog_enable(1, 1);  // Fallback: watchdog triggered in 1ms
+    while(1) {} // Wait for watchdog reset
+}
+
+void wifi_settings_ab_ota_buy() {
+    boot_info_t boot_info;
+    if (rom_get_boot_info(&boot_info)
+    && (boot_info.tbyb_and_update_info & BOOT_TBYB_AND_UPDATE_FLAG_BUY_PENDING)) {
+        // The firmware has started, so keep it (the work area is only used if the
+        // other partition needs to be erased)
+        uint8_t* workarea = malloc(FLASH_SECTOR_SIZE);
+        if (workarea) {
+            rom_explicit_buy(workarea, FLASH_SECTOR_SIZE);
+            free(workarea);
+        }
+    }
+}
+#endif
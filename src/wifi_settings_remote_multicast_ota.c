@@ -0,0 +1,341 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Multicast OTA updates for wifi-settings. ID_MULTICAST_OTA_HANDLER joins
+ * a multicast group, and firmware image chunks received from the group are
+ * written to Flash, so that remote_picotool can send an image to many boards
+ * at once. Chunks are encrypted and authenticated with keys that are sent
+ * to each board through the remote service. Any sectors that were not received
+ * are sent afterwards with ID_WRITE_FLASH_HANDLER, and the image is checked and
+ * installed by ID_OTA_FIRMWARE_UPDATE_HANDLER or ID_AB_OTA_HANDLER as usual.
+ * This is activated when building with cmake -DWIFI_SETTINGS_REMOTE=2
+ * -DWIFI_SETTINGS_REMOTE_MULTICAST_OTA=1.
+ *
+ */
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_remote.h"
+#include "wifi_settings/wifi_settings_remote_memory_access_handlers.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+
+#include "hardware/flash.h"
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "mbedtls/aes.h"
+#include "lwip/igmp.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef ENABLE_REMOTE_MEMORY_ACCESS
+#error "ENABLE_REMOTE_MEMORY_ACCESS must be enabled, i.e. cmake -DWIFI_SETTINGS_REMOTE=2"
+#endif
+
+#if !LWIP_IGMP
+#error "WIFI_SETTINGS_REMOTE_MULTICAST_OTA requires LWIP_IGMP=1 in lwipopts.h"
+#endif
+
+// Each packet contains a header, one chunk of the image (encrypted with AES-256-CTR)
+// and a CBC-MAC of the header and the encrypted chunk. All packets have the same size,
+// which CBC-MAC requires.
+#define AES_BLOCK_SIZE      16
+#define AES_KEY_SIZE        WIFI_SETTINGS_MULTICAST_OTA_KEY_SIZE
+#define CHUNK_SIZE          1024
+#define HEADER_SIZE         16
+#define MAC_SIZE            AES_BLOCK_SIZE
+#define PACKET_SIZE         (HEADER_SIZE + CHUNK_SIZE + MAC_SIZE)
+#define PACKET_MAGIC        "PWM1"
+
+#define MAX_CHUNKS          (WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE / CHUNK_SIZE)
+#define MAX_SECTORS         (WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE / FLASH_SECTOR_SIZE)
+#define CHUNKS_PER_SECTOR   (FLASH_SECTOR_SIZE / CHUNK_SIZE)
+
+#if ((FLASH_SECTOR_SIZE % CHUNK_SIZE) != 0) || ((CHUNK_SIZE % FLASH_PAGE_SIZE) != 0)
+#error "CHUNK_SIZE must be a multiple of FLASH_PAGE_SIZE, and divide FLASH_SECTOR_SIZE"
+#endif
+
+// Header at the start of each packet (HEADER_SIZE bytes)
+typedef struct multicast_ota_header_t {
+    uint8_t     magic[4];
+    uint32_t    transfer_id;
+    uint32_t    offset;         // offset of the chunk within the image
+    uint32_t    reserved;       // zero
+} multicast_ota_header_t;
+
+typedef struct multicast_ota_t {
+    struct udp_pcb*             pcb;            // NULL if not receiving
+    ip4_addr_t                  group_address;
+    wifi_settings_flash_range_t image;          // size 0 if there was no BEGIN
+    uint32_t                    transfer_id;
+    uint32_t                    packets_accepted;
+    uint32_t                    packets_rejected;
+    mbedtls_aes_context         decrypt;        // CTR mode: only the encryption direction is used
+    mbedtls_aes_context         mac;
+    uint8_t                     chunk_received[(MAX_CHUNKS + 7) / 8];
+    uint8_t                     sector_started[(MAX_SECTORS + 7) / 8];  // sector was erased
+    uint8_t                     packet[PACKET_SIZE];
+} multicast_ota_t;
+
+static multicast_ota_t g_multicast_ota;
+
+static bool get_bit(const uint8_t* bitmap, uint32_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+static void set_bit(uint8_t* bitmap, uint32_t index) {
+    bitmap[index / 8] |= (uint8_t) (1 << (index % 8));
+}
+
+// CBC-MAC of the header and encrypted chunk (MAC key is separate from the encryption key)
+static void get_mac(mbedtls_aes_context* ctx, const uint8_t* data, uint8_t* mac) {
+    memset(mac, 0, MAC_SIZE);
+    for (uint offset = 0; offset < (HEADER_SIZE + CHUNK_SIZE); offset += AES_BLOCK_SIZE) {
+        for (uint i = 0; i < AES_BLOCK_SIZE; i++) {
+            mac[i] ^= data[offset + i];
+        }
+        if (0 != mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, mac, mac)) {
+            panic("multicast_ota get_mac failed");
+        }
+    }
+}
+
+// AES-CTR with a 128-bit big-endian counter, which is the offset of the block within
+// the image divided by AES_BLOCK_SIZE, so the whole image is one CTR stream
+// (the key is unique to each transfer). As in wifi_settings_remote.c, this is
+// built on mbedtls_aes_crypt_ecb so that it doesn't need MBEDTLS_CIPHER_MODE_CTR.
+static void decrypt_chunk(mbedtls_aes_context* ctx, uint32_t offset, uint8_t* data) {
+    uint8_t counter[AES_BLOCK_SIZE];
+    uint8_t keystream[AES_BLOCK_SIZE];
+    for (uint block = 0; block < CHUNK_SIZE; block += AES_BLOCK_SIZE) {
+        const uint32_t value = (offset + block) / AES_BLOCK_SIZE;
+        memset(counter, 0, sizeof(counter));
+        counter[AES_BLOCK_SIZE - 4] = (uint8_t) (value >> 24);
+        counter[AES_BLOCK_SIZE - 3] = (uint8_t) (value >> 16);
+        counter[AES_BLOCK_SIZE - 2] = (uint8_t) (value >> 8);
+        counter[AES_BLOCK_SIZE - 1] = (uint8_t) value;
+        if (0 != mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, counter, keystream)) {
+            panic("multicast_ota decrypt_chunk failed");
+        }
+        for (uint i = 0; i < AES_BLOCK_SIZE; i++) {
+            data[block + i] ^= keystream[i];
+        }
+    }
+}
+
+// Check a packet, and write the chunk to Flash. Return true if the packet was valid.
+static bool receive_packet(multicast_ota_t* mo) {
+    multicast_ota_header_t header;
+    memcpy(&header, mo->packet, sizeof(header));
+    if ((memcmp(header.magic, PACKET_MAGIC, sizeof(header.magic)) != 0)
+    || (header.transfer_id != mo->transfer_id)
+    || (header.reserved != 0)) {
+        return false;
+    }
+
+    // Authenticate before doing anything with the contents
+    uint8_t mac[MAC_SIZE];
+    get_mac(&mo->mac, mo->packet, mac);
+    uint8_t diff = 0;
+    for (uint i = 0; i < MAC_SIZE; i++) {
+        diff |= mac[i] ^ mo->packet[HEADER_SIZE + CHUNK_SIZE + i];
+    }
+    if ((diff != 0)
+    || ((header.offset % CHUNK_SIZE) != 0)
+    || (header.offset >= mo->image.size)) {
+        return false;
+    }
+
+    const uint32_t chunk_index = header.offset / CHUNK_SIZE;
+    const uint32_t sector_index = header.offset / FLASH_SECTOR_SIZE;
+    if (get_bit(mo->chunk_received, chunk_index)) {
+        return true;    // already written (the packet was repeated)
+    }
+    uint8_t* chunk = &mo->packet[HEADER_SIZE];
+    decrypt_chunk(&mo->decrypt, header.offset, chunk);
+
+    // The sector is erased when the first chunk for it arrives
+    wifi_settings_flash_range_t fr;
+    fr.start_address = mo->image.start_address + header.offset;
+    fr.size = CHUNK_SIZE;
+    const int rc = wifi_settings_write_flash_pages(&fr, chunk,
+                        !get_bit(mo->sector_started, sector_index));
+    if (rc != PICO_OK) {
+        // The sector will be sent again with ID_WRITE_FLASH_HANDLER
+        return false;
+    }
+    set_bit(mo->sector_started, sector_index);
+    set_bit(mo->chunk_received, chunk_index);
+    return true;
+}
+
+static void multicast_ota_recv(
+        void* arg,
+        struct udp_pcb* pcb,
+        struct pbuf* p,
+        const ip_addr_t* addr,
+        u16_t port) {
+
+    // Packets are dropped while the wifi_settings task may be writing Flash,
+    // and the sectors are sent again with ID_WRITE_FLASH_HANDLER
+    multicast_ota_t* mo = &g_multicast_ota;
+    const bool copied = (p->tot_len == PACKET_SIZE)
+        && (!wifi_settings_remote_is_task_busy())
+        && (pbuf_copy_partial(p, mo->packet, PACKET_SIZE, 0) == PACKET_SIZE);
+    pbuf_free(p);
+    if (copied && (mo->pcb == pcb) && receive_packet(mo)) {
+        mo->packets_accepted++;
+    } else {
+        mo->packets_rejected++;
+    }
+}
+
+// Stop receiving, and forget the keys (the lwIP lock must be held)
+static void multicast_ota_stop(multicast_ota_t* mo) {
+    if (!mo->pcb) {
+        return;
+    }
+    igmp_leavegroup(IP4_ADDR_ANY4, &mo->group_address);
+    udp_remove(mo->pcb);
+    mo->pcb = NULL;
+    mbedtls_aes_free(&mo->decrypt);
+    mbedtls_aes_free(&mo->mac);
+    memset(mo->packet, 0, sizeof(mo->packet));
+}
+
+static int32_t multicast_ota_begin(multicast_ota_t* mo, const multicast_ota_begin_parameter_t* parameter) {
+    // Check the range is aligned, not too large, and can be written
+    if ((parameter->image.start_address % FLASH_SECTOR_SIZE) != 0) {
+        return PICO_ERROR_BAD_ALIGNMENT;
+    }
+    if (((parameter->image.size % FLASH_SECTOR_SIZE) != 0)
+    || (parameter->image.size == 0)
+    || (parameter->image.size > WIFI_SETTINGS_REMOTE_MULTICAST_OTA_MAX_SIZE)
+    || (parameter->port == 0)
+    || (parameter->port > 0xffff)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+    if (!wifi_settings_can_write_flash(&parameter->image)) {
+        return PICO_ERROR_INVALID_ADDRESS;
+    }
+    ip4_addr_t group_address;
+    ip4_addr_set_u32(&group_address, parameter->group_address);
+    if (!ip4_addr_ismulticast(&group_address)) {
+        return PICO_ERROR_INVALID_ARG;
+    }
+
+    // A new transfer replaces the previous one
+    multicast_ota_stop(mo);
+    mo->image = parameter->image;
+    mo->group_address = group_address;
+    mo->transfer_id = parameter->transfer_id;
+    mo->packets_accepted = 0;
+    mo->packets_rejected = 0;
+    memset(mo->chunk_received, 0, sizeof(mo->chunk_received));
+    memset(mo->sector_started, 0, sizeof(mo->sector_started));
+
+    mbedtls_aes_init(&mo->decrypt);
+    mbedtls_aes_init(&mo->mac);
+    if ((0 != mbedtls_aes_setkey_enc(&mo->decrypt, parameter->encrypt_key, AES_KEY_SIZE * 8))
+    || (0 != mbedtls_aes_setkey_enc(&mo->mac, parameter->mac_key, AES_KEY_SIZE * 8))) {
+        panic("multicast_ota_begin: mbedtls_aes_setkey_enc failed");
+    }
+
+    mo->pcb = udp_new_ip_type(IPADDR_TYPE_V4);
+    if (!mo->pcb) {
+        mbedtls_aes_free(&mo->decrypt);
+        mbedtls_aes_free(&mo->mac);
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    if ((udp_bind(mo->pcb, IP4_ADDR_ANY, (u16_t) parameter->port) != ERR_OK)
+    || (igmp_joingroup(IP4_ADDR_ANY4, &mo->group_address) != ERR_OK)) {
+        udp_remove(mo->pcb);
+        mo->pcb = NULL;
+        mbedtls_aes_free(&mo->decrypt);
+        mbedtls_aes_free(&mo->mac);
+        return PICO_ERROR_RESOURCE_IN_USE;
+    }
+    udp_recv(mo->pcb, multicast_ota_recv, NULL);
+    return PICO_OK;
+}
+
+static int32_t multicast_ota_status(multicast_ota_t* mo, uint8_t* data_buffer, uint32_t* output_data_size) {
+    const uint32_t num_sectors = mo->image.size / FLASH_SECTOR_SIZE;
+    const uint32_t bitmap_size = (num_sectors + 7) / 8;
+    const uint32_t size = sizeof(multicast_ota_status_t) + bitmap_size;
+    if ((num_sectors == 0) || (size > *output_data_size)) {
+        *output_data_size = 0;
+        return PICO_ERROR_NOT_FOUND;
+    }
+    multicast_ota_status_t status;
+    status.num_sectors = num_sectors;
+    status.packets_accepted = mo->packets_accepted;
+    status.packets_rejected = mo->packets_rejected;
+    memcpy(data_buffer, &status, sizeof(status));
+
+    // A sector has been received if all of its chunks have been received
+    uint8_t* bitmap = &data_buffer[sizeof(status)];
+    memset(bitmap, 0, bitmap_size);
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        bool received = true;
+        for (uint32_t j = 0; j < CHUNKS_PER_SECTOR; j++) {
+            received = received && get_bit(mo->chunk_received, (i * CHUNKS_PER_SECTOR) + j);
+        }
+        if (received) {
+            set_bit(bitmap, i);
+        }
+    }
+    *output_data_size = size;
+    return (int32_t) num_sectors;
+}
+
+// This handler begins and ends the reception of a firmware image from a multicast
+// group. WIFI_SETTINGS_MULTICAST_OTA_BEGIN receives a multicast_ota_begin_parameter_t
+// with the Flash range for the image (which has the same restrictions as
+// ID_WRITE_FLASH_HANDLER) and the keys for the transfer. WIFI_SETTINGS_MULTICAST_OTA_END
+// stops receiving, and WIFI_SETTINGS_MULTICAST_OTA_STATUS returns a multicast_ota_status_t
+// and a bitmap of the sectors that were received (available until the next BEGIN).
+int32_t wifi_settings_multicast_ota_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+
+    multicast_ota_t* mo = &g_multicast_ota;
+    int32_t rc = PICO_ERROR_INVALID_ARG;
+
+    // The state is shared with the receive callback, so the lock is needed
+    // if this handler is running in the wifi_settings task
+    cyw43_arch_lwip_begin();
+    switch (input_parameter) {
+        case WIFI_SETTINGS_MULTICAST_OTA_BEGIN:
+            *output_data_size = 0;
+            if (input_data_size == sizeof(multicast_ota_begin_parameter_t)) {
+                multicast_ota_begin_parameter_t parameter;
+                memcpy(&parameter, data_buffer, sizeof(parameter));
+                rc = multicast_ota_begin(mo, &parameter);
+                memset(&parameter, 0, sizeof(parameter));
+            }
+            break;
+        case WIFI_SETTINGS_MULTICAST_OTA_STATUS:
+            rc = multicast_ota_status(mo, data_buffer, output_data_size);
+            break;
+        case WIFI_SETTINGS_MULTICAST_OTA_END:
+            *output_data_size = 0;
+            multicast_ota_stop(mo);
+            rc = PICO_OK;
+            break;
+        default:
+            *output_data_size = 0;
+            break;
+    }
+    cyw43_arch_lwip_end();
+    return rc;
+}
@@ -0,0 +1,567 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2025 Jack Whitham
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Emulator for a fleet of virtual Pico W boards running the remote service,
+# for testing remote_picotool with many boards at once, without hardware.
+#
+# Each board has its own loopback address (127.0.x.y), board ID, update secret
+# and Flash image, and replies to searches and single-datagram requests. Data sent
+# by a board can be delayed to emulate the latency, bandwidth and packet loss of a
+# WiFi network.
+# Run with --help for instructions.
+#
+
+import argparse
+import asyncio
+import collections
+import hashlib
+import random
+import socket
+import struct
+import sys
+import typing
+from asyncio import StreamReader, StreamWriter
+
+import remote_picotool
+from test_server import HandlerCallback, Server
+
+FLASH_SECTOR_SIZE = 0x1000
+LOGICAL_OFFSET = 0x10000000
+PROGRAM_SIZE = 0x10000              # start of Flash, can't be written by 'load'
+WIFI_SETTINGS_FILE_SIZE = 0x1000    # end of Flash
+BASE_BOARD_ID = 0xE6614854D3000000
+RETRANSMIT_TIME = 0.2               # seconds before TCP resends lost data (minimum RTO)
+EMULATOR_VERSION = "fleet_emulator"
+MAX_DATA_SIZE = 0x1000
+MAX_READ_SIZE = 0x4000              # WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE
+PICO_ERROR_INVALID_ARG = -5
+PICO_ERROR_INVALID_ADDRESS = -10
+UDP_RPC_REPLAY_CACHE = 16           # WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE
+
+class Link:
+    """Network conditions for data sent by a board.
+
+    latency_ms is the round trip time, and is added to the data sent by the board
+    (requests from the client are not delayed, so the client sees the same effect).
+    bandwidth is in bytes per second (0 = unlimited), shared by all of the board's
+    connections. loss is the probability of losing each write: search replies are
+    dropped, and TCP data is delayed as if it was resent."""
+
+    def __init__(self, latency_ms: float = 0.0, bandwidth: int = 0,
+                 loss: float = 0.0, seed: typing.Optional[int] = None) -> None:
+        self.latency = latency_ms / 1000.0
+        self.bandwidth = bandwidth
+        self.loss = loss
+        self.random = random.Random(seed)
+        self.transmit_end = 0.0
+
+    @property
+    def is_perfect(self) -> bool:
+        return (self.latency <= 0.0) and (self.bandwidth <= 0) and (self.loss <= 0.0)
+
+    def is_lost(self) -> bool:
+        return (self.loss > 0.0) and (self.random.random() < self.loss)
+
+    def get_delivery_time(self, size: int) -> float:
+        """Return the event loop time at which data sent now arrives at the client."""
+        now = asyncio.get_running_loop().time()
+        self.transmit_end = max(now, self.transmit_end)
+        if self.bandwidth > 0:
+            self.transmit_end += size / self.bandwidth
+        delivery_time = self.transmit_end + self.latency
+        if self.is_lost():
+            delivery_time += RETRANSMIT_TIME + self.latency
+        return delivery_time
+
+class LinkWriter:
+    """Replaces the StreamWriter for a connection to a board: data is delivered
+    in order, at the times given by the board's Link."""
+
+    def __init__(self, link: Link, writer: StreamWriter) -> None:
+        self.link = link
+        self.writer = writer
+        self.queue: typing.Deque[typing.Tuple[float, bytes]] = collections.deque()
+        self.ready = asyncio.Event()
+        self.closing = False
+        self.task = asyncio.create_task(self.deliver())
+
+    def write(self, data: bytes) -> None:
+        self.queue.append((self.link.get_delivery_time(len(data)), bytes(data)))
+        self.ready.set()
+
+    async def drain(self) -> None:
+        # The sender waits while the data is being transmitted
+        delay = self.link.transmit_end - asyncio.get_running_loop().time()
+        if delay > 0.0:
+            await asyncio.sleep(delay)
+        await self.writer.drain()
+
+    async def deliver(self) -> None:
+        while True:
+            while not self.queue:
+                if self.closing:
+                    return
+                self.ready.clear()
+                await self.ready.wait()
+            (delivery_time, data) = self.queue.popleft()
+            delay = delivery_time - asyncio.get_running_loop().time()
+            if delay > 0.0:
+                await asyncio.sleep(delay)
+            if self.writer.is_closing():
+                return
+            self.writer.write(data)
+
+    def is_closing(self) -> bool:
+        return self.closing or self.writer.is_closing()
+
+    def close(self) -> None:
+        # Data already written is delivered before the connection is closed
+        self.closing = True
+        self.ready.set()
+
+    async def wait_closed(self) -> None:
+        try:
+            await self.task
+        finally:
+            self.writer.close()
+            await self.writer.wait_closed()
+
+class SparseFlash:
+    """Flash image which only stores the sectors that have been written."""
+
+    def __init__(self, size: int) -> None:
+        self.size = size
+        self.sectors: typing.Dict[int, bytearray] = {}
+        self.num_writes = 0
+
+    def read(self, offset: int, size: int) -> bytes:
+        data = bytearray()
+        while size > 0:
+            sector_offset = offset % FLASH_SECTOR_SIZE
+            sector = self.sectors.get(offset - sector_offset)
+            part_size = min(size, FLASH_SECTOR_SIZE - sector_offset)
+            if sector is None:
+                data += b"\xff" * part_size
+            else:
+                data += sector[sector_offset:sector_offset + part_size]
+            offset += part_size
+            size -= part_size
+        return bytes(data)
+
+    def write(self, offset: int, data: bytes) -> None:
+        self.num_writes += 1
+        for i in range(0, len(data), FLASH_SECTOR_SIZE):
+            sector_address = offset + i - ((offset + i) % FLASH_SECTOR_SIZE)
+            sector = self.sectors.setdefault(sector_address, bytearray(b"\xff" * FLASH_SECTOR_SIZE))
+            part = data[i:i + FLASH_SECTOR_SIZE]
+            sector_offset = (offset + i) - sector_address
+            sector[sector_offset:sector_offset + len(part)] = part
+
+class BoardInfoHandler(HandlerCallback):
+    def __init__(self, board: "VirtualBoard") -> None:
+        self.board = board
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        if (len(data) != 0) or (parameter != 0):
+            return (b"", PICO_ERROR_INVALID_ARG)
+        result_data = self.board.get_pico_info().encode("utf-8")
+        return (result_data, len(result_data))
+
+class PingHandler(HandlerCallback):
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        return (b"", parameter)
+
+class FlashReadHandler(HandlerCallback):
+    def __init__(self, flash: SparseFlash) -> None:
+        self.flash = flash
+
+    def read(self, address: int, size: int) -> typing.Optional[bytes]:
+        offset = address - LOGICAL_OFFSET
+        if (address < LOGICAL_OFFSET) or ((offset + size) > self.flash.size):
+            # Only Flash can be read
+            return None
+        return self.flash.read(offset, size)
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        if (len(data) != remote_picotool.READ_PARAMETER.size) or (parameter != 0):
+            return (b"", PICO_ERROR_INVALID_ARG)
+        (address, size) = remote_picotool.READ_PARAMETER.unpack(data)
+        result_data = self.read(address, min(size, MAX_READ_SIZE))
+        if result_data is None:
+            return (b"", PICO_ERROR_INVALID_ADDRESS)
+        return (result_data, len(result_data))
+
+class FlashReadRangesHandler(FlashReadHandler):
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        result_data = b""
+        for i in range(0, len(data), remote_picotool.READ_PARAMETER.size):
+            (address, size) = remote_picotool.READ_PARAMETER.unpack(
+                    data[i:i + remote_picotool.READ_PARAMETER.size])
+            range_data = self.read(address, size)
+            if range_data is None:
+                return (b"", PICO_ERROR_INVALID_ADDRESS)
+            result_data += range_data
+        return (result_data, 0)
+
+class FlashHashHandler(HandlerCallback):
+    def __init__(self, flash: SparseFlash) -> None:
+        self.flash = flash
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        (start, size) = remote_picotool.HASH_FLASH_PARAMETER.unpack(data)
+        if (((start | size) % FLASH_SECTOR_SIZE) != 0) or ((start + size) > self.flash.size):
+            return (b"", PICO_ERROR_INVALID_ADDRESS)
+        result_data = b"".join(hashlib.sha256(self.flash.read(offset, FLASH_SECTOR_SIZE)).digest()
+                               for offset in range(start, start + size, FLASH_SECTOR_SIZE))
+        return (result_data, size // FLASH_SECTOR_SIZE)
+
+class FlashWriteHandler(HandlerCallback):
+    def __init__(self, flash: SparseFlash) -> None:
+        self.flash = flash
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Compression is not advertised, so the data is not compressed
+        offset = parameter & ~remote_picotool.WRITE_FLASH_REPORT_UNCHANGED
+        if (((offset | len(data)) % FLASH_SECTOR_SIZE) != 0) or (len(data) == 0):
+            return (b"", PICO_ERROR_INVALID_ARG)
+        if ((offset < PROGRAM_SIZE)
+        or ((offset + len(data)) > (self.flash.size - WIFI_SETTINGS_FILE_SIZE))):
+            return (b"", PICO_ERROR_INVALID_ADDRESS)
+        if self.flash.read(offset, len(data)) == data:
+            if parameter & remote_picotool.WRITE_FLASH_REPORT_UNCHANGED:
+                return (b"", remote_picotool.WRITE_FLASH_UNCHANGED)
+            return (b"", 0)
+        self.flash.write(offset, data)
+        return (b"", 0)
+
+class UpdateHandler(HandlerCallback):
+    def __init__(self, flash: SparseFlash) -> None:
+        self.flash = flash
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        if (parameter != 0) or (len(data) > WIFI_SETTINGS_FILE_SIZE):
+            return (b"", PICO_ERROR_INVALID_ARG)
+        file_data = data + (b"\xff" * (WIFI_SETTINGS_FILE_SIZE - len(data)))
+        self.flash.write(self.flash.size - WIFI_SETTINGS_FILE_SIZE, file_data)
+        return (b"", len(data))
+
+class VirtualBoardServer(Server):
+    """Server for a connection to a VirtualBoard. Unlike the test server,
+    the greeting contains the board ID and allows pipelining."""
+
+    def __init__(self, board: "VirtualBoard", reader: StreamReader,
+                 writer: typing.Union[StreamWriter, LinkWriter]) -> None:
+        Server.__init__(self, board.handlers, board.update_secret_hash,
+                        reader, writer)  # type: ignore
+        self.board = board
+
+    async def greeting(self) -> None:
+        """First message, server to client. Say hello."""
+        data = (b"xxx\r" + self.board.board_id.encode("ascii")
+                + b"\rpico-wifi-settings version " + EMULATOR_VERSION.encode("ascii") + b"\r\n")
+        data += remote_picotool.get_pad_bytes(len(data), remote_picotool.AES_BLOCK_SIZE)
+        num_blocks = len(data) // remote_picotool.AES_BLOCK_SIZE
+        data = struct.pack("<BBBB", remote_picotool.ID_GREETING,
+                        remote_picotool.PROTOCOL_VERSION, num_blocks,
+                        remote_picotool.GREETING_PIPELINING) + data[4:]
+        await self.write_block(data)
+
+class VirtualBoard:
+    """A virtual Pico W with its own address, board ID, update secret and Flash image."""
+
+    def __init__(self, address: str, board_id: str, update_secret: str,
+                 flash_size: int = 0x200000, link: typing.Optional[Link] = None,
+                 name: str = "") -> None:
+        self.address = address
+        self.board_id = board_id
+        self.name = name or ("virtual-" + board_id[-4:].lower())
+        self.link = link if link is not None else Link()
+        self.flash = SparseFlash(flash_size)
+        self.update_secret_hash = b""
+        self.set_update_secret(update_secret)
+        self.handlers: typing.Dict[int, HandlerCallback] = {
+            remote_picotool.ID_PICO_INFO_HANDLER: BoardInfoHandler(self),
+            remote_picotool.ID_PING_HANDLER: PingHandler(),
+            remote_picotool.ID_READ_HANDLER: FlashReadHandler(self.flash),
+            remote_picotool.ID_READ_RANGES_HANDLER: FlashReadRangesHandler(self.flash),
+            remote_picotool.ID_HASH_FLASH_HANDLER: FlashHashHandler(self.flash),
+            remote_picotool.ID_FLASH_WRITE_HANDLER: FlashWriteHandler(self.flash),
+            remote_picotool.ID_UPDATE_HANDLER: UpdateHandler(self.flash),
+        }
+        self.server: typing.Optional[asyncio.base_events.Server] = None
+        self.transport: typing.Optional[asyncio.DatagramTransport] = None
+        # Handlers which can be used by single-datagram requests (wifi_settings_remote_allow_udp_rpc)
+        self.udp_rpc_handlers = {remote_picotool.ID_PICO_INFO_HANDLER, remote_picotool.ID_PING_HANDLER}
+        self.udp_rpc_epoch = random.randint(1, 0xffffffff)
+        self.udp_rpc_min_counter = 1
+        self.udp_rpc_recent: typing.Deque[bytes] = collections.deque()
+        self.num_connections = 0
+        self.num_searches = 0
+        self.num_udp_requests = 0
+        self.connections: typing.Dict[asyncio.Task, StreamWriter] = {}
+        self.udp_rpc_tasks: typing.Set[asyncio.Task] = set()
+
+    def set_update_secret(self, update_secret: str) -> None:
+        config = remote_picotool.RemotePicotoolCfg(argparse.Namespace())
+        config.set("update_secret", update_secret)
+        self.update_secret_hash = config.update_secret_hash
+
+    def get_pico_info(self) -> str:
+        file_start = self.flash.size - WIFI_SETTINGS_FILE_SIZE
+        return "\n".join([
+            f"flash_sector_size=0x{FLASH_SECTOR_SIZE:x}",
+            f"max_data_size=0x{MAX_DATA_SIZE:x}",
+            f"flash_all=0x00000000:0x{self.flash.size:08x}",
+            f"flash_reusable=0x{PROGRAM_SIZE:08x}:0x{file_start:08x}",
+            f"flash_wifi_settings_file=0x{file_start:08x}:0x{self.flash.size:08x}",
+            f"flash_program=0x00000000:0x{PROGRAM_SIZE:08x}",
+            f"logical_offset=0x{LOGICAL_OFFSET:08x}",
+            "remote_memory_access=1",
+            f"max_read_size=0x{MAX_READ_SIZE:x}",
+            "flash_sector_hash=sha256",
+            "write_flash_unchanged=1",
+            "sysinfo_chip_id=0x20004927",
+            f"board_id={self.board_id}",
+            f"name={self.name}",
+            f"ip={self.address}",
+            f"wifi_settings_version={EMULATOR_VERSION}",
+            "",
+        ])
+
+    async def serve(self, reader: StreamReader, raw_writer: StreamWriter) -> None:
+        self.num_connections += 1
+        task = asyncio.current_task()
+        assert task is not None
+        self.connections[task] = raw_writer
+        writer: typing.Union[StreamWriter, LinkWriter] = raw_writer
+        if not self.link.is_perfect:
+            writer = LinkWriter(self.link, raw_writer)
+        try:
+            await VirtualBoardServer(self, reader, writer).run()
+        except Exception as e:
+            # e.g. wrong update secret
+            print(f"** {self.board_id} {self.address}: {type(e).__name__}: {e}", file=sys.stderr)
+        finally:
+            try:
+                writer.close()
+                await writer.wait_closed()
+            except Exception:
+                pass
+            del self.connections[task]
+
+    def search(self, request: bytes, addr: typing.Tuple[str, int]) -> None:
+        """Reply to a search request (from the broadcast listener or sent to this board)."""
+        if not request.startswith(remote_picotool.RESPONDER_REQUEST_MAGIC):
+            return
+        requested_id = request[len(remote_picotool.RESPONDER_REQUEST_MAGIC):].decode("ascii", errors="ignore")
+        if requested_id.upper() not in self.board_id:
+            return
+        self.num_searches += 1
+        if self.link.is_lost():
+            return
+        reply = (remote_picotool.RESPONDER_REPLY_MAGIC + self.board_id.encode("ascii") + b"\x00"
+                 + f"name={self.name}\nwifi_settings_version={EMULATOR_VERSION}\nversion=\n".encode("utf-8"))
+        asyncio.get_running_loop().call_later(self.link.latency, self.send_datagram, reply, addr)
+
+    def send_datagram(self, reply: bytes, addr: typing.Tuple[str, int]) -> None:
+        if self.transport is not None:
+            self.transport.sendto(reply, addr)
+
+    def datagram_received(self, data: bytes, addr: typing.Tuple[str, int]) -> None:
+        """Handle a datagram sent to this board: a search or a single-datagram request."""
+        if data.startswith(remote_picotool.UDP_RPC_REQUEST_MAGIC):
+            task = asyncio.get_running_loop().create_task(self.udp_rpc(data, addr))
+            self.udp_rpc_tasks.add(task)
+            task.add_done_callback(self.udp_rpc_tasks.discard)
+        else:
+            self.search(data, addr)
+
+    def udp_rpc_is_fresh(self, nonce: bytes) -> bool:
+        """Replay protection for single-datagram requests, as in wifi_settings_remote.c:
+        the epoch must match, and the counter and random bytes must not have been used.
+        As recent requests are forgotten, the minimum counter is increased."""
+        (epoch, counter, _) = remote_picotool.UDP_RPC_NONCE.unpack(nonce)
+        if ((epoch != self.udp_rpc_epoch) or (counter < self.udp_rpc_min_counter)
+                or (nonce[4:] in self.udp_rpc_recent)):
+            return False
+        if len(self.udp_rpc_recent) >= UDP_RPC_REPLAY_CACHE:
+            (oldest_counter, ) = struct.unpack("<Q", self.udp_rpc_recent.popleft()[:8])
+            self.udp_rpc_min_counter = max(self.udp_rpc_min_counter, oldest_counter + 1)
+        self.udp_rpc_recent.append(nonce[4:])
+        return True
+
+    async def udp_rpc(self, request: bytes, addr: typing.Tuple[str, int]) -> None:
+        """Reply to a single-datagram request. Requests which are not authentic are ignored."""
+        header_size = len(remote_picotool.UDP_RPC_REQUEST_MAGIC) + remote_picotool.UDP_RPC_NONCE.size
+        mac_size = remote_picotool.UDP_RPC_MAC_SIZE
+        if ((len(request) < (header_size + remote_picotool.UDP_RPC_REQUEST_HEADER.size + mac_size))
+                or (len(request) > remote_picotool.UDP_RPC_MAX_SIZE)):
+            return
+        nonce = request[len(remote_picotool.UDP_RPC_REQUEST_MAGIC):header_size]
+        secret_hash = self.update_secret_hash
+        if request[-mac_size:] != remote_picotool.get_udp_rpc_mac(secret_hash, nonce, b"CM",
+                                                                  request[:-mac_size]):
+            return
+        self.num_udp_requests += 1
+        if not self.udp_rpc_is_fresh(nonce):
+            reply = (remote_picotool.UDP_RPC_REJECT_MAGIC + nonce
+                     + remote_picotool.UDP_RPC_REJECT.pack(self.udp_rpc_epoch, self.udp_rpc_min_counter))
+        else:
+            body = remote_picotool.udp_rpc_crypt(secret_hash, nonce, b"CE", request[header_size:-mac_size])
+            (msg_type, parameter) = remote_picotool.UDP_RPC_REQUEST_HEADER.unpack(
+                    body[:remote_picotool.UDP_RPC_REQUEST_HEADER.size])
+            result_data = b""
+            result_value = 0
+            status = remote_picotool.ID_BAD_HANDLER_ERROR
+            handler = self.handlers.get(msg_type)
+            if (handler is not None) and (msg_type in self.udp_rpc_handlers):
+                (result_data, result_value) = await handler.callback1(
+                        body[remote_picotool.UDP_RPC_REQUEST_HEADER.size:], parameter)
+                result_data = result_data[:remote_picotool.UDP_RPC_MAX_SIZE - header_size
+                                          - remote_picotool.UDP_RPC_REPLY_HEADER.size - mac_size]
+                status = remote_picotool.ID_OK
+            reply_body = remote_picotool.UDP_RPC_REPLY_HEADER.pack(msg_type, status, result_value) + result_data
+            reply = (remote_picotool.UDP_RPC_REPLY_MAGIC + nonce
+                     + remote_picotool.udp_rpc_crypt(secret_hash, nonce, b"SE", reply_body))
+        reply += remote_picotool.get_udp_rpc_mac(secret_hash, nonce, b"SM", reply)
+        if self.link.is_lost():
+            return
+        asyncio.get_running_loop().call_later(self.link.latency, self.send_datagram, reply, addr)
+
+    async def start(self, port: int) -> None:
+        board = self
+
+        class SearchProtocol(asyncio.DatagramProtocol):
+            def datagram_received(self, data: bytes, addr: typing.Tuple[str, int]) -> None:
+                board.datagram_received(data, addr)
+
+        self.server = await asyncio.start_server(self.serve, self.address, port, reuse_address=True)
+        (self.transport, _) = await asyncio.get_running_loop().create_datagram_endpoint(
+                SearchProtocol, sock=get_udp_socket(self.address, port))
+
+    async def stop(self) -> None:
+        if self.transport is not None:
+            self.transport.close()
+            self.transport = None
+        for task in list(self.udp_rpc_tasks):
+            task.cancel()
+        if self.server is not None:
+            self.server.close()
+            await self.server.wait_closed()
+            self.server = None
+        # Connections which are still open are closed, and their tasks finish
+        tasks = list(self.connections.keys())
+        for raw_writer in self.connections.values():
+            raw_writer.close()
+        await asyncio.gather(*tasks, return_exceptions=True)
+
+def get_udp_socket(address: str, port: int) -> socket.socket:
+    """Get a UDP socket which shares the port with the other boards."""
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    s.bind((address, port))
+    s.setblocking(False)
+    return s
+
+def get_board_address(index: int) -> str:
+    """Loopback address for board index (127.0.1.1, 127.0.1.2, ...).
+    Linux accepts every 127.x.y.z address without configuration."""
+    return f"127.0.{1 + (index // 250)}.{1 + (index % 250)}"
+
+class Fleet:
+    """A fleet of virtual boards sharing a port, each at its own loopback address.
+
+    update_secret may contain "{index}" or "{board_id}" to give each board a
+    different secret. Searches broadcast to the port are passed to every board.
+    remote_picotool finds the boards with `--search-interface 127.0.0.1 --port <port>`."""
+
+    def __init__(self, num_boards: int, update_secret: str,
+                 port: int = 0, flash_size: int = 0x200000,
+                 link_factory: typing.Optional[typing.Callable[[int], Link]] = None) -> None:
+        self.port = port
+        self.boards: typing.List[VirtualBoard] = []
+        for index in range(num_boards):
+            board_id = f"{BASE_BOARD_ID + index:016X}"
+            self.boards.append(VirtualBoard(
+                address=get_board_address(index),
+                board_id=board_id,
+                update_secret=update_secret.format(index=index, board_id=board_id),
+                flash_size=flash_size,
+                link=link_factory(index) if link_factory is not None else None))
+        self.transport: typing.Optional[asyncio.DatagramTransport] = None
+
+    async def __aenter__(self) -> "Fleet":
+        await self.start()
+        return self
+
+    async def __aexit__(self, *args: typing.Any) -> None:
+        await self.stop()
+
+    async def start(self) -> None:
+        if self.port == 0:
+            # Find a free port for the first board, then use it for the others
+            s = get_udp_socket(get_board_address(0), 0)
+            self.port = s.getsockname()[1]
+            s.close()
+        for board in self.boards:
+            await board.start(self.port)
+        fleet = self
+
+        class BroadcastProtocol(asyncio.DatagramProtocol):
+            def datagram_received(self, data: bytes, addr: typing.Tuple[str, int]) -> None:
+                for board in fleet.boards:
+                    board.search(data, addr)
+
+        (self.transport, _) = await asyncio.get_running_loop().create_datagram_endpoint(
+                BroadcastProtocol, sock=get_udp_socket("", self.port))
+
+    async def stop(self) -> None:
+        if self.transport is not None:
+            self.transport.close()
+            self.transport = None
+        for board in self.boards:
+            await board.stop()
+
+async def run_fleet(args: argparse.Namespace) -> None:
+    def link_factory(index: int) -> Link:
+        return Link(latency_ms=args.latency + (random.random() * args.jitter),
+                    bandwidth=args.bandwidth, loss=args.loss, seed=index)
+
+    async with Fleet(args.boards, args.secret, args.port, args.flash_size, link_factory) as fleet:
+        for board in fleet.boards:
+            print(f"{board.address} {board.board_id}")
+        print(f"{len(fleet.boards)} boards on port {fleet.port}, use: remote_picotool "
+              f"--search-interface 127.0.0.1 --port {fleet.port} ...", flush=True)
+        await asyncio.Event().wait()
+
+def main() -> None:
+    parser = argparse.ArgumentParser("fleet_emulator",
+        description="Run a fleet of virtual Pico W boards for testing remote_picotool.")
+    parser.add_argument("--boards", type=int, default=100,
+        help="Number of boards (default 100)")
+    parser.add_argument("--port", type=int, default=remote_picotool.PORT_NUMBER,
+        help=f"Port for every board (default {remote_picotool.PORT_NUMBER}, 0 = any free port)")
+    parser.add_argument("--secret", type=str, default="fleet",
+        help="Update secret: '{index}' and '{board_id}' are replaced for each board (default 'fleet')")
+    parser.add_argument("--flash-size", type=lambda text: int(text, 0), default=0x200000,
+        help="Size of each board's Flash image (default 0x200000)")
+    parser.add_argument("--latency", type=float, default=0.0,
+        help="Round trip time in milliseconds (default 0)")
+    parser.add_argument("--jitter", type=float, default=0.0,
+        help="Up to this many milliseconds are added to the latency of each board (default 0)")
+    parser.add_argument("--bandwidth", type=int, default=0,
+        help="Bytes per second sent by each board (default 0 = unlimited)")
+    parser.add_argument("--loss", type=float, default=0.0,
+        help="Probability of losing each packet sent by a board (default 0)")
+    args = parser.parse_args()
+    try:
+        asyncio.run(run_fleet(args))
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,182 @@
+#
+# Copyright (c) 2025 Jack Whitham
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Tests for remote_picotool with a fleet of virtual boards (see fleet_emulator.py)
+#
+
+import asyncio
+import subprocess
+import time
+import typing
+import pytest
+import re
+
+import remote_picotool
+from fleet_emulator import Fleet, Link
+from test_server import REMOTE_PICOTOOL, temp_dir
+
+FLEET_SECRET = "FLEET001"
+
+async def run_remote_picotool(fleet: Fleet, *args: str) -> typing.Tuple[int, str]:
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--search-interface", "127.0.0.1", "--port", str(fleet.port),
+            *args,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+    assert len(stderr_bytes) == 0
+    return (await client.wait(), stdout_bytes.decode("utf-8"))
+
+@pytest.mark.asyncio
+async def test_fleet_list() -> None:
+    # GIVEN
+    # A fleet of virtual boards
+    async with Fleet(50, FLEET_SECRET) as fleet:
+
+        # WHEN
+        # Running the client program with the list command
+        (rc, stdout) = await run_remote_picotool(fleet, "list")
+
+        # THEN
+        # Every board replies to the search from its own address
+        assert rc == 0
+        for board in fleet.boards:
+            assert re.search(r"^" + re.escape(board.address) + r"\s+" + board.board_id + r"\s",
+                             stdout, flags=re.MULTILINE)
+            assert board.num_searches == 1
+
+@pytest.mark.asyncio
+async def test_fleet_info() -> None:
+    # GIVEN
+    # A fleet of virtual boards with 50ms round trip times, where one board
+    # has a different update secret
+    async with Fleet(20, FLEET_SECRET, link_factory=lambda index: Link(latency_ms=50)) as fleet:
+        fleet.boards[5].set_update_secret("WRONG-PASSWORD")
+
+        # WHEN
+        # Running the client program with the info command on all of the boards at once
+        start_time = time.monotonic()
+        (rc, stdout) = await run_remote_picotool(fleet, "--secret", FLEET_SECRET,
+                "--fleet", "all", "--jobs", "20", "info")
+        elapsed = time.monotonic() - start_time
+
+        # THEN
+        # All of the boards except one are updated concurrently
+        assert rc == 1
+        assert re.search(r"^19 of 20 boards ok$", stdout, flags=re.MULTILINE)
+        board = fleet.boards[5]
+        assert re.search(r"^" + re.escape(board.address) + r" " + board.board_id + r": remote error",
+                         stdout, flags=re.MULTILINE)
+        assert all(board.num_connections == 1 for board in fleet.boards)
+        assert elapsed < 10.0
+
+@pytest.mark.asyncio
+async def test_fleet_load_save(temp_dir) -> None:
+    # GIVEN
+    # A fleet of virtual boards with limited bandwidth and some packet loss,
+    # and a file to be loaded into one of them
+    load_file = temp_dir / "load.bin"
+    save_file = temp_dir / "save.bin"
+    test_data = bytes(range(256)) * 64
+    load_file.write_bytes(test_data)
+    async with Fleet(10, FLEET_SECRET,
+            link_factory=lambda index: Link(latency_ms=10, bandwidth=500000,
+                                            loss=0.05, seed=index)) as fleet:
+        board = fleet.boards[7]
+
+        # WHEN
+        # Loading the file into the board, found by its board ID, and saving it again
+        (load_rc, load_stdout) = await run_remote_picotool(fleet, "--secret", FLEET_SECRET,
+                "--id", board.board_id, "load", "--offset", "0x20000", str(load_file))
+        (save_rc, save_stdout) = await run_remote_picotool(fleet, "--secret", FLEET_SECRET,
+                "--address", board.address, "save", "--range",
+                hex(0x10020000), hex(0x10020000 + len(test_data)), str(save_file))
+
+        # THEN
+        # The data is in the board's Flash image, and no other board was changed
+        assert load_rc == 0
+        assert re.search(r"^.*Load ok, offset 0x0*20000.*$", load_stdout, flags=re.MULTILINE)
+        assert save_rc == 0
+        assert board.flash.read(0x20000, len(test_data)) == test_data
+        assert save_file.read_bytes() == test_data
+        assert all(other.flash.num_writes == 0 for other in fleet.boards if other is not board)
+
+@pytest.mark.asyncio
+async def test_fleet_client_pool() -> None:
+    # GIVEN
+    # A fleet of virtual boards, and a pool of sessions for the library
+    async with Fleet(30, FLEET_SECRET, link_factory=lambda index: Link(latency_ms=20)) as fleet:
+        config = remote_picotool.RemotePicotoolCfg()
+        config.set("update_secret", FLEET_SECRET)
+        config.set("search_interface", "127.0.0.1")
+        config.set("port", str(fleet.port))
+
+        async with remote_picotool.ClientPool(config) as pool:
+            # WHEN
+            # Sending several requests to every board concurrently
+            async def ping_board(board_id: str) -> typing.List[int]:
+                return [(await pool.run(board_id, remote_picotool.ID_PING_HANDLER, b"", i))[1]
+                        for i in range(5)]
+
+            replies = await asyncio.gather(*[ping_board(board.board_id) for board in fleet.boards])
+
+            # THEN
+            # Every request is answered, using one connection for each board
+            assert replies == [list(range(5))] * len(fleet.boards)
+            assert pool.num_connections == len(fleet.boards)
+            assert all(board.num_connections == 1 for board in fleet.boards)
+
+@pytest.mark.asyncio
+async def test_fleet_udp_info() -> None:
+    # GIVEN
+    # A fleet of virtual boards with 20ms round trip times
+    async with Fleet(5, FLEET_SECRET, link_factory=lambda index: Link(latency_ms=20)) as fleet:
+        board = fleet.boards[3]
+
+        # WHEN
+        # Running the client program with the info command, sending single datagrams
+        (rc, stdout) = await run_remote_picotool(fleet, "--secret", FLEET_SECRET,
+                "--address", board.address, "info", "--udp")
+
+        # THEN
+        # The board replies without a connection: the first request is rejected,
+        # as the client doesn't know the board's epoch, then the request is sent
+        # again in the binary format, which isn't supported, then in the text format
+        assert rc == 0
+        assert re.search(r"^ board id:\s+" + board.board_id + r"$", stdout, flags=re.MULTILINE)
+        assert re.search(r"^ hostname:\s+" + board.name + r"$", stdout, flags=re.MULTILINE)
+        assert board.num_connections == 0
+        assert board.num_udp_requests == 3
+
+@pytest.mark.asyncio
+async def test_fleet_udp_client() -> None:
+    # GIVEN
+    # A fleet of virtual boards, where one board has a different update secret
+    async with Fleet(3, FLEET_SECRET) as fleet:
+        fleet.boards[2].set_update_secret("WRONG-PASSWORD")
+        secret_hash = fleet.boards[0].update_secret_hash
+        clients = [remote_picotool.UDPClient(secret_hash, board.address, fleet.port, timeout=0.2)
+                   for board in fleet.boards]
+
+        # WHEN
+        # Sending several requests to each board
+        replies = [(await clients[0].run(remote_picotool.ID_PING_HANDLER, b"", i))[1]
+                   for i in range(20)]
+        with pytest.raises(remote_picotool.BadHandlerError):
+            await clients[1].run(remote_picotool.ID_READ_HANDLER, b"", 0)
+        with pytest.raises(remote_picotool.RemoteError) as e:
+            await clients[2].run(remote_picotool.ID_PING_HANDLER, b"", 0)
+
+        # THEN
+        # Requests are answered by boards with the same secret, and only if the handler
+        # is allowed; after learning the epoch, each request is accepted the first time,
+        # including those after the replay cache is full
+        assert replies == list(range(20))
+        assert "No reply" in str(e.value)
+        assert fleet.boards[0].num_udp_requests == 21
+        assert fleet.boards[0].udp_rpc_min_counter > 1
+        assert fleet.boards[1].num_udp_requests == 2
+        assert fleet.boards[2].num_udp_requests == 0
+        assert all(board.num_connections == 0 for board in fleet.boards)
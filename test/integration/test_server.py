@@ -8,8 +8,9 @@
 
 import argparse
 import asyncio
+import hashlib
+import json
 import os
-import pyaes  # type: ignore
 import struct
 import subprocess
 import sys
@@ -78,11 +79,23 @@ class HandlerCallback:
         This receives whatever data was returned by callback1."""
         pass
 
+    def get_pushed_replies(self, input_parameter: int) -> typing.List[typing.Tuple[bytes, int]]:
+        """Replies to send after the first one, without a request (a subscription)."""
+        return []
+
 
 class FakeRebootError(remote_picotool.RemoteError):
     """This is for the server mode."""
     pass
 
+class FakeDisconnectError(Exception):
+    """Raised by a handler to close the connection without a reply."""
+    pass
+
+class FakeBusyError(Exception):
+    """Raised by a handler to reply with ID_BUSY_ERROR and close the connection."""
+    pass
+
 class Server(remote_picotool.AbstractCommunication):
     """Communications specialisation for server side."""
 
@@ -141,10 +154,10 @@ class Server(remote_picotool.AbstractCommunication):
 
     def setup_aes(self, client_challenge: bytes, server_challenge: bytes) -> None:
         """Generate AES keys for server."""
-        self.enc_receive = pyaes.aes.AESModeOfOperationCBC(key=self.get_c2s_key(
-                client_challenge, server_challenge), iv=remote_picotool.AES_IV)
-        self.enc_transmit = pyaes.aes.AESModeOfOperationCBC(key=self.get_s2c_key(
-                client_challenge, server_challenge), iv=remote_picotool.AES_IV)
+        self.enc_receive = remote_picotool.AESCipher(self.get_c2s_key(
+                client_challenge, server_challenge), False)
+        self.enc_transmit = remote_picotool.AESCipher(self.get_s2c_key(
+                client_challenge, server_challenge), False)
 
     def validate(self, msg_type: int, data_size: int, parameter: int) -> None:
         """Raise an exception if the request is invalid."""
@@ -169,6 +182,7 @@ class Server(remote_picotool.AbstractCommunication):
             result_data = b""
             result_value = 0
             msg_type = remote_picotool.ID_CORRUPT_ERROR
+            reply = True
             try:
                 (msg_type, request_data, parameter) = await self.receive()
                 handler = self.handlers[msg_type]
@@ -196,12 +210,21 @@ class Server(remote_picotool.AbstractCommunication):
             except ConnectionResetError:
                 # Connection lost
                 return
+            except FakeDisconnectError:
+                # Fake loss of the connection (from running a handler)
+                reply = False
+                return
+            except FakeBusyError:
+                # No data buffer available: the Pico replies and then disconnects
+                msg_type = remote_picotool.ID_BUSY_ERROR
+                return
             except Exception as e:
                 msg_type = remote_picotool.ID_UNKNOWN_ERROR
                 raise
             finally:
                 # Send reply (possibly an error)
-                await self.transmit(msg_type, result_data, result_value)
+                if reply:
+                    await self.transmit(msg_type, result_data, result_value)
 
             # If there was no error and deferred mode was used
             if handler.two_stage_handler:
@@ -211,6 +234,10 @@ class Server(remote_picotool.AbstractCommunication):
                     # Fake reboot in deferred handler
                     raise
 
+            # Subscription replies, e.g. telemetry frames
+            for (pushed_data, pushed_value) in handler.get_pushed_replies(parameter):
+                await self.transmit(remote_picotool.ID_OK, pushed_data, pushed_value)
+
 async def create_server(handlers: typing.Dict[int, HandlerCallback]) -> typing.Tuple[asyncio.base_events.Server, int]:
     server: typing.List[asyncio.Server] = []
     config = remote_picotool.RemotePicotoolCfg(argparse.Namespace())
@@ -251,6 +278,24 @@ class PicoInfoHandler(HandlerCallback):
         result_data = self.contents.encode("utf-8")
         return (result_data, len(result_data))
 
+class BinaryPicoInfoHandler(HandlerCallback):
+    def __init__(self, contents: str, binary_contents: bytes,
+                 parameters: typing.List[int]) -> None:
+        self.contents = contents
+        self.binary_contents = binary_contents
+        self.parameters = parameters
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Older firmware rejects the binary format (binary_contents is empty)
+        assert len(data) == 0
+        self.parameters.append(parameter)
+        if parameter == remote_picotool.PICO_INFO_BINARY:
+            if len(self.binary_contents) == 0:
+                return (b"", -5)    # PICO_ERROR_INVALID_ARG
+            return (self.binary_contents, 0)
+        assert parameter == remote_picotool.PICO_INFO_TEXT
+        return (self.contents.encode("utf-8"), 0)
+
 class WriteHandler(HandlerCallback):
     def __init__(self, writes: typing.List[typing.Tuple[int, bytes]]) -> None:
         self.writes = writes
@@ -259,6 +304,35 @@ class WriteHandler(HandlerCallback):
         self.writes.append((parameter, data))
         return (b"", 0)
 
+class FakeFlash:
+    def __init__(self, size: int) -> None:
+        self.data = bytearray(size)
+        self.writes: typing.List[int] = []
+        self.disconnect_after_writes = 0
+
+class FakeFlashWriteHandler(HandlerCallback):
+    def __init__(self, flash: FakeFlash) -> None:
+        self.flash = flash
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        if len(self.flash.writes) == self.flash.disconnect_after_writes:
+            self.flash.disconnect_after_writes = -1
+            raise FakeDisconnectError()
+        self.flash.writes.append(parameter)
+        self.flash.data[parameter:parameter + len(data)] = data
+        return (b"", 0)
+
+class FakeFlashHashHandler(HandlerCallback):
+    def __init__(self, flash: FakeFlash) -> None:
+        self.flash = flash
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        (start, size) = remote_picotool.HASH_FLASH_PARAMETER.unpack(data)
+        result_data = b""
+        for offset in range(start, start + size, 0x1000):
+            result_data += hashlib.sha256(self.flash.data[offset:offset + 0x1000]).digest()
+        return (result_data, size // 0x1000)
+
 class ReadHandler(HandlerCallback):
     async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
         assert len(data) == 8
@@ -284,6 +358,48 @@ class OTAHandler(HandlerCallback):
         assert callback1_result == 0
         self.ota_calls.append(callback1_data)
 
+class TelemetryHandler(HandlerCallback):
+    def __init__(self, parameters: typing.List[int]) -> None:
+        self.parameters = parameters
+
+    @staticmethod
+    def get_frame(time_ms: int) -> typing.Tuple[bytes, int]:
+        # Connected, with one profiling counter (file_search)
+        frame = struct.pack(remote_picotool.TELEMETRY_FORMAT,
+                time_ms, -60, 7, 1, 6, 3, 2, 1, 12345, 65536, 1, 10, 0)
+        frame += struct.pack(remote_picotool.PROFILE_COUNTER_FORMAT, 5, 100, 400)
+        return (frame, 1)
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        assert len(data) == 0
+        self.parameters.append(parameter)
+        return self.get_frame(1000)
+
+    def get_pushed_replies(self, input_parameter: int) -> typing.List[typing.Tuple[bytes, int]]:
+        return [self.get_frame(1000 + (i * input_parameter)) for i in range(1, 3)]
+
+class EventLogHandler(HandlerCallback):
+    def __init__(self, pages: typing.List[bytes], parameters: typing.List[int]) -> None:
+        self.pages = pages
+        self.parameters = parameters
+
+    @staticmethod
+    def make_page(sequence: int, boot_count: int,
+                  entries: typing.List[typing.Tuple[int, int, int, int, int]]) -> bytes:
+        header_size = struct.calcsize(remote_picotool.EVENT_LOG_HEADER_FORMAT)
+        page = b"".join(struct.pack(remote_picotool.EVENT_LOG_ENTRY_FORMAT, *entry)
+                        for entry in entries)
+        page += b"\xff" * (remote_picotool.EVENT_LOG_PAGE_SIZE - header_size - len(page))
+        return struct.pack(remote_picotool.EVENT_LOG_HEADER_FORMAT,
+                remote_picotool.EVENT_LOG_MAGIC, sequence, boot_count,
+                remote_picotool.get_fnv1a_hash(page)) + page
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Two pages per request
+        assert len(data) == 0
+        self.parameters.append(parameter)
+        return (b"".join(self.pages[parameter:parameter + 2]), len(self.pages))
+
 @pytest.mark.asyncio
 async def test_info() -> None:
     # GIVEN
@@ -313,6 +429,57 @@ async def test_info() -> None:
     server.close()
     await server.wait_closed()
 
+@pytest.mark.asyncio
+async def test_info_binary() -> None:
+    # GIVEN
+    # Test server that replies to info requests in the binary format, and another
+    # test server that only supports the text format
+    binary_contents = (
+        struct.pack("<BBI", 1, 4, 0x1000) +                 # flash_sector_size
+        struct.pack("<BBII", 3, 8, 0, 0x400000) +           # flash_all
+        struct.pack("<BB", 18, 5) + b"hello" +              # name
+        struct.pack("<BB", 200, 3) + b"new" +               # a tag from newer firmware
+        struct.pack("<BBBIIQ", 29, 17, 0, 5, 100, 400))     # profile (file_search)
+    parameters: typing.List[int] = []
+    old_parameters: typing.List[int] = []
+    (server, port) = await create_server({
+        remote_picotool.ID_PICO_INFO_HANDLER: BinaryPicoInfoHandler("", binary_contents, parameters),
+    })
+    (old_server, old_port) = await create_server({
+        remote_picotool.ID_PICO_INFO_HANDLER: BinaryPicoInfoHandler("name=old\n", b"", old_parameters),
+    })
+
+    # WHEN
+    # Running the client program with the info command and the binary format for each server
+    outputs = []
+    for p in (port, old_port):
+        client = await asyncio.create_subprocess_exec(
+                str(REMOTE_PICOTOOL),
+                "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+                "--port", str(p),
+                "info", "--raw", "--binary",
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        (stdout_bytes, stderr_bytes) = await client.communicate()
+        assert 0 == await client.wait()
+        assert len(stderr_bytes) == 0
+        outputs.append(stdout_bytes.decode("utf-8"))
+
+    # THEN
+    # The binary reply is decoded to the same fields as the text format, and the
+    # text format is requested if the binary format is not supported
+    assert parameters == [remote_picotool.PICO_INFO_BINARY]
+    assert re.search(r"^flash_sector_size=0x00001000$", outputs[0], flags=re.MULTILINE)
+    assert re.search(r"^flash_all=0x00000000:0x00400000$", outputs[0], flags=re.MULTILINE)
+    assert re.search(r"^profile_file_search=count=5 total=400 max=100$", outputs[0], flags=re.MULTILINE)
+    assert re.search(r"^\s*hostname:\s+hello$", outputs[0], flags=re.MULTILINE)
+    assert re.search(r"^\s*flash size:\s+0x00400000$", outputs[0], flags=re.MULTILINE)
+    assert old_parameters == [remote_picotool.PICO_INFO_BINARY, remote_picotool.PICO_INFO_TEXT]
+    assert re.search(r"^\s*hostname:\s+old$", outputs[1], flags=re.MULTILINE)
+    server.close()
+    await server.wait_closed()
+    old_server.close()
+    await old_server.wait_closed()
+
 @pytest.mark.asyncio
 async def test_wrong_password() -> None:
     # GIVEN
@@ -371,6 +538,40 @@ async def test_unsupported_command() -> None:
     server.close()
     await server.wait_closed()
 
+@pytest.mark.asyncio
+async def test_busy_greeting() -> None:
+    # GIVEN
+    # Test server that sends ID_BUSY_ERROR instead of the greeting, as a Pico 2
+    # does while a streaming request is using the SHA-256 hardware
+    async def serve_callback(reader: StreamReader, writer: StreamWriter) -> None:
+        writer.write(bytes([remote_picotool.ID_BUSY_ERROR]).ljust(remote_picotool.AES_BLOCK_SIZE, b"\x00"))
+        await writer.drain()
+        writer.close()
+        await writer.wait_closed()
+
+    server = await asyncio.start_server(serve_callback, SERVER_ADDRESS)
+    port = server.sockets[0].getsockname()[1]
+
+    # WHEN
+    # Running the client program with the info command
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "info", "--raw",
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # Client program reports that the Pico is busy, rather than a bad message
+    assert 1 == await client.wait()
+    assert len(stderr_bytes) == 0
+    stdout = stdout_bytes.decode("utf-8")
+    assert re.search(r"^.*Remote error: BusyError.*$",
+            stdout, flags=re.MULTILINE)
+    server.close()
+    await server.wait_closed()
+
 def test_get_file_type() -> None:
     # GIVEN
     # UF2 file
@@ -502,6 +703,67 @@ max_data_size=0x100
     server.close()
     await server.wait_closed()
 
+class UnchangedFlashWriteHandler(HandlerCallback):
+    def __init__(self, flash: FakeFlash, parameters: typing.List[int]) -> None:
+        self.flash = flash
+        self.parameters = parameters
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Unchanged data is only reported if the client asked for this
+        self.parameters.append(parameter)
+        offset = parameter & ~remote_picotool.WRITE_FLASH_REPORT_UNCHANGED
+        if self.flash.data[offset:offset + len(data)] == data:
+            if parameter & remote_picotool.WRITE_FLASH_REPORT_UNCHANGED:
+                return (b"", remote_picotool.WRITE_FLASH_UNCHANGED)
+            return (b"", 0)
+        self.flash.data[offset:offset + len(data)] = data
+        return (b"", 0)
+
+@pytest.mark.asyncio
+async def test_load_unchanged(temp_dir) -> None:
+    # GIVEN
+    # Test servers where the first of two sectors to be loaded is already in Flash,
+    # one which accepts WRITE_FLASH_REPORT_UNCHANGED, and one which doesn't (older firmware)
+    temp_file = temp_dir / "tmp.bin"
+    test_data = bytes(range(256)) * 32
+    temp_file.write_bytes(test_data)
+    outputs = []
+    all_parameters = []
+    for pico_info in ("write_flash_unchanged=1\n", ""):
+        flash = FakeFlash(0x400000)
+        flash.data[0x10000:0x11000] = test_data[:0x1000]
+        parameters: typing.List[int] = []
+        (server, port) = await create_server({
+            remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler(pico_info + BASIC_PICO_INFO),
+            remote_picotool.ID_FLASH_WRITE_HANDLER: UnchangedFlashWriteHandler(flash, parameters),
+        })
+
+        # WHEN
+        # Running the client program with the load command
+        client = await asyncio.create_subprocess_exec(
+                str(REMOTE_PICOTOOL),
+                "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+                "--port", str(port),
+                "load", "--offset", "0x10000", str(temp_file),
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        (stdout_bytes, stderr_bytes) = await client.communicate()
+        assert 0 == await client.wait()
+        assert len(stderr_bytes) == 0
+        assert flash.data[0x10000:0x12000] == test_data
+        outputs.append(stdout_bytes.decode("utf-8"))
+        all_parameters.append(parameters)
+        server.close()
+        await server.wait_closed()
+
+    # THEN
+    # The unchanged sector is reported if the server allows it; otherwise the
+    # flag is not sent, so the result is 0 as before
+    flag = remote_picotool.WRITE_FLASH_REPORT_UNCHANGED
+    assert all_parameters[0] == [0x10000 | flag, 0x11000 | flag]
+    assert re.search(r"^.*Load ok, offset 0x0*10000, 4096 bytes unchanged$", outputs[0], flags=re.MULTILINE)
+    assert all_parameters[1] == [0x10000, 0x11000]
+    assert re.search(r"^.*Load ok, offset 0x0*10000$", outputs[1], flags=re.MULTILINE)
+
 @pytest.mark.asyncio
 async def test_load_uf2() -> None:
     # GIVEN
@@ -657,6 +919,203 @@ max_data_size=0x10000
     server.close()
     await server.wait_closed()
 
+@pytest.mark.asyncio
+async def test_ota_reconnect() -> None:
+    # GIVEN
+    # Test server as in test_ota, which can report the hash of each Flash sector,
+    # and which drops the connection instead of handling the fourth write
+    flash = FakeFlash(0x400000)
+    flash.disconnect_after_writes = 3
+    ota_calls: typing.List[bytes] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler("""
+flash_reusable=0x80000:0xe0000
+max_data_size=0x10000
+flash_sector_hash=sha256
+""" + BASIC_PICO_INFO),
+        remote_picotool.ID_FLASH_WRITE_HANDLER: FakeFlashWriteHandler(flash),
+        remote_picotool.ID_HASH_FLASH_HANDLER: FakeFlashHashHandler(flash),
+        remote_picotool.ID_OTA_FIRMWARE_UPDATE_HANDLER: OTAHandler(ota_calls),
+    }
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the OTA command
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "ota", str(TEST3_FILE_PATH),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # The client connected again and only sent the blocks that were not written,
+    # and then the program was installed
+    stdout = stdout_bytes.decode("utf-8")
+    print(stdout)
+    assert len(stderr_bytes) == 0
+    assert 0 == await client.wait()
+    assert re.search(r"^Connection lost, reconnecting \(attempt 1 of 3\)$", stdout, flags=re.MULTILINE)
+    assert flash.writes == [0x80000 + (i * 0x10000) for i in range(6)]
+    assert re.search(r"^.*Load ok, offset 0x0*80000, 196608 bytes unchanged$", stdout, flags=re.MULTILINE)
+    assert len(ota_calls) == 2
+    assert struct.unpack("<IIII", ota_calls[0][:16]) == (0x80000, 0x5c000, 0x0, 0x5c000)
+    assert ota_calls[0][16:] == hashlib.sha256(flash.data[0x80000:0xdc000]).digest()
+
+    server.close()
+    await server.wait_closed()
+
+class ABOTATargetHandler(HandlerCallback):
+    def __init__(self, start: int, size: int) -> None:
+        self.start = start
+        self.size = size
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        assert len(data) == 0
+        return (remote_picotool.AB_OTA_PARAMETER.pack(self.start, self.size), 0)
+
+class ABOTAHandler(HandlerCallback):
+    two_stage_handler = True
+
+    def __init__(self, calls: typing.List[typing.Tuple[int, bytes]]) -> None:
+        self.calls = calls
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        self.calls.append((parameter, data))
+        return (data, 0)
+
+@pytest.mark.asyncio
+async def test_ota_ab() -> None:
+    # GIVEN
+    # Test server for a Pico 2 running from an A/B partition, where the other
+    # partition is at 0x200000 .. 0x300000
+    writes: typing.List[typing.Tuple[int, bytes]] = []
+    ab_ota_calls: typing.List[typing.Tuple[int, bytes]] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler("""
+max_data_size=0x10000
+ab_ota=1
+""" + BASIC_PICO_INFO),
+        remote_picotool.ID_FLASH_WRITE_HANDLER: WriteHandler(writes),
+        remote_picotool.ID_AB_OTA_TARGET_HANDLER: ABOTATargetHandler(0x200000, 0x100000),
+        remote_picotool.ID_AB_OTA_HANDLER: ABOTAHandler(ab_ota_calls),
+    }
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the OTA command
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "ota", str(TEST3_FILE_PATH),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # The target partition was read back, the program was loaded into it,
+    # and then the Pico was asked to reboot into it
+    stdout = stdout_bytes.decode("utf-8")
+    print(stdout)
+    assert len(stderr_bytes) == 0
+    assert 0 == await client.wait()
+    assert len(writes) == 6
+    for (offset, _) in writes:
+        assert 0x200000 <= offset < 0x300000
+    assert len(ab_ota_calls) == 1
+    (parameter, data) = ab_ota_calls[0]
+    assert parameter == remote_picotool.AB_OTA_REBOOT
+    assert remote_picotool.AB_OTA_PARAMETER.unpack(data[:8]) == (0x200000, 0x5c000)
+    assert re.search(r"^Verify ok - rebooting into partition: 0x0*200000 .. 0x0*25c000$",
+            stdout, flags=re.MULTILINE)
+
+    server.close()
+    await server.wait_closed()
+
+class MulticastOTAHandler(HandlerCallback):
+    def __init__(self, calls: typing.List[typing.Tuple[int, bytes]], missing: typing.Set[int]) -> None:
+        self.calls = calls
+        self.missing = missing
+        self.num_sectors = 0
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        self.calls.append((parameter, data))
+        if parameter == remote_picotool.MULTICAST_OTA_BEGIN:
+            (start, size, _, _, _, _, _) = remote_picotool.MULTICAST_OTA_BEGIN_PARAMETER.unpack(data)
+            self.num_sectors = size // 0x1000
+            return (b"", 0)
+        if parameter == remote_picotool.MULTICAST_OTA_STATUS:
+            bitmap = bytearray((self.num_sectors + 7) // 8)
+            for i in range(self.num_sectors):
+                if i not in self.missing:
+                    bitmap[i // 8] |= 1 << (i % 8)
+            result_data = remote_picotool.MULTICAST_OTA_STATUS_REPLY.pack(
+                    self.num_sectors, self.num_sectors * 4, 0) + bytes(bitmap)
+            return (result_data, self.num_sectors)
+        return (b"", 0)
+
+@pytest.mark.asyncio
+async def test_ota_multicast() -> None:
+    # GIVEN
+    # Test server as in test_ota, which also supports multicast OTA updates,
+    # and reports that sectors 1 and 91 (the last) were not received by multicast
+    writes: typing.List[typing.Tuple[int, bytes]] = []
+    ota_calls: typing.List[bytes] = []
+    multicast_calls: typing.List[typing.Tuple[int, bytes]] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler("""
+flash_reusable=0x80000:0xe0000
+max_data_size=0x10000
+multicast_ota=1
+""" + BASIC_PICO_INFO),
+        remote_picotool.ID_FLASH_WRITE_HANDLER: WriteHandler(writes),
+        remote_picotool.ID_OTA_FIRMWARE_UPDATE_HANDLER: OTAHandler(ota_calls),
+        remote_picotool.ID_MULTICAST_OTA_HANDLER: MulticastOTAHandler(multicast_calls, {1, 91}),
+    }
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the OTA command in multicast mode
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--fleet", SERVER_ADDRESS,
+            "--port", str(port),
+            "ota", "--multicast", "--multicast-interval", "0", str(TEST3_FILE_PATH),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # The multicast transfer was begun, ended and checked
+    stdout = stdout_bytes.decode("utf-8")
+    print(stdout)
+    assert len(stderr_bytes) == 0
+    assert 0 == await client.wait()
+    assert [parameter for (parameter, data) in multicast_calls] == [
+            remote_picotool.MULTICAST_OTA_BEGIN,
+            remote_picotool.MULTICAST_OTA_END,
+            remote_picotool.MULTICAST_OTA_STATUS]
+    begin = remote_picotool.MULTICAST_OTA_BEGIN_PARAMETER.unpack(multicast_calls[0][1])
+    assert begin[0] == 0x80000      # load offset, as in test_ota
+    assert begin[1] == 0x5c000      # size
+
+    # Only the missing sectors were uploaded directly
+    assert writes == [
+            (0x81000, writes[0][1]),
+            (0xdb000, writes[1][1])]
+    assert len(writes[0][1]) == 0x1000
+    assert len(writes[1][1]) == 0x1000
+    assert re.search(r"^.*Multicast received 90 of 92 sectors.*$", stdout, flags=re.MULTILINE)
+
+    # Then the image was verified and installed as usual
+    assert len(ota_calls) == 2
+    copy_data = struct.unpack("<IIII", ota_calls[0][:16])
+    assert copy_data == (0x80000, 0x5c000, 0x0, 0x5c000)
+    assert re.search(r"^1 of 1 boards ok$", stdout, flags=re.MULTILINE)
+
+    server.close()
+    await server.wait_closed()
+
 @pytest.mark.asyncio
 async def test_without_enough_space() -> None:
     # GIVEN
@@ -748,6 +1207,160 @@ async def test_save(temp_dir) -> None:
     server.close()
     await server.wait_closed()
 
+class SessionReadHandler(ReadHandler):
+    def __init__(self, sessions: typing.Set[asyncio.Task]) -> None:
+        self.sessions = sessions
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Each connection to the test server is served by a different task
+        self.sessions.add(asyncio.current_task())
+        return await ReadHandler.callback1(self, data, parameter)
+
+@pytest.mark.asyncio
+async def test_save_parallel(temp_dir) -> None:
+    # GIVEN
+    # Test server with a pool of 3 sessions, one in use
+    temp_file = temp_dir / "tmp.bin"
+    block_size = 0x1000
+    sessions: typing.Set[asyncio.Task] = set()
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler(
+            "remote_session_pool_size=3\nremote_sessions_active=1\n" + BASIC_PICO_INFO),
+        remote_picotool.ID_READ_HANDLER: SessionReadHandler(sessions),
+    }
+    num_blocks = 20
+    start_address = 0x20000000
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the save command for a large range
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "save", "--range",
+            hex(start_address), hex(start_address + (num_blocks * block_size)),
+            str(temp_file),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # All of the sessions in the pool were used, and each block is at the right offset
+    assert 0 == await client.wait()
+    assert len(stderr_bytes) == 0
+    stdout = stdout_bytes.decode("utf-8")
+    assert re.search(r"^Save ok.*$", stdout, flags=re.MULTILINE)
+    assert len(sessions) == 3
+    all_data = temp_file.read_bytes()
+    assert len(all_data) == (num_blocks * block_size)
+    for i in range(num_blocks):
+        block_data = all_data[i * block_size : (i + 1) * block_size]
+        (address, size) = struct.unpack("<II", block_data[:8])
+        assert size == block_size
+        assert address == (start_address + (i * block_size))
+
+    server.close()
+    await server.wait_closed()
+
+class BufferPoolReadHandler(SessionReadHandler):
+    def __init__(self, sessions: typing.Set[asyncio.Task], pool_size: int) -> None:
+        SessionReadHandler.__init__(self, sessions)
+        self.pool_size = pool_size
+        self.in_use = 0
+        self.num_busy = 0
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Each request holds a data buffer while it is handled
+        if self.in_use >= self.pool_size:
+            self.num_busy += 1
+            raise FakeBusyError()
+        self.in_use += 1
+        try:
+            await asyncio.sleep(0.001)
+            return await SessionReadHandler.callback1(self, data, parameter)
+        finally:
+            self.in_use -= 1
+
+async def run_save_with_buffer_pool(temp_file: Path, pico_info: str,
+                                    read_handler: BufferPoolReadHandler,
+                                    num_blocks: int, start_address: int) -> str:
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler(pico_info + BASIC_PICO_INFO),
+        remote_picotool.ID_READ_HANDLER: read_handler,
+    }
+    (server, port) = await create_server(handlers)
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "save", "--range",
+            hex(start_address), hex(start_address + (num_blocks * 0x1000)),
+            str(temp_file),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+    assert 0 == await client.wait()
+    assert len(stderr_bytes) == 0
+    server.close()
+    await server.wait_closed()
+
+    all_data = temp_file.read_bytes()
+    assert len(all_data) == (num_blocks * 0x1000)
+    for i in range(num_blocks):
+        block_data = all_data[i * 0x1000 : (i + 1) * 0x1000]
+        (address, size) = struct.unpack("<II", block_data[:8])
+        assert size == 0x1000
+        assert address == (start_address + (i * 0x1000))
+    return stdout_bytes.decode("utf-8")
+
+@pytest.mark.asyncio
+async def test_save_buffer_pool(temp_dir) -> None:
+    # GIVEN
+    # Test server with a pool of 3 sessions, one in use, and the default
+    # data buffer pool (one per session), and another with only 2 data buffers
+    sessions: typing.Set[asyncio.Task] = set()
+    small_sessions: typing.Set[asyncio.Task] = set()
+    read_handler = BufferPoolReadHandler(sessions, 3)
+    small_read_handler = BufferPoolReadHandler(small_sessions, 2)
+
+    # WHEN
+    # Running the client program with the save command for a large range
+    stdout = await run_save_with_buffer_pool(temp_dir / "tmp.bin",
+            "remote_session_pool_size=3\nremote_sessions_active=1\n"
+            "remote_data_buffer_pool_size=3\n", read_handler, 20, 0x20000000)
+    small_stdout = await run_save_with_buffer_pool(temp_dir / "tmp2.bin",
+            "remote_session_pool_size=3\nremote_sessions_active=1\n"
+            "remote_data_buffer_pool_size=2\n", small_read_handler, 20, 0x20000000)
+
+    # THEN
+    # The number of sessions is limited by the data buffers, so no request is
+    # rejected as busy, and each block is at the right offset
+    assert re.search(r"^Save ok.*$", stdout, flags=re.MULTILINE)
+    assert len(sessions) == 3
+    assert read_handler.num_busy == 0
+    assert re.search(r"^Save ok.*$", small_stdout, flags=re.MULTILINE)
+    assert len(small_sessions) == 2
+    assert small_read_handler.num_busy == 0
+
+@pytest.mark.asyncio
+async def test_save_busy(temp_dir) -> None:
+    # GIVEN
+    # Test server with a pool of 3 sessions, but only one data buffer, which
+    # (like older firmware) doesn't report the size of the data buffer pool
+    sessions: typing.Set[asyncio.Task] = set()
+    read_handler = BufferPoolReadHandler(sessions, 1)
+
+    # WHEN
+    # Running the client program with the save command for a large range
+    stdout = await run_save_with_buffer_pool(temp_dir / "tmp.bin",
+            "remote_session_pool_size=3\nremote_sessions_active=1\n",
+            read_handler, 20, 0x20000000)
+
+    # THEN
+    # Requests were rejected as busy, and the blocks were read again
+    # on one session, so each block is at the right offset
+    assert re.search(r"^Save ok.*$", stdout, flags=re.MULTILINE)
+    assert read_handler.num_busy > 0
+
 @pytest.mark.asyncio
 async def test_unsupported_memory_access(temp_dir) -> None:
     # GIVEN
@@ -777,3 +1390,143 @@ async def test_unsupported_memory_access(temp_dir) -> None:
 
     server.close()
     await server.wait_closed()
+
+@pytest.mark.asyncio
+async def test_telemetry() -> None:
+    # GIVEN
+    # Test server that sends telemetry frames after a subscription request
+    parameters: typing.List[int] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_TELEMETRY_HANDLER: TelemetryHandler(parameters),
+    }
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the telemetry command, for 3 frames
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "telemetry", "--interval", "700", "--count", "3", "--json",
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # One subscription request with the interval, and a line for the reply
+    # and each of the pushed frames
+    assert 0 == await client.wait()
+    assert len(stderr_bytes) == 0
+    assert parameters == [700]
+    frames = [json.loads(line) for line in stdout_bytes.decode("utf-8").splitlines()]
+    assert [frame["time_ms"] for frame in frames] == [1000, 1700, 2400]
+    assert frames[0]["rssi"] == -60
+    assert frames[0]["link_up"] is True
+    assert frames[0]["heap_used"] == 12345
+    assert frames[0]["profile"] == {"file_search": {"count": 5, "total": 400, "max": 100}}
+    server.close()
+    await server.wait_closed()
+
+@pytest.mark.asyncio
+async def test_events() -> None:
+    # GIVEN
+    # Test server with an event log containing an erased page, a page which was
+    # not completely programmed, a page from the previous boot, and the
+    # entries buffered in RAM
+    page_size = remote_picotool.EVENT_LOG_PAGE_SIZE
+    corrupt_page = bytearray(EventLogHandler.make_page(5, 0, [(10, 18, 1, -70, 0)]))
+    corrupt_page[page_size - 1] = 0
+    pages = [
+        b"\xff" * page_size,
+        bytes(corrupt_page),
+        EventLogHandler.make_page(6, 3, [(5, 16, 0, 0, 0), (1200, 18, 2, -65, 1),
+                                         (1500, 21, 2, 0, 0)]),
+        EventLogHandler.make_page(7, 4, [(5, 16, 0, 0, 0)]),
+    ]
+    parameters: typing.List[int] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_EVENT_LOG_HANDLER: EventLogHandler(pages, parameters),
+    }
+    (server, port) = await create_server(handlers)
+
+    # WHEN
+    # Running the client program with the events command
+    client = await asyncio.create_subprocess_exec(
+            str(REMOTE_PICOTOOL),
+            "--secret", UPDATE_SECRET, "--address", SERVER_ADDRESS,
+            "--port", str(port),
+            "events", "--json",
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (stdout_bytes, stderr_bytes) = await client.communicate()
+
+    # THEN
+    # All of the pages are read, two at a time, and the events are printed
+    # in order, without the erased and invalid pages
+    assert 0 == await client.wait()
+    assert len(stderr_bytes) == 0
+    assert parameters == [0, 2]
+    events = [json.loads(line) for line in stdout_bytes.decode("utf-8").splitlines()]
+    assert [(event["boot"], event["time_ms"], event["event"]) for event in events] == [
+        (3, 5, "boot"), (3, 1200, "join"), (3, 1500, "auth_failed"), (4, 5, "boot")]
+    assert events[1]["ssid_index"] == 2
+    assert events[1]["rssi"] == -65
+    assert events[1]["arg"] == 1
+    server.close()
+    await server.wait_closed()
+
+class SessionEchoHandler(HandlerCallback):
+    def __init__(self, sessions: typing.List[asyncio.Task]) -> None:
+        self.sessions = sessions
+
+    async def callback1(self, data: bytes, parameter: int) -> typing.Tuple[bytes, int]:
+        # Each connection to the test server is served by a different task
+        task = asyncio.current_task()
+        assert task is not None
+        if task not in self.sessions:
+            self.sessions.append(task)
+        if parameter < 0:
+            raise FakeDisconnectError()
+        return (data, parameter)
+
+@pytest.mark.asyncio
+async def test_client_pool() -> None:
+    # GIVEN
+    # Test server with an echo handler, and a pool of sessions for the library
+    sessions: typing.List[asyncio.Task] = []
+    handlers: typing.Dict[int, HandlerCallback] = {
+        remote_picotool.ID_PICO_INFO_HANDLER: PicoInfoHandler("name=hello"),
+        remote_picotool.ID_FIRST_USER_HANDLER: SessionEchoHandler(sessions),
+    }
+    (server, port) = await create_server(handlers)
+    config = remote_picotool.RemotePicotoolCfg(argparse.Namespace())
+    config.set("update_secret", UPDATE_SECRET)
+    config.set("board_address", SERVER_ADDRESS)
+    config.set("port", str(port))
+
+    async with remote_picotool.ClientPool(config) as pool:
+        # WHEN
+        # Several requests are made using the pool
+        replies = [await pool.run(None, remote_picotool.ID_FIRST_USER_HANDLER, b"abc", i)
+                   for i in range(3)]
+        pico_info = await pool.get_pico_info()
+
+        # THEN
+        # One connection is made, and its session is used for every request
+        assert replies == [(b"abc", 0), (b"abc", 1), (b"abc", 2)]
+        assert pico_info.name == "hello"
+        assert pool.num_connections == 1
+        assert len(sessions) == 1
+
+        # WHEN
+        # The connection is lost during a request, and then another request is made
+        with pytest.raises(ConnectionError):
+            await pool.run(None, remote_picotool.ID_FIRST_USER_HANDLER, b"", -1)
+        reply = await pool.run(None, remote_picotool.ID_FIRST_USER_HANDLER, b"def", 4)
+
+        # THEN
+        # The lost session is not reused: the request uses a new connection
+        assert reply == (b"def", 4)
+        assert pool.num_connections == 2
+        assert len(sessions) == 2
+
+    server.close()
+    await server.wait_closed()
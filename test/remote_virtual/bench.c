@@ -0,0 +1,974 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Benchmark for wifi_settings_remote.c (remote_virtual --bench)
+ *
+ * This is a client for the remote service which connects in memory (see
+ * fake_lwip_loopback_connect), so that handshakes and requests go through the
+ * real state machine and crypto without any sockets. It reports the cost of
+ * the server side for each operation: the time spent in the lwIP callbacks,
+ * the time per byte for receiving, decryption, hashing and encryption, and
+ * the number of tcp_write calls and pbuf operations. The client uses OpenSSL
+ * directly, so its own crypto is not counted.
+ *
+ * The "telemetry" scenario subscribes to ID_TELEMETRY_HANDLER, moving the time
+ * forward (fake_time_advance_ms) to receive each frame without waiting.
+ * Before the scenarios, the time is also moved forward to check that an idle
+ * session is ended (WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS); this is not timed.
+ *
+ * The "udp" scenario sends ID_PING_HANDLER requests as single datagrams
+ * (WIFI_SETTINGS_REMOTE_UDP_RPC), without a connection. Before the scenarios,
+ * the replay protection for these is also checked; this is not timed.
+ *
+ * A streaming request is also checked with another session connecting while
+ * it is in progress. With single-state SHA-256 (MBEDTLS_SHA256_ALT, as on Pico 2),
+ * the other session is refused with ID_BUSY_ERROR; otherwise it is served as usual.
+ *
+ * The last scenario ("flood") is a client which fails the handshake, then
+ * keeps connecting, as a scanner might. These connections are rejected
+ * by the backoff (WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES), so it must run last.
+ *
+ */
+
+#include "remote_virtual.h"
+#include "pico/stdlib.h"
+#include "lwip/tcp.h"
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_remote.h"
+#include "wifi_settings/wifi_settings_remote_handlers.h"
+#include "wifi_settings/wifi_settings_remote_memory_access_handlers.h"
+#include "wifi_settings/wifi_settings_sha256.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SEGMENT_SIZE                1460    // TCP_MSS
+#define AES_BLOCK_SIZE              16
+#define AES_KEY_SIZE                32
+#define HMAC_DIGEST_SIZE            32
+#define CHALLENGE_SIZE              15
+#define AUTHENTICATION_SIZE         15
+#define DATA_HASH_SIZE              7
+#define HEADER_SIZE                 (AES_BLOCK_SIZE - DATA_HASH_SIZE)
+#define PROTOCOL_VERSION            1
+#define PROTOCOL_VERSION_CTR        2
+#define GREETING_TICKETS            'r'
+#define GREETING_CAP_CTR            0x01
+#define ACKNOWLEDGE_TICKET          'T'
+#define MAX_PIPELINE_DEPTH          16
+#define WRITE_FLASH_ADDRESS         0x100000
+#define TELEMETRY_INTERVAL_MS       1000
+#define UDP_RPC_HEADER_SIZE         20      // magic, nonce
+#define UDP_RPC_NONCE_SIZE          16
+#define UDP_RPC_BODY_HEADER_SIZE    8
+#define UDP_RPC_MAC_SIZE            16
+#define MAX_DATAGRAM_SIZE           2048
+#define STREAM_DATA_SIZE            1024
+
+#define ID_GREETING         70
+#define ID_REQUEST          71
+#define ID_CHALLENGE        72
+#define ID_AUTHENTICATION   73
+#define ID_RESPONSE         74
+#define ID_ACKNOWLEDGE      75
+#define ID_AUTH_ERROR       77
+#define ID_OK               76
+#define ID_BAD_HANDLER_ERROR 81
+#define ID_RESUME           86
+#define ID_RESUMED          87
+#define ID_TICKET           88
+#define ID_TELEMETRY_HANDLER 112
+#define ID_PING_HANDLER     114
+#define ID_READ_HANDLER     122
+#define ID_WRITE_FLASH_HANDLER 125
+
+typedef enum scenario_t {
+    SCENARIO_FULL_HANDSHAKE,
+    SCENARIO_RESUMED_HANDSHAKE,
+    SCENARIO_PING,
+    SCENARIO_READ,
+    SCENARIO_WRITE,
+    SCENARIO_TELEMETRY,
+    SCENARIO_UDP,
+    SCENARIO_FLOOD,
+    NUM_SCENARIOS,
+} scenario_t;
+
+static const char* const scenario_names[NUM_SCENARIOS] = {
+    "full", "resumed", "ping", "read", "write", "telemetry", "udp", "flood"};
+
+typedef struct client_t {
+    struct tcp_pcb* pcb;
+    bool ctr_mode;
+    bool tickets_supported;
+    bool ctr_supported;
+    uint8_t client_challenge[CHALLENGE_SIZE];
+    uint8_t server_challenge[CHALLENGE_SIZE];
+    uint8_t request_mac_key[HMAC_DIGEST_SIZE];
+    uint8_t reply_mac_key[HMAC_DIGEST_SIZE];
+    EVP_CIPHER_CTX* encrypt;
+    EVP_CIPHER_CTX* decrypt;
+} client_t;
+
+typedef struct ticket_t {
+    bool valid;
+    uint8_t id[CHALLENGE_SIZE];
+    uint8_t resume_challenge[CHALLENGE_SIZE];
+    uint8_t protocol_version;
+} ticket_t;
+
+static uint8_t g_secret_hashed[HMAC_DIGEST_SIZE];
+static ticket_t g_ticket;
+static bool g_use_cbc = false;
+static uint g_pipeline_depth = 3;
+static uint g_num_handshakes = 1000;
+static uint g_num_requests = 1000;
+static uint32_t g_read_size = WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE;
+static uint32_t g_write_size = MAX_DATA_SIZE;
+static uint8_t g_request_data[MAX_DATA_SIZE];
+static uint32_t g_udp_rpc_epoch = 0;    // learned from the first request
+static uint64_t g_udp_rpc_counter = 0;
+
+static void hash_secret(const char* secret) {
+    // As wifi_settings_remote_update_secret
+    memset(g_secret_hashed, 0, HMAC_DIGEST_SIZE);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    ASSERT(ctx);
+    for (uint i = 0; i < 4096; i++) {
+        ASSERT(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL));
+        ASSERT(EVP_DigestUpdate(ctx, g_secret_hashed, HMAC_DIGEST_SIZE));
+        ASSERT(EVP_DigestUpdate(ctx, secret, strlen(secret)));
+        ASSERT(EVP_DigestFinal_ex(ctx, g_secret_hashed, NULL));
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+static void generate_authentication(const uint8_t* challenge1, const uint8_t* challenge2,
+                                    const char* append_code, uint8_t* output, uint output_size) {
+    uint8_t data[(CHALLENGE_SIZE * 2) + 2];
+    uint8_t digest[HMAC_DIGEST_SIZE];
+    unsigned digest_size = 0;
+    memcpy(data, challenge1, CHALLENGE_SIZE);
+    memcpy(&data[CHALLENGE_SIZE], challenge2, CHALLENGE_SIZE);
+    memcpy(&data[CHALLENGE_SIZE * 2], append_code, 2);
+    ASSERT(HMAC(EVP_sha256(), g_secret_hashed, HMAC_DIGEST_SIZE,
+                data, sizeof(data), digest, &digest_size));
+    ASSERT(digest_size == HMAC_DIGEST_SIZE);
+    memcpy(output, digest, output_size);
+}
+
+static void get_data_hash(const client_t* client, const uint8_t* header,
+                          const uint8_t* data, uint32_t data_size,
+                          const uint8_t* mac_key, uint8_t* data_hash) {
+    // Hash of the header (except the hash itself) and the data. In CTR mode, this is an HMAC.
+    static uint8_t message[HEADER_SIZE + WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE];
+    uint8_t digest[HMAC_DIGEST_SIZE];
+    ASSERT(data_size <= WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE);
+    memcpy(message, header, HEADER_SIZE);
+    memcpy(&message[HEADER_SIZE], data, data_size);
+    if (client->ctr_mode) {
+        ASSERT(HMAC(EVP_sha256(), mac_key, HMAC_DIGEST_SIZE,
+                    message, HEADER_SIZE + data_size, digest, NULL));
+    } else {
+        ASSERT(EVP_Digest(message, HEADER_SIZE + data_size, digest, NULL, EVP_sha256(), NULL));
+    }
+    memcpy(data_hash, digest, DATA_HASH_SIZE);
+}
+
+static EVP_CIPHER_CTX* new_cipher(const client_t* client, const uint8_t* key, bool encrypt) {
+    // The chaining state carries on from one message to the next, starting from zero
+    const uint8_t iv[AES_BLOCK_SIZE] = {0};
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    ASSERT(ctx);
+    ASSERT(EVP_CipherInit_ex(ctx, client->ctr_mode ? EVP_aes_256_ctr() : EVP_aes_256_cbc(),
+                             NULL, key, iv, encrypt ? 1 : 0));
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    return ctx;
+}
+
+static void client_crypt(EVP_CIPHER_CTX* ctx, uint8_t* data, uint32_t size) {
+    int size_out = 0;
+    ASSERT(EVP_CipherUpdate(ctx, data, &size_out, data, (int) size));
+    ASSERT(size_out == (int) size);
+}
+
+static void send_bytes(client_t* client, const uint8_t* data, uint32_t size) {
+    fake_lwip_loopback_send(client->pcb, data, size, SEGMENT_SIZE);
+    ASSERT(fake_lwip_loopback_is_open(client->pcb));
+}
+
+static void receive_bytes(client_t* client, uint8_t* data, uint32_t size) {
+    // The server runs within fake_lwip_loopback_send/receive, so all of the
+    // data should be available now
+    while (size > 0) {
+        const uint32_t received = fake_lwip_loopback_receive(client->pcb, data, size);
+        ASSERT(received > 0);
+        data += received;
+        size -= received;
+    }
+}
+
+static void send_block(client_t* client, uint8_t msg_type, const uint8_t* payload) {
+    uint8_t block[AES_BLOCK_SIZE];
+    block[0] = msg_type;
+    memcpy(&block[1], payload, AES_BLOCK_SIZE - 1);
+    send_bytes(client, block, AES_BLOCK_SIZE);
+}
+
+static void receive_block(client_t* client, uint8_t msg_type, uint8_t* payload) {
+    uint8_t block[AES_BLOCK_SIZE];
+    receive_bytes(client, block, AES_BLOCK_SIZE);
+    ASSERT(block[0] == msg_type);
+    memcpy(payload, &block[1], AES_BLOCK_SIZE - 1);
+}
+
+static void setup_keys(client_t* client) {
+    uint8_t key[AES_KEY_SIZE];
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "CK", key, AES_KEY_SIZE);
+    client->encrypt = new_cipher(client, key, true);
+    fake_mbedtls_set_request_key(key);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "SK", key, AES_KEY_SIZE);
+    client->decrypt = new_cipher(client, key, false);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "CM", client->request_mac_key, HMAC_DIGEST_SIZE);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "SM", client->reply_mac_key, HMAC_DIGEST_SIZE);
+}
+
+static void receive_ticket(client_t* client) {
+    // The ticket is sent before the reply to the first request
+    receive_block(client, ID_TICKET, g_ticket.id);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "RT", g_ticket.resume_challenge, CHALLENGE_SIZE);
+    g_ticket.protocol_version = client->ctr_mode ? PROTOCOL_VERSION_CTR : PROTOCOL_VERSION;
+    g_ticket.valid = true;
+}
+
+static void receive_greeting(client_t* client) {
+    uint8_t greeting[AES_BLOCK_SIZE * 16];
+    receive_bytes(client, greeting, AES_BLOCK_SIZE);
+    ASSERT(greeting[0] == ID_GREETING);
+    ASSERT(greeting[1] == PROTOCOL_VERSION);
+    ASSERT((greeting[2] > 0) && (greeting[2] <= 16));
+    receive_bytes(client, &greeting[AES_BLOCK_SIZE], (greeting[2] - 1) * AES_BLOCK_SIZE);
+    client->tickets_supported = greeting[3] == GREETING_TICKETS;
+    client->ctr_supported = (greeting[(greeting[2] * AES_BLOCK_SIZE) - 1] & GREETING_CAP_CTR) != 0;
+    ASSERT(client->ctr_supported);
+}
+
+static void client_connect(client_t* client, bool use_ticket) {
+    memset(client, 0, sizeof(client_t));
+    client->pcb = fake_lwip_loopback_connect();
+    ASSERT(client->pcb);
+    receive_greeting(client);
+
+    if (use_ticket) {
+        // Resume with the ticket from the previous session
+        ASSERT(g_ticket.valid);
+        uint8_t server_authentication[AUTHENTICATION_SIZE];
+        uint8_t check_authentication[AUTHENTICATION_SIZE];
+        g_ticket.valid = false;
+        send_block(client, ID_RESUME, g_ticket.id);
+        receive_block(client, ID_RESUMED, server_authentication);
+        generate_authentication(g_ticket.resume_challenge, g_ticket.id,
+                                "SA", check_authentication, AUTHENTICATION_SIZE);
+        ASSERT(memcmp(server_authentication, check_authentication, AUTHENTICATION_SIZE) == 0);
+        memcpy(client->client_challenge, g_ticket.resume_challenge, CHALLENGE_SIZE);
+        memcpy(client->server_challenge, g_ticket.id, CHALLENGE_SIZE);
+        client->ctr_mode = g_ticket.protocol_version == PROTOCOL_VERSION_CTR;
+        setup_keys(client);
+        receive_ticket(client);
+        return;
+    }
+
+    // Full handshake: challenges, then authentication in both directions
+    uint8_t block[AES_BLOCK_SIZE - 1];
+    ASSERT(RAND_bytes(client->client_challenge, CHALLENGE_SIZE) == 1);
+    send_block(client, ID_REQUEST, client->client_challenge);
+    receive_block(client, ID_CHALLENGE, client->server_challenge);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "CA", block, AUTHENTICATION_SIZE);
+    send_block(client, ID_AUTHENTICATION, block);
+    uint8_t check_authentication[AUTHENTICATION_SIZE];
+    receive_block(client, ID_RESPONSE, block);
+    generate_authentication(client->client_challenge, client->server_challenge,
+                            "SA", check_authentication, AUTHENTICATION_SIZE);
+    ASSERT(memcmp(block, check_authentication, AUTHENTICATION_SIZE) == 0);
+
+    // Acknowledge, choosing the protocol version and asking for a ticket
+    client->ctr_mode = client->ctr_supported && !g_use_cbc;
+    memset(block, 0, sizeof(block));
+    block[0] = client->tickets_supported ? ACKNOWLEDGE_TICKET : 0;
+    block[1] = client->ctr_mode ? PROTOCOL_VERSION_CTR : PROTOCOL_VERSION;
+    send_block(client, ID_ACKNOWLEDGE, block);
+    setup_keys(client);
+    if (client->tickets_supported) {
+        receive_ticket(client);
+    }
+}
+
+static void client_disconnect(client_t* client) {
+    fake_lwip_loopback_close(client->pcb);
+    EVP_CIPHER_CTX_free(client->encrypt);
+    EVP_CIPHER_CTX_free(client->decrypt);
+    client->encrypt = client->decrypt = NULL;
+}
+
+static void client_transmit(client_t* client, uint8_t msg_type,
+                            const uint8_t* data, uint32_t data_size, int32_t parameter) {
+    // The header and data are encrypted and sent together
+    static uint8_t message[AES_BLOCK_SIZE + MAX_DATA_SIZE];
+    const uint32_t padded_size = (data_size + AES_BLOCK_SIZE - 1) & ~(AES_BLOCK_SIZE - 1);
+    ASSERT(data_size <= MAX_DATA_SIZE);
+    memset(message, 0, AES_BLOCK_SIZE + padded_size);
+    memcpy(&message[0], &data_size, 4);
+    memcpy(&message[4], &parameter, 4);
+    message[8] = msg_type;
+    get_data_hash(client, message, data, data_size, client->request_mac_key, &message[HEADER_SIZE]);
+    memcpy(&message[AES_BLOCK_SIZE], data, data_size);
+    client_crypt(client->encrypt, message, AES_BLOCK_SIZE + padded_size);
+    send_bytes(client, message, AES_BLOCK_SIZE + padded_size);
+}
+
+static int32_t client_receive(client_t* client, uint32_t expect_data_size) {
+    static uint8_t reply[WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE + AES_BLOCK_SIZE];
+    uint8_t header[AES_BLOCK_SIZE];
+    receive_bytes(client, header, AES_BLOCK_SIZE);
+    client_crypt(client->decrypt, header, AES_BLOCK_SIZE);
+    uint32_t data_size;
+    int32_t result;
+    memcpy(&data_size, &header[0], 4);
+    memcpy(&result, &header[4], 4);
+    ASSERT(header[8] == ID_OK);
+    ASSERT(data_size == expect_data_size);
+
+    const uint32_t padded_size = (data_size + AES_BLOCK_SIZE - 1) & ~(AES_BLOCK_SIZE - 1);
+    ASSERT(padded_size <= sizeof(reply));
+    receive_bytes(client, reply, padded_size);
+    client_crypt(client->decrypt, reply, padded_size);
+    uint8_t data_hash[DATA_HASH_SIZE];
+    get_data_hash(client, header, reply, data_size, client->reply_mac_key, data_hash);
+    ASSERT(memcmp(data_hash, &header[HEADER_SIZE], DATA_HASH_SIZE) == 0);
+    return result;
+}
+
+static void transmit_request(client_t* client, scenario_t scenario, uint index) {
+    switch (scenario) {
+        case SCENARIO_READ:
+            {
+                read_parameter_t parameter;
+                memset(&parameter, 0, sizeof(parameter));
+                parameter.copy_from.start_address = (void*) (uintptr_t) 0;
+                parameter.copy_from.size = g_read_size;
+                client_transmit(client, ID_READ_HANDLER,
+                                (const uint8_t*) &parameter, sizeof(parameter), 0);
+            }
+            break;
+        case SCENARIO_WRITE:
+            client_transmit(client, ID_WRITE_FLASH_HANDLER, g_request_data, g_write_size,
+                            (int32_t) (WRITE_FLASH_ADDRESS + (index * g_write_size)));
+            break;
+        default:
+            client_transmit(client, ID_PING_HANDLER, NULL, 0, (int32_t) index);
+            break;
+    }
+}
+
+static void receive_reply(client_t* client, scenario_t scenario, uint index) {
+    switch (scenario) {
+        case SCENARIO_READ:
+            ASSERT(client_receive(client, g_read_size) == (int32_t) g_read_size);
+            break;
+        case SCENARIO_WRITE:
+            ASSERT(client_receive(client, 0) == 0);
+            break;
+        default:
+            ASSERT(client_receive(client, 0) == (int32_t) index);
+            break;
+    }
+}
+
+static void run_requests(scenario_t scenario, uint num_requests) {
+    // Requests are pipelined, as in remote_picotool
+    client_t client;
+    client_connect(&client, false);
+    uint num_replies = 0;
+    for (uint i = 0; i < num_requests; i++) {
+        if ((i - num_replies) >= g_pipeline_depth) {
+            receive_reply(&client, scenario, num_replies);
+            num_replies++;
+        }
+        transmit_request(&client, scenario, i);
+    }
+    while (num_replies < num_requests) {
+        receive_reply(&client, scenario, num_replies);
+        num_replies++;
+    }
+    client_disconnect(&client);
+}
+
+static void run_handshakes(bool resumed, uint num_handshakes) {
+    client_t client;
+    for (uint i = 0; i < num_handshakes; i++) {
+        client_connect(&client, resumed);
+        if (resumed) {
+            // The next ticket is only stored by the server after a request
+            client_transmit(&client, ID_PING_HANDLER, NULL, 0, (int32_t) i);
+            ASSERT(client_receive(&client, 0) == (int32_t) i);
+        }
+        client_disconnect(&client);
+    }
+}
+
+static void run_telemetry(uint num_frames) {
+#if WIFI_SETTINGS_REMOTE_TELEMETRY
+    // The first frame is the reply to the request, then one is sent for each interval
+    client_t client;
+    client_connect(&client, false);
+    client_transmit(&client, ID_TELEMETRY_HANDLER, NULL, 0, TELEMETRY_INTERVAL_MS);
+    ASSERT(client_receive(&client, sizeof(wifi_settings_telemetry_t)) == 0);
+    for (uint i = 0; i < num_frames; i++) {
+        fake_time_advance_ms(TELEMETRY_INTERVAL_MS);
+        ASSERT(fake_lwip_loopback_poll(client.pcb));
+        ASSERT(client_receive(&client, sizeof(wifi_settings_telemetry_t)) == 0);
+    }
+
+    // Another request ends the subscription
+    client_transmit(&client, ID_PING_HANDLER, NULL, 0, 0);
+    fake_time_advance_ms(TELEMETRY_INTERVAL_MS);
+    fake_lwip_loopback_poll(client.pcb);
+    ASSERT(!fake_lwip_loopback_is_open(client.pcb));
+    client_disconnect(&client);
+#endif
+}
+
+static void check_idle_timeout() {
+#if WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS > 0
+    // An authenticated session which receives nothing is ended by the poll callback
+    wifi_settings_remote_session_stats_t stats_before;
+    wifi_settings_remote_get_session_stats(&stats_before);
+    client_t client;
+    client_connect(&client, false);
+    fake_time_advance_ms(WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS - 1000);
+    fake_lwip_loopback_poll(client.pcb);
+    ASSERT(fake_lwip_loopback_is_open(client.pcb));
+
+    // A request restarts the idle time
+    client_transmit(&client, ID_PING_HANDLER, NULL, 0, 0);
+    ASSERT(client_receive(&client, 0) == 0);
+    fake_time_advance_ms(WIFI_SETTINGS_REMOTE_IDLE_TIMEOUT_MS - 1000);
+    fake_lwip_loopback_poll(client.pcb);
+    ASSERT(fake_lwip_loopback_is_open(client.pcb));
+
+    fake_time_advance_ms(1000);
+    fake_lwip_loopback_poll(client.pcb);
+    ASSERT(!fake_lwip_loopback_is_open(client.pcb));
+    client_disconnect(&client);
+
+    wifi_settings_remote_session_stats_t stats_after;
+    wifi_settings_remote_get_session_stats(&stats_after);
+    ASSERT(stats_after.num_idle_timeouts == (stats_before.num_idle_timeouts + 1));
+    ASSERT(stats_after.num_active == 0);
+#endif
+}
+
+static void run_flood(uint num_connections) {
+    wifi_settings_remote_session_stats_t stats_before;
+    wifi_settings_remote_get_session_stats(&stats_before);
+
+    // Connections which don't start the handshake are limited
+    client_t idle[WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES];
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES; i++) {
+        memset(&idle[i], 0, sizeof(client_t));
+        idle[i].pcb = fake_lwip_loopback_connect();
+        ASSERT(idle[i].pcb);
+        receive_greeting(&idle[i]);
+    }
+    ASSERT(!fake_lwip_loopback_connect());
+    for (uint i = 0; i < WIFI_SETTINGS_REMOTE_MAX_HANDSHAKES; i++) {
+        fake_lwip_loopback_close(idle[i].pcb);
+    }
+
+    // Wrong authentication: the connection is closed after the error
+    // is sent (so it can't be received here) and later connections are rejected
+    for (uint i = 0; i < num_connections; i++) {
+        client_t client;
+        memset(&client, 0, sizeof(client_t));
+        client.pcb = fake_lwip_loopback_connect();
+        if (!client.pcb) {
+            continue;
+        }
+        uint8_t block[AES_BLOCK_SIZE];
+        receive_greeting(&client);
+        ASSERT(RAND_bytes(client.client_challenge, CHALLENGE_SIZE) == 1);
+        send_block(&client, ID_REQUEST, client.client_challenge);
+        receive_block(&client, ID_CHALLENGE, client.server_challenge);
+        memset(block, 0, sizeof(block));
+        send_block(&client, ID_AUTHENTICATION, block);
+        fake_lwip_loopback_receive(client.pcb, block, sizeof(block));
+        ASSERT(!fake_lwip_loopback_is_open(client.pcb));
+    }
+
+    wifi_settings_remote_session_stats_t stats_after;
+    wifi_settings_remote_get_session_stats(&stats_after);
+    ASSERT(stats_after.num_handshake_limited == (stats_before.num_handshake_limited + 1));
+    ASSERT(stats_after.num_handshakes == 0);
+    ASSERT(stats_after.num_active == 0);
+#if WIFI_SETTINGS_REMOTE_BACKOFF_SOURCES > 0
+    ASSERT(stats_after.num_auth_failures == (stats_before.num_auth_failures + 1));
+    ASSERT(stats_after.num_backoff_rejected == (stats_before.num_backoff_rejected + num_connections - 1));
+#else
+    ASSERT(stats_after.num_auth_failures == (stats_before.num_auth_failures + num_connections));
+#endif
+}
+
+static void udp_rpc_key(const uint8_t* nonce, const char* append_code, uint8_t* key) {
+    // As generate_authentication, with the nonce instead of the challenges
+    uint8_t data[4 + UDP_RPC_NONCE_SIZE + 2];
+    memcpy(data, "PWR?", 4);
+    memcpy(&data[4], nonce, UDP_RPC_NONCE_SIZE);
+    memcpy(&data[4 + UDP_RPC_NONCE_SIZE], append_code, 2);
+    ASSERT(HMAC(EVP_sha256(), g_secret_hashed, HMAC_DIGEST_SIZE,
+                data, sizeof(data), key, NULL));
+}
+
+static void udp_rpc_mac(const uint8_t* datagram, uint32_t size, const char* append_code,
+                        uint8_t* mac) {
+    uint8_t key[HMAC_DIGEST_SIZE];
+    uint8_t digest[HMAC_DIGEST_SIZE];
+    udp_rpc_key(&datagram[4], append_code, key);
+    ASSERT(HMAC(EVP_sha256(), key, HMAC_DIGEST_SIZE, datagram, size, digest, NULL));
+    memcpy(mac, digest, UDP_RPC_MAC_SIZE);
+}
+
+static void udp_rpc_crypt(const uint8_t* nonce, const char* append_code,
+                          uint8_t* data, uint32_t size) {
+    uint8_t key[AES_KEY_SIZE];
+    const uint8_t iv[AES_BLOCK_SIZE] = {0};
+    udp_rpc_key(nonce, append_code, key);
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    ASSERT(ctx);
+    ASSERT(EVP_CipherInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv, 1));
+    client_crypt(ctx, data, size);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+static uint32_t udp_rpc_build(uint8_t* datagram, uint8_t msg_type, int32_t parameter) {
+    // Request with a new nonce and no data
+    const uint32_t body_size = UDP_RPC_BODY_HEADER_SIZE;
+    uint8_t* nonce = &datagram[4];
+    memcpy(datagram, "PWR?", 4);
+    g_udp_rpc_counter++;
+    memcpy(&nonce[0], &g_udp_rpc_epoch, 4);
+    memcpy(&nonce[4], &g_udp_rpc_counter, 8);
+    ASSERT(RAND_bytes(&nonce[12], 4) == 1);
+    uint8_t* body = &datagram[UDP_RPC_HEADER_SIZE];
+    memset(body, 0, body_size);
+    body[0] = msg_type;
+    memcpy(&body[4], &parameter, 4);
+    udp_rpc_crypt(nonce, "CE", body, body_size);
+    udp_rpc_mac(datagram, UDP_RPC_HEADER_SIZE + body_size, "CM", &body[body_size]);
+    return UDP_RPC_HEADER_SIZE + body_size + UDP_RPC_MAC_SIZE;
+}
+
+static uint32_t udp_rpc_exchange(const uint8_t* datagram, uint32_t size, uint8_t* reply) {
+    // Send a request, check the reply MAC and nonce, and return the reply size
+    // without the MAC (0 if there was no reply)
+    fake_lwip_udp_loopback_send(datagram, size);
+    const uint32_t reply_size = fake_lwip_udp_loopback_receive(reply, MAX_DATAGRAM_SIZE);
+    if (reply_size == 0) {
+        return 0;
+    }
+    ASSERT(reply_size >= (UDP_RPC_HEADER_SIZE + UDP_RPC_MAC_SIZE));
+    ASSERT(memcmp(&reply[4], &datagram[4], UDP_RPC_NONCE_SIZE) == 0);
+    uint8_t mac[UDP_RPC_MAC_SIZE];
+    udp_rpc_mac(reply, reply_size - UDP_RPC_MAC_SIZE, "SM", mac);
+    ASSERT(memcmp(mac, &reply[reply_size - UDP_RPC_MAC_SIZE], UDP_RPC_MAC_SIZE) == 0);
+    return reply_size - UDP_RPC_MAC_SIZE;
+}
+
+static bool udp_rpc_is_rejected(const uint8_t* reply, uint32_t reply_size) {
+    // A rejected request: use the epoch and counter given by the server
+    if (memcmp(reply, "PWR!", 4) != 0) {
+        return false;
+    }
+    ASSERT(reply_size == (UDP_RPC_HEADER_SIZE + 12));
+    uint64_t min_counter;
+    memcpy(&g_udp_rpc_epoch, &reply[UDP_RPC_HEADER_SIZE], 4);
+    memcpy(&min_counter, &reply[UDP_RPC_HEADER_SIZE + 4], 8);
+    if (g_udp_rpc_counter < min_counter) {
+        g_udp_rpc_counter = min_counter;
+    }
+    return true;
+}
+
+static int32_t udp_rpc_call(uint8_t msg_type, int32_t parameter, uint8_t expect_status) {
+    uint8_t datagram[MAX_DATAGRAM_SIZE];
+    uint8_t reply[MAX_DATAGRAM_SIZE];
+    uint32_t reply_size = 0;
+    for (uint attempt = 0; attempt < 2; attempt++) {
+        const uint32_t size = udp_rpc_build(datagram, msg_type, parameter);
+        reply_size = udp_rpc_exchange(datagram, size, reply);
+        ASSERT(reply_size > 0);
+        if (!udp_rpc_is_rejected(reply, reply_size)) {
+            break;
+        }
+    }
+    ASSERT(memcmp(reply, "PWR:", 4) == 0);
+    ASSERT(reply_size == (UDP_RPC_HEADER_SIZE + UDP_RPC_BODY_HEADER_SIZE));
+    uint8_t* body = &reply[UDP_RPC_HEADER_SIZE];
+    udp_rpc_crypt(&reply[4], "SE", body, UDP_RPC_BODY_HEADER_SIZE);
+    ASSERT(body[0] == msg_type);
+    ASSERT(body[1] == expect_status);
+    int32_t result;
+    memcpy(&result, &body[4], 4);
+    return result;
+}
+
+static void run_udp_requests(uint num_requests) {
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    for (uint i = 0; i < num_requests; i++) {
+        ASSERT(udp_rpc_call(ID_PING_HANDLER, (int32_t) i, ID_OK) == (int32_t) i);
+    }
+#endif
+}
+
+static void check_udp_rpc() {
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    // The first request has the wrong epoch, so it is rejected, then sent again
+    ASSERT(g_udp_rpc_epoch == 0);
+    ASSERT(udp_rpc_call(ID_PING_HANDLER, 1, ID_OK) == 1);
+    ASSERT(g_udp_rpc_epoch != 0);
+
+    // Replayed requests are rejected without calling the handler, including
+    // requests which are no longer among the recent requests
+    uint8_t datagram[MAX_DATAGRAM_SIZE];
+    uint8_t reply[MAX_DATAGRAM_SIZE];
+    uint8_t first_datagram[MAX_DATAGRAM_SIZE];
+    wifi_settings_remote_handler_stats_t stats_before;
+    wifi_settings_remote_handler_stats_t stats_after;
+    const uint32_t size = udp_rpc_build(first_datagram, ID_PING_HANDLER, 2);
+    ASSERT(udp_rpc_exchange(first_datagram, size, reply) > 0);
+    ASSERT(memcmp(reply, "PWR:", 4) == 0);
+    for (uint i = 0; i <= WIFI_SETTINGS_REMOTE_UDP_RPC_REPLAY_CACHE; i++) {
+        ASSERT(wifi_settings_remote_get_handler_stats(ID_PING_HANDLER, &stats_before) == 0);
+        memcpy(datagram, first_datagram, size);
+        const uint32_t reply_size = udp_rpc_exchange(datagram, size, reply);
+        ASSERT(memcmp(reply, "PWR!", 4) == 0);
+        const uint64_t counter = g_udp_rpc_counter;
+        ASSERT(udp_rpc_is_rejected(reply, reply_size));
+        ASSERT(g_udp_rpc_counter == counter);
+        ASSERT(wifi_settings_remote_get_handler_stats(ID_PING_HANDLER, &stats_after) == 0);
+        ASSERT(stats_after.num_calls == stats_before.num_calls);
+        ASSERT(udp_rpc_call(ID_PING_HANDLER, 3, ID_OK) == 3);
+    }
+
+    // Requests with the wrong MAC are ignored
+    memcpy(datagram, first_datagram, size);
+    datagram[UDP_RPC_HEADER_SIZE] ^= 1;
+    ASSERT(udp_rpc_exchange(datagram, size, reply) == 0);
+
+    // Only allowed handlers can be called, until they are registered again
+    ASSERT(udp_rpc_call(ID_WRITE_FLASH_HANDLER, 0, ID_BAD_HANDLER_ERROR) == 0);
+    ASSERT(wifi_settings_remote_allow_udp_rpc(ID_WRITE_FLASH_HANDLER) == 0);
+    udp_rpc_call(ID_WRITE_FLASH_HANDLER, 0, ID_OK);
+    ASSERT(wifi_settings_remote_set_handler(ID_WRITE_FLASH_HANDLER,
+                                            wifi_settings_write_flash_handler, NULL) == 0);
+    ASSERT(udp_rpc_call(ID_WRITE_FLASH_HANDLER, 0, ID_BAD_HANDLER_ERROR) == 0);
+#endif
+}
+
+#if WIFI_SETTINGS_REMOTE_USER_HANDLERS > 0
+static uint32_t g_stream_bytes = 0;
+
+static int32_t stream_begin(uint8_t msg_type, uint32_t input_data_size,
+                            int32_t input_parameter, void* arg) {
+    g_stream_bytes = 0;
+    return 0;
+}
+
+static void stream_data(uint8_t msg_type, const uint8_t* data,
+                        uint32_t data_offset, uint32_t data_size, void* arg) {
+    ASSERT(data_offset == g_stream_bytes);
+    ASSERT(memcmp(data, &g_request_data[data_offset], data_size) == 0);
+    g_stream_bytes += data_size;
+}
+
+static int32_t stream_end(uint8_t msg_type, bool data_valid, void* arg) {
+    return data_valid ? (int32_t) g_stream_bytes : -1;
+}
+#endif
+
+static void check_stream_busy() {
+#if WIFI_SETTINGS_REMOTE_USER_HANDLERS > 0
+    // A streaming request is sent in two parts, with another session connecting between them
+    ASSERT(wifi_settings_remote_set_stream_handler(ID_FIRST_USER_HANDLER,
+                                                   stream_begin, stream_data, stream_end, NULL) == 0);
+    client_t client;
+    client_connect(&client, false);
+    static uint8_t message[AES_BLOCK_SIZE + STREAM_DATA_SIZE];
+    const uint32_t data_size = STREAM_DATA_SIZE;
+    const int32_t parameter = 0;
+    memset(message, 0, sizeof(message));
+    memcpy(&message[0], &data_size, 4);
+    memcpy(&message[4], &parameter, 4);
+    message[8] = ID_FIRST_USER_HANDLER;
+    get_data_hash(&client, message, g_request_data, data_size,
+                  client.request_mac_key, &message[HEADER_SIZE]);
+    memcpy(&message[AES_BLOCK_SIZE], g_request_data, data_size);
+    client_crypt(client.encrypt, message, sizeof(message));
+    send_bytes(&client, message, AES_BLOCK_SIZE + (data_size / 2));
+
+    wifi_settings_remote_session_stats_t stats_before;
+    wifi_settings_remote_get_session_stats(&stats_before);
+    client_t other;
+#if WIFI_SETTINGS_SHA256_SINGLE_STATE
+    // The SHA-256 hardware is in use, so the other session is accepted, but only
+    // to send ID_BUSY_ERROR instead of the greeting. The connection is closed after
+    // this is sent (so it can't be received here).
+    memset(&other, 0, sizeof(client_t));
+    other.pcb = fake_lwip_loopback_connect();
+    ASSERT(other.pcb);
+    uint8_t block[AES_BLOCK_SIZE];
+    fake_lwip_loopback_receive(other.pcb, block, sizeof(block));
+    ASSERT(!fake_lwip_loopback_is_open(other.pcb));
+#if WIFI_SETTINGS_REMOTE_UDP_RPC
+    // UDP RPC requests are ignored
+    uint8_t datagram[MAX_DATAGRAM_SIZE];
+    uint8_t reply[MAX_DATAGRAM_SIZE];
+    const uint32_t size = udp_rpc_build(datagram, ID_PING_HANDLER, 1);
+    ASSERT(udp_rpc_exchange(datagram, size, reply) == 0);
+#endif
+    wifi_settings_remote_session_stats_t stats_after;
+    wifi_settings_remote_get_session_stats(&stats_after);
+    ASSERT(stats_after.num_rejected == (stats_before.num_rejected + 1));
+    ASSERT(stats_after.num_active == stats_before.num_active);
+#else
+    // Other sessions can compute hashes at the same time
+    client_connect(&other, false);
+    client_transmit(&other, ID_PING_HANDLER, NULL, 0, 1);
+    ASSERT(client_receive(&other, 0) == 1);
+    client_disconnect(&other);
+#endif
+
+    // The streaming request is unaffected
+    send_bytes(&client, &message[AES_BLOCK_SIZE + (data_size / 2)], data_size / 2);
+    ASSERT(client_receive(&client, 0) == (int32_t) data_size);
+    client_disconnect(&client);
+
+    // After it, another session can connect
+    client_connect(&other, false);
+    client_transmit(&other, ID_PING_HANDLER, NULL, 0, 2);
+    ASSERT(client_receive(&other, 0) == 2);
+    client_disconnect(&other);
+#endif
+}
+
+static void check_ticket_replay() {
+#if WIFI_SETTINGS_REMOTE_TICKET_COUNT > 0
+    client_t client;
+    client_connect(&client, false);
+    client_disconnect(&client);
+    ASSERT(g_ticket.valid);
+    const ticket_t first_ticket = g_ticket;
+
+    // The ticket ID is sent in the clear, so anyone can resume with it, but
+    // this doesn't use up the ticket unless a request is verified
+    client_connect(&client, true);
+    client_disconnect(&client);
+
+    // Two sessions are resumed with the same ticket
+    client_t replay;
+    g_ticket = first_ticket;
+    client_connect(&client, true);
+    const ticket_t next_ticket = g_ticket;
+    g_ticket = first_ticket;
+    client_connect(&replay, true);
+    client_transmit(&client, ID_PING_HANDLER, NULL, 0, 1);
+    ASSERT(client_receive(&client, 0) == 1);
+    client_disconnect(&client);
+
+    // The ticket has now been used, so the other session is closed at its first request
+    uint8_t block[AES_BLOCK_SIZE];
+    memset(block, 0, sizeof(block));
+    block[8] = ID_PING_HANDLER;
+    get_data_hash(&replay, block, NULL, 0, replay.request_mac_key, &block[HEADER_SIZE]);
+    client_crypt(replay.encrypt, block, sizeof(block));
+    fake_lwip_loopback_send(replay.pcb, block, sizeof(block), SEGMENT_SIZE);
+    ASSERT(!fake_lwip_loopback_is_open(replay.pcb));
+    client_disconnect(&replay);
+
+    // And the ticket isn't accepted again: its ID is taken as the client challenge
+    memset(&replay, 0, sizeof(client_t));
+    replay.pcb = fake_lwip_loopback_connect();
+    ASSERT(replay.pcb);
+    receive_greeting(&replay);
+    send_block(&replay, ID_RESUME, first_ticket.id);
+    receive_block(&replay, ID_CHALLENGE, block);
+    fake_lwip_loopback_close(replay.pcb);
+
+    // The ticket received from the verified session can be used
+    g_ticket = next_ticket;
+    client_connect(&client, true);
+    client_transmit(&client, ID_PING_HANDLER, NULL, 0, 2);
+    ASSERT(client_receive(&client, 0) == 2);
+    client_disconnect(&client);
+#endif
+}
+
+static double per(uint64_t value, uint64_t count) {
+    return (count == 0) ? 0.0 : (((double) value) / (double) count);
+}
+
+static void run_scenario(scenario_t scenario) {
+    uint num_ops = g_num_requests;
+    uint64_t data_bytes = 0;
+    if (scenario == SCENARIO_RESUMED_HANDSHAKE) {
+        // Get the first ticket (each session receives a ticket for the next one)
+        client_t client;
+        client_connect(&client, false);
+        client_disconnect(&client);
+        ASSERT(g_ticket.valid);
+    }
+    wifi_settings_remote_session_stats_t stats_before;
+    wifi_settings_remote_get_session_stats(&stats_before);
+    memset(&g_fake_lwip_counters, 0, sizeof(g_fake_lwip_counters));
+    memset(&g_fake_mbedtls_counters, 0, sizeof(g_fake_mbedtls_counters));
+
+    switch (scenario) {
+        case SCENARIO_FULL_HANDSHAKE:
+        case SCENARIO_RESUMED_HANDSHAKE:
+            num_ops = g_num_handshakes;
+            run_handshakes(scenario == SCENARIO_RESUMED_HANDSHAKE, num_ops);
+            break;
+        case SCENARIO_READ:
+            data_bytes = ((uint64_t) num_ops) * g_read_size;
+            run_requests(scenario, num_ops);
+            break;
+        case SCENARIO_WRITE:
+            data_bytes = ((uint64_t) num_ops) * g_write_size;
+            run_requests(scenario, num_ops);
+            break;
+        case SCENARIO_TELEMETRY:
+            run_telemetry(num_ops);
+            break;
+        case SCENARIO_UDP:
+            run_udp_requests(num_ops);
+            break;
+        case SCENARIO_FLOOD:
+            num_ops = g_num_handshakes;
+            run_flood(num_ops);
+            break;
+        default:
+            run_requests(scenario, num_ops);
+            break;
+    }
+
+    const fake_lwip_counters_t* lc = &g_fake_lwip_counters;
+    const fake_mbedtls_counters_t* mc = &g_fake_mbedtls_counters;
+    const uint64_t server_cycles = lc->accept_cycles + lc->recv_cycles + lc->sent_cycles
+                                  + lc->poll_cycles + lc->udp_recv_cycles;
+    const uint64_t pbuf_ops = lc->pbuf_free_calls + lc->pbuf_cat_calls + lc->pbuf_free_header_calls;
+    wifi_settings_remote_session_stats_t stats_after;
+    wifi_settings_remote_get_session_stats(&stats_after);
+    ASSERT((stats_after.num_auth_failures == stats_before.num_auth_failures)
+           || (scenario == SCENARIO_FLOOD));
+
+    printf("%-9s %6u %10.0f %7.1f %7.0f %6.1f %6.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+           scenario_names[scenario], num_ops,
+           per(server_cycles, num_ops),
+           per(lc->tcp_write_calls, num_ops),
+           per(lc->tcp_write_bytes, lc->tcp_write_calls),
+           per(lc->recv_callbacks + lc->sent_callbacks + lc->poll_callbacks
+               + lc->udp_recv_callbacks, num_ops),
+           per(pbuf_ops, num_ops),
+           per(server_cycles, data_bytes),
+           per(lc->recv_cycles, lc->recv_bytes),
+           per(mc->decrypt_cycles, mc->decrypt_bytes),
+           per(mc->hash_cycles, mc->hash_bytes),
+           per(mc->encrypt_cycles, mc->encrypt_bytes));
+}
+
+static uint parse_count(const char* option, const char* value) {
+    char* end = NULL;
+    const unsigned long count = value ? strtoul(value, &end, 0) : 0;
+    if ((!value) || (*end != '\0') || (count == 0) || (count > 100000000)) {
+        fprintf(stderr, "%s requires a positive number\n", option);
+        exit(1);
+    }
+    return (uint) count;
+}
+
+int bench_main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* value = ((i + 1) < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--quick") == 0) {
+            g_num_handshakes = 10;
+            g_num_requests = 10;
+        } else if (strcmp(argv[i], "--cbc") == 0) {
+            g_use_cbc = true;
+        } else if (strcmp(argv[i], "--handshakes") == 0) {
+            g_num_handshakes = parse_count(argv[i], value);
+            i++;
+        } else if (strcmp(argv[i], "--requests") == 0) {
+            g_num_requests = parse_count(argv[i], value);
+            i++;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            g_pipeline_depth = parse_count(argv[i], value);
+            if (g_pipeline_depth > MAX_PIPELINE_DEPTH) {
+                g_pipeline_depth = MAX_PIPELINE_DEPTH;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--read-size") == 0) {
+            g_read_size = parse_count(argv[i], value);
+            if (g_read_size > WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE) {
+                g_read_size = WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--write-size") == 0) {
+            g_write_size = parse_count(argv[i], value);
+            if (g_write_size > MAX_DATA_SIZE) {
+                g_write_size = MAX_DATA_SIZE;
+            }
+            i++;
+        } else {
+            fprintf(stderr, "Usage: remote_virtual --bench [--quick] [--cbc] [--handshakes <n>]\n"
+                            "    [--requests <n>] [--pipeline <n>] [--read-size <n>] [--write-size <n>]\n");
+            return 1;
+        }
+    }
+    hash_secret(BENCH_SECRET);
+    for (uint i = 0; i < sizeof(g_request_data); i++) {
+        g_request_data[i] = (uint8_t) (i * 7);
+    }
+
+    // "server/op" is all of the time in the lwIP callbacks, "/B" columns are per byte:
+    // "server/B" per byte of request or reply data, "receive/B" per byte received
+    // (including replies generated within the recv callback),
+    // and the others per byte processed by AES or SHA-256.
+    printf("%s mode, pipeline depth %u, times in %s\n",
+           g_use_cbc ? "AES-CBC" : "AES-CTR", g_pipeline_depth, fake_cycles_unit());
+    printf("%-9s %6s %10s %7s %7s %6s %6s %8s %8s %8s %8s %8s\n",
+           "scenario", "ops", "server/op", "write/op", "B/write", "cb/op", "pbuf/op",
+           "server/B", "receive/B", "decrypt/B", "hash/B", "encrypt/B");
+    check_idle_timeout();
+    check_udp_rpc();
+    check_stream_busy();
+    check_ticket_replay();
+    for (scenario_t scenario = 0; scenario < NUM_SCENARIOS; scenario++) {
+        run_scenario(scenario);
+    }
+    return 0;
+}
@@ -2,111 +2,276 @@
  * Copyright (c) 2025 Jack Whitham
  *
  * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Handlers for the remote service, and the parts of wifi-settings that
+ * it uses. There is no Flash: ID_READ_HANDLER reads from a fake memory
+ * and ID_WRITE_FLASH_HANDLER accepts anything.
  */
 
-#include "wifi_settings.h"
+#include "remote_virtual.h"
+#include "pico/stdlib.h"
+
+#include "wifi_settings/wifi_settings_configuration.h"
 #include "wifi_settings/wifi_settings_remote.h"
 #include "wifi_settings/wifi_settings_remote_handlers.h"
+#include "wifi_settings/wifi_settings_remote_memory_access_handlers.h"
 #include "wifi_settings/wifi_settings_flash_storage.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef ENABLE_REMOTE_UPDATE
 #error "ENABLE_REMOTE_UPDATE must be enabled"
 #endif
 
+#define FAKE_MEMORY_SIZE    (WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE * 2)
 
-handler_callback_result_t wifi_settings_pico_info_handler(
+static uint8_t g_fake_memory[FAKE_MEMORY_SIZE];
+
+static int32_t not_supported(uint32_t* output_data_size) {
+    *output_data_size = 0;
+    return PICO_ERROR_NOT_PERMITTED;
+}
+
+const char* wifi_settings_get_board_id_hex() {
+    return "AAAAAAAAAAAAAAAA";
+}
+
+const char* wifi_settings_get_hostname() {
+    return "remote_virtual";
+}
+
+const char* wifi_settings_get_binary_info_string(uint32_t id) {
+    return NULL;
+}
+
+void wifi_settings_add_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {
+    // The file never changes
+}
+
+void wifi_settings_set_remote_active(bool active) {
+}
+
+int32_t wifi_settings_pico_info_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
-
-    if (*output_data_size < sizeof(pico_info_t)) {
-        return CALLBACK_PARAM_ERROR;
+    const int size = snprintf((char*) data_buffer, *output_data_size,
+        "name=%s\nboard_id=%s\nmax_data_size=%u\nmax_read_size=%u\n"
+        "remote_memory_access=1\nlogical_offset=%u\n",
+        wifi_settings_get_hostname(), wifi_settings_get_board_id_hex(),
+        (uint) *output_data_size, (uint) WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE,
+        (uint) 0);
+    if ((size < 0) || ((uint32_t) size >= *output_data_size)) {
+        return not_supported(output_data_size);
     }
+    *output_data_size = (uint32_t) size;
+    return 0;
+}
 
-    *output_data_size = sizeof(pico_info_t);
-    pico_info_t* pico_info = (pico_info_t*) data_buffer;
-    memset(pico_info, 0, sizeof(pico_info_t));
+int32_t wifi_settings_ping_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    *output_data_size = 0;
+    return input_parameter;
+}
 
-    memset(pico_info->board_id, 0xaa, sizeof(pico_info->board_id));
-    strcpy(pico_info->board_name, "fake_handlers");
-    pico_info->chip_id = 0xaabbcc;
-    pico_info->wifi_settings_version = 0xdef;
+int32_t wifi_settings_stats_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    wifi_settings_remote_session_stats_t stats;
+    wifi_settings_remote_get_session_stats(&stats);
+    if (*output_data_size < sizeof(stats)) {
+        return not_supported(output_data_size);
+    }
+    memcpy(data_buffer, &stats, sizeof(stats));
+    *output_data_size = sizeof(stats);
+    return 0;
+}
+
+int32_t wifi_settings_telemetry_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    // The session counts are real, there is no link or heap information
+    wifi_settings_remote_session_stats_t stats;
+    wifi_settings_telemetry_t telemetry;
+    if (*output_data_size < sizeof(telemetry)) {
+        return not_supported(output_data_size);
+    }
+    wifi_settings_remote_get_session_stats(&stats);
+    memset(&telemetry, 0, sizeof(telemetry));
+    telemetry.time_ms = to_ms_since_boot(get_absolute_time());
+    telemetry.num_active = stats.num_active;
+    telemetry.num_sessions = stats.num_sessions;
+    telemetry.num_auth_failures = stats.num_auth_failures;
+    memcpy(data_buffer, &telemetry, sizeof(telemetry));
+    *output_data_size = sizeof(telemetry);
+    return 0;
+}
 
-    *output_parameter = strlen(pico_info->board_name);
-    return CALLBACK_OK;
+int32_t wifi_settings_update_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    return not_supported(output_data_size);
 }
 
-handler_callback_result_t wifi_settings_update_handler(
+int32_t wifi_settings_link_quality_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
-    *output_data_size = 0;
-    *output_parameter = 0;
-    return CALLBACK_FAILURE_ERROR;
+    return not_supported(output_data_size);
 }
 
-handler_callback_result_t wifi_settings_reboot_handler(
+int32_t wifi_settings_set_key_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
-    *output_data_size = 0;
-    *output_parameter = 0;
-    return CALLBACK_FAILURE_ERROR;
+    return not_supported(output_data_size);
 }
 
-handler_callback_result_t wifi_settings_update_reboot_handler(
+int32_t wifi_settings_update_reboot_handler1(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
-    *output_data_size = 0;
-    *output_parameter = 0;
-    return CALLBACK_FAILURE_ERROR;
+    return not_supported(output_data_size);
+}
+
+void wifi_settings_update_reboot_handler2(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        void* arg) {
 }
 
 #ifdef ENABLE_REMOTE_MEMORY_ACCESS
-handler_callback_result_t wifi_settings_read_handler(
+int32_t wifi_settings_read_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
-    *output_data_size = 0;
-    *output_parameter = 0;
-    return CALLBACK_FAILURE_ERROR;
+    // The address is an offset in the fake memory. As with Flash in the
+    // real handler, the reply is sent directly from the memory, without a copy.
+    read_parameter_t parameter;
+    if ((input_data_size != sizeof(read_parameter_t)) || (input_parameter != 0)) {
+        return not_supported(output_data_size);
+    }
+    memcpy(&parameter, data_buffer, sizeof(read_parameter_t));
+    const uintptr_t offset = (uintptr_t) parameter.copy_from.start_address;
+    uint32_t size = parameter.copy_from.size;
+    if (size > WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE) {
+        size = WIFI_SETTINGS_REMOTE_MAX_REPLY_SIZE;
+    }
+    if ((offset > FAKE_MEMORY_SIZE) || (size > (FAKE_MEMORY_SIZE - offset))) {
+        return not_supported(output_data_size);
+    }
+    wifi_settings_remote_set_reply_source(output_data_size, &g_fake_memory[offset]);
+    *output_data_size = size;
+    return (int32_t) size;
 }
 
-handler_callback_result_t wifi_settings_write_handler(
+int32_t wifi_settings_read_ranges_handler(
         uint8_t msg_type,
         uint8_t* data_buffer,
         uint32_t input_data_size,
-        uint32_t input_parameter,
+        int32_t input_parameter,
         uint32_t* output_data_size,
-        uint32_t* output_parameter,
         void* arg) {
+    return not_supported(output_data_size);
+}
+
+int32_t wifi_settings_hash_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    return not_supported(output_data_size);
+}
+
+int32_t wifi_settings_prepare_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    return not_supported(output_data_size);
+}
+
+bool wifi_settings_prepare_flash_pending() {
+    return false;
+}
+
+bool wifi_settings_prepare_flash_step() {
+    return false;
+}
+
+void wifi_settings_write_flash_session_ended() {
+}
+
+int32_t wifi_settings_write_flash_handler(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    // The data is accepted (and discarded)
     *output_data_size = 0;
-    *output_parameter = 0;
-    return CALLBACK_FAILURE_ERROR;
+    return 0;
+}
+
+int32_t wifi_settings_ota_firmware_update_handler1(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        uint32_t* output_data_size,
+        void* arg) {
+    return not_supported(output_data_size);
+}
+
+void wifi_settings_ota_firmware_update_handler2(
+        uint8_t msg_type,
+        uint8_t* data_buffer,
+        uint32_t input_data_size,
+        int32_t input_parameter,
+        void* arg) {
 }
 #endif
@@ -4,11 +4,15 @@
  * SPDX-License-Identifier: BSD-3-Clause
  *
  * This is a minimal lwip-like API which uses the host's sockets library.
+ * Connections can also be made in memory (loopback), without a socket,
+ * for benchmarking (see bench.c).
  *
  */
 
 #include "remote_virtual.h"
 #include "lwip/tcp.h"
+#include "lwip/udp.h"
+#include "pico/stdlib.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +26,7 @@
 #define NUM_PCBS                20
 #define WRITE_BUFFER_SIZE       1024
 #define READ_BUFFER_SIZE        1024
+#define POLL_TICK_US            500000  // lwIP's TCP_SLOW_INTERVAL
 
 typedef enum pcb_type_t {
     FREE = 0,
@@ -37,17 +42,37 @@ struct callbacks_t {
     tcp_recv_fn recv;
     tcp_sent_fn sent;
     tcp_err_fn err;
+    tcp_poll_fn poll;
 };
 
 struct tcp_pcb {
     pcb_type_t pcb_type;
-    int socket;
+    int socket;                 // -1 for a loopback connection
     struct callbacks_t callbacks;
+    uint8_t poll_interval;
+    uint64_t poll_time_us;      // time of the next call to callbacks.poll
+    uint32_t remote_address;
     uint16_t outstanding_write_size;
+    uint8_t* loopback_data;     // data written by the server, for the loopback client
+    uint32_t loopback_size;
+    uint32_t loopback_capacity;
 };
 
+#define MAX_DATAGRAM_SIZE 2048
+
+struct udp_pcb {
+    udp_recv_fn recv;
+    void* recv_arg;
+    uint8_t reply[MAX_DATAGRAM_SIZE];   // last datagram sent, for the loopback client
+    uint32_t reply_size;
+};
 
 static struct tcp_pcb g_pcbs[NUM_PCBS];
+static struct udp_pcb g_udp_pcb;
+
+static bool g_loopback_only = false;
+
+fake_lwip_counters_t g_fake_lwip_counters;
 
 static struct tcp_pcb* allocate_pcb() {
     for (uint32_t i = 0; i < NUM_PCBS; i++) {
@@ -74,14 +99,17 @@ static bool is_ready_for_read(int socket) {
 }
 
 static bool process_listen(struct tcp_pcb* pcb) {
-    if (is_ready_for_read(pcb->socket)) {
+    if ((pcb->socket >= 0) && is_ready_for_read(pcb->socket)) {
         // New connection
-        int a_socket = accept(pcb->socket, NULL, NULL);
+        struct sockaddr_in addr;
+        socklen_t addr_size = sizeof(addr);
+        int a_socket = accept(pcb->socket, (struct sockaddr*) &addr, &addr_size);
         ASSERT(a_socket >= 0);
         struct tcp_pcb* a_pcb = allocate_pcb();
         ASSERT(a_pcb);
         a_pcb->pcb_type = ACTIVE;
         a_pcb->socket = a_socket;
+        a_pcb->remote_address = addr.sin_addr.s_addr;
         ASSERT(pcb->callbacks.accept);
         memcpy(&a_pcb->callbacks, &pcb->callbacks, sizeof(struct callbacks_t));
         if (pcb->callbacks.accept(
@@ -94,7 +122,7 @@ static bool process_listen(struct tcp_pcb* pcb) {
 }
 
 static bool process_read(struct tcp_pcb* pcb) {
-    if (is_ready_for_read(pcb->socket)) {
+    if ((pcb->socket >= 0) && is_ready_for_read(pcb->socket)) {
         // New data received
         uint8_t buffer[READ_BUFFER_SIZE];
         ssize_t rc = read(pcb->socket, buffer, sizeof(buffer));
@@ -106,11 +134,16 @@ static bool process_read(struct tcp_pcb* pcb) {
         } else {
             // Data received
             ASSERT(pcb->callbacks.recv);
-            struct pbuf p;
-            p.payload = buffer;
-            p.len = (uint16_t) rc;
+            // (rc == 0 means the connection was closed by the other side)
+            struct pbuf* p = NULL;
+            if (rc > 0) {
+                p = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) rc, PBUF_RAM);
+                ASSERT(p);
+                memcpy(p->payload, buffer, (size_t) rc);
+            }
+            g_fake_lwip_counters.recv_callbacks++;
             if (pcb->callbacks.recv(
-                    pcb->callbacks.arg, pcb, &p, ERR_OK) != ERR_OK) {
+                    pcb->callbacks.arg, pcb, p, ERR_OK) != ERR_OK) {
                 tcp_close(pcb);
             }
         }
@@ -119,17 +152,35 @@ static bool process_read(struct tcp_pcb* pcb) {
     return false;
 }
 
+static bool process_poll(struct tcp_pcb* pcb) {
+    if ((!pcb->callbacks.poll) || (time_us_64() < pcb->poll_time_us)) {
+        return false;
+    }
+    pcb->poll_time_us = time_us_64() + (pcb->poll_interval * POLL_TICK_US);
+    const err_t err = pcb->callbacks.poll(pcb->callbacks.arg, pcb);
+    if (err == ERR_ABRT) {
+        // The pcb was aborted by the callback
+        tcp_close(pcb);
+    } else {
+        ASSERT(err == ERR_OK);
+    }
+    return true;
+}
+
 static bool process_write(struct tcp_pcb* pcb) {
     uint16_t size = pcb->outstanding_write_size;
     if (size > 0) {
-        ASSERT(pcb->callbacks.sent);
+        // Everything written so far is acknowledged
+        pcb->outstanding_write_size = 0;
+        if (!pcb->callbacks.sent) {
+            return true;
+        }
+        g_fake_lwip_counters.sent_callbacks++;
         if (pcb->callbacks.sent(
                 pcb->callbacks.arg, pcb,
                 size) != ERR_OK) {
             tcp_close(pcb);
         }
-        ASSERT(pcb->outstanding_write_size >= size);
-        pcb->outstanding_write_size -= size;
         return true;
     }
     return false;
@@ -150,6 +201,7 @@ bool fake_lwip_loop() {
             case ACTIVE:
                 activity = process_read(pcb) || activity;
                 activity = process_write(pcb) || activity;
+                activity = process_poll(pcb) || activity;
                 break;
             case ALLOCATED:
                 // Should not be in this state
@@ -177,6 +229,7 @@ void tcp_abort(struct tcp_pcb *pcb) {
 err_t tcp_close(struct tcp_pcb *pcb) {
     ASSERT(pcb);
     tcp_abort(pcb);
+    free(pcb->loopback_data);
     memset(pcb, 0, sizeof(struct tcp_pcb)); // pcb becomes FREE again
     return ERR_OK;
 }
@@ -189,8 +242,9 @@ uint16_t tcp_sndbuf(struct tcp_pcb *pcb) {
 
 err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags) {
     ASSERT(pcb);
-    ASSERT(apiflags == TCP_WRITE_FLAG_COPY);
+    ASSERT((apiflags & ~TCP_WRITE_FLAG_MORE) == TCP_WRITE_FLAG_COPY);
     ASSERT(pcb->pcb_type == ACTIVE);
+    g_fake_lwip_counters.tcp_write_calls++;
 
     uint16_t available_write_space =
         (uint16_t) WRITE_BUFFER_SIZE - pcb->outstanding_write_size;
@@ -200,18 +254,45 @@ err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apifla
         return ERR_MEM;
     }
 
-    ssize_t check = write(pcb->socket, dataptr, len);
-    ASSERT(check == len);
+    if (pcb->socket < 0) {
+        // Loopback connection: keep the data for fake_lwip_loopback_receive
+        if ((pcb->loopback_size + len) > pcb->loopback_capacity) {
+            pcb->loopback_capacity = (pcb->loopback_size + len) * 2;
+            pcb->loopback_data = realloc(pcb->loopback_data, pcb->loopback_capacity);
+            ASSERT(pcb->loopback_data);
+        }
+        memcpy(&pcb->loopback_data[pcb->loopback_size], dataptr, len);
+        pcb->loopback_size += len;
+    } else {
+        ssize_t check = write(pcb->socket, dataptr, len);
+        ASSERT(check == len);
+    }
     pcb->outstanding_write_size += len;
+    g_fake_lwip_counters.tcp_write_bytes += len;
     return ERR_OK;
 }
 
+err_t tcp_output(struct tcp_pcb *pcb) {
+    ASSERT(pcb);
+    g_fake_lwip_counters.tcp_output_calls++;
+    return ERR_OK;
+}
+
+void tcp_recved(struct tcp_pcb *pcb, u16_t len) {
+    ASSERT(pcb);
+    g_fake_lwip_counters.tcp_recved_calls++;
+    g_fake_lwip_counters.tcp_recved_bytes += len;
+}
+
 
 struct tcp_pcb* tcp_new_ip_type(u8_t type) {
     ASSERT(type == IPADDR_TYPE_ANY);
     struct tcp_pcb* pcb = allocate_pcb();
-    pcb->socket = socket(AF_INET, SOCK_STREAM, 0);
-    ASSERT(pcb->socket >= 0);
+    pcb->socket = -1;
+    if (!g_loopback_only) {
+        pcb->socket = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT(pcb->socket >= 0);
+    }
     pcb->pcb_type = PORT;
     return pcb;
 }
@@ -219,8 +300,11 @@ struct tcp_pcb* tcp_new_ip_type(u8_t type) {
 err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
     ASSERT(pcb);
     ASSERT(ipaddr == NULL);
-    ASSERT(pcb->socket >= 0);
     ASSERT(pcb->pcb_type == PORT);
+    if (g_loopback_only) {
+        return ERR_OK;
+    }
+    ASSERT(pcb->socket >= 0);
 
     int enable = 1;
     int rc = setsockopt(pcb->socket, SOL_SOCKET,
@@ -242,12 +326,14 @@ struct tcp_pcb* tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog) {
     ASSERT(pcb);
 
     struct tcp_pcb* service_pcb = allocate_pcb();
-    ASSERT(pcb->socket >= 0);
+    ASSERT((pcb->socket >= 0) || g_loopback_only);
     ASSERT(pcb->pcb_type == PORT);
     service_pcb->socket = pcb->socket;
     pcb->socket = -1;
-    int rc = listen(service_pcb->socket, backlog);
-    ASSERT(rc == 0);
+    if (!g_loopback_only) {
+        int rc = listen(service_pcb->socket, backlog);
+        ASSERT(rc == 0);
+    }
     service_pcb->pcb_type = LISTEN;
     return service_pcb;
 }
@@ -264,6 +350,28 @@ void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept) {
     pcb->callbacks.accept = accept;
 }
 
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval) {
+    ASSERT(pcb);
+    ASSERT(pcb->pcb_type == ACTIVE);
+    pcb->callbacks.poll = poll;
+    pcb->poll_interval = interval;
+    pcb->poll_time_us = time_us_64() + (interval * POLL_TICK_US);
+}
+
+err_t tcp_tcp_get_tcp_addrinfo(struct tcp_pcb *pcb, int local, ip_addr_t *addr, u16_t *port) {
+    // Only the remote address is needed; loopback connections are from 127.0.0.1
+    ASSERT(pcb);
+    ASSERT(pcb->pcb_type == ACTIVE);
+    ASSERT(!local);
+    if (addr) {
+        addr->addr = pcb->remote_address;
+    }
+    if (port) {
+        *port = 0;
+    }
+    return ERR_OK;
+}
+
 void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv) {
     ASSERT(pcb);
     ASSERT(pcb->pcb_type == ACTIVE);
@@ -281,3 +389,234 @@ void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err) {
     ASSERT(pcb->pcb_type == ACTIVE);
     pcb->callbacks.err = err;
 }
+
+struct pbuf* pbuf_alloc(int layer, u16_t length, int type) {
+    ASSERT(layer == PBUF_TRANSPORT);
+    ASSERT(type == PBUF_RAM);
+    // The payload follows the pbuf structure, as in lwIP
+    struct pbuf* p = malloc(sizeof(struct pbuf) + length);
+    ASSERT(p);
+    p->next = NULL;
+    p->payload = &p[1];
+    p->tot_len = length;
+    p->len = length;
+    g_fake_lwip_counters.pbuf_alloc_calls++;
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+    ASSERT(p);
+    u8_t count = 0;
+    while (p) {
+        struct pbuf* next = p->next;
+        free(p);
+        p = next;
+        count++;
+    }
+    g_fake_lwip_counters.pbuf_free_calls++;
+    return count;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail) {
+    ASSERT(head);
+    ASSERT(tail);
+    struct pbuf* p = head;
+    while (p->next) {
+        p->tot_len += tail->tot_len;
+        p = p->next;
+    }
+    p->tot_len += tail->tot_len;
+    p->next = tail;
+    g_fake_lwip_counters.pbuf_cat_calls++;
+}
+
+struct pbuf* pbuf_free_header(struct pbuf *q, u16_t size) {
+    // Remove size bytes from the start of the chain, freeing any pbufs which become empty
+    ASSERT(q);
+    ASSERT(size <= q->tot_len);
+    g_fake_lwip_counters.pbuf_free_header_calls++;
+    while (q && (size >= q->len)) {
+        struct pbuf* next = q->next;
+        size -= q->len;
+        free(q);
+        q = next;
+    }
+    if (q && (size > 0)) {
+        q->payload = ((uint8_t*) q->payload) + size;
+        q->len -= size;
+        for (struct pbuf* p = q; p; p = p->next) {
+            p->tot_len -= size;
+        }
+    }
+    return q;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *buf, void *dataptr, u16_t len, u16_t offset) {
+    u16_t copied = 0;
+    for (const struct pbuf* p = buf; p && (copied < len); p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        u16_t size = p->len - offset;
+        if (size > (len - copied)) {
+            size = len - copied;
+        }
+        memcpy(((uint8_t*) dataptr) + copied, ((const uint8_t*) p->payload) + offset, size);
+        copied += size;
+        offset = 0;
+    }
+    return copied;
+}
+
+struct udp_pcb* udp_new_ip_type(u8_t type) {
+    // The UDP responder only receives datagrams from fake_lwip_udp_loopback_send
+    ASSERT(type == IPADDR_TYPE_ANY);
+    return &g_udp_pcb;
+}
+
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
+    ASSERT(pcb == &g_udp_pcb);
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg) {
+    ASSERT(pcb == &g_udp_pcb);
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port) {
+    ASSERT(pcb == &g_udp_pcb);
+    ASSERT(p->tot_len <= MAX_DATAGRAM_SIZE);
+    pcb->reply_size = pbuf_copy_partial(p, pcb->reply, p->tot_len, 0);
+    return ERR_OK;
+}
+
+void fake_lwip_udp_loopback_send(const void* data, uint32_t size) {
+    // Deliver a datagram to the UDP responder, as if from a client
+    struct udp_pcb* pcb = &g_udp_pcb;
+    ASSERT(pcb->recv);
+    ASSERT(size <= MAX_DATAGRAM_SIZE);
+    struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, (u16_t) size, PBUF_RAM);
+    memcpy(p->payload, data, size);
+    ip_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    pcb->reply_size = 0;
+    g_fake_lwip_counters.udp_recv_callbacks++;
+    const uint64_t start = fake_cycles();
+    pcb->recv(pcb->recv_arg, pcb, p, &addr, 1404);
+    g_fake_lwip_counters.udp_recv_cycles += fake_cycles() - start;
+}
+
+uint32_t fake_lwip_udp_loopback_receive(void* data, uint32_t size) {
+    // Get the reply to the last datagram, returning its size (0 if there was no reply)
+    struct udp_pcb* pcb = &g_udp_pcb;
+    const uint32_t reply_size = pcb->reply_size;
+    ASSERT(reply_size <= size);
+    memcpy(data, pcb->reply, reply_size);
+    pcb->reply_size = 0;
+    return reply_size;
+}
+
+void fake_lwip_set_loopback_only() {
+    // No sockets are used, so that the benchmark doesn't need the TCP port
+    g_loopback_only = true;
+}
+
+struct tcp_pcb* fake_lwip_loopback_connect() {
+    // Connect to the listening pcb without a socket
+    struct tcp_pcb* listen_pcb = NULL;
+    for (uint i = 0; i < NUM_PCBS; i++) {
+        if (g_pcbs[i].pcb_type == LISTEN) {
+            listen_pcb = &g_pcbs[i];
+            break;
+        }
+    }
+    ASSERT(listen_pcb);
+    ASSERT(listen_pcb->callbacks.accept);
+    struct tcp_pcb* pcb = allocate_pcb();
+    ASSERT(pcb);
+    pcb->pcb_type = ACTIVE;
+    pcb->socket = -1;
+    pcb->remote_address = htonl(INADDR_LOOPBACK);
+    const uint64_t start = fake_cycles();
+    const err_t err = listen_pcb->callbacks.accept(listen_pcb->callbacks.arg, pcb, ERR_OK);
+    g_fake_lwip_counters.accept_cycles += fake_cycles() - start;
+    if (err != ERR_OK) {
+        tcp_close(pcb);
+        return NULL;
+    }
+    return pcb;
+}
+
+bool fake_lwip_loopback_is_open(struct tcp_pcb* pcb) {
+    return pcb->pcb_type == ACTIVE;
+}
+
+void fake_lwip_loopback_send(struct tcp_pcb* pcb, const void* data, uint32_t size, uint16_t segment_size) {
+    // Each segment is passed to the recv callback in a separate pbuf, as lwIP would do
+    ASSERT(pcb->socket < 0);
+    const uint8_t* bytes = (const uint8_t*) data;
+    while ((size > 0) && fake_lwip_loopback_is_open(pcb)) {
+        const uint16_t len = (size < segment_size) ? (uint16_t) size : segment_size;
+        struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        memcpy(p->payload, bytes, len);
+        bytes += len;
+        size -= len;
+        g_fake_lwip_counters.recv_callbacks++;
+        g_fake_lwip_counters.recv_bytes += len;
+        ASSERT(pcb->callbacks.recv);
+        const uint64_t start = fake_cycles();
+        const err_t err = pcb->callbacks.recv(pcb->callbacks.arg, pcb, p, ERR_OK);
+        g_fake_lwip_counters.recv_cycles += fake_cycles() - start;
+        if (err != ERR_OK) {
+            tcp_close(pcb);
+        }
+    }
+}
+
+uint32_t fake_lwip_loopback_receive(struct tcp_pcb* pcb, void* data, uint32_t size) {
+    // Acknowledge everything (calling the sent callback) until the server has nothing more
+    // to send, then take up to size bytes of the data written by the server
+    while (fake_lwip_loopback_is_open(pcb) && (pcb->outstanding_write_size > 0)) {
+        const uint64_t start = fake_cycles();
+        process_write(pcb);
+        g_fake_lwip_counters.sent_cycles += fake_cycles() - start;
+    }
+    if (!fake_lwip_loopback_is_open(pcb)) {
+        return 0;
+    }
+    if (size > pcb->loopback_size) {
+        size = pcb->loopback_size;
+    }
+    memcpy(data, pcb->loopback_data, size);
+    pcb->loopback_size -= size;
+    memmove(pcb->loopback_data, &pcb->loopback_data[size], pcb->loopback_size);
+    return size;
+}
+
+bool fake_lwip_loopback_poll(struct tcp_pcb* pcb) {
+    // Call the poll callback if it is due (see fake_time_advance_ms)
+    if (!fake_lwip_loopback_is_open(pcb)) {
+        return false;
+    }
+    const uint64_t start = fake_cycles();
+    const bool polled = process_poll(pcb);
+    if (polled) {
+        g_fake_lwip_counters.poll_callbacks++;
+        g_fake_lwip_counters.poll_cycles += fake_cycles() - start;
+    }
+    return polled;
+}
+
+void fake_lwip_loopback_close(struct tcp_pcb* pcb) {
+    // The client closes the connection (the recv callback gets NULL)
+    if (fake_lwip_loopback_is_open(pcb)) {
+        ASSERT(pcb->callbacks.recv);
+        const err_t err = pcb->callbacks.recv(pcb->callbacks.arg, pcb, NULL, ERR_OK);
+        if ((err != ERR_OK) || fake_lwip_loopback_is_open(pcb)) {
+            tcp_close(pcb);
+        }
+    }
+}
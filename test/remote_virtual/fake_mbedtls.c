@@ -18,8 +18,123 @@
 #include <openssl/rand.h>
 #include <string.h>
 
+#define NUM_AES_CONTEXTS 32
+
+// OpenSSL contexts are kept for each mbedtls_aes_context (by address), as
+// wifi_settings_remote clears the mbedtls_aes_context without freeing it,
+// and creating an OpenSSL context for each block would hide the cost of AES itself.
+typedef struct aes_context_entry_t {
+    const mbedtls_aes_context* owner;
+    EVP_CIPHER_CTX* ctx;
+    const EVP_CIPHER* cipher;   // cipher for which ctx is set up
+    uint8_t key[_AES_KEY_SIZE];
+    int direction;
+    int counted_as;             // MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT, 0 if not known yet
+} aes_context_entry_t;
+
+static aes_context_entry_t g_aes_contexts[NUM_AES_CONTEXTS];
+static uint32_t g_aes_next_replacement = 0;
+static EVP_CIPHER* g_aes_cbc = NULL;
+static EVP_CIPHER* g_aes_ecb = NULL;
+static EVP_MD* g_sha256 = NULL;
+static uint8_t g_request_key[_AES_KEY_SIZE];
+
+fake_mbedtls_counters_t g_fake_mbedtls_counters;
+
+#ifdef MBEDTLS_SHA256_ALT
+// Like the SHA-256 hardware (Pico 2), only one hash can be computed at a time
+static const mbedtls_sha256_context* g_sha256_owner = NULL;
+#endif
+
+static aes_context_entry_t* get_aes_context_entry(const mbedtls_aes_context* mctx, bool create) {
+    for (uint32_t i = 0; i < NUM_AES_CONTEXTS; i++) {
+        if (g_aes_contexts[i].owner == mctx) {
+            return &g_aes_contexts[i];
+        }
+    }
+    ASSERT(create);
+    aes_context_entry_t* entry = NULL;
+    for (uint32_t i = 0; (i < NUM_AES_CONTEXTS) && !entry; i++) {
+        if (!g_aes_contexts[i].owner) {
+            entry = &g_aes_contexts[i];
+        }
+    }
+    if (!entry) {
+        entry = &g_aes_contexts[g_aes_next_replacement];
+        g_aes_next_replacement = (g_aes_next_replacement + 1) % NUM_AES_CONTEXTS;
+    }
+    if (!entry->ctx) {
+        entry->ctx = EVP_CIPHER_CTX_new();
+        ASSERT(entry->ctx);
+    }
+    entry->owner = mctx;
+    return entry;
+}
+
+static EVP_CIPHER_CTX* get_aes_ctx(const mbedtls_aes_context* mctx, const EVP_CIPHER* cipher) {
+    aes_context_entry_t* entry = get_aes_context_entry(mctx, false);
+    ASSERT(memcmp(entry->key, mctx->key, _AES_KEY_SIZE) == 0);
+    ASSERT(entry->direction == mctx->direction);
+    if (entry->cipher != cipher) {
+        int rc = EVP_CipherInit_ex(entry->ctx, cipher, NULL, entry->key, NULL,
+                                   (entry->direction == MBEDTLS_AES_ENCRYPT) ? 1 : 0);
+        ASSERT(rc == 1);
+        EVP_CIPHER_CTX_set_padding(entry->ctx, 0);
+        entry->cipher = cipher;
+    }
+    return entry->ctx;
+}
+
+static void fetch_algorithms() {
+    if (!g_aes_cbc) {
+        g_aes_cbc = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+        ASSERT(g_aes_cbc);
+        g_aes_ecb = EVP_CIPHER_fetch(NULL, "AES-256-ECB", NULL);
+        ASSERT(g_aes_ecb);
+        g_sha256 = EVP_MD_fetch(NULL, "SHA-256", NULL);
+        ASSERT(g_sha256);
+        ASSERT(EVP_MD_size(g_sha256) == _SHA256_BLOCK_SIZE);
+    }
+}
+
+void fake_mbedtls_set_request_key(const uint8_t* key) {
+    memcpy(g_request_key, key, _AES_KEY_SIZE);
+}
+
+static void count_crypt(const mbedtls_aes_context* mctx, size_t length, uint64_t start) {
+    const uint64_t cycles = fake_cycles() - start;
+    // AES-CTR decrypts by encrypting, so decryption is recognised by the key
+    aes_context_entry_t* entry = get_aes_context_entry(mctx, false);
+    if (!entry->counted_as) {
+        entry->counted_as = ((entry->direction == MBEDTLS_AES_DECRYPT)
+                || (memcmp(entry->key, g_request_key, _AES_KEY_SIZE) == 0))
+            ? MBEDTLS_AES_DECRYPT : MBEDTLS_AES_ENCRYPT;
+    }
+    if (entry->counted_as == MBEDTLS_AES_ENCRYPT) {
+        g_fake_mbedtls_counters.encrypt_calls++;
+        g_fake_mbedtls_counters.encrypt_bytes += length;
+        g_fake_mbedtls_counters.encrypt_cycles += cycles;
+    } else {
+        g_fake_mbedtls_counters.decrypt_calls++;
+        g_fake_mbedtls_counters.decrypt_bytes += length;
+        g_fake_mbedtls_counters.decrypt_cycles += cycles;
+    }
+}
+
 void mbedtls_aes_init(mbedtls_aes_context* mctx) {
     ASSERT(mctx);
+    fetch_algorithms();
+}
+
+void mbedtls_aes_free(mbedtls_aes_context* mctx) {
+    // The OpenSSL context is kept for reuse by another mbedtls_aes_context
+    ASSERT(mctx);
+    for (uint32_t i = 0; i < NUM_AES_CONTEXTS; i++) {
+        if (g_aes_contexts[i].owner == mctx) {
+            g_aes_contexts[i].owner = NULL;
+        }
+    }
+    memset(mctx, 0, sizeof(mbedtls_aes_context));
 }
 
 int mbedtls_aes_setkey_enc(mbedtls_aes_context* mctx,
@@ -28,6 +143,11 @@ int mbedtls_aes_setkey_enc(mbedtls_aes_context* mctx,
     ASSERT(key_size == (_AES_KEY_SIZE * 8));
     memcpy(mctx->key, raw_key, _AES_KEY_SIZE);
     mctx->direction = MBEDTLS_AES_ENCRYPT;
+    aes_context_entry_t* entry = get_aes_context_entry(mctx, true);
+    memcpy(entry->key, raw_key, _AES_KEY_SIZE);
+    entry->direction = mctx->direction;
+    entry->cipher = NULL;
+    entry->counted_as = 0;
     return 0;
 }
 
@@ -35,6 +155,7 @@ int mbedtls_aes_setkey_dec(mbedtls_aes_context* mctx,
                 const uint8_t* raw_key, uint32_t key_size) {
     mbedtls_aes_setkey_enc(mctx, raw_key, key_size);
     mctx->direction = MBEDTLS_AES_DECRYPT;
+    get_aes_context_entry(mctx, false)->direction = mctx->direction;
     return 0;
 }
 
@@ -46,99 +167,111 @@ int mbedtls_aes_crypt_cbc(mbedtls_aes_context* mctx,
     ASSERT(mctx);
     ASSERT((mode == MBEDTLS_AES_ENCRYPT) || (mode == MBEDTLS_AES_DECRYPT));
     ASSERT(mode == mctx->direction);
-    ASSERT(length == _AES_BLOCK_SIZE);
-    
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    ASSERT(ctx);
+    ASSERT((length > 0) && ((length % _AES_BLOCK_SIZE) == 0));
+    const uint64_t start = fake_cycles();
 
-    EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
-    ASSERT(cipher);
+    EVP_CIPHER_CTX* ctx = get_aes_ctx(mctx, g_aes_cbc);
+    int rc = EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1);
+    ASSERT(rc == 1);
 
+    // The next IV is the final ciphertext block (src may be the same as dest)
+    uint8_t next_iv[_AES_BLOCK_SIZE];
+    if (mode == MBEDTLS_AES_DECRYPT) {
+        memcpy(next_iv, &src[length - _AES_BLOCK_SIZE], _AES_BLOCK_SIZE);
+    }
+    int len_out = 0;
+    rc = EVP_CipherUpdate(ctx, dest, &len_out, src, (int) length);
+    ASSERT(rc == 1);
+    ASSERT(len_out == (int) length);
     if (mode == MBEDTLS_AES_ENCRYPT) {
-        int rc = EVP_EncryptInit_ex(ctx, cipher, NULL, mctx->key, iv);
-        ASSERT(rc == 1);
-
-        EVP_CIPHER_CTX_set_padding(ctx, 0);
-
-        int len_out = 0;
-        rc = EVP_EncryptUpdate(ctx, dest, &len_out, src, _AES_BLOCK_SIZE);
-        ASSERT(rc == 1);
-        ASSERT(len_out == _AES_BLOCK_SIZE);
-        memcpy(iv, dest, _AES_BLOCK_SIZE);
-
-        uint8_t ignore[1];
-        rc = EVP_EncryptFinal_ex(ctx, ignore, &len_out);
-        ASSERT(rc == 1);
-        ASSERT(len_out == 0);
-    } else {
-
-        int rc = EVP_DecryptInit_ex(ctx, cipher, NULL, mctx->key, iv);
-        ASSERT(rc == 1);
-
-        EVP_CIPHER_CTX_set_padding(ctx, 0);
-
-        memcpy(iv, src, _AES_BLOCK_SIZE);
-        int len_out = 0;
-        rc = EVP_DecryptUpdate(ctx, dest, &len_out, src, _AES_BLOCK_SIZE);
-        ASSERT(rc == 1);
-        ASSERT(len_out == _AES_BLOCK_SIZE);
-
-        uint8_t ignore[1];
-        rc = EVP_DecryptFinal_ex(ctx, ignore, &len_out);
-        ASSERT(rc == 1);
-        ASSERT(len_out == 0);
+        memcpy(next_iv, &dest[length - _AES_BLOCK_SIZE], _AES_BLOCK_SIZE);
     }
+    memcpy(iv, next_iv, _AES_BLOCK_SIZE);
+    count_crypt(mctx, length, start);
+    return 0;
+}
 
-    EVP_CIPHER_free(cipher);
-    EVP_CIPHER_CTX_free(ctx);
+int mbedtls_aes_crypt_ecb(mbedtls_aes_context* mctx,
+                int mode,
+                const uint8_t src[_AES_BLOCK_SIZE],
+                uint8_t dest[_AES_BLOCK_SIZE]) {
+    ASSERT(mctx);
+    ASSERT(mode == MBEDTLS_AES_ENCRYPT);
+    ASSERT(mode == mctx->direction);
+    const uint64_t start = fake_cycles();
+
+    EVP_CIPHER_CTX* ctx = get_aes_ctx(mctx, g_aes_ecb);
+    int len_out = 0;
+    int rc = EVP_CipherUpdate(ctx, dest, &len_out, src, _AES_BLOCK_SIZE);
+    ASSERT(rc == 1);
+    ASSERT(len_out == _AES_BLOCK_SIZE);
+    count_crypt(mctx, _AES_BLOCK_SIZE, start);
     return 0;
 }
 
 void mbedtls_sha256_init(mbedtls_sha256_context *mctx) {
     ASSERT(mctx);
+    fetch_algorithms();
 
     EVP_MD_CTX* ctx = EVP_MD_CTX_new();
     ASSERT(ctx);
 
-    EVP_MD* hash = EVP_MD_fetch(NULL, "SHA-256", NULL);
-    ASSERT(hash);
-    ASSERT(EVP_MD_size(hash) == _SHA256_BLOCK_SIZE);
-
     mctx->opaque_ctx = ctx;
-    mctx->opaque_hash = hash;
+    mctx->opaque_hash = g_sha256;
     mctx->active = false;
 }
 
 void mbedtls_sha256_free(mbedtls_sha256_context *mctx) {
+    // (mctx may be active, e.g. a precomputed HMAC state which is never finished)
     ASSERT(mctx);
-    ASSERT(!mctx->active);
 
     EVP_MD_CTX* ctx = (EVP_MD_CTX*) mctx->opaque_ctx;
     ASSERT(ctx);
-    EVP_MD* hash = (EVP_MD*) mctx->opaque_hash;
-    ASSERT(hash);
+    ASSERT(mctx->opaque_hash);
 
-    EVP_MD_free(hash);
-	EVP_MD_CTX_free(ctx);
+    EVP_MD_CTX_free(ctx);
 
     mctx->opaque_ctx = NULL;
     mctx->opaque_hash = NULL;
 }
 
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst,
+                          const mbedtls_sha256_context *src) {
+    ASSERT(dst);
+    ASSERT(src);
+    ASSERT(src->active);
+    const uint64_t start = fake_cycles();
+
+    EVP_MD_CTX* dst_ctx = (EVP_MD_CTX*) dst->opaque_ctx;
+    ASSERT(dst_ctx);
+    int rc = EVP_MD_CTX_copy_ex(dst_ctx, (const EVP_MD_CTX*) src->opaque_ctx);
+    ASSERT(rc == 1);
+    dst->active = true;
+    g_fake_mbedtls_counters.hash_starts++;
+    g_fake_mbedtls_counters.hash_cycles += fake_cycles() - start;
+}
+
 int mbedtls_sha256_starts(mbedtls_sha256_context *mctx, int is224) {
     ASSERT(mctx);
     ASSERT(!is224);
+    const uint64_t start = fake_cycles();
 
     EVP_MD_CTX* ctx = (EVP_MD_CTX*) mctx->opaque_ctx;
     ASSERT(ctx);
-    EVP_MD* hash = (EVP_MD*) mctx->opaque_hash;
+    const EVP_MD* hash = (const EVP_MD*) mctx->opaque_hash;
     ASSERT(hash);
 
     ASSERT(!mctx->active);
     mctx->active = true;
+#ifdef MBEDTLS_SHA256_ALT
+    ASSERT(!g_sha256_owner);
+    g_sha256_owner = mctx;
+#endif
 
     int rc = EVP_DigestInit_ex(ctx, hash, NULL);
     ASSERT(rc == 1);
+    g_fake_mbedtls_counters.hash_starts++;
+    g_fake_mbedtls_counters.hash_cycles += fake_cycles() - start;
     return 0;
 }
 
@@ -147,11 +280,15 @@ int mbedtls_sha256_update(mbedtls_sha256_context *mctx,
                               size_t ilen) {
     ASSERT(mctx);
     ASSERT(mctx->active);
+    const uint64_t start = fake_cycles();
 
     EVP_MD_CTX* ctx = (EVP_MD_CTX*) mctx->opaque_ctx;
     ASSERT(ctx);
-	int rc = EVP_DigestUpdate(ctx, input, ilen);
+    int rc = EVP_DigestUpdate(ctx, input, ilen);
     ASSERT(rc == 1);
+    g_fake_mbedtls_counters.hash_calls++;
+    g_fake_mbedtls_counters.hash_bytes += ilen;
+    g_fake_mbedtls_counters.hash_cycles += fake_cycles() - start;
     return 0;
 }
 
@@ -159,15 +296,21 @@ int mbedtls_sha256_finish(mbedtls_sha256_context *mctx,
                               unsigned char output[_SHA256_BLOCK_SIZE]) {
     ASSERT(mctx);
     ASSERT(mctx->active);
+    const uint64_t start = fake_cycles();
 
     EVP_MD_CTX* ctx = (EVP_MD_CTX*) mctx->opaque_ctx;
     ASSERT(ctx);
 
     unsigned len = 0;
-	int rc = EVP_DigestFinal_ex(ctx, output, &len);
+    int rc = EVP_DigestFinal_ex(ctx, output, &len);
     ASSERT(rc == 1);
     ASSERT(len == _SHA256_BLOCK_SIZE);
     mctx->active = false;
+#ifdef MBEDTLS_SHA256_ALT
+    ASSERT(g_sha256_owner == mctx);
+    g_sha256_owner = NULL;
+#endif
+    g_fake_mbedtls_counters.hash_cycles += fake_cycles() - start;
     return 0;
 }
 
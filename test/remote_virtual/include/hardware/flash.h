@@ -0,0 +1,13 @@
+#ifndef HARDWARE_FLASH_H
+#define HARDWARE_FLASH_H
+
+#ifndef REMOTE_VIRTUAL
+#error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
+#endif
+
+#define XIP_BASE 0x10000000
+#define PICO_FLASH_SIZE_BYTES 0x200000
+#define FLASH_SECTOR_SIZE 0x1000
+#define FLASH_PAGE_SIZE 0x100
+
+#endif
@@ -15,17 +15,26 @@ typedef struct ip_addr_t{
     uint32_t addr;
 } ip_addr_t;
 
+#define ip_addr_cmp(addr1, addr2) ((addr1)->addr == (addr2)->addr)
+#define ip_addr_copy(dest, src) ((dest).addr = (src).addr)
+
 #define ERR_OK      0
 #define ERR_ABRT    51
 #define ERR_ARG     52
 #define TCP_WRITE_FLAG_COPY 53
 #define IPADDR_TYPE_ANY 54
 #define ERR_MEM     55
+#define ERR_VAL     56
+#define TCP_WRITE_FLAG_MORE 0x02
+#define PBUF_TRANSPORT 60
+#define PBUF_RAM    61
 
 struct tcp_pcb;
 
 struct pbuf {
-    uint8_t* payload;
+    struct pbuf* next;
+    void* payload;
+    uint16_t tot_len;
     uint16_t len;
 };
 
@@ -33,6 +42,7 @@ typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
 typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
 typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *tpcb, u16_t len);
 typedef void (*tcp_err_fn)(void *arg, err_t err);
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
 
 
 
@@ -42,12 +52,21 @@ void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
 void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
 void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
 void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
+err_t tcp_tcp_get_tcp_addrinfo(struct tcp_pcb *pcb, int local, ip_addr_t *addr, u16_t *port);
 void tcp_abort(struct tcp_pcb *pcb);
 err_t tcp_close(struct tcp_pcb *pcb);
 err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags);
 struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog);
 struct tcp_pcb * tcp_new_ip_type(u8_t type);
 err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+err_t tcp_output(struct tcp_pcb *pcb);
+struct pbuf * pbuf_alloc(int layer, u16_t length, int type);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+struct pbuf * pbuf_free_header(struct pbuf *q, u16_t size);
+u16_t pbuf_copy_partial(const struct pbuf *buf, void *dataptr, u16_t len, u16_t offset);
 bool fake_lwip_loop();
 
 #endif
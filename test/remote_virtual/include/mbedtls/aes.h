@@ -21,6 +21,7 @@ typedef struct mbedtls_aes_context {
 
 
 void mbedtls_aes_init(mbedtls_aes_context* mctx);
+void mbedtls_aes_free(mbedtls_aes_context* mctx);
 int mbedtls_aes_setkey_enc(mbedtls_aes_context* mctx,
                 const uint8_t* raw_key, uint32_t key_size);
 int mbedtls_aes_setkey_dec(mbedtls_aes_context* mctx,
@@ -30,6 +31,10 @@ int mbedtls_aes_crypt_cbc(mbedtls_aes_context* mctx,
                 uint8_t iv[_AES_BLOCK_SIZE],
                 const uint8_t* src,
                 uint8_t* dest);
+int mbedtls_aes_crypt_ecb(mbedtls_aes_context* mctx,
+                int mode,
+                const uint8_t src[_AES_BLOCK_SIZE],
+                uint8_t dest[_AES_BLOCK_SIZE]);
 
 #endif
 
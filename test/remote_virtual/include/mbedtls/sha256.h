@@ -18,6 +18,8 @@ typedef struct mbedtls_sha256_context {
 
 void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
 void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst,
+                          const mbedtls_sha256_context *src);
 int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224);
 int mbedtls_sha256_update(mbedtls_sha256_context *ctx,
                               const unsigned char *input,
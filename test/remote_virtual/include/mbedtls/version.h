@@ -0,0 +1,10 @@
+#ifndef MBEDTLS_VERSION_H
+#define MBEDTLS_VERSION_H
+
+#ifndef REMOTE_VIRTUAL
+#error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
+#endif
+
+#define MBEDTLS_VERSION_MAJOR 3
+
+#endif
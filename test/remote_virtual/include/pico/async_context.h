@@ -0,0 +1,31 @@
+#ifndef PICO_ASYNC_CONTEXT_H
+#define PICO_ASYNC_CONTEXT_H
+
+#ifndef REMOTE_VIRTUAL
+#error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct async_context_t {
+    int nothing;
+} async_context_t;
+
+typedef struct async_work_on_timeout {
+    void (*do_work)(async_context_t *context, struct async_work_on_timeout *timeout);
+} async_at_time_worker_t;
+
+typedef struct async_when_pending_worker {
+    void (*do_work)(async_context_t *context, struct async_when_pending_worker *worker);
+    bool work_pending;
+} async_when_pending_worker_t;
+
+bool async_context_add_at_time_worker_in_ms(async_context_t *context,
+        async_at_time_worker_t *worker, uint32_t ms);
+bool async_context_add_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker);
+void async_context_set_work_pending(async_context_t *context,
+        async_when_pending_worker_t *worker);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef PICO_BINARY_INFO_H
+#define PICO_BINARY_INFO_H
+
+#ifndef REMOTE_VIRTUAL
+#error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
+#endif
+
+#define bi_decl_if_func_used(x)
+#define BINARY_INFO_ID_RP_PROGRAM_VERSION_STRING 0x11a9bc3a
+
+#endif
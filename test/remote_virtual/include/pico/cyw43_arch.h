@@ -0,0 +1,16 @@
+#ifndef PICO_CYW43_ARCH_H
+#define PICO_CYW43_ARCH_H
+
+#ifndef REMOTE_VIRTUAL
+#error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
+#endif
+
+#include "pico/async_context.h"
+
+// There is only one thread, so the lwIP lock does nothing
+static inline void cyw43_arch_lwip_begin(void) {}
+static inline void cyw43_arch_lwip_end(void) {}
+
+async_context_t* cyw43_arch_async_context(void);
+
+#endif
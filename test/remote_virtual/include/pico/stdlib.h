@@ -5,12 +5,26 @@
 #error "THIS IS A MOCK HEADER FOR REMOTE VIRTUAL PLATFORM ONLY"
 #endif
 
+#include <stdint.h>
+
+// Same values as the Pico SDK, as handler results are sent to the client
+#define PICO_OK 0
 #define PICO_ERROR_NONE 0
-#define PICO_ERROR_INVALID_ARG 151
-#define PICO_ERROR_INSUFFICIENT_RESOURCES 152
-#define PICO_ERROR_RESOURCE_IN_USE 153
+#define PICO_ERROR_GENERIC -1
+#define PICO_ERROR_NOT_PERMITTED -4
+#define PICO_ERROR_INVALID_ARG -5
+#define PICO_ERROR_RESOURCE_IN_USE -11
+#define PICO_ERROR_INSUFFICIENT_RESOURCES -12
 
 typedef unsigned int uint;
 void panic(const char* fmt, ...);
 
+typedef struct absolute_time_t {
+    uint64_t value;
+} absolute_time_t;
+
+uint64_t time_us_64(void);
+absolute_time_t get_absolute_time(void);
+uint32_t to_ms_since_boot(absolute_time_t t);
+
 #endif
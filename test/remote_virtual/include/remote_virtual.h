@@ -5,8 +5,80 @@
 #error "THIS HEADER IS FOR REMOTE VIRTUAL TESTING ONLY"
 #endif
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define ASSERT(truth) \
     if (!(truth)) { fprintf(stderr, "Assert failed at %s:%u -> %s\n", \
         __FILE__, __LINE__, #truth); exit(1); }
 
+// Operation counts for benchmarking (see bench.c)
+typedef struct fake_lwip_counters_t {
+    uint64_t tcp_write_calls;
+    uint64_t tcp_write_bytes;
+    uint64_t tcp_output_calls;
+    uint64_t tcp_recved_calls;
+    uint64_t tcp_recved_bytes;
+    uint64_t accept_cycles;     // time in the accept callback (loopback only)
+    uint64_t recv_callbacks;
+    uint64_t recv_bytes;
+    uint64_t recv_cycles;       // time in the recv callback (loopback only)
+    uint64_t sent_callbacks;
+    uint64_t sent_cycles;       // time in the sent callback (loopback only)
+    uint64_t poll_callbacks;
+    uint64_t poll_cycles;       // time in the poll callback (loopback only)
+    uint64_t pbuf_alloc_calls;
+    uint64_t pbuf_free_calls;
+    uint64_t pbuf_cat_calls;
+    uint64_t pbuf_free_header_calls;
+    uint64_t udp_recv_callbacks;
+    uint64_t udp_recv_cycles;   // time in the UDP recv callback (loopback only)
+} fake_lwip_counters_t;
+
+typedef struct fake_mbedtls_counters_t {
+    uint64_t encrypt_calls;
+    uint64_t encrypt_bytes;
+    uint64_t encrypt_cycles;
+    uint64_t decrypt_calls;
+    uint64_t decrypt_bytes;
+    uint64_t decrypt_cycles;
+    uint64_t hash_starts;
+    uint64_t hash_calls;        // calls to mbedtls_sha256_update
+    uint64_t hash_bytes;
+    uint64_t hash_cycles;       // including mbedtls_sha256_starts/clone/finish
+} fake_mbedtls_counters_t;
+
+extern fake_lwip_counters_t g_fake_lwip_counters;
+extern fake_mbedtls_counters_t g_fake_mbedtls_counters;
+
+// The client to server key of the benchmark session, so that decryption
+// can be counted separately from encryption in AES-CTR mode
+void fake_mbedtls_set_request_key(const uint8_t* key);
+
+// CPU cycles (x86), or nanoseconds (other hosts)
+uint64_t fake_cycles();
+const char* fake_cycles_unit();
+
+// Move the time forward (time_us_64 etc.) without waiting
+void fake_time_advance_ms(uint32_t ms);
+
+// In-memory connections to the remote service, without a socket
+struct tcp_pcb;
+void fake_lwip_set_loopback_only();
+struct tcp_pcb* fake_lwip_loopback_connect();
+bool fake_lwip_loopback_is_open(struct tcp_pcb* pcb);
+void fake_lwip_loopback_send(struct tcp_pcb* pcb, const void* data, uint32_t size, uint16_t segment_size);
+uint32_t fake_lwip_loopback_receive(struct tcp_pcb* pcb, void* data, uint32_t size);
+bool fake_lwip_loopback_poll(struct tcp_pcb* pcb);
+void fake_lwip_loopback_close(struct tcp_pcb* pcb);
+
+// In-memory datagrams for the UDP responder
+void fake_lwip_udp_loopback_send(const void* data, uint32_t size);
+uint32_t fake_lwip_udp_loopback_receive(void* data, uint32_t size);
+
+// The update_secret for remote_virtual --bench
+#define BENCH_SECRET "bench"
+
+int bench_main(int argc, char** argv);
+
 #endif
@@ -1,9 +1,11 @@
 
 #include "remote_virtual.h"
 #include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
 #include "lwip/tcp.h"
 
 #include "wifi_settings/wifi_settings_remote.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -11,32 +13,114 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-uint8_t g_update_secret[MAX_SECRET_SIZE + 1];
+#define MAX_SECRET_SIZE 128
+
+static char g_update_secret[MAX_SECRET_SIZE + 1];
+static async_context_t g_async_context;
 
 void panic(const char* fmt, ...) {
     fprintf(stderr, "Panic: %s\n", fmt);
     exit(1);
 }
 
-bool wifi_settings_get_value_for_key(
-            const char* key, char* value, uint* value_size) {
+// Added to the time, so that the benchmark doesn't have to wait for timeouts
+static uint64_t g_time_offset_us = 0;
+
+uint64_t time_us_64() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t) ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000) + g_time_offset_us;
+}
+
+void fake_time_advance_ms(uint32_t ms) {
+    g_time_offset_us += ((uint64_t) ms) * 1000;
+}
+
+absolute_time_t get_absolute_time() {
+    absolute_time_t t;
+    t.value = time_us_64();
+    return t;
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t) (t.value / 1000);
+}
+
+uint64_t fake_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t) ts.tv_sec) * 1000000000) + ts.tv_nsec;
+#endif
+}
+
+const char* fake_cycles_unit() {
+#if defined(__x86_64__) || defined(__i386__)
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+async_context_t* cyw43_arch_async_context() {
+    return &g_async_context;
+}
+
+bool async_context_add_at_time_worker_in_ms(async_context_t *context,
+        async_at_time_worker_t *worker, uint32_t ms) {
+    // Only used for ID_PREPARE_FLASH_HANDLER, which has nothing to do here
+    return true;
+}
+
+bool async_context_add_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    // Handlers are not deferred (WIFI_SETTINGS_REMOTE_DEFERRED_HANDLERS=0)
+    return true;
+}
+
+void async_context_set_work_pending(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+}
+
+bool wifi_settings_staged_update_lock() {
+    return false;
+}
+
+void wifi_settings_staged_update_unlock(bool need_lock) {
+}
+
+bool wifi_settings_get_value_pointer_for_key(
+            const char* key, const char** value, uint* value_size) {
     ASSERT(strcmp(key, "update_secret") == 0);
 
     size_t actual_size = strlen(g_update_secret);
     if (actual_size == 0) {
         return false;
-    } else {
-        if (actual_size < *value_size) {
-            *value_size = actual_size;
-        }
-        memcpy(value, g_update_secret, *value_size);
-        return true;
     }
+    *value = g_update_secret;
+    *value_size = (uint) actual_size;
+    return true;
 }
 
 int main(int argc, char ** argv) {
+    if ((argc > 1) && (strcmp(argv[1], "--bench") == 0)) {
+        strcpy(g_update_secret, BENCH_SECRET);
+        fake_lwip_set_loopback_only();
+        int rc = wifi_settings_remote_init();
+        ASSERT(rc == 0);
+        // The virtual network is always connected
+        rc = wifi_settings_remote_connected();
+        ASSERT(rc == 0);
+        return bench_main(argc - 1, &argv[1]);
+    }
     if (argc <= 1) {
         g_update_secret[0] = '\0';
         printf("Secret is unset\n");
@@ -48,9 +132,11 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "Incorrect parameters\n");
         return 1;
     }
-        
+
     int rc = wifi_settings_remote_init();
     ASSERT(rc == 0);
+    rc = wifi_settings_remote_connected();
+    ASSERT(rc == 0);
     while(1) {
         if (!fake_lwip_loop()) {
             usleep(10000);
@@ -59,4 +145,3 @@ int main(int argc, char ** argv) {
     return 0;
 }
 
-
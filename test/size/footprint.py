@@ -0,0 +1,71 @@
+#
+# Copyright (c) 2025 Jack Whitham
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Footprint report for the pico-wifi-settings build profiles.
+# Builds the size test program for each profile and reports the
+# .text, .data and .bss sizes added by pico-wifi-settings, relative
+# to a program using the cyw43 driver and lwIP directly.
+#
+# Usage: python footprint.py [pico_w|pico2_w]
+#
+# Heap usage is not known until the program runs: the size test program
+# prints "Heap in use" after initialisation.
+#
+
+import subprocess
+import sys
+import tempfile
+import typing
+from pathlib import Path
+
+sys.path.append(str(Path(__file__).parent.parent))
+from release_tool import do_build
+
+# (name, test mode, cmake arguments)
+PROFILES: typing.List[typing.Tuple[str, str, typing.List[str]]] = [
+    ("basic", "basic", []),
+    ("basic_with_mbedtls", "basic_with_mbedtls", []),
+    ("connect_only_minimal", "wifi_settings",
+        ["-DWIFI_SETTINGS_REMOTE=0", "-DWIFI_SETTINGS_MINIMAL=1"]),
+    ("connect_only", "wifi_settings", ["-DWIFI_SETTINGS_REMOTE=0"]),
+    ("connect_remote_minimal", "wifi_settings",
+        ["-DWIFI_SETTINGS_REMOTE=1", "-DWIFI_SETTINGS_MINIMAL=1"]),
+    ("connect_remote", "wifi_settings", ["-DWIFI_SETTINGS_REMOTE=1"]),
+    ("full", "wifi_settings", ["-DWIFI_SETTINGS_REMOTE=2"]),
+]
+
+def get_section_sizes(elf_file: Path) -> typing.Tuple[int, int, int]:
+    # Berkeley format: text data bss dec hex filename
+    output = subprocess.run(["arm-none-eabi-size", "-B", str(elf_file)],
+                stdout=subprocess.PIPE, text=True, check=True).stdout
+    fields = output.splitlines()[1].split()
+    return (int(fields[0]), int(fields[1]), int(fields[2]))
+
+def main() -> None:
+    board = sys.argv[1] if len(sys.argv) > 1 else "pico2_w"
+    sizes: typing.Dict[str, typing.Tuple[int, int, int]] = {}
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        for (name, test_mode, cmake_args) in PROFILES:
+            elf_file = Path(tmp_dir) / f"size_test_{name}.elf"
+            do_build(src_dir="test/size",
+                     target_file=None,
+                     elf_file=elf_file,
+                     cmake_args=[f"-DPICO_BOARD={board}",
+                                 f"-DTEST_MODE={test_mode}"] + cmake_args)
+            sizes[name] = get_section_sizes(elf_file)
+
+    print(f"Footprint of pico-wifi-settings on {board} (bytes, relative to 'basic'):")
+    print("")
+    print("| Profile | .text | .data | .bss |")
+    print("|---|---|---|---|")
+    (base_text, base_data, base_bss) = sizes["basic"]
+    for (name, _, _) in PROFILES:
+        if name == "basic":
+            continue
+        (text, data, bss) = sizes[name]
+        print(f"| {name} | {text - base_text} | {data - base_data} | {bss - base_bss} |")
+
+if __name__ == "__main__":
+    main()
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <malloc.h>
 
 #include "pico/stdlib.h"
 #include "pico/bootrom.h"
@@ -144,6 +145,11 @@ int main() {
     tcp_accept(srv_pcb, server_accept);
 #endif
 
+    // Heap in use after initialisation (the difference between test modes
+    // is the heap footprint, as .bss does not include heap allocations)
+    const struct mallinfo heap_info = mallinfo();
+    printf("Heap in use: %u bytes\n", (unsigned) heap_info.uordblks);
+
     // Use basic functions that would be used in many programs
     char* x = calloc(1, size);
     if (!x) {
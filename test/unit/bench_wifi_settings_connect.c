@@ -0,0 +1,746 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Benchmark for wifi_settings_connect.c
+ *
+ * This runs the connection state machine under virtual time, against a
+ * simulated radio which follows a script for each scenario: the hotspots that
+ * a scan will find, the time taken to join them and to get an address by DHCP,
+ * failed joins and dropped links. For each scenario, it reports the time from
+ * wifi_settings_connect() to an IP address, the number of scans and joins, and
+ * the number of times that the state machine ran. Virtual time makes the results
+ * the same on every run, so a change in the connection time is a change in the
+ * state machine.
+ *
+ */
+
+#include "unit_test.h"
+#include "wifi_settings/wifi_settings_connect.h"
+#define WIFI_SETTINGS_CONNECT_C
+#include "wifi_settings/wifi_settings_connect_internal.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
+
+#include "pico/time.h"
+#include "pico/async_context.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Simulated radio: a scan reports the hotspots on each channel in turn
+#define NUM_CHANNELS            13
+#define SCAN_CHANNEL_TIME_MS    150
+#define SCAN_TIME_MS            (NUM_CHANNELS * SCAN_CHANNEL_TIME_MS)
+#define JOIN_NO_HOTSPOT_TIME_MS 3000    // time for a join to fail if the hotspot is absent
+#define DHCP_ADDRESS            0xc0a80064
+
+#define MAX_HOTSPOTS            4
+#define MAX_SETTINGS            12
+#define NEVER                   UINT32_MAX
+
+typedef enum {
+    JOIN_NONET,                 // the join fails with CYW43_LINK_NONET
+    JOIN_STALL,                 // the join never completes (so it times out)
+} join_failure_t;
+
+typedef struct sim_hotspot_t {
+    const char* ssid;
+    const char* password;       // NULL for an open hotspot
+    uint8_t bssid_last;         // last byte of the BSSID, the rest is zero
+    uint16_t channel;
+    int16_t rssi;
+    bool hidden;                // only found by a directed scan
+    uint32_t appear_ms;         // visible from this time
+    uint32_t disappear_ms;      // not visible from this time (0 = never)
+    uint32_t join_ms;           // time taken to join
+    uint32_t dhcp_ms;           // time taken to get an address after joining
+    uint num_failed_joins;      // the first joins fail...
+    join_failure_t failure;     // ... like this
+} sim_hotspot_t;
+
+typedef struct scenario_t {
+    const char* name;
+    const char* settings[MAX_SETTINGS];     // settings file as key=value, ends with NULL
+    sim_hotspot_t hotspots[MAX_HOTSPOTS];   // ends with ssid == NULL
+    uint32_t drop_ms;           // the link drops at this time (0 = never)
+    uint32_t duration_ms;
+    bool expect_ip;
+    bool expect_reconnect;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {
+        .name = "one",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "three",
+        .settings = {"ssid1=Office", "pass1=secret", "ssid2=Home", "pass2=secret",
+                     "ssid3=Phone", "pass3=secret", NULL},
+        .hotspots = {{.ssid = "Phone", .password = "secret", .bssid_last = 3, .channel = 1,
+                      .rssi = -40, .join_ms = 800, .dhcp_ms = 1500},
+                     {.ssid = "Home", .password = "secret", .bssid_last = 2, .channel = 6,
+                      .rssi = -60, .join_ms = 800, .dhcp_ms = 1500},
+                     {.ssid = "Office", .password = "secret", .bssid_last = 1, .channel = 11,
+                      .rssi = -70, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "late",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .appear_ms = 20000, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 120000, .expect_ip = true,
+    }, {
+        .name = "fails",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500,
+                      .num_failed_joins = 2, .failure = JOIN_NONET}},
+        .duration_ms = 120000, .expect_ip = true,
+    }, {
+        .name = "stall",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500,
+                      .num_failed_joins = 1, .failure = JOIN_STALL}},
+        .duration_ms = 120000, .expect_ip = true,
+    }, {
+        .name = "badauth",
+        .settings = {"ssid1=Home", "pass1=wrong", "ssid2=Phone", "pass2=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500},
+                     {.ssid = "Phone", .password = "secret", .bssid_last = 2, .channel = 11,
+                      .rssi = -70, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "slowdhcp",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 8000}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "staticip",
+        .settings = {"ssid1=Home", "pass1=secret", "ip1=192.168.0.2",
+                     "gw1=192.168.0.1", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "hidden",
+        .settings = {"ssid1=Home", "pass1=secret", "scan1=directed", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .hidden = true, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "open",
+        .settings = {"ssid1=Cafe", NULL},
+        .hotspots = {{.ssid = "Cafe", .bssid_last = 1, .channel = 1,
+                      .rssi = -65, .join_ms = 500, .dhcp_ms = 2500}},
+        .duration_ms = 60000, .expect_ip = true,
+    }, {
+        .name = "drop",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500}},
+        .drop_ms = 30000, .duration_ms = 120000, .expect_ip = true, .expect_reconnect = true,
+    }, {
+        .name = "moved",
+        .settings = {"ssid1=Home", "pass1=secret", "ssid2=Phone", "pass2=secret", NULL},
+        .hotspots = {{.ssid = "Home", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .disappear_ms = 30000, .join_ms = 800, .dhcp_ms = 1500},
+                     {.ssid = "Phone", .password = "secret", .bssid_last = 2, .channel = 11,
+                      .rssi = -70, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 120000, .expect_ip = true, .expect_reconnect = true,
+    }, {
+        .name = "absent",
+        .settings = {"ssid1=Home", "pass1=secret", NULL},
+        .hotspots = {{.ssid = "Neighbour", .password = "secret", .bssid_last = 1, .channel = 6,
+                      .rssi = -50, .join_ms = 800, .dhcp_ms = 1500}},
+        .duration_ms = 300000, .expect_ip = false,
+    },
+};
+
+typedef struct sim_result_t {
+    uint32_t ip_ms;             // time of the first IP address (NEVER if none)
+    uint32_t lost_ms;           // time the connection was first lost (NEVER if not)
+    uint32_t reconnect_ms;      // time of the next IP address (NEVER if none)
+    uint scans;                 // cyw43_wifi_scan calls before the first IP address
+    uint joins;                 // cyw43_wifi_join calls before the first IP address
+    uint rescans;               // cyw43_wifi_scan calls while reconnecting
+    uint rejoins;               // cyw43_wifi_join calls while reconnecting
+    uint wakeups;               // periodic and event worker runs before the first IP address
+} sim_result_t;
+
+static struct {
+    const scenario_t* scenario;
+    bool scan_active;
+    uint32_t scan_start_ms;
+    uint scan_next_channel;     // next channel to be reported by the scan
+    char scan_ssid[WIFI_SSID_SIZE]; // directed scan, or "" for a broadcast scan
+    int (*scan_callback)(void *, const cyw43_ev_scan_result_t *);
+    int link_status;
+    const sim_hotspot_t* hotspot;   // being joined, or joined
+    uint32_t join_done_ms;
+    int join_done_status;       // link status after joining
+    uint32_t dhcp_done_ms;
+    bool link_up;
+    bool dhcp_running;
+    bool dropped;
+    uint num_joins[MAX_HOTSPOTS];
+    ip4_addr_t ip_address;
+    ip4_addr_t netmask;
+    ip4_addr_t gateway;
+} radio;
+
+static absolute_time_t current_time = {0};
+static async_context_t async_context;
+static async_at_time_worker_t* current_worker = NULL;
+static async_when_pending_worker_t* current_event_worker = NULL;
+static netif_ext_callback_fn current_netif_callback = NULL;
+static sim_result_t result;
+
+cyw43_t cyw43_state;
+netif* netif_default;
+netif g_netif_default;
+extern struct wifi_state_t g_wifi_state;
+
+static bool is_visible(const sim_hotspot_t* hotspot) {
+    return (current_time.value >= hotspot->appear_ms)
+        && ((hotspot->disappear_ms == 0) || (current_time.value < hotspot->disappear_ms));
+}
+
+static void report_netif_change() {
+    if (current_netif_callback) {
+        current_netif_callback(&g_netif_default, 0, NULL);
+    }
+}
+
+static void link_down() {
+    // The connection (or connection attempt) ends. lwIP keeps a static address,
+    // but an address from DHCP is lost.
+    const bool was_up = radio.link_up;
+    radio.hotspot = NULL;
+    radio.link_up = false;
+    radio.join_done_ms = NEVER;
+    radio.dhcp_done_ms = NEVER;
+    if (radio.dhcp_running) {
+        radio.ip_address.addr = 0;
+    }
+    if (was_up) {
+        report_netif_change();
+    }
+}
+
+static void scan_channel(uint channel) {
+    // Report each hotspot found on the channel
+    for (uint i = 0; (i < MAX_HOTSPOTS) && radio.scenario->hotspots[i].ssid; i++) {
+        const sim_hotspot_t* hotspot = &radio.scenario->hotspots[i];
+        const bool directed = radio.scan_ssid[0] != '\0';
+        if ((hotspot->channel != channel)
+        || !is_visible(hotspot)
+        || (directed && (strcmp(radio.scan_ssid, hotspot->ssid) != 0))
+        || (hotspot->hidden && !directed)) {
+            continue;
+        }
+        cyw43_ev_scan_result_t scan_result;
+        memset(&scan_result, 0, sizeof(scan_result));
+        scan_result.ssid_len = (uint8_t) strlen(hotspot->ssid);
+        memcpy(scan_result.ssid, hotspot->ssid, scan_result.ssid_len);
+        scan_result.bssid[5] = hotspot->bssid_last;
+        scan_result.channel = hotspot->channel;
+        scan_result.rssi = hotspot->rssi;
+        radio.scan_callback(NULL, &scan_result);
+    }
+}
+
+static uint32_t get_radio_event_time() {
+    // Time of the next change in the simulated radio
+    uint32_t t = NEVER;
+    if (radio.scan_active) {
+        const uint32_t scan_time = radio.scan_start_ms + (radio.scan_next_channel * SCAN_CHANNEL_TIME_MS);
+        t = (scan_time < t) ? scan_time : t;
+    }
+    t = (radio.join_done_ms < t) ? radio.join_done_ms : t;
+    t = (radio.dhcp_done_ms < t) ? radio.dhcp_done_ms : t;
+    if (radio.link_up && radio.scenario->drop_ms && !radio.dropped) {
+        t = (radio.scenario->drop_ms < t) ? radio.scenario->drop_ms : t;
+    }
+    if (radio.hotspot && radio.hotspot->disappear_ms) {
+        t = (radio.hotspot->disappear_ms < t) ? radio.hotspot->disappear_ms : t;
+    }
+    return t;
+}
+
+static void run_radio() {
+    // Process everything that happens in the simulated radio at the current time
+    const uint32_t now = current_time.value;
+    while (radio.scan_active
+    && ((radio.scan_start_ms + (radio.scan_next_channel * SCAN_CHANNEL_TIME_MS)) <= now)) {
+        scan_channel(radio.scan_next_channel);
+        radio.scan_next_channel++;
+        if (radio.scan_next_channel > NUM_CHANNELS) {
+            // The end of the scan is not reported
+            radio.scan_active = false;
+        }
+    }
+    if (radio.join_done_ms <= now) {
+        radio.join_done_ms = NEVER;
+        radio.link_status = radio.join_done_status;
+        if (radio.link_status == CYW43_LINK_JOIN) {
+            radio.link_up = true;
+            if (radio.dhcp_running) {
+                radio.dhcp_done_ms = now + radio.hotspot->dhcp_ms;
+            }
+            report_netif_change();
+        } else {
+            radio.hotspot = NULL;
+        }
+    }
+    if (radio.dhcp_done_ms <= now) {
+        radio.dhcp_done_ms = NEVER;
+        radio.ip_address.addr = DHCP_ADDRESS;
+        report_netif_change();
+    }
+    if (radio.link_up
+    && ((radio.scenario->drop_ms && !radio.dropped && (radio.scenario->drop_ms <= now))
+        || !is_visible(radio.hotspot))) {
+        // Connection lost
+        radio.dropped = radio.dropped || (radio.scenario->drop_ms <= now);
+        radio.link_status = CYW43_LINK_DOWN;
+        link_down();
+    }
+}
+
+// Mock implementation of make_timeout_time_ms
+absolute_time_t make_timeout_time_ms(const uint32_t ms) {
+    return delayed_by_ms(current_time, ms);
+}
+
+// Mock implementation of delayed_by_ms
+absolute_time_t delayed_by_ms(const absolute_time_t t, const uint32_t ms) {
+    absolute_time_t t2;
+    t2.value = t.value + ms;
+    return t2;
+}
+
+// Mock implementation of get_absolute_time
+absolute_time_t get_absolute_time(void) {
+    return current_time;
+}
+
+// Mock implementation of to_ms_since_boot
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return t.value;
+}
+
+// Mock implementation of time_reached
+bool time_reached(const absolute_time_t t) {
+    return t.value <= current_time.value;
+}
+
+// Mock implementation of async_context_add_at_time_worker
+bool async_context_add_at_time_worker(async_context_t *context,
+        async_at_time_worker_t *worker) {
+    ASSERT(context == &async_context);
+    current_worker = worker;
+    return true;
+}
+
+// Mock implementation of async_context_remove_at_time_worker
+bool async_context_remove_at_time_worker(async_context_t *context,
+        async_at_time_worker_t *worker) {
+    ASSERT(current_worker == worker);
+    current_worker = NULL;
+    return true;
+}
+
+// Mock implementation of async_context_add_when_pending_worker
+bool async_context_add_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(context == &async_context);
+    current_event_worker = worker;
+    return true;
+}
+
+// Mock implementation of async_context_remove_when_pending_worker
+bool async_context_remove_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(current_event_worker == worker);
+    current_event_worker = NULL;
+    return true;
+}
+
+// Mock implementation of async_context_set_work_pending
+void async_context_set_work_pending(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(current_event_worker == worker);
+    worker->work_pending = true;
+}
+
+// Mock implementation of netif_add_ext_callback
+void netif_add_ext_callback(netif_ext_callback_t* callback, netif_ext_callback_fn fn) {
+    current_netif_callback = fn;
+}
+
+// Mock implementation of netif_remove_ext_callback
+void netif_remove_ext_callback(netif_ext_callback_t* callback) {
+    current_netif_callback = NULL;
+}
+
+// Mock implementation of cyw43_arch_lwip_begin
+void cyw43_arch_lwip_begin() {}
+
+// Mock implementation of cyw43_arch_lwip_end
+void cyw43_arch_lwip_end() {}
+
+// Mock implementation of cyw43_wifi_link_status
+int cyw43_wifi_link_status(cyw43_t *self, int itf) {
+    return radio.link_status;
+}
+
+// Mock implementation of cyw43_wifi_get_rssi
+int cyw43_wifi_get_rssi(cyw43_t *self, int32_t *rssi) {
+    *rssi = radio.hotspot ? radio.hotspot->rssi : 0;
+    return 0;
+}
+
+// Mock implementation of cyw43_wifi_pm
+int cyw43_wifi_pm(cyw43_t *self, uint32_t pm) {
+    return 0;
+}
+
+// Mock implementation of cyw43_wifi_scan_active
+bool cyw43_wifi_scan_active(cyw43_t *self) {
+    return radio.scan_active;
+}
+
+// Mock implementation of cyw43_wifi_join
+int cyw43_wifi_join(cyw43_t *self, size_t ssid_len, const uint8_t *ssid,
+        size_t key_len, const uint8_t *key, uint32_t auth_type,
+        const uint8_t *bssid, uint32_t channel) {
+    if (result.ip_ms == NEVER) {
+        result.joins++;
+    } else if (result.reconnect_ms == NEVER) {
+        result.rejoins++;
+    }
+    // Joining during a scan abandons the scan
+    radio.scan_active = false;
+    link_down();
+
+    // Which hotspot? If it's not visible, the join fails after a while
+    radio.link_status = CYW43_LINK_JOIN;
+    radio.join_done_ms = current_time.value + JOIN_NO_HOTSPOT_TIME_MS;
+    radio.join_done_status = CYW43_LINK_NONET;
+    for (uint i = 0; (i < MAX_HOTSPOTS) && radio.scenario->hotspots[i].ssid; i++) {
+        const sim_hotspot_t* hotspot = &radio.scenario->hotspots[i];
+        if ((!is_visible(hotspot))
+        || (ssid && ((ssid_len != strlen(hotspot->ssid)) || (memcmp(ssid, hotspot->ssid, ssid_len) != 0)))
+        || (!ssid && (bssid[5] != hotspot->bssid_last))) {
+            continue;
+        }
+        // Without a channel, the hardware must search for the hotspot
+        radio.hotspot = hotspot;
+        radio.join_done_ms = current_time.value + hotspot->join_ms
+            + ((channel == CYW43_CHANNEL_NONE) ? SCAN_TIME_MS : 0);
+        const char* password = hotspot->password ? hotspot->password : "";
+        if ((key_len != strlen(password)) || (memcmp(key, password, key_len) != 0)) {
+            radio.join_done_status = CYW43_LINK_BADAUTH;
+        } else if (radio.num_joins[i] < hotspot->num_failed_joins) {
+            radio.join_done_status = CYW43_LINK_NONET;
+            if (hotspot->failure == JOIN_STALL) {
+                radio.join_done_ms = NEVER;
+            }
+        } else {
+            radio.join_done_status = CYW43_LINK_JOIN;
+        }
+        radio.num_joins[i]++;
+        break;
+    }
+    return 0;
+}
+
+// Mock implementation of cyw43_wifi_leave
+int cyw43_wifi_leave(cyw43_t *self, int itf) {
+    radio.link_status = CYW43_LINK_DOWN;
+    link_down();
+    return 0;
+}
+
+// Mock implementation of cyw43_wifi_scan
+int cyw43_wifi_scan(cyw43_t *self, cyw43_wifi_scan_options_t *opts,
+        void *env,
+        int (*result_cb)(void *, const cyw43_ev_scan_result_t *)) {
+    if (radio.scan_active) {
+        return -1;
+    }
+    if (result.ip_ms == NEVER) {
+        result.scans++;
+    } else if (result.reconnect_ms == NEVER) {
+        result.rescans++;
+    }
+    ASSERT(opts->ssid_len < WIFI_SSID_SIZE);
+    memcpy(radio.scan_ssid, opts->ssid, opts->ssid_len);
+    radio.scan_ssid[opts->ssid_len] = '\0';
+    radio.scan_callback = result_cb;
+    radio.scan_active = true;
+    radio.scan_start_ms = current_time.value;
+    radio.scan_next_channel = 1;
+    return 0;
+}
+
+// Mock implementation of cyw43_arch_init_with_country
+int cyw43_arch_init_with_country(uint32_t country) {
+    return 0;
+}
+
+// Mock implementation of cyw43_arch_enable_sta_mode
+void cyw43_arch_enable_sta_mode(void) {
+    netif_default = &g_netif_default;
+}
+
+// Mock implementation of cyw43_arch_deinit
+void cyw43_arch_deinit(void) {}
+
+// Mock implementation of cyw43_arch_async_context
+async_context_t *cyw43_arch_async_context(void) {
+    return &async_context;
+}
+
+// Mock implementation of netif_is_link_up
+bool netif_is_link_up(struct netif *netif) {
+    return radio.link_up;
+}
+
+// Mock implementation of netif_set_hostname
+void netif_set_hostname(struct netif *netif, const char *) {}
+
+// Mock implementation of ip4addr_ntoa_r
+char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen) {
+    const uint32_t a = addr->addr;
+    snprintf(buf, buflen, "%u.%u.%u.%u",
+             (uint) (a >> 24), (uint) ((a >> 16) & 0xff), (uint) ((a >> 8) & 0xff), (uint) (a & 0xff));
+    return buf;
+}
+
+// Mock implementation of ip4addr_aton
+int ip4addr_aton(const char *cp, ip4_addr_t *addr) {
+    unsigned a, b, c, d;
+    char end;
+    if ((sscanf(cp, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4)
+    || (a > 255) || (b > 255) || (c > 255) || (d > 255)) {
+        return 0;
+    }
+    IP4_ADDR(addr, a, b, c, d);
+    return 1;
+}
+
+const ip4_addr_t ip4_addr_any = {0};
+
+// Mock implementation of netif_set_addr
+void netif_set_addr(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+        const ip4_addr_t *gw) {
+    radio.ip_address = *ipaddr;
+    radio.netmask = *netmask;
+    radio.gateway = *gw;
+}
+
+// Mock implementation of dhcp_start
+int dhcp_start(struct netif *netif) {
+    radio.dhcp_running = true;
+    return 0;
+}
+
+// Mock implementation of dhcp_stop
+void dhcp_stop(struct netif *netif) {
+    radio.dhcp_running = false;
+    radio.dhcp_done_ms = NEVER;
+}
+
+// Mock implementation of dns_setserver
+void dns_setserver(uint8_t numdns, const ip_addr_t *dnsserver) {}
+
+// Mock implementation of netif_ip4_addr
+const ip4_addr_t* netif_ip4_addr(struct netif *netif) {
+    return &radio.ip_address;
+}
+
+// Mock implementation of netif_ip4_netmask
+const ip4_addr_t* netif_ip4_netmask(struct netif *netif) {
+    return &radio.netmask;
+}
+
+// Mock implementation of netif_ip4_gw
+const ip4_addr_t* netif_ip4_gw(struct netif *netif) {
+    return &radio.gateway;
+}
+
+static const char* find_setting(const char* key, uint* value_size) {
+    const uint key_size = (uint) strlen(key);
+    for (uint i = 0; (i < MAX_SETTINGS) && radio.scenario->settings[i]; i++) {
+        const char* setting = radio.scenario->settings[i];
+        if ((strncmp(setting, key, key_size) == 0) && (setting[key_size] == '=')) {
+            *value_size = (uint) strlen(&setting[key_size + 1]);
+            return &setting[key_size + 1];
+        }
+    }
+    return NULL;
+}
+
+// Mock implementation of wifi_settings_get_value_for_key
+bool wifi_settings_get_value_for_key(
+            const char* key, char* value, uint* value_size) {
+    uint size = 0;
+    const char* found = find_setting(key, &size);
+    if (!found) {
+        return false;
+    }
+    if (*value_size > size) {
+        *value_size = size;
+    }
+    memcpy(value, found, *value_size);
+    return true;
+}
+
+// Mock implementation of wifi_settings_get_values_for_keys
+uint wifi_settings_get_values_for_keys(
+            wifi_settings_key_value_t* items, uint num_items) {
+    uint num_found = 0;
+    for (uint i = 0; i < num_items; i++) {
+        wifi_settings_key_value_t* item = &items[i];
+        item->found = wifi_settings_get_value_for_key(item->key, item->value, &item->value_size);
+        num_found += item->found ? 1 : 0;
+    }
+    return num_found;
+}
+
+// Mock implementation of wifi_settings_set_hostname
+void wifi_settings_set_hostname() {}
+
+// Mock implementation of wifi_settings_key_index_rebuild
+void wifi_settings_key_index_rebuild() {}
+
+// Mock implementation of wifi_settings_get_file_generation
+uint32_t wifi_settings_get_file_generation() {
+    return 1;
+}
+
+// Mock implementation of wifi_settings_add_file_change_subscriber
+void wifi_settings_add_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {}
+
+// Mock implementation of wifi_settings_remove_file_change_subscriber
+void wifi_settings_remove_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {}
+
+// Mock implementation of wifi_settings_get_hostname
+const char* wifi_settings_get_hostname() {
+    return "FakeHostname";
+}
+
+static void record_event(wifi_settings_event_t event, void* arg) {
+    const uint32_t now = current_time.value;
+    if (event == WIFI_SETTINGS_EVENT_IP_ACQUIRED) {
+        if (result.ip_ms == NEVER) {
+            result.ip_ms = now;
+        } else if ((result.lost_ms != NEVER) && (result.reconnect_ms == NEVER)) {
+            result.reconnect_ms = now;
+        }
+    } else if ((event == WIFI_SETTINGS_EVENT_LOST) && (result.lost_ms == NEVER)) {
+        result.lost_ms = now;
+    }
+}
+
+static void run_event_worker() {
+    // As async_context would, run the event worker until no more work is pending
+    for (uint i = 0; current_event_worker && current_event_worker->work_pending; i++) {
+        ASSERT(i < 100);
+        current_event_worker->work_pending = false;
+        current_event_worker->do_work(&async_context, current_event_worker);
+        if (result.ip_ms == NEVER) {
+            result.wakeups++;
+        }
+    }
+}
+
+static void run_scenario(const scenario_t* scenario) {
+    // Power on
+    memset(&radio, 0, sizeof(radio));
+    memset(&result, 0, sizeof(result));
+    memset(&g_wifi_state, 0, sizeof(g_wifi_state));
+    radio.scenario = scenario;
+    radio.link_status = CYW43_LINK_DOWN;
+    radio.dhcp_running = true;
+    radio.join_done_ms = radio.dhcp_done_ms = NEVER;
+    result.ip_ms = result.lost_ms = result.reconnect_ms = NEVER;
+    current_time.value = 0;
+    current_worker = NULL;
+    current_event_worker = NULL;
+
+    ASSERT(wifi_settings_init() == 0);
+    wifi_settings_set_event_callback(record_event, NULL);
+    wifi_settings_connect();
+
+    // Run until the end of the scenario, moving time forward to the next
+    // time that something happens
+    while (true) {
+        run_event_worker();
+        ASSERT(current_worker);
+        const uint32_t radio_time = get_radio_event_time();
+        const uint32_t worker_time = current_worker->next_time.value;
+        const uint32_t next_time = (radio_time < worker_time) ? radio_time : worker_time;
+        if (next_time > scenario->duration_ms) {
+            break;
+        }
+        ASSERT(next_time >= current_time.value);
+        current_time.value = next_time;
+        run_radio();
+        run_event_worker();
+        if (current_worker->next_time.value <= current_time.value) {
+            current_worker->do_work(&async_context, current_worker);
+            if (result.ip_ms == NEVER) {
+                result.wakeups++;
+            }
+        }
+    }
+    wifi_settings_deinit();
+
+    ASSERT((result.ip_ms != NEVER) == scenario->expect_ip);
+    ASSERT((result.reconnect_ms != NEVER) == scenario->expect_reconnect);
+}
+
+static void print_time(uint32_t t) {
+    if (t == NEVER) {
+        printf(" %9s", "-");
+    } else {
+        printf(" %9u", t);
+    }
+}
+
+int main() {
+    // "ip_ms" is the time from wifi_settings_connect() to the first IP address,
+    // "reconnect_ms" is the time from losing the connection to the next IP address.
+    // "wakeups" counts runs of the state machine before the first IP address.
+    printf("%-10s %9s %5s %5s %7s %12s %7s %7s\n",
+           "scenario", "ip_ms", "scans", "joins", "wakeups", "reconnect_ms", "rescans", "rejoins");
+    for (uint i = 0; i < NUM_ELEMENTS(scenarios); i++) {
+        const scenario_t* scenario = &scenarios[i];
+        run_scenario(scenario);
+        printf("%-10s", scenario->name);
+        print_time(result.ip_ms);
+        printf(" %5u %5u %7u   ", result.scans, result.joins, result.wakeups);
+        if (result.reconnect_ms == NEVER) {
+            print_time(NEVER);
+        } else {
+            print_time(result.reconnect_ms - result.lost_ms);
+        }
+        printf(" %7u %7u\n", result.rescans, result.rejoins);
+    }
+    return 0;
+}
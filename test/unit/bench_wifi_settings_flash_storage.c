@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Benchmark for wifi_settings_flash_storage.c
+ *
+ * This times lookups in synthetic settings files of various sizes and layouts,
+ * with a linear scan of the file, with the key index, and with a single scan
+ * for several keys (wifi_settings_get_values_for_keys). Run with --quick
+ * to check that the benchmark works (as a unit test) without timing anything
+ * accurately.
+ *
+ */
+
+#include "unit_test.h"
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+#include "hardware/flash.h"
+#include "pico/cyw43_arch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_FILE_SIZE           0x10000
+#define TARGET_KEY              "target"
+#define TARGET_VALUE            "found"
+#define NUM_BATCH_ITEMS         4
+
+static char file[MAX_FILE_SIZE];
+static uint file_size = MAX_FILE_SIZE;
+static uint contents_size = 0;
+static uint64_t min_time_ns = 50000000;
+
+typedef enum {
+    POSITION_START,
+    POSITION_MIDDLE,
+    POSITION_END,
+    POSITION_MISSING,
+    NUM_POSITIONS,
+} position_t;
+
+typedef enum {
+    FILLER_KEYS,
+    FILLER_COMMENTS,
+    NUM_FILLERS,
+} filler_t;
+
+typedef enum {
+    MODE_SCAN,
+    MODE_INDEX,
+    MODE_BATCH,
+    NUM_MODES,
+} lookup_mode_t;
+
+static const char* const position_names[NUM_POSITIONS] = {"start", "middle", "end", "missing"};
+static const char* const filler_names[NUM_FILLERS] = {"keys", "comments"};
+static const char* const mode_names[NUM_MODES] = {"scan", "index", "batch"};
+static const uint file_sizes[] = {0x1000, 0x4000, 0x10000};
+
+static uint64_t get_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t) ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+// Fill the file with lines of the given type, with the target key at the given position.
+// Return the number of bytes that a linear scan reads to find the target key
+// (the end of its line), or the size of the file contents (contents_size) if it is missing.
+static uint make_file(uint size, filler_t filler, position_t position) {
+    const char* target_line = TARGET_KEY "=" TARGET_VALUE "\n";
+    const uint target_line_size = (uint) strlen(target_line);
+    uint target_offset = size;
+    switch (position) {
+        case POSITION_START:    target_offset = 0; break;
+        case POSITION_MIDDLE:   target_offset = size / 2; break;
+        default:                break;
+    }
+
+    memset(file, '\xff', sizeof(file));
+    uint offset = 0;
+    uint scan_size = 0;
+    uint line_number = 0;
+    while (true) {
+        char line[160];
+        // At the end: the target is the last line, before a filler line would no longer fit
+        const bool is_target = (scan_size == 0)
+            && ((offset >= target_offset)
+                || ((position == POSITION_END) && ((offset + sizeof(line) + target_line_size) > size)));
+        if (is_target) {
+            snprintf(line, sizeof(line), "%s", target_line);
+        } else if (filler == FILLER_KEYS) {
+            snprintf(line, sizeof(line), "key%05u=value for key number %05u\n",
+                     line_number, line_number);
+            line_number++;
+        } else {
+            snprintf(line, sizeof(line), "# This is a long comment about the settings, "
+                     "which might explain what the following keys are for. %05u\n",
+                     line_number);
+            line_number++;
+        }
+        const uint line_size = (uint) strlen(line);
+        if ((offset + line_size) > size) {
+            break;
+        }
+        memcpy(&file[offset], line, line_size);
+        offset += line_size;
+        if (is_target) {
+            scan_size = offset;
+        }
+    }
+    file_size = size;
+    contents_size = offset;
+    return (position == POSITION_MISSING) ? offset : scan_size;
+}
+
+static bool lookup(lookup_mode_t mode) {
+    char value[32];
+    uint value_size = sizeof(value);
+    if (mode != MODE_BATCH) {
+        return wifi_settings_get_value_for_key(TARGET_KEY, value, &value_size);
+    }
+    // Batch: the target key plus some that are missing, so the whole file is scanned
+    char values[NUM_BATCH_ITEMS][32];
+    wifi_settings_key_value_t items[NUM_BATCH_ITEMS] = {
+        {TARGET_KEY, values[0], sizeof(values[0]), false},
+        {"missing1", values[1], sizeof(values[1]), false},
+        {"missing2", values[2], sizeof(values[2]), false},
+        {"missing3", values[3], sizeof(values[3]), false},
+    };
+    wifi_settings_get_values_for_keys(items, NUM_BATCH_ITEMS);
+    return items[0].found;
+}
+
+static void run_case(uint size, filler_t filler, position_t position, lookup_mode_t mode) {
+    const uint scan_size = make_file(size, filler, position);
+    if (mode == MODE_INDEX) {
+        wifi_settings_key_index_rebuild();
+    } else {
+        wifi_settings_key_index_invalidate();
+    }
+
+    // Check the result, then repeat until enough time has passed
+    const bool found = lookup(mode);
+    ASSERT(found == (position != POSITION_MISSING));
+    uint64_t num_lookups = 0;
+    uint64_t batch_size = 1;
+    const uint64_t start_time = get_time_ns();
+    uint64_t elapsed_ns = 0;
+    do {
+        for (uint64_t i = 0; i < batch_size; i++) {
+            lookup(mode);
+        }
+        num_lookups += batch_size;
+        batch_size *= 2;
+        elapsed_ns = get_time_ns() - start_time;
+    } while (elapsed_ns < min_time_ns);
+
+    const uint keys_per_lookup = (mode == MODE_BATCH) ? NUM_BATCH_ITEMS : 1;
+    const double ns_per_key = ((double) elapsed_ns) / (double) (num_lookups * keys_per_lookup);
+    const uint bytes_scanned = ((mode == MODE_BATCH) ? contents_size : scan_size);
+    printf("%6u %-9s %-8s %-6s %12.1f %8u ",
+           size, filler_names[filler], position_names[position], mode_names[mode],
+           ns_per_key, bytes_scanned);
+    if (mode == MODE_INDEX) {
+        // The file is not scanned unless the index is full
+        printf("%10s\n", "-");
+    } else {
+        printf("%10.1f\n", (((double) bytes_scanned) * num_lookups * 1000.0) / (double) elapsed_ns);
+    }
+}
+
+int main(int argc, char** argv) {
+    if ((argc > 1) && (strcmp(argv[1], "--quick") == 0)) {
+        min_time_ns = 0;
+    }
+
+    // "bytes" is the number of bytes that a linear scan reads for each lookup:
+    // the key index or a binary file may read much less.
+    printf("%6s %-9s %-8s %-6s %12s %8s %10s\n",
+           "size", "filler", "key", "mode", "ns/key", "bytes", "MB/s");
+    for (uint i = 0; i < NUM_ELEMENTS(file_sizes); i++) {
+        for (filler_t filler = 0; filler < NUM_FILLERS; filler++) {
+            for (position_t position = 0; position < NUM_POSITIONS; position++) {
+                for (lookup_mode_t mode = 0; mode < NUM_MODES; mode++) {
+                    run_case(file_sizes[i], filler, position, mode);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Mock implementation of wifi_settings_range_get_wifi_settings_file
+void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r) {
+    r->start_address = 0x1234;
+    r->size = file_size;
+}
+
+// Mock implementation of wifi_settings_range_translate_to_logical
+void wifi_settings_range_translate_to_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    ASSERT(fr->start_address == 0x1234);
+    lr->start_address = file;
+    lr->size = fr->size;
+}
+
+// Mock implementation of wifi_settings_range_translate_to_uncached_logical
+void wifi_settings_range_translate_to_uncached_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    wifi_settings_range_translate_to_logical(fr, lr);
+}
+
+// Mock implementation of cyw43_arch_async_context (cyw43_arch is initialised)
+async_context_t *cyw43_arch_async_context(void) {
+    static async_context_t context;
+    return &context;
+}
+
+// Mock implementation of cyw43_arch_lwip_begin
+void cyw43_arch_lwip_begin() {}
+
+// Mock implementation of cyw43_arch_lwip_end
+void cyw43_arch_lwip_end() {}
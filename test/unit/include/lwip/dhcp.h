@@ -0,0 +1,13 @@
+#ifndef LWIP_DHCP_H
+#define LWIP_DHCP_H
+
+#ifndef UNIT_TEST
+#error "THIS IS A MOCK HEADER FOR UNIT TESTING ONLY"
+#endif
+
+#include "pico/cyw43_arch.h"
+
+int dhcp_start(struct netif *netif);
+void dhcp_stop(struct netif *netif);
+
+#endif
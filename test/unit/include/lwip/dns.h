@@ -0,0 +1,14 @@
+#ifndef LWIP_DNS_H
+#define LWIP_DNS_H
+
+#ifndef UNIT_TEST
+#error "THIS IS A MOCK HEADER FOR UNIT TESTING ONLY"
+#endif
+
+#include "pico/cyw43_arch.h"
+
+#define LWIP_DNS 1
+
+void dns_setserver(uint8_t numdns, const ip_addr_t *dnsserver);
+
+#endif
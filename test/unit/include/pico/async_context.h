@@ -16,10 +16,21 @@ typedef struct async_work_on_timeout {
     void (*do_work)(async_context_t *context, struct async_work_on_timeout *timeout);
 } async_at_time_worker_t;
 
+typedef struct async_when_pending_worker {
+    void (*do_work)(async_context_t *context, struct async_when_pending_worker *worker);
+    bool work_pending;
+} async_when_pending_worker_t;
+
 bool async_context_add_at_time_worker(async_context_t *context,
         async_at_time_worker_t *worker);
 bool async_context_remove_at_time_worker(async_context_t *context,
         async_at_time_worker_t *worker);
+bool async_context_add_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker);
+bool async_context_remove_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker);
+void async_context_set_work_pending(async_context_t *context,
+        async_when_pending_worker_t *worker);
 
 
 
@@ -19,15 +19,40 @@ typedef struct netif {
 typedef struct ip4_addr_t{
     uint32_t addr;
 } ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+    ((ipaddr)->addr = ((uint32_t) (a) << 24) | ((uint32_t) (b) << 16) | ((uint32_t) (c) << 8) | (uint32_t) (d))
+#define ip4_addr_set_zero(ipaddr) ((ipaddr)->addr = 0)
+#define ip4_addr_get_u32(src_ipaddr) ((src_ipaddr)->addr)
+#define ip4_addr_set_u32(dest_ipaddr, src_u32) ((dest_ipaddr)->addr = (src_u32))
+#define ipaddr_aton ip4addr_aton
+extern const ip4_addr_t ip4_addr_any;
+#define IP4_ADDR_ANY4 (&ip4_addr_any)
 typedef struct cyw43_ev_scan_result_t{
     uint8_t bssid[6];
     uint8_t ssid[32];
     uint8_t ssid_len;
+    uint16_t channel;
+    int16_t rssi;
+    uint8_t auth_mode;
 } cyw43_ev_scan_result_t;
 typedef struct cyw43_wifi_scan_options_t {
-    int nothing;
+    uint32_t ssid_len;
+    uint8_t ssid[32];
 } cyw43_wifi_scan_options_t;
 
+#define LWIP_NETIF_EXT_STATUS_CALLBACK 1
+typedef uint16_t netif_nsc_reason_t;
+typedef union netif_ext_callback_args_t {
+    int nothing;
+} netif_ext_callback_args_t;
+typedef void (*netif_ext_callback_fn)(struct netif* netif, netif_nsc_reason_t reason,
+        const netif_ext_callback_args_t* args);
+typedef struct netif_ext_callback {
+    netif_ext_callback_fn callback_fn;
+} netif_ext_callback_t;
+#define NETIF_DECLARE_EXT_CALLBACK(name) static netif_ext_callback_t name;
+
 extern cyw43_t cyw43_state;
 extern netif* netif_default;
 
@@ -43,6 +68,9 @@ extern netif* netif_default;
 #define CYW43_AUTH_OPEN 1009        // unit testing value only
 #define CYW43_CHANNEL_NONE 1010     // unit testing value only
 #define PICO_CYW43_ARCH_DEFAULT_COUNTRY_CODE 1011
+#define CYW43_DEFAULT_PM 1015       // unit testing value only
+#define CYW43_NONE_PM 1016          // unit testing value only
+#define CYW43_AGGRESSIVE_PM 1017    // unit testing value only
 #define MY_IP_ADDRESS 1012
 #define MY_NETMASK 1013
 #define MY_GATEWAY 1014
@@ -53,6 +81,7 @@ void cyw43_arch_lwip_end();
 int cyw43_wifi_link_status(cyw43_t *self, int itf);
 int cyw43_wifi_get_rssi(cyw43_t *self, int32_t *rssi);
 int cyw43_wifi_leave(cyw43_t *self, int itf);
+int cyw43_wifi_pm(cyw43_t *self, uint32_t pm);
 bool cyw43_wifi_scan_active(cyw43_t *self);
 int cyw43_wifi_join(cyw43_t *self, size_t ssid_len,
         const uint8_t *ssid, size_t key_len,
@@ -68,8 +97,13 @@ async_context_t *cyw43_arch_async_context(void);
 bool netif_is_link_up(struct netif *netif);
 void netif_set_hostname(struct netif *netif, const char *hostname);
 char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen);
+int ip4addr_aton(const char *cp, ip4_addr_t *addr);
+void netif_set_addr(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+        const ip4_addr_t *gw);
 const ip4_addr_t* netif_ip4_addr(struct netif *netif);
 const ip4_addr_t* netif_ip4_netmask(struct netif *netif);
 const ip4_addr_t* netif_ip4_gw(struct netif *netif);
+void netif_add_ext_callback(netif_ext_callback_t* callback, netif_ext_callback_fn fn);
+void netif_remove_ext_callback(netif_ext_callback_t* callback);
 
 #endif
@@ -10,4 +10,5 @@
 #define PICO_ERROR_GENERIC -101
 #define PICO_ERROR_INVALID_DATA -102
 #define PICO_ERROR_INVALID_ARG -103
+#define PICO_ERROR_INSUFFICIENT_RESOURCES -104
 #endif
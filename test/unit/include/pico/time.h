@@ -15,5 +15,8 @@ typedef struct absolute_time_t {
 absolute_time_t make_timeout_time_ms(const uint32_t ms);
 absolute_time_t delayed_by_ms(const absolute_time_t t, const uint32_t ms);
 bool time_reached(const absolute_time_t t);
+absolute_time_t get_absolute_time(void);
+uint32_t to_ms_since_boot(absolute_time_t t);
+uint32_t time_us_32(void);
 
 #endif
@@ -11,10 +11,13 @@
 #include "wifi_settings/wifi_settings_connect.h"
 #define WIFI_SETTINGS_CONNECT_C
 #include "wifi_settings/wifi_settings_connect_internal.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
 
 #include "pico/time.h"
 #include "pico/async_context.h"
 #include "pico/cyw43_arch.h"
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -42,6 +45,9 @@ typedef struct key_value_item_t {
 
 static absolute_time_t current_time = {0};
 static async_at_time_worker_t *current_worker = NULL;
+static async_when_pending_worker_t *current_event_worker = NULL;
+static netif_ext_callback_fn current_netif_callback = NULL;
+static uint32_t calls_to_set_work_pending;
 static int current_link_status = CYW43_LINK_DOWN;
 static async_context_t async_context;
 static int (*scan_callback)(void *, const cyw43_ev_scan_result_t *);
@@ -53,11 +59,23 @@ static uint32_t calls_to_is_link_up;
 static uint32_t calls_to_cyw43_wifi_leave;
 static uint32_t calls_to_cyw43_wifi_scan_active;
 static uint32_t calls_to_netif_ip4_addr;
+static uint32_t calls_to_get_value_for_key;
+static uint32_t current_file_generation;
 static key_value_item_t key_value_items[MAX_NUM_SSIDS * 2];
 static bool cyw43_arch_lwip_lock = false;
 static char connected_ssid[WIFI_SSID_SIZE];
 static char connected_bssid[WIFI_BSSID_SIZE];
 static char connected_password[WIFI_PASSWORD_SIZE];
+static uint32_t connected_channel;
+static char scan_ssid[WIFI_SSID_SIZE];
+static uint32_t calls_to_cyw43_wifi_scan;
+static bool dhcp_running;
+static bool scan_while_connected;
+static int32_t current_rssi;
+static uint32_t current_pm;
+static uint calls_to_cyw43_wifi_pm;
+static int cyw43_wifi_pm_error;
+static ip_addr_t current_dns_server;
 static char text_buffer[1000];
 
 cyw43_t cyw43_state;
@@ -77,6 +95,16 @@ absolute_time_t delayed_by_ms(const absolute_time_t t, const uint32_t ms) {
     return t2;
 }
 
+// Mock implementation of get_absolute_time
+absolute_time_t get_absolute_time(void) {
+    return current_time;
+}
+
+// Mock implementation of to_ms_since_boot
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return t.value;
+}
+
 // Mock implementation of time_reached
 bool time_reached(const absolute_time_t t) {
     return t.value <= current_time.value;
@@ -85,12 +113,17 @@ bool time_reached(const absolute_time_t t) {
 // Mock implementation of async_context_add_at_time_worker
 bool async_context_add_at_time_worker(async_context_t *context,
         async_at_time_worker_t *worker) {
-    if (mock_state == MS_PARTIAL_INIT_2) {
-        // Being called from wifi_settings_init
-        mock_state = MS_DOWN;
+    if (mock_state == MS_PARTIAL_INIT_1) {
+        // Being called from wifi_settings_init_async
         ASSERT(context == &async_context);
         ASSERT(!current_worker);
         current_worker = worker;
+    } else if (mock_state == MS_PARTIAL_INIT_2) {
+        // Being called from wifi_settings_init (or wifi_settings_init_callback)
+        mock_state = MS_DOWN;
+        ASSERT(context == &async_context);
+        ASSERT((!current_worker) || (current_worker == worker));
+        current_worker = worker;
     } else {
         // Being called from periodic task
         ASSERT((mock_state == MS_DOWN)
@@ -114,6 +147,50 @@ bool async_context_remove_at_time_worker(async_context_t *context,
     return true;
 }
 
+// Mock implementation of async_context_add_when_pending_worker
+bool async_context_add_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(context == &async_context);
+    ASSERT(!current_event_worker);
+    ASSERT(worker->do_work);
+    current_event_worker = worker;
+    return true;
+}
+
+// Mock implementation of async_context_remove_when_pending_worker
+bool async_context_remove_when_pending_worker(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(context == &async_context);
+    ASSERT(current_event_worker);
+    ASSERT(current_event_worker == worker);
+    current_event_worker = NULL;
+    return true;
+}
+
+// Mock implementation of async_context_set_work_pending
+void async_context_set_work_pending(async_context_t *context,
+        async_when_pending_worker_t *worker) {
+    ASSERT(context == &async_context);
+    ASSERT(current_event_worker);
+    ASSERT(current_event_worker == worker);
+    calls_to_set_work_pending++;
+    worker->work_pending = true;
+}
+
+// Mock implementation of netif_add_ext_callback
+void netif_add_ext_callback(netif_ext_callback_t* callback, netif_ext_callback_fn fn) {
+    ASSERT(callback);
+    ASSERT(!current_netif_callback);
+    current_netif_callback = fn;
+}
+
+// Mock implementation of netif_remove_ext_callback
+void netif_remove_ext_callback(netif_ext_callback_t* callback) {
+    ASSERT(callback);
+    ASSERT(current_netif_callback);
+    current_netif_callback = NULL;
+}
+
 // Mock implementation of cyw43_arch_lwip_begin
 void cyw43_arch_lwip_begin() {
     ASSERT(!cyw43_arch_lwip_lock);
@@ -138,15 +215,25 @@ int cyw43_wifi_link_status(cyw43_t *self, int itf) {
 // Mock implementation of cyw43_wifi_get_rssi
 int cyw43_wifi_get_rssi(cyw43_t *self, int32_t *rssi) {
     ASSERT(self == &cyw43_state);
-    *rssi = -1;
+    *rssi = current_rssi;
     return 0;
 }
 
+// Mock implementation of cyw43_wifi_pm
+int cyw43_wifi_pm(cyw43_t *self, uint32_t pm) {
+    ASSERT(self == &cyw43_state);
+    ASSERT(mock_state != MS_START);
+    ASSERT(mock_state != MS_PARTIAL_INIT_1);
+    current_pm = pm;
+    calls_to_cyw43_wifi_pm++;
+    return cyw43_wifi_pm_error;
+}
+
 // Mock implementation of cyw43_wifi_scan_active
 bool cyw43_wifi_scan_active(cyw43_t *self) {
     ASSERT(self == &cyw43_state);
     calls_to_cyw43_wifi_scan_active++;
-    return mock_state == MS_SCANNING;
+    return (mock_state == MS_SCANNING) || scan_while_connected;
 }
 
 // Mock implementation of cyw43_wifi_join
@@ -155,16 +242,18 @@ int cyw43_wifi_join(cyw43_t *self, size_t ssid_len, const uint8_t *ssid,
         const uint8_t *bssid, uint32_t channel) {
     ASSERT(self == &cyw43_state);
     if (ssid) {
-        ASSERT(!bssid);
         ASSERT(ssid_len < WIFI_SSID_SIZE);
-        memset(connected_bssid, 0, WIFI_BSSID_SIZE);
         memcpy(connected_ssid, ssid, ssid_len);
         connected_ssid[ssid_len] = '\0';
     } else {
         ASSERT(bssid);
         ASSERT(ssid_len == 0);
         memset(connected_ssid, 0, WIFI_SSID_SIZE);
+    }
+    if (bssid) {
         memcpy(connected_bssid, bssid, WIFI_BSSID_SIZE);
+    } else {
+        memset(connected_bssid, 0, WIFI_BSSID_SIZE);
     }
     ASSERT(key_len < WIFI_PASSWORD_SIZE);
     ASSERT(key);
@@ -174,8 +263,9 @@ int cyw43_wifi_join(cyw43_t *self, size_t ssid_len, const uint8_t *ssid,
     } else {
         ASSERT(auth_type == CYW43_AUTH_WPA2_AES_PSK);
     }
-    ASSERT(channel == CYW43_CHANNEL_NONE);
-    ASSERT(mock_state == MS_DOWN);
+    // Joining is possible during a scan: the scan is abandoned
+    ASSERT((mock_state == MS_DOWN) || (mock_state == MS_SCANNING));
+    connected_channel = channel;
     memcpy(connected_password, key, key_len);
     connected_password[key_len] = '\0';
     mock_state = MS_JOIN;
@@ -188,9 +278,12 @@ int cyw43_wifi_leave(cyw43_t *self, int itf) {
     ASSERT(itf == CYW43_ITF_STA);
     ASSERT((mock_state == MS_JOIN)
             || (mock_state == MS_UP)
-            || (mock_state == MS_DOWN));
+            || (mock_state == MS_DOWN)
+            || (mock_state == MS_SCANNING));
     calls_to_cyw43_wifi_leave++;
-    mock_state = MS_DOWN;
+    if (mock_state != MS_SCANNING) {
+        mock_state = MS_DOWN;
+    }
     return 0;
 }
 
@@ -202,9 +295,19 @@ int cyw43_wifi_scan(cyw43_t *self, cyw43_wifi_scan_options_t *opts,
     ASSERT(self == &cyw43_state);
     ASSERT(opts);
     ASSERT(!env);
-    ASSERT(mock_state == MS_DOWN);
+    ASSERT((mock_state == MS_DOWN) || (mock_state == MS_UP));
     ASSERT(!scan_callback);
-    mock_state = MS_SCANNING;
+    ASSERT(!scan_while_connected);
+    ASSERT(opts->ssid_len < WIFI_SSID_SIZE);
+    memcpy(scan_ssid, opts->ssid, opts->ssid_len);
+    scan_ssid[opts->ssid_len] = '\0';
+    calls_to_cyw43_wifi_scan++;
+    if (mock_state == MS_UP) {
+        // Scanning while connected does not affect the connection
+        scan_while_connected = true;
+    } else {
+        mock_state = MS_SCANNING;
+    }
     scan_callback = result_cb;
     return 0;
 }
@@ -235,7 +338,7 @@ void cyw43_arch_deinit(void) {
 
 // Mock implementation of cyw43_arch_async_context
 async_context_t *cyw43_arch_async_context(void) {
-    ASSERT(mock_state == MS_PARTIAL_INIT_2);
+    ASSERT(mock_state == MS_PARTIAL_INIT_1);
     return &async_context;
 }
 
@@ -259,6 +362,50 @@ char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen) {
     return buf;
 }
 
+// Mock implementation of ip4addr_aton
+int ip4addr_aton(const char *cp, ip4_addr_t *addr) {
+    unsigned a, b, c, d;
+    char end;
+    if ((sscanf(cp, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4)
+    || (a > 255) || (b > 255) || (c > 255) || (d > 255)) {
+        return 0;
+    }
+    IP4_ADDR(addr, a, b, c, d);
+    return 1;
+}
+
+const ip4_addr_t ip4_addr_any = {0};
+
+// Mock implementation of netif_set_addr
+void netif_set_addr(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+        const ip4_addr_t *gw) {
+    ASSERT(netif);
+    ASSERT(netif == &g_netif_default);
+    current_ip_address = *ipaddr;
+    current_netmask = *netmask;
+    current_gateway = *gw;
+}
+
+// Mock implementation of dhcp_start
+int dhcp_start(struct netif *netif) {
+    ASSERT(netif == &g_netif_default);
+    ASSERT(!dhcp_running);
+    dhcp_running = true;
+    return 0;
+}
+
+// Mock implementation of dhcp_stop
+void dhcp_stop(struct netif *netif) {
+    ASSERT(netif == &g_netif_default);
+    dhcp_running = false;
+}
+
+// Mock implementation of dns_setserver
+void dns_setserver(uint8_t numdns, const ip_addr_t *dnsserver) {
+    ASSERT(numdns == 0);
+    current_dns_server = *dnsserver;
+}
+
 // Mock implementation of netif_ip4_addr
 const ip4_addr_t* netif_ip4_addr(struct netif *netif) {
     ASSERT(netif);
@@ -284,6 +431,7 @@ const ip4_addr_t* netif_ip4_gw(struct netif *netif) {
 // Mock implementation of wifi_settings_get_value_for_key
 bool wifi_settings_get_value_for_key(
             const char* key, char* value, uint* value_size) {
+    calls_to_get_value_for_key++;
     for (uint i = 0; i < NUM_ELEMENTS(key_value_items); i++) {
         key_value_item_t* item = &key_value_items[i];
         if (strcmp(item->key, key) == 0) {
@@ -297,9 +445,54 @@ bool wifi_settings_get_value_for_key(
     return false;
 }
 
+// Mock implementation of wifi_settings_get_values_for_keys
+uint wifi_settings_get_values_for_keys(
+            wifi_settings_key_value_t* items, uint num_items) {
+    // One search of the file finds all of the keys
+    calls_to_get_value_for_key++;
+    uint num_found = 0;
+    for (uint i = 0; i < num_items; i++) {
+        wifi_settings_key_value_t* item = &items[i];
+        item->found = false;
+        for (uint j = 0; j < NUM_ELEMENTS(key_value_items); j++) {
+            key_value_item_t* kv = &key_value_items[j];
+            if (strcmp(kv->key, item->key) == 0) {
+                if (item->value_size > kv->value_size) {
+                    item->value_size = kv->value_size;
+                }
+                memcpy(item->value, kv->value, item->value_size);
+                item->found = true;
+                num_found++;
+                break;
+            }
+        }
+    }
+    return num_found;
+}
+
 // Mock implementation of wifi_settings_set_hostname
 void wifi_settings_set_hostname() {}
 
+// Mock implementation of wifi_settings_key_index_rebuild
+void wifi_settings_key_index_rebuild() {}
+
+// Mock implementation of wifi_settings_get_file_generation
+uint32_t wifi_settings_get_file_generation() {
+    return current_file_generation;
+}
+
+// Mock implementation of wifi_settings_add_file_change_subscriber
+void wifi_settings_add_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {
+    ASSERT(subscriber->callback);
+}
+
+// Mock implementation of wifi_settings_remove_file_change_subscriber
+void wifi_settings_remove_file_change_subscriber(
+            wifi_settings_file_change_subscriber_t* subscriber) {
+    ASSERT(subscriber->callback);
+}
+
 // Mock implementation of wifi_settings_get_hostname
 const char* wifi_settings_get_hostname() {
     return "FakeHostname";
@@ -307,6 +500,7 @@ const char* wifi_settings_get_hostname() {
 
 void set_value_for_key(const char* key, const char* value) {
     uint value_size = strlen(value);
+    current_file_generation++;
     ASSERT(value_size <= sizeof(key_value_items[0].value));
     ASSERT(strlen(key) < sizeof(key_value_items[0].key));
 
@@ -335,15 +529,22 @@ void set_value_for_key(const char* key, const char* value) {
 // Reset calls_to... variables
 void reset_calls_to() {
     calls_to_cyw43_wifi_leave = 0;
+    calls_to_cyw43_wifi_scan = 0;
     calls_to_cyw43_wifi_scan_active = 0;
     calls_to_is_link_up = 0;
     calls_to_netif_ip4_addr = 0;
+    calls_to_get_value_for_key = 0;
+    calls_to_set_work_pending = 0;
+    calls_to_cyw43_wifi_pm = 0;
+    cyw43_wifi_pm_error = 0;
 }
 
 // Reset everything
 void reset_all() {
     current_time.value = 0;
     current_worker = NULL;
+    current_event_worker = NULL;
+    current_netif_callback = NULL;
     current_link_status = CYW43_LINK_DOWN;
     scan_callback = NULL;
     current_ip_address.addr = 0;
@@ -355,10 +556,16 @@ void reset_all() {
     memset(key_value_items, 0, sizeof(key_value_items));
     memset(&g_netif_default, 0, sizeof(g_netif_default));
     country_code = 0;
+    dhcp_running = true;
+    current_dns_server.addr = 0;
+    scan_while_connected = false;
+    current_rssi = -1;
+    current_pm = 0;
     reset_calls_to();
     memset(connected_ssid, 0, sizeof(connected_ssid));
     memset(connected_bssid, 0, sizeof(connected_bssid));
     memset(connected_password, 0, sizeof(connected_password));
+    connected_channel = 0;
     memset(text_buffer, TEXT_BUFFER_FILL_BYTE, sizeof(text_buffer));
     text_buffer[sizeof(text_buffer) - 1] = '\0';
     mock_state = MS_START;
@@ -366,6 +573,16 @@ void reset_all() {
 }
 
 
+#define MAX_RECORDED_EVENTS 10
+static wifi_settings_event_t recorded_events[MAX_RECORDED_EVENTS];
+static uint num_recorded_events;
+
+static void record_event(wifi_settings_event_t event, void* arg) {
+    ASSERT(arg == &num_recorded_events);
+    ASSERT(num_recorded_events < MAX_RECORDED_EVENTS);
+    recorded_events[num_recorded_events++] = event;
+}
+
 void test_wifi_settings_init() {
     // GIVEN uninitialised state
     reset_all();
@@ -589,6 +806,79 @@ void step_state_machine() {
     ASSERT(current_worker->next_time.value > previous_next_time); // Check that time advanced
 }
 
+void test_wifi_settings_init_async() {
+    // GIVEN uninitialised state
+    reset_all();
+    // WHEN wifi_settings_init_async() is called
+    int ret = wifi_settings_init_async();
+    // THEN it returns without starting the hardware
+    ASSERT(ret == 0);
+    ASSERT(mock_state == MS_PARTIAL_INIT_1);
+    ASSERT(g_wifi_state.cstate == INITIALISING);
+    ASSERT(g_wifi_state.context == &async_context);
+    ASSERT(current_worker);
+    ASSERT(current_event_worker);
+    wifi_settings_get_connect_status_text(text_buffer, sizeof(text_buffer));
+    ASSERT(strcmp(text_buffer, "WiFi hardware is starting") == 0);
+    ASSERT(wifi_settings_get_hw_status_text(text_buffer, sizeof(text_buffer)) == 0);
+
+    // WHEN wifi_settings_init_async() is called again
+    ret = wifi_settings_init_async();
+    // THEN return is non-zero
+    ASSERT(ret != 0);
+
+    // WHEN wifi_settings_connect() is called, and then the async_context runs
+    num_recorded_events = 0;
+    wifi_settings_set_event_callback(record_event, &num_recorded_events);
+    wifi_settings_connect();
+    ASSERT(g_wifi_state.cstate == INITIALISING);
+    step_state_machine();
+    // THEN the hardware is started, completion is reported, and the connection begins
+    ASSERT(mock_state == MS_DOWN);
+    ASSERT(num_recorded_events == 1);
+    ASSERT(recorded_events[0] == WIFI_SETTINGS_EVENT_INITIALISED);
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(current_event_worker->work_pending);
+    ASSERT(g_wifi_state.periodic_worker.next_time.value == INITIAL_SETUP_TIME_MS);
+    ASSERT(g_wifi_state.periodic_worker.do_work != NULL);
+
+    // GIVEN an event callback set before wifi_settings_init_async() is called
+    reset_all();
+    num_recorded_events = 0;
+    wifi_settings_set_event_callback(record_event, &num_recorded_events);
+    ret = wifi_settings_init_async();
+    ASSERT(ret == 0);
+    // WHEN the async_context runs
+    step_state_machine();
+    // THEN completion is reported to the callback
+    ASSERT(num_recorded_events == 1);
+    ASSERT(recorded_events[0] == WIFI_SETTINGS_EVENT_INITIALISED);
+
+    // GIVEN wifi_settings_init_async() was called
+    reset_all();
+    ret = wifi_settings_init_async();
+    ASSERT(ret == 0);
+    // WHEN wifi_settings_connect() and wifi_settings_disconnect() are called,
+    // and then the async_context runs
+    wifi_settings_connect();
+    wifi_settings_disconnect();
+    ASSERT(g_wifi_state.cstate == INITIALISING);
+    step_state_machine();
+    // THEN the hardware is started, but there is no connection
+    ASSERT(mock_state == MS_DOWN);
+    ASSERT(g_wifi_state.cstate == DISCONNECTED);
+
+    // GIVEN cyw43_arch_init_with_country fails
+    reset_all();
+    mock_state = MS_INIT_FAILS;
+    // WHEN wifi_settings_init_async() is called
+    ret = wifi_settings_init_async();
+    // THEN return is non-zero and state is INITIALISATION_ERROR
+    ASSERT(ret != 0);
+    ASSERT(g_wifi_state.cstate == INITIALISATION_ERROR);
+    ASSERT(!current_worker);
+}
+
 void test_wifi_storage_empty_state() {
     // GIVEN the TRY_TO_CONNECT state without any wifi hotspots
     reset_for_state_machine_test();
@@ -603,10 +893,23 @@ void test_wifi_storage_empty_state() {
 
     // GIVEN the STORAGE_EMPTY_ERROR state without any wifi hotspots
     // WHEN stepping through the state machine
+    calls_to_get_value_for_key = 0;
+    step_state_machine();
+
+    // THEN stay in STORAGE_EMPTY_ERROR state, without searching the unchanged file
+    ASSERT(g_wifi_state.cstate == STORAGE_EMPTY_ERROR);
+    ASSERT(calls_to_get_value_for_key == 0);
+
+    // GIVEN the STORAGE_EMPTY_ERROR state, and the file changed without adding a hotspot
+    set_value_for_key("name", "x");
+
+    // WHEN stepping through the state machine twice
+    step_state_machine();
     step_state_machine();
 
-    // THEN stay in STORAGE_EMPTY_ERROR state
+    // THEN stay in STORAGE_EMPTY_ERROR state, and the file was searched once
     ASSERT(g_wifi_state.cstate == STORAGE_EMPTY_ERROR);
+    ASSERT(calls_to_get_value_for_key == 1);
 
     // GIVEN the STORAGE_EMPTY_ERROR state with a wifi hotspot
     create_ssids(1);
@@ -654,7 +957,7 @@ void reach_connecting_state() {
     ASSERT(scan_callback);
 
     // GIVEN the SCANNING state, with nothing found
-    ASSERT(g_wifi_state.ssid_scan_info[5] == NOT_FOUND);
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == NOT_FOUND);
     ASSERT(strcmp(wifi_settings_get_ssid_status(5), "NOT FOUND") == 0);
     // WHEN a known SSID is found
     cyw43_ev_scan_result_t scan_result;
@@ -663,30 +966,38 @@ void reach_connecting_state() {
     scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
     scan_callback(NULL, &scan_result);
     // THEN SSID marked as found
-    ASSERT(g_wifi_state.ssid_scan_info[5] == FOUND);
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == FOUND);
     ASSERT(strcmp(wifi_settings_get_ssid_status(5), "FOUND") == 0);
 
     // GIVEN the SCANNING state
-    ASSERT(g_wifi_state.ssid_scan_info[3] == NOT_FOUND);
+    ASSERT(g_wifi_state.ssid_match[3].scan_info == NOT_FOUND);
     // WHEN a known SSID is found
+    reset_calls_to();
     strcpy((char*)scan_result.ssid, "SSID_3");
     scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_result.bssid[5] = 3;
+    scan_result.channel = 11;
     scan_callback(NULL, &scan_result);
-    // THEN SSID marked as found
-    ASSERT(g_wifi_state.ssid_scan_info[3] == FOUND);
+    // THEN SSID marked as found, after confirming the match with the file
+    // (bssid3 and ssid3, with one search)
+    ASSERT(g_wifi_state.ssid_match[3].scan_info == FOUND);
+    ASSERT(calls_to_get_value_for_key == 1);
 
     // GIVEN the SCANNING state
     // WHEN an unknown SSID is found
+    reset_calls_to();
     memset(&scan_result, 0, sizeof(scan_result));
     strcpy((char*)scan_result.ssid, "Hello");
     scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
     scan_callback(NULL, &scan_result);
+    // THEN the file is not searched
+    ASSERT(calls_to_get_value_for_key == 0);
     // THEN no change in the SSID set - only 3 and 5 were found
     for (uint i = 0; i <= MAX_NUM_SSIDS; i++) {
         if ((i == 3) || (i == 5)) {
-            ASSERT(g_wifi_state.ssid_scan_info[i] == FOUND);
+            ASSERT(g_wifi_state.ssid_match[i].scan_info == FOUND);
         } else {
-            ASSERT(g_wifi_state.ssid_scan_info[i] == NOT_FOUND);
+            ASSERT(g_wifi_state.ssid_match[i].scan_info == NOT_FOUND);
         }
     }
     ASSERT(g_wifi_state.cstate == SCANNING);
@@ -698,14 +1009,16 @@ void reach_connecting_state() {
     step_state_machine();
     // THEN begin_connecting() is called, state changes to CONNECTING,
     // disconnection is forced, connection begins to SSID_3 (highest priority of those found)
+    // using the BSSID and channel where SSID_3 was found
     ASSERT(calls_to_cyw43_wifi_scan_active == 1);   // one final check of whether scan was active
     ASSERT(calls_to_cyw43_wifi_leave == 1);         // disconnection is forced
     ASSERT(g_wifi_state.cstate == CONNECTING);
     ASSERT(strcmp(connected_ssid, "SSID_3") == 0);  // cyw43_wifi_join called
-    ASSERT(connected_bssid[0] == '\0');
+    ASSERT(memcmp(connected_bssid, "\0\0\0\0\0\3", WIFI_BSSID_SIZE) == 0);
+    ASSERT(connected_channel == 11);
     ASSERT(strcmp(connected_password, "PASSWORD_3") == 0);
     ASSERT(g_wifi_state.selected_ssid_index == 3);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT); // connection attempt begun
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT); // connection attempt begun
     reset_calls_to();
 }
 
@@ -718,7 +1031,7 @@ void test_wifi_connecting_state() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as FAILED
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == FAILED);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
     // GIVEN connecting state, but link status is NONET
@@ -729,7 +1042,7 @@ void test_wifi_connecting_state() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as FAILED
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == FAILED);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
     // GIVEN connecting state, but link status is FAIL
@@ -740,7 +1053,7 @@ void test_wifi_connecting_state() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as FAILED
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == FAILED);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
     // GIVEN connecting state, but link status is BADAUTH
@@ -751,7 +1064,7 @@ void test_wifi_connecting_state() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as BADAUTH
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == BADAUTH);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == BADAUTH);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
     // GIVEN connecting state, and link status is JOIN
@@ -765,7 +1078,7 @@ void test_wifi_connecting_state() {
     // THEN netif_is_link_up is called (but returns false) and there is no state change
     ASSERT(calls_to_is_link_up == 1);
     ASSERT(g_wifi_state.cstate == CONNECTING);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
 
     // GIVEN connecting state, and link status is JOIN, but the timeout is reached
     reach_connecting_state();
@@ -777,7 +1090,7 @@ void test_wifi_connecting_state() {
 
     // THEN state changes to SCANNING and the SSID is marked as TIMEOUT
     ASSERT(calls_to_is_link_up == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == TIMEOUT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == TIMEOUT);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
     // GIVEN connecting state, and link status is JOIN, and network link is up
@@ -792,7 +1105,7 @@ void test_wifi_connecting_state() {
     // so there is no state change
     ASSERT(calls_to_is_link_up == 1);
     ASSERT(calls_to_netif_ip4_addr == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
     ASSERT(g_wifi_state.cstate == CONNECTING);
 }
 
@@ -810,7 +1123,7 @@ void reach_connected_ip_state() {
     // so the state changes to CONNECTED_IP
     ASSERT(calls_to_is_link_up == 1);
     ASSERT(calls_to_netif_ip4_addr == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == SUCCESS);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == SUCCESS);
     ASSERT(g_wifi_state.cstate == CONNECTED_IP);
     reset_calls_to();
 }
@@ -839,7 +1152,7 @@ void test_wifi_connected_ip_state() {
     // so the IP address is lost and the state changes to TRY_TO_CONNECT
     ASSERT(calls_to_is_link_up == 1);
     ASSERT(calls_to_netif_ip4_addr == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == LOST);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == LOST);
     ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
 
     // GIVEN connected_ip state, and connection is not stable, because the network link goes down
@@ -853,7 +1166,7 @@ void test_wifi_connected_ip_state() {
     // so the IP address is lost and the state changes to TRY_TO_CONNECT
     ASSERT(calls_to_is_link_up == 1);
     ASSERT(calls_to_netif_ip4_addr == 0); // never called as netif_is_link_up is first
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == LOST);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == LOST);
     ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
 }
 
@@ -870,7 +1183,7 @@ void test_wifi_connecting_state_when_lost() {
     // The true purpose of entering this state is not to scan for more hotspots
     // but to revisit the existing list of known hotspots and pick another one
     ASSERT(g_wifi_state.selected_ssid_index == 3);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == FAILED);
 
     // GIVEN scanning state
     ASSERT(g_wifi_state.cstate == SCANNING);
@@ -885,7 +1198,7 @@ void test_wifi_connecting_state_when_lost() {
     ASSERT(calls_to_cyw43_wifi_scan_active == 1);
     ASSERT(g_wifi_state.cstate == CONNECTING);
     ASSERT(g_wifi_state.selected_ssid_index == 5);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
 
     // GIVEN connecting state and SSID join in progress
     current_link_status = CYW43_LINK_JOIN;
@@ -895,7 +1208,7 @@ void test_wifi_connecting_state_when_lost() {
 
     // THEN no state change
     ASSERT(g_wifi_state.selected_ssid_index == 5);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
     ASSERT(g_wifi_state.cstate == CONNECTING);
 
     // GIVEN connecting state and SSID join in progress
@@ -906,7 +1219,7 @@ void test_wifi_connecting_state_when_lost() {
 
     // THEN no state change
     ASSERT(g_wifi_state.selected_ssid_index == 5);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
     ASSERT(g_wifi_state.cstate == CONNECTING);
 
     // GIVEN connecting state and SSID join failed
@@ -918,7 +1231,7 @@ void test_wifi_connecting_state_when_lost() {
 
     // THEN state changes to SCANNING and the SSID is marked as FAILED - again
     ASSERT(g_wifi_state.selected_ssid_index == 5);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == FAILED);
 
     // GIVEN scanning state
     ASSERT(g_wifi_state.cstate == SCANNING);
@@ -936,9 +1249,9 @@ void test_wifi_connecting_state_when_lost() {
     ASSERT(g_wifi_state.selected_ssid_index == 0);
     for (uint i = 0; i <= MAX_NUM_SSIDS; i++) {
         if ((i == 3) || (i == 5)) {
-            ASSERT(g_wifi_state.ssid_scan_info[i] == FAILED);
+            ASSERT(g_wifi_state.ssid_match[i].scan_info == FAILED);
         } else {
-            ASSERT(g_wifi_state.ssid_scan_info[i] == NOT_FOUND);
+            ASSERT(g_wifi_state.ssid_match[i].scan_info == NOT_FOUND);
         }
     }
 }
@@ -951,9 +1264,9 @@ void test_wifi_connecting_state_when_ssid_details_are_forgotten() {
     mock_state = MS_DOWN;
     step_state_machine();
     ASSERT(g_wifi_state.cstate == SCANNING);
-    ASSERT(g_wifi_state.ssid_scan_info[3] == FAILED);   // Just lost connection to this
+    ASSERT(g_wifi_state.ssid_match[3].scan_info == FAILED);   // Just lost connection to this
     ASSERT(strcmp(wifi_settings_get_ssid_status(3), "FAILED") == 0);
-    ASSERT(g_wifi_state.ssid_scan_info[5] == FOUND);    // Ready for connection
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == FOUND);    // Ready for connection
     ASSERT(strcmp(wifi_settings_get_ssid_status(5), "FOUND") == 0);
     memset(key_value_items, 0, sizeof(key_value_items)); // All SSID details are forgotten!
 
@@ -962,7 +1275,7 @@ void test_wifi_connecting_state_when_ssid_details_are_forgotten() {
 
     // THEN the next state is TRY_TO_CONNECT, because the SSID_5 details were lost
     ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
-    ASSERT(g_wifi_state.ssid_scan_info[5] == ATTEMPT); // Connection attempt was abandoned
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == ATTEMPT); // Connection attempt was abandoned
     ASSERT(strcmp(wifi_settings_get_ssid_status(5), "ATTEMPT") == 0);
     ASSERT(g_wifi_state.selected_ssid_index == 0);
 }
@@ -995,15 +1308,16 @@ void test_wifi_connecting_with_bssid() {
     cyw43_ev_scan_result_t scan_result;
     memset(&scan_result, 0, sizeof(scan_result));
     scan_result.bssid[5] = 1; // bssid1 (00:00:00:00:00:01)
+    scan_result.channel = 6;
     scan_callback(NULL, &scan_result);
     // THEN SSID marked as found
-    ASSERT(g_wifi_state.ssid_scan_info[1] == FOUND);
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == FOUND);
     ASSERT(strcmp(wifi_settings_get_ssid_status(1), "FOUND") == 0);
 
     // GIVEN the SCANNING state with bssid2 not found
     ASSERT(g_wifi_state.cstate == SCANNING);
     ASSERT(scan_callback);
-    ASSERT(g_wifi_state.ssid_scan_info[2] == NOT_FOUND);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == NOT_FOUND);
     // WHEN known SSID_2 is found, but the BSSID is also listed and is different
     memset(&scan_result, 0, sizeof(scan_result));
     scan_result.bssid[5] = 0x99; // unknown BSSID (00:00:00:00:00:99)
@@ -1011,12 +1325,12 @@ void test_wifi_connecting_with_bssid() {
     scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
     scan_callback(NULL, &scan_result);
     // THEN ssid2 is still not marked as found, as the BSSID check takes priority
-    ASSERT(g_wifi_state.ssid_scan_info[2] == NOT_FOUND);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == NOT_FOUND);
 
     // GIVEN the SCANNING state with bssid2 not found
     ASSERT(g_wifi_state.cstate == SCANNING);
     ASSERT(scan_callback);
-    ASSERT(g_wifi_state.ssid_scan_info[2] == NOT_FOUND);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == NOT_FOUND);
     // WHEN unknown SSID is found, but the BSSID is bssid2
     memset(&scan_result, 0, sizeof(scan_result));
     scan_result.bssid[5] = 2; // bssid2 (00:00:00:00:00:02)
@@ -1024,7 +1338,7 @@ void test_wifi_connecting_with_bssid() {
     scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
     scan_callback(NULL, &scan_result);
     // THEN bssid2 is marked as found
-    ASSERT(g_wifi_state.ssid_scan_info[2] == FOUND);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == FOUND);
 
     // GIVEN that scanning ends
     mock_state = MS_DOWN;
@@ -1035,9 +1349,10 @@ void test_wifi_connecting_with_bssid() {
     ASSERT(g_wifi_state.cstate == CONNECTING);
     ASSERT(strcmp(connected_ssid, "") == 0);  // No SSID is known (or used)
     ASSERT(memcmp("\x00\x00\x00\x00\x00\x01", connected_bssid, WIFI_BSSID_SIZE) == 0); // bssid1
+    ASSERT(connected_channel == 6); // channel where bssid1 was found
     ASSERT(strcmp(connected_password, "PASSWORD_1") == 0);
     ASSERT(g_wifi_state.selected_ssid_index == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[g_wifi_state.selected_ssid_index] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[g_wifi_state.selected_ssid_index].scan_info == ATTEMPT);
     ASSERT(mock_state == MS_JOIN);
 
     // GIVEN connecting state, connection fails
@@ -1048,7 +1363,7 @@ void test_wifi_connecting_with_bssid() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as FAILED
-    ASSERT(g_wifi_state.ssid_scan_info[1] == FAILED);
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == FAILED);
     ASSERT(strcmp(wifi_settings_get_ssid_status(1), "FAILED") == 0);
 
     // GIVEN scanning state
@@ -1061,7 +1376,7 @@ void test_wifi_connecting_with_bssid() {
     // to bssid2
     ASSERT(g_wifi_state.cstate == CONNECTING);
     ASSERT(g_wifi_state.selected_ssid_index == 2);
-    ASSERT(g_wifi_state.ssid_scan_info[2] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == ATTEMPT);
     ASSERT(strcmp(wifi_settings_get_ssid_status(2), "ATTEMPT") == 0);
     ASSERT(memcmp("\x00\x00\x00\x00\x00\x02", connected_bssid, WIFI_BSSID_SIZE) == 0); // bssid2
     ASSERT(strcmp(connected_ssid, "") == 0);  // SSID_2 is not used for the connection attempt
@@ -1092,6 +1407,7 @@ void test_wifi_connecting_with_open_hotspot() {
     ASSERT(g_wifi_state.cstate == CONNECTING);
     ASSERT(strcmp(connected_ssid, "SSID_1") == 0);
     ASSERT(strcmp(connected_password, "") == 0);
+    ASSERT(connected_channel == CYW43_CHANNEL_NONE); // channel was not reported by the scan
     ASSERT(g_wifi_state.selected_ssid_index == 1);
     ASSERT(mock_state == MS_JOIN);
 }
@@ -1130,10 +1446,10 @@ void test_wifi_connecting_with_multiple_passwords_for_ssid() {
     ASSERT(strcmp(connected_ssid, "SSID_X") == 0);
     ASSERT(strcmp(connected_password, "PASSWORD_1") == 0);
     ASSERT(g_wifi_state.selected_ssid_index == 1);
-    ASSERT(g_wifi_state.ssid_scan_info[1] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == ATTEMPT);
     ASSERT(strcmp(wifi_settings_get_ssid_status(1), "ATTEMPT") == 0);
     for (uint i = 2; i <= MAX_NUM_SSIDS; i++) {
-        ASSERT(g_wifi_state.ssid_scan_info[i] == FOUND);
+        ASSERT(g_wifi_state.ssid_match[i].scan_info == FOUND);
         ASSERT(strcmp(wifi_settings_get_ssid_status(i), "FOUND") == 0);
     }
 
@@ -1144,7 +1460,7 @@ void test_wifi_connecting_with_multiple_passwords_for_ssid() {
     step_state_machine();
 
     // THEN state changes to SCANNING and the SSID is marked as BADAUTH
-    ASSERT(g_wifi_state.ssid_scan_info[1] == BADAUTH);
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == BADAUTH);
     ASSERT(strcmp(wifi_settings_get_ssid_status(1), "BADAUTH") == 0);
     ASSERT(g_wifi_state.cstate == SCANNING);
 
@@ -1159,7 +1475,7 @@ void test_wifi_connecting_with_multiple_passwords_for_ssid() {
     ASSERT(strcmp(connected_ssid, "SSID_X") == 0);
     ASSERT(strcmp(connected_password, "PASSWORD_2") == 0);
     ASSERT(g_wifi_state.selected_ssid_index == 2);
-    ASSERT(g_wifi_state.ssid_scan_info[2] == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[2].scan_info == ATTEMPT);
     ASSERT(strcmp(wifi_settings_get_ssid_status(2), "ATTEMPT") == 0);
 }
 
@@ -1338,6 +1654,75 @@ void test_wifi_settings_get_ip_status_text() {
     ASSERT(strstr(text_buffer, "IPv4 address = 0.0.0.1"));
 }
 
+void test_wifi_settings_get_status() {
+    wifi_settings_status_t status;
+
+    // GIVEN uninitialised state
+    reset_all();
+    // WHEN wifi_settings_get_status is called
+    wifi_settings_get_status(&status);
+    // THEN nothing is known
+    ASSERT(status.state == UNINITIALISED);
+    ASSERT(!status.link_up);
+    ASSERT(!status.scan_active);
+    ASSERT(status.ssid_index == 0);
+    ASSERT(status.rssi == -1);
+    ASSERT(status.ipv4_address == 0);
+
+    // GIVEN scanning state
+    reset_for_state_machine_test();
+    create_ssids(1);
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    // WHEN wifi_settings_get_status is called
+    wifi_settings_get_status(&status);
+    // THEN the scan is reported
+    ASSERT(status.state == SCANNING);
+    ASSERT(status.scan_active);
+    ASSERT(status.link_status == CYW43_LINK_DOWN);
+    ASSERT(status.ssid_index == 0);
+
+    // GIVEN connected IP state, and the periodic callback has read the signal strength
+    reach_connected_ip_state();
+    current_rssi = -55;
+    IP4_ADDR(&current_netmask, 255, 255, 255, 0);
+    IP4_ADDR(&current_gateway, 192, 168, 0, 1);
+    step_state_machine();
+    const uint32_t rssi_time_ms = current_time.value;
+    // WHEN wifi_settings_get_status is called
+    wifi_settings_get_status(&status);
+    // THEN the connection details are reported
+    ASSERT(status.state == CONNECTED_IP);
+    ASSERT(status.link_up);
+    ASSERT(!status.scan_active);
+    ASSERT(status.ssid_index == (int) g_wifi_state.selected_ssid_index);
+    ASSERT(status.ssid_index != 0);
+    ASSERT(status.channel == g_wifi_state.selected_channel);
+    ASSERT(status.link_status == CYW43_LINK_JOIN);
+    ASSERT(status.rssi == -55);
+    ASSERT(status.rssi_time_ms == rssi_time_ms);
+    ASSERT(status.hw_error_code == 0);
+    ASSERT(status.ipv4_address == 1);
+    ASSERT(status.ipv4_netmask == current_netmask.addr);
+    ASSERT(status.ipv4_gateway == current_gateway.addr);
+
+    // GIVEN the signal strength changes
+    current_rssi = -70;
+    // WHEN wifi_settings_get_status is called
+    wifi_settings_get_status(&status);
+    // THEN the previous reading is reported
+    ASSERT(status.rssi == -55);
+    ASSERT(status.rssi_time_ms == rssi_time_ms);
+    // WHEN the periodic callback runs after HW_STATUS_CACHE_TIME_MS
+    while (current_time.value < (rssi_time_ms + HW_STATUS_CACHE_TIME_MS)) {
+        step_state_machine();
+    }
+    wifi_settings_get_status(&status);
+    // THEN the new reading is reported
+    ASSERT(status.rssi == -70);
+    ASSERT(status.rssi_time_ms == current_time.value);
+}
+
 void test_wifi_settings_has_no_wifi_details() {
     bool ret;
 
@@ -1361,8 +1746,1038 @@ void test_wifi_settings_has_no_wifi_details() {
     ASSERT(!ret);
 }
 
+void test_wifi_fast_reconnect() {
+    // GIVEN connected_ip state, and connection is lost
+    reach_connected_ip_state();
+    ASSERT(g_wifi_state.last_ssid_index == 3);
+    ASSERT(g_wifi_state.fast_reconnect_pending);
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+
+    // WHEN periodic callback runs
+    scan_callback = NULL;
+    step_state_machine();
+
+    // THEN a connection to the same hotspot begins immediately, without scanning,
+    // using the BSSID and channel found by the previous scan
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(!scan_callback);
+    ASSERT(mock_state == MS_JOIN);
+    ASSERT(g_wifi_state.selected_ssid_index == 3);
+    ASSERT(g_wifi_state.ssid_match[3].scan_info == ATTEMPT);
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == NOT_FOUND);
+    ASSERT(strcmp(connected_ssid, "SSID_3") == 0);
+    ASSERT(memcmp(connected_bssid, "\0\0\0\0\0\3", WIFI_BSSID_SIZE) == 0);
+    ASSERT(connected_channel == 11);
+    ASSERT(strcmp(connected_password, "PASSWORD_3") == 0);
+    ASSERT(!g_wifi_state.fast_reconnect_pending);
+
+    // GIVEN the fast reconnection, and the connection succeeds
+    mock_state = MS_UP;
+    current_link_status = CYW43_LINK_JOIN;
+    // WHEN periodic callback runs
+    step_state_machine();
+    // THEN the state is CONNECTED_IP and the hotspot is remembered for next time
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    ASSERT(g_wifi_state.last_ssid_index == 3);
+    ASSERT(g_wifi_state.last_channel == 11);
+    ASSERT(g_wifi_state.fast_reconnect_pending);
+
+    // GIVEN the connection is lost again, and the fast reconnection fails
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_NONET;
+    // WHEN periodic callback runs
+    step_state_machine();
+    // THEN the hotspot is marked as FAILED and forgotten
+    ASSERT(g_wifi_state.ssid_match[3].scan_info == FAILED);
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(g_wifi_state.last_ssid_index == 0);
+    ASSERT(!g_wifi_state.fast_reconnect_pending);
+
+    // WHEN periodic callback runs
+    step_state_machine();
+    // THEN there are no other hotspots to try, so the state is TRY_TO_CONNECT
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+
+    // WHEN periodic callback runs until the scan holdoff time is reached
+    for (uint i = 0; (i < 10) && (g_wifi_state.cstate == TRY_TO_CONNECT); i++) {
+        step_state_machine();
+    }
+    // THEN a new scan begins
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(scan_callback);
+    ASSERT(mock_state == MS_SCANNING);
+}
+
+void scan_three_hotspots_and_connect() {
+    // Scan finds SSID_1 (weak), SSID_2 (strong, and also a weaker access point)
+    // and SSID_3 (medium), then connection begins
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(scan_callback);
+    const char* ssids[] = {"SSID_1", "SSID_2", "SSID_2", "SSID_3"};
+    const int16_t rssi[] = {-88, -45, -70, -60};
+    for (uint i = 0; i < NUM_ELEMENTS(ssids); i++) {
+        cyw43_ev_scan_result_t scan_result;
+        memset(&scan_result, 0, sizeof(scan_result));
+        strcpy((char*)scan_result.ssid, ssids[i]);
+        scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+        scan_result.bssid[5] = (uint8_t) (i + 1);
+        scan_result.channel = (uint16_t) (i + 1);
+        scan_result.rssi = rssi[i];
+        scan_callback(NULL, &scan_result);
+    }
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(mock_state == MS_JOIN);
+}
+
+void test_wifi_hotspot_selection() {
+    // GIVEN three hotspots and no selection policy
+    reset_for_state_machine_test();
+    create_ssids(3);
+    // WHEN the scan finds all three
+    scan_three_hotspots_and_connect();
+    // THEN the lowest-numbered hotspot is chosen, regardless of signal strength
+    ASSERT(g_wifi_state.selected_ssid_index == 1);
+    ASSERT(strcmp(connected_ssid, "SSID_1") == 0);
+
+    // GIVEN three hotspots, and the strongest signal is preferred
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("select", "rssi");
+    // WHEN the scan finds all three
+    scan_three_hotspots_and_connect();
+    // THEN the strongest hotspot is chosen, using the strongest access point
+    ASSERT(g_wifi_state.selected_ssid_index == 2);
+    ASSERT(strcmp(connected_ssid, "SSID_2") == 0);
+    ASSERT(memcmp(connected_bssid, "\0\0\0\0\0\2", WIFI_BSSID_SIZE) == 0);
+    ASSERT(connected_channel == 2);
+
+    // GIVEN three hotspots, the strongest signal is preferred, but ssid3 has a higher priority
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("select", "rssi");
+    set_value_for_key("prio3", "1");
+    // WHEN the scan finds all three
+    scan_three_hotspots_and_connect();
+    // THEN the higher priority hotspot is chosen
+    ASSERT(g_wifi_state.selected_ssid_index == 3);
+    ASSERT(strcmp(connected_ssid, "SSID_3") == 0);
+
+    // GIVEN three hotspots, without a selection policy, but ssid1 has a lower priority
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("prio1", "-1");
+    // WHEN the scan finds all three
+    scan_three_hotspots_and_connect();
+    // THEN the lowest-numbered hotspot with the highest priority is chosen
+    ASSERT(g_wifi_state.selected_ssid_index == 2);
+    ASSERT(strcmp(connected_ssid, "SSID_2") == 0);
+}
+
+void run_event_worker() {
+    // Run the event worker, if work is pending, as async_context would
+    ASSERT(current_event_worker);
+    ASSERT(current_event_worker->do_work);
+    if (current_event_worker->work_pending) {
+        current_event_worker->work_pending = false;
+        current_event_worker->do_work(&async_context, current_event_worker);
+    }
+}
+
+uint64_t scan_and_find_nothing() {
+    // Wait for a scan to begin, then end it without any results.
+    // Returns the time when the scan began.
+    scan_callback = NULL;
+    for (uint i = 0; (i < 1000) && (g_wifi_state.cstate == TRY_TO_CONNECT); i++) {
+        step_state_machine();
+    }
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(scan_callback);
+    const uint64_t scan_start_time = current_time.value;
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    return scan_start_time;
+}
+
+void test_wifi_scan_backoff() {
+    // GIVEN one hotspot which is never found
+    reset_for_state_machine_test();
+    create_ssids(1);
+    // WHEN scans repeatedly find nothing
+    // THEN the time between scans doubles each time, up to the maximum
+    uint64_t previous_scan_start_time = scan_and_find_nothing();
+    uint32_t expect_time_ms = REPEAT_SCAN_TIME_MS;
+    for (uint i = 0; i < 10; i++) {
+        const uint64_t scan_start_time = scan_and_find_nothing();
+        ASSERT(scan_start_time >= (previous_scan_start_time + expect_time_ms));
+        ASSERT(scan_start_time < (previous_scan_start_time + expect_time_ms + PERIODIC_TIME_MS));
+        previous_scan_start_time = scan_start_time;
+        expect_time_ms *= 2;
+        if (expect_time_ms > MAX_REPEAT_SCAN_TIME_MS) {
+            expect_time_ms = MAX_REPEAT_SCAN_TIME_MS;
+        }
+    }
+    ASSERT(g_wifi_state.scan_backoff_time_ms == MAX_REPEAT_SCAN_TIME_MS);
+
+    // GIVEN the hotspot appears
+    scan_callback = NULL;
+    while (g_wifi_state.cstate == TRY_TO_CONNECT) {
+        step_state_machine();
+    }
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    // WHEN the connection is successful
+    mock_state = MS_UP;
+    current_ip_address.addr = 1;
+    current_link_status = CYW43_LINK_UP;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    // THEN the time between scans is reset
+    ASSERT(g_wifi_state.scan_backoff_time_ms == REPEAT_SCAN_TIME_MS);
+
+    // GIVEN the backoff time has increased
+    wifi_settings_disconnect();
+    g_wifi_state.scan_backoff_time_ms = MAX_REPEAT_SCAN_TIME_MS;
+    // WHEN wifi_settings_connect is called
+    wifi_settings_connect();
+    // THEN the time between scans is reset
+    ASSERT(g_wifi_state.scan_backoff_time_ms == REPEAT_SCAN_TIME_MS);
+}
+
+void test_wifi_early_scan_termination() {
+    // GIVEN three hotspots, where ssid2 has the highest priority
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("prio2", "1");
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(g_wifi_state.top_ssid_index == 2);
+    run_event_worker();
+    // WHEN the scan finds ssid1
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    // THEN the scan continues
+    ASSERT(!current_event_worker->work_pending);
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    // WHEN the scan finds ssid2
+    strcpy((char*)scan_result.ssid, "SSID_2");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_result.channel = 6;
+    scan_callback(NULL, &scan_result);
+    // THEN the event worker is triggered, and the connection begins while
+    // the scan is still active
+    ASSERT(current_event_worker->work_pending);
+    ASSERT(mock_state == MS_SCANNING);
+    current_link_status = CYW43_LINK_JOIN;
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(g_wifi_state.selected_ssid_index == 2);
+    ASSERT(strcmp(connected_ssid, "SSID_2") == 0);
+    ASSERT(connected_channel == 6);
+
+    // GIVEN three hotspots, where ssid2 has the highest priority, and select=rssi
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("prio2", "1");
+    set_value_for_key("select", "rssi");
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    run_event_worker();
+    // WHEN the scan finds ssid2
+    scan_callback(NULL, &scan_result);
+    // THEN the scan continues, because there may be a stronger access point
+    ASSERT(!current_event_worker->work_pending);
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+}
+
+void end_scan_and_step() {
+    // The current scan ends, and the state machine runs
+    ASSERT(mock_state == MS_SCANNING);
+    scan_callback = NULL;
+    mock_state = MS_DOWN;
+    step_state_machine();
+}
+
+void test_wifi_directed_scan() {
+    // GIVEN three hotspots, where ssid2 and ssid3 need directed scans
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("scan2", "directed");
+    set_value_for_key("scan3", "directed");
+    // WHEN a scan begins
+    step_state_machine();
+    // THEN it is a directed scan for ssid2
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(calls_to_cyw43_wifi_scan == 1);
+    ASSERT(strcmp(scan_ssid, "SSID_2") == 0);
+    // WHEN ssid2 is not found
+    end_scan_and_step();
+    // THEN a directed scan for ssid3 begins
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(calls_to_cyw43_wifi_scan == 2);
+    ASSERT(strcmp(scan_ssid, "SSID_3") == 0);
+    ASSERT(scan_callback);
+    // WHEN ssid3 is found
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_3");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    end_scan_and_step();
+    // THEN the connection begins immediately, without a broadcast scan
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(calls_to_cyw43_wifi_scan == 2);
+    ASSERT(strcmp(connected_ssid, "SSID_3") == 0);
+
+    // GIVEN the same hotspots
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("scan2", "directed");
+    set_value_for_key("scan3", "directed");
+    // WHEN the directed scans find nothing
+    step_state_machine();
+    end_scan_and_step();
+    end_scan_and_step();
+    // THEN a broadcast scan begins
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(calls_to_cyw43_wifi_scan == 3);
+    ASSERT(strcmp(scan_ssid, "") == 0);
+    // WHEN the broadcast scan finds nothing
+    end_scan_and_step();
+    // THEN the scan is over
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(calls_to_cyw43_wifi_scan == 3);
+
+    // GIVEN one hotspot which needs a directed scan
+    reset_for_state_machine_test();
+    create_ssids(1);
+    set_value_for_key("scan1", "directed");
+    // WHEN the directed scan finds nothing
+    step_state_machine();
+    ASSERT(strcmp(scan_ssid, "SSID_1") == 0);
+    end_scan_and_step();
+    // THEN the scan is over, as a broadcast scan is not needed
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(calls_to_cyw43_wifi_scan == 1);
+}
+
+void test_wifi_static_ip_address() {
+    // GIVEN two hotspots, where ssid1 has a static IP address
+    reset_for_state_machine_test();
+    create_ssids(2);
+    set_value_for_key("ip1", "192.168.1.50");
+    set_value_for_key("gw1", "192.168.1.1");
+    set_value_for_key("dns1", "192.168.1.2");
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    // WHEN the scan finds both hotspots
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    strcpy((char*)scan_result.ssid, "SSID_2");
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    step_state_machine();
+    // THEN ssid1 is joined with a static IP address, the default netmask, and without DHCP
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(strcmp(connected_ssid, "SSID_1") == 0);
+    ASSERT(!dhcp_running);
+    ASSERT(current_ip_address.addr == 0xc0a80132);
+    ASSERT(current_netmask.addr == 0xffffff00);
+    ASSERT(current_gateway.addr == 0xc0a80101);
+    ASSERT(current_dns_server.addr == 0xc0a80102);
+
+    // WHEN the connection to ssid1 fails
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_NONET;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    step_state_machine();
+    // THEN ssid2 is joined using DHCP
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(strcmp(connected_ssid, "SSID_2") == 0);
+    ASSERT(dhcp_running);
+    ASSERT(current_ip_address.addr == 0);
+    ASSERT(current_netmask.addr == 0);
+    ASSERT(current_gateway.addr == 0);
+
+    // GIVEN a hotspot with an invalid static IP address
+    reset_for_state_machine_test();
+    create_ssids(1);
+    set_value_for_key("ip1", "192.168.1.500");
+    step_state_machine();
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    // WHEN the hotspot is joined
+    step_state_machine();
+    // THEN DHCP is used
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(dhcp_running);
+    ASSERT(current_ip_address.addr == 0);
+}
+
+void test_wifi_connect_timing() {
+    // GIVEN two hotspots
+    reset_for_state_machine_test();
+    create_ssids(2);
+    wifi_settings_connect_timing_t timing;
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.scan_start_time_ms == 0);
+    ASSERT(timing.num_attempts == 0);
+    ASSERT(strcmp(timing.failure_cause, "") == 0);
+    // WHEN a scan begins
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    const uint32_t scan_start_time = current_time.value;
+    // THEN the scan start time is recorded
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.scan_start_time_ms == scan_start_time);
+    ASSERT(timing.scan_end_time_ms == 0);
+
+    // WHEN the scan finds both hotspots, and ends
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    strcpy((char*)scan_result.ssid, "SSID_2");
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    const uint32_t join_time_1 = current_time.value;
+    // THEN the scan end time and join time are recorded
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.scan_start_time_ms == scan_start_time);
+    ASSERT(timing.scan_end_time_ms == join_time_1);
+    ASSERT(timing.join_start_time_ms == join_time_1);
+    ASSERT(timing.ssid_index == 1);
+    ASSERT(timing.num_attempts == 1);
+    ASSERT(timing.link_up_time_ms == 0);
+
+    // WHEN the connection to ssid1 fails and ssid2 is tried
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_NONET;
+    step_state_machine();
+    const uint32_t failure_time = current_time.value;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    const uint32_t join_time_2 = current_time.value;
+    // THEN the failure is recorded, along with the new join time
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.failure_time_ms == failure_time);
+    ASSERT(timing.failure_ssid_index == 1);
+    ASSERT(strcmp(timing.failure_cause, "FAILED") == 0);
+    ASSERT(timing.num_failures == 1);
+    ASSERT(timing.scan_end_time_ms == join_time_1);
+    ASSERT(timing.join_start_time_ms == join_time_2);
+    ASSERT(timing.ssid_index == 2);
+    ASSERT(timing.num_attempts == 2);
+
+    // WHEN the link comes up, without an IP address
+    mock_state = MS_UP;
+    current_link_status = CYW43_LINK_JOIN;
+    step_state_machine();
+    const uint32_t link_up_time = current_time.value;
+    // THEN the link up time is recorded
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.link_up_time_ms == link_up_time);
+    ASSERT(timing.ip_time_ms == 0);
+
+    // WHEN the IP address is obtained
+    current_ip_address.addr = 1;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    const uint32_t ip_time = current_time.value;
+    // THEN the time is recorded, and all of the times can be reported as text
+    wifi_settings_get_connect_timing(&timing);
+    ASSERT(timing.link_up_time_ms == link_up_time);
+    ASSERT(timing.ip_time_ms == ip_time);
+    char expect[200];
+    snprintf(expect, sizeof(expect),
+        "scan=%u:%u join=%u link=%u ip=%u attempts=2 failures=1 last_failure=ssid1:FAILED@%u",
+        scan_start_time, join_time_1, join_time_2, link_up_time, ip_time, failure_time);
+    wifi_settings_get_connect_timing_text(text_buffer, sizeof(text_buffer));
+    ASSERT(strcmp(text_buffer, expect) == 0);
+}
+
+void roaming_scan_result(const char* ssid, uint8_t bssid_last, int16_t rssi) {
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, ssid);
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_result.bssid[5] = bssid_last;
+    scan_result.channel = bssid_last;
+    scan_result.rssi = rssi;
+    scan_callback(NULL, &scan_result);
+}
+
+void reach_roaming_scan() {
+    // Connect to ssid1 (at BSSID ...:01) and then wait for a roaming scan
+    // to begin when the signal becomes weak
+    step_state_machine();
+    roaming_scan_result("SSID_1", 1, -70);
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    mock_state = MS_UP;
+    current_ip_address.addr = 1;
+    current_link_status = CYW43_LINK_JOIN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    scan_callback = NULL;
+    reset_calls_to();
+
+    // The signal is weak, but is briefly stronger
+    current_rssi = -85;
+    uint64_t start_time = current_time.value;
+    while (current_time.value < (start_time + ((ROAMING_LOW_RSSI_COUNT - 1) * ROAMING_CHECK_TIME_MS))) {
+        step_state_machine();
+    }
+    current_rssi = -60;
+    start_time = current_time.value;
+    while (current_time.value < (start_time + ROAMING_CHECK_TIME_MS)) {
+        step_state_machine();
+    }
+    current_rssi = -85;
+    ASSERT(calls_to_cyw43_wifi_scan == 0);
+    ASSERT(g_wifi_state.roaming_low_rssi_count == 0);
+
+    // The signal remains weak: a roaming scan begins
+    for (uint i = 0; (i < 1000) && (calls_to_cyw43_wifi_scan == 0); i++) {
+        step_state_machine();
+    }
+    ASSERT(calls_to_cyw43_wifi_scan == 1);
+    ASSERT(g_wifi_state.roaming_scan_active);
+    ASSERT(scan_while_connected);
+    ASSERT(scan_callback);
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    ASSERT(current_worker->next_time.value == (current_time.value + SCAN_POLL_TIME_MS));
+}
+
+void test_wifi_roaming() {
+    // GIVEN a connection to ssid1 with a weak signal, and a roaming scan
+    reset_for_state_machine_test();
+    create_ssids(3);
+    reach_roaming_scan();
+    // WHEN the scan finds the current access point, a stronger ssid2, and
+    // another ssid1 access point that is not as strong as ssid2
+    roaming_scan_result("SSID_1", 1, -85);
+    roaming_scan_result("SSID_2", 2, -60);
+    roaming_scan_result("SSID_1", 3, -70);
+    // THEN the connection continues while scanning
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    // WHEN the scan ends
+    scan_while_connected = false;
+    step_state_machine();
+    // THEN the strongest access point is joined
+    ASSERT(!g_wifi_state.roaming_scan_active);
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(g_wifi_state.selected_ssid_index == 2);
+    ASSERT(strcmp(connected_ssid, "SSID_2") == 0);
+    ASSERT(memcmp(connected_bssid, "\0\0\0\0\0\2", WIFI_BSSID_SIZE) == 0);
+    ASSERT(connected_channel == 2);
+    // THEN the other ssid1 access point remains available if this fails
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == FOUND);
+
+    // GIVEN a connection to ssid1 with a weak signal, and a roaming scan,
+    // where ssid2 has a lower priority
+    reset_for_state_machine_test();
+    create_ssids(3);
+    set_value_for_key("prio2", "-1");
+    reach_roaming_scan();
+    // WHEN the scan finds ssid2 and a slightly stronger ssid1 access point
+    roaming_scan_result("SSID_2", 2, -50);
+    roaming_scan_result("SSID_1", 3, -80);
+    scan_while_connected = false;
+    step_state_machine();
+    // THEN the connection to ssid1 continues, as there is no better access point
+    ASSERT(!g_wifi_state.roaming_scan_active);
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    ASSERT(g_wifi_state.selected_ssid_index == 1);
+    ASSERT(g_wifi_state.ssid_match[1].scan_info == SUCCESS);
+    ASSERT(mock_state == MS_UP);
+}
+
+void test_wifi_ssid_table_size() {
+    // GIVEN three hotspots in the file
+    reset_all();
+    create_ssids(3);
+    // WHEN initialised
+    wifi_settings_init();
+    // THEN the table contains only those hotspots
+    ASSERT(g_wifi_state.num_ssid_matches == 3);
+    ASSERT(strcmp(wifi_settings_get_ssid_status(3), "NOT FOUND") == 0);
+    ASSERT(strcmp(wifi_settings_get_ssid_status(4), "NOT FOUND") == 0);
+    ASSERT(strcmp(wifi_settings_get_ssid_status(MAX_NUM_SSIDS + 1), "") == 0);
+
+    // WHEN the file is updated with two more hotspots, and a scan begins
+    create_ssids(5);
+    wifi_settings_connect();
+    step_state_machine();
+    // THEN the table is resized
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(g_wifi_state.num_ssid_matches == 5);
+    // WHEN the new hotspot is found
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_5");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    // THEN it is recorded
+    ASSERT(g_wifi_state.ssid_match[5].scan_info == FOUND);
+    ASSERT(strcmp(wifi_settings_get_ssid_status(5), "FOUND") == 0);
+}
+
+void test_wifi_power_profile() {
+    // GIVEN a connection with the default profile
+    reach_connected_ip_state();
+    // THEN the driver default power management mode was set when the hotspot was joined
+    ASSERT(wifi_settings_get_power_profile() == WIFI_SETTINGS_POWER_PROFILE_BALANCED);
+    ASSERT(current_pm == CYW43_DEFAULT_PM);
+
+    // WHEN the low power profile is set
+    wifi_settings_set_power_profile(WIFI_SETTINGS_POWER_PROFILE_LOW_POWER);
+    // THEN it is applied immediately
+    ASSERT(wifi_settings_get_power_profile() == WIFI_SETTINGS_POWER_PROFILE_LOW_POWER);
+    ASSERT(current_pm == CYW43_AGGRESSIVE_PM);
+    ASSERT(calls_to_cyw43_wifi_pm == 1);
+
+    // WHEN a remote session is connected and then ends
+    wifi_settings_set_remote_active(true);
+    // THEN there is no power saving during the session
+    ASSERT(current_pm == CYW43_NONE_PM);
+    // THEN the profile is unchanged
+    ASSERT(wifi_settings_get_power_profile() == WIFI_SETTINGS_POWER_PROFILE_LOW_POWER);
+    wifi_settings_set_remote_active(true);
+    ASSERT(calls_to_cyw43_wifi_pm == 2);
+    wifi_settings_set_remote_active(false);
+    // THEN the profile is used again
+    ASSERT(current_pm == CYW43_AGGRESSIVE_PM);
+    ASSERT(calls_to_cyw43_wifi_pm == 3);
+
+    // WHEN the connection is lost and the hotspot is joined again
+    current_pm = 0;
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    mock_state = MS_UP;
+    current_link_status = CYW43_LINK_JOIN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    // THEN the profile is applied again
+    ASSERT(current_pm == CYW43_AGGRESSIVE_PM);
+    ASSERT(calls_to_cyw43_wifi_pm == 4);
+
+    // WHEN there was an earlier error, and the profile is set successfully
+    g_wifi_state.hw_error_code = 123;
+    wifi_settings_set_power_profile(WIFI_SETTINGS_POWER_PROFILE_BALANCED);
+    // THEN the earlier error is still reported
+    ASSERT(current_pm == CYW43_DEFAULT_PM);
+    ASSERT(g_wifi_state.hw_error_code == 123);
+
+    // WHEN setting the profile fails
+    cyw43_wifi_pm_error = -4;
+    wifi_settings_set_power_profile(WIFI_SETTINGS_POWER_PROFILE_LOW_LATENCY);
+    // THEN the error is reported
+    ASSERT(g_wifi_state.hw_error_code == -4);
+    cyw43_wifi_pm_error = 0;
+
+    // GIVEN uninitialised state
+    reset_all();
+    // WHEN the profile is set, or a remote session starts, before wifi_settings_init_async()
+    wifi_settings_set_power_profile(WIFI_SETTINGS_POWER_PROFILE_LOW_POWER);
+    wifi_settings_set_remote_active(true);
+    wifi_settings_set_remote_active(false);
+    // THEN the driver is not used
+    ASSERT(calls_to_cyw43_wifi_pm == 0);
+    // WHEN initialisation begins
+    ASSERT(wifi_settings_init_async() == 0);
+    ASSERT(g_wifi_state.cstate == INITIALISING);
+    wifi_settings_set_remote_active(true);
+    // THEN the driver is still not used, and the profile is kept
+    ASSERT(calls_to_cyw43_wifi_pm == 0);
+    ASSERT(wifi_settings_get_power_profile() == WIFI_SETTINGS_POWER_PROFILE_LOW_POWER);
+    wifi_settings_set_remote_active(false);
+}
+
+void test_wifi_link_quality_history() {
+    wifi_settings_link_quality_t history[LINK_QUALITY_HISTORY_SIZE + 1];
+
+    // GIVEN connected_ip state
+    reach_connected_ip_state();
+    const uint32_t connected_time = current_time.value;
+
+    // WHEN the history is requested
+    int count = wifi_settings_get_link_quality_history(history, LINK_QUALITY_HISTORY_SIZE + 1);
+
+    // THEN each state change is recorded, oldest first, ending with the first sample
+    ASSERT(count == 5);
+    ASSERT(history[0].event == WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+    ASSERT(history[0].state == TRY_TO_CONNECT);
+    ASSERT(history[1].state == SCANNING);
+    ASSERT(history[2].state == CONNECTING);
+    ASSERT(history[2].num_attempts == 1);
+    ASSERT(history[3].event == WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+    ASSERT(history[3].state == CONNECTED_IP);
+    ASSERT(history[3].time_ms == connected_time);
+    ASSERT(history[3].rssi == -1);
+    ASSERT(history[4].event == WIFI_SETTINGS_LINK_QUALITY_SAMPLE);
+    ASSERT(history[4].state == CONNECTED_IP);
+    ASSERT(history[4].time_ms == connected_time);
+
+    // WHEN the connection remains stable, with a changing signal strength
+    for (uint i = 0; i < (LINK_QUALITY_SAMPLE_TIME_MS * 2); i += PERIODIC_TIME_MS) {
+        current_rssi = -50 - (int32_t) (i / PERIODIC_TIME_MS);
+        step_state_machine();
+    }
+
+    // THEN the signal strength is sampled at intervals
+    count = wifi_settings_get_link_quality_history(history, LINK_QUALITY_HISTORY_SIZE + 1);
+    ASSERT(count == 7);
+    ASSERT(history[5].event == WIFI_SETTINGS_LINK_QUALITY_SAMPLE);
+    ASSERT(history[5].time_ms == (connected_time + LINK_QUALITY_SAMPLE_TIME_MS));
+    ASSERT(history[5].rssi == (-50 - ((LINK_QUALITY_SAMPLE_TIME_MS / PERIODIC_TIME_MS) - 1)));
+    ASSERT(history[6].time_ms == (connected_time + (LINK_QUALITY_SAMPLE_TIME_MS * 2)));
+
+    // WHEN max_entries is smaller than the history
+    // THEN only the oldest entries are copied
+    count = wifi_settings_get_link_quality_history(history, 2);
+    ASSERT(count == 2);
+    ASSERT(history[0].state == TRY_TO_CONNECT);
+    ASSERT(history[1].state == SCANNING);
+
+    // WHEN the connection remains stable for long enough to fill the history
+    for (uint i = 0; i < LINK_QUALITY_HISTORY_SIZE; i++) {
+        for (uint j = 0; j < LINK_QUALITY_SAMPLE_TIME_MS; j += PERIODIC_TIME_MS) {
+            step_state_machine();
+        }
+    }
+
+    // THEN the oldest entries are discarded, and only samples remain, oldest first
+    count = wifi_settings_get_link_quality_history(history, LINK_QUALITY_HISTORY_SIZE + 1);
+    ASSERT(count == LINK_QUALITY_HISTORY_SIZE);
+    for (int i = 0; i < count; i++) {
+        ASSERT(history[i].event == WIFI_SETTINGS_LINK_QUALITY_SAMPLE);
+        ASSERT(history[i].time_ms == (connected_time +
+            (LINK_QUALITY_SAMPLE_TIME_MS * (uint32_t) (i + 3))));
+    }
+
+    // WHEN the connection is lost
+    mock_state = MS_DOWN;
+    step_state_machine();
+
+    // THEN the state change is the newest entry, without a signal strength
+    count = wifi_settings_get_link_quality_history(history, LINK_QUALITY_HISTORY_SIZE + 1);
+    ASSERT(count == LINK_QUALITY_HISTORY_SIZE);
+    ASSERT(history[count - 1].event == WIFI_SETTINGS_LINK_QUALITY_STATE_CHANGE);
+    ASSERT(history[count - 1].state == TRY_TO_CONNECT);
+    ASSERT(history[count - 1].rssi == 0);
+}
+
+void test_wifi_event_callback() {
+    // GIVEN one hotspot, and an event callback
+    reset_for_state_machine_test();
+    create_ssids(1);
+    num_recorded_events = 0;
+    wifi_settings_set_event_callback(record_event, &num_recorded_events);
+
+    // WHEN the scan doesn't find the hotspot
+    scan_and_find_nothing();
+    // THEN the scan failure is reported
+    ASSERT(num_recorded_events == 1);
+    ASSERT(recorded_events[0] == WIFI_SETTINGS_EVENT_SCAN_FAILED);
+
+    // WHEN the next scan finds the hotspot, and joining begins
+    num_recorded_events = 0;
+    scan_callback = NULL;
+    while (g_wifi_state.cstate == TRY_TO_CONNECT) {
+        step_state_machine();
+    }
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    // THEN nothing is reported yet
+    ASSERT(num_recorded_events == 0);
+
+    // WHEN the link comes up, without an IP address
+    mock_state = MS_UP;
+    current_link_status = CYW43_LINK_JOIN;
+    step_state_machine();
+    step_state_machine();
+    // THEN the connection is reported once
+    ASSERT(num_recorded_events == 1);
+    ASSERT(recorded_events[0] == WIFI_SETTINGS_EVENT_CONNECTED);
+
+    // WHEN the IP address is obtained
+    current_ip_address.addr = 1;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    // THEN this is reported
+    ASSERT(num_recorded_events == 2);
+    ASSERT(recorded_events[1] == WIFI_SETTINGS_EVENT_IP_ACQUIRED);
+
+    // WHEN the connection is lost
+    mock_state = MS_DOWN;
+    step_state_machine();
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    // THEN this is reported
+    ASSERT(num_recorded_events == 3);
+    ASSERT(recorded_events[2] == WIFI_SETTINGS_EVENT_LOST);
+
+    // GIVEN connected_ip state, and an event callback
+    reach_connected_ip_state();
+    num_recorded_events = 0;
+    wifi_settings_set_event_callback(record_event, &num_recorded_events);
+    // WHEN wifi_settings_disconnect is called
+    wifi_settings_disconnect();
+    // THEN the loss of the connection is reported
+    ASSERT(num_recorded_events == 1);
+    ASSERT(recorded_events[0] == WIFI_SETTINGS_EVENT_LOST);
+
+    // GIVEN connected_ip state, and the callback is removed
+    reach_connected_ip_state();
+    num_recorded_events = 0;
+    wifi_settings_set_event_callback(record_event, &num_recorded_events);
+    wifi_settings_set_event_callback(NULL, NULL);
+    // WHEN the connection is lost
+    mock_state = MS_DOWN;
+    step_state_machine();
+    // THEN nothing is reported
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(num_recorded_events == 0);
+}
+
+static int num_scan_callbacks;
+static int scan_callback_num_results;
+
+static void record_scan_results(int num_results, void* arg) {
+    ASSERT(arg == &num_scan_callbacks);
+    num_scan_callbacks++;
+    scan_callback_num_results = num_results;
+}
+
+static void report_access_point(uint8_t bssid_byte, const char* ssid, int16_t rssi) {
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    memset(scan_result.bssid, bssid_byte, WIFI_BSSID_SIZE);
+    strcpy((char*)scan_result.ssid, ssid);
+    scan_result.ssid_len = (uint8_t) strlen(ssid);
+    scan_result.channel = bssid_byte;
+    scan_result.rssi = rssi;
+    scan_result.auth_mode = 4;
+    scan_callback(NULL, &scan_result);
+}
+
+void test_wifi_scan_results() {
+    wifi_settings_scan_result_t results[SCAN_RESULTS_SIZE + 1];
+
+    // GIVEN one hotspot, and a scan callback
+    reset_for_state_machine_test();
+    create_ssids(1);
+    num_scan_callbacks = 0;
+    wifi_settings_set_scan_callback(record_scan_results, &num_scan_callbacks);
+    while (g_wifi_state.cstate == TRY_TO_CONNECT) {
+        step_state_machine();
+    }
+    ASSERT(g_wifi_state.cstate == SCANNING);
+
+    // WHEN the scan finds other access points, some more than once
+    report_access_point(1, "OTHER", -70);
+    report_access_point(2, "SSID_1", -60);
+    report_access_point(3, "", -80);
+    report_access_point(1, "OTHER", -50);
+    report_access_point(2, "SSID_1", -65);
+
+    // THEN the results so far are available, strongest first, each access point once,
+    // and the callback is not called yet
+    int count = wifi_settings_get_scan_results(results, SCAN_RESULTS_SIZE + 1);
+    ASSERT(count == 3);
+    ASSERT(results[0].bssid[0] == 1);
+    ASSERT(results[0].rssi == -50);
+    ASSERT(strcmp(results[0].ssid, "OTHER") == 0);
+    ASSERT(results[0].ssid_len == 5);
+    ASSERT(results[0].channel == 1);
+    ASSERT(results[0].auth_mode == 4);
+    ASSERT(results[1].bssid[0] == 2);
+    ASSERT(results[1].rssi == -60);
+    ASSERT(results[2].bssid[0] == 3);
+    ASSERT(results[2].ssid[0] == '\0');
+    ASSERT(num_scan_callbacks == 0);
+
+    // WHEN the scan ends
+    end_scan_and_step();
+
+    // THEN the callback is called once, and the results remain available
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(num_scan_callbacks == 1);
+    ASSERT(scan_callback_num_results == 3);
+    step_state_machine();
+    ASSERT(num_scan_callbacks == 1);
+    count = wifi_settings_get_scan_results(results, 2);
+    ASSERT(count == 2);
+    ASSERT(results[1].bssid[0] == 2);
+
+    // WHEN the connection is lost, and the next scan finds more access points
+    // than can be kept
+    mock_state = MS_DOWN;
+    current_link_status = CYW43_LINK_DOWN;
+    scan_callback = NULL;
+    while (mock_state != MS_SCANNING) {
+        step_state_machine();
+    }
+    count = wifi_settings_get_scan_results(results, SCAN_RESULTS_SIZE + 1);
+    ASSERT(count == 0);
+    for (uint i = 0; i < (SCAN_RESULTS_SIZE + 2); i++) {
+        report_access_point((uint8_t) (i + 10), "MANY", (int16_t) (-90 + (int) ((i * 7) % 11)));
+    }
+    report_access_point(2, "SSID_1", -40);
+    end_scan_and_step();
+
+    // THEN the strongest are kept, in order
+    ASSERT(num_scan_callbacks == 2);
+    ASSERT(scan_callback_num_results == SCAN_RESULTS_SIZE);
+    count = wifi_settings_get_scan_results(results, SCAN_RESULTS_SIZE + 1);
+    ASSERT(count == SCAN_RESULTS_SIZE);
+    ASSERT(results[0].bssid[0] == 2);
+    for (int i = 1; i < count; i++) {
+        ASSERT(results[i].rssi <= results[i - 1].rssi);
+        ASSERT(results[i].rssi > -90);
+    }
+
+    // WHEN the callback is removed, and there is another scan
+    wifi_settings_set_scan_callback(NULL, NULL);
+    mock_state = MS_DOWN;
+    scan_callback = NULL;
+    while (mock_state != MS_SCANNING) {
+        step_state_machine();
+    }
+    end_scan_and_step();
+    // THEN it is not called
+    ASSERT(num_scan_callbacks == 2);
+}
+
+void test_wifi_event_driven() {
+    // GIVEN initialisation
+    reset_all();
+    create_ssids(1);
+    wifi_settings_init();
+    // THEN the event worker and netif callback are registered
+    ASSERT(current_event_worker);
+    ASSERT(current_netif_callback);
+    ASSERT(!current_event_worker->work_pending);
+
+    // WHEN connecting
+    wifi_settings_connect();
+    // THEN the event worker is triggered immediately
+    ASSERT(current_event_worker->work_pending);
+    // WHEN the event worker runs before the initial setup time
+    run_event_worker();
+    // THEN the state doesn't change, and the event worker is not triggered again
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(!current_event_worker->work_pending);
+
+    // WHEN the periodic worker runs after the initial setup time
+    step_state_machine();
+    // THEN a scan begins and the periodic worker will run again soon, so that the
+    // end of the scan is detected quickly
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(current_worker->next_time.value == (current_time.value + SCAN_POLL_TIME_MS));
+    ASSERT(current_event_worker->work_pending);
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == SCANNING);
+    ASSERT(!current_event_worker->work_pending);
+
+    // GIVEN the scan finds the hotspot and then ends
+    cyw43_ev_scan_result_t scan_result;
+    memset(&scan_result, 0, sizeof(scan_result));
+    strcpy((char*)scan_result.ssid, "SSID_1");
+    scan_result.ssid_len = (uint8_t) strlen((char*)scan_result.ssid);
+    scan_callback(NULL, &scan_result);
+    mock_state = MS_DOWN;
+    // WHEN the periodic worker runs
+    step_state_machine();
+    // THEN a connection begins, and the normal period is used
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(current_worker->next_time.value == (current_time.value + PERIODIC_TIME_MS));
+    current_link_status = CYW43_LINK_JOIN;
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+    ASSERT(!current_event_worker->work_pending);
+
+    // GIVEN the connection is made
+    mock_state = MS_UP;
+    current_ip_address.addr = 1;
+    current_link_status = CYW43_LINK_UP;
+    // WHEN lwIP reports an address change
+    current_netif_callback(&g_netif_default, 0, NULL);
+    // THEN the event worker is triggered, and the state changes without waiting
+    // for the periodic worker
+    ASSERT(current_event_worker->work_pending);
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == CONNECTED_IP);
+    ASSERT(!current_event_worker->work_pending);
+
+    // GIVEN the connection is lost
+    mock_state = MS_DOWN;
+    // WHEN lwIP reports a link change
+    current_netif_callback(&g_netif_default, 0, NULL);
+    run_event_worker();
+    // THEN the state changes, and the event worker runs again to begin reconnecting
+    ASSERT(g_wifi_state.cstate == TRY_TO_CONNECT);
+    ASSERT(current_event_worker->work_pending);
+    run_event_worker();
+    ASSERT(g_wifi_state.cstate == CONNECTING);
+
+    // WHEN deinitialising
+    wifi_settings_deinit();
+    // THEN the event worker and netif callback are removed
+    ASSERT(!current_event_worker);
+    ASSERT(!current_netif_callback);
+}
+
 int main() {
     test_wifi_settings_init();
+    test_wifi_settings_init_async();
     test_wifi_settings_deinit();
     test_wifi_settings_connect();
     test_wifi_settings_disconnect();
@@ -1371,13 +2786,28 @@ int main() {
     test_wifi_connecting_state();
     test_wifi_connected_ip_state();
     test_wifi_connecting_state_when_lost();
+    test_wifi_fast_reconnect();
     test_wifi_connecting_state_when_ssid_details_are_forgotten();
     test_wifi_connecting_with_bssid();
     test_wifi_connecting_with_open_hotspot();
+    test_wifi_hotspot_selection();
+    test_wifi_event_driven();
+    test_wifi_scan_backoff();
+    test_wifi_early_scan_termination();
+    test_wifi_directed_scan();
+    test_wifi_static_ip_address();
+    test_wifi_connect_timing();
+    test_wifi_roaming();
+    test_wifi_ssid_table_size();
+    test_wifi_power_profile();
+    test_wifi_link_quality_history();
+    test_wifi_event_callback();
+    test_wifi_scan_results();
     test_wifi_connecting_with_multiple_passwords_for_ssid();
     test_wifi_settings_get_connect_status_text();
     test_wifi_settings_get_hw_status_text();
     test_wifi_settings_get_ip_status_text();
+    test_wifi_settings_get_status();
     test_wifi_settings_has_no_wifi_details();
     return 0;
 }
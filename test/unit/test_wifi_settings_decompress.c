@@ -0,0 +1,169 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test for wifi_settings_decompress.c
+ *
+ */
+
+#include "unit_test.h"
+
+#include "wifi_settings/wifi_settings_decompress.h"
+#include "pico/error.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define BUFFER_SIZE 4096
+
+static uint8_t buffer[BUFFER_SIZE];
+
+static int decompress(const uint8_t* input, uint32_t input_size,
+                      uint32_t buffer_size, uint32_t* output_size) {
+    memset(buffer, 0xaa, sizeof(buffer));
+    memcpy(buffer, input, input_size);
+    return wifi_settings_decompress_in_place(buffer, buffer_size, input_size, output_size);
+}
+
+void test_wifi_settings_decompress_valid() {
+    uint32_t output_size;
+    int ret;
+
+    // GIVEN literals, a match which overlaps itself, and a tail
+    const uint8_t repeat[] = {19, 0, 1, 0, 0x3b, 'a', 'b', 'c', 3, 0, 'X'};
+    // WHEN decompressed
+    ret = decompress(repeat, sizeof(repeat), BUFFER_SIZE, &output_size);
+    // THEN the match repeats the earlier output
+    ASSERT(ret == PICO_OK);
+    ASSERT(output_size == 19);
+    ASSERT(memcmp(buffer, "abcabcabcabcabcabcX", 19) == 0);
+
+    // GIVEN a whole Flash sector of 0xff bytes: 1 literal and a match of 4095 bytes,
+    // which needs extra length bytes (4095 - 4 - 15 = (15 * 255) + 251)
+    uint8_t sector[24];
+    sector[0] = BUFFER_SIZE & 0xff;
+    sector[1] = BUFFER_SIZE >> 8;
+    sector[2] = 0;
+    sector[3] = 0;
+    sector[4] = 0x1f;
+    sector[5] = 0xff;
+    sector[6] = 1;
+    sector[7] = 0;
+    memset(&sector[8], 255, 15);
+    sector[23] = 251;
+    // WHEN decompressed
+    ret = decompress(sector, sizeof(sector), BUFFER_SIZE, &output_size);
+    // THEN the whole buffer is filled, overwriting the input as it is used
+    ASSERT(ret == PICO_OK);
+    ASSERT(output_size == BUFFER_SIZE);
+    for (uint i = 0; i < BUFFER_SIZE; i++) {
+        ASSERT(buffer[i] == 0xff);
+    }
+
+    // GIVEN a match which ends immediately before the next input to be read
+    const uint8_t exact_fit[] = {17, 0, 1, 0, 0x1b, 'a', 1, 0, 'b'};
+    // WHEN decompressed in a buffer which is the same size as the output
+    ret = decompress(exact_fit, sizeof(exact_fit), 17, &output_size);
+    // THEN the output is correct
+    ASSERT(ret == PICO_OK);
+    ASSERT(output_size == 17);
+    ASSERT(memcmp(buffer, "aaaaaaaaaaaaaaaab", 17) == 0);
+}
+
+void test_wifi_settings_decompress_invalid() {
+    uint32_t output_size;
+    int ret;
+
+    // GIVEN input which is larger than the buffer
+    const uint8_t literals[] = {5, 0, 5, 0, 'h', 'e', 'l', 'l', 'o'};
+    // WHEN decompressed
+    ret = decompress(literals, sizeof(literals), 8, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_ARG);
+    ASSERT(output_size == 0);
+
+    // GIVEN input which is smaller than the header
+    // WHEN decompressed
+    ret = decompress(literals, 3, BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_ARG);
+
+    // GIVEN a decompressed size which is larger than the buffer
+    const uint8_t too_large[] = {0x01, 0x10, 0, 0};
+    // WHEN decompressed
+    ret = decompress(too_large, sizeof(too_large), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN compressed data which is larger than the decompressed data
+    // (remote_picotool sends this data uncompressed instead)
+    // WHEN decompressed
+    ret = decompress(literals, sizeof(literals), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a tail which goes beyond the end of the input
+    const uint8_t tail_too_large[] = {10, 0, 6, 0, 'h', 'e', 'l', 'l', 'o'};
+    // WHEN decompressed
+    ret = decompress(tail_too_large, sizeof(tail_too_large), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN sequences which don't fill the space before the tail
+    const uint8_t short_output[] = {20, 0, 1, 0, 0x3b, 'a', 'b', 'c', 3, 0, 'X'};
+    // WHEN decompressed
+    ret = decompress(short_output, sizeof(short_output), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN literals which go beyond the end of the input
+    const uint8_t literals_truncated[] = {20, 0, 0, 0, 0x40, 'a', 'b', 'c'};
+    // WHEN decompressed
+    ret = decompress(literals_truncated, sizeof(literals_truncated), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a match offset of 0
+    const uint8_t offset_zero[] = {20, 0, 0, 0, 0x10, 'a', 0, 0};
+    // WHEN decompressed
+    ret = decompress(offset_zero, sizeof(offset_zero), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a match offset before the start of the output
+    const uint8_t offset_too_large[] = {20, 0, 0, 0, 0x10, 'a', 2, 0};
+    // WHEN decompressed
+    ret = decompress(offset_too_large, sizeof(offset_too_large), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a match with a missing offset byte
+    const uint8_t offset_truncated[] = {20, 0, 0, 0, 0x10, 'a', 1};
+    // WHEN decompressed
+    ret = decompress(offset_truncated, sizeof(offset_truncated), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a literal length with missing extra length bytes
+    const uint8_t length_truncated[] = {20, 0, 0, 0, 0xf0, 255};
+    // WHEN decompressed
+    ret = decompress(length_truncated, sizeof(length_truncated), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+
+    // GIVEN a match which would overwrite input that has not been read yet,
+    // because the final literal is not in the tail
+    const uint8_t no_tail[] = {17, 0, 0, 0, 0x1b, 'a', 1, 0, 0x10, 'b'};
+    // WHEN decompressed
+    ret = decompress(no_tail, sizeof(no_tail), BUFFER_SIZE, &output_size);
+    // THEN it is rejected
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+}
+
+int main() {
+    test_wifi_settings_decompress_valid();
+    test_wifi_settings_decompress_invalid();
+    return 0;
+}
@@ -0,0 +1,333 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test for wifi_settings_event_log.c
+ *
+ */
+
+#include "unit_test.h"
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_event_log.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+#include "hardware/flash.h"
+#include "pico/error.h"
+#include "pico/time.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MOCK_FLASH_START_ADDRESS (WIFI_SETTINGS_EVENT_LOG_ADDRESS)
+#define MOCK_FLASH_SIZE (WIFI_SETTINGS_EVENT_LOG_SIZE)
+#define NUM_PAGES (MOCK_FLASH_SIZE / FLASH_PAGE_SIZE)
+#define PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+static uint8_t flash_fake[MOCK_FLASH_SIZE];
+static uint flash_erase_count;
+static uint flash_program_count;
+static uint int_disable_level;
+static uint lock_level;
+static uint32_t current_time_ms;
+
+static void reset_flash() {
+    memset(flash_fake, 0xff, sizeof(flash_fake));
+    flash_erase_count = 0;
+    flash_program_count = 0;
+    int_disable_level = 0;
+    lock_level = 0;
+    current_time_ms = 1000;
+    wifi_settings_event_log_reset();
+}
+
+static const wifi_settings_event_log_header_t* get_page_header(uint page) {
+    return (const wifi_settings_event_log_header_t*) &flash_fake[page * FLASH_PAGE_SIZE];
+}
+
+static const wifi_settings_event_log_entry_t* get_page_entry(uint page, uint index) {
+    return (const wifi_settings_event_log_entry_t*)
+        &flash_fake[(page * FLASH_PAGE_SIZE) + sizeof(wifi_settings_event_log_header_t)
+                    + (index * sizeof(wifi_settings_event_log_entry_t))];
+}
+
+// Mock implementation of save_and_disable_interrupts
+uint32_t save_and_disable_interrupts() {
+    int_disable_level++;
+    return 1234;
+}
+
+// Mock implementation of restore_interrupts
+void restore_interrupts(uint32_t flags) {
+    ASSERT(flags == 1234);
+    ASSERT(int_disable_level > 0);
+    int_disable_level--;
+}
+
+// Mock implementation of flash_range_erase
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    flash_erase_count++;
+    ASSERT(flash_offs >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((flash_offs + count) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    ASSERT((flash_offs % FLASH_SECTOR_SIZE) == 0);
+    ASSERT(count == FLASH_SECTOR_SIZE);
+    ASSERT(int_disable_level > 0);
+    memset(&flash_fake[flash_offs - MOCK_FLASH_START_ADDRESS], 0xff, count);
+}
+
+// Mock implementation of flash_range_program
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    flash_program_count++;
+    ASSERT(flash_offs >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((flash_offs + count) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    ASSERT(count == FLASH_PAGE_SIZE);
+    ASSERT((flash_offs % FLASH_PAGE_SIZE) == 0);
+    ASSERT(int_disable_level > 0);
+    // Programming only clears bits
+    for (uint i = 0; i < count; i++) {
+        flash_fake[flash_offs - MOCK_FLASH_START_ADDRESS + i] &= data[i];
+    }
+}
+
+// Mock implementation of wifi_settings_range_translate_to_logical
+void wifi_settings_range_translate_to_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    ASSERT(fr->start_address >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((fr->start_address + fr->size) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    lr->start_address = &flash_fake[fr->start_address - MOCK_FLASH_START_ADDRESS];
+    lr->size = fr->size;
+}
+
+// Mock implementation of flash_safe_execute
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t) {
+    ASSERT(lock_level > 0);
+    func(param);
+    return PICO_OK;
+}
+
+// Mock implementation of cyw43_arch_lwip_begin
+void cyw43_arch_lwip_begin() {
+    lock_level++;
+}
+
+// Mock implementation of cyw43_arch_lwip_end
+void cyw43_arch_lwip_end() {
+    ASSERT(lock_level > 0);
+    lock_level--;
+}
+
+// Mock implementation of get_absolute_time
+absolute_time_t get_absolute_time(void) {
+    absolute_time_t t;
+    t.value = current_time_ms;
+    return t;
+}
+
+// Mock implementation of make_timeout_time_ms
+absolute_time_t make_timeout_time_ms(const uint32_t ms) {
+    absolute_time_t t;
+    t.value = current_time_ms + ms;
+    return t;
+}
+
+// Mock implementation of to_ms_since_boot
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return t.value;
+}
+
+// Mock implementation of time_reached
+bool time_reached(const absolute_time_t t) {
+    return t.value <= current_time_ms;
+}
+
+static void add_events(uint count) {
+    for (uint i = 0; i < count; i++) {
+        wifi_settings_event_log_add(WIFI_SETTINGS_EVENT_LOG_JOIN, 3, -60 - (int32_t) (i % 20), (uint8_t) i);
+    }
+}
+
+void test_wifi_settings_event_log_buffer() {
+    // GIVEN blank flash
+    reset_flash();
+    // WHEN the log starts
+    wifi_settings_event_log_init();
+    // THEN nothing is written to Flash yet
+    ASSERT(flash_program_count == 0);
+    ASSERT(flash_erase_count == 0);
+
+    // WHEN the page is nearly full
+    add_events(WIFI_SETTINGS_EVENT_LOG_ENTRIES_PER_PAGE - 2);
+    // THEN nothing is written to Flash
+    ASSERT(flash_program_count == 0);
+    // AND the periodic function does not write before the flush time
+    current_time_ms += WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS - 1;
+    wifi_settings_event_log_periodic();
+    ASSERT(flash_program_count == 0);
+
+    // WHEN the page is full
+    add_events(1);
+    // THEN the first page is written, after erasing the first sector
+    ASSERT(flash_program_count == 1);
+    ASSERT(flash_erase_count == 1);
+    ASSERT(get_page_header(0)->magic == WIFI_SETTINGS_EVENT_LOG_MAGIC);
+    ASSERT(get_page_header(0)->sequence == 0);
+    ASSERT(get_page_header(0)->boot_count == 0);
+    ASSERT(get_page_entry(0, 0)->event == WIFI_SETTINGS_EVENT_LOG_BOOT);
+    ASSERT(get_page_entry(0, 0)->time_ms == 1000);
+    ASSERT(get_page_entry(0, 1)->event == WIFI_SETTINGS_EVENT_LOG_JOIN);
+    ASSERT(get_page_entry(0, 1)->ssid_index == 3);
+    ASSERT(get_page_entry(0, 1)->rssi == -60);
+    ASSERT(get_page_entry(0, 2)->arg == 1);
+    ASSERT(lock_level == 0);
+
+    // WHEN one more event is added, and the flush time passes
+    add_events(1);
+    current_time_ms += WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS - 1;
+    wifi_settings_event_log_periodic();
+    ASSERT(flash_program_count == 1);
+    current_time_ms += 1;
+    wifi_settings_event_log_periodic();
+    // THEN the partly filled page is written, without erasing
+    ASSERT(flash_program_count == 2);
+    ASSERT(flash_erase_count == 1);
+    ASSERT(get_page_header(1)->sequence == 1);
+    ASSERT(get_page_entry(1, 0)->event == WIFI_SETTINGS_EVENT_LOG_JOIN);
+    ASSERT(get_page_entry(1, 1)->event == WIFI_SETTINGS_EVENT_LOG_UNUSED);
+    // AND the periodic function does nothing when the buffer is empty
+    current_time_ms += WIFI_SETTINGS_EVENT_LOG_FLUSH_TIME_MS;
+    wifi_settings_event_log_periodic();
+    ASSERT(flash_program_count == 2);
+
+    // WHEN flushed with an empty buffer
+    // THEN nothing is written
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    ASSERT(flash_program_count == 2);
+}
+
+void test_wifi_settings_event_log_reboot() {
+    // GIVEN a log with two pages, written before a reboot
+    reset_flash();
+    wifi_settings_event_log_init();
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    add_events(1);
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    ASSERT(flash_program_count == 2);
+
+    // WHEN there is a reboot
+    wifi_settings_event_log_reset();
+    wifi_settings_event_log_init();
+    // AND a further call to init (e.g. wifi_settings_init after wifi_settings_deinit)
+    wifi_settings_event_log_init();
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    // THEN the next page is used, with the next sequence number and boot count,
+    // and only one boot is recorded
+    ASSERT(flash_program_count == 3);
+    ASSERT(get_page_header(2)->sequence == 2);
+    ASSERT(get_page_header(2)->boot_count == 1);
+    ASSERT(get_page_entry(2, 0)->event == WIFI_SETTINGS_EVENT_LOG_BOOT);
+    ASSERT(get_page_entry(2, 1)->event == WIFI_SETTINGS_EVENT_LOG_UNUSED);
+
+    // WHEN a page was partly programmed when power was lost (the header is not valid)
+    memset(&flash_fake[3 * FLASH_PAGE_SIZE], 0x00, 8);
+    wifi_settings_event_log_reset();
+    wifi_settings_event_log_init();
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    // THEN that page is skipped
+    ASSERT(flash_program_count == 4);
+    ASSERT(get_page_header(4)->sequence == 3);
+    ASSERT(get_page_header(4)->boot_count == 2);
+    ASSERT(flash_erase_count == 1);
+}
+
+void test_wifi_settings_event_log_wrap() {
+    // GIVEN blank flash
+    reset_flash();
+    wifi_settings_event_log_init();
+
+    // WHEN the log is filled
+    for (uint page = 0; page < NUM_PAGES; page++) {
+        ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+        add_events(1);
+    }
+    // THEN each sector is erased once, when it is first used
+    ASSERT(flash_program_count == NUM_PAGES);
+    ASSERT(flash_erase_count == (NUM_PAGES / PAGES_PER_SECTOR));
+
+    // WHEN another page is written
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    // THEN the first sector is erased, and the other sectors are kept
+    ASSERT(flash_program_count == (NUM_PAGES + 1));
+    ASSERT(flash_erase_count == ((NUM_PAGES / PAGES_PER_SECTOR) + 1));
+    ASSERT(get_page_header(0)->sequence == NUM_PAGES);
+    ASSERT(get_page_header(1)->magic == 0xffffffff);
+    ASSERT(get_page_header(PAGES_PER_SECTOR)->sequence == PAGES_PER_SECTOR);
+
+    // WHEN there is a reboot
+    wifi_settings_event_log_reset();
+    wifi_settings_event_log_init();
+    ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+    // THEN the most recent page is found, and the next page is used
+    ASSERT(get_page_header(1)->sequence == (NUM_PAGES + 1));
+    ASSERT(get_page_header(1)->boot_count == 1);
+    ASSERT(flash_erase_count == ((NUM_PAGES / PAGES_PER_SECTOR) + 1));
+}
+
+void test_wifi_settings_event_log_read() {
+    uint8_t buffer[(NUM_PAGES + 1) * FLASH_PAGE_SIZE];
+
+    // GIVEN a log which has wrapped around, with one entry buffered in RAM
+    reset_flash();
+    wifi_settings_event_log_init();
+    for (uint page = 0; page <= NUM_PAGES; page++) {
+        ASSERT(wifi_settings_event_log_flush() == PICO_OK);
+        add_events(1);
+    }
+    ASSERT(wifi_settings_event_log_get_num_pages() == (NUM_PAGES + 1));
+
+    // WHEN all pages are read
+    const uint count = wifi_settings_event_log_read_pages(0, buffer, NUM_PAGES + 10);
+    // THEN the pages are returned in order, beginning with the erased pages
+    // after the most recent page, and ending with the buffered entries
+    ASSERT(count == (NUM_PAGES + 1));
+    ASSERT(lock_level == 0);
+    uint32_t sequence = 0;
+    uint num_valid = 0;
+    for (uint i = 0; i < count; i++) {
+        const wifi_settings_event_log_header_t* header =
+            (const wifi_settings_event_log_header_t*) &buffer[i * FLASH_PAGE_SIZE];
+        if (i < (PAGES_PER_SECTOR - 1)) {
+            ASSERT(header->magic == 0xffffffff);
+            continue;
+        }
+        ASSERT(header->magic == WIFI_SETTINGS_EVENT_LOG_MAGIC);
+        if (num_valid != 0) {
+            ASSERT(header->sequence == (sequence + 1));
+        }
+        sequence = header->sequence;
+        num_valid++;
+    }
+    ASSERT(num_valid == (NUM_PAGES - PAGES_PER_SECTOR + 2));
+    ASSERT(sequence == (NUM_PAGES + 1));
+    const wifi_settings_event_log_entry_t* entry = (const wifi_settings_event_log_entry_t*)
+        &buffer[(NUM_PAGES * FLASH_PAGE_SIZE) + sizeof(wifi_settings_event_log_header_t)];
+    ASSERT(entry[0].event == WIFI_SETTINGS_EVENT_LOG_JOIN);
+    ASSERT(entry[1].event == WIFI_SETTINGS_EVENT_LOG_UNUSED);
+
+    // WHEN some pages are read, beginning part of the way through
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT(wifi_settings_event_log_read_pages(NUM_PAGES - 1, buffer, 1) == 1);
+    // THEN the requested page is returned (the most recent page in Flash)
+    ASSERT(((const wifi_settings_event_log_header_t*) buffer)->sequence == NUM_PAGES);
+    // AND nothing is returned after the end
+    ASSERT(wifi_settings_event_log_read_pages(NUM_PAGES + 1, buffer, 1) == 0);
+}
+
+int main() {
+    test_wifi_settings_event_log_buffer();
+    test_wifi_settings_event_log_reboot();
+    test_wifi_settings_event_log_wrap();
+    test_wifi_settings_event_log_read();
+    return 0;
+}
@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test for wifi_settings_flash_ab_storage.c, along with
+ * A/B storage support in wifi_settings_flash_storage_update.c
+ *
+ */
+
+#include "unit_test.h"
+
+#include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_flash_ab_storage.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
+#include "wifi_settings/wifi_settings_flash_storage_update.h"
+#include "wifi_settings/wifi_settings_flash_range.h"
+#include "hardware/flash.h"
+#include "pico/error.h"
+#include "pico/time.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// The two slots are next to each other by default
+#define MOCK_FLASH_START_ADDRESS (WIFI_SETTINGS_AB_STORAGE_ADDRESS)
+#define MOCK_FLASH_SIZE (WIFI_SETTINGS_FILE_SIZE * 2)
+#define MAX_FILE_SIZE (WIFI_SETTINGS_FILE_SIZE - FLASH_PAGE_SIZE)
+
+static char flash_fake[MOCK_FLASH_SIZE];
+static uint flash_erase_count;
+static uint flash_program_count;
+static uint flash_program_limit;
+static uint int_disable_level;
+
+static void reset_flash() {
+    memset(flash_fake, 0xff, sizeof(flash_fake));
+    flash_erase_count = 0;
+    flash_program_count = 0;
+    flash_program_limit = UINT32_MAX;
+    int_disable_level = 0;
+    wifi_settings_ab_reset_active_slot();
+}
+
+static char* get_slot_data(uint slot) {
+    wifi_settings_flash_range_t fr;
+    wifi_settings_ab_get_slot(slot, &fr);
+    ASSERT(fr.size == WIFI_SETTINGS_FILE_SIZE);
+    ASSERT(fr.start_address >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((fr.start_address + fr.size) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    return &flash_fake[fr.start_address - MOCK_FLASH_START_ADDRESS];
+}
+
+static wifi_settings_ab_footer_t* get_slot_footer(uint slot) {
+    return (wifi_settings_ab_footer_t*) &get_slot_data(slot)[MAX_FILE_SIZE];
+}
+
+// Mock implementation of save_and_disable_interrupts
+uint32_t save_and_disable_interrupts() {
+    int_disable_level++;
+    return 1234;
+}
+
+// Mock implementation of restore_interrupts
+void restore_interrupts(uint32_t flags) {
+    ASSERT(flags == 1234);
+    ASSERT(int_disable_level > 0);
+    int_disable_level--;
+}
+
+// Mock implementation of time_us_32
+uint32_t time_us_32() {
+    return 0;
+}
+
+// Mock implementation of flash_range_erase
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    flash_erase_count++;
+    ASSERT(flash_offs >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((flash_offs + count) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    ASSERT(count == FLASH_SECTOR_SIZE);
+    ASSERT(int_disable_level > 0);
+    memset(&flash_fake[flash_offs - MOCK_FLASH_START_ADDRESS], 0xff, count);
+}
+
+// Mock implementation of flash_range_program
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    ASSERT(flash_offs >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((flash_offs + count) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    ASSERT(count == FLASH_PAGE_SIZE);
+    ASSERT((flash_offs % FLASH_PAGE_SIZE) == 0);
+    ASSERT(int_disable_level > 0);
+    if (flash_program_count < flash_program_limit) {
+        // Programming only clears bits
+        for (uint i = 0; i < count; i++) {
+            flash_fake[flash_offs - MOCK_FLASH_START_ADDRESS + i] &= data[i];
+        }
+    }
+    flash_program_count++;
+}
+
+// Mock implementation of wifi_settings_flash_range_verify
+bool wifi_settings_flash_range_verify(
+            const wifi_settings_flash_range_t* fr,
+            const char* data) {
+    ASSERT(fr->start_address >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((fr->start_address + fr->size) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    ASSERT(int_disable_level == 0);
+    return memcmp(&flash_fake[fr->start_address - MOCK_FLASH_START_ADDRESS],
+            data, fr->size) == 0;
+}
+
+// Mock implementation of wifi_settings_range_translate_to_logical
+void wifi_settings_range_translate_to_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    ASSERT(fr->start_address >= MOCK_FLASH_START_ADDRESS);
+    ASSERT((fr->start_address + fr->size) <= (MOCK_FLASH_START_ADDRESS + MOCK_FLASH_SIZE));
+    lr->start_address = &flash_fake[fr->start_address - MOCK_FLASH_START_ADDRESS];
+    lr->size = fr->size;
+}
+
+// Mock implementation of wifi_settings_range_get_wifi_settings_file
+void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r) {
+    wifi_settings_ab_get_slot(wifi_settings_ab_get_active_slot(), r);
+    r->size -= FLASH_PAGE_SIZE;
+}
+
+// Mock implementation of wifi_settings_key_index_invalidate
+void wifi_settings_key_index_invalidate() {}
+
+// Mock implementation of wifi_settings_key_index_rebuild
+void wifi_settings_key_index_rebuild() {}
+
+// Mock implementations of the staged updates: nothing is ever staged
+int wifi_settings_staged_update_add(const char* key, const char* value, uint value_size) {
+    return PICO_ERROR_INSUFFICIENT_RESOURCES;
+}
+void wifi_settings_staged_update_get(const char** updates, uint* size) {
+    *updates = "";
+    *size = 0;
+}
+void wifi_settings_staged_update_clear() {}
+bool wifi_settings_staged_update_lock() {
+    return false;
+}
+void wifi_settings_staged_update_unlock(bool need_lock) {}
+absolute_time_t make_timeout_time_ms(const uint32_t ms) {
+    absolute_time_t t = {0};
+    return t;
+}
+bool time_reached(const absolute_time_t t) {
+    return true;
+}
+
+// Mock implementation of flash_safe_execute
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t) {
+    func(param);
+    return PICO_OK;
+}
+
+static void make_file(char* file, uint file_size, uint seed) {
+    for (uint i = 0; i < file_size; i++) {
+        file[i] = (char) ('a' + ((i + seed) % 26));
+    }
+}
+
+void test_wifi_settings_ab_storage_update() {
+    char file1[MAX_FILE_SIZE];
+    char file2[MAX_FILE_SIZE];
+    int ret;
+
+    // GIVEN blank flash
+    reset_flash();
+    // THEN slot 0 is used
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+
+    // WHEN a file is stored
+    make_file(file1, 100, 1);
+    ret = wifi_settings_update_flash_safe(file1, 100);
+    // THEN it is written to slot 1, which becomes active
+    ASSERT(ret == PICO_OK);
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+    ASSERT(memcmp(get_slot_data(1), file1, 100) == 0);
+    ASSERT(get_slot_data(1)[100] == '\xff');
+    ASSERT(get_slot_footer(1)->magic == WIFI_SETTINGS_AB_FOOTER_MAGIC);
+    ASSERT(get_slot_footer(1)->sequence == 1);
+    ASSERT(get_slot_footer(1)->file_size == 100);
+    // AND slot 1 is still active when the footers are checked again
+    wifi_settings_ab_reset_active_slot();
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+
+    // WHEN another file is stored
+    make_file(file2, MAX_FILE_SIZE, 2);
+    ret = wifi_settings_update_flash_safe(file2, MAX_FILE_SIZE);
+    // THEN it is written to slot 0, which becomes active, and slot 1 is unchanged
+    ASSERT(ret == PICO_OK);
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+    ASSERT(memcmp(get_slot_data(0), file2, MAX_FILE_SIZE) == 0);
+    ASSERT(get_slot_footer(0)->sequence == 2);
+    ASSERT(memcmp(get_slot_data(1), file1, 100) == 0);
+    wifi_settings_ab_reset_active_slot();
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+
+    // WHEN the update is interrupted before the footer is programmed
+    // (e.g. by a power failure)
+    const uint num_pages = (100 + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    flash_program_count = 0;
+    flash_program_limit = num_pages;
+    make_file(file1, 100, 3);
+    ret = wifi_settings_update_flash_safe(file1, 100);
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+    ASSERT(flash_program_count == (num_pages + 1));
+    // THEN the old file is still used
+    wifi_settings_ab_reset_active_slot();
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+    ASSERT(memcmp(get_slot_data(0), file2, MAX_FILE_SIZE) == 0);
+
+    // WHEN the update is interrupted before the file is completely programmed
+    flash_program_count = 0;
+    flash_program_limit = 0;
+    ret = wifi_settings_update_flash_safe(file1, 100);
+    // THEN the error is detected and the old file is still used
+    ASSERT(ret == PICO_ERROR_INVALID_DATA);
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+    wifi_settings_ab_reset_active_slot();
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+
+    // WHEN the update succeeds
+    flash_program_limit = UINT32_MAX;
+    ret = wifi_settings_update_flash_safe(file1, 100);
+    // THEN the sequence number continues from the active slot
+    ASSERT(ret == PICO_OK);
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+    ASSERT(get_slot_footer(1)->sequence == 3);
+
+    // WHEN a file which is too large is stored
+    flash_erase_count = 0;
+    ret = wifi_settings_update_flash_safe(file2, MAX_FILE_SIZE + 1);
+    // THEN nothing is changed
+    ASSERT(ret == PICO_ERROR_INVALID_ARG);
+    ASSERT(flash_erase_count == 0);
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+}
+
+void test_wifi_settings_ab_storage_active_slot() {
+    char file[MAX_FILE_SIZE];
+    wifi_settings_ab_footer_t footer;
+
+    // GIVEN a file stored without A/B storage in slot 0, and other data in slot 1
+    reset_flash();
+    make_file(get_slot_data(0), 200, 4);
+    make_file(get_slot_data(1), WIFI_SETTINGS_FILE_SIZE, 5);
+    // THEN slot 0 is used
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+
+    // WHEN a file is stored
+    make_file(file, 100, 6);
+    ASSERT(wifi_settings_update_flash_safe(file, 100) == PICO_OK);
+    // THEN it is written to slot 1, and slot 0 is unchanged
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+    ASSERT(get_slot_footer(1)->sequence == 1);
+    make_file(file, 200, 4);
+    ASSERT(memcmp(get_slot_data(0), file, 200) == 0);
+
+    // GIVEN two valid slots where the sequence number has wrapped around
+    for (uint slot = 0; slot < WIFI_SETTINGS_AB_NUM_SLOTS; slot++) {
+        make_file(get_slot_data(slot), 10, slot);
+        wifi_settings_ab_set_active_slot(1 - slot);
+        wifi_settings_ab_make_footer(get_slot_data(slot), 10, &footer);
+        footer.sequence = (slot == 0) ? UINT32_MAX : 0;
+        memcpy(get_slot_footer(slot), &footer, sizeof(footer));
+    }
+    wifi_settings_ab_reset_active_slot();
+    // THEN the slot with the more recent sequence number is used
+    ASSERT(wifi_settings_ab_get_active_slot() == 1);
+
+    // GIVEN a footer which does not match the file
+    get_slot_data(1)[5] ^= 1;
+    wifi_settings_ab_reset_active_slot();
+    // THEN the other slot is used
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+
+    // GIVEN a footer with an invalid size
+    get_slot_footer(0)->file_size = MAX_FILE_SIZE + 1;
+    wifi_settings_ab_reset_active_slot();
+    // THEN neither slot is valid, and slot 0 is used
+    ASSERT(wifi_settings_ab_get_active_slot() == 0);
+}
+
+int main() {
+    test_wifi_settings_ab_storage_update();
+    test_wifi_settings_ab_storage_active_slot();
+    return 0;
+}
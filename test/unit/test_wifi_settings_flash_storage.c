@@ -13,6 +13,7 @@
 #include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
 #include "hardware/flash.h"
+#include "pico/cyw43_arch.h"
 #include "pico/error.h"
 
 #include <stdio.h>
@@ -20,6 +21,33 @@
 #include <stdlib.h>
 
 static char file[WIFI_SETTINGS_FILE_SIZE + 2];
+static char other_file[WIFI_SETTINGS_FILE_SIZE];
+static char* file_location = file;
+static bool use_key_index = false;
+static bool use_multi_key_lookup = false;
+static uint lock_level = 0;
+
+// Find a key, either by scanning the file or by using the key index,
+// and with either wifi_settings_get_value_for_key or wifi_settings_get_values_for_keys
+static bool get_value_for_key(const char* key, char* value, uint* value_size) {
+    if (use_key_index) {
+        wifi_settings_key_index_rebuild();
+    } else {
+        wifi_settings_key_index_invalidate();
+    }
+    if (use_multi_key_lookup) {
+        wifi_settings_key_value_t item;
+        item.key = key;
+        item.value = value;
+        item.value_size = *value_size;
+        item.found = true;
+        const uint num_found = wifi_settings_get_values_for_keys(&item, 1);
+        ASSERT(num_found == (item.found ? 1 : 0));
+        *value_size = item.value_size;
+        return item.found;
+    }
+    return wifi_settings_get_value_for_key(key, value, value_size);
+}
 
 void test_wifi_settings_get_value_for_key() {
     char value[10];
@@ -37,7 +65,7 @@ void test_wifi_settings_get_value_for_key() {
         memcpy(&file[key_position[i]], key_value, strlen(key_value));
         // WHEN trying to find the key
         value_size = sizeof(value);
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN the key is found regardless of its position
         ASSERT(ret == true);
@@ -53,7 +81,7 @@ void test_wifi_settings_get_value_for_key() {
         memcpy(&file[j], key_value, WIFI_SETTINGS_FILE_SIZE - j);
         // WHEN trying to find the key
         value_size = sizeof(value);
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN only part of the value is found
         ASSERT(ret == true);
@@ -71,7 +99,7 @@ void test_wifi_settings_get_value_for_key() {
 
     // WHEN trying to find the key
     value_size = sizeof(value);
-    ret = wifi_settings_get_value_for_key
+    ret = get_value_for_key
         ("key", value, &value_size);
     // THEN only the correct value is found
     ASSERT(ret == true);
@@ -93,7 +121,7 @@ void test_wifi_settings_get_value_for_key() {
         // WHEN trying to find the key
         value_size = sizeof(value);
         memcpy(value, unused, sizeof(value));
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN nothing is found
         ASSERT(ret == false);
@@ -107,7 +135,7 @@ void test_wifi_settings_get_value_for_key() {
 
         // WHEN trying to find the key
         value_size = sizeof(value);
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN the value is correct
         ASSERT(ret == true);
@@ -120,7 +148,7 @@ void test_wifi_settings_get_value_for_key() {
     // WHEN trying to find the key
     value_size = sizeof(value);
     memcpy(value, unused, sizeof(value));
-    ret = wifi_settings_get_value_for_key
+    ret = get_value_for_key
         ("", value, &value_size);
     // THEN no value is found
     ASSERT(ret == false);
@@ -132,7 +160,7 @@ void test_wifi_settings_get_value_for_key() {
     // WHEN trying to find the key
     value_size = sizeof(value);
     memcpy(value, unused, sizeof(value));
-    ret = wifi_settings_get_value_for_key
+    ret = get_value_for_key
         ("k", value, &value_size);
     // THEN the value is exactly whatever follows the first =
     ASSERT(ret == true);
@@ -148,7 +176,7 @@ void test_wifi_settings_get_value_for_key() {
         // WHEN trying to find the key
         value_size = sizeof(value);
         memcpy(value, unused, sizeof(value));
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             (file, value, &value_size);
         // THEN no key is found
         ASSERT(ret == false);
@@ -162,7 +190,7 @@ void test_wifi_settings_get_value_for_key() {
         // WHEN trying to find the key
         value_size = i;
         memcpy(value, unused, sizeof(value));
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN the key is found and the value is truncated appropriately
         ASSERT(ret == true);
@@ -171,6 +199,41 @@ void test_wifi_settings_get_value_for_key() {
         ASSERT(value[i] == unused[0]);
     }
 
+    const char eol_type[] = {'\n', '\r'};
+    for (uint i = 0; i < 16; i++) {
+        for (uint j = 0; j < NUM_ELEMENTS(eol_type); j++) {
+            // GIVEN a long line of some length, containing control characters,
+            // followed by the key on the next line
+            memset(file, '\0', sizeof(file));
+            memset(file, '#', i + 20);
+            file[i + 3] = '\t';
+            file[i + 5] = '\x7f';
+            file[i + 20] = eol_type[j];
+            memcpy(&file[i + 21], key_value, strlen(key_value));
+            // WHEN trying to find the key
+            value_size = sizeof(value);
+            ret = get_value_for_key
+                ("key", value, &value_size);
+            // THEN the key is found, regardless of the position of the end of line
+            ASSERT(ret == true);
+            ASSERT(value_size == 5);
+            ASSERT(memcmp(value, "value", value_size) == 0);
+        }
+        for (uint j = 0; j < NUM_ELEMENTS(eof_type); j++) {
+            // GIVEN a long line of some length, followed by an EOF character and the key
+            memset(file, '\0', sizeof(file));
+            memset(file, '#', i + 20);
+            file[i + 20] = eof_type[j];
+            memcpy(&file[i + 21], "\nkey=value", 10);
+            // WHEN trying to find the key
+            value_size = sizeof(value);
+            ret = get_value_for_key
+                ("key", value, &value_size);
+            // THEN the key is not found, regardless of the position of the EOF
+            ASSERT(ret == false);
+        }
+    }
+
     const char blank_type[] = "\n\rk \xff";
     for (uint i = 0; i < NUM_ELEMENTS(blank_type); i++) {
         // GIVEN a blank file (filled with some blank character)
@@ -178,7 +241,7 @@ void test_wifi_settings_get_value_for_key() {
         // WHEN trying to find a key
         value_size = sizeof(value);
         memcpy(value, unused, sizeof(value));
-        ret = wifi_settings_get_value_for_key
+        ret = get_value_for_key
             ("key", value, &value_size);
         // THEN nothing is found
         ASSERT(ret == false);
@@ -188,6 +251,524 @@ void test_wifi_settings_get_value_for_key() {
 
 }
 
+void test_wifi_settings_key_index() {
+    char value[10];
+    char key[10];
+    bool ret;
+    uint value_size;
+
+    // GIVEN a file containing more keys than the index can hold,
+    // and the index has been built
+    const uint num_keys = WIFI_SETTINGS_KEY_INDEX_SIZE * 2;
+    uint index = 0;
+    memset(file, '\n', sizeof(file));
+    for (uint i = 0; i < num_keys; i++) {
+        index += snprintf(&file[index], sizeof(file) - index, "k%u=v%u\n", i, i);
+    }
+    wifi_settings_key_index_rebuild();
+    for (uint i = 0; i < num_keys; i++) {
+        // WHEN trying to find each key
+        snprintf(key, sizeof(key), "k%u", i);
+        value_size = sizeof(value);
+        ret = wifi_settings_get_value_for_key(key, value, &value_size);
+        // THEN every key is found (by scanning the file)
+        ASSERT(ret == true);
+        ASSERT(value_size == strlen(key));
+        ASSERT(value[0] == 'v');
+        ASSERT(memcmp(&value[1], &key[1], value_size - 1) == 0);
+    }
+
+    // GIVEN a file containing as many keys as the index can hold,
+    // some of which are repeated, and the index has been built
+    const uint num_unique_keys = (WIFI_SETTINGS_KEY_INDEX_SIZE * 3) / 4;
+    index = 0;
+    memset(file, '\n', sizeof(file));
+    for (uint i = 0; i < num_unique_keys; i++) {
+        index += snprintf(&file[index], sizeof(file) - index, "k%u=v%u\nk%u=x\n", i, i, i / 2);
+    }
+    wifi_settings_key_index_rebuild();
+    for (uint i = 0; i < num_unique_keys; i++) {
+        // WHEN trying to find each key
+        snprintf(key, sizeof(key), "k%u", i);
+        value_size = sizeof(value);
+        ret = wifi_settings_get_value_for_key(key, value, &value_size);
+        // THEN the first value for every key is found
+        ASSERT(ret == true);
+        ASSERT(value_size == strlen(key));
+        ASSERT(value[0] == 'v');
+        ASSERT(memcmp(&value[1], &key[1], value_size - 1) == 0);
+    }
+    // WHEN trying to find a key that isn't present
+    value_size = sizeof(value);
+    ret = wifi_settings_get_value_for_key("k", value, &value_size);
+    // THEN nothing is found
+    ASSERT(ret == false);
+    ASSERT(value_size == sizeof(value));
+
+    // GIVEN a key which contains '=' and the index has been built
+    snprintf(file, sizeof(file), "a=b=c\n");
+    wifi_settings_key_index_rebuild();
+    // WHEN trying to find the key
+    value_size = sizeof(value);
+    ret = wifi_settings_get_value_for_key("a=b", value, &value_size);
+    // THEN the value is found, as if the file was scanned
+    ASSERT(ret == true);
+    ASSERT(value_size == 1);
+    ASSERT(memcmp(value, "c", value_size) == 0);
+
+    // GIVEN an index that was built for a file in a different location
+    snprintf(file, sizeof(file), "key=old\n");
+    wifi_settings_key_index_rebuild();
+    snprintf(other_file, sizeof(other_file), "other=1\nkey=new\n");
+    file_location = other_file;
+    // WHEN trying to find a key
+    value_size = sizeof(value);
+    ret = wifi_settings_get_value_for_key("key", value, &value_size);
+    // THEN the index is not used and the value is found in the new location
+    ASSERT(ret == true);
+    ASSERT(value_size == 3);
+    ASSERT(memcmp(value, "new", value_size) == 0);
+    file_location = file;
+}
+
+void test_wifi_settings_get_value_pointer_for_key() {
+    const char* value = NULL;
+    uint value_size = 0;
+
+    for (uint mode = 0; mode < 2; mode++) {
+        // GIVEN a file containing a key, and the index is valid or invalid
+        snprintf(file, sizeof(file), "other=1\nupdate_secret=a long secret\r\nkey=\n");
+        const uint32_t generation = wifi_settings_get_file_generation();
+        if (mode == 0) {
+            wifi_settings_key_index_invalidate();
+        } else {
+            wifi_settings_key_index_rebuild();
+        }
+        // THEN the generation number changed
+        ASSERT(wifi_settings_get_file_generation() != generation);
+
+        // WHEN trying to find the key
+        ASSERT(wifi_settings_get_value_pointer_for_key("update_secret", &value, &value_size));
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+        // THEN the value is found in the copy of the file
+        ASSERT((value < file) || (value >= &file[sizeof(file)]));
+#else
+        // THEN the value is found in place
+        ASSERT(value == &file[22]);
+#endif
+        ASSERT(value_size == 13);
+        ASSERT(memcmp(value, "a long secret", value_size) == 0);
+
+        // WHEN trying to find a key with an empty value
+        ASSERT(wifi_settings_get_value_pointer_for_key("key", &value, &value_size));
+        // THEN the value is found
+        ASSERT(value_size == 0);
+
+        // WHEN trying to find a key which isn't present
+        value = NULL;
+        value_size = 99;
+        // THEN nothing is found
+        ASSERT(!wifi_settings_get_value_pointer_for_key("update", &value, &value_size));
+        ASSERT(!wifi_settings_get_value_pointer_for_key("", &value, &value_size));
+        ASSERT(value == NULL);
+        ASSERT(value_size == 99);
+    }
+}
+
+void test_wifi_settings_get_values_for_keys() {
+    char values[5][10];
+    wifi_settings_key_value_t items[5];
+    const char* keys[] = {"ssid1", "pass1", "bssid1", "x=y", "ssid2"};
+
+    for (uint mode = 0; mode < 2; mode++) {
+        // GIVEN a file containing some of the keys, one of them twice
+        snprintf(file, sizeof(file),
+            "# comment\n"
+            "pass1=secret\r\n"
+            "ssid1=MyHotspot\n"
+            "x=y=z\n"
+            "pass1=ignored\n");
+        if (mode == 0) {
+            wifi_settings_key_index_invalidate();
+        } else {
+            wifi_settings_key_index_rebuild();
+        }
+        for (uint i = 0; i < NUM_ELEMENTS(items); i++) {
+            items[i].key = keys[i];
+            items[i].value = values[i];
+            items[i].value_size = sizeof(values[i]);
+            items[i].found = true;
+        }
+
+        // WHEN trying to find all of the keys at once
+        const uint num_found = wifi_settings_get_values_for_keys(items, NUM_ELEMENTS(items));
+
+        // THEN the keys that are present are found, with their first values,
+        // and values are truncated to fit the buffer
+        ASSERT(num_found == 3);
+        ASSERT(items[0].found);
+        ASSERT(items[0].value_size == 9);
+        ASSERT(memcmp(items[0].value, "MyHotspot", 9) == 0);
+        ASSERT(items[1].found);
+        ASSERT(items[1].value_size == 6);
+        ASSERT(memcmp(items[1].value, "secret", 6) == 0);
+        ASSERT(!items[2].found);
+        ASSERT(items[2].value_size == sizeof(values[2]));
+        ASSERT(items[3].found);
+        ASSERT(items[3].value_size == 1);
+        ASSERT(memcmp(items[3].value, "z", 1) == 0);
+        ASSERT(!items[4].found);
+    }
+
+    // WHEN looking up no keys
+    // THEN nothing is found
+    ASSERT(wifi_settings_get_values_for_keys(items, 0) == 0);
+}
+
+// Build a binary settings file from keys and values, which must already be sorted
+static void make_binary_file(const char* const* keys, const char* const* values, uint num_keys) {
+    wifi_settings_binary_file_header_t header;
+    memset(file, 0xff, sizeof(file));
+    memcpy(header.magic, WIFI_SETTINGS_BINARY_FILE_MAGIC, sizeof(header.magic));
+    header.version = WIFI_SETTINGS_BINARY_FILE_VERSION;
+    header.num_keys = (uint16_t) num_keys;
+    memcpy(file, &header, sizeof(header));
+
+    uint data_offset = sizeof(header) + (num_keys * sizeof(wifi_settings_binary_file_entry_t));
+    for (uint i = 0; i < num_keys; i++) {
+        wifi_settings_binary_file_entry_t entry;
+        entry.key_offset = (uint16_t) data_offset;
+        entry.key_size = (uint16_t) strlen(keys[i]);
+        memcpy(&file[data_offset], keys[i], entry.key_size);
+        data_offset += entry.key_size;
+        entry.value_offset = (uint16_t) data_offset;
+        entry.value_size = (uint16_t) strlen(values[i]);
+        memcpy(&file[data_offset], values[i], entry.value_size);
+        data_offset += entry.value_size;
+        memcpy(&file[sizeof(header) + (i * sizeof(entry))], &entry, sizeof(entry));
+    }
+}
+
+void test_wifi_settings_binary_file() {
+    const char* keys[] = {"bssid1", "name", "pass1", "ssid1", "ssid10", "ssid2"};
+    const char* values[] = {"01:02:03:04:05:06", "", "secret", "MyHotspot", "Other", "x=y"};
+    char value[20];
+    uint value_size;
+
+    for (uint mode = 0; mode < 2; mode++) {
+        // GIVEN a binary file, and the index has been rebuilt or invalidated
+        make_binary_file(keys, values, NUM_ELEMENTS(keys));
+        if (mode == 0) {
+            wifi_settings_key_index_invalidate();
+        } else {
+            wifi_settings_key_index_rebuild();
+        }
+
+        // WHEN looking up each key
+        for (uint i = 0; i < NUM_ELEMENTS(keys); i++) {
+            value_size = sizeof(value);
+            // THEN the value is found
+            ASSERT(wifi_settings_get_value_for_key(keys[i], value, &value_size));
+            ASSERT(value_size == strlen(values[i]));
+            ASSERT(memcmp(value, values[i], value_size) == 0);
+        }
+
+        // WHEN looking up keys which are not present, including prefixes and extensions of keys
+        const char* missing[] = {"", "a", "bssid", "ssid", "ssid100", "ssid3", "z", "ssid2=x"};
+        for (uint i = 0; i < NUM_ELEMENTS(missing); i++) {
+            value_size = sizeof(value);
+            // THEN nothing is found
+            ASSERT(!wifi_settings_get_value_for_key(missing[i], value, &value_size));
+            ASSERT(value_size == sizeof(value));
+        }
+
+        // WHEN looking up a key without copying
+        const char* pointer = NULL;
+        ASSERT(wifi_settings_get_value_pointer_for_key("ssid10", &pointer, &value_size));
+        // THEN the value is found in place
+        ASSERT(value_size == 5);
+#if WIFI_SETTINGS_FILE_READ_MODE != 2
+        ASSERT(pointer > file);
+        ASSERT(pointer < &file[sizeof(file)]);
+#endif
+        ASSERT(memcmp(pointer, "Other", 5) == 0);
+
+        // WHEN looking up several keys at once
+        char values2[3][10];
+        wifi_settings_key_value_t items[3];
+        const char* keys2[] = {"ssid2", "ssid", "pass1"};
+        for (uint i = 0; i < NUM_ELEMENTS(items); i++) {
+            items[i].key = keys2[i];
+            items[i].value = values2[i];
+            items[i].value_size = sizeof(values2[i]);
+        }
+        // THEN the keys that are present are found
+        ASSERT(wifi_settings_get_values_for_keys(items, NUM_ELEMENTS(items)) == 2);
+        ASSERT(items[0].found);
+        ASSERT(items[0].value_size == 3);
+        ASSERT(memcmp(items[0].value, "x=y", 3) == 0);
+        ASSERT(!items[1].found);
+        ASSERT(items[2].found);
+        ASSERT(items[2].value_size == 6);
+        ASSERT(memcmp(items[2].value, "secret", 6) == 0);
+    }
+
+    // GIVEN a binary file with an empty directory
+    make_binary_file(keys, values, 0);
+    wifi_settings_key_index_rebuild();
+    // THEN nothing is found
+    value_size = sizeof(value);
+    ASSERT(!wifi_settings_get_value_for_key("ssid1", value, &value_size));
+
+    // GIVEN a binary file where the directory is larger than the file
+    make_binary_file(keys, values, NUM_ELEMENTS(keys));
+    file[6] = (char) 0xff;
+    file[7] = (char) 0xff;
+    wifi_settings_key_index_rebuild();
+    // THEN the file is treated as text, and nothing is found
+    value_size = sizeof(value);
+    ASSERT(!wifi_settings_get_value_for_key("ssid1", value, &value_size));
+
+    // GIVEN a binary file where a directory entry is corrupted
+    make_binary_file(keys, values, 1);
+    file[8] = (char) 0xff;
+    file[9] = (char) 0xff;
+    wifi_settings_key_index_rebuild();
+    // THEN nothing is found
+    value_size = sizeof(value);
+    ASSERT(!wifi_settings_get_value_for_key("bssid1", value, &value_size));
+
+    // GIVEN a text file beginning with the magic number
+    snprintf(file, sizeof(file), WIFI_SETTINGS_BINARY_FILE_MAGIC "=1\nssid1=Text\n");
+    wifi_settings_key_index_rebuild();
+    // THEN the file is treated as text
+    value_size = sizeof(value);
+    ASSERT(wifi_settings_get_value_for_key("ssid1", value, &value_size));
+    ASSERT(value_size == 4);
+    ASSERT(memcmp(value, "Text", 4) == 0);
+}
+
+static uint file_change_count[2];
+
+static void file_change_callback(void* arg) {
+    ASSERT(lock_level == 0);
+    file_change_count[(uintptr_t) arg]++;
+}
+
+void test_wifi_settings_file_change_subscribers() {
+    wifi_settings_file_change_subscriber_t subscriber[2];
+    for (uint i = 0; i < NUM_ELEMENTS(subscriber); i++) {
+        subscriber[i].callback = file_change_callback;
+        subscriber[i].arg = (void*) (uintptr_t) i;
+        file_change_count[i] = 0;
+    }
+
+    // GIVEN two subscribers, one added twice
+    wifi_settings_add_file_change_subscriber(&subscriber[0]);
+    wifi_settings_add_file_change_subscriber(&subscriber[1]);
+    wifi_settings_add_file_change_subscriber(&subscriber[0]);
+
+    // WHEN the index is invalidated
+    const uint32_t generation = wifi_settings_get_file_generation();
+    wifi_settings_key_index_invalidate();
+    // THEN the generation changes, but nobody is notified until the index is rebuilt
+    ASSERT(wifi_settings_get_file_generation() != generation);
+    ASSERT(file_change_count[0] == 0);
+    ASSERT(file_change_count[1] == 0);
+
+    // WHEN the index is rebuilt
+    wifi_settings_key_index_rebuild();
+    // THEN each subscriber is notified once
+    ASSERT(file_change_count[0] == 1);
+    ASSERT(file_change_count[1] == 1);
+
+    // WHEN a subscriber is removed and the index is rebuilt
+    wifi_settings_remove_file_change_subscriber(&subscriber[1]);
+    wifi_settings_remove_file_change_subscriber(&subscriber[1]);
+    wifi_settings_key_index_rebuild();
+    // THEN only the other subscriber is notified
+    ASSERT(file_change_count[0] == 2);
+    ASSERT(file_change_count[1] == 1);
+
+    // WHEN all subscribers are removed
+    wifi_settings_remove_file_change_subscriber(&subscriber[0]);
+    wifi_settings_key_index_rebuild();
+    // THEN nobody is notified
+    ASSERT(file_change_count[0] == 2);
+    ASSERT(file_change_count[1] == 1);
+}
+
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+void test_wifi_settings_staged_update() {
+    char value[10];
+    uint value_size;
+    const char* pointer = NULL;
+    const char* updates = NULL;
+    uint updates_size = 0;
+    wifi_settings_key_value_t items[3];
+    char values[3][10];
+    const char* keys[] = {"ssid1", "pass1", "ssid2"};
+    wifi_settings_file_change_subscriber_t subscriber;
+    subscriber.callback = file_change_callback;
+    subscriber.arg = (void*) (uintptr_t) 0;
+    file_change_count[0] = 0;
+
+    for (uint mode = 0; mode < 2; mode++) {
+        // GIVEN a file with some keys, and the index is valid or invalid
+        snprintf(file, sizeof(file), "ssid1=A\npass1=B\nssid2=C\n");
+        if (mode == 0) {
+            wifi_settings_key_index_invalidate();
+        } else {
+            wifi_settings_key_index_rebuild();
+        }
+        wifi_settings_add_file_change_subscriber(&subscriber);
+        file_change_count[0] = 0;
+
+        // WHEN changes are staged
+        const uint32_t generation = wifi_settings_get_file_generation();
+        ASSERT(wifi_settings_staged_update_add("pass1", "new", 3) == PICO_OK);
+        ASSERT(wifi_settings_staged_update_add("ssid2", NULL, 0) == PICO_OK);
+        ASSERT(wifi_settings_staged_update_add("ssid3", "D", 1) == PICO_OK);
+        // THEN the generation changes, and subscribers are notified
+        ASSERT(wifi_settings_get_file_generation() != generation);
+        ASSERT(file_change_count[0] == 3);
+        wifi_settings_remove_file_change_subscriber(&subscriber);
+
+        // AND the staged values are found instead of the values in the file
+        value_size = sizeof(value);
+        ASSERT(wifi_settings_get_value_for_key("pass1", value, &value_size));
+        ASSERT(value_size == 3);
+        ASSERT(memcmp(value, "new", value_size) == 0);
+        value_size = sizeof(value);
+        ASSERT(!wifi_settings_get_value_for_key("ssid2", value, &value_size));
+        ASSERT(wifi_settings_get_value_pointer_for_key("ssid3", &pointer, &value_size));
+        ASSERT(value_size == 1);
+        ASSERT(memcmp(pointer, "D", value_size) == 0);
+        ASSERT(!wifi_settings_get_value_pointer_for_key("ssid2", &pointer, &value_size));
+        // AND keys which were not changed are found in the file
+        value_size = sizeof(value);
+        ASSERT(wifi_settings_get_value_for_key("ssid1", value, &value_size));
+        ASSERT(value_size == 1);
+        ASSERT(memcmp(value, "A", value_size) == 0);
+        // AND keys which begin with a staged key are not affected
+        value_size = sizeof(value);
+        ASSERT(!wifi_settings_get_value_for_key("pass", value, &value_size));
+        ASSERT(!wifi_settings_get_value_for_key("ssid", value, &value_size));
+
+        // WHEN several keys are found at once
+        for (uint i = 0; i < NUM_ELEMENTS(items); i++) {
+            items[i].key = keys[i];
+            items[i].value = values[i];
+            items[i].value_size = sizeof(values[i]);
+            items[i].found = true;
+        }
+        // THEN the staged values are used
+        ASSERT(wifi_settings_get_values_for_keys(items, NUM_ELEMENTS(items)) == 2);
+        ASSERT(items[0].found);
+        ASSERT(items[0].value_size == 1);
+        ASSERT(memcmp(items[0].value, "A", 1) == 0);
+        ASSERT(items[1].found);
+        ASSERT(items[1].value_size == 3);
+        ASSERT(memcmp(items[1].value, "new", 3) == 0);
+        ASSERT(!items[2].found);
+        ASSERT(items[2].value_size == sizeof(values[2]));
+
+        // WHEN a change for a key is staged again
+        ASSERT(wifi_settings_staged_update_add("ssid2", "E", 1) == PICO_OK);
+        // THEN the earlier change is replaced
+        wifi_settings_staged_update_get(&updates, &updates_size);
+        ASSERT(updates_size == 26);
+        ASSERT(memcmp(updates, "pass1=new\nssid3=D\nssid2=E\n", updates_size) == 0);
+        value_size = sizeof(value);
+        ASSERT(wifi_settings_get_value_for_key("ssid2", value, &value_size));
+        ASSERT(value_size == 1);
+        ASSERT(memcmp(value, "E", value_size) == 0);
+
+        // WHEN the staged updates are cleared
+        wifi_settings_add_file_change_subscriber(&subscriber);
+        file_change_count[0] = 0;
+        wifi_settings_staged_update_clear();
+        wifi_settings_remove_file_change_subscriber(&subscriber);
+        // THEN subscribers are notified, and the values in the file are found again
+        ASSERT(file_change_count[0] == 1);
+        ASSERT(lock_level == 0);
+        wifi_settings_staged_update_get(&updates, &updates_size);
+        ASSERT(updates_size == 0);
+        value_size = sizeof(value);
+        ASSERT(wifi_settings_get_value_for_key("ssid2", value, &value_size));
+        ASSERT(value_size == 1);
+        ASSERT(memcmp(value, "C", value_size) == 0);
+    }
+
+    // WHEN a change would not fit
+    static char big_value[WIFI_SETTINGS_STAGED_UPDATE_SIZE];
+    memset(big_value, 'x', sizeof(big_value));
+    ASSERT(wifi_settings_staged_update_add("a", big_value, sizeof(big_value) - 2)
+            == PICO_ERROR_INSUFFICIENT_RESOURCES);
+    // THEN nothing is staged
+    wifi_settings_staged_update_get(&updates, &updates_size);
+    ASSERT(updates_size == 0);
+    // AND a change which exactly fits can be staged, and replaced by a smaller one
+    ASSERT(wifi_settings_staged_update_add("a", big_value, sizeof(big_value) - 3) == PICO_OK);
+    ASSERT(wifi_settings_staged_update_add("b", NULL, 0) == PICO_ERROR_INSUFFICIENT_RESOURCES);
+    ASSERT(wifi_settings_staged_update_add("a", NULL, 0) == PICO_OK);
+    wifi_settings_staged_update_get(&updates, &updates_size);
+    ASSERT(updates_size == 2);
+    wifi_settings_staged_update_clear();
+}
+#endif
+
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+void test_wifi_settings_file_copy() {
+    char value[10];
+    uint value_size;
+
+    // GIVEN a file which has been copied to RAM
+    snprintf(file, sizeof(file), "key=old\n");
+    wifi_settings_key_index_rebuild();
+
+    // WHEN the file is modified without rebuilding the index
+    snprintf(file, sizeof(file), "key=new\n");
+    value_size = sizeof(value);
+    // THEN the copy is still used
+    ASSERT(wifi_settings_get_value_for_key("key", value, &value_size));
+    ASSERT(value_size == 3);
+    ASSERT(memcmp(value, "old", value_size) == 0);
+
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    // WHEN a change is staged for another key
+    ASSERT(wifi_settings_staged_update_add("other", "1", 1) == PICO_OK);
+    value_size = sizeof(value);
+    // THEN the copy is still used, as the file in Flash did not change
+    ASSERT(wifi_settings_get_value_for_key("key", value, &value_size));
+    ASSERT(value_size == 3);
+    ASSERT(memcmp(value, "old", value_size) == 0);
+    wifi_settings_staged_update_clear();
+#endif
+
+    // WHEN the file generation changes
+    const uint32_t generation = wifi_settings_get_file_generation();
+    wifi_settings_key_index_invalidate();
+    value_size = sizeof(value);
+    // THEN the file is copied again
+    ASSERT(wifi_settings_get_value_for_key("key", value, &value_size));
+    ASSERT(value_size == 3);
+    ASSERT(memcmp(value, "new", value_size) == 0);
+    ASSERT(wifi_settings_get_file_generation() == (generation + 1));
+
+    // WHEN the file moves
+    snprintf(other_file, sizeof(other_file), "key=moved\n");
+    file_location = other_file;
+    value_size = sizeof(value);
+    // THEN the file is copied again, and the generation changes
+    ASSERT(wifi_settings_get_value_for_key("key", value, &value_size));
+    ASSERT(value_size == 5);
+    ASSERT(memcmp(value, "moved", value_size) == 0);
+    ASSERT(wifi_settings_get_file_generation() != (generation + 1));
+    file_location = file;
+}
+#endif
+
 // Mock implementation of wifi_settings_range_get_wifi_settings_file
 void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r) {
     r->start_address = 0x1234;
@@ -200,13 +781,100 @@ void wifi_settings_range_translate_to_logical(
         wifi_settings_logical_range_t* lr) {
     ASSERT(fr->start_address == 0x1234);
     ASSERT(fr->size == WIFI_SETTINGS_FILE_SIZE);
-    lr->start_address = file;
+    lr->start_address = file_location;
     lr->size = WIFI_SETTINGS_FILE_SIZE;
 }
 
+// Mock implementation of wifi_settings_range_translate_to_uncached_logical
+void wifi_settings_range_translate_to_uncached_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    wifi_settings_range_translate_to_logical(fr, lr);
+}
+
+// Mock implementation of cyw43_arch_async_context (cyw43_arch is initialised)
+async_context_t *cyw43_arch_async_context(void) {
+    static async_context_t context;
+    return &context;
+}
+
+// Mock implementation of cyw43_arch_lwip_begin
+void cyw43_arch_lwip_begin() {
+    lock_level++;
+}
+
+// Mock implementation of cyw43_arch_lwip_end
+void cyw43_arch_lwip_end() {
+    ASSERT(lock_level > 0);
+    lock_level--;
+}
 
 
+
+#ifdef TEST_GET_VALUE_FOR_KEY_OVERRIDE
+// The application's own storage, replacing the settings file
+bool wifi_settings_get_value_for_key(
+            const char* key, char* value, uint* value_size) {
+    if (strcmp(key, "ssid1") != 0) {
+        return false;
+    }
+    if (*value_size > 5) {
+        *value_size = 5;
+    }
+    memcpy(value, "Other", *value_size);
+    return true;
+}
+
+void test_wifi_settings_get_values_for_keys_override() {
+    // GIVEN a file containing the keys, and an application which reimplements
+    // wifi_settings_get_value_for_key, but not wifi_settings_get_values_for_keys
+    snprintf(file, sizeof(file), "ssid1=MyHotspot\npass1=secret\n");
+    wifi_settings_key_index_rebuild();
+    char values[2][10];
+    wifi_settings_key_value_t items[2];
+    const char* keys[] = {"ssid1", "pass1"};
+    for (uint i = 0; i < NUM_ELEMENTS(items); i++) {
+        items[i].key = keys[i];
+        items[i].value = values[i];
+        items[i].value_size = sizeof(values[i]);
+        items[i].found = true;
+    }
+
+    // WHEN trying to find the keys at once
+    const uint num_found = wifi_settings_get_values_for_keys(items, NUM_ELEMENTS(items));
+
+    // THEN the values come from the application's wifi_settings_get_value_for_key
+    ASSERT(num_found == 1);
+    ASSERT(items[0].found);
+    ASSERT(items[0].value_size == 5);
+    ASSERT(memcmp(items[0].value, "Other", 5) == 0);
+    ASSERT(!items[1].found);
+}
+
+int main() {
+    test_wifi_settings_get_values_for_keys_override();
+    return 0;
+}
+#else
 int main() {
     test_wifi_settings_get_value_for_key();
+    use_key_index = true;
+    test_wifi_settings_get_value_for_key();
+    use_multi_key_lookup = true;
+    test_wifi_settings_get_value_for_key();
+    use_key_index = false;
+    test_wifi_settings_get_value_for_key();
+    test_wifi_settings_key_index();
+    test_wifi_settings_get_values_for_keys();
+    test_wifi_settings_get_value_pointer_for_key();
+    test_wifi_settings_binary_file();
+    test_wifi_settings_file_change_subscribers();
+#if WIFI_SETTINGS_STAGED_UPDATE_SIZE > 0
+    test_wifi_settings_staged_update();
+#endif
+#if WIFI_SETTINGS_FILE_READ_MODE == 2
+    test_wifi_settings_file_copy();
+#endif
     return 0;
 }
+#endif
@@ -10,10 +10,12 @@
 #include "unit_test.h"
 
 #include "wifi_settings/wifi_settings_configuration.h"
+#include "wifi_settings/wifi_settings_flash_storage.h"
 #include "wifi_settings/wifi_settings_flash_storage_update.h"
 #include "wifi_settings/wifi_settings_flash_range.h"
 #include "hardware/flash.h"
 #include "pico/error.h"
+#include "pico/time.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -21,6 +23,10 @@
 
 #define MOCK_FILE_START_ADDRESS (PICO_FLASH_SIZE_BYTES - WIFI_SETTINGS_FILE_SIZE)
 #define MOCK_FILE_END_ADDRESS (PICO_FLASH_SIZE_BYTES)
+#define NUM_SECTORS (WIFI_SETTINGS_FILE_SIZE / FLASH_SECTOR_SIZE)
+#define PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define MOCK_ERASE_TIME_US 1000
+#define MOCK_PROGRAM_TIME_US 100
 
 
 static uint flash_erase_count;
@@ -30,6 +36,13 @@ static uint flash_program_error_at;
 static char flash_fake[WIFI_SETTINGS_FILE_SIZE];
 static uint int_disable_level;
 static uint int_disable_count;
+static uint key_index_invalidate_count;
+static uint key_index_rebuild_count;
+static uint32_t fake_time_us;
+static char staged_updates[64];
+static uint staged_updates_size;
+static uint staged_updates_clear_count;
+static uint staged_updates_lock_level;
 
 void reset_flash() {
     flash_erase_count = 0;
@@ -39,6 +52,74 @@ void reset_flash() {
     memset(flash_fake, 0xcc, sizeof(flash_fake));
     int_disable_level = 0;
     int_disable_count = 0;
+    key_index_invalidate_count = 0;
+    key_index_rebuild_count = 0;
+    fake_time_us = 0;
+    staged_updates_size = 0;
+    staged_updates_clear_count = 0;
+}
+
+// Mock implementation of time_us_32
+uint32_t time_us_32() {
+    return fake_time_us;
+}
+
+// Mock implementation of make_timeout_time_ms
+absolute_time_t make_timeout_time_ms(const uint32_t ms) {
+    absolute_time_t t;
+    t.value = fake_time_us + (ms * 1000);
+    return t;
+}
+
+// Mock implementation of time_reached
+bool time_reached(const absolute_time_t t) {
+    return (int32_t) (fake_time_us - t.value) >= 0;
+}
+
+// Mock implementation of wifi_settings_staged_update_add: changes are
+// added at the end, without replacing any earlier change for the key
+int wifi_settings_staged_update_add(const char* key, const char* value, uint value_size) {
+    const uint key_size = strlen(key);
+    const uint line_size = key_size + ((value != NULL) ? (1 + value_size) : 0) + 1;
+    if ((staged_updates_size + line_size) > sizeof(staged_updates)) {
+        return PICO_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    memcpy(&staged_updates[staged_updates_size], key, key_size);
+    staged_updates_size += key_size;
+    if (value != NULL) {
+        staged_updates[staged_updates_size++] = '=';
+        memcpy(&staged_updates[staged_updates_size], value, value_size);
+        staged_updates_size += value_size;
+    }
+    staged_updates[staged_updates_size++] = '\n';
+    return PICO_OK;
+}
+
+// Mock implementation of wifi_settings_staged_update_get
+void wifi_settings_staged_update_get(const char** updates, uint* size) {
+    *updates = staged_updates;
+    *size = staged_updates_size;
+}
+
+// Mock implementation of wifi_settings_staged_update_clear
+void wifi_settings_staged_update_clear() {
+    // The staged updates are flushed and cleared with the lock held
+    ASSERT(staged_updates_lock_level > 0);
+    staged_updates_size = 0;
+    staged_updates_clear_count++;
+}
+
+// Mock implementation of wifi_settings_staged_update_lock
+bool wifi_settings_staged_update_lock() {
+    staged_updates_lock_level++;
+    return true;
+}
+
+// Mock implementation of wifi_settings_staged_update_unlock
+void wifi_settings_staged_update_unlock(bool need_lock) {
+    ASSERT(need_lock);
+    ASSERT(staged_updates_lock_level > 0);
+    staged_updates_lock_level--;
 }
 
 // Mock implementation of save_and_disable_interrupts
@@ -58,10 +139,13 @@ void restore_interrupts(uint32_t flags) {
 // Mock implementation of flash_range_erase
 void flash_range_erase(uint32_t flash_offs, size_t count) {
     flash_erase_count++;
-    ASSERT(flash_offs == MOCK_FILE_START_ADDRESS);
-    ASSERT(count == WIFI_SETTINGS_FILE_SIZE);
+    ASSERT(flash_offs >= MOCK_FILE_START_ADDRESS);
+    ASSERT(flash_offs <= (MOCK_FILE_END_ADDRESS - FLASH_SECTOR_SIZE));
+    ASSERT(count == FLASH_SECTOR_SIZE);
+    ASSERT((flash_offs % FLASH_SECTOR_SIZE) == 0);
     ASSERT(int_disable_level > 0);
-    memset(flash_fake, 0xff, sizeof(flash_fake));
+    memset(&flash_fake[flash_offs - MOCK_FILE_START_ADDRESS], 0xff, count);
+    fake_time_us += MOCK_ERASE_TIME_US;
 }
 
 // Mock implementation of flash_range_program
@@ -74,6 +158,7 @@ void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
     ASSERT(int_disable_level > 0);
     memcpy(&flash_fake[flash_offs - MOCK_FILE_START_ADDRESS],
             data, count);
+    fake_time_us += MOCK_PROGRAM_TIME_US;
 }
 
 // Mock implementation of wifi_settings_flash_range_verify
@@ -87,8 +172,8 @@ bool wifi_settings_flash_range_verify(
     ASSERT((flash_offs + count) <= MOCK_FILE_END_ADDRESS);
     ASSERT(int_disable_level == 0);
     ASSERT(count <= WIFI_SETTINGS_FILE_SIZE);
-    if (flash_program_error_at < WIFI_SETTINGS_FILE_SIZE) {
-        // Deliberate error introduced immediately before the first verify
+    if ((flash_program_error_at < WIFI_SETTINGS_FILE_SIZE) && (flash_program_count > 0)) {
+        // Deliberate error introduced immediately before the first verify after programming
         flash_fake[flash_program_error_at] ^= 1;
         flash_program_error_at = WIFI_SETTINGS_FILE_SIZE;
     }
@@ -96,6 +181,18 @@ bool wifi_settings_flash_range_verify(
             data, count) == 0;
 }
 
+// Mock implementation of wifi_settings_key_index_invalidate
+void wifi_settings_key_index_invalidate() {
+    ASSERT(flash_erase_count == 0);
+    key_index_invalidate_count++;
+}
+
+// Mock implementation of wifi_settings_key_index_rebuild
+void wifi_settings_key_index_rebuild() {
+    ASSERT(int_disable_level == 0);
+    key_index_rebuild_count++;
+}
+
 // Mock implementation of flash_safe_execute
 int flash_safe_execute(void (*func)(void *), void *param, uint32_t) {
     func(param);
@@ -109,6 +206,16 @@ void wifi_settings_range_get_wifi_settings_file(wifi_settings_flash_range_t* r)
     wifi_settings_range_align_to_sector(r);
 }
 
+// Mock implementation of wifi_settings_range_translate_to_logical
+void wifi_settings_range_translate_to_logical(
+        const wifi_settings_flash_range_t* fr,
+        wifi_settings_logical_range_t* lr) {
+    ASSERT(fr->start_address == MOCK_FILE_START_ADDRESS);
+    ASSERT(fr->size == WIFI_SETTINGS_FILE_SIZE);
+    lr->start_address = flash_fake;
+    lr->size = fr->size;
+}
+
 // Mock implementation of wifi_settings_range_align_to_sector
 void wifi_settings_range_align_to_sector(wifi_settings_flash_range_t* r) {
     ASSERT(r->start_address == MOCK_FILE_START_ADDRESS);
@@ -139,18 +246,22 @@ void test_wifi_settings_update_flash() {
         ret = wifi_settings_update_flash_safe(file, test_file_sizes[i]);
         // THEN the flash programming process works correctly, with erase,
         // program and verify cycles, each with appropriate sizes and offsets,
-        // and the programming correctly writes the data with correct padding
+        // and the programming correctly writes the data with correct padding,
+        // and the key index is invalidated before erasing and rebuilt afterwards.
+        // Each sector differs from the new data, and this is detected by comparing the first page.
         fprintf(stderr, "i = %u ret = %d\n", i, ret);
         ASSERT(ret == PICO_OK);
-        ASSERT(flash_erase_count == 1);
+        ASSERT(flash_erase_count == NUM_SECTORS);
         ASSERT(int_disable_count > 0);
         ASSERT(int_disable_level == 0);
+        ASSERT(key_index_invalidate_count == 1);
+        ASSERT(key_index_rebuild_count == 1);
         uint num_blocks = (test_file_sizes[i] + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
         ASSERT(flash_program_count == num_blocks);
         if (test_file_sizes[i] == WIFI_SETTINGS_FILE_SIZE) {
-            ASSERT(flash_verify_count == 1); // no padding
+            ASSERT(flash_verify_count == (NUM_SECTORS + 1)); // no padding
         } else {
-            ASSERT(flash_verify_count == 2); // verifies padding too
+            ASSERT(flash_verify_count == (NUM_SECTORS + 2)); // verifies padding too
         }
         for (uint j = 0; j < test_file_sizes[i]; j++) {
             ASSERT(flash_fake[j] == file[j]);
@@ -173,7 +284,7 @@ void test_wifi_settings_update_flash() {
         ret = wifi_settings_update_flash_safe(file, test_file_size);
         // THEN the flash verify step detects the error
         ASSERT(ret == PICO_ERROR_INVALID_DATA);
-        ASSERT(flash_erase_count == 1);
+        ASSERT(flash_erase_count == NUM_SECTORS);
         ASSERT(int_disable_count > 0);
         ASSERT(int_disable_level == 0);
         ASSERT(flash_program_count == 2);
@@ -193,7 +304,331 @@ void test_wifi_settings_update_flash() {
     ASSERT(flash_verify_count == 0);
 }
 
+void test_wifi_settings_update_flash_incremental() {
+    int ret = PICO_ERROR_GENERIC;
+    char file[WIFI_SETTINGS_FILE_SIZE];
+    const uint test_file_size = WIFI_SETTINGS_FILE_SIZE - 13;
+
+    // GIVEN flash which already contains a file
+    reset_flash();
+    for (uint j = 0; j < test_file_size; j++) {
+        file[j] = (char) (1 + j);
+    }
+    ret = wifi_settings_update_flash_safe(file, test_file_size);
+    ASSERT(ret == PICO_OK);
+
+    // WHEN flash is programmed with the same file
+    flash_erase_count = flash_program_count = int_disable_count = 0;
+    ret = wifi_settings_update_flash_safe(file, test_file_size);
+    // THEN nothing is erased or programmed
+    ASSERT(ret == PICO_OK);
+    ASSERT(flash_erase_count == 0);
+    ASSERT(flash_program_count == 0);
+    ASSERT(int_disable_count == 0);
+
+    for (uint sector = 0; sector < NUM_SECTORS; sector++) {
+        // WHEN flash is programmed with a file which differs in one sector
+        const uint change_at = (sector * FLASH_SECTOR_SIZE) + FLASH_PAGE_SIZE + 1;
+        file[change_at] ^= 1;
+        flash_erase_count = flash_program_count = 0;
+        ret = wifi_settings_update_flash_safe(file, test_file_size);
+        // THEN only that sector is erased and reprogrammed
+        ASSERT(ret == PICO_OK);
+        ASSERT(flash_erase_count == 1);
+        ASSERT(flash_program_count == (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE));
+        ASSERT(memcmp(flash_fake, file, test_file_size) == 0);
+    }
+
+    // WHEN flash is programmed with a smaller file
+    flash_erase_count = flash_program_count = 0;
+    ret = wifi_settings_update_flash_safe(file, FLASH_PAGE_SIZE + 1);
+    // THEN pages that are only padding are not programmed,
+    // and sectors that are only padding are erased
+    ASSERT(ret == PICO_OK);
+    ASSERT(flash_erase_count == NUM_SECTORS);
+    ASSERT(flash_program_count == 2);
+    for (uint j = FLASH_PAGE_SIZE + 1; j < WIFI_SETTINGS_FILE_SIZE; j++) {
+        ASSERT(flash_fake[j] == '\xff');
+    }
+}
+
+void test_wifi_settings_update_flash_stats() {
+    char file[WIFI_SETTINGS_FILE_SIZE];
+    wifi_settings_flash_update_stats_t stats_before, stats_after;
+
+    // Number of pages expected to be programmed each time interrupts are disabled
+    const uint pages_per_window =
+        (WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US < MOCK_PROGRAM_TIME_US) ? 1 :
+        (WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US / MOCK_PROGRAM_TIME_US) < PAGES_PER_SECTOR ?
+        (WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US / MOCK_PROGRAM_TIME_US) : PAGES_PER_SECTOR;
+    const uint windows_per_sector = (PAGES_PER_SECTOR + pages_per_window - 1) / pages_per_window;
+
+    // GIVEN erased flash
+    reset_flash();
+    memset(flash_fake, 0xff, sizeof(flash_fake));
+    wifi_settings_get_flash_update_stats(&stats_before);
+
+    // WHEN a file filling the whole space is programmed
+    for (uint j = 0; j < WIFI_SETTINGS_FILE_SIZE; j++) {
+        file[j] = (char) j;
+    }
+    ASSERT(wifi_settings_update_flash_safe(file, WIFI_SETTINGS_FILE_SIZE) == PICO_OK);
+
+    // THEN the pages in each sector are programmed in groups, with interrupts
+    // re-enabled between each group and after each erase
+    ASSERT(memcmp(flash_fake, file, WIFI_SETTINGS_FILE_SIZE) == 0);
+    ASSERT(flash_erase_count == NUM_SECTORS);
+    ASSERT(flash_program_count == (NUM_SECTORS * PAGES_PER_SECTOR));
+    ASSERT(int_disable_count == (NUM_SECTORS * (1 + windows_per_sector)));
+    ASSERT(int_disable_level == 0);
+
+    // AND the longest times with interrupts disabled are recorded
+    wifi_settings_get_flash_update_stats(&stats_after);
+    ASSERT(stats_after.num_updates == (stats_before.num_updates + 1));
+    ASSERT(stats_after.max_erase_time_us == MOCK_ERASE_TIME_US);
+    ASSERT(stats_after.max_program_time_us == (pages_per_window * MOCK_PROGRAM_TIME_US));
+    ASSERT((stats_after.max_program_time_us <= WIFI_SETTINGS_FLASH_INTERRUPTS_OFF_LIMIT_US)
+        || (pages_per_window == 1));
+}
+
+static void set_file(const char* text) {
+    reset_flash();
+    ASSERT(wifi_settings_update_flash_safe(text, strlen(text)) == PICO_OK);
+    flash_erase_count = flash_program_count = flash_verify_count = 0;
+    key_index_rebuild_count = 0;
+}
+
+static bool file_is(const char* text) {
+    const uint size = strlen(text);
+    flash_erase_count = flash_program_count = flash_verify_count = 0;
+    return (memcmp(flash_fake, text, size) == 0) && (flash_fake[size] == '\xff');
+}
+
+void test_wifi_settings_set_value_for_key() {
+    // GIVEN a file with some keys, comments and Windows line endings
+    set_file("# comment\r\nssid1=A\r\npass1=B\r\nssid1=C\n");
+
+    // WHEN a key is set
+    ASSERT(wifi_settings_set_value_for_key("pass1", "new pass", 8) == PICO_OK);
+    // THEN the value is replaced in place, and the index is rebuilt
+    ASSERT(file_is("# comment\r\nssid1=A\r\npass1=new pass\r\nssid1=C\n"));
+    ASSERT(key_index_rebuild_count == 1);
+
+    // WHEN a key which appears twice is set
+    ASSERT(wifi_settings_set_value_for_key("ssid1", "D", 1) == PICO_OK);
+    // THEN the first line is replaced and the other line is removed
+    ASSERT(file_is("# comment\r\nssid1=D\r\npass1=new pass\r\n"));
+
+    // WHEN a new key is set, with a value that is not '\0'-terminated
+    ASSERT(wifi_settings_set_value_for_key("ssid2", "EFG", 2) == PICO_OK);
+    // THEN it is added at the end
+    ASSERT(file_is("# comment\r\nssid1=D\r\npass1=new pass\r\nssid2=EF\n"));
+
+    // WHEN a key is set to an empty value
+    ASSERT(wifi_settings_set_value_for_key("ssid", "", 0) == PICO_OK);
+    // THEN it is added; keys which only begin with the same characters are not affected
+    ASSERT(file_is("# comment\r\nssid1=D\r\npass1=new pass\r\nssid2=EF\nssid=\n"));
+
+    // WHEN a key is set to its current value
+    key_index_rebuild_count = 0;
+    ASSERT(wifi_settings_set_value_for_key("ssid1", "D", 1) == PICO_OK);
+    // THEN Flash is not updated
+    ASSERT(flash_erase_count == 0);
+    ASSERT(flash_program_count == 0);
+    ASSERT(key_index_rebuild_count == 0);
+
+    // GIVEN a file without a final line ending
+    set_file("a=1");
+    // WHEN a key is added
+    ASSERT(wifi_settings_set_value_for_key("b", "2", 1) == PICO_OK);
+    // THEN a line ending is added first
+    ASSERT(file_is("a=1\nb=2\n"));
+
+    // GIVEN an empty file
+    reset_flash();
+    memset(flash_fake, 0xff, sizeof(flash_fake));
+    // WHEN a key is added
+    ASSERT(wifi_settings_set_value_for_key("a", "1", 1) == PICO_OK);
+    // THEN it is the only line
+    ASSERT(file_is("a=1\n"));
+
+    // WHEN invalid keys or values are used
+    // THEN nothing is changed
+    ASSERT(wifi_settings_set_value_for_key("", "1", 1) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_set_value_for_key("a=b", "1", 1) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_set_value_for_key("a\n", "1", 1) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_set_value_for_key("a", "1\r", 2) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_set_value_for_key("a", "1\xff", 2) == PICO_ERROR_INVALID_ARG);
+    ASSERT(file_is("a=1\n"));
+    ASSERT(flash_erase_count == 0);
+
+    // WHEN the new file would be too large
+    static char big_value[WIFI_SETTINGS_FILE_SIZE];
+    memset(big_value, 'x', sizeof(big_value));
+    ASSERT(wifi_settings_set_value_for_key("b", big_value,
+            WIFI_SETTINGS_FILE_SIZE - 6) == PICO_ERROR_INVALID_ARG);
+    // THEN nothing is changed
+    ASSERT(file_is("a=1\n"));
+    ASSERT(flash_erase_count == 0);
+    // AND a value which exactly fits can be stored
+    ASSERT(wifi_settings_set_value_for_key("b", big_value,
+            WIFI_SETTINGS_FILE_SIZE - 7) == PICO_OK);
+    ASSERT(memcmp(flash_fake, "a=1\nb=xxx", 9) == 0);
+    ASSERT(flash_fake[WIFI_SETTINGS_FILE_SIZE - 1] == '\n');
+
+    // GIVEN a pre-compiled binary file
+    set_file(WIFI_SETTINGS_BINARY_FILE_MAGIC "\x01\x00\x00\x00");
+    // THEN it can't be edited
+    ASSERT(wifi_settings_set_value_for_key("a", "1", 1) == PICO_ERROR_INVALID_DATA);
+    ASSERT(flash_erase_count == 0);
+}
+
+void test_wifi_settings_delete_key() {
+    // GIVEN a file with some keys
+    set_file("ssid1=A\npass1=B\r\nssid1=C\nssid10=D");
+
+    // WHEN a key is deleted
+    ASSERT(wifi_settings_delete_key("ssid1") == PICO_OK);
+    // THEN every line for the key is removed
+    ASSERT(file_is("pass1=B\r\nssid10=D"));
+    ASSERT(key_index_rebuild_count == 1);
+
+    // WHEN a key which is not present is deleted
+    key_index_rebuild_count = 0;
+    ASSERT(wifi_settings_delete_key("ssid2") == PICO_OK);
+    // THEN Flash is not updated
+    ASSERT(flash_erase_count == 0);
+    ASSERT(key_index_rebuild_count == 0);
+
+    // WHEN the last keys are deleted
+    ASSERT(wifi_settings_delete_key("ssid10") == PICO_OK);
+    ASSERT(file_is("pass1=B\r\n"));
+    ASSERT(wifi_settings_delete_key("pass1") == PICO_OK);
+    // THEN the file is empty
+    ASSERT(file_is(""));
+
+    // WHEN an invalid key is deleted
+    ASSERT(wifi_settings_delete_key("") == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_delete_key("a=") == PICO_ERROR_INVALID_ARG);
+}
+
+void test_wifi_settings_stage_value_for_key() {
+    // GIVEN a file with some keys
+    set_file("ssid1=A\npass1=B\n");
+
+    // WHEN several changes are staged
+    ASSERT(wifi_settings_stage_value_for_key("ssid1", "C", 1) == PICO_OK);
+    ASSERT(wifi_settings_stage_value_for_key("pass2", "DE", 2) == PICO_OK);
+    ASSERT(wifi_settings_stage_delete_key("pass1") == PICO_OK);
+    ASSERT(wifi_settings_stage_value_for_key("ssid1", "F", 1) == PICO_OK);
+    // THEN Flash is not updated yet
+    ASSERT(wifi_settings_has_staged_updates());
+    ASSERT(file_is("ssid1=A\npass1=B\n"));
+    ASSERT(key_index_rebuild_count == 0);
+
+    // WHEN the periodic function is called before the delay has passed
+    fake_time_us += (WIFI_SETTINGS_STAGED_UPDATE_DELAY_MS * 1000) - 1;
+    wifi_settings_staged_updates_periodic();
+    // THEN Flash is not updated yet
+    ASSERT(file_is("ssid1=A\npass1=B\n"));
+
+    // WHEN the delay has passed since the last change
+    fake_time_us++;
+    wifi_settings_staged_updates_periodic();
+    // THEN all of the changes are written at once, in order
+    ASSERT(file_is("ssid1=F\npass2=DE\n"));
+    ASSERT(key_index_rebuild_count == 1);
+    ASSERT(staged_updates_clear_count == 1);
+    ASSERT(staged_updates_lock_level == 0);
+    ASSERT(!wifi_settings_has_staged_updates());
+
+    // WHEN there are no staged changes
+    set_file("a=1\n");
+    wifi_settings_staged_updates_periodic();
+    // THEN nothing is written
+    ASSERT(wifi_settings_flush_staged_updates() == PICO_OK);
+    ASSERT(key_index_rebuild_count == 0);
+
+    // WHEN a staged change is flushed explicitly, and it doesn't change the file
+    ASSERT(wifi_settings_stage_value_for_key("a", "1", 1) == PICO_OK);
+    ASSERT(wifi_settings_flush_staged_updates() == PICO_OK);
+    // THEN Flash is not updated
+    ASSERT(key_index_rebuild_count == 0);
+    ASSERT(flash_erase_count == 0);
+    ASSERT(!wifi_settings_has_staged_updates());
+
+    // WHEN a key is set immediately while a change is staged
+    ASSERT(wifi_settings_stage_value_for_key("b", "2", 1) == PICO_OK);
+    ASSERT(wifi_settings_set_value_for_key("c", "3", 1) == PICO_OK);
+    // THEN both changes are written at once
+    ASSERT(file_is("a=1\nb=2\nc=3\n"));
+    ASSERT(key_index_rebuild_count == 1);
+    ASSERT(!wifi_settings_has_staged_updates());
+
+    // WHEN there is not enough space to stage a change
+    static char big_value[WIFI_SETTINGS_FILE_SIZE];
+    memset(big_value, 'x', sizeof(big_value));
+    set_file("a=1\n");
+    ASSERT(wifi_settings_stage_value_for_key("b", big_value, 40) == PICO_OK);
+    ASSERT(wifi_settings_stage_value_for_key("c", big_value, 40) == PICO_OK);
+    // THEN the earlier changes are written first
+    ASSERT(key_index_rebuild_count == 1);
+    ASSERT(memcmp(flash_fake, "a=1\nb=xxx", 9) == 0);
+    ASSERT(flash_fake[4 + 43] == '\xff');
+    ASSERT(wifi_settings_has_staged_updates());
+
+    // WHEN a change is too large to be staged at all
+    set_file("a=1\n");
+    ASSERT(wifi_settings_stage_value_for_key("d", big_value, 100) == PICO_OK);
+    // THEN it is written immediately
+    ASSERT(key_index_rebuild_count == 1);
+    ASSERT(!wifi_settings_has_staged_updates());
+    ASSERT(memcmp(flash_fake, "a=1\nd=xxx", 9) == 0);
+    ASSERT(flash_fake[4 + 103] == '\xff');
+
+    // WHEN invalid keys or values are staged
+    // THEN nothing is staged
+    ASSERT(wifi_settings_stage_value_for_key("", "1", 1) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_stage_value_for_key("a=b", "1", 1) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_stage_value_for_key("a", "1\n", 2) == PICO_ERROR_INVALID_ARG);
+    ASSERT(wifi_settings_stage_delete_key("a\r") == PICO_ERROR_INVALID_ARG);
+    ASSERT(!wifi_settings_has_staged_updates());
+
+    // GIVEN a file which is almost full
+    reset_flash();
+    memset(flash_fake, 0xff, sizeof(flash_fake));
+    big_value[0] = 'a';
+    big_value[1] = '=';
+    big_value[WIFI_SETTINGS_FILE_SIZE - 9] = '\n';
+    ASSERT(wifi_settings_update_flash_safe(big_value, WIFI_SETTINGS_FILE_SIZE - 8) == PICO_OK);
+    key_index_rebuild_count = 0;
+    // WHEN the staged changes would make the file too large
+    ASSERT(wifi_settings_stage_value_for_key("b", "1234567", 7) == PICO_OK);
+    ASSERT(wifi_settings_flush_staged_updates() == PICO_ERROR_INVALID_ARG);
+    // THEN the changes are discarded, and nothing is written
+    ASSERT(!wifi_settings_has_staged_updates());
+    ASSERT(key_index_rebuild_count == 0);
+    ASSERT(flash_fake[WIFI_SETTINGS_FILE_SIZE - 8] == '\xff');
+
+    // GIVEN a pre-compiled binary file
+    set_file(WIFI_SETTINGS_BINARY_FILE_MAGIC "\x01\x00\x00\x00");
+    // THEN changes can't be staged
+    ASSERT(wifi_settings_stage_value_for_key("a", "1", 1) == PICO_ERROR_INVALID_DATA);
+    ASSERT(!wifi_settings_has_staged_updates());
+    // AND changes staged before the file was replaced are discarded
+    memcpy(staged_updates, "a=1\n", 4);
+    staged_updates_size = 4;
+    ASSERT(wifi_settings_flush_staged_updates() == PICO_ERROR_INVALID_DATA);
+    ASSERT(!wifi_settings_has_staged_updates());
+    ASSERT(flash_erase_count == 0);
+}
+
 int main() {
     test_wifi_settings_update_flash();
+    test_wifi_settings_update_flash_incremental();
+    test_wifi_settings_update_flash_stats();
+    test_wifi_settings_set_value_for_key();
+    test_wifi_settings_delete_key();
+    test_wifi_settings_stage_value_for_key();
     return 0;
 }
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2025 Jack Whitham
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Test for wifi_settings_profile.c
+ *
+ */
+
+#include "unit_test.h"
+
+#include "wifi_settings/wifi_settings_profile.h"
+#include "pico/time.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static uint32_t g_time_us = 0;
+
+uint32_t time_us_32(void) {
+    return g_time_us;
+}
+
+static void run(wifi_settings_profile_id_t id, uint32_t time_us) {
+    WIFI_SETTINGS_PROFILE_START(profile_start);
+    g_time_us += time_us;
+    WIFI_SETTINGS_PROFILE_STOP(id, profile_start);
+}
+
+void test_wifi_settings_profile_counters() {
+    wifi_settings_profile_counter_t counter;
+
+    // GIVEN no profiled code has run
+    wifi_settings_profile_reset();
+    // WHEN a counter is read
+    wifi_settings_profile_get(WIFI_SETTINGS_PROFILE_HMAC, &counter);
+    // THEN it is zero
+    ASSERT(counter.count == 0);
+    ASSERT(counter.total_time == 0);
+    ASSERT(counter.max_time == 0);
+
+    // GIVEN code runs three times, and the timer wraps during the final run
+    run(WIFI_SETTINGS_PROFILE_HMAC, 10);
+    run(WIFI_SETTINGS_PROFILE_HMAC, 30);
+    g_time_us = 0xfffffff0;
+    run(WIFI_SETTINGS_PROFILE_HMAC, 20);
+    // WHEN the counter is read
+    wifi_settings_profile_get(WIFI_SETTINGS_PROFILE_HMAC, &counter);
+    // THEN the count, total and maximum are correct
+    ASSERT(counter.count == 3);
+    ASSERT(counter.total_time == 60);
+    ASSERT(counter.max_time == 30);
+    // AND the other counters are unaffected
+    wifi_settings_profile_get(WIFI_SETTINGS_PROFILE_FILE_SEARCH, &counter);
+    ASSERT(counter.count == 0);
+
+    // GIVEN an invalid counter id
+    memset(&counter, 0xaa, sizeof(counter));
+    // WHEN it is read
+    wifi_settings_profile_get(WIFI_SETTINGS_PROFILE_NUM_COUNTERS, &counter);
+    // THEN the result is zero
+    ASSERT(counter.count == 0);
+    ASSERT(counter.total_time == 0);
+    ASSERT(counter.max_time == 0);
+    ASSERT(strcmp(wifi_settings_profile_get_name(WIFI_SETTINGS_PROFILE_NUM_COUNTERS), "?") == 0);
+
+    // GIVEN the counters are reset
+    wifi_settings_profile_reset();
+    // WHEN the counter is read
+    wifi_settings_profile_get(WIFI_SETTINGS_PROFILE_HMAC, &counter);
+    // THEN it is zero again
+    ASSERT(counter.count == 0);
+    ASSERT(counter.total_time == 0);
+}
+
+void test_wifi_settings_profile_text() {
+    char text[512];
+
+    // GIVEN one counter has been used
+    wifi_settings_profile_reset();
+    run(WIFI_SETTINGS_PROFILE_FILE_SEARCH, 5);
+    run(WIFI_SETTINGS_PROFILE_FILE_SEARCH, 7);
+    // WHEN the text report is produced
+    const int size = wifi_settings_profile_get_text(text, sizeof(text));
+    // THEN there is one line per counter, in microseconds
+    ASSERT(size == (int) strlen(text));
+    ASSERT(strcmp(wifi_settings_profile_get_unit(), "us") == 0);
+    ASSERT(strncmp(text, "file_search count=2 total=12 max=7\n"
+                         "scan_callback count=0 total=0 max=0\n", 71) == 0);
+    ASSERT(strstr(text, "interrupts_off count=0 total=0 max=0\n") != NULL);
+    uint num_lines = 0;
+    for (int i = 0; i < size; i++) {
+        num_lines += (text[i] == '\n') ? 1 : 0;
+    }
+    ASSERT(num_lines == WIFI_SETTINGS_PROFILE_NUM_COUNTERS);
+
+    // GIVEN a small buffer
+    char small[16];
+    // WHEN the text report is produced
+    const int small_size = wifi_settings_profile_get_text(small, sizeof(small));
+    // THEN the text is truncated, and the return value is larger than the buffer
+    ASSERT(small_size >= (int) sizeof(small));
+    ASSERT(strlen(small) == (sizeof(small) - 1));
+    ASSERT(strncmp(small, text, sizeof(small) - 1) == 0);
+}
+
+int main() {
+    test_wifi_settings_profile_counters();
+    test_wifi_settings_profile_text();
+    return 0;
+}